@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Gets the bucket for a value.
+ *
+ * @param value The value
+ * @return The bucket index.
+ */
+static size_t hist_bucket(uint64_t value);
+
+/**
+ * @brief Gets the largest value that falls in a bucket.
+ *
+ * @param index The bucket index
+ * @return The value.
+ */
+static uint64_t hist_upper(size_t index);
+
+//------------------------------------------------------------------------------
+// Histogram
+//------------------------------------------------------------------------------
+
+bench_hist* bench_hist_new()
+{
+    bench_hist* h = calloc(1, sizeof(bench_hist));
+    h->min        = UINT64_MAX;
+
+    return h;
+}
+
+void bench_hist_reset(bench_hist* h)
+{
+    memset(h, 0, sizeof(bench_hist));
+    h->min = UINT64_MAX;
+}
+
+void bench_hist_record(bench_hist* h, uint64_t value)
+{
+    h->buckets[hist_bucket(value)]++;
+    h->count++;
+    h->sum += value;
+
+    if (value < h->min)
+    {
+        h->min = value;
+    }
+
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+void bench_hist_merge(bench_hist* to, const bench_hist* from)
+{
+    to->count += from->count;
+    to->sum   += from->sum;
+
+    if (from->min < to->min)
+    {
+        to->min = from->min;
+    }
+
+    if (from->max > to->max)
+    {
+        to->max = from->max;
+    }
+
+    for (size_t i = 0; i < BENCH_HIST_BUCKETS; i++)
+    {
+        to->buckets[i] += from->buckets[i];
+    }
+}
+
+uint64_t bench_hist_percentile(const bench_hist* h, double p)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+
+    // The rank of the value we want, counting from 1
+    uint64_t rank = (uint64_t)((p / 100.0) * (double)h->count + 0.5);
+
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < BENCH_HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+
+        if (seen >= rank)
+        {
+            uint64_t upper = hist_upper(i);
+            return (upper < h->max) ? upper : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+void bench_hist_print(const char* name, const bench_hist* h)
+{
+    if (h->count == 0)
+    {
+        printf("%-12s no samples\n", name);
+        return;
+    }
+
+    printf( "%-12s n=%llu mean=%.1f p50=%.1f p99=%.1f p999=%.1f "
+            "max=%.1f us\n",
+            name,
+            (unsigned long long)h->count,
+            (double)h->sum / h->count / 1000.0,
+            bench_hist_percentile(h, 50) / 1000.0,
+            bench_hist_percentile(h, 99) / 1000.0,
+            bench_hist_percentile(h, 99.9) / 1000.0,
+            h->max / 1000.0 );
+}
+
+size_t hist_bucket(uint64_t value)
+{
+    if (value < BENCH_HIST_SUB)
+    {
+        return (size_t)value;
+    }
+
+    // The top bit picks the power of two, the five below it the sub-bucket
+    int top      = 63 - __builtin_clzll(value);
+    size_t index = (size_t)(top - 4) * BENCH_HIST_SUB
+                 + ((value >> (top - 5)) & (BENCH_HIST_SUB - 1));
+
+    if (index >= BENCH_HIST_BUCKETS)
+    {
+        index = BENCH_HIST_BUCKETS - 1;
+    }
+
+    return index;
+}
+
+uint64_t hist_upper(size_t index)
+{
+    if (index < BENCH_HIST_SUB)
+    {
+        return index;
+    }
+
+    int top      = (int)(index / BENCH_HIST_SUB) + 4;
+    uint64_t sub = index % BENCH_HIST_SUB;
+
+    return ((BENCH_HIST_SUB + sub + 1) << (top - 5)) - 1;
+}
+
+//------------------------------------------------------------------------------
+// Time
+//------------------------------------------------------------------------------
+
+uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,100 @@
+#ifndef VWS_BENCH_DECLARE
+#define VWS_BENCH_DECLARE
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file bench.h
+ * @brief Common code for the benchmark programs
+ *
+ * Latency histograms are log-linear: values below BENCH_HIST_SUB nanoseconds
+ * get a bucket each, and every power of two above that is split into
+ * BENCH_HIST_SUB buckets. Percentiles are reported as the top of their
+ * bucket, so they overstate by at most 1/BENCH_HIST_SUB (about 3%).
+ */
+
+/**< Sub-buckets per power of two */
+#define BENCH_HIST_SUB 32
+
+/**< Buckets in a histogram, enough for values up to 2^48 ns (3 days) */
+#define BENCH_HIST_BUCKETS ((48 - 4 + 1) * BENCH_HIST_SUB)
+
+/**
+ * @brief A latency histogram, in nanoseconds
+ */
+typedef struct bench_hist
+{
+    /**< Values recorded */
+    uint64_t count;
+
+    /**< Sum of the values */
+    uint64_t sum;
+
+    /**< Smallest value */
+    uint64_t min;
+
+    /**< Largest value */
+    uint64_t max;
+
+    /**< Count of values in each bucket */
+    uint64_t buckets[BENCH_HIST_BUCKETS];
+
+} bench_hist;
+
+/**
+ * @brief Allocates an empty histogram.
+ *
+ * @return The histogram. Free it with free().
+ */
+bench_hist* bench_hist_new();
+
+/**
+ * @brief Empties a histogram.
+ *
+ * @param h The histogram
+ */
+void bench_hist_reset(bench_hist* h);
+
+/**
+ * @brief Records a value.
+ *
+ * @param h The histogram
+ * @param value The value
+ */
+void bench_hist_record(bench_hist* h, uint64_t value);
+
+/**
+ * @brief Adds one histogram into another.
+ *
+ * @param to The total
+ * @param from The histogram to add
+ */
+void bench_hist_merge(bench_hist* to, const bench_hist* from);
+
+/**
+ * @brief Estimates a percentile.
+ *
+ * @param h The histogram
+ * @param p The percentile, from 0 to 100
+ * @return The value, or 0 if the histogram is empty.
+ */
+uint64_t bench_hist_percentile(const bench_hist* h, double p);
+
+/**
+ * @brief Prints a line with the count, mean and usual percentiles, in
+ * microseconds.
+ *
+ * @param name What was measured
+ * @param h The histogram
+ */
+void bench_hist_print(const char* name, const bench_hist* h);
+
+/**
+ * @brief Gets the monotonic clock time.
+ *
+ * @return The time in nanoseconds.
+ */
+uint64_t bench_now();
+
+#endif /* VWS_BENCH_DECLARE */
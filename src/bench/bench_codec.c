@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "websocket.h"
+#include "message.h"
+#include "http_message.h"
+
+#include "bench.h"
+
+/**
+ * @file bench_codec.c
+ * @brief Microbenchmarks for the codec kernels
+ *
+ * Times the frame, message and HTTP codecs, masking, the accept key and
+ * buffer append/drain over a range of payload sizes. Each case reports the
+ * time and the number of allocations per operation. Allocations are counted
+ * by hooking vws.malloc, vws.calloc and vws.realloc, so they cover everything
+ * the library allocates itself.
+ *
+ *   bench_codec [-f filter] [-s size] [-t milliseconds]
+ *
+ * A case runs until it has taken at least the given time (100 ms by default).
+ * The filter selects the cases whose names contain it.
+ */
+
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+
+typedef struct
+{
+    /**< Only run cases whose names contain this */
+    cstr filter;
+
+    /**< Only run this payload size, if not 0 */
+    size_t size;
+
+    /**< The minimum time to run each case for, in nanoseconds */
+    uint64_t time;
+
+} bench_options;
+
+static bench_options opts =
+{
+    .filter = NULL,
+    .size   = 0,
+    .time   = 100 * 1000 * 1000
+};
+
+// Payload sizes covering each frame length encoding
+static size_t sizes[] = { 16, 125, 1024, 16 * 1024, 64 * 1024, 1024 * 1024 };
+
+//------------------------------------------------------------------------------
+// Allocation counting
+//------------------------------------------------------------------------------
+
+// The benchmarks are single threaded, so a plain counter does.
+static uint64_t allocs = 0;
+
+static vws_malloc_cb  next_malloc;
+static vws_calloc_cb  next_calloc;
+static vws_realloc_cb next_realloc;
+
+static void* count_malloc(size_t size)
+{
+    allocs++;
+    return next_malloc(size);
+}
+
+static void* count_calloc(size_t nmemb, size_t size)
+{
+    allocs++;
+    return next_calloc(nmemb, size);
+}
+
+static void* count_realloc(void* ptr, size_t size)
+{
+    allocs++;
+    return next_realloc(ptr, size);
+}
+
+static void count_allocations()
+{
+    next_malloc  = vws.malloc;
+    next_calloc  = vws.calloc;
+    next_realloc = vws.realloc;
+
+    vws.malloc   = count_malloc;
+    vws.calloc   = count_calloc;
+    vws.realloc  = count_realloc;
+}
+
+//------------------------------------------------------------------------------
+// Runner
+//------------------------------------------------------------------------------
+
+// State shared by the cases. Setup builds what an operation consumes.
+typedef struct
+{
+    /**< Payload of the current size */
+    unsigned char* payload;
+
+    /**< Output for masking */
+    unsigned char* out;
+
+    /**< Payload size */
+    size_t size;
+
+    /**< Serialized input for the decoding cases */
+    vws_buffer* input;
+
+    /**< Scratch buffer */
+    vws_buffer* buffer;
+
+} bench_state;
+
+typedef void (*bench_op)(bench_state* s);
+
+typedef struct
+{
+    /**< Case name */
+    cstr name;
+
+    /**< Prepares s->input for this size (may be NULL) */
+    bench_op setup;
+
+    /**< One operation */
+    bench_op op;
+
+    /**< Set if the case does not depend on the payload size */
+    bool fixed;
+
+} bench_case;
+
+// Runs op n times and returns the elapsed nanoseconds
+static uint64_t run_n(bench_op op, bench_state* s, uint64_t n)
+{
+    uint64_t began = bench_now();
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        op(s);
+    }
+
+    return bench_now() - began;
+}
+
+static void run_case(const bench_case* c, bench_state* s)
+{
+    if (c->setup != NULL)
+    {
+        c->setup(s);
+    }
+
+    // Warm up, then double the count until a run takes long enough
+    run_n(c->op, s, 1);
+
+    uint64_t n       = 1;
+    uint64_t elapsed = 0;
+    uint64_t count   = 0;
+
+    while (true)
+    {
+        uint64_t before = allocs;
+        elapsed         = run_n(c->op, s, n);
+        count           = allocs - before;
+
+        if (elapsed >= opts.time)
+        {
+            break;
+        }
+
+        n *= 2;
+    }
+
+    double ns = (double)elapsed / n;
+
+    if (c->fixed == true)
+    {
+        printf( "%-22s %8s %12.1f ns/op %8.2f allocs/op\n",
+                c->name, "-", ns, (double)count / n );
+    }
+    else
+    {
+        printf( "%-22s %8zu %12.1f ns/op %8.2f allocs/op %10.1f MB/s\n",
+                c->name, s->size, ns, (double)count / n,
+                s->size / ns * 1e9 / (1024 * 1024) );
+    }
+
+    vws_buffer_free(s->input);
+    s->input = NULL;
+}
+
+//------------------------------------------------------------------------------
+// Cases
+//------------------------------------------------------------------------------
+
+static void frame_serialize(bench_state* s)
+{
+    vws_frame* f  = vws_frame_new(s->payload, s->size, BINARY_FRAME);
+    vws_buffer* b = vws_serialize(f);
+    vws_buffer_free(b);
+}
+
+static void frame_deserialize_setup(bench_state* s)
+{
+    vws_frame* f = vws_frame_new(s->payload, s->size, BINARY_FRAME);
+    s->input     = vws_serialize(f);
+}
+
+static void frame_deserialize(bench_state* s)
+{
+    vws_frame* f    = vws_frame_new(NULL, 0, BINARY_FRAME);
+    size_t consumed = 0;
+    vws_deserialize(s->input->data, s->input->size, f, &consumed);
+    vws_frame_free(f);
+}
+
+static void mask(bench_state* s)
+{
+    static const unsigned char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+    vws_mask(s->out, s->payload, s->size, key, 0);
+}
+
+static void accept_key(bench_state* s)
+{
+    cstr key = vws_accept_key("dGhlIHNhbXBsZSBub25jZQ==");
+    vws.free((void*)key);
+}
+
+static void accept_key_into(bench_state* s)
+{
+    char out[VWS_ACCEPT_KEY_SIZE];
+    vws_accept_key_into("dGhlIHNhbXBsZSBub25jZQ==", out);
+}
+
+static vrtql_msg* message(bench_state* s, vrtql_msg_format_t format)
+{
+    vrtql_msg* m = vrtql_msg_new();
+    m->format    = format;
+    vrtql_msg_set_header(m, "id", "bench");
+    vrtql_msg_set_header(m, "tag", "0123456789");
+    vws_buffer_append(m->content, s->payload, s->size);
+
+    return m;
+}
+
+static void msg_serialize(bench_state* s, vrtql_msg_format_t format)
+{
+    vrtql_msg* m  = message(s, format);
+    vws_buffer* b = vrtql_msg_serialize(m);
+    vws_buffer_free(b);
+    vrtql_msg_free(m);
+}
+
+static void msg_deserialize_setup(bench_state* s, vrtql_msg_format_t format)
+{
+    vrtql_msg* m = message(s, format);
+    s->input     = vrtql_msg_serialize(m);
+    vrtql_msg_free(m);
+}
+
+static void msg_deserialize(bench_state* s)
+{
+    vrtql_msg* m = vrtql_msg_new();
+    vrtql_msg_deserialize(m, s->input->data, s->input->size);
+    vrtql_msg_free(m);
+}
+
+static void msg_serialize_mpack(bench_state* s)
+{
+    msg_serialize(s, VM_MPACK_FORMAT);
+}
+
+static void msg_serialize_json(bench_state* s)
+{
+    msg_serialize(s, VM_JSON_FORMAT);
+}
+
+static void msg_deserialize_mpack_setup(bench_state* s)
+{
+    msg_deserialize_setup(s, VM_MPACK_FORMAT);
+}
+
+static void msg_deserialize_json_setup(bench_state* s)
+{
+    msg_deserialize_setup(s, VM_JSON_FORMAT);
+}
+
+static void buffer_append_drain(bench_state* s)
+{
+    vws_buffer_append(s->buffer, s->payload, s->size);
+    vws_buffer_drain(s->buffer, s->size);
+}
+
+static cstr http_request = "GET /websocket HTTP/1.1\r\n"
+                           "Host: example.com\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                           "Sec-WebSocket-Version: 13\r\n"
+                           "Origin: http://example.com\r\n"
+                           "User-Agent: bench_codec\r\n"
+                           "\r\n";
+
+static void http_parse(bench_state* s)
+{
+    vws_http_msg* req = vws_http_msg_new(HTTP_REQUEST);
+    vws_http_msg_parse(req, http_request, strlen(http_request));
+    vws_http_msg_free(req);
+}
+
+static void http_parse_handshake(bench_state* s)
+{
+    vws_http_msg* req = vws_http_msg_handshake_new();
+    vws_http_msg_parse(req, http_request, strlen(http_request));
+    vws_http_msg_free(req);
+}
+
+static const bench_case cases[] =
+{
+    { "frame_serialize",
+      NULL,
+      frame_serialize,
+      false },
+
+    { "frame_deserialize",
+      frame_deserialize_setup,
+      frame_deserialize,
+      false },
+
+    { "mask",
+      NULL,
+      mask,
+      false },
+
+    { "accept_key",
+      NULL,
+      accept_key,
+      true },
+
+    { "accept_key_into",
+      NULL,
+      accept_key_into,
+      true },
+
+    { "msg_serialize_mpack",
+      NULL,
+      msg_serialize_mpack,
+      false },
+
+    { "msg_deserialize_mpack",
+      msg_deserialize_mpack_setup,
+      msg_deserialize,
+      false },
+
+    { "msg_serialize_json",
+      NULL,
+      msg_serialize_json,
+      false },
+
+    { "msg_deserialize_json",
+      msg_deserialize_json_setup,
+      msg_deserialize,
+      false },
+
+    { "buffer_append_drain",
+      NULL,
+      buffer_append_drain,
+      false },
+
+    { "http_parse",
+      NULL,
+      http_parse,
+      true },
+
+    { "http_parse_handshake",
+      NULL,
+      http_parse_handshake,
+      true }
+};
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf(stderr, "usage: bench_codec [-f filter] [-s size] [-t ms]\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f': opts.filter = optarg;                             break;
+            case 's': opts.size   = (size_t)atol(optarg);               break;
+            case 't': opts.time   = (uint64_t)atol(optarg) * 1000000;   break;
+            default:  usage();
+        }
+    }
+
+    count_allocations();
+
+    bench_state s;
+    memset(&s, 0, sizeof(s));
+    s.buffer = vws_buffer_new();
+
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+
+    if (opts.size != 0)
+    {
+        sizes[0] = opts.size;
+        count    = 1;
+    }
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const bench_case* bc = &cases[c];
+
+        if (opts.filter != NULL && strstr(bc->name, opts.filter) == NULL)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            // JSON carries the content as a string, so use printable bytes
+            s.size    = sizes[i];
+            s.payload = malloc(s.size);
+            s.out     = malloc(s.size);
+            memset(s.payload, 'x', s.size);
+
+            run_case(bc, &s);
+
+            free(s.payload);
+            free(s.out);
+
+            if (bc->fixed == true)
+            {
+                break;
+            }
+        }
+    }
+
+    vws_buffer_free(s.buffer);
+
+    return 0;
+}
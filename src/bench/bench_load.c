@@ -0,0 +1,625 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "rpc.h"
+#include "reactor.h"
+
+#include "bench.h"
+
+/**
+ * @file bench_load.c
+ * @brief Load generator (vws-bench)
+ *
+ * Opens many client connections to a running server, spread over threads
+ * that each drive their share from a reactor, and sends one of three
+ * patterns:
+ *
+ *   ws    binary WebSocket messages, which the server must echo
+ *   msg   VRTQL messages, which the server must echo
+ *   rpc   RPC calls made with vrtql_rpc_send(), answered by the server
+ *
+ * With a rate (-r) the load is open loop: every connection sends on a fixed
+ * schedule whether or not earlier replies have come back. Latency is taken
+ * from when a message was due to be sent, not from when it was sent. A stall
+ * in the client or the server then counts against every message it delays,
+ * rather than quietly holding back the sender (coordinated omission). The
+ * service time, taken from the actual send, is reported alongside. Without a
+ * rate the load is closed loop: each connection keeps a fixed number of
+ * messages in flight (-d) and both times are the same.
+ *
+ *   vws-bench [-u uri] [-m ws|msg|rpc] [-c connections] [-t threads]
+ *             [-r rate] [-d depth] [-s size] [-D seconds] [-C call]
+ *
+ * The rate is in messages per second over all connections. For ws and msg
+ * the payload carries the send times in its first 16 bytes. For rpc the call
+ * (-C) is put in the "id" header and the payload is the content.
+ */
+
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+
+typedef struct
+{
+    /**< Server to connect to */
+    cstr uri;
+
+    /**< Pattern: "ws", "msg" or "rpc" */
+    cstr mode;
+
+    /**< Connections to open */
+    int connections;
+
+    /**< Client threads the connections are spread over */
+    int threads;
+
+    /**< Messages per second over all connections. 0 for closed loop. */
+    double rate;
+
+    /**< Messages each connection keeps in flight in closed loop */
+    int depth;
+
+    /**< Payload size in bytes */
+    size_t size;
+
+    /**< Seconds to send for */
+    int duration;
+
+    /**< RPC call name */
+    cstr call;
+
+} load_options;
+
+static load_options opts =
+{
+    .uri         = "ws://127.0.0.1:8181/websocket",
+    .mode        = "ws",
+    .connections = 100,
+    .threads     = 4,
+    .rate        = 0,
+    .depth       = 1,
+    .size        = 64,
+    .duration    = 10,
+    .call        = "bench.echo"
+};
+
+// The send times carried by a message
+typedef struct
+{
+    /**< When the message was due to be sent */
+    uint64_t due;
+
+    /**< When it was sent */
+    uint64_t sent;
+
+} load_stamp;
+
+// Time allowed for replies still in flight when sending stops
+#define LOAD_DRAIN_NS (2ULL * 1000 * 1000 * 1000)
+
+//------------------------------------------------------------------------------
+// Clients
+//------------------------------------------------------------------------------
+
+struct load_client;
+
+// A client connection
+typedef struct
+{
+    /**< The connection */
+    vws_cnx* cnx;
+
+    /**< RPC instance (rpc mode) */
+    vrtql_rpc* rpc;
+
+    /**< The thread it belongs to */
+    struct load_client* client;
+
+    /**< When the next message is due (open loop) */
+    uint64_t next;
+
+    /**< Set once the connection has failed */
+    bool closed;
+
+} load_cnx;
+
+// A client thread
+typedef struct load_client
+{
+    /**< The thread */
+    pthread_t thread;
+
+    /**< Its connections */
+    load_cnx* cnxs;
+
+    /**< Number of connections */
+    int count;
+
+    /**< Messages sent */
+    uint64_t sent;
+
+    /**< Replies received */
+    uint64_t received;
+
+    /**< Messages lost to failed sends or connections */
+    uint64_t errors;
+
+    /**< Latency from when each message was due */
+    bench_hist* latency;
+
+    /**< Latency from when each message was sent */
+    bench_hist* service;
+
+    /**< Message payload, stamped before each send */
+    unsigned char* payload;
+
+    /**< When sending stops */
+    uint64_t end;
+
+} load_client;
+
+// A call in flight (rpc mode)
+typedef struct
+{
+    /**< The connection */
+    load_cnx* lc;
+
+    /**< Its send times */
+    load_stamp stamp;
+
+} load_call;
+
+// Released once every client has connected
+static pthread_barrier_t start;
+
+static bool is_mode(cstr mode)
+{
+    return strcmp(opts.mode, mode) == 0;
+}
+
+static void client_record(load_client* client, load_stamp* stamp)
+{
+    uint64_t now = bench_now();
+    bench_hist_record(client->latency, now - stamp->due);
+    bench_hist_record(client->service, now - stamp->sent);
+    client->received++;
+}
+
+static void client_rpc_done(vrtql_rpc* rpc, vrtql_msg* reply, void* data)
+{
+    load_call* call      = (load_call*)data;
+    load_client* client  = call->lc->client;
+
+    if (reply != NULL)
+    {
+        client_record(client, &call->stamp);
+        vrtql_msg_free(reply);
+    }
+    else
+    {
+        client->errors++;
+    }
+
+    vws.free(call);
+}
+
+// Sends a message that was due at the given time
+static void client_send(load_cnx* lc, uint64_t due)
+{
+    load_client* client = lc->client;
+
+    load_stamp stamp;
+    stamp.due  = due;
+    stamp.sent = bench_now();
+
+    bool ok = true;
+
+    if (is_mode("rpc"))
+    {
+        load_call* call = vws.malloc(sizeof(load_call));
+        call->lc        = lc;
+        call->stamp     = stamp;
+
+        vrtql_msg* req = vrtql_msg_new();
+        vrtql_msg_set_header(req, "id", opts.call);
+        vws_buffer_append(req->content, client->payload, opts.size);
+
+        ok = vrtql_rpc_send(lc->rpc, req, client_rpc_done, call);
+        vrtql_msg_free(req);
+
+        if (ok == false)
+        {
+            vws.free(call);
+        }
+    }
+    else
+    {
+        memcpy(client->payload, &stamp, sizeof(stamp));
+
+        if (is_mode("msg"))
+        {
+            vrtql_msg* m = vrtql_msg_new();
+            vws_buffer_append(m->content, client->payload, opts.size);
+
+            ok = vrtql_msg_send(lc->cnx, m) > 0;
+            vrtql_msg_free(m);
+        }
+        else
+        {
+            ok = vws_msg_send_binary(lc->cnx, client->payload, opts.size) > 0;
+        }
+    }
+
+    if (ok == true)
+    {
+        client->sent++;
+    }
+    else
+    {
+        client->errors++;
+    }
+}
+
+static void client_on_msg(vws_reactor* r, vws_cnx* c, vws_msg* m)
+{
+    load_client* client = (load_client*)r->data;
+    load_cnx* lc        = (load_cnx*)c->data;
+
+    ucstr data  = m->data->data;
+    size_t size = m->data->size;
+
+    if (is_mode("ws"))
+    {
+        if (size >= sizeof(load_stamp))
+        {
+            load_stamp stamp;
+            memcpy(&stamp, data, sizeof(stamp));
+            client_record(client, &stamp);
+        }
+    }
+    else
+    {
+        vrtql_msg* reply = vrtql_msg_new();
+
+        if (vrtql_msg_deserialize(reply, data, size) == false)
+        {
+            client->errors++;
+            vrtql_msg_free(reply);
+        }
+        else if (is_mode("rpc"))
+        {
+            // Completing the call hands the reply to client_rpc_done()
+            if (vrtql_rpc_dispatch(lc->rpc, reply) == false)
+            {
+                vrtql_msg_free(reply);
+            }
+        }
+        else
+        {
+            if (reply->content->size >= sizeof(load_stamp))
+            {
+                load_stamp stamp;
+                memcpy(&stamp, reply->content->data, sizeof(stamp));
+                client_record(client, &stamp);
+            }
+
+            vrtql_msg_free(reply);
+        }
+    }
+
+    vws_msg_free(m);
+
+    // Closed loop: each reply releases the next message
+    if (opts.rate == 0 && bench_now() < client->end)
+    {
+        client_send(lc, bench_now());
+    }
+}
+
+static void client_on_close(vws_reactor* r, vws_cnx* c)
+{
+    load_cnx* lc = (load_cnx*)c->data;
+    lc->closed   = true;
+
+    fprintf(stderr, "connection closed: %s\n", vws.e.text);
+}
+
+// Sends every message that has fallen due and returns the time until the
+// next one, in milliseconds.
+static int client_schedule(load_client* client, uint64_t interval)
+{
+    uint64_t now  = bench_now();
+    uint64_t next = client->end;
+
+    for (int i = 0; i < client->count; i++)
+    {
+        load_cnx* lc = &client->cnxs[i];
+
+        if (lc->closed == true)
+        {
+            continue;
+        }
+
+        // A late sender catches up at once, so the schedule stays fixed
+        while (lc->next <= now && lc->next < client->end)
+        {
+            client_send(lc, lc->next);
+            lc->next += interval;
+        }
+
+        if (lc->next < next)
+        {
+            next = lc->next;
+        }
+    }
+
+    return next > now ? (int)((next - now) / 1000000) : 0;
+}
+
+static uint64_t client_outstanding(load_client* client)
+{
+    return client->sent - client->received - client->errors;
+}
+
+static void* client_thread(void* arg)
+{
+    load_client* client = (load_client*)arg;
+    vws_reactor* r      = vws_reactor_new();
+    r->data             = client;
+    r->on_msg           = client_on_msg;
+    r->on_close         = client_on_close;
+
+    for (int i = 0; i < client->count; i++)
+    {
+        load_cnx* lc  = &client->cnxs[i];
+        lc->cnx       = vws_cnx_new();
+        lc->cnx->data = (char*)lc;
+        lc->client    = client;
+
+        if (vws_connect(lc->cnx, opts.uri) == false)
+        {
+            fprintf(stderr, "connect failed: %s\n", vws.e.text);
+            lc->closed = true;
+            continue;
+        }
+
+        if (is_mode("rpc"))
+        {
+            lc->rpc = vrtql_rpc_new(lc->cnx);
+        }
+
+        vws_reactor_add(r, lc->cnx);
+    }
+
+    pthread_barrier_wait(&start);
+
+    uint64_t began    = bench_now();
+    client->end       = began + (uint64_t)opts.duration * 1000000000ULL;
+    uint64_t interval = 0;
+
+    if (opts.rate > 0)
+    {
+        // Each connection sends at rate / connections. Stagger the first
+        // sends so the load does not arrive in waves.
+        interval = (uint64_t)(1e9 * opts.connections / opts.rate);
+
+        for (int i = 0; i < client->count; i++)
+        {
+            client->cnxs[i].next = began + interval * i / client->count;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < client->count; i++)
+        {
+            for (int j = 0; j < opts.depth; j++)
+            {
+                if (client->cnxs[i].closed == false)
+                {
+                    client_send(&client->cnxs[i], began);
+                }
+            }
+        }
+    }
+
+    while (vws_reactor_size(r) > 0 && bench_now() < client->end)
+    {
+        int wait = 100;
+
+        if (opts.rate > 0)
+        {
+            wait = client_schedule(client, interval);
+        }
+
+        vws_reactor_run(r, wait);
+    }
+
+    // Collect what is still in flight
+    uint64_t deadline = bench_now() + LOAD_DRAIN_NS;
+
+    while (vws_reactor_size(r) > 0 && client_outstanding(client) > 0 &&
+           bench_now() < deadline)
+    {
+        vws_reactor_run(r, 100);
+    }
+
+    for (int i = 0; i < client->count; i++)
+    {
+        load_cnx* lc = &client->cnxs[i];
+
+        if (lc->closed == false)
+        {
+            vws_reactor_remove(r, lc->cnx);
+        }
+
+        // Fails any calls still pending, which counts them as errors
+        if (lc->rpc != NULL)
+        {
+            vrtql_rpc_free(lc->rpc);
+        }
+
+        vws_disconnect(lc->cnx);
+        vws_cnx_free(lc->cnx);
+    }
+
+    vws_reactor_free(r);
+
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf( stderr,
+             "usage: vws-bench [-u uri] [-m ws|msg|rpc] [-c connections]\n"
+             "                 [-t threads] [-r rate] [-d depth] [-s size]\n"
+             "                 [-D seconds] [-C call]\n" );
+    exit(1);
+}
+
+// Every connection needs a descriptor. Use all we are allowed.
+static void raise_fd_limit()
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:m:c:t:r:d:s:D:C:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u': opts.uri         = optarg;               break;
+            case 'm': opts.mode        = optarg;               break;
+            case 'c': opts.connections = atoi(optarg);         break;
+            case 't': opts.threads     = atoi(optarg);         break;
+            case 'r': opts.rate        = atof(optarg);         break;
+            case 'd': opts.depth       = atoi(optarg);         break;
+            case 's': opts.size        = (size_t)atol(optarg); break;
+            case 'D': opts.duration    = atoi(optarg);         break;
+            case 'C': opts.call        = optarg;               break;
+            default:  usage();
+        }
+    }
+
+    if (is_mode("ws") == false && is_mode("msg") == false &&
+        is_mode("rpc") == false)
+    {
+        usage();
+    }
+
+    if (opts.size < sizeof(load_stamp))
+    {
+        opts.size = sizeof(load_stamp);
+    }
+
+    if (opts.threads > opts.connections)
+    {
+        opts.threads = opts.connections;
+    }
+
+    if (opts.threads < 1 || opts.depth < 1 || opts.duration < 1 ||
+        opts.rate < 0)
+    {
+        usage();
+    }
+
+    raise_fd_limit();
+
+    load_client* clients = calloc(opts.threads, sizeof(load_client));
+    pthread_barrier_init(&start, NULL, opts.threads + 1);
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        load_client* client = &clients[i];
+
+        // Spread the connections evenly
+        client->count   = opts.connections / opts.threads
+                        + (i < opts.connections % opts.threads);
+        client->cnxs    = calloc(client->count, sizeof(load_cnx));
+        client->latency = bench_hist_new();
+        client->service = bench_hist_new();
+        client->payload = calloc(1, opts.size);
+
+        pthread_create(&client->thread, NULL, client_thread, client);
+    }
+
+    pthread_barrier_wait(&start);
+
+    bench_hist* latency = bench_hist_new();
+    bench_hist* service = bench_hist_new();
+    uint64_t sent       = 0;
+    uint64_t received   = 0;
+    uint64_t errors     = 0;
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        load_client* client = &clients[i];
+        pthread_join(client->thread, NULL);
+
+        bench_hist_merge(latency, client->latency);
+        bench_hist_merge(service, client->service);
+        sent     += client->sent;
+        received += client->received;
+        errors   += client->errors;
+
+        free(client->cnxs);
+        free(client->latency);
+        free(client->service);
+        free(client->payload);
+    }
+
+    //> Report
+
+    printf( "uri=%s mode=%s connections=%i threads=%i size=%zu\n",
+            opts.uri, opts.mode, opts.connections, opts.threads,
+            opts.size );
+
+    if (opts.rate > 0)
+    {
+        printf("open loop at %.0f msgs/s for %i s\n", opts.rate, opts.duration);
+    }
+    else
+    {
+        printf("closed loop at depth %i for %i s\n", opts.depth, opts.duration);
+    }
+
+    printf( "%-12s sent=%llu received=%llu errors=%llu, %.0f msgs/s\n",
+            "messages",
+            (unsigned long long)sent,
+            (unsigned long long)received,
+            (unsigned long long)errors,
+            (double)received / opts.duration );
+
+    bench_hist_print("latency", latency);
+    bench_hist_print("service", service);
+
+    // Falling short of the rate means the client could not keep up, and the
+    // latency includes its own backlog.
+    if (opts.rate > 0 && sent < 0.95 * opts.rate * opts.duration)
+    {
+        printf("sent below the requested rate: add threads or connections\n");
+    }
+
+    free(latency);
+    free(service);
+    free(clients);
+    pthread_barrier_destroy(&start);
+
+    return (errors > 0 || received < sent) ? 1 : 0;
+}
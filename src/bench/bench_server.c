@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "message.h"
+#include "reactor.h"
+
+#include "bench.h"
+
+/**
+ * @file bench_server.c
+ * @brief Throughput and latency benchmark for the server stack
+ *
+ * Runs a WebSocket (vws_svr) or messaging (vrtql_msg_svr) echo server in
+ * process and drives it from client threads, each running a reactor over its
+ * share of the connections. Every connection keeps a fixed number of messages
+ * in flight. Each message carries its send time in its first 8 bytes, so the
+ * echo gives the round trip latency.
+ *
+ *   bench_server [-m ws|msg] [-c connections] [-t threads] [-s size]
+ *                [-d depth] [-n messages] [-p pool] [-l loops] [-P port]
+ *
+ * Many connections need a raised descriptor limit (ulimit -n).
+ */
+
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+
+typedef struct
+{
+    /**< Server to run: "ws" or "msg" */
+    cstr mode;
+
+    /**< Port to listen on */
+    int port;
+
+    /**< Connections to open */
+    int connections;
+
+    /**< Client threads the connections are spread over */
+    int threads;
+
+    /**< Payload size in bytes, at least 8 */
+    size_t size;
+
+    /**< Messages each connection keeps in flight */
+    int depth;
+
+    /**< Messages each connection sends */
+    int messages;
+
+    /**< Server worker threads */
+    int pool;
+
+    /**< Server network loops */
+    int loops;
+
+} bench_options;
+
+static bench_options opts =
+{
+    .mode        = "ws",
+    .port        = 8282,
+    .connections = 100,
+    .threads     = 4,
+    .size        = 64,
+    .depth       = 1,
+    .messages    = 1000,
+    .pool        = 4,
+    .loops       = 1
+};
+
+//------------------------------------------------------------------------------
+// Server
+//------------------------------------------------------------------------------
+
+// WebSocket echo. Runs in a worker.
+static void ws_echo(vws_svr_cnx* cnx, vws_msg* m)
+{
+    vws_svr* server = (vws_svr*)cnx->server;
+
+    // send() takes the message
+    server->send(cnx, m);
+}
+
+// Message echo. Runs in a worker. The request goes back as it came, routing
+// and all, so this also answers vrtql_rpc_send() calls (see bench_load.c).
+static void msg_echo(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    // send() takes the message
+    server->send(cnx, m);
+}
+
+static void server_thread(void* arg)
+{
+    vws_tcp_svr_run((vws_tcp_svr*)arg, "127.0.0.1", opts.port);
+}
+
+//------------------------------------------------------------------------------
+// Clients
+//------------------------------------------------------------------------------
+
+// A client connection
+typedef struct
+{
+    /**< The connection */
+    vws_cnx* cnx;
+
+    /**< Messages sent */
+    int sent;
+
+} bench_cnx;
+
+// A client thread
+typedef struct
+{
+    /**< The thread */
+    uv_thread_t thread;
+
+    /**< Its connections */
+    bench_cnx* cnxs;
+
+    /**< Number of connections */
+    int count;
+
+    /**< Replies expected */
+    uint64_t expected;
+
+    /**< Replies received */
+    uint64_t received;
+
+    /**< Payload bytes received */
+    uint64_t bytes;
+
+    /**< Round trip times */
+    bench_hist* latency;
+
+    /**< Message sent, stamped before each send */
+    unsigned char* payload;
+
+    /**< Set if a connection failed */
+    bool failed;
+
+} bench_client;
+
+// Released once every client has connected
+static uv_barrier_t start;
+
+// Sends a message stamped with the current time
+static void client_send(bench_client* client, bench_cnx* bc)
+{
+    uint64_t now = bench_now();
+    memcpy(client->payload, &now, sizeof(now));
+
+    if (strcmp(opts.mode, "msg") == 0)
+    {
+        vrtql_msg* m = vrtql_msg_new();
+        m->format    = VM_MPACK_FORMAT;
+        vws_buffer_append(m->content, client->payload, opts.size);
+
+        vrtql_msg_send(bc->cnx, m);
+        vrtql_msg_free(m);
+    }
+    else
+    {
+        vws_msg_send_binary(bc->cnx, client->payload, opts.size);
+    }
+
+    bc->sent++;
+}
+
+static void client_on_msg(vws_reactor* r, vws_cnx* c, vws_msg* m)
+{
+    bench_client* client = (bench_client*)r->data;
+    bench_cnx* bc        = (bench_cnx*)c->data;
+    vrtql_msg* reply     = NULL;
+
+    ucstr data  = m->data->data;
+    size_t size = m->data->size;
+
+    if (strcmp(opts.mode, "msg") == 0)
+    {
+        reply = vrtql_msg_new();
+
+        if (vrtql_msg_deserialize(reply, data, size) == false)
+        {
+            client->failed = true;
+        }
+
+        data = reply->content->data;
+        size = reply->content->size;
+    }
+
+    if (size >= sizeof(uint64_t))
+    {
+        uint64_t sent;
+        memcpy(&sent, data, sizeof(sent));
+        bench_hist_record(client->latency, bench_now() - sent);
+    }
+
+    client->received++;
+    client->bytes += size;
+
+    vrtql_msg_free(reply);
+    vws_msg_free(m);
+
+    if (bc->sent < opts.messages)
+    {
+        client_send(client, bc);
+    }
+}
+
+static void client_on_close(vws_reactor* r, vws_cnx* c)
+{
+    bench_client* client = (bench_client*)r->data;
+    client->failed       = true;
+}
+
+static void client_thread(void* arg)
+{
+    bench_client* client = (bench_client*)arg;
+    vws_reactor* r       = vws_reactor_new();
+    r->data              = client;
+    r->on_msg            = client_on_msg;
+    r->on_close          = client_on_close;
+
+    char uri[64];
+    snprintf(uri, sizeof(uri), "ws://127.0.0.1:%i/websocket", opts.port);
+
+    for (int i = 0; i < client->count; i++)
+    {
+        bench_cnx* bc = &client->cnxs[i];
+        bc->cnx       = vws_cnx_new();
+        bc->cnx->data = (char*)bc;
+        bc->sent      = 0;
+
+        if (vws_connect(bc->cnx, uri) == false)
+        {
+            fprintf(stderr, "connect failed: %s\n", vws.e.text);
+            client->failed = true;
+            break;
+        }
+
+        vws_reactor_add(r, bc->cnx);
+    }
+
+    uv_barrier_wait(&start);
+
+    if (client->failed == false)
+    {
+        for (int i = 0; i < client->count; i++)
+        {
+            for (int j = 0; j < opts.depth && j < opts.messages; j++)
+            {
+                client_send(client, &client->cnxs[i]);
+            }
+        }
+
+        // Give up if nothing comes back for 10 seconds
+        int idle = 0;
+
+        while (client->received < client->expected && client->failed == false)
+        {
+            int n = vws_reactor_run(r, 1000);
+
+            if (n < 0 || (n == 0 && ++idle == 10))
+            {
+                client->failed = true;
+            }
+            else if (n > 0)
+            {
+                idle = 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < client->count; i++)
+    {
+        bench_cnx* bc = &client->cnxs[i];
+
+        if (bc->cnx != NULL)
+        {
+            vws_reactor_remove(r, bc->cnx);
+            vws_disconnect(bc->cnx);
+            vws_cnx_free(bc->cnx);
+        }
+    }
+
+    vws_reactor_free(r);
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf( stderr,
+             "usage: bench_server [-m ws|msg] [-c connections] [-t threads]\n"
+             "                    [-s size] [-d depth] [-n messages]\n"
+             "                    [-p pool] [-l loops] [-P port]\n" );
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:c:t:s:d:n:p:l:P:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm': opts.mode        = optarg;               break;
+            case 'c': opts.connections = atoi(optarg);         break;
+            case 't': opts.threads     = atoi(optarg);         break;
+            case 's': opts.size        = (size_t)atol(optarg); break;
+            case 'd': opts.depth       = atoi(optarg);         break;
+            case 'n': opts.messages    = atoi(optarg);         break;
+            case 'p': opts.pool        = atoi(optarg);         break;
+            case 'l': opts.loops       = atoi(optarg);         break;
+            case 'P': opts.port        = atoi(optarg);         break;
+            default:  usage();
+        }
+    }
+
+    if (strcmp(opts.mode, "ws") != 0 && strcmp(opts.mode, "msg") != 0)
+    {
+        usage();
+    }
+
+    if (opts.size < sizeof(uint64_t))
+    {
+        opts.size = sizeof(uint64_t);
+    }
+
+    if (opts.threads > opts.connections)
+    {
+        opts.threads = opts.connections;
+    }
+
+    if (opts.threads < 1 || opts.depth < 1 || opts.messages < 1)
+    {
+        usage();
+    }
+
+    //> Start the server
+
+    vws_tcp_svr* server;
+
+    if (strcmp(opts.mode, "msg") == 0)
+    {
+        vrtql_msg_svr* s = vrtql_msg_svr_new(opts.pool, 0, 0);
+        s->process       = msg_echo;
+        server           = (vws_tcp_svr*)s;
+    }
+    else
+    {
+        vws_svr* s = vws_svr_new(opts.pool, 0, 0);
+        s->process = ws_echo;
+        server     = (vws_tcp_svr*)s;
+    }
+
+    vws_tcp_svr_set_loops(server, opts.loops);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state(server) != VS_RUNNING)
+    {
+        vws_msleep(10);
+    }
+
+    //> Run the clients
+
+    bench_client* clients = calloc(opts.threads, sizeof(bench_client));
+    uv_barrier_init(&start, opts.threads + 1);
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        bench_client* client = &clients[i];
+
+        // Spread the connections evenly
+        client->count    = opts.connections / opts.threads
+                         + (i < opts.connections % opts.threads);
+        client->cnxs     = calloc(client->count, sizeof(bench_cnx));
+        client->expected = (uint64_t)client->count * opts.messages;
+        client->latency  = bench_hist_new();
+        client->payload  = calloc(1, opts.size);
+
+        uv_thread_create(&client->thread, client_thread, client);
+    }
+
+    uv_barrier_wait(&start);
+    uint64_t began = bench_now();
+
+    bench_hist* latency = bench_hist_new();
+    uint64_t received   = 0;
+    uint64_t bytes      = 0;
+    bool failed         = false;
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        bench_client* client = &clients[i];
+        uv_thread_join(&client->thread);
+
+        bench_hist_merge(latency, client->latency);
+        received += client->received;
+        bytes    += client->bytes;
+        failed    = failed || client->failed;
+
+        free(client->cnxs);
+        free(client->latency);
+        free(client->payload);
+    }
+
+    double elapsed = (bench_now() - began) / 1e9;
+
+    //> Report
+
+    printf( "mode=%s connections=%i threads=%i size=%zu depth=%i "
+            "pool=%i loops=%i\n",
+            opts.mode, opts.connections, opts.threads, opts.size,
+            opts.depth, opts.pool, opts.loops );
+
+    printf( "%-12s %llu in %.3f s: %.0f msgs/s, %.2f MB/s\n",
+            "messages",
+            (unsigned long long)received,
+            elapsed,
+            received / elapsed,
+            bytes / elapsed / (1024 * 1024) );
+
+    bench_hist_print("latency", latency);
+
+    if (failed == true)
+    {
+        printf("some connections failed\n");
+    }
+
+    free(latency);
+    free(clients);
+    uv_barrier_destroy(&start);
+
+    //> Stop the server
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+
+    if (strcmp(opts.mode, "msg") == 0)
+    {
+        vrtql_msg_svr_free((vrtql_msg_svr*)server);
+    }
+    else
+    {
+        vws_svr_free((vws_svr*)server);
+    }
+
+    return failed ? 1 : 0;
+}
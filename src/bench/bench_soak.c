@@ -0,0 +1,1236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+#include "message.h"
+
+#include "bench.h"
+
+/**
+ * @file bench_soak.c
+ * @brief Connection scaling soak for the message server (C1M)
+ *
+ * Ramps the number of connections to a vrtql_msg_svr echo server in steps and
+ * measures what each step costs. The server runs in a child process so that
+ * its memory is measured on its own and each side gets its own descriptor
+ * limit. The harness reads the server's RSS and metrics over a socket pair
+ * after every step.
+ *
+ * Client connections are bare non-blocking sockets driven from epoll by a few
+ * threads, so the harness stays small next to the server. They bind to source
+ * addresses spread over 127.0.0.0/8 (loopback aliases, which Linux routes
+ * without configuration), so the count is not capped by one address's
+ * ephemeral ports. The first connections opened are active: each sends a
+ * message at a fixed rate and waits for its echo. The rest stay idle once
+ * upgraded.
+ *
+ * Every step reports, as the count grows:
+ *
+ *   rss/conn   Server RSS over its baseline, per open connection
+ *   accept/s   Connections upgraded per second during the ramp
+ *   handshake  Connect to 101 response
+ *   lag        Ping round trip on a probe connection. Pings are answered on
+ *              the loop thread, so this is how late the loop gets to a ready
+ *              socket.
+ *   wait       Time requests waited in worker queues (requests_wait)
+ *   rtt        Echo round trip of the active connections, taken from when
+ *              each message was due so that a stall counts against every
+ *              message it delays
+ *
+ * Latencies are in microseconds and cover the whole step, ramp and dwell. The
+ * ramp stops at the first step where connections fail, which is the limit
+ * being measured.
+ *
+ *   bench_soak [-c connections] [-a active] [-S step] [-r rate] [-D seconds]
+ *              [-A aliases] [-t threads] [-i inflight] [-s size] [-p pool]
+ *              [-l loops] [-b backlog] [-P port]
+ *
+ * A million connections need both processes' descriptor limits raised
+ * (ulimit -n, fs.nr_open), fs.file-max, and a listen backlog the kernel
+ * allows (net.core.somaxconn). For 1M idle and 100k active:
+ *
+ *   bench_soak -c 1000000 -a 100000 -S 100000 -l 4 -p 8
+ */
+
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+
+typedef struct
+{
+    /**< Port to listen on */
+    int port;
+
+    /**< Connections to ramp to */
+    int connections;
+
+    /**< Connections that send, the first opened */
+    int active;
+
+    /**< Connections added per step. Default a tenth of connections. */
+    int step;
+
+    /**< Messages per second each active connection sends */
+    double rate;
+
+    /**< Seconds to hold each step before sampling */
+    int dwell;
+
+    /**< Source addresses to spread connections over. Default one per 25000
+     * connections. */
+    int aliases;
+
+    /**< Client threads */
+    int threads;
+
+    /**< Handshakes each client thread keeps in flight while ramping */
+    int inflight;
+
+    /**< Payload size in bytes */
+    size_t size;
+
+    /**< Server worker threads */
+    int pool;
+
+    /**< Server network loops */
+    int loops;
+
+    /**< Server listen backlog */
+    int backlog;
+
+} soak_options;
+
+static soak_options opts =
+{
+    .port        = 8383,
+    .connections = 10000,
+    .active      = 1000,
+    .step        = 0,
+    .rate        = 1,
+    .dwell       = 5,
+    .aliases     = 0,
+    .threads     = 4,
+    .inflight    = 64,
+    .size        = 64,
+    .pool        = 4,
+    .loops       = 1,
+    .backlog     = 4096
+};
+
+// Connections per source address by default, well inside the ephemeral range
+#define SOAK_ALIAS_CONNECTIONS 25000
+
+// Milliseconds between probe pings
+#define SOAK_PROBE_INTERVAL 10
+
+// Seconds a ramp may go without progress before it is given up
+#define SOAK_STALL 10
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+static const char soak_upgrade[] =
+    "GET /websocket HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+//------------------------------------------------------------------------------
+// Server
+//------------------------------------------------------------------------------
+
+// What the server reports after each step
+typedef struct
+{
+    /**< Resident set size in bytes */
+    uint64_t rss;
+
+    /**< Server metrics snapshot */
+    vws_svr_metrics metrics;
+
+} soak_sample;
+
+// Message echo. Runs in a worker.
+static void msg_echo(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    // send() takes the message
+    server->send(cnx, m);
+}
+
+static void server_thread(void* arg)
+{
+    vws_tcp_svr_run((vws_tcp_svr*)arg, "127.0.0.1", opts.port);
+}
+
+static bool read_full(int fd, void* data, size_t size)
+{
+    unsigned char* p = (unsigned char*)data;
+
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        p    += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_full(int fd, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        p    += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// Reads the resident set size from /proc/self/statm, opened up front as fd so
+// that it can still be read when connections have used up the descriptors
+static uint64_t rss_bytes(int fd)
+{
+    char text[128];
+    ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+    long size = 0;
+    long rss  = 0;
+
+    if (n > 0)
+    {
+        text[n] = 0;
+
+        if (sscanf(text, "%ld %ld", &size, &rss) != 2)
+        {
+            rss = 0;
+        }
+    }
+
+    return (uint64_t)rss * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+// Runs the server in the child. Answers 's' on the socket pair with a sample
+// and stops on anything else, or when the harness goes away.
+static int server_main(int fd)
+{
+    vrtql_msg_svr* s    = vrtql_msg_svr_new(opts.pool, opts.backlog, 0);
+    s->process          = msg_echo;
+    vws_tcp_svr* server = (vws_tcp_svr*)s;
+
+    vws_tcp_svr_set_loops(server, opts.loops);
+
+    int statm = open("/proc/self/statm", O_RDONLY);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state(server) != VS_RUNNING)
+    {
+        vws_msleep(10);
+    }
+
+    char cmd = 'r';
+    write_full(fd, &cmd, 1);
+
+    soak_sample* sample = calloc(1, sizeof(soak_sample));
+
+    while (read_full(fd, &cmd, 1) == true && cmd == 's')
+    {
+        sample->rss = rss_bytes(statm);
+        vws_tcp_svr_metrics(server, &sample->metrics);
+
+        if (write_full(fd, sample, sizeof(soak_sample)) == false)
+        {
+            break;
+        }
+    }
+
+    free(sample);
+    close(statm);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(s);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// Clients
+//------------------------------------------------------------------------------
+
+// Connection states
+enum
+{
+    SOAK_CONNECTING = 0,
+    SOAK_UPGRADING  = 1,
+    SOAK_OPEN       = 2,
+    SOAK_CLOSED     = 3
+};
+
+// A client connection. There may be a million, so it is kept small.
+typedef struct
+{
+    /**< The socket, -1 once closed */
+    int fd;
+
+    /**< SOAK_* state */
+    uint8_t state;
+
+    /**< Whether a message is waiting for its echo */
+    bool waiting;
+
+    /**< Bytes held in head */
+    uint8_t have;
+
+    /**< The status line while upgrading, then the partly read header of a
+     * frame */
+    unsigned char head[12];
+
+    /**< Payload bytes of the current frame still to come */
+    uint32_t need;
+
+    /**< The last four bytes of the upgrade response, to find its end */
+    uint32_t tail;
+
+    /**< When the connect started, then when the message waiting for its echo
+     * was due */
+    uint64_t time;
+
+} soak_cnx;
+
+// An active connection's next send
+typedef struct
+{
+    /**< The connection's index in its thread */
+    int index;
+
+    /**< When it is due */
+    uint64_t due;
+
+} soak_due;
+
+// A client thread. Connection j of thread i is connection j * threads + i
+// overall, so the first n overall are the first share(n, i) of each thread.
+typedef struct
+{
+    /**< The thread */
+    uv_thread_t thread;
+
+    /**< Its index */
+    int index;
+
+    /**< Its connections */
+    soak_cnx* cnxs;
+
+    /**< Number of connections it can open */
+    int count;
+
+    /**< Of those, how many are active: the first */
+    int active;
+
+    /**< Connections to have opened by now. Set by main. Read atomically. */
+    int target;
+
+    /**< Connects started */
+    int started;
+
+    /**< Handshakes under way */
+    int pending;
+
+    /**< Connections upgraded. Read atomically. */
+    int opened;
+
+    /**< Connections that failed to connect or upgrade. Read atomically. */
+    int failed;
+
+    /**< Connections closed after upgrading. Read atomically. */
+    int dropped;
+
+    /**< The first error, 0 if none */
+    int error;
+
+    /**< Echoes received. Read atomically. */
+    uint64_t replies;
+
+    /**< Sends skipped because the last echo had not come back. Read
+     * atomically. */
+    uint64_t late;
+
+    /**< Sends due, oldest first. A ring holding each open active connection
+     * once. They all send at the same interval, so it stays in order. */
+    soak_due* ring;
+
+    /**< Index of the oldest in ring */
+    int ring_head;
+
+    /**< Entries in ring */
+    int ring_size;
+
+    /**< The message, framed and masked */
+    vws_buffer* frame;
+
+    /**< Connect to upgrade times */
+    bench_hist* handshake;
+
+    /**< Echo round trip times */
+    bench_hist* rtt;
+
+    /**< Guards handshake and rtt, which main takes after every step */
+    uv_mutex_t lock;
+
+} soak_client;
+
+static bool running = true;
+
+// The connections of n overall that fall to thread i
+static int share(int n, int i)
+{
+    return n / opts.threads + (i < n % opts.threads);
+}
+
+static void client_fail(soak_client* t, soak_cnx* c, int error)
+{
+    if (c->fd >= 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    if (t->error == 0)
+    {
+        t->error = error;
+    }
+
+    if (c->state == SOAK_OPEN)
+    {
+        __atomic_add_fetch(&t->dropped, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        t->pending--;
+        __atomic_add_fetch(&t->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    c->state = SOAK_CLOSED;
+}
+
+static void client_connect(soak_client* t, int ep, int j)
+{
+    soak_cnx* c = &t->cnxs[j];
+    c->state    = SOAK_CONNECTING;
+    c->time     = bench_now();
+    c->fd       = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    t->pending++;
+
+    if (c->fd < 0)
+    {
+        client_fail(t, c, errno);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Pick the source address, and leave the port to connect() so it need
+    // only be unique for the destination
+    setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+    int n = j * opts.threads + t->index;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7F000001 + (n % opts.aliases));
+
+    if (bind(c->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        client_fail(t, c, errno);
+        return;
+    }
+
+    addr.sin_addr.s_addr = htonl(0x7F000001);
+    addr.sin_port        = htons(opts.port);
+
+    if ( connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 &&
+         errno != EINPROGRESS )
+    {
+        client_fail(t, c, errno);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events   = EPOLLOUT;
+    ev.data.u32 = (uint32_t)j;
+
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) != 0)
+    {
+        client_fail(t, c, errno);
+    }
+}
+
+// The socket is writable: the connect is done, so send the upgrade request
+static void client_connected(soak_client* t, int ep, int j)
+{
+    soak_cnx* c   = &t->cnxs[j];
+    int error     = 0;
+    socklen_t len = sizeof(error);
+
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+    if (error != 0)
+    {
+        client_fail(t, c, error);
+        return;
+    }
+
+    size_t size = sizeof(soak_upgrade) - 1;
+
+    if (send(c->fd, soak_upgrade, size, MSG_NOSIGNAL) != (ssize_t)size)
+    {
+        client_fail(t, c, errno);
+        return;
+    }
+
+    c->state = SOAK_UPGRADING;
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.u32 = (uint32_t)j;
+
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Reads frames off an open connection, returning how many were completed
+static int client_frames(soak_cnx* c, const unsigned char* data, size_t size)
+{
+    int frames = 0;
+
+    while (size > 0)
+    {
+        if (c->need > 0)
+        {
+            size_t n = (size < c->need) ? size : c->need;
+            c->need -= n;
+            data    += n;
+            size    -= n;
+            frames  += (c->need == 0);
+
+            continue;
+        }
+
+        c->head[c->have++] = *data++;
+        size--;
+
+        if (c->have < 2)
+        {
+            continue;
+        }
+
+        uint64_t length = c->head[1] & 0x7F;
+        size_t header   = (length == 126) ? 4 : (length == 127) ? 10 : 2;
+
+        if (c->have < header)
+        {
+            continue;
+        }
+
+        if (header > 2)
+        {
+            length = 0;
+
+            for (size_t i = 2; i < header; i++)
+            {
+                length = (length << 8) | c->head[i];
+            }
+        }
+
+        c->have = 0;
+        c->need = (uint32_t)length;
+        frames += (length == 0);
+    }
+
+    return frames;
+}
+
+static void client_read(soak_client* t, int j, unsigned char* buffer)
+{
+    soak_cnx* c = &t->cnxs[j];
+    ssize_t n   = recv(c->fd, buffer, 16384, 0);
+
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return;
+        }
+
+        client_fail(t, c, (n == 0) ? ECONNRESET : errno);
+        return;
+    }
+
+    const unsigned char* data = buffer;
+    size_t size               = (size_t)n;
+
+    // Look for the end of the upgrade response, keeping its status line
+    while (c->state == SOAK_UPGRADING && size > 0)
+    {
+        unsigned char b = *data++;
+        size--;
+
+        if (c->have < sizeof(c->head))
+        {
+            c->head[c->have++] = b;
+        }
+
+        c->tail = (c->tail << 8) | b;
+
+        if (c->tail != 0x0D0A0D0A)
+        {
+            continue;
+        }
+
+        if (memcmp(c->head, "HTTP/1.1 101", sizeof(c->head)) != 0)
+        {
+            client_fail(t, c, EPROTO);
+            return;
+        }
+
+        uint64_t now = bench_now();
+
+        uv_mutex_lock(&t->lock);
+        bench_hist_record(t->handshake, now - c->time);
+        uv_mutex_unlock(&t->lock);
+
+        c->state = SOAK_OPEN;
+        c->have  = 0;
+        t->pending--;
+        __atomic_add_fetch(&t->opened, 1, __ATOMIC_RELAXED);
+
+        // Active connections join the back of the ring. Everything in it is
+        // due within an interval, so it stays in order.
+        if (j < t->active && opts.rate > 0)
+        {
+            int slot = (t->ring_head + t->ring_size++) % t->active;
+            t->ring[slot].index = j;
+            t->ring[slot].due   = now + (uint64_t)(1e9 / opts.rate);
+        }
+    }
+
+    if (c->state == SOAK_OPEN && client_frames(c, data, size) > 0)
+    {
+        if (c->waiting == true)
+        {
+            uv_mutex_lock(&t->lock);
+            bench_hist_record(t->rtt, bench_now() - c->time);
+            uv_mutex_unlock(&t->lock);
+
+            c->waiting = false;
+            __atomic_add_fetch(&t->replies, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Sends for every active connection that is due. Returns milliseconds until
+// the next is due, at most 10.
+static int client_send_due(soak_client* t)
+{
+    uint64_t now      = bench_now();
+    uint64_t interval = (uint64_t)(1e9 / opts.rate);
+    size_t size       = t->frame->size;
+
+    while (t->ring_size > 0)
+    {
+        soak_due* d = &t->ring[t->ring_head];
+
+        if (d->due > now)
+        {
+            uint64_t ms = (d->due - now) / 1000000;
+            return (ms < 10) ? (int)ms : 10;
+        }
+
+        soak_cnx* c = &t->cnxs[d->index];
+        t->ring_head = (t->ring_head + 1) % t->active;
+        t->ring_size--;
+
+        if (c->state != SOAK_OPEN)
+        {
+            continue;
+        }
+
+        if (c->waiting == true)
+        {
+            __atomic_add_fetch(&t->late, 1, __ATOMIC_RELAXED);
+        }
+        else if (send(c->fd, t->frame->data, size, MSG_NOSIGNAL)
+                 == (ssize_t)size)
+        {
+            c->waiting = true;
+            c->time    = d->due;
+        }
+
+        int slot = (t->ring_head + t->ring_size++) % t->active;
+        t->ring[slot].index = d->index;
+        t->ring[slot].due   = d->due + interval;
+    }
+
+    return 10;
+}
+
+static void client_thread(void* arg)
+{
+    soak_client* t = (soak_client*)arg;
+    int ep         = epoll_create1(0);
+
+    struct epoll_event events[256];
+    unsigned char* buffer = malloc(16384);
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) == true)
+    {
+        int target = __atomic_load_n(&t->target, __ATOMIC_ACQUIRE);
+
+        while (t->started < target && t->pending < opts.inflight)
+        {
+            client_connect(t, ep, t->started++);
+        }
+
+        int timeout = client_send_due(t);
+        int n       = epoll_wait(ep, events, 256, timeout);
+
+        for (int i = 0; i < n; i++)
+        {
+            int j       = (int)events[i].data.u32;
+            soak_cnx* c = &t->cnxs[j];
+
+            if (c->state == SOAK_CONNECTING)
+            {
+                client_connected(t, ep, j);
+            }
+            else if (c->state != SOAK_CLOSED)
+            {
+                client_read(t, j, buffer);
+            }
+        }
+    }
+
+    for (int j = 0; j < t->started; j++)
+    {
+        if (t->cnxs[j].fd >= 0)
+        {
+            close(t->cnxs[j].fd);
+        }
+    }
+
+    free(buffer);
+    close(ep);
+}
+
+//------------------------------------------------------------------------------
+// Probe
+//------------------------------------------------------------------------------
+
+// Ping round trips, guarded by probe_lock
+static bench_hist* probe_lag;
+static uv_mutex_t probe_lock;
+
+// Pings the server on a connection of its own. The pong comes from the loop
+// thread, without a worker, so the round trip shows how busy the loop is.
+static void probe_thread(void* arg)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7F000001);
+    addr.sin_port        = htons(opts.port);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    size_t size = sizeof(soak_upgrade) - 1;
+    uint32_t tail = 0;
+    unsigned char b;
+
+    if ( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+         send(fd, soak_upgrade, size, MSG_NOSIGNAL) != (ssize_t)size )
+    {
+        fprintf(stderr, "probe: connect failed: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+
+    while (tail != 0x0D0A0D0A && read_full(fd, &b, 1) == true)
+    {
+        tail = (tail << 8) | b;
+    }
+
+    // An empty ping, masked with a zero key, and the pong it gets back
+    static const unsigned char ping[] = { 0x89, 0x80, 0, 0, 0, 0 };
+    unsigned char pong[2];
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) == true)
+    {
+        uint64_t sent = bench_now();
+
+        if ( send(fd, ping, sizeof(ping), MSG_NOSIGNAL) != sizeof(ping) ||
+             read_full(fd, pong, sizeof(pong)) == false )
+        {
+            fprintf(stderr, "probe: connection lost\n");
+            break;
+        }
+
+        uv_mutex_lock(&probe_lock);
+        bench_hist_record(probe_lag, bench_now() - sent);
+        uv_mutex_unlock(&probe_lock);
+
+        vws_msleep(SOAK_PROBE_INTERVAL);
+    }
+
+    close(fd);
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf( stderr,
+             "usage: bench_soak [-c connections] [-a active] [-S step]\n"
+             "                  [-r rate] [-D seconds] [-A aliases]\n"
+             "                  [-t threads] [-i inflight] [-s size]\n"
+             "                  [-p pool] [-l loops] [-b backlog] [-P port]\n" );
+    exit(1);
+}
+
+// Every connection needs a descriptor. Use all we are allowed.
+static void raise_fd_limit()
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static bool sample_take(int fd, soak_sample* sample)
+{
+    char cmd = 's';
+
+    return write_full(fd, &cmd, 1) == true &&
+           read_full(fd, sample, sizeof(soak_sample)) == true;
+}
+
+// The part of a cumulative histogram recorded since an earlier snapshot. The
+// largest value cannot be separated out, so it is the overall one.
+static void hist_since( vws_svr_histogram* out,
+                        const vws_svr_histogram* now,
+                        const vws_svr_histogram* then )
+{
+    out->count = now->count - then->count;
+    out->sum   = now->sum   - then->sum;
+    out->max   = now->max;
+
+    for (int i = 0; i < VWS_SVR_HIST_BUCKETS; i++)
+    {
+        out->buckets[i] = now->buckets[i] - then->buckets[i];
+    }
+}
+
+// Sums a counter over the client threads
+static uint64_t client_sum(soak_client* clients, size_t offset, bool wide)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        char* field = (char*)&clients[i] + offset;
+
+        if (wide == true)
+        {
+            total += __atomic_load_n((uint64_t*)field, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            total += __atomic_load_n((int*)field, __ATOMIC_RELAXED);
+        }
+    }
+
+    return total;
+}
+
+#define CLIENT_SUM(clients, field)                                       \
+    client_sum( clients,                                                 \
+                offsetof(soak_client, field),                            \
+                sizeof(((soak_client*)0)->field) == sizeof(uint64_t) )
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:a:S:r:D:A:t:i:s:p:l:b:P:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': opts.connections = atoi(optarg);         break;
+            case 'a': opts.active      = atoi(optarg);         break;
+            case 'S': opts.step        = atoi(optarg);         break;
+            case 'r': opts.rate        = atof(optarg);         break;
+            case 'D': opts.dwell       = atoi(optarg);         break;
+            case 'A': opts.aliases     = atoi(optarg);         break;
+            case 't': opts.threads     = atoi(optarg);         break;
+            case 'i': opts.inflight    = atoi(optarg);         break;
+            case 's': opts.size        = (size_t)atol(optarg); break;
+            case 'p': opts.pool        = atoi(optarg);         break;
+            case 'l': opts.loops       = atoi(optarg);         break;
+            case 'b': opts.backlog     = atoi(optarg);         break;
+            case 'P': opts.port        = atoi(optarg);         break;
+            default:  usage();
+        }
+    }
+
+    if (opts.step <= 0)
+    {
+        opts.step = (opts.connections + 9) / 10;
+    }
+
+    if (opts.aliases <= 0)
+    {
+        opts.aliases = opts.connections / SOAK_ALIAS_CONNECTIONS + 1;
+    }
+
+    if (opts.active > opts.connections)
+    {
+        opts.active = opts.connections;
+    }
+
+    if ( opts.connections < 1 || opts.active < 0 || opts.threads < 1 ||
+         opts.inflight < 1 || opts.dwell < 0 || opts.rate < 0 )
+    {
+        usage();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    //> Start the server in a child, before any threads
+
+    int pair[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0)
+    {
+        close(pair[0]);
+        exit(server_main(pair[1]));
+    }
+
+    close(pair[1]);
+
+    int fd = pair[0];
+    char ready;
+
+    if (read_full(fd, &ready, 1) == false)
+    {
+        fprintf(stderr, "server failed to start\n");
+        return 1;
+    }
+
+    soak_sample* base   = calloc(1, sizeof(soak_sample));
+    soak_sample* last   = calloc(1, sizeof(soak_sample));
+    soak_sample* sample = calloc(1, sizeof(soak_sample));
+
+    sample_take(fd, base);
+    memcpy(last, base, sizeof(soak_sample));
+
+    //> Start the probe and the clients
+
+    probe_lag = bench_hist_new();
+    uv_mutex_init(&probe_lock);
+
+    uv_thread_t probe_tid;
+    uv_thread_create(&probe_tid, probe_thread, NULL);
+
+    vrtql_msg* m = vrtql_msg_new();
+    m->format    = VM_MPACK_FORMAT;
+    vws_buffer_reserve(m->content, opts.size);
+    memset(m->content->data, 'x', opts.size);
+    m->content->size = opts.size;
+
+    soak_client* clients = calloc(opts.threads, sizeof(soak_client));
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        soak_client* t = &clients[i];
+        t->index       = i;
+        t->count       = share(opts.connections, i);
+        t->active      = share(opts.active, i);
+        t->cnxs        = calloc(t->count, sizeof(soak_cnx));
+        t->ring        = calloc(t->active + 1, sizeof(soak_due));
+        t->frame       = vrtql_msg_serialize_frame(m, true);
+        t->handshake   = bench_hist_new();
+        t->rtt         = bench_hist_new();
+
+        uv_mutex_init(&t->lock);
+        uv_thread_create(&t->thread, client_thread, t);
+    }
+
+    vrtql_msg_free(m);
+
+    printf( "connections=%i active=%i step=%i rate=%g dwell=%i aliases=%i "
+            "threads=%i pool=%i loops=%i\n",
+            opts.connections, opts.active, opts.step, opts.rate, opts.dwell,
+            opts.aliases, opts.threads, opts.pool, opts.loops );
+
+    printf( "baseline rss %.1f MB\n\n", base->rss / (1024.0 * 1024.0) );
+
+    printf( "%8s %8s %8s %9s %9s %8s %8s %8s %8s %8s %8s %8s %9s %7s\n",
+            "conns", "open", "rss_MB", "KB/conn", "accept/s",
+            "hs_p50", "hs_p99", "lag_p50", "lag_p99",
+            "wait_p50", "wait_p99", "rtt_p99", "msgs/s", "failed" );
+
+    //> Ramp
+
+    bench_hist* handshake = bench_hist_new();
+    bench_hist* rtt       = bench_hist_new();
+    bench_hist* lag       = bench_hist_new();
+
+    vws_svr_histogram* wait = calloc(1, sizeof(vws_svr_histogram));
+
+    int reached  = 0;
+    cstr stopped = NULL;
+
+    while (reached < opts.connections && stopped == NULL)
+    {
+        int n = reached + opts.step;
+
+        if (n > opts.connections)
+        {
+            n = opts.connections;
+        }
+
+        uint64_t failed  = CLIENT_SUM(clients, failed);
+        uint64_t replies = CLIENT_SUM(clients, replies);
+        uint64_t began   = bench_now();
+
+        for (int i = 0; i < opts.threads; i++)
+        {
+            __atomic_store_n(&clients[i].target, share(n, i), __ATOMIC_RELEASE);
+        }
+
+        // Wait for every connect of the step to upgrade or fail
+        uint64_t settled  = 0;
+        uint64_t progress = began;
+
+        while (settled < (uint64_t)n)
+        {
+            vws_msleep(1);
+
+            uint64_t now = CLIENT_SUM(clients, opened)
+                         + CLIENT_SUM(clients, failed);
+
+            if (now > settled)
+            {
+                settled  = now;
+                progress = bench_now();
+            }
+            else if (bench_now() - progress > SOAK_STALL * 1000000000ULL)
+            {
+                stopped = "ramp stalled";
+                break;
+            }
+        }
+
+        double ramp = (bench_now() - began) / 1e9;
+        vws_msleep(opts.dwell * 1000);
+
+        //> Sample
+
+        if (sample_take(fd, sample) == false)
+        {
+            stopped = "server went away";
+            break;
+        }
+
+        double elapsed = (bench_now() - began) / 1e9;
+        uint64_t added = CLIENT_SUM(clients, failed) - failed;
+
+        for (int i = 0; i < opts.threads; i++)
+        {
+            soak_client* t = &clients[i];
+
+            uv_mutex_lock(&t->lock);
+            bench_hist_merge(handshake, t->handshake);
+            bench_hist_merge(rtt, t->rtt);
+            bench_hist_reset(t->handshake);
+            bench_hist_reset(t->rtt);
+            uv_mutex_unlock(&t->lock);
+        }
+
+        uv_mutex_lock(&probe_lock);
+        bench_hist_merge(lag, probe_lag);
+        bench_hist_reset(probe_lag);
+        uv_mutex_unlock(&probe_lock);
+
+        hist_since( wait,
+                    &sample->metrics.requests_wait,
+                    &last->metrics.requests_wait );
+
+        // Open on the server, less the probe
+        vws_svr_metrics* sm = &sample->metrics;
+        int64_t open        = (int64_t)(sm->connections - sm->disconnections);
+        open               -= (open > 0);
+
+        double rss = (double)sample->rss - (double)base->rss;
+
+        printf( "%8i %8lli %8.1f %9.2f %9.0f "
+                "%8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %9.0f %7llu\n",
+                n,
+                (long long)open,
+                sample->rss / (1024.0 * 1024.0),
+                (open > 0) ? rss / 1024.0 / open : 0.0,
+                (ramp > 0) ? (n - reached) / ramp : 0.0,
+                bench_hist_percentile(handshake, 50) / 1000.0,
+                bench_hist_percentile(handshake, 99) / 1000.0,
+                bench_hist_percentile(lag, 50) / 1000.0,
+                bench_hist_percentile(lag, 99) / 1000.0,
+                vws_svr_histogram_percentile(wait, 50) / 1000.0,
+                vws_svr_histogram_percentile(wait, 99) / 1000.0,
+                bench_hist_percentile(rtt, 99) / 1000.0,
+                (CLIENT_SUM(clients, replies) - replies) / elapsed,
+                (unsigned long long)added );
+
+        fflush(stdout);
+
+        bench_hist_reset(handshake);
+        bench_hist_reset(rtt);
+        bench_hist_reset(lag);
+        memcpy(last, sample, sizeof(soak_sample));
+
+        reached = n;
+
+        if (added > 0 && stopped == NULL)
+        {
+            stopped = "connections failed";
+        }
+    }
+
+    //> Report
+
+    int error = 0;
+
+    for (int i = 0; i < opts.threads && error == 0; i++)
+    {
+        error = clients[i].error;
+    }
+
+    printf( "\nlate sends %llu, dropped %llu\n",
+            (unsigned long long)CLIENT_SUM(clients, late),
+            (unsigned long long)CLIENT_SUM(clients, dropped) );
+
+    if (stopped != NULL)
+    {
+        printf( "limit at %i connections: %s%s%s\n",
+                reached,
+                stopped,
+                (error != 0) ? ": " : "",
+                (error != 0) ? strerror(error) : "" );
+    }
+
+    //> Stop
+
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        soak_client* t = &clients[i];
+        uv_thread_join(&t->thread);
+
+        uv_mutex_destroy(&t->lock);
+        vws_buffer_free(t->frame);
+        free(t->cnxs);
+        free(t->ring);
+        free(t->handshake);
+        free(t->rtt);
+    }
+
+    uv_thread_join(&probe_tid);
+    uv_mutex_destroy(&probe_lock);
+
+    char cmd = 'q';
+    write_full(fd, &cmd, 1);
+    close(fd);
+    waitpid(pid, NULL, 0);
+
+    free(clients);
+    free(probe_lag);
+    free(handshake);
+    free(rtt);
+    free(lag);
+    free(wait);
+    free(base);
+    free(last);
+    free(sample);
+
+    return (stopped != NULL) ? 1 : 0;
+}
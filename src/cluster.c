@@ -0,0 +1,928 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cluster.h"
+
+//------------------------------------------------------------------------------
+// Internal types
+//------------------------------------------------------------------------------
+
+/**
+ * @brief A topic subscribed on one or more nodes. The entry owns the name.
+ */
+typedef struct
+{
+    /**< The topic name */
+    char* name;
+
+    /**< The number of local connections subscribed */
+    uint32_t local;
+
+    /**< The other nodes with subscribers, one bit per node index */
+    uint64_t nodes;
+
+} cluster_topic;
+
+/**
+ * @brief The topics a local connection is subscribed to through the cluster.
+ */
+typedef struct
+{
+    /**< The topic names */
+    char** topics;
+
+    /**< The number of topics */
+    size_t count;
+
+} cluster_subs;
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Process callback installed on the server. Runs in a worker. Node
+ * messages update the table or are delivered locally, client messages with a
+ * "to" routing key are published to the cluster, and the rest go to the
+ * server's own process callback.
+ *
+ * @param cnx The connection the message came from
+ * @param m The message
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_process(vws_svr_cnx* cnx, vrtql_msg* m);
+
+/**
+ * @brief Disconnect callback installed on the server. Ends the connection's
+ * subscriptions, then calls the server's own callback. Runs in the network
+ * thread.
+ *
+ * @param cnx The connection
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_disconnect(vws_svr_cnx* cnx);
+
+/**
+ * @brief Handles a message from another node. Frees the message.
+ *
+ * @param c The cluster
+ * @param op The value of its "cluster" routing key
+ * @param m The message
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_node(vrtql_cluster* c, cstr op, vrtql_msg* m);
+
+/**
+ * @brief Looks up a topic, adding it if it is not there and add is true.
+ * Called with the cluster lock held.
+ *
+ * @param c The cluster
+ * @param name The topic name
+ * @param add Whether to add the topic if it is missing
+ * @return The topic, or NULL if it is missing and add is false.
+ *
+ * @ingroup ClusterFunctions
+ */
+static cluster_topic* cluster_topic_get(vrtql_cluster* c, cstr name, bool add);
+
+/**
+ * @brief Removes a topic once no node has subscribers left. Called with the
+ * cluster lock held.
+ *
+ * @param c The cluster
+ * @param t The topic
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_topic_release(vrtql_cluster* c, cluster_topic* t);
+
+/**
+ * @brief Takes a local subscriber off a topic, telling the other nodes if it
+ * was the last. Called with the cluster lock held.
+ *
+ * @param c The cluster
+ * @param name The topic name
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_topic_leave(vrtql_cluster* c, cstr name);
+
+/**
+ * @brief Serializes a node message.
+ *
+ * @param c The cluster
+ * @param op The operation ("hello", "sub" or "unsub")
+ * @param topic The topic, NULL for none
+ * @return The message, serialized
+ *
+ * @ingroup ClusterFunctions
+ */
+static vws_buffer* cluster_node_msg(vrtql_cluster* c, cstr op, cstr topic);
+
+/**
+ * @brief Sends a node message to every other node. Called with the cluster
+ * lock held, so the messages go out in the order the table changed.
+ *
+ * @param c The cluster
+ * @param op The operation
+ * @param topic The topic
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_announce(vrtql_cluster* c, cstr op, cstr topic);
+
+/**
+ * @brief Queues serialized data on a link, or drops it if the link is down.
+ * Takes ownership of the data.
+ *
+ * @param l The link
+ * @param data The data
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_put(vrtql_cluster_link* l, vws_buffer* data);
+
+/**
+ * @brief Connects a link and queues the node's hello and topics on it ahead
+ * of anything else.
+ *
+ * @param l The link
+ * @return True if the link is up
+ *
+ * @ingroup ClusterFunctions
+ */
+static bool cluster_link_connect(vrtql_cluster_link* l);
+
+/**
+ * @brief Checks that an idle link's peer is still there. Nothing is expected
+ * from it, so whatever it has sent is read and thrown away. Called with the
+ * link lock held.
+ *
+ * @param l The link
+ * @return True if the link is still up
+ *
+ * @ingroup ClusterFunctions
+ */
+static bool cluster_link_check(vrtql_cluster_link* l);
+
+/**
+ * @brief Marks a link down and drops what is queued on it. Called with the
+ * link lock held.
+ *
+ * @param l The link
+ * @param lost The number of messages lost besides those queued
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_link_down(vrtql_cluster_link* l, size_t lost);
+
+/**
+ * @brief Link thread. Connects the link, then sends what is queued on it in
+ * batches until the cluster stops.
+ *
+ * @param arg The link
+ *
+ * @ingroup ClusterFunctions
+ */
+static void cluster_link_thread(void* arg);
+
+//------------------------------------------------------------------------------
+// API
+//------------------------------------------------------------------------------
+
+vrtql_cluster* vrtql_cluster_new( vrtql_msg_svr* server,
+                                  cstr* urls,
+                                  size_t n,
+                                  size_t self )
+{
+    if (server == NULL || urls == NULL || n == 0 || n > VRTQL_CLUSTER_MAX)
+    {
+        vws.error(VE_RT, "Invalid cluster");
+        return NULL;
+    }
+
+    if (self >= n)
+    {
+        vws.error(VE_RT, "Node index out of range");
+        return NULL;
+    }
+
+    vrtql_cluster* c = (vrtql_cluster*)vws.calloc(1, sizeof(vrtql_cluster));
+    c->server        = server;
+    c->self          = self;
+    c->size          = n;
+    c->retry         = VRTQL_CLUSTER_RETRY;
+    c->running       = true;
+    c->links         = vws.calloc(n, sizeof(vrtql_cluster_link));
+
+    sc_map_init_sv(&c->topics, 0, 0);
+    sc_map_init_64v(&c->subs, 0, 0);
+    uv_mutex_init(&c->lock);
+
+    // Take over the callbacks
+    vws_tcp_svr* tcp   = (vws_tcp_svr*)server;
+    c->process         = server->process;
+    c->on_disconnect   = tcp->on_disconnect;
+    server->process    = cluster_process;
+    tcp->on_disconnect = cluster_disconnect;
+    server->cluster    = c;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == self)
+        {
+            continue;
+        }
+
+        vrtql_cluster_link* l = &c->links[i];
+        l->cluster            = c;
+        l->url                = vws_strdup(urls[i]);
+        l->cnx                = vws_cnx_new();
+        l->up                 = false;
+        l->dropped            = 0;
+
+        sc_queue_init(&l->queue);
+        uv_mutex_init(&l->lock);
+        uv_cond_init(&l->cond);
+        uv_thread_create(&l->thread, cluster_link_thread, l);
+    }
+
+    vws.success();
+
+    return c;
+}
+
+void vrtql_cluster_free(vrtql_cluster* c)
+{
+    if (c == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&c->running, false, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < c->size; i++)
+    {
+        if (i == c->self)
+        {
+            continue;
+        }
+
+        vrtql_cluster_link* l = &c->links[i];
+
+        uv_mutex_lock(&l->lock);
+        uv_cond_broadcast(&l->cond);
+        uv_mutex_unlock(&l->lock);
+    }
+
+    for (size_t i = 0; i < c->size; i++)
+    {
+        if (i == c->self)
+        {
+            continue;
+        }
+
+        vrtql_cluster_link* l = &c->links[i];
+        uv_thread_join(&l->thread);
+
+        vws_buffer* data;
+        sc_queue_foreach (&l->queue, data)
+        {
+            vws_buffer_free(data);
+        }
+
+        sc_queue_term(&l->queue);
+        vws_disconnect(l->cnx);
+        vws_cnx_free(l->cnx);
+        vws.free(l->url);
+        uv_cond_destroy(&l->cond);
+        uv_mutex_destroy(&l->lock);
+    }
+
+    // Give the server its callbacks back
+    vws_tcp_svr* tcp   = (vws_tcp_svr*)c->server;
+    c->server->process = c->process;
+    tcp->on_disconnect = c->on_disconnect;
+    c->server->cluster = NULL;
+
+    cstr name; cluster_topic* t;
+    sc_map_foreach(&c->topics, name, t)
+    {
+        vws.free(t->name);
+        vws.free(t);
+    }
+
+    uint64_t id; cluster_subs* s;
+    sc_map_foreach(&c->subs, id, s)
+    {
+        for (size_t i = 0; i < s->count; i++)
+        {
+            vws.free(s->topics[i]);
+        }
+
+        vws.free(s->topics);
+        vws.free(s);
+    }
+
+    sc_map_term_sv(&c->topics);
+    sc_map_term_64v(&c->subs);
+    uv_mutex_destroy(&c->lock);
+
+    vws.free(c->links);
+    vws.free(c);
+}
+
+void vrtql_cluster_subscribe(vrtql_cluster* c, vws_svr_cnx* cnx, cstr topic)
+{
+    uv_mutex_lock(&c->lock);
+
+    cluster_subs* s = sc_map_get_64v(&c->subs, cnx->id);
+
+    if (sc_map_found(&c->subs) == false)
+    {
+        s = vws.calloc(1, sizeof(cluster_subs));
+        sc_map_put_64v(&c->subs, cnx->id, s);
+    }
+
+    for (size_t i = 0; i < s->count; i++)
+    {
+        if (strcmp(s->topics[i], topic) == 0)
+        {
+            // Already subscribed
+            uv_mutex_unlock(&c->lock);
+            return;
+        }
+    }
+
+    size_t size           = (s->count + 1) * sizeof(char*);
+    s->topics             = vws.realloc(s->topics, size);
+    s->topics[s->count++] = vws_strdup(topic);
+
+    cluster_topic* t = cluster_topic_get(c, topic, true);
+
+    if (t->local++ == 0)
+    {
+        cluster_announce(c, "sub", topic);
+    }
+
+    uv_mutex_unlock(&c->lock);
+
+    vws_tcp_svr_subscribe(cnx, topic);
+}
+
+void vrtql_cluster_unsubscribe(vrtql_cluster* c, vws_svr_cnx* cnx, cstr topic)
+{
+    uv_mutex_lock(&c->lock);
+
+    cluster_subs* s = sc_map_get_64v(&c->subs, cnx->id);
+
+    if (sc_map_found(&c->subs) == true)
+    {
+        for (size_t i = 0; i < s->count; i++)
+        {
+            if (strcmp(s->topics[i], topic) != 0)
+            {
+                continue;
+            }
+
+            cluster_topic_leave(c, topic);
+
+            vws.free(s->topics[i]);
+            s->topics[i] = s->topics[--s->count];
+
+            break;
+        }
+
+        if (s->count == 0)
+        {
+            sc_map_del_64v(&c->subs, cnx->id);
+            vws.free(s->topics);
+            vws.free(s);
+        }
+    }
+
+    uv_mutex_unlock(&c->lock);
+
+    vws_tcp_svr_unsubscribe(cnx, topic);
+}
+
+void vrtql_cluster_publish(vrtql_cluster* c, cstr topic, vrtql_msg* m)
+{
+    uint32_t local = 0;
+    uint64_t nodes = 0;
+
+    uv_mutex_lock(&c->lock);
+
+    cluster_topic* t = cluster_topic_get(c, topic, false);
+
+    if (t != NULL)
+    {
+        local = t->local;
+        nodes = t->nodes;
+    }
+
+    uv_mutex_unlock(&c->lock);
+
+    if (nodes != 0)
+    {
+        // Serialized once, in the message's own format, and copied to each
+        // node with subscribers
+        vrtql_msg_set_routing(m, "cluster", "msg");
+        vrtql_msg_set_routing(m, "to", topic);
+        vws_buffer* data = vrtql_msg_serialize(m);
+        vrtql_msg_clear_routing(m, "cluster");
+
+        for (size_t i = 0; i < c->size; i++)
+        {
+            if ((nodes & (1ULL << i)) == 0)
+            {
+                continue;
+            }
+
+            vws_buffer* copy = vws_buffer_new();
+            vws_buffer_append(copy, data->data, data->size);
+            cluster_put(&c->links[i], copy);
+        }
+
+        vws_buffer_free(data);
+    }
+
+    if (local > 0)
+    {
+        vrtql_msg_svr_publish(c->server, topic, m);
+    }
+    else
+    {
+        vrtql_msg_free(m);
+    }
+}
+
+size_t vrtql_cluster_up(vrtql_cluster* c)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < c->size; i++)
+    {
+        if (i == c->self)
+        {
+            continue;
+        }
+
+        vrtql_cluster_link* l = &c->links[i];
+
+        uv_mutex_lock(&l->lock);
+        n += (l->up == true);
+        uv_mutex_unlock(&l->lock);
+    }
+
+    return n;
+}
+
+size_t vrtql_cluster_nodes(vrtql_cluster* c, cstr topic)
+{
+    size_t n = 0;
+
+    uv_mutex_lock(&c->lock);
+
+    cluster_topic* t = cluster_topic_get(c, topic, false);
+
+    if (t != NULL)
+    {
+        n = __builtin_popcountll(t->nodes) + (t->local > 0);
+    }
+
+    uv_mutex_unlock(&c->lock);
+
+    return n;
+}
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+void cluster_process(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_cluster* c = ((vrtql_msg_svr*)cnx->server)->cluster;
+
+    cstr op = vrtql_msg_get_routing(m, "cluster");
+
+    if (op != NULL)
+    {
+        cluster_node(c, op, m);
+        return;
+    }
+
+    cstr to = vrtql_msg_get_routing(m, "to");
+
+    if (to == NULL)
+    {
+        c->process(cnx, m);
+        return;
+    }
+
+    // The message may let go of its routing as it is published
+    char* topic = vws_strdup(to);
+    vrtql_cluster_publish(c, topic, m);
+    vws.free(topic);
+}
+
+void cluster_disconnect(vws_svr_cnx* cnx)
+{
+    vrtql_cluster* c = ((vrtql_msg_svr*)cnx->server)->cluster;
+
+    uv_mutex_lock(&c->lock);
+
+    cluster_subs* s = sc_map_get_64v(&c->subs, cnx->id);
+
+    if (sc_map_found(&c->subs) == true)
+    {
+        sc_map_del_64v(&c->subs, cnx->id);
+
+        for (size_t i = 0; i < s->count; i++)
+        {
+            cluster_topic_leave(c, s->topics[i]);
+            vws.free(s->topics[i]);
+        }
+
+        vws.free(s->topics);
+        vws.free(s);
+    }
+
+    uv_mutex_unlock(&c->lock);
+
+    c->on_disconnect(cnx);
+}
+
+void cluster_node(vrtql_cluster* c, cstr op, vrtql_msg* m)
+{
+    if (strcmp(op, "msg") == 0)
+    {
+        // Forwarded by another node: delivered here only, never forwarded on
+        cstr to = vrtql_msg_get_routing(m, "to");
+
+        if (to == NULL)
+        {
+            vrtql_msg_free(m);
+            return;
+        }
+
+        char* topic = vws_strdup(to);
+        vrtql_msg_clear_routing(m, "cluster");
+
+        uv_mutex_lock(&c->lock);
+        cluster_topic* t = cluster_topic_get(c, topic, false);
+        bool local       = (t != NULL && t->local > 0);
+        uv_mutex_unlock(&c->lock);
+
+        if (local == true)
+        {
+            vrtql_msg_svr_publish(c->server, topic, m);
+        }
+        else
+        {
+            vrtql_msg_free(m);
+        }
+
+        vws.free(topic);
+
+        return;
+    }
+
+    cstr node  = vrtql_msg_get_routing(m, "node");
+    cstr topic = vrtql_msg_get_routing(m, "topic");
+    long index = (node != NULL) ? strtol(node, NULL, 10) : -1;
+
+    if (index < 0 || (size_t)index >= c->size || (size_t)index == c->self)
+    {
+        vrtql_msg_free(m);
+        return;
+    }
+
+    uint64_t bit = 1ULL << index;
+
+    uv_mutex_lock(&c->lock);
+
+    if (strcmp(op, "hello") == 0)
+    {
+        // The node has (re)connected and is about to send its topics again
+        cluster_topic** stale = vws.malloc( (sc_map_size_sv(&c->topics) + 1)
+                                            * sizeof(cluster_topic*) );
+        size_t count = 0;
+
+        cstr name; cluster_topic* t;
+        sc_map_foreach(&c->topics, name, t)
+        {
+            t->nodes &= ~bit;
+            stale[count++] = t;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            cluster_topic_release(c, stale[i]);
+        }
+
+        vws.free(stale);
+    }
+    else if (topic != NULL && strcmp(op, "sub") == 0)
+    {
+        cluster_topic_get(c, topic, true)->nodes |= bit;
+    }
+    else if (topic != NULL && strcmp(op, "unsub") == 0)
+    {
+        cluster_topic* t = cluster_topic_get(c, topic, false);
+
+        if (t != NULL)
+        {
+            t->nodes &= ~bit;
+            cluster_topic_release(c, t);
+        }
+    }
+
+    uv_mutex_unlock(&c->lock);
+
+    vrtql_msg_free(m);
+}
+
+cluster_topic* cluster_topic_get(vrtql_cluster* c, cstr name, bool add)
+{
+    cluster_topic* t = sc_map_get_sv(&c->topics, name);
+
+    if (sc_map_found(&c->topics) == true)
+    {
+        return t;
+    }
+
+    if (add == false)
+    {
+        return NULL;
+    }
+
+    t        = vws.malloc(sizeof(cluster_topic));
+    t->name  = vws_strdup(name);
+    t->local = 0;
+    t->nodes = 0;
+
+    sc_map_put_sv(&c->topics, t->name, t);
+
+    return t;
+}
+
+void cluster_topic_release(vrtql_cluster* c, cluster_topic* t)
+{
+    if (t->local > 0 || t->nodes != 0)
+    {
+        return;
+    }
+
+    sc_map_del_sv(&c->topics, t->name);
+    vws.free(t->name);
+    vws.free(t);
+}
+
+void cluster_topic_leave(vrtql_cluster* c, cstr name)
+{
+    cluster_topic* t = cluster_topic_get(c, name, false);
+
+    if (t == NULL || t->local == 0)
+    {
+        return;
+    }
+
+    if (--t->local == 0)
+    {
+        cluster_announce(c, "unsub", name);
+        cluster_topic_release(c, t);
+    }
+}
+
+vws_buffer* cluster_node_msg(vrtql_cluster* c, cstr op, cstr topic)
+{
+    char node[24];
+    snprintf(node, sizeof(node), "%zu", c->self);
+
+    vrtql_msg* m = vrtql_msg_new();
+    vrtql_msg_set_routing(m, "cluster", op);
+    vrtql_msg_set_routing(m, "node", node);
+
+    if (topic != NULL)
+    {
+        vrtql_msg_set_routing(m, "topic", topic);
+    }
+
+    vws_buffer* data = vrtql_msg_serialize(m);
+    vrtql_msg_free(m);
+
+    return data;
+}
+
+void cluster_announce(vrtql_cluster* c, cstr op, cstr topic)
+{
+    for (size_t i = 0; i < c->size; i++)
+    {
+        if (i != c->self)
+        {
+            cluster_put(&c->links[i], cluster_node_msg(c, op, topic));
+        }
+    }
+}
+
+void cluster_put(vrtql_cluster_link* l, vws_buffer* data)
+{
+    uv_mutex_lock(&l->lock);
+
+    if (l->up == true)
+    {
+        sc_queue_add_last(&l->queue, data);
+        uv_cond_signal(&l->cond);
+        data = NULL;
+    }
+    else
+    {
+        l->dropped++;
+    }
+
+    uv_mutex_unlock(&l->lock);
+
+    if (data != NULL)
+    {
+        vws_buffer_free(data);
+    }
+}
+
+bool cluster_link_connect(vrtql_cluster_link* l)
+{
+    vrtql_cluster* c = l->cluster;
+
+    if (vws_connect(l->cnx, l->url) == false)
+    {
+        return false;
+    }
+
+    if (l->cnx->out == NULL)
+    {
+        vws_cnx_cork(l->cnx, 0);
+    }
+
+    // Both locks, so no change to the topics can slip in between the
+    // snapshot and the link coming up
+    uv_mutex_lock(&c->lock);
+    uv_mutex_lock(&l->lock);
+
+    sc_queue_add_last(&l->queue, cluster_node_msg(c, "hello", NULL));
+
+    cstr name; cluster_topic* t;
+    sc_map_foreach(&c->topics, name, t)
+    {
+        if (t->local > 0)
+        {
+            sc_queue_add_last(&l->queue, cluster_node_msg(c, "sub", name));
+        }
+    }
+
+    l->up = true;
+
+    uv_mutex_unlock(&l->lock);
+    uv_mutex_unlock(&c->lock);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "cluster_link_connect(): %s", l->url);
+    }
+
+    return true;
+}
+
+void cluster_link_thread(void* arg)
+{
+    vrtql_cluster_link* l = (vrtql_cluster_link*)arg;
+    vrtql_cluster* c      = l->cluster;
+    vws_buffer** batch    = NULL;
+    size_t room           = 0;
+
+    while (__atomic_load_n(&c->running, __ATOMIC_ACQUIRE) == true)
+    {
+        if (vws_cnx_is_connected(l->cnx) == false)
+        {
+            if (cluster_link_connect(l) == false)
+            {
+                uv_mutex_lock(&l->lock);
+
+                if (__atomic_load_n(&c->running, __ATOMIC_ACQUIRE) == true)
+                {
+                    uint64_t ns = (uint64_t)c->retry * 1000000;
+                    uv_cond_timedwait(&l->cond, &l->lock, ns);
+                }
+
+                uv_mutex_unlock(&l->lock);
+
+                continue;
+            }
+        }
+
+        uv_mutex_lock(&l->lock);
+
+        while ( sc_queue_size(&l->queue) == 0 &&
+                __atomic_load_n(&c->running, __ATOMIC_ACQUIRE) == true )
+        {
+            uint64_t ns = (uint64_t)c->retry * 1000000;
+
+            if ( uv_cond_timedwait(&l->cond, &l->lock, ns) == UV_ETIMEDOUT &&
+                 cluster_link_check(l) == false )
+            {
+                break;
+            }
+        }
+
+        if (l->up == false)
+        {
+            uv_mutex_unlock(&l->lock);
+            continue;
+        }
+
+        // Take everything queued since the last write
+        size_t count = sc_queue_size(&l->queue);
+
+        if (count > room)
+        {
+            room  = count * 2;
+            batch = vws.realloc(batch, room * sizeof(vws_buffer*));
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            batch[i] = sc_queue_del_first(&l->queue);
+        }
+
+        uv_mutex_unlock(&l->lock);
+
+        bool ok = true;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            vws_buffer* data = batch[i];
+
+            if (ok == true)
+            {
+                ok = vws_msg_send_binary(l->cnx, data->data, data->size) >= 0;
+            }
+
+            vws_buffer_free(data);
+        }
+
+        if (ok == true && count > 0)
+        {
+            ok = vws_cnx_flush(l->cnx) >= 0;
+        }
+
+        if (ok == false)
+        {
+            uv_mutex_lock(&l->lock);
+            cluster_link_down(l, count);
+            uv_mutex_unlock(&l->lock);
+
+            vws_disconnect(l->cnx);
+        }
+    }
+
+    vws.free(batch);
+}
+
+bool cluster_link_check(vrtql_cluster_link* l)
+{
+    vws_socket* s   = (vws_socket*)l->cnx;
+    bool want_write = false;
+
+    if (vws_socket_read_ready(s, &want_write) < 0)
+    {
+        // Closed by the peer, and by the read
+        cluster_link_down(l, 0);
+        return false;
+    }
+
+    vws_buffer_clear(s->buffer);
+
+    return true;
+}
+
+void cluster_link_down(vrtql_cluster_link* l, size_t lost)
+{
+    l->up       = false;
+    l->dropped += lost + sc_queue_size(&l->queue);
+
+    vws_buffer* data;
+    sc_queue_foreach (&l->queue, data)
+    {
+        vws_buffer_free(data);
+    }
+
+    sc_queue_clear(&l->queue);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "cluster_link_down(): %s", l->url);
+    }
+}
@@ -0,0 +1,221 @@
+#ifndef VRTQL_CLUSTER_DECLARE
+#define VRTQL_CLUSTER_DECLARE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "server.h"
+
+/**
+ * @file cluster.h
+ * @brief Routing vrtql messages across message server nodes
+ *
+ * A cluster joins several vrtql_msg_svr processes, on one host or many, so
+ * that clients connected to different nodes can message each other. Clients
+ * are addressed by topic: a connection subscribes to a topic with
+ * vrtql_cluster_subscribe(), and a message whose "to" routing key names the
+ * topic goes to every subscriber, whichever node it is on.
+ *
+ * Each node keeps a WebSocket link to every other node, connecting as a
+ * client to the peer's message server. A thread per link sends whatever has
+ * queued up for it since its last write, corked, so a busy link sends many
+ * messages per system call. Links that drop are reconnected every
+ * VRTQL_CLUSTER_RETRY milliseconds. What is queued for a link that is down is
+ * dropped: delivery is at most once.
+ *
+ * Nodes tell each other which topics they have subscribers for. Each keeps a
+ * table of the topics subscribed anywhere and the nodes they are subscribed
+ * on, so a message only crosses to the nodes that want it, and only once per
+ * node however many subscribers it has there. On connecting, a link tells the
+ * peer to drop what it knew of the node and sends it the node's topics again.
+ *
+ * Node messages are vrtql messages with a "cluster" routing key. The server
+ * does not tell them from client messages, so node ports must only be
+ * reachable by the nodes and their clients.
+ *
+ * The cluster takes over the server's process callback, and hands it every
+ * message that is not routed. It does not work with process_batch.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most nodes in a cluster */
+#define VRTQL_CLUSTER_MAX 64
+
+/** Milliseconds between attempts to reconnect a link */
+#define VRTQL_CLUSTER_RETRY 1000
+
+/**
+ * @brief A link to another node.
+ */
+typedef struct vrtql_cluster_link
+{
+    /**< The cluster */
+    struct vrtql_cluster* cluster;
+
+    /**< The peer's URL */
+    char* url;
+
+    /**< The connection to the peer */
+    vws_cnx* cnx;
+
+    /**< Serialized messages waiting to be sent (vws_buffer), oldest first */
+    struct sc_queue_ptr queue;
+
+    /**< Whether the link is connected. Messages are only queued while it
+     * is. */
+    bool up;
+
+    /**< Messages dropped because the link was down or failed */
+    uint64_t dropped;
+
+    /**< Guards queue, up and dropped */
+    uv_mutex_t lock;
+
+    /**< Signalled when there is something to send, or the cluster stops */
+    uv_cond_t cond;
+
+    /**< The thread sending on the link */
+    uv_thread_t thread;
+
+} vrtql_cluster_link;
+
+/**
+ * @brief A node in a cluster.
+ */
+typedef struct vrtql_cluster
+{
+    /**< The node's message server */
+    vrtql_msg_svr* server;
+
+    /**< The node's index in the cluster */
+    size_t self;
+
+    /**< The number of nodes */
+    size_t size;
+
+    /**< A link to each node, by index. The node's own is unused. */
+    vrtql_cluster_link* links;
+
+    /**< Topics subscribed on any node, by name (cluster_topic) */
+    struct sc_map_sv topics;
+
+    /**< Topics each local connection is subscribed to, by connection ID
+     * (cluster_subs) */
+    struct sc_map_64v subs;
+
+    /**< Guards topics and subs */
+    uv_mutex_t lock;
+
+    /**< Milliseconds between attempts to reconnect a link. Default
+     * VRTQL_CLUSTER_RETRY. */
+    uint32_t retry;
+
+    /**< Whether the link threads are to keep running */
+    bool running;
+
+    /**< The server's process callback, for messages that are not routed */
+    vrtql_svr_process_msg process;
+
+    /**< The server's disconnect callback */
+    vws_tcp_svr_disconnect on_disconnect;
+
+} vrtql_cluster;
+
+/**
+ * @brief Makes a message server a node of a cluster and starts linking to
+ * the other nodes. Call it before the server runs. Every node is given the
+ * same list of URLs.
+ *
+ * @param server The server, with its process callback set. The callback is
+ *   taken over and called for messages that are not routed.
+ * @param urls The WebSocket URL of each node
+ * @param n The number of nodes, at most VRTQL_CLUSTER_MAX
+ * @param self The index of this node in urls
+ * @return The cluster, or NULL if the arguments are invalid.
+ *
+ * @ingroup ClusterFunctions
+ */
+vrtql_cluster* vrtql_cluster_new( vrtql_msg_svr* server,
+                                  cstr* urls,
+                                  size_t n,
+                                  size_t self );
+
+/**
+ * @brief Stops the links and frees a cluster. The server gets its callbacks
+ * back. Call it once the server has stopped.
+ *
+ * @param c The cluster.
+ *
+ * @ingroup ClusterFunctions
+ */
+void vrtql_cluster_free(vrtql_cluster* c);
+
+/**
+ * @brief Subscribes a connection to a topic (as vws_tcp_svr_subscribe()) and
+ * tells the other nodes if it is the node's first subscriber.
+ *
+ * @param c The cluster.
+ * @param cnx The connection.
+ * @param topic The topic.
+ *
+ * @ingroup ClusterFunctions
+ */
+void vrtql_cluster_subscribe(vrtql_cluster* c, vws_svr_cnx* cnx, cstr topic);
+
+/**
+ * @brief Unsubscribes a connection from a topic, telling the other nodes if
+ * it was the node's last subscriber. Subscriptions also end when the
+ * connection closes.
+ *
+ * @param c The cluster.
+ * @param cnx The connection.
+ * @param topic The topic.
+ *
+ * @ingroup ClusterFunctions
+ */
+void vrtql_cluster_unsubscribe(vrtql_cluster* c, vws_svr_cnx* cnx, cstr topic);
+
+/**
+ * @brief Sends a message to every subscriber of a topic in the cluster. This
+ * is what happens to a message from a client with a "to" routing key. It can
+ * be called from any thread. This TAKES OWNERSHIP of the message.
+ *
+ * @param c The cluster.
+ * @param topic The topic.
+ * @param m The message.
+ *
+ * @ingroup ClusterFunctions
+ */
+void vrtql_cluster_publish(vrtql_cluster* c, cstr topic, vrtql_msg* m);
+
+/**
+ * @brief Returns the number of links that are connected.
+ *
+ * @param c The cluster.
+ * @return The number of links up, at most size - 1.
+ *
+ * @ingroup ClusterFunctions
+ */
+size_t vrtql_cluster_up(vrtql_cluster* c);
+
+/**
+ * @brief Returns the number of nodes a topic has subscribers on, as far as
+ * this node knows.
+ *
+ * @param c The cluster.
+ * @param topic The topic.
+ * @return The number of nodes, this one included.
+ *
+ * @ingroup ClusterFunctions
+ */
+size_t vrtql_cluster_nodes(vrtql_cluster* c, cstr topic);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VRTQL_CLUSTER_DECLARE */
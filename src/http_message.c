@@ -1,5 +1,6 @@
 #include <ctype.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "http_message.h"
 
@@ -64,6 +65,79 @@ static int on_header_value(llhttp_t* p, cstr at, size_t l);
  */
 static int on_body(llhttp_t* p, cstr at, size_t l);
 
+/**
+ * @brief Handshake mode on_header_field: collects the header name.
+ * @param p The HTTP parser instance.
+ * @param at Pointer to the header field data.
+ * @param l Length of the header field data.
+ * @return 0 to continue parsing.
+ */
+static int hs_on_header_field(llhttp_t* p, cstr at, size_t l);
+
+/**
+ * @brief Handshake mode on_header_field_complete: decides whether the value
+ * that follows is one we record.
+ * @param p The HTTP parser instance.
+ * @return 0 to continue parsing.
+ */
+static int hs_on_header_field_complete(llhttp_t* p);
+
+/**
+ * @brief Handshake mode on_header_value: extends the span of a recorded
+ * header.
+ * @param p The HTTP parser instance.
+ * @param at Pointer to the header value data.
+ * @param l Length of the header value data.
+ * @return 0 to continue parsing.
+ */
+static int hs_on_header_value(llhttp_t* p, cstr at, size_t l);
+
+/**
+ * @brief Handshake mode on_header_value_complete: resets for the next header.
+ * @param p The HTTP parser instance.
+ * @return 0 to continue parsing.
+ */
+static int hs_on_header_value_complete(llhttp_t* p);
+
+/**
+ * @brief Handshake mode on_url: extends the URL span.
+ * @param p The HTTP parser instance.
+ * @param at Pointer to the URL data.
+ * @param l Length of the URL data.
+ * @return 0 to continue parsing.
+ */
+static int hs_on_url(llhttp_t* p, cstr at, size_t l);
+
+/**
+ * @brief Handshake mode on_headers_complete.
+ * @param p The HTTP parser instance.
+ * @return 0 to continue parsing.
+ */
+static int hs_on_headers_complete(llhttp_t* p);
+
+/** Settings for handshake mode. They are the same for every parser, so they
+ * are shared. */
+static llhttp_settings_t handshake_settings =
+{
+    .on_url                   = hs_on_url,
+    .on_header_field          = hs_on_header_field,
+    .on_header_field_complete = hs_on_header_field_complete,
+    .on_header_value          = hs_on_header_value,
+    .on_header_value_complete = hs_on_header_value_complete,
+    .on_headers_complete      = hs_on_headers_complete,
+    .on_message_complete      = on_message_complete
+};
+
+/** Lowercase names of the headers handshake mode records, by
+ * vws_http_header_t. */
+static cstr handshake_names[VWS_HTTP_URL] =
+{
+    "sec-websocket-key",
+    "sec-websocket-protocol",
+    "sec-websocket-extensions",
+    "upgrade"
+};
+
 //------------------------------------------------------------------------------
 // HTTP Request
 //------------------------------------------------------------------------------
@@ -114,6 +188,14 @@ vws_http_msg* vws_http_msg_new(int mode)
     req->value            = vws_buffer_new();
     req->headers_complete = false;
     req->done             = false;
+    req->handshake        = false;
+    req->parsed           = 0;
+    req->origin           = NULL;
+    req->current          = -1;
+    req->in_value         = false;
+    req->name_size        = 0;
+
+    memset(req->spans, 0, sizeof(req->spans));
 
     llhttp_settings_init(req->settings);
 
@@ -133,6 +215,80 @@ vws_http_msg* vws_http_msg_new(int mode)
     return req;
 }
 
+vws_http_msg* vws_http_msg_handshake_new()
+{
+    // The parser lives in the same block, just after the message
+    vws_http_msg* req     = vws.malloc(sizeof(vws_http_msg) + sizeof(llhttp_t));
+    req->parser           = (llhttp_t*)(req + 1);
+    req->settings         = &handshake_settings;
+    req->url              = NULL;
+    req->body             = NULL;
+    req->field            = NULL;
+    req->value            = NULL;
+    req->headers_complete = false;
+    req->done             = false;
+    req->handshake        = true;
+    req->parsed           = 0;
+    req->origin           = NULL;
+    req->current          = -1;
+    req->in_value         = false;
+    req->name_size        = 0;
+
+    memset(req->spans, 0, sizeof(req->spans));
+
+    llhttp_init(req->parser, HTTP_REQUEST, req->settings);
+    req->parser->data = req;
+
+    // An empty map takes no memory
+    sc_map_init_str(&req->headers, 0, 0);
+
+    return req;
+}
+
+cstr vws_http_msg_span( vws_http_msg* req,
+                        cstr data,
+                        vws_http_header_t h,
+                        char* out,
+                        size_t size )
+{
+    vws_http_span* span = &req->spans[h];
+
+    if (span->size == 0 || span->size >= size)
+    {
+        return NULL;
+    }
+
+    memcpy(out, data + span->offset, span->size);
+    out[span->size] = '\0';
+
+    return out;
+}
+
+bool vws_http_msg_headers(vws_http_msg* req, cstr data, size_t size)
+{
+    if (req->handshake == false || sc_map_size_str(&req->headers) > 0)
+    {
+        return true;
+    }
+
+    // Parse the request again in full and take its headers
+    vws_http_msg* full = vws_http_msg_new(HTTP_REQUEST);
+
+    if (vws_http_msg_parse(full, data, size) < 0)
+    {
+        vws_http_msg_free(full);
+        return false;
+    }
+
+    sc_map_term_str(&req->headers);
+    req->headers = full->headers;
+    sc_map_init_str(&full->headers, 0, 0);
+
+    vws_http_msg_free(full);
+
+    return true;
+}
+
 void vws_http_msg_free(vws_http_msg* req)
 {
     if (req == NULL)
@@ -148,6 +304,14 @@ void vws_http_msg_free(vws_http_msg* req)
     }
 
     sc_map_term_str(&req->headers);
+
+    if (req->handshake == true)
+    {
+        // Parser is part of the block, settings are shared
+        vws.free(req);
+        return;
+    }
+
     vws_buffer_free(req->url);
     vws_buffer_free(req->body);
     vws_buffer_free(req->field);
@@ -218,9 +382,124 @@ int on_body(llhttp_t* p, cstr at, size_t l)
     return 0;
 }
 
+int hs_on_header_field(llhttp_t* p, cstr at, size_t l)
+{
+    vws_http_msg* req = p->data;
+
+    // A name too long to be one of ours is marked as not fitting
+    if (req->name_size + l > sizeof(req->name))
+    {
+        req->name_size = sizeof(req->name) + 1;
+        return 0;
+    }
+
+    memcpy(req->name + req->name_size, at, l);
+    req->name_size += l;
+
+    return 0;
+}
+
+int hs_on_header_field_complete(llhttp_t* p)
+{
+    vws_http_msg* req = p->data;
+    req->current      = -1;
+
+    for (int i = 0; i < VWS_HTTP_URL; i++)
+    {
+        size_t n = strlen(handshake_names[i]);
+
+        if (req->name_size != n)
+        {
+            continue;
+        }
+
+        size_t j = 0;
+        while (j < n && tolower(req->name[j]) == handshake_names[i][j])
+        {
+            j++;
+        }
+
+        if (j == n)
+        {
+            req->current       = i;
+            req->spans[i].size = 0;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int hs_on_header_value(llhttp_t* p, cstr at, size_t l)
+{
+    vws_http_msg* req = p->data;
+
+    if (req->current < 0)
+    {
+        return 0;
+    }
+
+    vws_http_span* span = &req->spans[req->current];
+
+    // The value may arrive in pieces, but it is contiguous in the data
+    if (req->in_value == false)
+    {
+        req->in_value = true;
+        span->offset  = (uint32_t)(at - req->origin);
+    }
+
+    span->size += l;
+
+    return 0;
+}
+
+int hs_on_header_value_complete(llhttp_t* p)
+{
+    vws_http_msg* req = p->data;
+    req->current      = -1;
+    req->in_value     = false;
+    req->name_size    = 0;
+
+    return 0;
+}
+
+int hs_on_url(llhttp_t* p, cstr at, size_t l)
+{
+    vws_http_msg* req   = p->data;
+    vws_http_span* span = &req->spans[VWS_HTTP_URL];
+
+    if (span->size == 0)
+    {
+        span->offset = (uint32_t)(at - req->origin);
+    }
+
+    span->size += l;
+
+    return 0;
+}
+
+int hs_on_headers_complete(llhttp_t* p)
+{
+    vws_http_msg* req     = p->data;
+    req->headers_complete = true;
+
+    return 0;
+}
+
 int vws_http_msg_parse(vws_http_msg* req, cstr data, size_t size)
 {
-    enum llhttp_errno rc = llhttp_execute(req->parser, data, size);
+    size_t skip = 0;
+
+    if (req->handshake == true)
+    {
+        // The data starts where it did last time. Parse only what is new.
+        req->origin = data;
+        skip        = req->parsed;
+        req->parsed = size;
+    }
+
+    enum llhttp_errno rc;
+    rc = llhttp_execute(req->parser, data + skip, size - skip);
 
     if (rc != HPE_OK)
     {
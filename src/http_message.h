@@ -8,6 +8,45 @@
 extern "C" {
 #endif
 
+/**
+ * @brief The parts of a request recorded by a handshake parser.
+ */
+typedef enum
+{
+    /** Sec-WebSocket-Key */
+    VWS_HTTP_KEY,
+
+    /** Sec-WebSocket-Protocol */
+    VWS_HTTP_PROTOCOL,
+
+    /** Sec-WebSocket-Extensions */
+    VWS_HTTP_EXTENSIONS,
+
+    /** Upgrade */
+    VWS_HTTP_UPGRADE,
+
+    /** The request target (URL). Not a header. */
+    VWS_HTTP_URL,
+
+    /** The number of recorded parts */
+    VWS_HTTP_SPANS
+
+} vws_http_header_t;
+
+/**
+ * @brief Where a header value or the URL lies in the data given to the
+ * parser.
+ */
+typedef struct vws_http_span
+{
+    /**< Offset from the start of the data. */
+    uint32_t offset;
+
+    /**< Length of the value. 0 if the header was not seen. */
+    uint32_t size;
+
+} vws_http_span;
+
 /**
  * @struct vws_http_msg
  * @brief Structure representing an HTTP request
@@ -41,6 +80,34 @@ typedef struct vws_http_msg
     /** Flag indicates a complete message has been parsed. */
     bool done;
 
+    /**< Handshake mode. Only the headers in spans are recorded, and nothing
+     * else is copied. url, body, field and value are NULL and headers stays
+     * empty until vws_http_msg_headers() is called. */
+    bool handshake;
+
+    /**< Handshake mode: the recorded headers. */
+    vws_http_span spans[VWS_HTTP_SPANS];
+
+    /**< Handshake mode: bytes of the data already parsed. */
+    size_t parsed;
+
+    /**< Handshake mode: the data being parsed, which spans are relative to. */
+    cstr origin;
+
+    /**< Handshake mode: the span the current header value goes into, or -1
+     * if the header is not one we record. */
+    int8_t current;
+
+    /**< Handshake mode: true once the current header's value has started. */
+    bool in_value;
+
+    /**< Handshake mode: the current header name, as much as fits. */
+    char name[32];
+
+    /**< Handshake mode: length of name. Past sizeof(name) when it did not
+     * fit, which matches nothing. */
+    uint8_t name_size;
+
 } vws_http_msg;
 
 /**
@@ -51,6 +118,46 @@ typedef struct vws_http_msg
  */
 vws_http_msg* vws_http_msg_new(int mode);
 
+/**
+ * @brief Creates a parser for a WebSocket upgrade request. Rather than
+ * copying the URL and every header, it records where the few headers the
+ * handshake needs lie in the data (see vws_http_span), and takes a single
+ * allocation.
+ *
+ * Each call to vws_http_msg_parse() must pass all of the request received so
+ * far, from the same start. Only the bytes not seen before are parsed, and
+ * the data must stay put until the spans have been read.
+ *
+ * @return The newly created vws_http_msg instance.
+ */
+vws_http_msg* vws_http_msg_handshake_new();
+
+/**
+ * @brief Copies a header recorded by a handshake parser.
+ * @param req The vws_http_msg instance.
+ * @param data The data given to vws_http_msg_parse().
+ * @param h The header.
+ * @param out Receives the NUL-terminated value.
+ * @param size The size of out.
+ * @return out, or NULL if the header was not seen or does not fit.
+ */
+cstr vws_http_msg_span( vws_http_msg* req,
+                        cstr data,
+                        vws_http_header_t h,
+                        char* out,
+                        size_t size );
+
+/**
+ * @brief Builds the full header map of a request parsed in handshake mode,
+ * for when an application wants more than the recorded headers. Does
+ * nothing if the map is already built.
+ * @param req The vws_http_msg instance.
+ * @param data The data given to vws_http_msg_parse().
+ * @param size The size of the data.
+ * @return True on success, false if the data does not parse.
+ */
+bool vws_http_msg_headers(vws_http_msg* req, cstr data, size_t size);
+
 /**
  * @brief Parses the provided data as an HTTP request.
  * @param req The vws_http_msg instance.
@@ -18,7 +18,9 @@
  * @param map The map to populate with parsed key-value pairs.
  * @return True if the parsing was successful, false otherwise.
  */
-static bool msg_parse_map(mpack_reader_t* reader, struct sc_map_str* map);
+static bool msg_parse_map( mpack_reader_t* reader,
+                           vrtql_msg* msg,
+                           struct sc_map_str* map );
 
 /**
  * @brief Parses content from a MessagePack reader into a buffer.
@@ -27,9 +29,251 @@ static bool msg_parse_map(mpack_reader_t* reader, struct sc_map_str* map);
  *
  * @param reader The MessagePack reader from which to parse the content.
  * @param buffer The buffer to which the parsed content will be appended.
+ * @param borrow If not NULL, the content is not copied. This is set to point
+ *   at it in the reader's data instead.
  * @return An integer indicating the status of the operation.
  */
-static int32_t msg_parse_content(mpack_reader_t* reader, vws_buffer* buffer);
+static int32_t msg_parse_content( mpack_reader_t* reader,
+                                  vws_buffer* buffer,
+                                  cstr* borrow );
+
+/**
+ * @brief Deserializes a message.
+ *
+ * @param msg The message.
+ * @param data The serialized message.
+ * @param length The length of data.
+ * @param source If not NULL, the buffer data is in. MessagePack content is
+ *   then taken from it rather than copied: the two buffers are swapped.
+ * @return true on success, false on failure.
+ */
+static bool msg_deserialize( vrtql_msg* msg,
+                             ucstr data,
+                             size_t length,
+                             vws_buffer* source );
+
+/**
+ * @brief Computes the exact MessagePack encoding size of a message.
+ *
+ * @param msg The message.
+ * @return The number of bytes msg_mpack_write() will produce.
+ */
+static size_t msg_mpack_size(vrtql_msg* msg);
+
+/**
+ * @brief Encodes a message as MessagePack in a single pass into memory of
+ * exactly the size given by msg_mpack_size(). Entry counts come from the maps,
+ * so nothing is buffered to count them.
+ *
+ * @param msg The message.
+ * @param data The destination.
+ * @param size The size of data.
+ * @return true on success, false on failure (vws.e has the details).
+ */
+static bool msg_mpack_write(vrtql_msg* msg, ucstr data, size_t size);
+
+/**
+ * @brief Computes the size of a message in JSON, not counting escapes.
+ *
+ * @param msg The message.
+ * @return The number of bytes the JSON will take at least.
+ */
+static size_t msg_json_size(vrtql_msg* msg);
+
+/**
+ * @brief Appends a map to a buffer as a JSON object.
+ *
+ * @param buffer The buffer.
+ * @param map The map.
+ */
+static void msg_json_map(vws_buffer* buffer, struct sc_map_str* map);
+
+/**
+ * @brief Appends a string to a buffer as a quoted, escaped JSON string.
+ *
+ * @param buffer The buffer.
+ * @param data The string. It need not be NUL-terminated.
+ * @param size The length of the string.
+ */
+static void msg_json_str(vws_buffer* buffer, cstr data, size_t size);
+
+/**
+ * @brief Finds the three elements of a JSON message array without parsing
+ * them: just enough scanning to match up quotes, braces and brackets.
+ *
+ * @param data The JSON.
+ * @param size The length of data.
+ * @param at Set to the start and end offsets of routing, headers and content.
+ * @return true if data is an array of three elements, false otherwise.
+ */
+static bool msg_json_split(cstr data, size_t size, size_t at[3][2]);
+
+/**
+ * @brief Skips over one JSON value.
+ *
+ * @param data The JSON.
+ * @param size The length of data.
+ * @param pos The offset of the value's first character. Set to the offset
+ *   just past it.
+ * @return true on success, false if the value runs off the end.
+ */
+static bool msg_json_skip(cstr data, size_t size, size_t* pos);
+
+/**
+ * @brief Deserializes a JSON message whose content is raw JSON. Routing and
+ * headers are parsed. The content is kept as the bytes it came in as.
+ *
+ * @param msg The message.
+ * @param data The JSON.
+ * @param at The element offsets from msg_json_split().
+ * @param source If not NULL, the buffer data is in. The content is then taken
+ *   from it rather than copied.
+ * @return true on success, false on failure.
+ */
+static bool msg_json_raw( vrtql_msg* msg,
+                          cstr data,
+                          size_t at[3][2],
+                          vws_buffer* source );
+
+/**
+ * @brief Copies the members of a JSON object into a message map.
+ *
+ * @param msg The message.
+ * @param map The map.
+ * @param object The JSON object.
+ * @return true on success, false if object is not an object.
+ */
+static bool msg_json_parse_map( vrtql_msg* msg,
+                                struct sc_map_str* map,
+                                yyjson_val* object );
+
+/**
+ * @brief Makes a source buffer the message content without copying. The
+ * buffers are swapped and the cursor moved up to the content.
+ *
+ * @param msg The message.
+ * @param source The buffer holding the serialized message.
+ * @param data Where the content starts in source.
+ * @param size The length of the content.
+ */
+static void msg_adopt_content( vrtql_msg* msg,
+                               vws_buffer* source,
+                               cstr data,
+                               size_t size );
+
+/**
+ * @brief Parses a JSON object held in part of a larger document into a
+ * message map.
+ *
+ * @param msg The message.
+ * @param map The map.
+ * @param json Where the object starts.
+ * @param size The length of the object.
+ * @return true on success, false if it is not an object.
+ */
+static bool msg_json_map_at( vrtql_msg* msg,
+                             struct sc_map_str* map,
+                             cstr json,
+                             size_t size );
+
+/**
+ * @brief Deserializes the routing map of a message and keeps the rest for
+ * msg_decode().
+ *
+ * @param msg The message.
+ * @param data The serialized message.
+ * @param length The length of data.
+ * @param source If not NULL, the buffer data is in. It is taken over rather
+ *   than copied: the two buffers are swapped.
+ * @return true on success, false on failure.
+ */
+static bool msg_deserialize_lazy( vrtql_msg* msg,
+                                  ucstr data,
+                                  size_t length,
+                                  vws_buffer* source );
+
+/**
+ * @brief Decodes the headers and content of a lazy message from its raw bytes
+ * if it is still lazy. Called by everything that reads or changes them.
+ *
+ * @param msg The message.
+ * @return true on success or if there was nothing to do, false on failure.
+ */
+static bool msg_decode(vrtql_msg* msg);
+
+/**
+ * @brief Drops the raw bytes of a lazy message without decoding them, for when
+ * everything is about to be replaced.
+ *
+ * @param msg The message.
+ */
+static void msg_drop_raw(vrtql_msg* msg);
+
+/**
+ * @brief Checks whether a message can be serialized by copying its raw bytes:
+ * it is still lazy and its format has not been changed.
+ *
+ * @param msg The message.
+ * @return true if the raw bytes can be sent as they are.
+ */
+static bool msg_raw_usable(vrtql_msg* msg);
+
+/**
+ * @brief Copies a string into the message's storage. Common strings are
+ * interned instead of copied.
+ *
+ * @param msg The message.
+ * @param data The string. It need not be NUL-terminated.
+ * @param size The length of the string.
+ * @return The copy.
+ */
+static char* msg_strndup(vrtql_msg* msg, cstr data, size_t size);
+
+/**
+ * @brief Releases a string held in one of the message's maps. Strings in the
+ * message's storage go with it. Anything else was put there from outside
+ * (directly with vws_map_set()) and is freed.
+ *
+ * @param msg The message.
+ * @param ptr The string.
+ */
+static void msg_release(vrtql_msg* msg, cstr ptr);
+
+/**
+ * @brief Frees the message's overflow storage and empties its arena. Only
+ * call this when both maps are empty.
+ *
+ * @param msg The message.
+ */
+static void msg_arena_reset(vrtql_msg* msg);
+
+/**
+ * @brief yyjson allocator over the vws hooks, so JSON documents are counted
+ * and replaced along with everything else. Documents only live for the call
+ * that makes them, so they come from vws.arena when it is set.
+ */
+static void* msg_json_malloc(void* ctx, size_t size);
+static void* msg_json_realloc(void* ctx, void* ptr, size_t old, size_t size);
+static void msg_json_free(void* ctx, void* ptr);
+
+static const yyjson_alc msg_json_alc =
+{
+    msg_json_malloc,
+    msg_json_realloc,
+    msg_json_free,
+    NULL
+};
+
+/**
+ * @brief Strings common enough to intern rather than copy: the keys used by
+ * RPC and the usual success code. NUL-separated, indexed by msg_interned_at.
+ */
+static const char msg_interned[] = "id\0tag\0rc\0msg\0cid\0" "0";
+
+static const uint8_t msg_interned_at[] = { 0, 3, 7, 10, 14, 18 };
+
+// The first byte of every MessagePack message. See msg_deserialize().
+static const unsigned char msg_magic = (unsigned char)(0x90u | 3);
 
 //------------------------------------------------------------------------------
 // API functions
@@ -37,13 +281,29 @@ static int32_t msg_parse_content(mpack_reader_t* reader, vws_buffer* buffer);
 
 vrtql_msg* vrtql_msg_new()
 {
-    vrtql_msg* msg = vws.calloc(1, sizeof(vrtql_msg));
+    // Not calloc(): the arena needs no clearing.
+    vrtql_msg* msg;
+    uint64_t flags = 0;
+
+    if (vws.arena != NULL)
+    {
+        msg   = vws_arena_alloc(vws.arena, sizeof(vrtql_msg));
+        flags = VM_MSG_ARENA;
+    }
+    else
+    {
+        msg   = vws.malloc(sizeof(vrtql_msg));
+    }
 
     sc_map_init_str(&msg->routing, 0, 0);
     sc_map_init_str(&msg->headers, 0, 0);
-    msg->content = vws_buffer_new();
-    msg->flags   = 0;
-    msg->format  = VM_MPACK_FORMAT;
+    msg->content    = vws_buffer_new();
+    msg->flags      = flags;
+    msg->format     = VM_MPACK_FORMAT;
+    msg->arena_used = 0;
+    msg->blocks     = NULL;
+    msg->raw        = NULL;
+    msg->raw_at     = 0;
 
     vws_set_flag(&msg->flags, VM_MSG_VALID);
 
@@ -58,15 +318,23 @@ void vrtql_msg_free(vrtql_msg* msg)
         return;
     }
 
-    vws_map_clear(&msg->routing);
-    vws_map_clear(&msg->headers);
+    msg_drop_raw(msg);
+
+    vrtql_msg_map_clear(msg, &msg->routing);
+    vrtql_msg_map_clear(msg, &msg->headers);
 
     sc_map_term_str(&msg->routing);
     sc_map_term_str(&msg->headers);
 
+    msg_arena_reset(msg);
+
     vws_buffer_free(msg->content);
 
-    vws.free(msg);
+    if (vws_is_flag(&msg->flags, VM_MSG_ARENA) == false)
+    {
+        vws.free(msg);
+    }
+
     msg = NULL;
 }
 
@@ -77,136 +345,197 @@ vws_buffer* vrtql_msg_serialize(vrtql_msg* msg)
         return false;
     }
 
-    if (msg->format == VM_MPACK_FORMAT)
+    if (msg_raw_usable(msg) == true)
     {
-        // Serialize MessagePack
-
-        // Buffer to hold data
+        // Untouched since it came in. Send the bytes it came in as.
         vws_buffer* buffer = vws_buffer_new();
+        vws_buffer_append(buffer, msg->raw->data, msg->raw->size);
 
-        // Initialize writer
+        return buffer;
+    }
 
-        cstr key; cstr value;
-        mpack_writer_t writer;
-        mpack_writer_init_growable(&writer, (char**)&buffer->data, &buffer->size);
+    if (msg_decode(msg) == false)
+    {
+        // Error already set
+        return NULL;
+    }
 
-        // Binary is an array of 3 elements: routing, headers, content.
-        mpack_start_array(&writer, 3);
+    if (msg->format == VM_MPACK_FORMAT)
+    {
+        // Serialize MessagePack into a buffer of exactly the right size
 
-        // Generate routing
+        size_t size        = msg_mpack_size(msg);
+        vws_buffer* buffer = vws_buffer_new();
+        buffer->data       = vws.malloc(size);
+        buffer->allocated  = size;
 
-        mpack_build_map(&writer);
-        sc_map_foreach(&msg->routing, key, value)
+        if (msg_mpack_write(msg, buffer->data, size) == false)
         {
-            mpack_write_cstr(&writer, key);
-            mpack_write_cstr(&writer, value);
+            vws_buffer_free(buffer);
+            return NULL;
         }
-        mpack_complete_map(&writer);
 
-        // Generate headers
+        buffer->size = size;
 
-        mpack_build_map(&writer);
-        sc_map_foreach(&msg->headers, key, value)
-        {
-            mpack_write_cstr(&writer, key);
-            mpack_write_cstr(&writer, value);
-        }
-        mpack_complete_map(&writer);
+        return buffer;
+    }
 
-        // Create content
+    if (msg->format == VM_JSON_FORMAT)
+    {
+        // Serialize JSON straight into the buffer. The content is escaped as
+        // it is copied, so it is copied once.
 
-        int size  = msg->content->size;
-        cstr data = (cstr)msg->content->data;
-        mpack_write_bin(&writer, data, size);
+        vws_buffer* buffer = vws_buffer_new();
 
-        // Close array
-        mpack_finish_array(&writer);
+        // Room for everything unescaped. Escapes are rare, growing is fine.
+        vws_buffer_reserve(buffer, msg_json_size(msg));
 
-        // Cleanup
+        vws_buffer_append(buffer, (ucstr)"[", 1);
+        msg_json_map(buffer, &msg->routing);
+        vws_buffer_append(buffer, (ucstr)",", 1);
+        msg_json_map(buffer, &msg->headers);
+        vws_buffer_append(buffer, (ucstr)",", 1);
 
-        mpack_error_t rc = mpack_writer_destroy(&writer);
+        cstr data  = (cstr)msg->content->data;
+        size_t len = msg->content->size;
 
-        if (rc != mpack_ok)
+        if (vws_is_flag(&msg->flags, VM_MSG_RAW_JSON) && len > 0)
         {
-            char buf[256];
-            cstr text = mpack_error_to_string(rc);
-            snprintf(buf, sizeof(buf), "Encoding errror: %s", text);
-            vws.error(VE_RT, buf);
-
-            vws_buffer_free(buffer);
-            return NULL;
+            // Already JSON. Embed it as is.
+            vws_buffer_append(buffer, (ucstr)data, len);
+        }
+        else
+        {
+            msg_json_str(buffer, data, len);
         }
 
+        vws_buffer_append(buffer, (ucstr)"]", 1);
+
         return buffer;
     }
 
-    if (msg->format == VM_JSON_FORMAT)
+    return NULL;
+}
+
+vws_buffer* vrtql_msg_serialize_frame(vrtql_msg* msg, bool mask)
+{
+    if (msg == NULL)
     {
-        // Serialize JSON
+        return NULL;
+    }
 
-        // Buffer to hold data
-        vws_buffer* buffer = vws_buffer_new();
+    if (msg->format != VM_MPACK_FORMAT)
+    {
+        // Size not known up front. Serialize and frame separately.
+        vws_buffer* body = vrtql_msg_serialize(msg);
 
-        // Create a mutable doc
-        yyjson_mut_doc* doc = yyjson_mut_doc_new(NULL);
+        if (body == NULL)
+        {
+            return NULL;
+        }
 
-        // We're generating an array as root.
-        yyjson_mut_val* root = yyjson_mut_arr(doc);
+        vws_frame* f = vws_frame_new(body->data, body->size, BINARY_FRAME);
+        f->mask      = mask;
+        vws_buffer_free(body);
 
-        // Set root of the doc
-        yyjson_mut_doc_set_root(doc, root);
+        return vws_serialize(f);
+    }
 
-        // Generate routing
-        yyjson_mut_val* routing = yyjson_mut_arr_add_obj(doc, root);
-        cstr key; cstr value;
-        sc_map_foreach(&msg->routing, key, value)
-        {
-            yyjson_mut_obj_add_str(doc, routing, key, value);
-        }
+    bool raw = msg_raw_usable(msg);
 
-        // Generate headers
-        yyjson_mut_val* headers = yyjson_mut_arr_add_obj(doc, root);
-        sc_map_foreach(&msg->headers, key, value)
-        {
-            yyjson_mut_obj_add_str(doc, headers, key, value);
-        }
+    if (raw == false && msg_decode(msg) == false)
+    {
+        // Error already set
+        return NULL;
+    }
 
-        // Add content
-        int size  = msg->content->size;
-        cstr data = (cstr)msg->content->data;
+    size_t size = (raw == true) ? msg->raw->size : msg_mpack_size(msg);
 
-        if (size > 0)
-        {
-            yyjson_mut_arr_add_strncpy(doc, root, data, size);
-        }
+    // Frame header, then the masking key if any, then the body
+    unsigned char header[14];
+    size_t header_size = vws_frame_header(header, 1, BINARY_FRAME, size);
 
-        // To string, minified
-        cstr json = yyjson_mut_write(doc, 0, NULL);
+    if (mask == true)
+    {
+        header[1] |= 0x80;
 
-        if (json)
+        if (vws_mask_key(header + header_size) == false)
         {
-            // Assuming vws_buffer_write takes a char* and size, writes the
-            // data to the buffer
-            vws_buffer_append(buffer, (ucstr)json, strlen(json));
-            vws.free((void*)json);
+            // Error already set
+            return NULL;
         }
 
-        // Free the doc
-        yyjson_mut_doc_free(doc);
+        header_size += 4;
+    }
 
-        return buffer;
+    vws_buffer* buffer = vws_buffer_new();
+    buffer->data       = vws.malloc(header_size + size);
+    buffer->allocated  = header_size + size;
+
+    memcpy(buffer->data, header, header_size);
+
+    ucstr body = buffer->data + header_size;
+
+    if (raw == true)
+    {
+        memcpy(body, msg->raw->data, size);
+    }
+    else if (msg_mpack_write(msg, body, size) == false)
+    {
+        vws_buffer_free(buffer);
+        return NULL;
     }
 
-    return NULL;
+    if (mask == true)
+    {
+        vws_mask(body, body, size, body - 4, 0);
+    }
+
+    buffer->size = header_size + size;
+
+    vws.success();
+
+    return buffer;
 }
 
 bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
+{
+    return msg_deserialize(msg, data, length, NULL);
+}
+
+bool vrtql_msg_deserialize_ws(vrtql_msg* msg, vws_msg* wsm)
+{
+    // A mapped payload is read-only, so it can't be adopted or parsed in place
+    vws_buffer* source = (wsm->mapped == true) ? NULL : wsm->data;
+    return msg_deserialize(msg, wsm->data->data, wsm->data->size, source);
+}
+
+bool vrtql_msg_deserialize_lazy(vrtql_msg* msg, ucstr data, size_t length)
+{
+    return msg_deserialize_lazy(msg, data, length, NULL);
+}
+
+bool vrtql_msg_deserialize_ws_lazy(vrtql_msg* msg, vws_msg* wsm)
+{
+    vws_buffer* source = (wsm->mapped == true) ? NULL : wsm->data;
+    return msg_deserialize_lazy(msg, wsm->data->data, wsm->data->size, source);
+}
+
+bool vrtql_msg_decode(vrtql_msg* msg)
+{
+    return msg_decode(msg);
+}
+
+bool msg_deserialize(vrtql_msg* msg, ucstr data, size_t length, vws_buffer* source)
 {
     if ((data == NULL) || (length == 0))
     {
         return false;
     }
 
+    // Everything is replaced, so whatever is left undecoded can go
+    msg_drop_raw(msg);
+
     // Parse message based on exptected format
     //
     // A message can be serialized into both JSON and MessagePack on the wire
@@ -245,29 +574,37 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
             return false;
         }
 
+        // Both maps are replaced, so their storage can be reused
+
+        vrtql_msg_map_clear(msg, &msg->routing);
+        vrtql_msg_map_clear(msg, &msg->headers);
+        msg_arena_reset(msg);
+
         // Parse routing map
 
-        if (msg_parse_map(&reader, &msg->routing) == false)
+        if (msg_parse_map(&reader, msg, &msg->routing) == false)
         {
             return false;
         }
 
         // Parse header map
 
-        if (msg_parse_map(&reader, &msg->headers) == false)
+        if (msg_parse_map(&reader, msg, &msg->headers) == false)
         {
             return false;
         }
 
         // Parse content
 
-        ssize_t n = msg_parse_content(&reader, msg->content);
+        cstr borrowed = NULL;
+        cstr* borrow  = (source != NULL) ? &borrowed : NULL;
+        ssize_t n     = msg_parse_content(&reader, msg->content, borrow);
 
         if (n < 0)
         {
             return false;
         }
-        else
+        else if (borrowed == NULL)
         {
             msg->content->size = n;
         }
@@ -289,6 +626,13 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
             return false;
         }
 
+        if (borrowed != NULL)
+        {
+            // Content is the last thing in the message. Take the source buffer
+            // whole rather than copy.
+            msg_adopt_content(msg, source, borrowed, n);
+        }
+
         // Record format
         msg->format = VM_MPACK_FORMAT;
     }
@@ -296,9 +640,35 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
     {
         // Deserialize JSON
 
+        // Content that is not a string is raw JSON. It is taken as it is
+        // rather than parsed, so split the array up ourselves first.
+        size_t at[3][2];
+
+        if (msg_json_split((cstr)data, length, at) && data[at[2][0]] != '"')
+        {
+            return msg_json_raw(msg, (cstr)data, at, source);
+        }
+
         yyjson_read_flag flags = YYJSON_READ_NOFLAG;
-        yyjson_doc* doc        = yyjson_read((cstr)data, length, flags);
-        yyjson_val* root       = yyjson_doc_get_root(doc);
+
+        if (source != NULL)
+        {
+            // We own the source, so parse it in place: strings are unescaped
+            // where they are rather than copied into the document. This needs
+            // zeroed padding past the end.
+            vws_buffer_reserve(source, YYJSON_PADDING_SIZE);
+            memset(source->data + source->size, 0, YYJSON_PADDING_SIZE);
+
+            data  = source->data;
+            flags = YYJSON_READ_INSITU;
+        }
+
+        yyjson_doc* doc  = yyjson_read_opts( (char*)data,
+                                             length,
+                                             flags,
+                                             &msg_json_alc,
+                                             NULL );
+        yyjson_val* root = yyjson_doc_get_root(doc);
 
         if (!yyjson_is_arr(root) || yyjson_arr_size(root) != 3)
         {
@@ -312,23 +682,7 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
         yyjson_val* headers = yyjson_arr_get(root, 1);
         yyjson_val* content = yyjson_arr_get(root, 2);
 
-        yyjson_val* key;
-        yyjson_val* value;
-        yyjson_obj_iter iter;
-
-        if (routing && yyjson_is_obj(routing))
-        {
-            yyjson_obj_iter_init(routing, &iter);
-
-            while ((key = yyjson_obj_iter_next(&iter)))
-            {
-                value = yyjson_obj_iter_get_val(key);
-                vws_map_set( &msg->routing,
-                             yyjson_get_str(key),
-                             yyjson_get_str(value) );
-            }
-        }
-        else
+        if (msg_json_parse_map(msg, &msg->routing, routing) == false)
         {
             vws.error(VE_RT, "Invalid JSON: routing not JSON object");
             yyjson_doc_free(doc);
@@ -336,18 +690,7 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
             return false;
         }
 
-        if (headers && yyjson_is_obj(headers))
-        {
-            yyjson_obj_iter_init(headers, &iter);
-            while ((key = yyjson_obj_iter_next(&iter)))
-            {
-                value = yyjson_obj_iter_get_val(key);
-                vws_map_set( &msg->headers,
-                             yyjson_get_str(key),
-                             yyjson_get_str(value) );
-            }
-        }
-        else
+        if (msg_json_parse_map(msg, &msg->headers, headers) == false)
         {
             vws.error(VE_RT, "Invalid JSON: headers is not JSON object");
             yyjson_doc_free(doc);
@@ -357,7 +700,18 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
 
         if (content && yyjson_is_str(content))
         {
-            vrtql_msg_set_content(msg, yyjson_get_str(content));
+            cstr str   = yyjson_get_str(content);
+            size_t len = yyjson_get_len(content);
+
+            if (source != NULL && len > 0)
+            {
+                // The string was unescaped in place in the source
+                msg_adopt_content(msg, source, str, len);
+            }
+            else
+            {
+                vrtql_msg_set_content_binary(msg, str, len);
+            }
         }
         else
         {
@@ -371,49 +725,251 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
 
         // Record format
         msg->format = VM_JSON_FORMAT;
+        vws_clear_flag(&msg->flags, VM_MSG_RAW_JSON);
     }
 
     return true;
 }
 
-void vrtql_msg_dump(vrtql_msg* msg)
+bool msg_deserialize_lazy( vrtql_msg* msg,
+                           ucstr data,
+                           size_t length,
+                           vws_buffer* source )
 {
-    // Buffer to hold data
-    vws_buffer* buffer = vws_buffer_new();
+    if ((data == NULL) || (length == 0))
+    {
+        return false;
+    }
 
-    // Create a mutable doc
-    yyjson_mut_doc* doc = yyjson_mut_doc_new(NULL);
+    // Everything is replaced
 
-    // We're generating an array as root.
-    yyjson_mut_val* root = yyjson_mut_arr(doc);
+    msg_drop_raw(msg);
+    vrtql_msg_map_clear(msg, &msg->routing);
+    vrtql_msg_map_clear(msg, &msg->headers);
+    msg_arena_reset(msg);
+    vws_buffer_clear(msg->content);
+    vws_clear_flag(&msg->flags, VM_MSG_RAW_JSON);
 
-    // Set root of the doc
-    yyjson_mut_doc_set_root(doc, root);
+    size_t at = 0;
 
-    // Generate routing
-    yyjson_mut_val* routing = yyjson_mut_arr_add_obj(doc, root);
-    cstr key; cstr value;
-    sc_map_foreach(&msg->routing, key, value)
+    if (data[0] == msg_magic)
     {
-        yyjson_mut_obj_add_str(doc, routing, key, value);
-    }
+        // The magic number is the array header, so the routing map comes
+        // straight after it. Start reading there and stop after the map.
+        mpack_reader_t reader;
+        mpack_reader_init_data(&reader, (cstr)data + 1, length - 1);
 
-    // Generate headers
-    yyjson_mut_val* headers = yyjson_mut_arr_add_obj(doc, root);
-    sc_map_foreach(&msg->headers, key, value)
-    {
-        yyjson_mut_obj_add_str(doc, headers, key, value);
-    }
+        bool ok = msg_parse_map(&reader, msg, &msg->routing);
+        at      = length - mpack_reader_remaining(&reader, NULL);
 
-    // To string, minified
-    cstr json = yyjson_mut_write(doc, 0, NULL);
+        if (mpack_reader_destroy(&reader) != mpack_ok || ok == false)
+        {
+            vws.error(VE_RT, "Invalid MessagePack format");
+            return false;
+        }
 
-    if (json)
+        msg->format = VM_MPACK_FORMAT;
+    }
+    else
     {
-        // Assuming vws_buffer_write takes a char* and size, writes the
+        size_t json[3][2];
+
+        if (msg_json_split((cstr)data, length, json) == false)
+        {
+            vws.error(VE_RT, "Invalid JSON: Root is not an array of size 3");
+            return false;
+        }
+
+        cstr routing = (cstr)data + json[0][0];
+        size_t size  = json[0][1] - json[0][0];
+
+        if (msg_json_map_at(msg, &msg->routing, routing, size) == false)
+        {
+            vws.error(VE_RT, "Invalid JSON: routing not JSON object");
+            return false;
+        }
+
+        msg->format = VM_JSON_FORMAT;
+    }
+
+    // Keep the rest for later
+
+    msg->raw = vws_buffer_new();
+
+    if (source != NULL)
+    {
+        vws_buffer swap = *msg->raw;
+        *msg->raw       = *source;
+        *source         = swap;
+    }
+    else
+    {
+        vws_buffer_append(msg->raw, data, length);
+    }
+
+    msg->raw_at = at;
+    vws_set_flag(&msg->flags, VM_MSG_LAZY);
+
+    return true;
+}
+
+bool msg_decode(vrtql_msg* msg)
+{
+    if (vws_is_flag(&msg->flags, VM_MSG_LAZY) == false)
+    {
+        return true;
+    }
+
+    // Cleared first, as what follows goes through the accessors
+    vws_clear_flag(&msg->flags, VM_MSG_LAZY);
+
+    vws_buffer* raw = msg->raw;
+    msg->raw        = NULL;
+    bool ok         = false;
+
+    if (raw->data[0] == msg_magic)
+    {
+        // Headers, then content, from where routing left off
+
+        mpack_reader_t reader;
+        mpack_reader_init_data( &reader,
+                                (cstr)raw->data + msg->raw_at,
+                                raw->size - msg->raw_at );
+
+        cstr borrowed = NULL;
+        ssize_t n     = -1;
+
+        if (msg_parse_map(&reader, msg, &msg->headers) == true)
+        {
+            n = msg_parse_content(&reader, msg->content, &borrowed);
+        }
+
+        ok = (mpack_reader_destroy(&reader) == mpack_ok) && (n >= 0);
+
+        if (ok == true && borrowed != NULL)
+        {
+            msg_adopt_content(msg, raw, borrowed, n);
+        }
+    }
+    else
+    {
+        size_t at[3][2];
+        cstr data = (cstr)raw->data;
+
+        if (msg_json_split(data, raw->size, at) == true)
+        {
+            cstr headers = data + at[1][0];
+            cstr content = data + at[2][0];
+            size_t size  = at[2][1] - at[2][0];
+
+            ok = msg_json_map_at( msg,
+                                  &msg->headers,
+                                  headers,
+                                  at[1][1] - at[1][0] );
+
+            if (ok == true && content[0] != '"')
+            {
+                // Raw JSON, taken as it is
+                msg_adopt_content(msg, raw, content, size);
+                vws_set_flag(&msg->flags, VM_MSG_RAW_JSON);
+            }
+            else if (ok == true)
+            {
+                yyjson_doc* doc = yyjson_read_opts( (char*)content,
+                                                    size,
+                                                    0,
+                                                    &msg_json_alc,
+                                                    NULL );
+                yyjson_val* str = yyjson_doc_get_root(doc);
+                ok              = yyjson_is_str(str);
+
+                if (ok == true)
+                {
+                    vrtql_msg_set_content_binary( msg,
+                                                  yyjson_get_str(str),
+                                                  yyjson_get_len(str) );
+                }
+
+                yyjson_doc_free(doc);
+            }
+        }
+    }
+
+    vws_buffer_free(raw);
+
+    if (ok == false)
+    {
+        vrtql_msg_map_clear(msg, &msg->headers);
+        vws_buffer_clear(msg->content);
+        vws.error(VE_RT, "Invalid message: bad headers or content");
+    }
+
+    return ok;
+}
+
+void msg_drop_raw(vrtql_msg* msg)
+{
+    if (msg->raw != NULL)
+    {
+        vws_buffer_free(msg->raw);
+        msg->raw = NULL;
+    }
+
+    vws_clear_flag(&msg->flags, VM_MSG_LAZY);
+}
+
+bool msg_raw_usable(vrtql_msg* msg)
+{
+    if (vws_is_flag(&msg->flags, VM_MSG_LAZY) == false)
+    {
+        return false;
+    }
+
+    bool mpack = (msg->raw->data[0] == msg_magic);
+
+    return mpack == (msg->format == VM_MPACK_FORMAT);
+}
+
+void vrtql_msg_dump(vrtql_msg* msg)
+{
+    msg_decode(msg);
+
+    // Buffer to hold data
+    vws_buffer* buffer = vws_buffer_new();
+
+    // Create a mutable doc
+    yyjson_mut_doc* doc = yyjson_mut_doc_new(&msg_json_alc);
+
+    // We're generating an array as root.
+    yyjson_mut_val* root = yyjson_mut_arr(doc);
+
+    // Set root of the doc
+    yyjson_mut_doc_set_root(doc, root);
+
+    // Generate routing
+    yyjson_mut_val* routing = yyjson_mut_arr_add_obj(doc, root);
+    cstr key; cstr value;
+    sc_map_foreach(&msg->routing, key, value)
+    {
+        yyjson_mut_obj_add_str(doc, routing, key, value);
+    }
+
+    // Generate headers
+    yyjson_mut_val* headers = yyjson_mut_arr_add_obj(doc, root);
+    sc_map_foreach(&msg->headers, key, value)
+    {
+        yyjson_mut_obj_add_str(doc, headers, key, value);
+    }
+
+    // To string, minified
+    cstr json = yyjson_mut_write_opts(doc, 0, &msg_json_alc, NULL, NULL);
+
+    if (json)
+    {
+        // Assuming vws_buffer_write takes a char* and size, writes the
         // data to the buffer
         vws_buffer_append(buffer, (ucstr)json, strlen(json));
-        vws.free((void*)json);
+        msg_json_free(NULL, (void*)json);
     }
 
     // Free the doc
@@ -431,17 +987,18 @@ void vrtql_msg_dump(vrtql_msg* msg)
 
 cstr vrtql_msg_get_header(vrtql_msg* msg, cstr key)
 {
+    msg_decode(msg);
     return vws_map_get(&msg->headers, key);
 }
 
 void vrtql_msg_set_header(vrtql_msg* msg, cstr key, cstr value)
 {
-    vws_map_set(&msg->headers, key, value);
+    vrtql_msg_map_set(msg, &msg->headers, key, value);
 }
 
 void vrtql_msg_clear_header(vrtql_msg* msg, cstr key)
 {
-    vws_map_remove(&msg->headers, key);
+    vrtql_msg_map_remove(msg, &msg->headers, key);
 }
 
 cstr vrtql_msg_get_routing(vrtql_msg* msg, cstr key)
@@ -451,48 +1008,144 @@ cstr vrtql_msg_get_routing(vrtql_msg* msg, cstr key)
 
 void vrtql_msg_set_routing(vrtql_msg* msg, cstr key, cstr value)
 {
-    vws_map_set(&msg->routing, key, value);
+    vrtql_msg_map_set(msg, &msg->routing, key, value);
 }
 
 void vrtql_msg_clear_routing(vrtql_msg* msg, cstr key)
 {
-    vws_map_remove(&msg->routing, key);
+    vrtql_msg_map_remove(msg, &msg->routing, key);
+}
+
+void vrtql_msg_map_set(vrtql_msg* msg, struct sc_map_str* map, cstr key, cstr value)
+{
+    // Raw bytes would be out of date after this
+    msg_decode(msg);
+
+    char* v  = msg_strndup(msg, value, strlen(value));
+    cstr old = sc_map_get_str(map, key);
+    cstr k   = NULL;
+
+    if (sc_map_found(map) == true)
+    {
+        // sc_map_put_str() replaces the stored key along with the value. Hand
+        // it the stored key back so it stays owned as it was.
+        cstr i;
+        sc_map_foreach_key(map, i)
+        {
+            if (strcmp(i, key) == 0)
+            {
+                k = i;
+                break;
+            }
+        }
+
+        msg_release(msg, old);
+    }
+    else
+    {
+        k = msg_strndup(msg, key, strlen(key));
+    }
+
+    sc_map_put_str(map, k, v);
+}
+
+void vrtql_msg_map_remove(vrtql_msg* msg, struct sc_map_str* map, cstr key)
+{
+    // Raw bytes would be out of date after this
+    msg_decode(msg);
+
+    cstr v = sc_map_get_str(map, key);
+
+    if (sc_map_found(map) == false)
+    {
+        return;
+    }
+
+    // Deleting loses the stored key, so find it first
+    cstr k = NULL;
+    cstr i;
+    sc_map_foreach_key(map, i)
+    {
+        if (strcmp(i, key) == 0)
+        {
+            k = i;
+            break;
+        }
+    }
+
+    sc_map_del_str(map, key);
+
+    msg_release(msg, k);
+    msg_release(msg, v);
+}
+
+void vrtql_msg_map_clear(vrtql_msg* msg, struct sc_map_str* map)
+{
+    // Raw bytes would be out of date after this
+    msg_decode(msg);
+
+    cstr key; cstr value;
+    sc_map_foreach(map, key, value)
+    {
+        msg_release(msg, key);
+        msg_release(msg, value);
+    }
+
+    sc_map_clear_str(map);
 }
 
 void vrtql_msg_clear_content(vrtql_msg* msg)
 {
+    msg_decode(msg);
     vws_buffer_clear(msg->content);
 }
 
 cstr vrtql_msg_get_content(vrtql_msg* msg)
 {
+    msg_decode(msg);
     return (cstr)msg->content->data;
 }
 
 size_t vrtql_msg_get_content_size(vrtql_msg* msg)
 {
+    msg_decode(msg);
     return msg->content->size;
 }
 
 void vrtql_msg_set_content(vrtql_msg* msg, cstr value)
 {
+    msg_decode(msg);
     vws_buffer_clear(msg->content);
     vws_buffer_append(msg->content, (ucstr)value, strlen(value));
 }
 
 void vrtql_msg_set_content_binary(vrtql_msg* msg, cstr value, size_t size)
 {
+    msg_decode(msg);
     vws_buffer_clear(msg->content);
     vws_buffer_append(msg->content, (ucstr)value, size);
 }
 
 ssize_t vrtql_msg_send(vws_cnx* c, vrtql_msg* msg)
 {
-    vws_buffer* binary = vrtql_msg_serialize(msg);
-    ssize_t bytes = vws_frame_send_binary(c, binary->data, binary->size);
-    vws_buffer_free(binary);
+    if (vws_cnx_is_deflate(c) == true || c->max_frame > 0)
+    {
+        // The payload is compressed or fragmented before framing, so it
+        // can't be framed as it is encoded.
+        vws_buffer* binary = vrtql_msg_serialize(msg);
+        ssize_t bytes = vws_msg_send_binary(c, binary->data, binary->size);
+        vws_buffer_free(binary);
 
-    return bytes;
+        return bytes;
+    }
+
+    if (vws_cnx_is_connected(c) == false)
+    {
+        return -1;
+    }
+
+    // Header, masking key and body in one buffer, written in one pass
+    return vws_frame_write(c, vrtql_msg_serialize_frame(msg, true));
 }
 
 vrtql_msg* vrtql_msg_recv(vws_cnx* c)
@@ -504,11 +1157,10 @@ vrtql_msg* vrtql_msg_recv(vws_cnx* c)
         return NULL;
     }
 
-    // Deserialize VRTQL message
+    // Deserialize VRTQL message, taking the payload rather than copying it
     vrtql_msg* m = vrtql_msg_new();
-    ucstr data   = wsm->data->data;
-    size_t size  = wsm->data->size;
-    if (vrtql_msg_deserialize(m, data, size) == false)
+
+    if (vrtql_msg_deserialize_ws(m, wsm) == false)
     {
         // Error already set
         vws_msg_free(wsm);
@@ -525,11 +1177,38 @@ vrtql_msg* vrtql_msg_recv(vws_cnx* c)
 // Utility functions
 //------------------------------------------------------------------------------
 
-static bool msg_parse_map(mpack_reader_t* reader, struct sc_map_str* map)
+void* msg_json_malloc(void* ctx, size_t size)
 {
-    // Clear contents
-    vws_map_clear(map);
+    if (vws.arena != NULL)
+    {
+        return vws_arena_alloc(vws.arena, size);
+    }
+
+    return vws.malloc(size);
+}
+
+void* msg_json_realloc(void* ctx, void* ptr, size_t old, size_t size)
+{
+    if ((vws.arena != NULL) && (ptr == NULL || vws_arena_owns(vws.arena, ptr)))
+    {
+        return vws_arena_realloc(vws.arena, ptr, old, size);
+    }
+
+    return vws.realloc(ptr, size);
+}
+
+void msg_json_free(void* ctx, void* ptr)
+{
+    if ((vws.arena != NULL) && vws_arena_owns(vws.arena, ptr))
+    {
+        return;
+    }
 
+    vws.free(ptr);
+}
+
+bool msg_parse_map(mpack_reader_t* reader, vrtql_msg* msg, struct sc_map_str* map)
+{
     mpack_tag_t tag = mpack_read_tag(reader);
 
     if (mpack_reader_error(reader) != mpack_ok)
@@ -565,10 +1244,13 @@ static bool msg_parse_map(mpack_reader_t* reader, struct sc_map_str* map)
 
         length = mpack_tag_str_length(&tag);
         data   = mpack_read_bytes_inplace(reader, length);
-        key    = vws.malloc(length + 1);
 
-        memcpy(key, data, length);
-        key[length] = 0;
+        if (mpack_reader_error(reader) != mpack_ok)
+        {
+            return false;
+        }
+
+        key = msg_strndup(msg, data, length);
         mpack_done_str(reader);
 
         //> Get value
@@ -583,13 +1265,22 @@ static bool msg_parse_map(mpack_reader_t* reader, struct sc_map_str* map)
 
         length = mpack_tag_str_length(&tag);
         data   = mpack_read_bytes_inplace(reader, length);
-        value  = vws.malloc(length + 1);
 
-        memcpy(value, data, length);
-        value[length] = 0;
+        if (mpack_reader_error(reader) != mpack_ok)
+        {
+            return false;
+        }
+
+        value = msg_strndup(msg, data, length);
         mpack_done_str(reader);
 
-        sc_map_put_str(map, key, value);
+        // A repeated key keeps the last value
+        cstr old = sc_map_put_str(map, key, value);
+
+        if (sc_map_found(map) == true)
+        {
+            msg_release(msg, old);
+        }
 
         if (mpack_reader_error(reader) != mpack_ok)
         {
@@ -602,7 +1293,494 @@ static bool msg_parse_map(mpack_reader_t* reader, struct sc_map_str* map)
     return true;
 }
 
-int32_t msg_parse_content(mpack_reader_t* reader, vws_buffer* buffer)
+char* msg_strndup(vrtql_msg* msg, cstr data, size_t size)
+{
+    // Interned strings are at most 3 bytes
+    if (size <= 3)
+    {
+        for (size_t i = 0; i < sizeof(msg_interned_at); i++)
+        {
+            cstr s = msg_interned + msg_interned_at[i];
+
+            if ((strncmp(s, data, size) == 0) && (s[size] == '\0'))
+            {
+                return (char*)s;
+            }
+        }
+    }
+
+    char* ptr;
+
+    if (msg->arena_used + size + 1 <= VM_ARENA_SIZE)
+    {
+        ptr              = msg->arena + msg->arena_used;
+        msg->arena_used += size + 1;
+    }
+    else
+    {
+        vrtql_msg_block* b = msg->blocks;
+
+        if ((b == NULL) || (b->used + size + 1 > b->size))
+        {
+            size_t bytes = VM_ARENA_SIZE * 4;
+
+            if (size + 1 > bytes)
+            {
+                bytes = size + 1;
+            }
+
+            size_t n = sizeof(vrtql_msg_block) + bytes;
+
+            if (vws_is_flag(&msg->flags, VM_MSG_ARENA))
+            {
+                b = vws_arena_alloc(vws.arena, n);
+            }
+            else
+            {
+                b = vws.malloc(n);
+            }
+
+            b->next     = msg->blocks;
+            b->size     = bytes;
+            b->used     = 0;
+            msg->blocks = b;
+        }
+
+        ptr      = b->data + b->used;
+        b->used += size + 1;
+    }
+
+    memcpy(ptr, data, size);
+    ptr[size] = '\0';
+
+    return ptr;
+}
+
+void msg_release(vrtql_msg* msg, cstr ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    if ((ptr >= msg_interned) && (ptr < msg_interned + sizeof(msg_interned)))
+    {
+        return;
+    }
+
+    if ((ptr >= msg->arena) && (ptr < msg->arena + VM_ARENA_SIZE))
+    {
+        return;
+    }
+
+    for (vrtql_msg_block* b = msg->blocks; b != NULL; b = b->next)
+    {
+        if ((ptr >= b->data) && (ptr < b->data + b->size))
+        {
+            return;
+        }
+    }
+
+    vws.free((void*)ptr);
+}
+
+void msg_arena_reset(vrtql_msg* msg)
+{
+    if (vws_is_flag(&msg->flags, VM_MSG_ARENA))
+    {
+        // They go with vws.arena
+        msg->blocks = NULL;
+    }
+
+    while (msg->blocks != NULL)
+    {
+        vrtql_msg_block* next = msg->blocks->next;
+        vws.free(msg->blocks);
+        msg->blocks = next;
+    }
+
+    msg->arena_used = 0;
+}
+
+size_t msg_json_size(vrtql_msg* msg)
+{
+    // Brackets, braces, commas and quotes
+    size_t size = 10 + msg->content->size;
+
+    struct sc_map_str* maps[2] = { &msg->routing, &msg->headers };
+
+    for (int i = 0; i < 2; i++)
+    {
+        cstr key; cstr value;
+        sc_map_foreach(maps[i], key, value)
+        {
+            size += strlen(key) + strlen(value) + 6;
+        }
+    }
+
+    return size;
+}
+
+void msg_json_map(vws_buffer* buffer, struct sc_map_str* map)
+{
+    bool first = true;
+
+    vws_buffer_append(buffer, (ucstr)"{", 1);
+
+    cstr key; cstr value;
+    sc_map_foreach(map, key, value)
+    {
+        if (first == false)
+        {
+            vws_buffer_append(buffer, (ucstr)",", 1);
+        }
+
+        first = false;
+
+        msg_json_str(buffer, key, strlen(key));
+        vws_buffer_append(buffer, (ucstr)":", 1);
+        msg_json_str(buffer, value, strlen(value));
+    }
+
+    vws_buffer_append(buffer, (ucstr)"}", 1);
+}
+
+void msg_json_str(vws_buffer* buffer, cstr data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    vws_buffer_append(buffer, (ucstr)"\"", 1);
+
+    size_t start = 0;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char c = (unsigned char)data[i];
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+
+        // Flush the run of plain characters before this one
+        vws_buffer_append(buffer, (ucstr)data + start, i - start);
+        start = i + 1;
+
+        char esc[6] = { '\\', 0 };
+        size_t n    = 2;
+
+        switch (c)
+        {
+            case '"':  esc[1] = '"';  break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b';  break;
+            case '\f': esc[1] = 'f';  break;
+            case '\n': esc[1] = 'n';  break;
+            case '\r': esc[1] = 'r';  break;
+            case '\t': esc[1] = 't';  break;
+            default:
+            {
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xF];
+                n      = 6;
+            }
+        }
+
+        vws_buffer_append(buffer, (ucstr)esc, n);
+    }
+
+    vws_buffer_append(buffer, (ucstr)data + start, size - start);
+    vws_buffer_append(buffer, (ucstr)"\"", 1);
+}
+
+/**
+ * @brief Returns the offset of the first non-whitespace character at or after
+ * pos.
+ */
+static size_t msg_json_space(cstr data, size_t size, size_t pos)
+{
+    while (pos < size && (data[pos] == ' '  || data[pos] == '\t' ||
+                          data[pos] == '\r' || data[pos] == '\n'))
+    {
+        pos++;
+    }
+
+    return pos;
+}
+
+bool msg_json_skip(cstr data, size_t size, size_t* pos)
+{
+    size_t i     = *pos;
+    size_t depth = 0;
+
+    do
+    {
+        if (i >= size)
+        {
+            return false;
+        }
+
+        char c = data[i++];
+
+        if (c == '"')
+        {
+            // Skip the string, minding escapes
+            while (i < size && data[i] != '"')
+            {
+                i += (data[i] == '\\') ? 2 : 1;
+            }
+
+            if (i++ >= size)
+            {
+                return false;
+            }
+        }
+        else if (c == '{' || c == '[')
+        {
+            depth++;
+        }
+        else if (c == '}' || c == ']')
+        {
+            if (depth == 0)
+            {
+                return false;
+            }
+
+            depth--;
+        }
+        else if (depth == 0)
+        {
+            // Scalar: runs up to the next delimiter
+            while (i < size && strchr(",]} \t\r\n", data[i]) == NULL)
+            {
+                i++;
+            }
+        }
+    }
+    while (depth > 0);
+
+    *pos = i;
+
+    return true;
+}
+
+bool msg_json_split(cstr data, size_t size, size_t at[3][2])
+{
+    size_t pos = msg_json_space(data, size, 0);
+
+    if (pos >= size || data[pos++] != '[')
+    {
+        return false;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        pos      = msg_json_space(data, size, pos);
+        at[i][0] = pos;
+
+        if (msg_json_skip(data, size, &pos) == false)
+        {
+            return false;
+        }
+
+        at[i][1] = pos;
+        pos      = msg_json_space(data, size, pos);
+
+        char expect = (i < 2) ? ',' : ']';
+
+        if (pos >= size || data[pos++] != expect)
+        {
+            return false;
+        }
+    }
+
+    return msg_json_space(data, size, pos) == size;
+}
+
+bool msg_json_raw(vrtql_msg* msg, cstr data, size_t at[3][2], vws_buffer* source)
+{
+    struct sc_map_str* maps[2] = { &msg->routing, &msg->headers };
+    cstr errors[2]             = { "Invalid JSON: routing not JSON object",
+                                   "Invalid JSON: headers is not JSON object" };
+
+    for (int i = 0; i < 2; i++)
+    {
+        size_t size = at[i][1] - at[i][0];
+
+        if (msg_json_map_at(msg, maps[i], data + at[i][0], size) == false)
+        {
+            vws.error(VE_RT, errors[i]);
+            return false;
+        }
+    }
+
+    cstr content = data + at[2][0];
+    size_t size  = at[2][1] - at[2][0];
+
+    if (source != NULL)
+    {
+        msg_adopt_content(msg, source, content, size);
+    }
+    else
+    {
+        vrtql_msg_set_content_binary(msg, content, size);
+    }
+
+    msg->format = VM_JSON_FORMAT;
+    vws_set_flag(&msg->flags, VM_MSG_RAW_JSON);
+
+    return true;
+}
+
+bool msg_json_parse_map(vrtql_msg* msg, struct sc_map_str* map, yyjson_val* object)
+{
+    if (object == NULL || yyjson_is_obj(object) == false)
+    {
+        return false;
+    }
+
+    yyjson_val* key;
+    yyjson_obj_iter iter;
+    yyjson_obj_iter_init(object, &iter);
+
+    while ((key = yyjson_obj_iter_next(&iter)))
+    {
+        yyjson_val* value = yyjson_obj_iter_get_val(key);
+
+        vrtql_msg_map_set( msg,
+                           map,
+                           yyjson_get_str(key),
+                           yyjson_get_str(value) );
+    }
+
+    return true;
+}
+
+bool msg_json_map_at(vrtql_msg* msg, struct sc_map_str* map, cstr json, size_t size)
+{
+    yyjson_doc* doc = yyjson_read_opts((char*)json, size, 0, &msg_json_alc, NULL);
+
+    bool ok = msg_json_parse_map(msg, map, yyjson_doc_get_root(doc));
+    yyjson_doc_free(doc);
+
+    return ok;
+}
+
+void msg_adopt_content(vrtql_msg* msg, vws_buffer* source, cstr data, size_t size)
+{
+    vws_buffer swap = *msg->content;
+    *msg->content   = *source;
+    *source         = swap;
+
+    vws_buffer_consume(msg->content, (ucstr)data - msg->content->data);
+    msg->content->size = size;
+}
+
+/**
+ * @brief Returns the encoded size of a MessagePack string header.
+ */
+static size_t msg_mpack_str_size(size_t n)
+{
+    return (n < 32) ? 1 : (n <= UINT8_MAX) ? 2 : (n <= UINT16_MAX) ? 3 : 5;
+}
+
+/**
+ * @brief Returns the encoded size of a MessagePack map of strings.
+ */
+static size_t msg_mpack_map_size(struct sc_map_str* map)
+{
+    size_t n    = sc_map_size_str(map);
+    size_t size = (n < 16) ? 1 : (n <= UINT16_MAX) ? 3 : 5;
+
+    cstr key; cstr value;
+    sc_map_foreach(map, key, value)
+    {
+        size_t k = strlen(key);
+        size_t v = strlen(value);
+
+        size += msg_mpack_str_size(k) + k + msg_mpack_str_size(v) + v;
+    }
+
+    return size;
+}
+
+size_t msg_mpack_size(vrtql_msg* msg)
+{
+    size_t n    = msg->content->size;
+    size_t size = 1; // fixarray of 3
+
+    size += msg_mpack_map_size(&msg->routing);
+    size += msg_mpack_map_size(&msg->headers);
+    size += ((n <= UINT8_MAX) ? 2 : (n <= UINT16_MAX) ? 3 : 5) + n;
+
+    return size;
+}
+
+bool msg_mpack_write(vrtql_msg* msg, ucstr data, size_t size)
+{
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)data, size);
+
+    // Binary is an array of 3 elements: routing, headers, content.
+    mpack_start_array(&writer, 3);
+
+    cstr key; cstr value;
+
+    // Generate routing
+
+    mpack_start_map(&writer, sc_map_size_str(&msg->routing));
+    sc_map_foreach(&msg->routing, key, value)
+    {
+        mpack_write_cstr(&writer, key);
+        mpack_write_cstr(&writer, value);
+    }
+    mpack_finish_map(&writer);
+
+    // Generate headers
+
+    mpack_start_map(&writer, sc_map_size_str(&msg->headers));
+    sc_map_foreach(&msg->headers, key, value)
+    {
+        mpack_write_cstr(&writer, key);
+        mpack_write_cstr(&writer, value);
+    }
+    mpack_finish_map(&writer);
+
+    // Create content
+
+    cstr content = (cstr)msg->content->data;
+    mpack_write_bin(&writer, content, msg->content->size);
+
+    // Close array
+    mpack_finish_array(&writer);
+
+    // A short write means msg_mpack_size() is wrong. Catch it here rather
+    // than send garbage.
+    size_t used      = mpack_writer_buffer_used(&writer);
+    mpack_error_t rc = mpack_writer_destroy(&writer);
+
+    if (rc == mpack_ok && used != size)
+    {
+        rc = mpack_error_bug;
+    }
+
+    if (rc != mpack_ok)
+    {
+        char buf[256];
+        cstr text = mpack_error_to_string(rc);
+        snprintf(buf, sizeof(buf), "Encoding errror: %s", text);
+        vws.error(VE_RT, buf);
+
+        return false;
+    }
+
+    return true;
+}
+
+int32_t msg_parse_content(mpack_reader_t* reader, vws_buffer* buffer, cstr* borrow)
 {
     mpack_tag_t tag = mpack_read_tag(reader);
 
@@ -627,6 +1805,19 @@ int32_t msg_parse_content(mpack_reader_t* reader, vws_buffer* buffer)
 
     cstr data = mpack_read_bytes_inplace(reader, length);
 
+    if (mpack_reader_error(reader) != mpack_ok)
+    {
+        return -1;
+    }
+
+    if (borrow != NULL)
+    {
+        *borrow = data;
+        mpack_done_str(reader);
+
+        return length;
+    }
+
     vws_buffer_clear(buffer);
     vws_buffer_append(buffer, (ucstr)data, length);
     mpack_done_str(reader);
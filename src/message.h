@@ -17,7 +17,19 @@ typedef enum
 {
     VM_MSG_VALID       = (1 << 1),
     VM_MSG_PRIORITY    = (1 << 2),
-    VM_MSG_OUT_OF_BAND = (1 << 3)
+    VM_MSG_OUT_OF_BAND = (1 << 3),
+
+    /* In JSON format, content is itself JSON and goes on the wire as a value
+     * rather than a string. Set by the deserializer when it finds one. */
+    VM_MSG_RAW_JSON    = (1 << 4),
+
+    /* The message and its overflow storage came from vws.arena, so they are
+     * released when the arena is reset rather than by vrtql_msg_free(). */
+    VM_MSG_ARENA       = (1 << 5),
+
+    /* Only the routing map has been decoded. Headers and content are still in
+     * raw, and are decoded on first use. See vrtql_msg_deserialize_lazy(). */
+    VM_MSG_LAZY        = (1 << 6)
 } vrtql_msg_state_t;
 
 /**
@@ -27,9 +39,41 @@ typedef enum
  *
  */
 
+/** Bytes of routing and header string storage held inline in each message.
+ * Messages with more spill into heap blocks. */
+#define VM_ARENA_SIZE 256
+
+/** Routing key holding how long the sender waits for a reply, in
+ * milliseconds. A vrtql_msg_svr drops the request unprocessed if it has been
+ * queued longer than that. It is relative, so the clocks on either end need
+ * not agree. */
+#define VM_DEADLINE "deadline"
+
+/**
+ * @brief An overflow block of message string storage.
+ *
+ * @ingroup MessageFunctions
+ */
+typedef struct vrtql_msg_block
+{
+    struct vrtql_msg_block* next; /**< The next block                 */
+    size_t size;                  /**< Bytes available in data        */
+    size_t used;                  /**< Bytes used in data             */
+    char data[];                  /**< The storage                    */
+} vrtql_msg_block;
+
 /**
  * @brief Represents a message with routing, headers, and content.
  *
+ * Routing and header keys and values are owned by the message. They live in
+ * its arena (or are interned, for common strings like "id" and "tag") and are
+ * all released at once by vrtql_msg_free(). Modify the maps only with the
+ * vrtql_msg_*() functions, never with vws_map_set() and friends.
+ *
+ * A lazily deserialized message (VM_MSG_LAZY) has empty headers and content
+ * until vrtql_msg_decode(). The accessors call it for you. Code that uses the
+ * headers or content members directly must call it first.
+ *
  * @ingroup MessageFunctions
  */
 typedef struct vrtql_msg
@@ -39,10 +83,17 @@ typedef struct vrtql_msg
     vws_buffer* content;       /**< Buffer for the message content.    */
     uint64_t flags;            /**< Message state flags                */
     vrtql_msg_format_t format; /**< Message format                     */
+    size_t arena_used;         /**< Bytes used in arena                */
+    vrtql_msg_block* blocks;   /**< Overflow string storage            */
+    vws_buffer* raw;           /**< Serialized message, while lazy     */
+    size_t raw_at;             /**< Offset of the headers in raw       */
+    char arena[VM_ARENA_SIZE]; /**< Inline string storage              */
 } vrtql_msg;
 
 /**
- * @brief Creates a new vrtql_msg instance.
+ * @brief Creates a new vrtql_msg instance. While vws.arena is set, as it is in
+ * a server worker handling a request, the message comes from the arena and
+ * must not be kept past the request. vrtql_msg_free() is still called on it.
  * @return A pointer to the new vrtql_msg instance.
  *
  * @ingroup MessageFunctions
@@ -123,6 +174,37 @@ void vrtql_msg_set_routing(vrtql_msg* msg, cstr key, cstr value);
  */
 void vrtql_msg_clear_routing(vrtql_msg* msg, cstr key);
 
+/**
+ * @brief Sets a key-value pair in one of the message's maps. The key and value
+ * are copied into the message.
+ * @param msg The vrtql_msg instance.
+ * @param map The map: &msg->routing or &msg->headers.
+ * @param key The key.
+ * @param value The value.
+ *
+ * @ingroup MessageFunctions
+ */
+void vrtql_msg_map_set(vrtql_msg* msg, struct sc_map_str* map, cstr key, cstr value);
+
+/**
+ * @brief Removes a key-value pair from one of the message's maps.
+ * @param msg The vrtql_msg instance.
+ * @param map The map: &msg->routing or &msg->headers.
+ * @param key The key.
+ *
+ * @ingroup MessageFunctions
+ */
+void vrtql_msg_map_remove(vrtql_msg* msg, struct sc_map_str* map, cstr key);
+
+/**
+ * @brief Removes all key-value pairs from one of the message's maps.
+ * @param msg The vrtql_msg instance.
+ * @param map The map: &msg->routing or &msg->headers.
+ *
+ * @ingroup MessageFunctions
+ */
+void vrtql_msg_map_clear(vrtql_msg* msg, struct sc_map_str* map);
+
 /**
  * @brief Gets the content of the message.
  * @param msg The vrtql_msg instance.
@@ -177,6 +259,19 @@ void vrtql_msg_clear_content(vrtql_msg* msg);
  */
 vws_buffer* vrtql_msg_serialize(vrtql_msg* msg);
 
+/**
+ * @brief Serializes a vrtql_msg instance as a complete WebSocket binary frame.
+ * For MessagePack the encoded size is computed up front and the frame header,
+ * masking key and body are written in one pass into one exactly sized buffer.
+ * No compression is applied.
+ * @param msg The vrtql_msg instance.
+ * @param mask Whether to mask the frame (client to server).
+ * @return A buffer containing the frame, or NULL on error.
+ *
+ * @ingroup MessageFunctions
+ */
+vws_buffer* vrtql_msg_serialize_frame(vrtql_msg* msg, bool mask);
+
 /**
  * @brief Deserializes a buffer to a vrtql_msg instance.
  * @param msg The vrtql_msg instance.
@@ -188,6 +283,66 @@ vws_buffer* vrtql_msg_serialize(vrtql_msg* msg);
  */
 bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length);
 
+/**
+ * @brief Deserializes a WebSocket message into a vrtql_msg instance without
+ * copying the content. For MessagePack, the message takes over the WebSocket
+ * message's payload buffer and its content points into it. Routing and
+ * headers go into the message's inline arena. A typical request then costs no
+ * allocation beyond the message itself. A mapped payload (vws_msg.mapped) is
+ * copied instead.
+ * @param msg The vrtql_msg instance.
+ * @param wsm The WebSocket message. Its payload may be replaced; the caller
+ *   still frees it.
+ * @return true on success, false on failure.
+ *
+ * @ingroup MessageFunctions
+ */
+bool vrtql_msg_deserialize_ws(vrtql_msg* msg, vws_msg* wsm);
+
+/**
+ * @brief Deserializes only the routing map of a buffer. The message keeps the
+ * serialized bytes, and headers and content are decoded from them on first
+ * use (vrtql_msg_decode()). Until then, vrtql_msg_serialize() and
+ * vrtql_msg_serialize_frame() emit the original bytes as they are, provided
+ * the format has not been changed. This makes routing and forwarding a message
+ * cost one parse of the routing map and one copy.
+ *
+ * Reading routing does not decode the rest. Changing it does, since the
+ * original bytes would then be out of date.
+ * @param msg The vrtql_msg instance.
+ * @param data The buffer containing the serialized message.
+ * @param length The length of the buffer in bytes.
+ * @return true on success, false on failure. Errors in the headers or content
+ *   only show when they are decoded.
+ *
+ * @ingroup MessageFunctions
+ */
+bool vrtql_msg_deserialize_lazy(vrtql_msg* msg, ucstr data, size_t length);
+
+/**
+ * @brief Lazily deserializes a WebSocket message (see
+ * vrtql_msg_deserialize_lazy()). The message takes over the WebSocket
+ * message's payload buffer rather than copying it, unless it is mapped.
+ * @param msg The vrtql_msg instance.
+ * @param wsm The WebSocket message. Its payload may be replaced; the caller
+ *   still frees it.
+ * @return true on success, false on failure.
+ *
+ * @ingroup MessageFunctions
+ */
+bool vrtql_msg_deserialize_ws_lazy(vrtql_msg* msg, vws_msg* wsm);
+
+/**
+ * @brief Decodes the headers and content of a lazily deserialized message and
+ * releases the serialized bytes. Does nothing for any other message.
+ * @param msg The vrtql_msg instance.
+ * @return true on success, false if the headers or content are invalid
+ *   (vws.e has the details). They are left empty in that case.
+ *
+ * @ingroup MessageFunctions
+ */
+bool vrtql_msg_decode(vrtql_msg* msg);
+
 /**
  * @brief Sends a message via a websocket connection. Does not take ownership of
  * message. Caller is still responsible for freeing message. This is to allow
@@ -0,0 +1,58 @@
+#ifndef VWS_PROBE_DECLARE
+#define VWS_PROBE_DECLARE
+
+/**
+ * @file probe.h
+ * @brief Static (USDT) probes
+ *
+ * The library marks the stages a message goes through with static probes
+ * under the provider name "vws". A probe costs a single nop until a tracer
+ * such as bpftrace attaches to it, so they stay in production builds. Build
+ * with -DUSDT=ON (which needs sys/sdt.h from systemtap-sdt-dev) to compile
+ * them in. Otherwise they compile to nothing.
+ *
+ * Server probes take the connection or data item as their first argument, so
+ * stages can be matched up by it:
+ *
+ *   accept(cnx)                     connection accepted
+ *   upgrade(cnx)                    WebSocket handshake completed
+ *   queue_push(name, data)          data put on the named queue
+ *   queue_pop(name, data)           data taken off the named queue
+ *   work_begin(data)                worker starts on a request
+ *   work_end(data)                  worker is done with a request
+ *   write(cnx, items, bytes)        batch of responses handed to the socket
+ *   write_done(cnx, status)         batch write completed
+ *
+ * Connection probes take the vws_cnx:
+ *
+ *   frame(c, opcode, size)          frame parsed by vws_cnx_ingress()
+ *   msg_pop(c, msg, size)           message assembled by vws_msg_pop()
+ *
+ * For example, the time requests wait for a worker:
+ *
+ *   bpftrace -e '
+ *     usdt:libvws.so:vws:queue_push /str(arg0) == "requests"/
+ *       { @t[arg1] = nsecs; }
+ *     usdt:libvws.so:vws:work_begin /@t[arg0]/
+ *       { @wait = hist(nsecs - @t[arg0]); delete(@t[arg0]); }'
+ */
+
+#if defined(VWS_USDT)
+
+#include <sys/sdt.h>
+
+#define VWS_PROBE(name)             DTRACE_PROBE(vws, name)
+#define VWS_PROBE1(name, a)         DTRACE_PROBE1(vws, name, a)
+#define VWS_PROBE2(name, a, b)      DTRACE_PROBE2(vws, name, a, b)
+#define VWS_PROBE3(name, a, b, c)   DTRACE_PROBE3(vws, name, a, b, c)
+
+#else
+
+#define VWS_PROBE(name)             do {} while (0)
+#define VWS_PROBE1(name, a)         do {} while (0)
+#define VWS_PROBE2(name, a, b)      do {} while (0)
+#define VWS_PROBE3(name, a, b, c)   do {} while (0)
+
+#endif
+
+#endif /* VWS_PROBE_DECLARE */
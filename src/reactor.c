@@ -0,0 +1,435 @@
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <unistd.h>
+#elif defined(__bsd__)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <unistd.h>
+#elif defined(__sunos__)
+#include <poll.h>
+#endif
+
+#if defined(__windows__)
+#include <winsock2.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "reactor.h"
+
+/** Events collected per call to vws_reactor_run(). The rest are picked up on
+ * the next call. */
+#define REACTOR_EVENTS 64
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Tells the kernel which direction to watch a connection for.
+ *
+ * @param r The reactor
+ * @param e The connection entry
+ * @param add True when adding the descriptor, false when changing it
+ * @return True on success, false otherwise.
+ */
+static bool reactor_watch(vws_reactor* r, vws_reactor_cnx* e, bool add);
+
+/**
+ * @brief Stops watching a connection and frees its entry.
+ *
+ * @param r The reactor
+ * @param e The connection entry
+ */
+static void reactor_unwatch(vws_reactor* r, vws_reactor_cnx* e);
+
+/**
+ * @brief Services a connection the kernel reported ready: reads the socket,
+ * processes frames and dispatches messages.
+ *
+ * @param r The reactor
+ * @param fd The socket descriptor the event was reported for
+ */
+static void reactor_service(vws_reactor* r, int fd);
+
+/**
+ * @brief Looks up a registered connection by descriptor.
+ *
+ * @param r The reactor
+ * @param fd The socket descriptor
+ * @return The entry, or NULL if none is registered.
+ */
+static vws_reactor_cnx* reactor_lookup(vws_reactor* r, int fd);
+
+//------------------------------------------------------------------------------
+//> Reactor API
+//------------------------------------------------------------------------------
+
+vws_reactor* vws_reactor_new()
+{
+    vws_reactor* r = vws.malloc(sizeof(vws_reactor));
+
+    r->on_msg   = NULL;
+    r->on_close = NULL;
+    r->data     = NULL;
+
+    sc_map_init_64v(&r->cnxs, 0, 0);
+
+    #if defined(__linux__)
+    r->fd = epoll_create1(EPOLL_CLOEXEC);
+    #elif defined(__bsd__)
+    r->fd = kqueue();
+    #else
+    r->fd = -1;
+    #endif
+
+    #if defined(__linux__) || defined(__bsd__)
+    if (r->fd < 0)
+    {
+        vws.error(VE_RT, "Failed to create reactor: %s", strerror(errno));
+        sc_map_term_64v(&r->cnxs);
+        vws.free(r);
+
+        return NULL;
+    }
+    #endif
+
+    vws.success();
+
+    return r;
+}
+
+void vws_reactor_free(vws_reactor* r)
+{
+    if (r == NULL)
+    {
+        return;
+    }
+
+    vws_reactor_cnx* e;
+    sc_map_foreach_value(&r->cnxs, e)
+    {
+        vws.free(e);
+    }
+
+    sc_map_term_64v(&r->cnxs);
+
+    #if defined(__linux__) || defined(__bsd__)
+    close(r->fd);
+    #endif
+
+    vws.free(r);
+}
+
+bool vws_reactor_add(vws_reactor* r, vws_cnx* c)
+{
+    if (vws_cnx_is_connected(c) == false)
+    {
+        vws.error(VE_SOCKET, "vws_reactor_add(): not connected");
+        return false;
+    }
+
+    if (reactor_lookup(r, c->base.sockfd) != NULL)
+    {
+        vws.error(VE_WARN, "vws_reactor_add(): already registered");
+        return false;
+    }
+
+    vws_reactor_cnx* e = vws.malloc(sizeof(vws_reactor_cnx));
+    e->cnx             = c;
+    e->fd              = c->base.sockfd;
+    e->want_write      = false;
+
+    if (reactor_watch(r, e, true) == false)
+    {
+        vws.free(e);
+        return false;
+    }
+
+    sc_map_put_64v(&r->cnxs, (uint64_t)e->fd, e);
+
+    vws.success();
+
+    return true;
+}
+
+bool vws_reactor_remove(vws_reactor* r, vws_cnx* c)
+{
+    // The connection may have closed its socket since it was added, in which
+    // case the descriptor no longer finds it.
+    vws_reactor_cnx* e = reactor_lookup(r, c->base.sockfd);
+
+    if (e == NULL || e->cnx != c)
+    {
+        vws_reactor_cnx* i;
+
+        e = NULL;
+        sc_map_foreach_value(&r->cnxs, i)
+        {
+            if (i->cnx == c)
+            {
+                e = i;
+                break;
+            }
+        }
+    }
+
+    if (e == NULL)
+    {
+        return false;
+    }
+
+    reactor_unwatch(r, e);
+
+    return true;
+}
+
+size_t vws_reactor_size(vws_reactor* r)
+{
+    return sc_map_size_64v(&r->cnxs);
+}
+
+int vws_reactor_run(vws_reactor* r, int timeout)
+{
+    vws.success();
+
+    if (sc_map_size_64v(&r->cnxs) == 0)
+    {
+        return 0;
+    }
+
+    // Collect the ready descriptors first. Callbacks may add or remove
+    // connections, so nothing is serviced until the kernel's answer is in
+    // hand, and each descriptor is looked up again as it is serviced.
+    int ready[REACTOR_EVENTS];
+    int n = 0;
+
+    #if defined(__linux__)
+
+    struct epoll_event events[REACTOR_EVENTS];
+
+    n = epoll_wait(r->fd, events, REACTOR_EVENTS, timeout);
+
+    for (int i = 0; i < n; i++)
+    {
+        ready[i] = events[i].data.fd;
+    }
+
+    #elif defined(__bsd__)
+
+    struct kevent events[REACTOR_EVENTS];
+    struct timespec ts;
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+
+    n = kevent( r->fd, NULL, 0, events, REACTOR_EVENTS,
+                timeout < 0 ? NULL : &ts );
+
+    for (int i = 0; i < n; i++)
+    {
+        ready[i] = (int)events[i].ident;
+    }
+
+    #else
+
+    // No readiness API to register with: build the poll set each time.
+    #if defined(__windows__)
+    WSAPOLLFD fds[REACTOR_EVENTS];
+    #else
+    struct pollfd fds[REACTOR_EVENTS];
+    #endif
+
+    int count = 0;
+    vws_reactor_cnx* e;
+
+    sc_map_foreach_value(&r->cnxs, e)
+    {
+        if (count == REACTOR_EVENTS)
+        {
+            break;
+        }
+
+        fds[count].fd      = e->fd;
+        fds[count].events  = e->want_write ? POLLOUT : POLLIN;
+        fds[count].revents = 0;
+        count++;
+    }
+
+    #if defined(__windows__)
+    n = WSAPoll(fds, count, timeout);
+    #else
+    n = poll(fds, count, timeout);
+    #endif
+
+    if (n > 0)
+    {
+        n = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (fds[i].revents != 0)
+            {
+                ready[n++] = (int)fds[i].fd;
+            }
+        }
+    }
+
+    #endif
+
+    if (n < 0)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+
+        vws.error(VE_RT, "vws_reactor_run(): %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        reactor_service(r, ready[i]);
+    }
+
+    vws.success();
+
+    return n;
+}
+
+//------------------------------------------------------------------------------
+//> Internal functions
+//------------------------------------------------------------------------------
+
+vws_reactor_cnx* reactor_lookup(vws_reactor* r, int fd)
+{
+    vws_reactor_cnx* e = sc_map_get_64v(&r->cnxs, (uint64_t)fd);
+
+    if (sc_map_found(&r->cnxs) == false)
+    {
+        return NULL;
+    }
+
+    return e;
+}
+
+bool reactor_watch(vws_reactor* r, vws_reactor_cnx* e, bool add)
+{
+    #if defined(__linux__)
+
+    // Level-triggered: whatever we leave unread is reported again next time.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = e->want_write ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = e->fd;
+
+    int op = add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    if (epoll_ctl(r->fd, op, e->fd, &ev) != 0)
+    {
+        vws.error(VE_RT, "epoll_ctl(): %s", strerror(errno));
+        return false;
+    }
+
+    #elif defined(__bsd__)
+
+    struct kevent ev[2];
+    int n = 0;
+
+    if (add == false)
+    {
+        int old = e->want_write ? EVFILT_READ : EVFILT_WRITE;
+        EV_SET(&ev[n++], e->fd, old, EV_DELETE, 0, 0, NULL);
+    }
+
+    int filter = e->want_write ? EVFILT_WRITE : EVFILT_READ;
+    EV_SET(&ev[n++], e->fd, filter, EV_ADD, 0, 0, NULL);
+
+    if (kevent(r->fd, ev, n, NULL, 0, NULL) != 0)
+    {
+        vws.error(VE_RT, "kevent(): %s", strerror(errno));
+        return false;
+    }
+
+    #endif
+
+    return true;
+}
+
+void reactor_unwatch(vws_reactor* r, vws_reactor_cnx* e)
+{
+    // If the socket has already been closed, the kernel dropped it from the
+    // set on its own and these fail harmlessly.
+
+    #if defined(__linux__)
+
+    epoll_ctl(r->fd, EPOLL_CTL_DEL, e->fd, NULL);
+
+    #elif defined(__bsd__)
+
+    struct kevent ev;
+    int filter = e->want_write ? EVFILT_WRITE : EVFILT_READ;
+    EV_SET(&ev, e->fd, filter, EV_DELETE, 0, 0, NULL);
+    kevent(r->fd, &ev, 1, NULL, 0, NULL);
+
+    #endif
+
+    sc_map_del_64v(&r->cnxs, (uint64_t)e->fd);
+    vws.free(e);
+}
+
+void reactor_service(vws_reactor* r, int fd)
+{
+    vws_reactor_cnx* e = reactor_lookup(r, fd);
+
+    // Removed by a callback earlier in this round
+    if (e == NULL)
+    {
+        return;
+    }
+
+    vws_cnx* c      = e->cnx;
+    bool want_write = false;
+
+    if (vws_socket_read_ready(&c->base, &want_write) < 0)
+    {
+        // The socket has been closed.
+        reactor_unwatch(r, e);
+
+        if (r->on_close != NULL)
+        {
+            r->on_close(r, c);
+        }
+
+        return;
+    }
+
+    // TLS needs to write before it can read any further. Wait for that rather
+    // than spinning on a readable socket it will not read from.
+    if (want_write != e->want_write)
+    {
+        e->want_write = want_write;
+        reactor_watch(r, e, false);
+    }
+
+    vws_cnx_ingress(c);
+
+    if (r->on_msg == NULL)
+    {
+        return;
+    }
+
+    vws_msg* m;
+    while ((m = vws_msg_pop(c)) != NULL)
+    {
+        r->on_msg(r, c, m);
+
+        // The callback may have removed the connection.
+        if (reactor_lookup(r, fd) != e)
+        {
+            break;
+        }
+    }
+}
@@ -0,0 +1,164 @@
+#ifndef VWS_REACTOR_DECLARE
+#define VWS_REACTOR_DECLARE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "websocket.h"
+#include "util/sc_map.h"
+
+/**
+ * @file reactor.h
+ * @brief Event-driven client reactor
+ *
+ * A reactor drives many client connections from a single thread. Rather than
+ * blocking in vws_msg_recv() on one connection at a time, connections are
+ * registered with the reactor and vws_reactor_run() waits on all of them at
+ * once using epoll (Linux), kqueue (BSD) or poll() (everything else). When a
+ * connection becomes readable the reactor pulls whatever the socket has into
+ * its buffer with vws_socket_read_ready(), hands it to vws_cnx_ingress() and
+ * then delivers each complete message to the on_msg callback.
+ *
+ * Connections are not owned by the reactor. Sending is unchanged: use the
+ * normal vws_frame_send_*() / vws_msg_send_*() functions on the connection.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vws_reactor;
+
+/**
+ * @brief Callback for a complete message received on a connection.
+ *
+ * @param r The reactor
+ * @param c The connection the message arrived on
+ * @param m The message. The callback takes ownership and must free it with
+ *   vws_msg_free().
+ */
+typedef void (*vws_reactor_msg)(struct vws_reactor* r, vws_cnx* c, vws_msg* m);
+
+/**
+ * @brief Callback for a connection that failed or was closed by the peer. The
+ * connection has already been removed from the reactor and its socket closed.
+ * It is safe to free or reconnect it here.
+ *
+ * @param r The reactor
+ * @param c The connection
+ */
+typedef void (*vws_reactor_close)(struct vws_reactor* r, vws_cnx* c);
+
+/**
+ * @brief A registered connection.
+ */
+typedef struct vws_reactor_cnx
+{
+    /**< The connection. */
+    vws_cnx* cnx;
+
+    /**< The socket descriptor at registration. The connection closes its
+     * socket (and forgets it) on error, so we keep our own copy. */
+    int fd;
+
+    /**< True while waiting for the socket to become writable (TLS
+     * renegotiation) rather than readable. */
+    bool want_write;
+
+} vws_reactor_cnx;
+
+/**
+ * @brief A client reactor.
+ */
+typedef struct vws_reactor
+{
+    /**< The epoll or kqueue descriptor. -1 when using poll(). */
+    int fd;
+
+    /**< Registered connections, keyed by socket descriptor. */
+    struct sc_map_64v cnxs;
+
+    /**< Message callback. If NULL, messages are left in the connection's queue
+     * for vws_msg_pop(). */
+    vws_reactor_msg on_msg;
+
+    /**< Close callback. Optional. */
+    vws_reactor_close on_close;
+
+    /**< User-defined data associated with the reactor */
+    void* data;
+
+} vws_reactor;
+
+/**
+ * @brief Creates a new reactor.
+ *
+ * @return A new reactor, or NULL on error (vws.e has the details).
+ *
+ * @ingroup ReactorFunctions
+ */
+vws_reactor* vws_reactor_new();
+
+/**
+ * @brief Frees a reactor. Registered connections are not closed or freed.
+ *
+ * @param r The reactor.
+ *
+ * @ingroup ReactorFunctions
+ */
+void vws_reactor_free(vws_reactor* r);
+
+/**
+ * @brief Registers a connected connection with the reactor.
+ *
+ * @param r The reactor.
+ * @param c The connection. It must be connected and stay allocated until
+ *   removed (or reported through on_close).
+ * @return True on success, false otherwise.
+ *
+ * @ingroup ReactorFunctions
+ */
+bool vws_reactor_add(vws_reactor* r, vws_cnx* c);
+
+/**
+ * @brief Unregisters a connection. Call this before closing or freeing a
+ * connection that is still registered. It is safe to call from callbacks.
+ *
+ * @param r The reactor.
+ * @param c The connection.
+ * @return True if the connection was registered, false otherwise.
+ *
+ * @ingroup ReactorFunctions
+ */
+bool vws_reactor_remove(vws_reactor* r, vws_cnx* c);
+
+/**
+ * @brief Returns the number of registered connections.
+ *
+ * @param r The reactor.
+ * @return The number of connections.
+ *
+ * @ingroup ReactorFunctions
+ */
+size_t vws_reactor_size(vws_reactor* r);
+
+/**
+ * @brief Waits for activity on the registered connections and services it,
+ * reading data, processing frames and dispatching messages to the callbacks.
+ * Call this in a loop.
+ *
+ * @param r The reactor.
+ * @param timeout Maximum time to wait in milliseconds. -1 waits indefinitely,
+ *   0 returns immediately.
+ * @return The number of connections serviced, 0 on timeout, or -1 on error.
+ *
+ * @ingroup ReactorFunctions
+ */
+int vws_reactor_run(vws_reactor* r, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VWS_REACTOR_DECLARE */
@@ -1,10 +1,13 @@
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include <openssl/rand.h>
-
+#include "mpack-expect.h"
+#include "mpack-reader.h"
+#include "mpack-writer.h"
 #include "rpc.h"
 
 //------------------------------------------------------------------------------
@@ -34,30 +37,226 @@ static bool reconnect(vrtql_rpc* rpc)
 // Client-side Internal functions
 //------------------------------------------------------------------------------
 
-char* vrtql_rpc_tag(uint16_t length)
+/**
+ * @brief A pending asynchronous call
+ */
+typedef struct rpc_call
+{
+    /**< The call id. This is also the key in vrtql_rpc.pending. */
+    uint64_t id;
+
+    /**< The completion callback */
+    vrtql_rpc_cb cb;
+
+    /**< User data for callback */
+    void* data;
+
+} rpc_call;
+
+/**
+ * @brief Sends a tagged request, reconnecting if the connection dropped.
+ *
+ * @param rpc The RPC instance
+ * @param req The message to send
+ * @return True if sent, false otherwise (vws.e has VE_SOCKET and VE_SEND set
+ *         if the connection failed).
+ */
+static bool rpc_send(vrtql_rpc* rpc, vrtql_msg* req);
+
+/** Size of a call tag buffer: 16 hex digits and the NUL */
+#define RPC_TAG_SIZE 17
+
+/**
+ * @brief Tags a request with the next call id. Tags are the id in lowercase
+ * hex, drawn from the connection's sequence so they never collide however many
+ * calls are in flight, and replies can be matched by integer.
+ *
+ * @param rpc The RPC instance
+ * @param req The request
+ * @return The call id
+ */
+static uint64_t rpc_tag(vrtql_rpc* rpc, vrtql_msg* req);
+
+/**
+ * @brief Sets the deadline of a request (VM_DEADLINE) to how long
+ * vrtql_rpc_exec() waits for the reply, unless the caller has set one.
+ *
+ * @param rpc The RPC instance
+ * @param req The request
+ */
+static void rpc_deadline(vrtql_rpc* rpc, vrtql_msg* req);
+
+/**
+ * @brief Reads the call id back from the tag of a reply.
+ *
+ * @param m The reply
+ * @param id Set to the call id
+ * @return True if the message has a tag of the form rpc_tag() makes, false
+ *         otherwise (it is not a reply to one of our calls).
+ */
+static void rpc_deadline(vrtql_rpc* rpc, vrtql_msg* req)
 {
-    char valid_chars[]  = "abcdefghijklmnopqrstuvwxyz0123456789";
-    unsigned char* data = (unsigned char*)malloc(length);
-    unsigned char* tag  = (unsigned char*)malloc(length);
+    int timeout = rpc->cnx->base.timeout;
 
-    if (RAND_bytes(data, length) != 1)
+    // No timeout means we wait for as long as it takes
+    if (timeout <= 0 || vrtql_msg_get_routing(req, VM_DEADLINE) != NULL)
     {
-        free(data);
-        free(tag);
+        return;
+    }
 
-        return NULL;
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%" PRIu64, (uint64_t)timeout * rpc->retries);
+
+    vrtql_msg_set_routing(req, VM_DEADLINE, buf);
+}
+
+bool rpc_tag_id(vrtql_msg* m, uint64_t* id);
+
+/**
+ * @brief Completes every pending call with a NULL reply.
+ *
+ * @param rpc The RPC instance
+ */
+static void rpc_fail_pending(vrtql_rpc* rpc);
+
+/**
+ * @brief Completes the pending calls for all messages already received on the
+ * connection, without waiting.
+ *
+ * @param rpc The RPC instance
+ * @return The number of calls completed
+ */
+static int rpc_drain(vrtql_rpc* rpc);
+
+/**
+ * @brief Packs messages into the content of a batch envelope. The content is
+ * a MessagePack array with one bin element per message, each holding the
+ * message serialized in MessagePack format.
+ *
+ * @param env The envelope
+ * @param msgs The messages
+ * @param n The number of messages
+ * @return True on success, false otherwise.
+ */
+static bool rpc_batch_pack(vrtql_msg* env, vrtql_msg** msgs, size_t n);
+
+/**
+ * @brief Unpacks the messages in a batch envelope.
+ *
+ * @param env The envelope
+ * @param n Set to the number of messages
+ * @return An array of messages (vws.free() it after freeing each message), or
+ *         NULL on error or if there are none.
+ */
+static vrtql_msg** rpc_batch_unpack(vrtql_msg* env, size_t* n);
+
+/**
+ * @brief Dumps a message to the trace under a banner. With asynchronous
+ * tracing on, the message is serialized into the trace buffer and dumped by
+ * the writer thread.
+ *
+ * @param title The banner title (a string literal)
+ * @param m The message
+ */
+static void rpc_trace(cstr title, vrtql_msg* m);
+
+/**
+ * @brief Takes a dropped connection out of use and hands it to the reconnect
+ * thread. Its pending calls are completed with a NULL reply.
+ *
+ * @param p The pool
+ * @param c The connection
+ */
+static void rpc_pool_down(vrtql_rpc_pool* p, vrtql_rpc_pool_cnx* c);
+
+/**
+ * @brief The reconnect thread of a pool. Reconnects connections that have
+ * dropped until the pool is freed.
+ *
+ * @param arg The pool
+ * @return NULL
+ */
+static void* rpc_pool_thread(void* arg);
+
+/**
+ * @brief Reactor callback: completes the call a message is a response to.
+ *
+ * @param r The reactor
+ * @param c The connection
+ * @param wsm The message
+ */
+static void rpc_pool_msg(vws_reactor* r, vws_cnx* c, vws_msg* wsm);
+
+/**
+ * @brief Reactor callback: takes a connection that dropped out of use.
+ *
+ * @param r The reactor
+ * @param c The connection
+ */
+static void rpc_pool_close(vws_reactor* r, vws_cnx* c);
+
+uint64_t rpc_tag(vrtql_rpc* rpc, vrtql_msg* req)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    uint64_t id = rpc->sequence++;
+    char buf[RPC_TAG_SIZE];
+    char* p = buf + sizeof(buf) - 1;
+    *p      = '\0';
+
+    uint64_t v = id;
+    do
+    {
+        *--p = digits[v & 0xf];
+        v  >>= 4;
+    }
+    while (v != 0);
+
+    vrtql_msg_set_routing(req, "tag", p);
+
+    return id;
+}
+
+bool rpc_tag_id(vrtql_msg* m, uint64_t* id)
+{
+    cstr tag = vrtql_msg_get_routing(m, "tag");
+
+    if (tag == NULL || *tag == '\0')
+    {
+        return false;
     }
 
-    uint16_t vc_len = strlen(valid_chars);
-    for (uint16_t cnt = 0; cnt < length; cnt++)
+    uint64_t v = 0;
+    int n      = 0;
+
+    for (cstr p = tag; *p != '\0'; p++, n++)
     {
-        uint16_t c = data[cnt] % vc_len;
-        tag[cnt]   = valid_chars[c];
+        unsigned d;
+
+        if (*p >= '0' && *p <= '9')
+        {
+            d = *p - '0';
+        }
+        else if (*p >= 'a' && *p <= 'f')
+        {
+            d = *p - 'a' + 10;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (n == 16)
+        {
+            return false;
+        }
+
+        v = (v << 4) | d;
     }
 
-    free(data);
+    *id = v;
 
-    return (char*)tag;
+    return true;
 }
 
 bool vrtql_rpc_invoke(vrtql_rpc* rpc, vrtql_msg* req)
@@ -99,168 +298,1013 @@ bool vrtql_rpc_invoke(vrtql_rpc* rpc, vrtql_msg* req)
     vrtql_msg_free(req);
     vrtql_msg_free(reply);
 
-    return true;
+    return true;
+}
+
+vrtql_msg* vrtql_rpc_exec(vrtql_rpc* rpc, vrtql_msg* req)
+{
+    //> Send request
+
+    // Assign a tag to verify response
+    uint64_t id = rpc_tag(rpc, req);
+
+    // Let the server know when there is no point in processing it
+    rpc_deadline(rpc, req);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        rpc_trace("Message Sent", req);
+    }
+
+    if (rpc_send(rpc, req) == false)
+    {
+        // Hand error back to caller.
+        return NULL;
+    }
+
+    //> Wait for response
+
+    int retries      = 0;
+    vrtql_msg* reply = NULL;
+
+    while (retries < rpc->retries)
+    {
+        reply = vrtql_msg_recv(rpc->cnx);
+
+        // If we have a message
+        if (reply != NULL)
+        {
+            // If tags do not match
+            uint64_t t;
+            if ((rpc_tag_id(reply, &t) == false) || (t != id))
+            {
+                // This is not response message. It may be the response to an
+                // asynchronous call. Otherwise send to handler.
+                if (vrtql_rpc_dispatch(rpc, reply) == false)
+                {
+                    rpc->out_of_band(rpc, reply);
+                }
+
+                // Keep waiting for response.
+                continue;
+            }
+
+            vws.success();
+
+            break;
+        }
+
+        if (vws.e.code == VE_TIMEOUT)
+        {
+            retries++;
+            continue;
+        }
+        else
+        {
+            if (vws.e.code == VE_SOCKET)
+            {
+                // Modify error to indicate the failure was on recv, so the
+                // caller knows the message was sent. Error will have both bits
+                // set: VE_SOCKET and VE_RECV.
+                vws_set_flag(&vws.e.code, VE_RECV);
+            }
+
+            // Something unexpected happend. We expect vrtql_msg_recv() to set
+            // appropriate error. Even if disconenct (VE_SOCKET) there is no
+            // point in reconnecting because we have lost our response no matter
+            // what. We will leave error as it is and hand back to caller.
+            break;
+        }
+    }
+
+    if ((vws.tracelevel >= VT_SERVICE) && (reply != NULL))
+    {
+        rpc_trace("Message Received", reply);
+    }
+
+    return reply;
+}
+
+bool vrtql_rpc_send(vrtql_rpc* rpc, vrtql_msg* req, vrtql_rpc_cb cb, void* data)
+{
+    uint64_t id = rpc_tag(rpc, req);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        rpc_trace("Message Sent (async)", req);
+    }
+
+    if (rpc_send(rpc, req) == false)
+    {
+        return false;
+    }
+
+    // Nothing reads the connection until we return, so registering after the
+    // send cannot miss the response.
+    rpc_call* call = (rpc_call*)vws.malloc(sizeof(rpc_call));
+    call->id       = id;
+    call->cb       = cb;
+    call->data     = data;
+
+    sc_map_put_64v(&rpc->pending, call->id, call);
+
+    vws.success();
+
+    return true;
+}
+
+int vrtql_rpc_poll(vrtql_rpc* rpc)
+{
+    vws.success();
+
+    // Handle anything already received first
+    int completed = rpc_drain(rpc);
+
+    if (completed > 0)
+    {
+        return completed;
+    }
+
+    vrtql_msg* m = vrtql_msg_recv(rpc->cnx);
+
+    if (m == NULL)
+    {
+        if (vws.e.code == VE_TIMEOUT)
+        {
+            return 0;
+        }
+
+        if (vws.e.code == VE_SOCKET)
+        {
+            // The responses are lost. Fail every call so callers can release
+            // whatever they attached to them.
+            vws_set_flag(&vws.e.code, VE_RECV);
+            rpc_fail_pending(rpc);
+
+            return -1;
+        }
+
+        // Some other error (bad message). The connection is still good.
+        return 0;
+    }
+
+    if (vrtql_rpc_dispatch(rpc, m) == true)
+    {
+        completed++;
+    }
+    else
+    {
+        rpc->out_of_band(rpc, m);
+    }
+
+    // One message often brings the next ones with it
+    return completed + rpc_drain(rpc);
+}
+
+bool vrtql_rpc_dispatch(vrtql_rpc* rpc, vrtql_msg* m)
+{
+    uint64_t id;
+
+    if (rpc_tag_id(m, &id) == false)
+    {
+        return false;
+    }
+
+    rpc_call* call = sc_map_get_64v(&rpc->pending, id);
+
+    if (sc_map_found(&rpc->pending) == false)
+    {
+        return false;
+    }
+
+    sc_map_del_64v(&rpc->pending, id);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        rpc_trace("Message Received (async)", m);
+    }
+
+    call->cb(rpc, m, call->data);
+
+    vws.free(call);
+
+    return true;
+}
+
+size_t vrtql_rpc_pending(vrtql_rpc* rpc)
+{
+    return sc_map_size_64v(&rpc->pending);
+}
+
+bool rpc_send(vrtql_rpc* rpc, vrtql_msg* req)
+{
+    // Loop until message sent or fatal error. Timeouts are ignored: keeps
+    // grinding until message is fully sent or error.
+    while (true)
+    {
+        if (vrtql_msg_send(rpc->cnx, req) > 0)
+        {
+            // Message successfully sent
+            return true;
+        }
+
+        // If connection dropped
+        if (vws.e.code == VE_SOCKET)
+        {
+            // The responses to any calls in flight went with it.
+            rpc_fail_pending(rpc);
+
+            // Try to reconnect
+            if (rpc->autoreconnect == true && reconnect(rpc) == true)
+            {
+                // Reconnect worked. Try again.
+                continue;
+            }
+
+            // Failed to reconnect. Modify error to indicate the failure was on
+            // send so the caller knows the message was not sent. Error will
+            // have both bits set: VE_SOCKET and VE_SEND.
+            vws_set_flag(&vws.e.code, VE_SEND);
+        }
+
+        return false;
+    }
+}
+
+void rpc_fail_pending(vrtql_rpc* rpc)
+{
+    if (sc_map_size_64v(&rpc->pending) == 0)
+    {
+        return;
+    }
+
+    // Swap in an empty map first: callbacks are free to start new calls.
+    struct sc_map_64v calls = rpc->pending;
+    sc_map_init_64v(&rpc->pending, 0, 0);
+
+    // Callbacks may clobber the error, so each one sees the original code.
+    uint64_t code = vws.e.code;
+
+    rpc_call* call;
+    sc_map_foreach_value(&calls, call)
+    {
+        vws.e.code = code;
+        call->cb(rpc, NULL, call->data);
+
+        vws.free(call);
+    }
+
+    sc_map_term_64v(&calls);
+
+    vws.e.code = code;
+}
+
+int rpc_drain(vrtql_rpc* rpc)
+{
+    int completed = 0;
+    vws_msg* wsm;
+
+    while ((wsm = vws_msg_pop(rpc->cnx)) != NULL)
+    {
+        vrtql_msg* m = vrtql_msg_new();
+        bool ok      = vrtql_msg_deserialize_ws(m, wsm);
+        vws_msg_free(wsm);
+
+        if (ok == false)
+        {
+            vrtql_msg_free(m);
+            continue;
+        }
+
+        if (vrtql_rpc_dispatch(rpc, m) == true)
+        {
+            completed++;
+        }
+        else
+        {
+            rpc->out_of_band(rpc, m);
+        }
+    }
+
+    return completed;
+}
+
+bool rpc_batch_pack(vrtql_msg* env, vrtql_msg** msgs, size_t n)
+{
+    char* data  = NULL;
+    size_t size = 0;
+
+    mpack_writer_t writer;
+    mpack_writer_init_growable(&writer, &data, &size);
+    mpack_start_array(&writer, n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        // Sub-messages are always binary: JSON content can't hold them.
+        vrtql_msg_format_t format = msgs[i]->format;
+        msgs[i]->format           = VM_MPACK_FORMAT;
+        vws_buffer* buffer        = vrtql_msg_serialize(msgs[i]);
+        msgs[i]->format           = format;
+
+        if (buffer == NULL)
+        {
+            mpack_writer_flag_error(&writer, mpack_error_data);
+            break;
+        }
+
+        mpack_write_bin(&writer, (cstr)buffer->data, buffer->size);
+        vws_buffer_free(buffer);
+    }
+
+    mpack_finish_array(&writer);
+
+    mpack_error_t rc = mpack_writer_destroy(&writer);
+
+    if (rc != mpack_ok)
+    {
+        vws.error(VE_RT, "Batch encoding error: %s", mpack_error_to_string(rc));
+        MPACK_FREE(data);
+
+        return false;
+    }
+
+    vrtql_msg_set_content_binary(env, data, size);
+    MPACK_FREE(data);
+
+    // The envelope has to be binary too
+    env->format = VM_MPACK_FORMAT;
+
+    return true;
+}
+
+/**
+ * @brief Dumps a serialized message, for the trace writer.
+ *
+ * @param data The serialized message
+ * @param size The size of the data
+ */
+static void rpc_trace_dump(const unsigned char* data, size_t size)
+{
+    vrtql_msg* m = vrtql_msg_new();
+
+    if (vrtql_msg_deserialize(m, data, size) == true)
+    {
+        vrtql_msg_dump(m);
+    }
+    else
+    {
+        // Cut short by the trace buffer
+        printf("message of %zu bytes or more\n", size);
+    }
+
+    vrtql_msg_free(m);
+}
+
+void rpc_trace(cstr title, vrtql_msg* m)
+{
+    if (vws_trace_async() == false)
+    {
+        vws_trace_lock();
+        printf("\n\n");
+        printf("+----------------------------------------------------+\n");
+        printf("| %-51s|\n", title);
+        printf("+----------------------------------------------------+\n");
+        vrtql_msg_dump(m);
+        printf("------------------------------------------------------\n");
+        vws_trace_unlock();
+
+        return;
+    }
+
+    vws_buffer* data = vrtql_msg_serialize(m);
+
+    if (data != NULL)
+    {
+        vws_trace_dump(title, rpc_trace_dump, data->data, data->size);
+        vws_buffer_free(data);
+    }
+}
+
+vrtql_msg** rpc_batch_unpack(vrtql_msg* env, size_t* n)
+{
+    *n = 0;
+
+    mpack_reader_t reader;
+    mpack_reader_init_data( &reader,
+                            (cstr)env->content->data,
+                            env->content->size );
+
+    uint32_t count = mpack_expect_array(&reader);
+
+    if (mpack_reader_error(&reader) != mpack_ok || count == 0)
+    {
+        mpack_reader_destroy(&reader);
+
+        if (count != 0)
+        {
+            vws.error(VE_RT, "Invalid batch format");
+        }
+
+        return NULL;
+    }
+
+    vrtql_msg** msgs = vws.malloc(sizeof(vrtql_msg*) * count);
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        uint32_t size = mpack_expect_bin(&reader);
+
+        if (mpack_reader_error(&reader) != mpack_ok)
+        {
+            break;
+        }
+
+        ucstr data = (ucstr)mpack_read_bytes_inplace(&reader, size);
+        mpack_done_bin(&reader);
+
+        if (mpack_reader_error(&reader) != mpack_ok)
+        {
+            break;
+        }
+
+        msgs[i] = vrtql_msg_new();
+
+        if (vrtql_msg_deserialize(msgs[i], data, size) == false)
+        {
+            vrtql_msg_free(msgs[i]);
+            break;
+        }
+    }
+
+    mpack_done_array(&reader);
+    mpack_error_t rc = mpack_reader_destroy(&reader);
+
+    if (i < count || rc != mpack_ok)
+    {
+        vws.error(VE_RT, "Invalid batch format");
+
+        for (uint32_t j = 0; j < i; j++)
+        {
+            vrtql_msg_free(msgs[j]);
+        }
+
+        vws.free(msgs);
+
+        return NULL;
+    }
+
+    *n = count;
+
+    return msgs;
+}
+
+void out_of_band_default(vrtql_rpc* rpc, vrtql_msg* m)
+{
+    if (m != NULL)
+    {
+        vrtql_msg_free(m);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Client-side API
+//------------------------------------------------------------------------------
+
+vrtql_rpc* vrtql_rpc_new(vws_cnx* cnx)
+{
+    vrtql_rpc* rpc     = (vrtql_rpc*)vws.malloc(sizeof(vrtql_rpc));
+    rpc->cnx           = cnx;
+    rpc->retries       = 5;
+    rpc->out_of_band   = out_of_band_default;
+    rpc->reconnect     = NULL;
+    rpc->autoreconnect = true;
+    rpc->data          = NULL;
+    rpc->val           = vws_buffer_new();
+    rpc->sequence      = 0;
+
+    sc_map_init_64v(&rpc->pending, 0, 0);
+
+    return rpc;
+}
+
+void vrtql_rpc_free(vrtql_rpc* rpc)
+{
+    if (rpc != NULL)
+    {
+        // Complete calls still in flight so their data can be released
+        if (sc_map_size_64v(&rpc->pending) > 0)
+        {
+            vws.error(VE_RT, "RPC instance freed");
+            rpc_fail_pending(rpc);
+        }
+
+        sc_map_term_64v(&rpc->pending);
+
+        vws_buffer_free(rpc->val);
+        vws.free(rpc);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Client-side Batch API
+//------------------------------------------------------------------------------
+
+vrtql_rpc_batch* vrtql_rpc_batch_new()
+{
+    vrtql_rpc_batch* b = (vrtql_rpc_batch*)vws.malloc(sizeof(vrtql_rpc_batch));
+    b->calls           = NULL;
+    b->replies         = NULL;
+    b->size            = 0;
+    b->capacity        = 0;
+
+    return b;
+}
+
+void vrtql_rpc_batch_free(vrtql_rpc_batch* b)
+{
+    if (b == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < b->size; i++)
+    {
+        vrtql_msg_free(b->calls[i]);
+
+        if (b->replies != NULL)
+        {
+            vrtql_msg_free(b->replies[i]);
+        }
+    }
+
+    vws.free(b->calls);
+    vws.free(b->replies);
+    vws.free(b);
+}
+
+void vrtql_rpc_batch_add(vrtql_rpc_batch* b, vrtql_msg* req)
+{
+    if (b->size == b->capacity)
+    {
+        b->capacity = (b->capacity == 0) ? 8 : b->capacity * 2;
+        size_t size = sizeof(vrtql_msg*) * b->capacity;
+        b->calls    = vws.realloc(b->calls, size);
+
+        if (b->replies != NULL)
+        {
+            b->replies = vws.realloc(b->replies, size);
+        }
+    }
+
+    b->calls[b->size] = req;
+
+    if (b->replies != NULL)
+    {
+        b->replies[b->size] = NULL;
+    }
+
+    b->size++;
+}
+
+vrtql_msg* vrtql_rpc_batch_reply(vrtql_rpc_batch* b, size_t i)
+{
+    if (b->replies == NULL || i >= b->size)
+    {
+        return NULL;
+    }
+
+    return b->replies[i];
+}
+
+bool vrtql_rpc_batch_exec(vrtql_rpc* rpc, vrtql_rpc_batch* b)
+{
+    // Drop replies from a previous execution
+    if (b->replies != NULL)
+    {
+        for (size_t i = 0; i < b->size; i++)
+        {
+            vrtql_msg_free(b->replies[i]);
+        }
+
+        vws.free(b->replies);
+        b->replies = NULL;
+    }
+
+    vrtql_msg* req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", VRTQL_RPC_BATCH);
+
+    if (rpc_batch_pack(req, b->calls, b->size) == false)
+    {
+        vrtql_msg_free(req);
+        return false;
+    }
+
+    vrtql_msg* reply = vrtql_rpc_exec(rpc, req);
+    vrtql_msg_free(req);
+
+    if (reply == NULL)
+    {
+        // Error already set
+        return false;
+    }
+
+    size_t n;
+    vrtql_msg** replies = rpc_batch_unpack(reply, &n);
+    vrtql_msg_free(reply);
+
+    if (n != b->size)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            vrtql_msg_free(replies[i]);
+        }
+
+        vws.free(replies);
+        vws.error(VE_RT, "Batch reply does not match request");
+
+        return false;
+    }
+
+    // Size the array like calls so vrtql_rpc_batch_add() keeps both in step
+    if (replies != NULL)
+    {
+        b->replies = vws.realloc(replies, sizeof(vrtql_msg*) * b->capacity);
+    }
+
+    vws.success();
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Client-side Pool API
+//------------------------------------------------------------------------------
+
+vrtql_rpc_pool* vrtql_rpc_pool_new(cstr* urls, size_t n, size_t per)
+{
+    vrtql_rpc_pool* p    = (vrtql_rpc_pool*)vws.malloc(sizeof(vrtql_rpc_pool));
+    p->size              = n * per;
+    p->cnxs              = vws.calloc(p->size, sizeof(vrtql_rpc_pool_cnx));
+    p->next              = 0;
+    p->retry             = VRTQL_RPC_POOL_RETRY;
+    p->completed         = 0;
+    p->running           = true;
+    p->reactor           = vws_reactor_new();
+    p->reactor->data     = p;
+    p->reactor->on_msg   = rpc_pool_msg;
+    p->reactor->on_close = rpc_pool_close;
+
+    for (size_t i = 0; i < p->size; i++)
+    {
+        // Endpoints take turns, so each has connections near the front
+        vrtql_rpc_pool_cnx* c = &p->cnxs[i];
+        c->url                = vws_strdup(urls[i % n]);
+        c->rpc                = vrtql_rpc_new(vws_cnx_new());
+        c->rpc->autoreconnect = false;
+        c->rpc->cnx->data     = (char*)c;
+        c->up                 = vws_connect(c->rpc->cnx, c->url);
+        c->polled             = false;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_create(&p->thread, NULL, rpc_pool_thread, p);
+
+    return p;
+}
+
+void vrtql_rpc_pool_free(vrtql_rpc_pool* p)
+{
+    if (p == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->running = false;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    for (size_t i = 0; i < p->size; i++)
+    {
+        vrtql_rpc_pool_cnx* c = &p->cnxs[i];
+        vws_cnx* cnx          = c->rpc->cnx;
+
+        vws_reactor_remove(p->reactor, cnx);
+        vrtql_rpc_free(c->rpc);
+        vws_disconnect(cnx);
+        vws_cnx_free(cnx);
+        vws.free(c->url);
+    }
+
+    vws_reactor_free(p->reactor);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+
+    vws.free(p->cnxs);
+    vws.free(p);
+}
+
+vrtql_rpc* vrtql_rpc_pool_get(vrtql_rpc_pool* p)
+{
+    vrtql_rpc_pool_cnx* best = NULL;
+    size_t load              = 0;
+    size_t at                = 0;
+
+    for (size_t i = 0; i < p->size; i++)
+    {
+        size_t k              = (p->next + i) % p->size;
+        vrtql_rpc_pool_cnx* c = &p->cnxs[k];
+
+        if (__atomic_load_n(&c->up, __ATOMIC_ACQUIRE) == false)
+        {
+            continue;
+        }
+
+        if (vws_socket_is_connected((vws_socket*)c->rpc->cnx) == false)
+        {
+            // Dropped since it was last used
+            rpc_pool_down(p, c);
+            continue;
+        }
+
+        size_t n = vrtql_rpc_pending(c->rpc);
+
+        if (best == NULL || n < load)
+        {
+            best = c;
+            load = n;
+            at   = k;
+        }
+    }
+
+    if (best == NULL)
+    {
+        vws.error(VE_SOCKET, "No connection available");
+        vws_set_flag(&vws.e.code, VE_SEND);
+
+        return NULL;
+    }
+
+    // Ties go to the next one along next time
+    p->next = at + 1;
+
+    return best->rpc;
+}
+
+vrtql_msg* vrtql_rpc_pool_exec(vrtql_rpc_pool* p, vrtql_msg* req)
+{
+    for (size_t i = 0; i < p->size; i++)
+    {
+        vrtql_rpc* rpc = vrtql_rpc_pool_get(p);
+
+        if (rpc == NULL)
+        {
+            // Error already set
+            return NULL;
+        }
+
+        vrtql_msg* reply = vrtql_rpc_exec(rpc, req);
+
+        if (reply != NULL || vws_is_flag(&vws.e.code, VE_SOCKET) == false)
+        {
+            return reply;
+        }
+
+        uint64_t code = vws.e.code;
+        rpc_pool_down(p, (vrtql_rpc_pool_cnx*)rpc->cnx->data);
+        vws.e.code = code;
+
+        if (vws_is_flag(&vws.e.code, VE_SEND) == false)
+        {
+            // Sent, and the reply lost. It may not be safe to send again.
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+bool vrtql_rpc_pool_send( vrtql_rpc_pool* p,
+                          vrtql_msg* req,
+                          vrtql_rpc_cb cb,
+                          void* data )
+{
+    for (size_t i = 0; i < p->size; i++)
+    {
+        vrtql_rpc* rpc = vrtql_rpc_pool_get(p);
+
+        if (rpc == NULL)
+        {
+            // Error already set
+            return false;
+        }
+
+        if (vrtql_rpc_send(rpc, req, cb, data) == true)
+        {
+            return true;
+        }
+
+        if (vws_is_flag(&vws.e.code, VE_SOCKET) == false)
+        {
+            return false;
+        }
+
+        uint64_t code = vws.e.code;
+        rpc_pool_down(p, (vrtql_rpc_pool_cnx*)rpc->cnx->data);
+        vws.e.code = code;
+    }
+
+    return false;
+}
+
+int vrtql_rpc_pool_poll(vrtql_rpc_pool* p, int timeout)
+{
+    p->completed = 0;
+
+    for (size_t i = 0; i < p->size; i++)
+    {
+        vrtql_rpc_pool_cnx* c = &p->cnxs[i];
+
+        if (__atomic_load_n(&c->up, __ATOMIC_ACQUIRE) == false)
+        {
+            continue;
+        }
+
+        if (c->polled == false)
+        {
+            // New, or back from the reconnect thread
+            c->polled = vws_reactor_add(p->reactor, c->rpc->cnx);
+        }
+
+        // Responses that came in with others while waiting for a reply
+        p->completed += rpc_drain(c->rpc);
+    }
+
+    if (p->completed > 0)
+    {
+        return p->completed;
+    }
+
+    if (vws_reactor_run(p->reactor, timeout) < 0)
+    {
+        // Error already set
+        return -1;
+    }
+
+    return p->completed;
 }
 
-vrtql_msg* vrtql_rpc_exec(vrtql_rpc* rpc, vrtql_msg* req)
+size_t vrtql_rpc_pool_up(vrtql_rpc_pool* p)
 {
-    //> Send request
-
-    // Assign a tag to verify response
-    cstr tag = vrtql_rpc_tag(7);
-    vrtql_msg_set_routing(req, "tag", tag);
+    size_t n = 0;
 
-    if (vws.tracelevel >= VT_SERVICE)
+    for (size_t i = 0; i < p->size; i++)
     {
-        vws_trace_lock();
-        printf("\n\n");
-        printf("+----------------------------------------------------+\n");
-        printf("| Message Sent                                       |\n");
-        printf("+----------------------------------------------------+\n");
-        vrtql_msg_dump(req);
-        printf("------------------------------------------------------\n");
-        vws_trace_unlock();
+        if (__atomic_load_n(&p->cnxs[i].up, __ATOMIC_ACQUIRE) == true)
+        {
+            n++;
+        }
     }
 
-    // Loop until message sent or fatal error. Timeouts are ignored: keeps
-    // grinding until message is fully sent or error.
-    while (true)
+    return n;
+}
+
+void rpc_pool_down(vrtql_rpc_pool* p, vrtql_rpc_pool_cnx* c)
+{
+    if (__atomic_load_n(&c->up, __ATOMIC_ACQUIRE) == false)
     {
-        if (vrtql_msg_send(rpc->cnx, req) > 0)
-        {
-            // Message successfully sent
-            break;
-        }
+        return;
+    }
 
-        // If connection dropped
-        if (vws.e.code == VE_SOCKET)
-        {
-            // Try to reconnect
-            if (reconnect(rpc) == true)
-            {
-                // Reconnect worked. Try again.
-                continue;
-            }
+    // Finished with it before the reconnect thread takes it
+    vws_reactor_remove(p->reactor, c->rpc->cnx);
+    c->polled = false;
 
-            // Failed to reconnect. Modify error to indicate the failure was on
-            // send so the caller knows the message was not sent. Error will
-            // have both bits set: VE_SOCKET and VE_SEND.
-            vws_set_flag(&vws.e.code, VE_SEND);
-        }
+    vws.error(VE_SOCKET, "Connection lost");
+    vws_set_flag(&vws.e.code, VE_RECV);
+    rpc_fail_pending(c->rpc);
 
-        // Hand error back to caller.
-        free(tag);
-        return NULL;
-    }
+    __atomic_store_n(&c->up, false, __ATOMIC_RELEASE);
 
-    //> Wait for response
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
 
-    int retries      = 0;
-    vrtql_msg* reply = NULL;
+void* rpc_pool_thread(void* arg)
+{
+    vrtql_rpc_pool* p = (vrtql_rpc_pool*)arg;
 
-    while (retries < rpc->retries)
+    pthread_mutex_lock(&p->lock);
+
+    while (p->running == true)
     {
-        reply = vrtql_msg_recv(rpc->cnx);
+        bool pending = false;
 
-        // If we have a message
-        if (reply != NULL)
+        pthread_mutex_unlock(&p->lock);
+
+        for (size_t i = 0; i < p->size; i++)
         {
-            // Get message tag
-            cstr t = vrtql_msg_get_routing(reply, "tag");
+            vrtql_rpc_pool_cnx* c = &p->cnxs[i];
 
-            // If tags do not match
-            if (strncmp(tag, t, strlen(tag)) != 0)
+            if (__atomic_load_n(&c->up, __ATOMIC_ACQUIRE) == true)
             {
-                // This is not response message. Send to handler.
-                rpc->out_of_band(rpc, reply);
-
-                // Keep waiting for response.
                 continue;
             }
 
-            vws.success();
+            if (reconnect(c->rpc) == true)
+            {
+                __atomic_store_n(&c->up, true, __ATOMIC_RELEASE);
+            }
+            else
+            {
+                pending = true;
+            }
+        }
+
+        pthread_mutex_lock(&p->lock);
 
+        if (p->running == false)
+        {
             break;
         }
 
-        if (vws.e.code == VE_TIMEOUT)
+        // Until the next attempt is due, or another connection drops
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        uint64_t ms = pending ? p->retry : 60000;
+        ts.tv_sec  += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000;
+
+        if (ts.tv_nsec >= 1000000000)
         {
-            retries++;
-            continue;
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
         }
-        else
-        {
-            if (vws.e.code == VE_SOCKET)
-            {
-                // Modify error to indicate the failure was on recv, so the
-                // caller knows the message was sent. Error will have both bits
-                // set: VE_SOCKET and VE_RECV.
-                vws_set_flag(&vws.e.code, VE_RECV);
-            }
 
-            // Something unexpected happend. We expect vrtql_msg_recv() to set
-            // appropriate error. Even if disconenct (VE_SOCKET) there is no
-            // point in reconnecting because we have lost our response no matter
-            // what. We will leave error as it is and hand back to caller.
-            break;
-        }
+        pthread_cond_timedwait(&p->cond, &p->lock, &ts);
     }
 
-    free(tag);
-
-    if ((vws.tracelevel >= VT_SERVICE) && (reply != NULL))
-    {
-        vws_trace_lock();
-        printf("\n\n");
-        printf("+----------------------------------------------------+\n");
-        printf("| Message Received                                   |\n");
-        printf("+----------------------------------------------------+\n");
-        vrtql_msg_dump(reply);
-        printf("------------------------------------------------------\n");
-        vws_trace_unlock();
-    }
+    pthread_mutex_unlock(&p->lock);
 
-    return reply;
+    return NULL;
 }
 
-void out_of_band_default(vrtql_rpc* rpc, vrtql_msg* m)
+void rpc_pool_msg(vws_reactor* r, vws_cnx* c, vws_msg* wsm)
 {
-    if (m != NULL)
+    vrtql_rpc_pool* p     = (vrtql_rpc_pool*)r->data;
+    vrtql_rpc_pool_cnx* k = (vrtql_rpc_pool_cnx*)c->data;
+
+    vrtql_msg* m = vrtql_msg_new();
+    bool ok      = vrtql_msg_deserialize_ws(m, wsm);
+    vws_msg_free(wsm);
+
+    if (ok == false)
     {
         vrtql_msg_free(m);
+        return;
     }
-}
-
-//------------------------------------------------------------------------------
-// Client-side API
-//------------------------------------------------------------------------------
-
-vrtql_rpc* vrtql_rpc_new(vws_cnx* cnx)
-{
-    vrtql_rpc* rpc   = (vrtql_rpc*)vws.malloc(sizeof(vrtql_rpc));
-    rpc->cnx         = cnx;
-    rpc->retries     = 5;
-    rpc->out_of_band = out_of_band_default;
-    rpc->reconnect   = NULL;
-    rpc->data        = NULL;
-    rpc->val         = vws_buffer_new();
 
-    return rpc;
+    if (vrtql_rpc_dispatch(k->rpc, m) == true)
+    {
+        p->completed++;
+    }
+    else
+    {
+        k->rpc->out_of_band(k->rpc, m);
+    }
 }
 
-void vrtql_rpc_free(vrtql_rpc* rpc)
+void rpc_pool_close(vws_reactor* r, vws_cnx* c)
 {
-    if (rpc != NULL)
-    {
-        vws_buffer_new(rpc->val);
-        vws.free(rpc);
-    }
+    vrtql_rpc_pool_cnx* k = (vrtql_rpc_pool_cnx*)c->data;
+
+    // Already unregistered
+    k->polled = false;
+    rpc_pool_down((vrtql_rpc_pool*)r->data, k);
 }
 
 //------------------------------------------------------------------------------
 // Server-side Internal functions
 //------------------------------------------------------------------------------
 
+/**
+ * @brief Services a batch envelope. Each call is serviced in order and the
+ * replies are packed into a reply envelope.
+ *
+ * @param s The RPC system instance
+ * @param e The RPC environment
+ * @param m The batch envelope. This is freed.
+ * @return The reply envelope, or NULL if the envelope is invalid.
+ */
+static vrtql_msg* rpc_service_batch( vrtql_rpc_system* s,
+                                     vrtql_rpc_env* e,
+                                     vrtql_msg* m );
+
 typedef void (*vrtql_rpc_map_free)(void* e);
 
 /**
@@ -295,6 +1339,19 @@ static void sys_map_set(vrtql_rpc_map* map, cstr key, void* value);
  */
 static void sys_map_clear(vrtql_rpc_map* map, cstr key, vrtql_rpc_map_free cb);
 
+/**
+ * @brief Adds a call to the system dispatch table under its full call ID.
+ *
+ * @param s The RPC system
+ * @param m The module the call belongs to
+ * @param n The name of the call within the module
+ * @param c The RPC call
+ */
+static void sys_index( vrtql_rpc_system* s,
+                       vrtql_rpc_module* m,
+                       cstr n,
+                       vrtql_rpc_call c );
+
 //------------------------------------------------------------------------------
 // Server-side API
 //------------------------------------------------------------------------------
@@ -310,7 +1367,8 @@ vrtql_rpc_module* vrtql_rpc_module_new(cstr name)
 
     m = (vrtql_rpc_module*)vws.malloc(sizeof(vrtql_rpc_module));
 
-    m->name = strdup(name);
+    m->name   = vws_strdup(name);
+    m->system = NULL;
     sc_map_init_sv(&m->calls, 0, 0);
 
     return m;
@@ -336,6 +1394,11 @@ void vrtql_rpc_module_free(vrtql_rpc_module* m)
 void vrtql_rpc_module_set(vrtql_rpc_module* m, cstr n, vrtql_rpc_call c)
 {
     sys_map_set(&m->calls, n, c);
+
+    if (m->system != NULL)
+    {
+        sys_index(m->system, m, n, c);
+    }
 }
 
 vrtql_rpc_call vrtql_rpc_module_get(vrtql_rpc_module* m, cstr n)
@@ -352,6 +1415,10 @@ vrtql_rpc_system* vrtql_rpc_system_new()
     vrtql_rpc_system* s;
     s = (vrtql_rpc_system*)vws.malloc(sizeof(vrtql_rpc_system));
     sc_map_init_sv(&s->modules, 0, 0);
+    sc_map_init_sv(&s->calls, 0, 0);
+
+    s->numbered      = NULL;
+    s->numbered_size = 0;
 
     return s;
 }
@@ -375,6 +1442,15 @@ void vrtql_rpc_system_free(vrtql_rpc_system* s)
 
         sc_map_term_sv(&s->modules);
 
+        cstr id; vrtql_rpc_call call;
+        sc_map_foreach(&s->calls, id, call)
+        {
+            vws.free(id);
+        }
+
+        sc_map_term_sv(&s->calls);
+        vws.free(s->numbered);
+
         vws.free(s);
     }
 }
@@ -382,6 +1458,16 @@ void vrtql_rpc_system_free(vrtql_rpc_system* s)
 void vrtql_rpc_system_set(vrtql_rpc_system* s, vrtql_rpc_module* m)
 {
     sys_map_set(&s->modules, m->name, m);
+
+    // Index the calls it already has. Calls added later are indexed by
+    // vrtql_rpc_module_set().
+    m->system = s;
+
+    cstr n; vrtql_rpc_call c;
+    sc_map_foreach(&m->calls, n, c)
+    {
+        sys_index(s, m, n, c);
+    }
 }
 
 vrtql_rpc_module* vrtql_rpc_system_get(vrtql_rpc_system* s, cstr n)
@@ -389,97 +1475,98 @@ vrtql_rpc_module* vrtql_rpc_system_get(vrtql_rpc_system* s, cstr n)
     return sys_map_get(&s->modules, n);
 }
 
-//------------------------------------------------------------------------------
-// RPC API
-//------------------------------------------------------------------------------
-
-bool parse_rpc_string(const char* input, char** module, char** function)
+bool vrtql_rpc_system_bind(vrtql_rpc_system* s, cstr id, uint32_t n)
 {
-    // Find the first occurrence of the period
-    const char* delimiter = strchr(input, '.');
+    vrtql_rpc_call call = sys_map_get(&s->calls, id);
 
-    if (delimiter != NULL)
+    if (call == NULL)
     {
-        // Calculate the lengths of the module and function substrings
-        size_t m_len = delimiter - input;
-        size_t f_len = strlen(input) - m_len - 1;
-
-        // Allocate memory for the module and function strings
-        *module   = (char*)vws.malloc((m_len + 1) * sizeof(char));
-        *function = (char*)vws.malloc((f_len + 1) * sizeof(char));
+        vws.error(VE_RT, "RPC does not exist");
+        return false;
+    }
 
-        // Copy the module substring
-        strncpy(*module, input, m_len);
-        (*module)[m_len] = '\0';
+    if (n >= s->numbered_size)
+    {
+        uint32_t size = n + 1;
+        s->numbered   = vws.realloc(s->numbered, sizeof(vrtql_rpc_call) * size);
 
-        // Copy the function substring
-        strncpy(*function, delimiter + 1, f_len);
-        (*function)[f_len] = '\0';
+        for (uint32_t i = s->numbered_size; i < size; i++)
+        {
+            s->numbered[i] = NULL;
+        }
 
-        return true;
+        s->numbered_size = size;
     }
 
-    // Invalid input format
-    return false;
+    s->numbered[n] = call;
+
+    return true;
 }
 
+//------------------------------------------------------------------------------
+// RPC API
+//------------------------------------------------------------------------------
+
 vrtql_msg* vrtql_rpc_service(vrtql_rpc_system* s, vrtql_rpc_env* e, vrtql_msg* m)
 {
     vws.success();
 
+    e->deferred = false;
+
     cstr id = vrtql_msg_get_header(m, "id");
 
-    if (id == NULL)
+    if ((id != NULL) && (strcmp(id, VRTQL_RPC_BATCH) == 0))
     {
-        vws.error(VE_RT, "ID not specified");
+        return rpc_service_batch(s, e, m);
+    }
 
-        vrtql_msg_free(m);
+    vrtql_rpc_call rpc = NULL;
 
-        return NULL;
-    }
+    // A numeric call ID goes straight to its slot
+    cstr cid = vrtql_msg_get_header(m, VRTQL_RPC_CID);
 
-    // Parse ID into module and function
-    char* mn; char* fn;
-    if (parse_rpc_string(id, &mn, &fn) == false)
+    if (cid != NULL)
     {
-        vws.error(VE_RT, "Invalid ID format");
-
-        vrtql_msg_free(m);
+        char* end;
+        unsigned long n = strtoul(cid, &end, 10);
 
-        return NULL;
+        if ((*end == '\0') && (n < s->numbered_size))
+        {
+            rpc = s->numbered[n];
+        }
     }
 
-    // Lookup module in system
-    vrtql_rpc_module* module = vrtql_rpc_system_get(s, mn);
-
-    if (module == NULL)
+    // Otherwise a single lookup of the full ID in the dispatch table
+    if (rpc == NULL)
     {
-        vws.error(VE_RT, "RPC does not exist");
+        if (id == NULL)
+        {
+            vws.error(VE_RT, "ID not specified");
 
-        vrtql_msg_free(m);
-        vws.free(mn);
-        vws.free(fn);
+            vrtql_msg_free(m);
 
-        return NULL;
-    }
+            return NULL;
+        }
 
-    // Lookup RPC in module
-    vrtql_rpc_call rpc = vrtql_rpc_module_get(module, fn);
+        rpc = sys_map_get(&s->calls, id);
+    }
 
     if (rpc == NULL)
     {
-        vws.error(VE_RT, "RPC does not exist");
+        if (strchr(id, '.') == NULL)
+        {
+            vws.error(VE_RT, "Invalid ID format");
+        }
+        else
+        {
+            vws.error(VE_RT, "RPC does not exist");
+        }
 
         vrtql_msg_free(m);
-        vws.free(mn);
-        vws.free(fn);
 
         return NULL;
     }
 
-    vws.free(mn);
-    vws.free(fn);
-
     // Invoke RPC
     vrtql_msg* reply = rpc(e, m);
 
@@ -490,10 +1577,136 @@ vrtql_msg* vrtql_rpc_service(vrtql_rpc_system* s, vrtql_rpc_env* e, vrtql_msg* m
     return reply;
 }
 
+void vrtql_rpc_env_init(vrtql_rpc_env* e)
+{
+    e->data     = NULL;
+    e->deliver  = NULL;
+    e->target   = NULL;
+    e->id       = 0;
+    e->deferred = false;
+}
+
+vrtql_rpc_reply* vrtql_rpc_defer(vrtql_rpc_env* e, vrtql_msg* m)
+{
+    if (e->deliver == NULL)
+    {
+        vws.error(VE_RT, "Call cannot be deferred");
+        return NULL;
+    }
+
+    cstr tag = vrtql_msg_get_routing(m, "tag");
+
+    vrtql_rpc_reply* r = vws.malloc(sizeof(vrtql_rpc_reply));
+    r->tag             = (tag != NULL) ? vws_strdup(tag) : NULL;
+    r->format          = m->format;
+    r->deliver         = e->deliver;
+    r->target          = e->target;
+    r->id              = e->id;
+
+    e->deferred = true;
+
+    return r;
+}
+
+void vrtql_rpc_complete(vrtql_rpc_reply* r, vrtql_msg* reply)
+{
+    if (r->tag != NULL && vrtql_msg_get_routing(reply, "tag") == NULL)
+    {
+        vrtql_msg_set_routing(reply, "tag", r->tag);
+    }
+
+    reply->format = r->format;
+    r->deliver(r, reply);
+
+    vws.free(r->tag);
+    vws.free(r);
+}
+
 //------------------------------------------------------------------------------
 // Internal Functions
 //------------------------------------------------------------------------------
 
+vrtql_msg* rpc_service_batch(vrtql_rpc_system* s, vrtql_rpc_env* e, vrtql_msg* m)
+{
+    size_t n;
+    vrtql_msg** calls = rpc_batch_unpack(m, &n);
+
+    if (calls == NULL && vws.e.code != VE_SUCCESS)
+    {
+        // Error already set
+        vrtql_msg_free(m);
+        return NULL;
+    }
+
+    vrtql_msg** replies = vws.malloc(sizeof(vrtql_msg*) * (n + 1));
+
+    // The replies all go back in one envelope, so none can come later
+    vrtql_rpc_deliver deliver = e->deliver;
+    e->deliver                = NULL;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        // Keep the call's tag: vrtql_rpc_service() frees the call.
+        cstr t    = vrtql_msg_get_routing(calls[i], "tag");
+        char* tag = (t != NULL) ? vws_strdup(t) : NULL;
+
+        vrtql_msg* reply = vrtql_rpc_service(s, e, calls[i]);
+
+        if (reply == NULL)
+        {
+            // Report the failure in place so the other calls still count
+            char rc[32];
+            snprintf(rc, sizeof(rc), "%" PRIu64, vws.e.code);
+
+            reply = vrtql_msg_new();
+            vrtql_msg_set_header(reply, "rc", rc);
+
+            if (vws.e.text != NULL)
+            {
+                vrtql_msg_set_header(reply, "msg", vws.e.text);
+            }
+        }
+
+        if (tag != NULL)
+        {
+            if (vrtql_msg_get_routing(reply, "tag") == NULL)
+            {
+                vrtql_msg_set_routing(reply, "tag", tag);
+            }
+
+            vws.free(tag);
+        }
+
+        replies[i] = reply;
+    }
+
+    e->deliver = deliver;
+
+    vrtql_msg* reply = vrtql_msg_new();
+    vrtql_msg_set_header(reply, "rc", "0");
+
+    bool packed = rpc_batch_pack(reply, replies, n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vrtql_msg_free(replies[i]);
+    }
+
+    vws.free(replies);
+    vws.free(calls);
+    vrtql_msg_free(m);
+
+    if (packed == false)
+    {
+        vrtql_msg_free(reply);
+        return NULL;
+    }
+
+    vws.success();
+
+    return reply;
+}
+
 void* sys_map_get(vrtql_rpc_map* map, cstr key)
 {
     // See if we have an existing entry
@@ -515,12 +1728,26 @@ void sys_map_set(vrtql_rpc_map* map, cstr key, void* value)
     if (sc_map_found(map) == false)
     {
         // We don't. Therefore we need to allocate new key.
-        key = strdup(key);
+        key = vws_strdup(key);
     }
 
     sc_map_put_sv(map, key, value);
 }
 
+void sys_index( vrtql_rpc_system* s,
+                vrtql_rpc_module* m,
+                cstr n,
+                vrtql_rpc_call c )
+{
+    size_t size = strlen(m->name) + strlen(n) + 2;
+    char* id    = vws.malloc(size);
+    snprintf(id, size, "%s.%s", m->name, n);
+
+    sys_map_set(&s->calls, id, c);
+
+    vws.free(id);
+}
+
 void sys_map_clear(vrtql_rpc_map* map, cstr key, vrtql_rpc_map_free cb)
 {
     // See if we have an existing entry
@@ -1,7 +1,10 @@
 #ifndef VRTQL_RPC_DECLARE
 #define VRTQL_RPC_DECLARE
 
+#include <pthread.h>
+
 #include "message.h"
+#include "reactor.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,6 +23,10 @@ extern "C" {
 
 struct vrtql_rpc;
 
+/** The id of a batch envelope. Sub-call ids always contain a '.' (see
+ * vrtql_rpc_service()), so this can never clash with a real call. */
+#define VRTQL_RPC_BATCH "batch"
+
 /**
  * @brief Callback for out-of-band messages received during RPC call
  * @param e The RPC environment
@@ -35,6 +42,19 @@ typedef void (*vrtql_rpc_ob)(struct vrtql_rpc* rpc, vrtql_msg* m);
  */
 typedef bool (*vrtql_rpc_reconnect)(struct vrtql_rpc* rpc);
 
+/**
+ * @brief Completion callback for an asynchronous RPC call.
+ * @param rpc The RPC instance
+ * @param reply The response message. The callback takes ownership and must
+ *        free it with vrtql_msg_free(). This is NULL if the call failed before
+ *        a response arrived (connection lost, or the RPC instance was freed),
+ *        in which case vws.e holds the error.
+ * @param data The user data passed to vrtql_rpc_send()
+ */
+typedef void (*vrtql_rpc_cb)( struct vrtql_rpc* rpc,
+                              vrtql_msg* reply,
+                              void* data );
+
 /**
  * @brief Struct representing a RPC environment
  */
@@ -52,9 +72,19 @@ typedef struct vrtql_rpc
     /**> User-defined handler for reconnect */
     vrtql_rpc_reconnect reconnect;
 
+    /**< Reconnect and send again when the connection has dropped (default
+     * true). Connections in a vrtql_rpc_pool leave it to the pool. */
+    bool autoreconnect;
+
     /**< Data from last response */
     vws_buffer* val;
 
+    /**< Asynchronous calls awaiting a response. Key is call id. */
+    struct sc_map_64v pending;
+
+    /**< Sequence of call ids. Calls are tagged with the id in hex. */
+    uint64_t sequence;
+
     /**> User-defined data*/
     void* data;
 
@@ -77,7 +107,9 @@ void vrtql_rpc_free(vrtql_rpc* rpc);
 
 /**
  * @brief Low-level RPC call invocation. This takes a message as input, sends
- * and waits for a response.
+ * and waits for a response. It waits up to retries times the connection
+ * timeout, and sets that as the request's deadline (VM_DEADLINE) unless it
+ * already has one, so that the server drops it if it is still queued by then.
  *
  * @param rpc The RPC instance
  * @param req The message to send
@@ -106,10 +138,284 @@ vrtql_msg* vrtql_rpc_exec(vrtql_rpc* rpc, vrtql_msg* req);
  */
 bool vrtql_rpc_invoke(vrtql_rpc* rpc, vrtql_msg* req);
 
+/**
+ * @brief Asynchronous RPC call invocation. This tags and sends the message and
+ * returns without waiting. The response is delivered to the callback by
+ * vrtql_rpc_poll() or vrtql_rpc_dispatch(). Any number of calls can be in
+ * flight on the same connection at once.
+ *
+ * @param rpc The RPC instance
+ * @param req The message to send. The caller still owns it.
+ * @param cb The completion callback
+ * @param data User data passed to the callback
+ * @return True if the request was sent, false otherwise. The callback is never
+ *         called for a request that was not sent. If connection fails, error
+ *         will have VE_SOCKET and VE_SEND set.
+ */
+bool vrtql_rpc_send(vrtql_rpc* rpc, vrtql_msg* req, vrtql_rpc_cb cb, void* data);
+
+/**
+ * @brief Receives responses to asynchronous calls and completes them. This
+ * waits up to the connection timeout for the first message, then handles
+ * every message already received without waiting further. Messages that are
+ * not responses go to the out-of-band handler.
+ *
+ * @param rpc The RPC instance
+ * @return The number of calls completed, 0 on timeout, or -1 if the connection
+ *         failed. On failure, every pending call is completed with a NULL
+ *         reply and vws.e has VE_SOCKET and VE_RECV set.
+ */
+int vrtql_rpc_poll(vrtql_rpc* rpc);
+
+/**
+ * @brief Completes the asynchronous call a message is a response to. Use this
+ * to feed responses received some other way, such as from a vws_reactor.
+ *
+ * @param rpc The RPC instance
+ * @param m The message
+ * @return True if the message matched a pending call, in which case it was
+ *         handed to the call's callback. False otherwise, and the caller still
+ *         owns the message.
+ */
+bool vrtql_rpc_dispatch(vrtql_rpc* rpc, vrtql_msg* m);
+
+/**
+ * @brief Returns the number of asynchronous calls awaiting a response.
+ *
+ * @param rpc The RPC instance
+ * @return The number of pending calls
+ */
+size_t vrtql_rpc_pending(vrtql_rpc* rpc);
+
+/**
+ * @brief A batch of RPC calls sent in a single round-trip. The calls travel
+ * in one envelope message whose content packs the sub-call messages, and come
+ * back the same way, one reply per call in the same order.
+ */
+typedef struct vrtql_rpc_batch
+{
+    /**< The calls, in order */
+    vrtql_msg** calls;
+
+    /**< The replies, one per call in the same order. Set by
+     * vrtql_rpc_batch_exec(). */
+    vrtql_msg** replies;
+
+    /**< The number of calls */
+    size_t size;
+
+    /**< The number of calls allocated */
+    size_t capacity;
+
+} vrtql_rpc_batch;
+
+/**
+ * @brief Creates a new, empty batch.
+ *
+ * @return A new batch.
+ */
+vrtql_rpc_batch* vrtql_rpc_batch_new();
+
+/**
+ * @brief Frees a batch, including its calls and replies.
+ *
+ * @param b The batch
+ */
+void vrtql_rpc_batch_free(vrtql_rpc_batch* b);
+
+/**
+ * @brief Adds a call to a batch.
+ *
+ * @param b The batch
+ * @param req The request. The batch takes ownership.
+ */
+void vrtql_rpc_batch_add(vrtql_rpc_batch* b, vrtql_msg* req);
+
+/**
+ * @brief Returns the reply to a call in a batch.
+ *
+ * @param b The batch
+ * @param i The index of the call
+ * @return The reply, or NULL if there is none. The batch still owns it.
+ */
+vrtql_msg* vrtql_rpc_batch_reply(vrtql_rpc_batch* b, size_t i);
+
+/**
+ * @brief Sends every call in a batch in one message and waits for the replies.
+ * A call the server could not service gets a reply with its "rc" and "msg"
+ * headers set from the server-side error.
+ *
+ * @param rpc The RPC instance
+ * @param b The batch. Replies from a previous execution are replaced.
+ * @return True if the batch reply was received, false otherwise. Errors are
+ *         reported as for vrtql_rpc_exec().
+ */
+bool vrtql_rpc_batch_exec(vrtql_rpc* rpc, vrtql_rpc_batch* b);
+
+/** Milliseconds between attempts to reconnect a pool connection */
+#define VRTQL_RPC_POOL_RETRY 1000
+
+/**
+ * @brief A connection in a vrtql_rpc_pool.
+ */
+typedef struct vrtql_rpc_pool_cnx
+{
+    /**< The RPC instance over the connection */
+    vrtql_rpc* rpc;
+
+    /**< The endpoint */
+    char* url;
+
+    /**< Whether it is connected. While it is not, it belongs to the pool's
+     * reconnect thread and is never picked. Changed atomically. */
+    bool up;
+
+    /**< Whether it is registered with the pool's reactor */
+    bool polled;
+
+} vrtql_rpc_pool_cnx;
+
+/**
+ * @brief A pool of RPC connections spread over several endpoints, such as the
+ * servers of a cluster. Each call goes to the connection with the fewest
+ * asynchronous calls in flight, ties going round in turn.
+ *
+ * A connection that drops is handed to a background thread, which reconnects
+ * it (every retry milliseconds until it succeeds) while calls carry on over
+ * the others. Callers never wait for a reconnect, and the pool stays warm
+ * without waiting for the next call to notice. A call that could not be sent
+ * is sent on another connection. One that was sent is not, as it may not be
+ * safe to repeat.
+ *
+ * A pool is not thread safe. Use it from one thread, like a connection. To
+ * hook reconnects, set vrtql_rpc.reconnect on each connection's RPC instance.
+ * It is called in the reconnect thread.
+ */
+typedef struct vrtql_rpc_pool
+{
+    /**< The connections */
+    vrtql_rpc_pool_cnx* cnxs;
+
+    /**< The number of connections */
+    size_t size;
+
+    /**< Where the search for the least loaded connection starts next */
+    size_t next;
+
+    /**< Milliseconds between reconnect attempts (default
+     * VRTQL_RPC_POOL_RETRY) */
+    uint32_t retry;
+
+    /**< Receives the responses to asynchronous calls (vrtql_rpc_pool_poll()) */
+    vws_reactor* reactor;
+
+    /**< Calls completed by the current vrtql_rpc_pool_poll() */
+    int completed;
+
+    /**< The reconnect thread */
+    pthread_t thread;
+
+    /**< Guards running, and wakes the reconnect thread */
+    pthread_mutex_t lock;
+
+    /**< Signalled when a connection drops or the pool is freed */
+    pthread_cond_t cond;
+
+    /**< Cleared to stop the reconnect thread */
+    bool running;
+
+} vrtql_rpc_pool;
+
+/**
+ * @brief Creates a pool and connects it. Endpoints that cannot be reached
+ * now are retried in the background.
+ *
+ * @param urls The endpoint URLs
+ * @param n The number of endpoints
+ * @param per The number of connections to each endpoint
+ * @return A new pool.
+ */
+vrtql_rpc_pool* vrtql_rpc_pool_new(cstr* urls, size_t n, size_t per);
+
+/**
+ * @brief Frees a pool, disconnecting its connections. Asynchronous calls
+ * still in flight are completed with a NULL reply.
+ *
+ * @param p The pool
+ */
+void vrtql_rpc_pool_free(vrtql_rpc_pool* p);
+
+/**
+ * @brief Picks the least loaded connected connection.
+ *
+ * @param p The pool
+ * @return Its RPC instance, or NULL if none is connected (vws.e has VE_SOCKET
+ *         and VE_SEND set). The pool keeps it.
+ */
+vrtql_rpc* vrtql_rpc_pool_get(vrtql_rpc_pool* p);
+
+/**
+ * @brief Makes a call, as vrtql_rpc_exec(), on the least loaded connection. If
+ * the request could not be sent, it is sent on the next one.
+ *
+ * @param p The pool
+ * @param req The message to send
+ * @return The response message on success, NULL otherwise, with errors as for
+ *         vrtql_rpc_exec(). The caller must free the message.
+ */
+vrtql_msg* vrtql_rpc_pool_exec(vrtql_rpc_pool* p, vrtql_msg* req);
+
+/**
+ * @brief Makes an asynchronous call, as vrtql_rpc_send(), on the least loaded
+ * connection. If the request could not be sent, it is sent on the next one.
+ * The response is delivered by vrtql_rpc_pool_poll().
+ *
+ * @param p The pool
+ * @param req The message to send. The caller still owns it.
+ * @param cb The completion callback. It is passed the RPC instance of the
+ *        connection the call went out on.
+ * @param data User data passed to the callback
+ * @return True if the request was sent, false otherwise.
+ */
+bool vrtql_rpc_pool_send( vrtql_rpc_pool* p,
+                          vrtql_msg* req,
+                          vrtql_rpc_cb cb,
+                          void* data );
+
+/**
+ * @brief Receives responses to asynchronous calls on every connection and
+ * completes them, waiting on all of them at once. Calls on a connection that
+ * drops are completed with a NULL reply.
+ *
+ * @param p The pool
+ * @param timeout The longest to wait in milliseconds. -1 waits indefinitely.
+ * @return The number of calls completed, 0 on timeout, -1 on error.
+ */
+int vrtql_rpc_pool_poll(vrtql_rpc_pool* p, int timeout);
+
+/**
+ * @brief Returns the number of connections that are connected.
+ *
+ * @param p The pool
+ * @return The number of connections up
+ */
+size_t vrtql_rpc_pool_up(vrtql_rpc_pool* p);
+
 //------------------------------------------------------------------------------
 // Server Side
 //------------------------------------------------------------------------------
 
+struct vrtql_rpc_reply;
+
+/**
+ * @brief Sends the reply to a deferred call back to the caller. See
+ * vrtql_rpc_env.deliver.
+ * @param r The reply token
+ * @param m The reply, with its tag and format set. The callback takes
+ *        ownership.
+ */
+typedef void (*vrtql_rpc_deliver)(struct vrtql_rpc_reply* r, vrtql_msg* m);
+
 /**
  * @brief Struct representing a RPC environment
  */
@@ -118,8 +424,47 @@ typedef struct vrtql_rpc_env
     /**< The data */
     char* data;
 
+    /**< Sends the replies to deferred calls (see vrtql_rpc_defer()). Calls can
+     * only be deferred when this is set. vrtql_msg_svr_rpc_env() sets it up
+     * for a message server connection. */
+    vrtql_rpc_deliver deliver;
+
+    /**< Passed on to deliver in each reply token, such as the server */
+    void* target;
+
+    /**< Passed on to deliver in each reply token, such as the connection ID */
+    uint64_t id;
+
+    /**< Set if the call was deferred rather than answered. Reset by
+     * vrtql_rpc_service(). */
+    bool deferred;
+
 } vrtql_rpc_env;
 
+/**
+ * @brief A token for the reply to a deferred call. It carries what is needed
+ * to answer the caller, so it can be completed from any thread once the
+ * request itself is gone.
+ */
+typedef struct vrtql_rpc_reply
+{
+    /**< The request's tag, put on the reply. NULL if it had none. */
+    char* tag;
+
+    /**< The request's format, used for the reply */
+    unsigned char format;
+
+    /**< From the environment the call was serviced in */
+    vrtql_rpc_deliver deliver;
+
+    /**< From the environment the call was serviced in */
+    void* target;
+
+    /**< From the environment the call was serviced in */
+    uint64_t id;
+
+} vrtql_rpc_reply;
+
 /**
  * @brief Callback for RPC call
  * @param e The RPC environment
@@ -131,6 +476,11 @@ typedef vrtql_msg* (*vrtql_rpc_call)(vrtql_rpc_env* e, vrtql_msg* m);
  * for the module system and registry of RPC calls for each module. */
 typedef struct sc_map_sv vrtql_rpc_map;
 
+/** The header holding a numeric call ID. See vrtql_rpc_system_bind(). */
+#define VRTQL_RPC_CID "cid"
+
+struct vrtql_rpc_system;
+
 typedef struct vrtql_rpc_module
 {
     /**< Module name. */
@@ -139,6 +489,9 @@ typedef struct vrtql_rpc_module
     /**< Map of RPC calls. Key is call name. Value is vrtql_rpc_call. */
     vrtql_rpc_map calls;
 
+    /**< The system the module is registered in, if any. */
+    struct vrtql_rpc_system* system;
+
 } vrtql_rpc_module;
 
 typedef struct vrtql_rpc_system
@@ -146,6 +499,17 @@ typedef struct vrtql_rpc_system
     /**< Map of RPC modules. Key is module name. Value is module instance. */
     vrtql_rpc_map modules;
 
+    /**< Dispatch table of every registered call. Key is the full call ID
+     * ("module.function"). Value is vrtql_rpc_call. Kept up to date as modules
+     * and calls are registered so servicing a call is a single lookup. */
+    vrtql_rpc_map calls;
+
+    /**< Calls bound to numeric call IDs, indexed by ID. NULL if unbound. */
+    vrtql_rpc_call* numbered;
+
+    /**< The number of slots in numbered. */
+    uint32_t numbered_size;
+
 } vrtql_rpc_system;
 
 /**
@@ -212,13 +576,59 @@ void vrtql_rpc_system_set(vrtql_rpc_system* s, vrtql_rpc_module* m);
 vrtql_rpc_module* vrtql_rpc_system_get(vrtql_rpc_system* s, cstr n);
 
 /**
- * @brief Service an RPC call
+ * @brief Binds a numeric call ID to a registered call. A request carrying the
+ * VRTQL_RPC_CID header is dispatched by indexing with it, skipping the
+ * "id" lookup. IDs index a flat table, so keep them small and dense. Bind
+ * again if the call is replaced.
+ *
+ * @param s The RPC system
+ * @param id The full call ID ("module.function") of a registered call
+ * @param n The numeric call ID
+ * @return True on success, false if the call is not registered.
+ */
+bool vrtql_rpc_system_bind(vrtql_rpc_system* s, cstr id, uint32_t n);
+
+/**
+ * @brief Service an RPC call. A batch envelope (id VRTQL_RPC_BATCH) is
+ * unpacked and each of its calls serviced in order. The reply is an envelope
+ * holding one reply per call. Calls in a batch cannot be deferred.
  * @param c The RPC system instance
  * @param e The RPC environment
  * @param m The incoming message to process
+ * @return The reply. NULL on error, or if the call was deferred, in which case
+ *         e->deferred is set and the reply is sent when the call completes.
  */
 vrtql_msg* vrtql_rpc_service(vrtql_rpc_system* s, vrtql_rpc_env* e, vrtql_msg* m);
 
+/**
+ * @brief Clears an RPC environment. Calls serviced in it cannot be deferred.
+ *
+ * @param e The RPC environment
+ */
+void vrtql_rpc_env_init(vrtql_rpc_env* e);
+
+/**
+ * @brief Defers the reply to a call. An RPC call calls this and returns NULL
+ * straight away, leaving its worker free. Whatever it is waiting on completes
+ * it later with vrtql_rpc_complete(), from any thread.
+ *
+ * @param e The RPC environment the call is serviced in
+ * @param m The request. It is still freed when the call returns.
+ * @return The reply token, or NULL if the call cannot be deferred here
+ *         (e->deliver is not set, or it is part of a batch). vws.e is set and
+ *         the call should reply as usual.
+ */
+vrtql_rpc_reply* vrtql_rpc_defer(vrtql_rpc_env* e, vrtql_msg* m);
+
+/**
+ * @brief Completes a deferred call, sending the reply to the caller. It can
+ * be called from any thread. If the caller has gone, the reply is dropped.
+ *
+ * @param r The reply token. It is freed.
+ * @param reply The reply. It is freed.
+ */
+void vrtql_rpc_complete(vrtql_rpc_reply* r, vrtql_msg* reply);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,6 +36,10 @@ unless have_library('crypto')
   abort "Crypto library is missing. Please install it."
 end
 
+unless have_library('z')
+  abort "zlib library is missing. Please install it."
+end
+
 unless $os_define.include?('__WINDOWS__')
   unless have_library('pthread')
     abort "Pthread library is missing. Please install it."
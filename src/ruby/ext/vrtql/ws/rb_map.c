@@ -6,10 +6,11 @@
 VALUE vr_map_cls;
 
 // Create a new message object
-VALUE vr_map_new(struct sc_map_str* map)
+VALUE vr_map_new(vrtql_msg* msg, struct sc_map_str* map)
 {
     // Wrap the sc_map_str pointer with a Ruby object
     vr_map* obj = ruby_xmalloc(sizeof(vr_map));
+    obj->msg    = msg;
     obj->map    = map;
 
     // Wrap the vr_msg object with a Ruby object and set the vr_msg_free
@@ -27,7 +28,8 @@ static VALUE msg_allocator(VALUE the_cls)
     rb_raise(rb_eRuntimeError, "Cannot create a VRTQL::Map");
 
     vr_map* handle = ruby_xmalloc(sizeof(vr_map));
-    handle->map       = NULL;
+    handle->msg    = NULL;
+    handle->map    = NULL;
 
     return Data_Wrap_Struct(the_cls, NULL, &vr_map_free, handle);
 }
@@ -82,18 +84,67 @@ static VALUE m_equals(VALUE self, VALUE other)
     return Qtrue;
 }
 
+void vr_map_changed(VALUE map)
+{
+    if (map != Qnil)
+    {
+        rb_ivar_set(map, rb_intern("hash"), Qnil);
+    }
+}
+
 static VALUE m_set(VALUE self, VALUE key, VALUE value)
 {
-    struct sc_map_str* map = get_object(self);
+    vr_map* handle;
+    Data_Get_Struct(self, vr_map, handle);
 
     char* c_key   = StringValueCStr(key);
     char* c_value = StringValueCStr(value);
 
-    vws_map_set(map, c_key, c_value);
+    // The message owns its strings
+    vrtql_msg_map_set(handle->msg, handle->map, c_key, c_value);
+
+    vr_map_changed(self);
 
     return Qnil;
 }
 
+/*
+ * Document-method: m_to_h
+ *
+ * call-seq: m_to_h -> Hash
+ *
+ * Converts the map to a frozen Hash. The Hash is built on the first call and
+ * returned again until the map changes.
+ *
+ * Returns:
+ *   A hash of the map's contents
+ */
+static VALUE m_to_h(VALUE self)
+{
+    ID id      = rb_intern("hash");
+    VALUE hash = rb_ivar_get(self, id);
+
+    if (hash != Qnil)
+    {
+        return hash;
+    }
+
+    struct sc_map_str* map = get_object(self);
+
+    hash = rb_hash_new();
+
+    char* key; char* value;
+    sc_map_foreach(map, key, value)
+    {
+        rb_hash_aset(hash, rb_str_new_cstr(key), rb_str_new_cstr(value));
+    }
+
+    rb_obj_freeze(hash);
+    rb_ivar_set(self, id, hash);
+
+    return hash;
+}
+
 static VALUE m_get(VALUE self, VALUE key)
 {
     struct sc_map_str* map = get_object(self);
@@ -119,4 +170,5 @@ void init_map(VALUE module)
     rb_define_method(vr_map_cls, "[]=",        m_set,  2);
     rb_define_method(vr_map_cls, "get",        m_get,  1);
     rb_define_method(vr_map_cls, "[]",         m_get,  1);
+    rb_define_method(vr_map_cls, "to_h",       m_to_h, 0);
 }
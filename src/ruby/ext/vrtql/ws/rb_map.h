@@ -3,19 +3,24 @@
 
 #include "rb_ws_common.h"
 #include "vrtql/util/sc_map.h"
+#include "vrtql/message.h"
 
-// Define the structure to hold the map pointer
+// Define the structure to hold the map pointer and the message that owns it
 typedef struct
 {
+    vrtql_msg* msg;
     struct sc_map_str* map;
 } vr_map;
 
-// Create a new map object
-VALUE vr_map_new(struct sc_map_str* map);
+// Create a new map object over one of a message's maps
+VALUE vr_map_new(vrtql_msg* msg, struct sc_map_str* map);
 
 // Memory deallocation function for the map object
 void vr_map_free(vr_map* map);
 
+// Drops the cached Hash of a map object (or nil) after its map has changed
+void vr_map_changed(VALUE map);
+
 extern VALUE vr_map_cls;
 
 void init_map(VALUE module);
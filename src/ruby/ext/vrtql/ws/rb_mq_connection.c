@@ -28,10 +28,13 @@ static VALUE vrtql_connection_allocator(VALUE the_cls)
     vr_mq_cnx* handle = ruby_xmalloc(sizeof(vr_mq_cnx));
 
     // Initialize base class
-    handle->base.cnx       = vws_cnx_new();
+    vr_ws_cnx_init(&handle->base);
     handle->default_format = VM_MPACK_FORMAT;
 
-    return Data_Wrap_Struct(the_cls, NULL, &vr_mq_cnx_free, handle);
+    return Data_Wrap_Struct( the_cls,
+                             &vr_ws_cnx_mark,
+                             &vr_mq_cnx_free,
+                             handle );
 }
 
 /*
@@ -129,9 +132,14 @@ static VALUE m_send(int argc, VALUE* argv, VALUE self)
     vrtql_msg* msg = vr_mq_get_object(value);
     msg->format = format;
     vws_buffer* binary = vrtql_msg_serialize(msg);
-    int sent = vws_msg_send_binary(c, binary->data, binary->size);
+    int sent = vr_ws_cnx_send_msg(c, binary->data, binary->size, 0x2);
     vws_buffer_free(binary);
 
+    if (sent < 0)
+    {
+        vr_ws_cnx_check_ints(c);
+    }
+
     // Return the number of bytes sent as a Ruby integer
     return INT2NUM(sent);
 }
@@ -151,8 +159,8 @@ static VALUE m_receive(VALUE self)
     vws_cnx* c = get_object(self);
     ensure_connected(c);
 
-    // Call the vws_recv_msg function from the C API
-    vws_msg* m = vws_msg_recv(c);
+    // Wait for a message without holding the GVL
+    vws_msg* m = vr_ws_cnx_recv_msg(c);
 
     if (m == NULL)
     {
@@ -164,9 +172,7 @@ static VALUE m_receive(VALUE self)
     VALUE object   = vr_mq_msg_new(msg);
 
     // Deserialize
-    cstr data   = m->data->data;
-    size_t size = m->data->size;
-    if (vrtql_msg_deserialize(msg, data, size) == false)
+    if (vrtql_msg_deserialize_ws(msg, m) == false)
     {
         // Set invalid (clear valid flag)
         vws_clear_flag(&msg->flags, VM_MSG_VALID);
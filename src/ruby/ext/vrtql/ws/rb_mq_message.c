@@ -47,6 +47,53 @@ void vr_mq_msg_free(vr_mq_msg* msg)
     ruby_xfree(msg);
 }
 
+// The content buffer behind a String view from m_get_content(). While the
+// message still uses the buffer, the message owns it and is kept alive (marked)
+// through here. When the content changes, the view's buffer is detached from
+// the message and owned here instead, until the view is collected.
+typedef struct
+{
+    vws_buffer* buffer;
+    VALUE message;
+    bool owned;
+} content_ref;
+
+static void content_ref_mark(content_ref* ref)
+{
+    rb_gc_mark(ref->message);
+}
+
+static void content_ref_free(content_ref* ref)
+{
+    if (ref->owned == true)
+    {
+        vws_buffer_free(ref->buffer);
+    }
+
+    ruby_xfree(ref);
+}
+
+// Gives the content buffer to the view on it, if any, so that the message can
+// change its content without pulling the memory out from under the view.
+static void content_detach(VALUE self, vrtql_msg* msg)
+{
+    ID id      = rb_intern("content");
+    VALUE view = rb_ivar_get(self, id);
+
+    if (view == Qnil)
+    {
+        return;
+    }
+
+    content_ref* ref;
+    Data_Get_Struct(rb_ivar_get(view, rb_intern("owner")), content_ref, ref);
+    ref->owned   = true;
+    ref->message = Qnil;
+
+    msg->content = vws_buffer_new();
+    rb_ivar_set(self, id, Qnil);
+}
+
 static VALUE msg_allocator(VALUE the_cls)
 {
     vr_mq_msg* handle = ruby_xmalloc(sizeof(vr_mq_msg));
@@ -78,25 +125,44 @@ vrtql_msg* vr_mq_get_object(VALUE obj)
  *
  * call-seq: m_get_headers -> Hash
  *
- * Retrieves the headers from the Message.
+ * Retrieves the headers from the Message. The same VRTQL::Map is returned on
+ * every call. Use to_h on it for a Hash.
  *
  * Returns:
  *   A hash of headers
  */
 static VALUE m_get_headers(VALUE self)
 {
+    ID id     = rb_intern("headers");
+    VALUE map = rb_ivar_get(self, id);
+
+    if (map != Qnil)
+    {
+        return map;
+    }
+
     vrtql_msg* msg = get_object(self);
 
-    VALUE map = vr_map_new(&msg->headers);
+    map = vr_map_new(msg, &msg->headers);
 
     // Assign the reference from table to self to keep a reference count on it.
     rb_ivar_set(map, rb_intern("message"), self);
 
+    // The map object is a view of the message's map. Keep it for later calls.
+    rb_ivar_set(self, id, map);
+
     return map;
 }
 
+// The message map a hash is being copied into
+typedef struct
+{
+    vrtql_msg* msg;
+    struct sc_map_str* map;
+} hash_target;
+
 // Function to be called for each key/value pair in the hash
-static int hash_iter(VALUE key, VALUE value, st_data_t map_ptr)
+static int hash_iter(VALUE key, VALUE value, st_data_t target_ptr)
 {
     // Check that the key and value are both strings
     Check_Type(key, T_STRING);
@@ -107,10 +173,10 @@ static int hash_iter(VALUE key, VALUE value, st_data_t map_ptr)
     char* c_value = RSTRING_PTR(value);
 
     // Get the map from the data pointer
-    struct sc_map_str* map = (struct sc_map_str*)map_ptr;
+    hash_target* target = (hash_target*)target_ptr;
 
     // Set the key/value in the map
-    vws_map_set(map, c_key, c_value);
+    vrtql_msg_map_set(target->msg, target->map, c_key, c_value);
 }
 
 /*
@@ -156,15 +222,13 @@ static VALUE m_set_headers(VALUE self, VALUE hash)
     Check_Type(hash, T_HASH);
 
     // Clear map contents
-    char* key; char* value;
-    sc_map_foreach(&msg->headers, key, value)
-    {
-        free(key);
-        free(value);
-    }
+    vrtql_msg_map_clear(msg, &msg->headers);
 
     // Iterate over Hash and set each key/value pair
-    rb_hash_foreach(hash, hash_iter, (st_data_t)&msg->headers);
+    hash_target target = { msg, &msg->headers };
+    rb_hash_foreach(hash, hash_iter, (st_data_t)&target);
+
+    vr_map_changed(rb_ivar_get(self, rb_intern("headers")));
 
     return self;
 }
@@ -190,15 +254,13 @@ static VALUE m_set_routing(VALUE self, VALUE hash)
     Check_Type(hash, T_HASH);
 
     // Clear map contents
-    char* key; char* value;
-    sc_map_foreach(&msg->routing, key, value)
-    {
-        free(key);
-        free(value);
-    }
+    vrtql_msg_map_clear(msg, &msg->routing);
 
     // Iterate over Hash and set each key/value pair
-    rb_hash_foreach(hash, hash_iter, (st_data_t)&msg->routing);
+    hash_target target = { msg, &msg->routing };
+    rb_hash_foreach(hash, hash_iter, (st_data_t)&target);
+
+    vr_map_changed(rb_ivar_get(self, rb_intern("routing")));
 
     return self;
 }
@@ -208,20 +270,32 @@ static VALUE m_set_routing(VALUE self, VALUE hash)
  *
  * call-seq: m_get_routing -> Hash
  *
- * Retrieves the routing from the Message.
+ * Retrieves the routing from the Message. The same VRTQL::Map is returned on
+ * every call. Use to_h on it for a Hash.
  *
  * Returns:
  *   A hash of routing
  */
 static VALUE m_get_routing(VALUE self)
 {
+    ID id     = rb_intern("routing");
+    VALUE map = rb_ivar_get(self, id);
+
+    if (map != Qnil)
+    {
+        return map;
+    }
+
     vrtql_msg* msg = get_object(self);
 
-    VALUE map = vr_map_new(&msg->routing);
+    map = vr_map_new(msg, &msg->routing);
 
     // Assign the reference from table to self to keep a reference count on it.
     rb_ivar_set(map, rb_intern("message"), self);
 
+    // The map object is a view of the message's map. Keep it for later calls.
+    rb_ivar_set(self, id, map);
+
     return map;
 }
 
@@ -249,6 +323,9 @@ static VALUE m_set_content(VALUE self, VALUE content)
     cstr data = RSTRING_PTR(content);
     long size = RSTRING_LEN(content);
 
+    // Leave the current content to the view on it, if any
+    content_detach(self, msg);
+
     // Use the pointer to the string and the size to set the message content
     vrtql_msg_set_content_binary(msg, data, size);
 
@@ -260,22 +337,44 @@ static VALUE m_set_content(VALUE self, VALUE content)
  *
  * call-seq: m_get_content -> String
  *
- * Retrieves the content from the Message.
+ * Retrieves the content from the Message. This is a frozen string over the
+ * message's content buffer rather than a copy. The same string is returned
+ * until the content changes. It stays valid after that.
  *
  * Returns:
  *   A string of the message content
  */
 static VALUE m_get_content(VALUE self)
 {
+    ID id         = rb_intern("content");
+    VALUE content = rb_ivar_get(self, id);
+
+    if (content != Qnil)
+    {
+        return content;
+    }
+
     vrtql_msg* msg = get_object(self);
-    char* val      = vrtql_msg_get_content(msg);
 
-    if (val == NULL)
+    if (vrtql_msg_get_content(msg) == NULL)
     {
         return Qnil;
     }
 
-    return rb_str_new_cstr(val);
+    content_ref* ref = ruby_xmalloc(sizeof(content_ref));
+    ref->buffer      = msg->content;
+    ref->message     = self;
+    ref->owned       = false;
+
+    VALUE owner = Data_Wrap_Struct( 0,
+                                    content_ref_mark,
+                                    content_ref_free,
+                                    ref );
+
+    content = vr_buffer_view(owner, msg->content);
+    rb_ivar_set(self, id, content);
+
+    return content;
 }
 
 /*
@@ -319,9 +418,15 @@ static VALUE m_deserialize(VALUE self, VALUE data)
     Check_Type(data, T_STRING);
 
     vrtql_msg* msg = get_object(self);
-    bool ret       = vrtql_msg_deserialize( msg,
-                                            RSTRING_PTR(data),
-                                            RSTRING_LEN(data) );
+
+    // Everything may change. Let go of the views on the old contents.
+    content_detach(self, msg);
+    vr_map_changed(rb_ivar_get(self, rb_intern("routing")));
+    vr_map_changed(rb_ivar_get(self, rb_intern("headers")));
+
+    bool ret = vrtql_msg_deserialize( msg,
+                                      RSTRING_PTR(data),
+                                      RSTRING_LEN(data) );
 
     return ret ? Qtrue : Qfalse;
 }
@@ -1,2 +1,21 @@
 #include "rb_ws_common.h"
 
+VALUE vr_str_view(VALUE owner, cstr data, size_t size)
+{
+    VALUE str = rb_str_new_static(data, size);
+
+    // The String doesn't own the memory. Hold a reference to the object that
+    // does so that it is not collected before the String is.
+    rb_ivar_set(str, rb_intern("owner"), owner);
+
+    return rb_obj_freeze(str);
+}
+
+VALUE vr_buffer_view(VALUE owner, vws_buffer* buffer)
+{
+    // Make room for the terminator. This doesn't change the buffer's size.
+    vws_buffer_reserve(buffer, 1);
+    buffer->data[buffer->size] = 0;
+
+    return vr_str_view(owner, (cstr)buffer->data, buffer->size);
+}
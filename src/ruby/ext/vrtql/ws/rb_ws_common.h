@@ -7,8 +7,26 @@
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
 
 #include "ruby.h"
+#include "ruby/io.h"
+#include "ruby/thread.h"
+#include "ruby/version.h"
+
+#if RUBY_API_VERSION_MAJOR >= 3
+#include "ruby/fiber/scheduler.h"
+#endif
 
 #pragma GCC diagnostic pop
 #pragma clang diagnostic pop
 
+#include "vrtql/vws.h"
+
+// Returns a frozen String over size bytes at data, without copying them. Ruby
+// expects a NUL after the bytes, so there must be one. The String keeps owner
+// alive, and owner must keep the bytes alive and unchanged.
+VALUE vr_str_view(VALUE owner, cstr data, size_t size);
+
+// Returns a String view (see vr_str_view()) of a buffer kept alive by owner.
+// The buffer is NUL-terminated in place, past its size.
+VALUE vr_buffer_view(VALUE owner, vws_buffer* buffer);
+
 #endif /* VRTQL_RUBY_COMMON */
@@ -1,3 +1,13 @@
+#ifdef __WINDOWS__
+#include <winsock2.h>
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+
 #include "rb_ws_common.h"
 #include "rb_ws_connection.h"
 #include "rb_ws_frame.h"
@@ -14,6 +24,20 @@
 
 VALUE vr_ws_cnx_cls;
 
+void vr_ws_cnx_init(vr_ws_cnx* handle)
+{
+    handle->cnx            = vws_cnx_new();
+    handle->cnx->base.data = (char*)handle;
+    handle->io             = Qnil;
+    handle->io_fd          = -1;
+    handle->state          = 0;
+}
+
+void vr_ws_cnx_mark(vr_ws_cnx* handle)
+{
+    rb_gc_mark(handle->io);
+}
+
 // Memory deallocation function for the vr_ws_cnx object
 static void vr_ws_cnx_free(vr_ws_cnx* cnx)
 {
@@ -29,9 +53,12 @@ static void vr_ws_cnx_free(vr_ws_cnx* cnx)
 static VALUE ws_connection_allocator(VALUE the_cls)
 {
     vr_ws_cnx* handle = ruby_xmalloc(sizeof(vr_ws_cnx));
-    handle->cnx    = vws_cnx_new();
+    vr_ws_cnx_init(handle);
 
-    return Data_Wrap_Struct(the_cls, NULL, &vr_ws_cnx_free, handle);
+    return Data_Wrap_Struct( the_cls,
+                             &vr_ws_cnx_mark,
+                             &vr_ws_cnx_free,
+                             handle );
 }
 
 /*
@@ -66,6 +93,246 @@ static vws_cnx* get_object(VALUE self)
     return handle->cnx;
 }
 
+//------------------------------------------------------------------------------
+// Blocking calls
+//
+// Receives and sends can wait in poll() for up to the socket timeout. They run
+// without the GVL so that other Ruby threads keep running in the meantime. The
+// functions called without the GVL must not touch any Ruby object.
+//
+// Under a fiber scheduler (Ruby 3), they keep the GVL and wait through the
+// scheduler instead, with rb_io_wait() on the socket, so that other fibers on
+// the thread keep running.
+//------------------------------------------------------------------------------
+
+typedef struct
+{
+    vws_cnx* cnx;
+    ucstr data;
+    size_t size;
+    int oc;
+    ssize_t sent;
+} send_args;
+
+static void* nogvl_recv_msg(void* arg)
+{
+    return vws_msg_recv((vws_cnx*)arg);
+}
+
+static void* nogvl_recv_frame(void* arg)
+{
+    return vws_frame_recv((vws_cnx*)arg);
+}
+
+static void* nogvl_send_msg(void* arg)
+{
+    send_args* a = (send_args*)arg;
+    a->sent      = vws_msg_send_data(a->cnx, a->data, a->size, a->oc);
+
+    return NULL;
+}
+
+// Unblocks a send. Sends are all or nothing: stopping halfway would leave part
+// of a frame on the wire, so the only way out is to drop the connection. The
+// blocked poll() then fails and the send returns -1.
+static void ubf_send(void* arg)
+{
+    vws_socket* s = (vws_socket*)((send_args*)arg)->cnx;
+
+    if (s->sockfd > -1)
+    {
+        shutdown(s->sockfd, 2);
+    }
+}
+
+// Returns an IO for the connection's socket, for waiting on it. It doesn't
+// close the descriptor, which the connection still owns.
+static VALUE cnx_io(vr_ws_cnx* handle)
+{
+    int fd = handle->cnx->base.sockfd;
+
+    if (handle->io == Qnil || handle->io_fd != fd)
+    {
+        handle->io    = rb_io_fdopen(fd, O_RDWR, NULL);
+        handle->io_fd = fd;
+        rb_funcall(handle->io, rb_intern("autoclose="), 1, Qfalse);
+    }
+
+    return handle->io;
+}
+
+#if RUBY_API_VERSION_MAJOR >= 3
+
+typedef struct
+{
+    VALUE io;
+    VALUE events;
+    VALUE timeout;
+} wait_args;
+
+static VALUE fiber_wait_call(VALUE arg)
+{
+    wait_args* a = (wait_args*)arg;
+    return rb_io_wait(a->io, a->events, a->timeout);
+}
+
+// The socket's wait callback (vws_socket_wait) under a fiber scheduler. An
+// exception from the scheduler (such as a cancelled task) can't unwind through
+// the library, so it is caught here, the wait fails and it is raised again by
+// vr_ws_cnx_check_ints() once the library call has returned.
+static int fiber_wait(vws_socket* s, short events, int timeout, short* revents)
+{
+    vr_ws_cnx* handle = (vr_ws_cnx*)s->data;
+
+    int mask = 0;
+
+    if (events & POLLIN)
+    {
+        mask |= RUBY_IO_READABLE;
+    }
+
+    if (events & POLLOUT)
+    {
+        mask |= RUBY_IO_WRITABLE;
+    }
+
+    wait_args args;
+    args.io      = cnx_io(handle);
+    args.events  = INT2NUM(mask);
+    args.timeout = (timeout < 0) ? Qnil : rb_float_new(timeout / 1000.0);
+
+    int state   = 0;
+    VALUE ready = rb_protect(fiber_wait_call, (VALUE)&args, &state);
+
+    if (state != 0)
+    {
+        handle->state = state;
+        errno         = ECANCELED;
+
+        return -1;
+    }
+
+    if (RTEST(ready) == 0)
+    {
+        return 0;
+    }
+
+    mask = NUM2INT(ready);
+
+    if (mask & RUBY_IO_READABLE)
+    {
+        *revents |= POLLIN;
+    }
+
+    if (mask & RUBY_IO_WRITABLE)
+    {
+        *revents |= POLLOUT;
+    }
+
+    return 1;
+}
+
+#endif
+
+// Runs fn(arg), a library call on c. It runs without the GVL, unblocked by ubf,
+// or under the fiber scheduler if there is one.
+static void* cnx_call( vws_cnx* c,
+                       void* (*fn)(void*),
+                       void* arg,
+                       rb_unblock_function_t* ubf,
+                       void* ubf_arg )
+{
+#if RUBY_API_VERSION_MAJOR >= 3
+
+    if (rb_fiber_scheduler_current() != Qnil)
+    {
+        vr_ws_cnx* handle = (vr_ws_cnx*)c->base.data;
+        handle->state     = 0;
+
+        c->base.wait = fiber_wait;
+        void* result = fn(arg);
+        c->base.wait = NULL;
+
+        return result;
+    }
+
+#endif
+
+    return rb_thread_call_without_gvl(fn, arg, ubf, ubf_arg);
+}
+
+void vr_ws_cnx_check_ints(vws_cnx* c)
+{
+    vr_ws_cnx* handle = (vr_ws_cnx*)c->base.data;
+
+    if (handle->state != 0)
+    {
+        int state     = handle->state;
+        handle->state = 0;
+
+        rb_jump_tag(state);
+    }
+
+    rb_thread_check_ints();
+}
+
+// Receives use RUBY_UBF_IO: Ruby signals the blocked thread, poll() returns
+// with EINTR and the receive returns NULL as on a timeout. The connection stays
+// usable. If the interrupt was a Thread#raise or Thread#kill, it is raised here.
+vws_msg* vr_ws_cnx_recv_msg(vws_cnx* c)
+{
+    vws_msg* msg = cnx_call(c, nogvl_recv_msg, c, RUBY_UBF_IO, NULL);
+
+    if (msg == NULL)
+    {
+        vr_ws_cnx_check_ints(c);
+    }
+
+    return msg;
+}
+
+static vws_frame* recv_frame(vws_cnx* c)
+{
+    vws_frame* frame = cnx_call(c, nogvl_recv_frame, c, RUBY_UBF_IO, NULL);
+
+    if (frame == NULL)
+    {
+        vr_ws_cnx_check_ints(c);
+    }
+
+    return frame;
+}
+
+ssize_t vr_ws_cnx_send_msg(vws_cnx* c, ucstr data, size_t size, int oc)
+{
+    send_args args = { c, data, size, oc, -1 };
+
+    cnx_call(c, nogvl_send_msg, &args, ubf_send, &args);
+
+    return args.sent;
+}
+
+// Sends a Ruby string. The string is locked for the duration so that other
+// threads can't modify it while it is being sent without the GVL.
+static ssize_t send_string(vws_cnx* c, VALUE value, int oc)
+{
+    rb_str_locktmp(value);
+
+    ssize_t sent = vr_ws_cnx_send_msg( c,
+                                       (ucstr)RSTRING_PTR(value),
+                                       RSTRING_LEN(value),
+                                       oc );
+
+    rb_str_unlocktmp(value);
+
+    if (sent < 0)
+    {
+        vr_ws_cnx_check_ints(c);
+    }
+
+    return sent;
+}
+
 /*
  * Document-method: m_connect
  *
@@ -168,8 +435,8 @@ static VALUE m_send_text(VALUE self, VALUE text)
 
     Check_Type(text, T_STRING);
 
-    // Call the vws_send_text function from the C API
-    int bytes_sent = vws_msg_send_text(c, RSTRING_PTR(text));
+    // Send as a TEXT message without holding the GVL
+    int bytes_sent = send_string(c, text, 0x1);
 
     // Return the number of bytes sent as a Ruby integer
     return INT2NUM(bytes_sent);
@@ -195,12 +462,8 @@ static VALUE m_send_binary(VALUE self, VALUE value)
 
     Check_Type(value, T_STRING);
 
-    // Get the binary data and its length
-    const char* data = RSTRING_PTR(value);
-    long size        = RSTRING_LEN(value);
-
-    // Call the vws_send_binary function from the C API
-    int sent = vws_msg_send_binary(c, data, size);
+    // Send as a BINARY message without holding the GVL
+    int sent = send_string(c, value, 0x2);
 
     // Return the number of bytes sent as a Ruby integer
     return INT2NUM(sent);
@@ -221,8 +484,8 @@ static VALUE m_recv_frame(VALUE self)
     vws_cnx* c = get_object(self);
     ensure_connected(c);
 
-    // Call the vws_recv_frame function from the C API
-    vws_frame* frame = vws_frame_recv(c);
+    // Wait for a frame without holding the GVL
+    vws_frame* frame = recv_frame(c);
 
     if (frame == NULL)
     {
@@ -248,8 +511,8 @@ static VALUE m_recv_msg(VALUE self)
     vws_cnx* c = get_object(self);
     ensure_connected(c);
 
-    // Call the vws_recv_msg function from the C API
-    vws_msg* msg = vws_msg_recv(c);
+    // Wait for a message without holding the GVL
+    vws_msg* msg = vr_ws_cnx_recv_msg(c);
 
     if (msg == NULL)
     {
@@ -259,6 +522,49 @@ static VALUE m_recv_msg(VALUE self)
     return vr_ws_msg_new(msg);
 }
 
+/*
+ * Document-method: m_fileno
+ *
+ * call-seq: m_fileno -> Integer or nil
+ *
+ * Returns the socket file descriptor, for use with IO.select or an event loop.
+ *
+ * Returns:
+ *   The file descriptor, or nil if not connected
+ */
+static VALUE m_fileno(VALUE self)
+{
+    vws_cnx* c = get_object(self);
+
+    if (vws_socket_is_connected((vws_socket*)c) == false)
+    {
+        return Qnil;
+    }
+
+    return INT2NUM(c->base.sockfd);
+}
+
+/*
+ * Document-method: m_to_io
+ *
+ * call-seq: m_to_io -> IO
+ *
+ * Returns an IO for the socket, for waiting on it with IO.select, IO#wait or
+ * a fiber scheduler. It does not close the socket, which the connection owns.
+ * Don't read or write through it.
+ *
+ * Returns:
+ *   An IO object
+ */
+static VALUE m_to_io(VALUE self)
+{
+    vr_ws_cnx* handle;
+    Data_Get_Struct(self, vr_ws_cnx, handle);
+    ensure_connected(handle->cnx);
+
+    return cnx_io(handle);
+}
+
 /*
  * Document-method: m_set_timeout
  *
@@ -310,6 +616,8 @@ void init_ws_connection(VALUE module)
     rb_define_method(vr_ws_cnx_cls, "recvFrame",    m_recv_frame,    0);
     rb_define_method(vr_ws_cnx_cls, "recvMessage",  m_recv_msg,      0);
     rb_define_method(vr_ws_cnx_cls, "setTimeout",   m_set_timeout,   1);
+    rb_define_method(vr_ws_cnx_cls, "fileno",       m_fileno,        0);
+    rb_define_method(vr_ws_cnx_cls, "to_io",        m_to_io,         0);
 }
 
 #pragma GCC diagnostic pop
@@ -6,10 +6,36 @@
 typedef struct
 {
     vws_cnx* cnx;
+
+    // IO for the socket, created when first needed, and its descriptor
+    VALUE io;
+    int io_fd;
+
+    // Exception state caught while waiting under a fiber scheduler
+    int state;
 } vr_ws_cnx;
 
 extern VALUE vr_ws_cnx_cls;
 
 void init_ws_connection(VALUE module);
 
+// Initializes a new handle with a new connection
+void vr_ws_cnx_init(vr_ws_cnx* handle);
+
+// GC mark function for the handle
+void vr_ws_cnx_mark(vr_ws_cnx* handle);
+
+// Raises an exception caught while waiting under a fiber scheduler, or a
+// pending interrupt
+void vr_ws_cnx_check_ints(vws_cnx* c);
+
+// Receives a message with the GVL released. Returns NULL on timeout, error or
+// interrupt.
+vws_msg* vr_ws_cnx_recv_msg(vws_cnx* c);
+
+// Sends data as a message with the GVL released. Returns the number of bytes
+// sent, or -1 on error. An interrupt drops the connection. The caller should
+// call vr_ws_cnx_check_ints() on failure, once it has cleaned up.
+ssize_t vr_ws_cnx_send_msg(vws_cnx* c, ucstr data, size_t size, int oc);
+
 #endif
@@ -34,22 +34,46 @@ void vr_ws_frame_free(vr_ws_frame* object)
  *
  * call-seq: m_data -> String
  *
- * Returns the frame data.
+ * Returns the frame data. This is a frozen string over the frame's own payload
+ * rather than a copy. It is created on the first call and the same string is
+ * returned after that.
  *
  * Returns:
  *   The frame data as a Ruby string
  */
 static VALUE m_data(VALUE self)
 {
+    ID id      = rb_intern("data");
+    VALUE data = rb_ivar_get(self, id);
+
+    if (data != Qnil)
+    {
+        return data;
+    }
+
     vr_ws_frame* object;
     Data_Get_Struct(self, vr_ws_frame, object);
 
-    // Get the frame data and its length
-    const char* data = object->frame->data;
-    size_t size      = object->frame->size;
+    vws_frame* f = object->frame;
+
+    if (f->borrowed == 1 || f->data == NULL)
+    {
+        // Not ours to resize (or empty), so copy
+        data = rb_obj_freeze(rb_str_new(f->data, f->size));
+    }
+    else
+    {
+        // The payload is allocated to size. Grow it by one for the terminator
+        // Ruby expects, which seldom moves it.
+        f->data          = vws.realloc(f->data, f->size + 1);
+        f->data[f->size] = 0;
+
+        data = vr_str_view(self, (cstr)f->data, f->size);
+    }
+
+    rb_ivar_set(self, id, data);
 
-    // Return the frame data as a Ruby string with length
-    return rb_str_new(data, size);
+    return data;
 }
 
 /*
@@ -32,22 +32,32 @@ void vr_ws_msg_free(vr_ws_msg* object)
  *
  * call-seq: m_data -> String
  *
- * Returns the message data.
+ * Returns the message data. This is a frozen string over the message's own
+ * buffer rather than a copy. It is created on the first call and the same
+ * string is returned after that.
  *
  * Returns:
  *   The message data as a Ruby string
  */
 static VALUE m_data(VALUE self)
 {
+    ID id      = rb_intern("data");
+    VALUE data = rb_ivar_get(self, id);
+
+    if (data != Qnil)
+    {
+        return data;
+    }
+
     vr_ws_msg* object;
     Data_Get_Struct(self, vr_ws_msg, object);
 
-    // Get the message data and its length
-    const char* data = object->msg->data->data;
-    size_t size      = object->msg->data->size;
+    // Messages are read-only in Ruby, so the buffer never changes under the
+    // view. The view keeps self, and so the buffer, alive.
+    data = vr_buffer_view(self, object->msg->data);
+    rb_ivar_set(self, id, data);
 
-    // Return the message data as a Ruby string with length
-    return rb_str_new(data, size);
+    return data;
 }
 
 /*
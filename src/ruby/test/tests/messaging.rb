@@ -87,6 +87,29 @@ class MessagingTest < Minitest::Test
 
   end
 
+  def test_content_view
+    m = VRTQL::Message.new()
+    m.content = "first"
+    m.headers = { "id" => "test" }
+
+    # Content is a frozen view, the same one on every call
+    c1 = m.content
+    assert c1.frozen?
+    assert m.content.equal?(c1)
+
+    # Headers are one map, with its Hash cached until it changes
+    assert m.headers.equal?(m.headers)
+    assert m.headers.to_h.equal?(m.headers.to_h)
+    m.headers["to"] = "mike"
+    assert m.headers.to_h == { "id" => "test", "to" => "mike" }
+
+    # Replacing the content leaves the old view intact
+    m.content = "second"
+    GC.start
+    assert c1 == "first"
+    assert m.content == "second"
+  end
+
   def test_set_timeout
     skip
     @connection.setTimeout(30.0)
@@ -1,14 +1,41 @@
+#if defined(__linux__)
+// For pthread_setaffinity_np() and the CPU_* macros
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
 #include <unistd.h>
 #endif
 
+// For handing off sockets over a Unix socket, and Unix socket listeners
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// For the listening socket's TCP options
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <openssl/err.h>
+
 #include "server.h"
 #include "websocket.h"
+#include "probe.h"
+
+#if defined(VWS_SHM)
+#include "shm.h"
+#endif
 
 //------------------------------------------------------------------------------
 // Internal functions
@@ -24,7 +51,7 @@
  */
 
 /**
- * @brief UV callback executed in response to (server->wakeup) async signal.
+ * @brief UV callback executed in response to (loop->wakeup) async signal.
  *
  * This function handles asynchronous events in the main thread, specifically
  * managing outgoing network I/O from worker threads back to clients. It runs
@@ -33,37 +60,107 @@
  *
  * Worker threads pass data to it through a queue. The data is in the form of
  * vws_svr_data instances. When a worker sends a vws_svr_data instance, it
- * adds it to the queue (server->responses) and notifies (wakes up) the main UV
- * loop (uv_run() in vrtql_svr_run()) by calling uv_async_send(server->wakeup)
- * which in turn calls this function to check the server->responses queue. This
+ * adds it to the queue (loop->responses) and notifies (wakes up) the main UV
+ * loop (uv_run() in vrtql_svr_run()) by calling uv_async_send(loop->wakeup)
+ * which in turn calls this function to check the loop->responses queue. This
  * function unloads all data in the queue and sends the data out to each
  * respective client. It then returns control back to the main UV loop which
  * resumes polling the network connections (blocking if there is no activity).
  *
+ * Workers only signal a loop that is not already awake (loop->signaled), so a
+ * busy loop takes a single wakeup for any number of responses. It keeps
+ * draining until the queues are empty before clearing the flag.
+ *
  * @param handle A pointer to the uv_async_t handle that triggered the callback.
  *
  * @ingroup ThreadFunctions
  */
 static void uv_thread(uv_async_t* handle);
 
+/**
+ * @brief Takes the next response off a loop's queues in uv_thread(). The
+ * priority lane is emptied before each ordinary response.
+ *
+ * @param loop The loop.
+ * @return The response, or NULL if both queues are empty.
+ *
+ * @ingroup ThreadFunctions
+ */
+static vws_svr_data* uv_thread_next(vws_svr_loop* loop);
+
+/**
+ * @brief Handles one response popped off a loop queue in uv_thread().
+ *
+ * @param loop The loop.
+ * @param data The response.
+ * @param batching Whether responses are gathered into per-connection batches.
+ *
+ * @ingroup ThreadFunctions
+ */
+static void uv_thread_dispatch( vws_svr_loop* loop,
+                                vws_svr_data* data,
+                                bool batching );
+
 /**
  * @brief The entry point for a worker thread.
  *
  * This function implements the worker thread pool. It is what each worker
  * thread runs. It loops continuously, handling incoming data from clients,
  * processing them and returning data back to them via the uv_thread(). It
- * processes data by taking data (requests) from the server->requests queue,
+ * processes data by taking data (requests) from its worker->requests queue,
  * dispatching them to server->process(data) for processing, which in turn
  * generates data (responses), sending them back to the client by putting them
- * on the server->responses queue (processed by uv_thread()).
+ * on the cnx->loop->responses queue (processed by uv_thread()).
  *
- * @param arg A void pointer, typically to the server object,
+ * @param arg A void pointer to the vws_svr_worker the thread runs,
  *        used to pass data into the thread.
  *
  * @ingroup ThreadFunctions
  */
 static void worker_thread(void* arg);
 
+/**
+ * @brief Handles one request taken off a worker queue or a connection's run
+ * queue: passes it to server->on_data_in(), or sends a release or handoff
+ * marker back to the loop.
+ *
+ * @param worker The worker.
+ * @param request The request.
+ * @param arena The worker's request arena, NULL if none.
+ *
+ * @ingroup ThreadFunctions
+ */
+static void worker_handle( vws_svr_worker* worker,
+                           vws_svr_data* request,
+                           vws_arena* arena );
+
+/**
+ * @brief Runs a connection's turn (work stealing): handles requests from its
+ * run queue in order until it is empty, or until VWS_SVR_RUN_BATCH of them,
+ * when the turn goes to the back of the worker's queue.
+ *
+ * @param worker The worker.
+ * @param turn The turn (VM_SVR_DATA_RUN). It is freed or queued again.
+ * @param arena The worker's request arena, NULL if none.
+ *
+ * @ingroup ThreadFunctions
+ */
+static void worker_run( vws_svr_worker* worker,
+                        vws_svr_data* turn,
+                        vws_arena* arena );
+
+/**
+ * @brief The entry point for an additional network loop thread.
+ *
+ * Runs the loop until vws_tcp_svr_stop() halts it, then closes its listener.
+ * The first loop runs in the thread that called vws_tcp_svr_run() instead.
+ *
+ * @param arg A void pointer to the vws_svr_loop the thread runs.
+ *
+ * @ingroup ThreadFunctions
+ */
+static void loop_thread(void* arg);
+
 /**
  * @defgroup ServerFunctions
  *
@@ -117,1431 +214,7718 @@ static void tcp_svr_dtor(vws_tcp_svr* s);
 static void svr_shutdown(vws_tcp_svr* server);
 
 /**
- * @brief Handles the close event for a libuv handle.
+ * @brief Halts every worker's request queue and wakes any worker sleeping on
+ * it so that it can exit.
  *
- * This function is called when a libuv handle is closed. It checks if the handle
- * has associated heap data stored in `handle->data` and generates a warning if
- * the resource was not properly freed.
+ * @param server The server.
  *
- * @param handle The libuv handle being closed.
+ * @ingroup ServerFunctions
  */
-static void on_uv_close(uv_handle_t* handle);
+static void svr_stop_workers(vws_tcp_svr* server);
 
 /**
- * @brief Walks through libuv handles and attempts to close them.
+ * @brief Initializes a network loop: libuv loop, wakeup handle, response queue,
+ * connection map and read buffer.
  *
- * This function is used to walk through libuv handles and attempts to close each
- * handle. It is typically called during libuv shutdown to ensure that all handles
- * are properly closed. If a handle has not been closed, it will be closed and
- * the `on_uv_close()` function will be called.
+ * @param server The server the loop belongs to.
+ * @param loop The loop to initialize.
+ * @param queue_size The response queue capacity.
  *
- * @param handle The libuv handle being walked.
- * @param arg    Optional argument passed to the function (not used in this case).
+ * @ingroup ServerFunctions
  */
-static void on_uv_walk(uv_handle_t* handle, void* arg);
+static void svr_loop_init(vws_tcp_svr* server, vws_svr_loop* loop, int queue_size);
 
 /**
- * @brief Callback for new client connection.
+ * @brief Closes all remaining handles on a network loop and frees its members.
+ * The loop must no longer be running.
  *
- * This function is invoked when a new client successfully connects to the
- * server.
- *
- * @param server The server to which the client connected.
- * @param status The status of the connection.
+ * @param loop The loop to destroy.
  *
  * @ingroup ServerFunctions
  */
-static void svr_on_connect(uv_stream_t* server, int status);
+static void svr_loop_destroy(vws_svr_loop* loop);
 
 /**
- * @brief Callback for buffer reallocation.
+ * @brief Creates the listening socket for a network loop, bound to the given
+ * address. If the server has more than one loop, the socket is marked
+ * SO_REUSEPORT so that every loop can bind the same address.
  *
- * This function is invoked when a handle requires a buffer reallocation.
- *
- * @param handle The handle requiring reallocation.
- * @param size The size of the buffer to be allocated.
- * @param buf The buffer.
+ * @param loop The loop.
+ * @param addr The address to bind.
+ * @return 0 on success, -1 on error.
  *
  * @ingroup ServerFunctions
  */
-static void svr_on_realloc(uv_handle_t* handle, size_t size, uv_buf_t* buf);
+static int svr_loop_listen(vws_svr_loop* loop, const struct sockaddr_in* addr);
 
 /**
- * @brief Callback for handle closure.
+ * @brief Creates a server's workers, without starting their threads.
  *
- * This function is invoked when a handle is closed.
- *
- * @param handle The handle that was closed.
+ * @param server The server.
+ * @param n The number of workers.
+ * @param queue_size The request queue capacity.
  *
  * @ingroup ServerFunctions
-
  */
-static void svr_on_close(uv_handle_t* handle);
+static void svr_workers_init(vws_tcp_svr* server, int n, int queue_size);
 
 /**
- * @brief Callback for reading data.
- *
- * This function is invoked when data is read from a client.
+ * @brief Frees a server's workers. Their threads must not be running.
  *
- * @param client The client from which data was read.
- * @param size The number of bytes read.
- * @param buf The buffer containing the data.
+ * @param server The server.
  *
  * @ingroup ServerFunctions
  */
-static void svr_on_read(uv_stream_t* client, ssize_t size, const uv_buf_t* buf);
+static void svr_workers_destroy(vws_tcp_svr* server);
 
 /**
- * @brief Callback for write completion.
- *
- * This function is invoked when a write operation to a client completes.
+ * @brief Starts the threads of the first pool.min workers and, if the pool is
+ * adaptive, the timer that resizes it.
  *
- * @param req The write request.
- * @param status The status of the write operation.
+ * @param server The server.
  *
  * @ingroup ServerFunctions
  */
-static void svr_on_write_complete(uv_write_t* req, int status);
+static void svr_pool_start(vws_tcp_svr* server);
 
 /**
- * @defgroup Connection Functions
- *
- * @brief Functions that support connection operation
+ * @brief Checks the request queues and grows or shrinks an adaptive pool.
+ * Runs on the first loop.
  *
- * Connections always refer to client-side connections, on the server. They are
- * active connections established within the main UV loop.
+ * @param handle The pool timer.
  *
  * @ingroup ServerFunctions
  */
+static void svr_on_pool_tick(uv_timer_t* handle);
 
 /**
- * @brief Creates a new server connection.
+ * @brief Picks the active worker to bind a connection accepted by a loop to.
  *
- * @param s The server for the connection.
- * @param c The client for the connection.
- * @return A new server connection.
+ * @param loop The loop.
+ * @return The worker.
  *
  * @ingroup ServerFunctions
  */
-static vws_svr_cnx* svr_cnx_new(vws_tcp_svr* s, uv_stream_t* c);
+static vws_svr_worker* svr_worker_next(vws_svr_loop* loop);
 
 /**
- * @brief Frees a server connection.
+ * @brief Returns the worker to queue a request from a connection to, and
+ * counts the request as pending. With an adaptive pool, a connection with
+ * nothing pending moves off a parked or backed up worker first. Called on the
+ * connection's loop.
  *
- * @param c The connection to be freed.
+ * @param cnx The connection.
+ * @return The worker.
  *
  * @ingroup ServerFunctions
  */
-static void svr_cnx_free(vws_svr_cnx* c);
+static vws_svr_worker* svr_cnx_worker(vws_svr_cnx* cnx);
 
 /**
- * @brief Actively close a client connection
+ * @brief Queues a request from a connection to be processed after those
+ * before it. Release and handoff markers go through here as well. Called on
+ * the connection's loop.
  *
- * @param c The connection
+ * @param cnx The connection.
+ * @param data The request.
+ *
+ * @ingroup ServerFunctions
  */
-static void svr_cnx_close(vws_svr_cnx* c);
+static void svr_cnx_queue(vws_svr_cnx* cnx, vws_svr_data* data);
 
 /**
- * @brief Callback for client connection.
- *
- * This function is triggered when a new client connection is established.  It
- * is responsible for processing any steps necessary at the start of a
- * connection.
+ * @brief Returns whether the server is work stealing: vws_tcp_svr.steal is
+ * set and the pool is fixed.
  *
- * @param c The connection structure representing the client that has connected.
+ * @param server The server.
+ * @return True if it is.
  *
  * @ingroup ServerFunctions
  */
-static void svr_client_connect(vws_svr_cnx* c);
+static bool svr_stealing(vws_tcp_svr* server);
 
 /**
- * @brief Callback for client disconnection.
- *
- * This function is triggered when a client connection is terminated. It is
- * responsible for processing any cleanup or other steps necessary at the end of
- * a connection.
+ * @brief Returns the worker to queue a connection's turn on (work stealing).
+ * This is the worker that last ran it, unless that one is busy and another
+ * is idle, in which case the connection moves to the idle one.
  *
- * @param c The connection
+ * @param cnx The connection.
+ * @return The worker.
  *
  * @ingroup ServerFunctions
  */
-static void svr_client_disconnect(vws_svr_cnx* c);
+static vws_svr_worker* svr_cnx_run_worker(vws_svr_cnx* cnx);
 
 /**
- * @brief Callback for client read operations.
+ * @brief Takes a connection's turn off the queue of a busy worker, for a
+ * worker with nothing of its own to do.
  *
- * This function is triggered when data is read from a client connection. It is
- * responsible for processing the received data.
- *
- * @param c The connection that sent the data.
- * @param size The size of the data that was read.
- * @param buf The buffer containing the data that was read.
+ * @param worker The idle worker.
+ * @return The turn, or NULL if no busy worker has one waiting.
  *
  * @ingroup ServerFunctions
  */
-static void svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf);
+static vws_svr_data* svr_worker_steal(vws_svr_worker* worker);
 
 /**
- * @brief Callback for processing client data in (ingress)
+ * @brief Takes a spinlock. For state touched briefly by the loop and workers.
  *
- * This function processes data arriving from client to worker thread. It is
- * responsible for handling the actual computation or other work associated with
- * the data. This takes place in the context of worker_thread().
- *
- * @param data The incoming data from the client to process.
+ * @param lock The lock.
  *
  * @ingroup ServerFunctions
  */
-static void svr_client_data_in(vws_svr_data* data);
+static void svr_spin_lock(bool* lock);
 
 /**
- * @brief Callback for processing client data in (ingress)
- *
- * This function is triggered to process data arriving from worker thread to be
- * send back to client. It is responsible for transferring the data from the
- * response argument (vws_svr_data ) onto the wire (client socket via
- * libuv). actual computation or other work associated with the data. This takes
- * place in the context of uv_thread().
+ * @brief Releases a spinlock.
  *
- * @param data The outgoing data from worker to client
+ * @param lock The lock.
  *
  * @ingroup ServerFunctions
  */
-static void svr_client_data_out(vws_svr_data* data);
-
-
-
+static void svr_spin_unlock(bool* lock);
 
 /**
- * @defgroup WebSocketServerFunctions
+ * @brief Works out the CPUs each loop and worker runs on from the server's
+ * affinity settings, replacing those of an earlier run.
  *
- * @brief Functions that support message server operation
+ * @param server The server.
  *
+ * @ingroup ServerFunctions
  */
+static void svr_place(vws_tcp_svr* server);
 
 /**
- * @brief WebSocket server constructor.
+ * @brief Pins the calling thread to a set of CPUs.
  *
- * @param server The WebSocket server instance.
- * @param nt The number of threads to run in the worker pool.
- * @param bl The connection backlog for listen(). If set to 0, it uses the
- *        default value (128).
- * @param qs The maximum queue size for requests and responses. If set to 0, it
- *        uses the default value (1024).
+ * @param cpus The CPUs. If NULL, nothing happens.
+ * @param count The number of CPUs.
+ *
+ * @ingroup ServerFunctions
  */
-static void ws_svr_ctor(vws_svr* server, int nt, int bl, int qs);
+static void svr_pin(const int* cpus, int count);
 
 /**
- * @brief WebSocket server destructor.
+ * @brief Pins the calling thread to a loop's CPUs and moves the loop's read
+ * buffer into memory local to them. Called by the thread that runs the loop.
  *
- * @param server The WebSocket server instance to free.
+ * @param loop The loop.
+ *
+ * @ingroup ServerFunctions
  */
-static void ws_svr_dtor(vws_svr* server);
+static void svr_loop_pin(vws_svr_loop* loop);
 
 /**
- * @brief Callback for client connection.
- *
- * This function is triggered when a new client connection is established.  It
- * is responsible for processing any steps necessary at the start of a
- * connection.
+ * @brief Fills the calling thread's pools with the server's cnx_reserve of
+ * connection state and handles. Called by a loop's thread before it runs.
  *
- * @param c The connection structure representing the client that has connected.
+ * @param loop The loop.
  *
- * @ingroup WebSocketServerFunctions
+ * @ingroup ServerFunctions
  */
-static void ws_svr_client_connect(vws_svr_cnx* c);
+static void svr_loop_reserve(vws_svr_loop* loop);
 
 /**
- * @brief Callback for client disconnection.
- *
- * This function is triggered when a client connection is terminated. It is
- * responsible for processing any cleanup or other steps necessary at the end of
- * a connection.
+ * @brief Parses a CPU list such as "0-7,16-23", the format of the Linux
+ * cpulist files.
  *
- * @param c The connection
+ * @param list The list.
+ * @param cpus Set to the CPUs, from vws.malloc().
+ * @return The number of CPUs, or -1 if the list is invalid.
  *
- * @ingroup WebSocketServerFunctions
+ * @ingroup ServerFunctions
  */
-static void ws_svr_client_disconnect(vws_svr_cnx* c);
+static int svr_cpus_parse(cstr list, int** cpus);
 
 /**
- * @brief Callback for client read operations.
- *
- * This function is triggered when data is read from a client connection. It is
- * responsible for processing the received data.
+ * @brief Reads a CPU list from a file.
  *
- * @param c The connection that sent the data.
- * @param size The size of the data that was read.
- * @param buf The buffer containing the data that was read.
+ * @param path The file.
+ * @param cpus Set to the CPUs, from vws.malloc().
+ * @return The number of CPUs, or -1 if the file cannot be read or parsed.
  *
- * @ingroup WebSocketServerFunctions
+ * @ingroup ServerFunctions
  */
-static void ws_svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf);
+static int svr_cpus_read(cstr path, int** cpus);
 
 /**
- * @brief Callback for processing client data in (ingress) for msg server
- *
- * This function processes data arriving from client to worker thread. It
- * collects data until there is a complete message. It passes message to
- * ws_svr_client_msg_in() for processing. This takes place in the context of
- * worker_thread().
+ * @brief Handles the close event for a libuv handle.
  *
- * @param server The server instance
- * @param data The incoming data from the client to process.
+ * This function is called when a libuv handle is closed. It checks if the handle
+ * has associated heap data stored in `handle->data` and generates a warning if
+ * the resource was not properly freed.
  *
- * @ingroup WebSocketServerFunctions
+ * @param handle The libuv handle being closed.
  */
-static void ws_svr_client_data_in(vws_svr_data* data);
+static void on_uv_close(uv_handle_t* handle);
 
 /**
- * @brief Sends data from a server connection to a client WebSocket connection.
+ * @brief Walks through libuv handles and attempts to close them.
  *
- * @param cnx The server connection.
- * @param buffer The data to send.
- * @param opcode The opcode for the WebSocket frame.
+ * This function is used to walk through libuv handles and attempts to close each
+ * handle. It is typically called during libuv shutdown to ensure that all handles
+ * are properly closed. If a handle has not been closed, it will be closed and
+ * the `on_uv_close()` function will be called.
+ *
+ * @param handle The libuv handle being walked.
+ * @param arg    Optional argument passed to the function (not used in this case).
  */
-static void ws_svr_client_data_out( vws_svr_cnx* cnx,
-                                    vws_buffer* buffer,
-                                    unsigned char opcode);
+static void on_uv_walk(uv_handle_t* handle, void* arg);
 
 /**
- * @brief Process a WebSocket frame received from a client.
+ * @brief Callback for new client connection.
  *
- * @param c The WebSocket connection.
- * @param f The incoming frame to process.
+ * This function is invoked when a new client successfully connects to the
+ * server.
+ *
+ * @param server The server to which the client connected.
+ * @param status The status of the connection.
+ *
+ * @ingroup ServerFunctions
  */
-static void ws_svr_process_frame(vws_cnx* c, vws_frame* f);
+static void svr_on_connect(uv_stream_t* server, int status);
 
 /**
- * @brief Callback for client message processing
+ * @brief Callback for buffer allocation.
  *
- * This function is triggered when a message is read from a client
- * connection. It is responsible for processing the message. This takes place in
- * the context of worker_thread().
+ * This function is invoked when a handle needs a buffer to read into. It hands
+ * out the server's read buffer so that reads don't allocate.
  *
- * @param c The connection that sent the data.
- * @param m The message to process
+ * @param handle The handle requiring allocation.
+ * @param size The size of the buffer to be allocated.
+ * @param buf The buffer.
  *
- * @ingroup WebSocketServerFunctions
+ * @ingroup ServerFunctions
  */
-static void ws_svr_client_msg_in(vws_svr_cnx* c, vws_msg* m);
+static void svr_on_realloc(uv_handle_t* handle, size_t size, uv_buf_t* buf);
 
 /**
- * @brief Callback for sending message to client. It takes a message as input,
- * serializes it to a binary WebSocket message and then sends it to the
- * uv_thread() to send back to client. This takes place in the context of
- * worker_thread() (only to be called within that context).
+ * @brief Callback for client handle closure.
  *
- * This function sends a message back to a client.
+ * This function is invoked when a client connection's handle is closed. The
+ * handle's data is the connection.
  *
- * @param c The connection that sent the data.
- * @param m The message to send
+ * @param handle The handle that was closed.
  *
- * @ingroup WebSocketServerFunctions
+ * @ingroup ServerFunctions
  */
-static void ws_svr_client_msg_out(vws_svr_cnx* c, vws_msg* m);
+static void svr_on_close(uv_handle_t* handle);
 
 /**
- * @brief Default WebSocket message processing function. This is mean to be
- * overriden by application to perform message processing, specifically by
- * assigning the vws_svr.process callback to the desired processing
- * handler. The default implementation simple drops (deletes) the incoming
- * message.
+ * @brief Callback for closure of the server's own handles (listening socket,
+ * wakeup). It frees the handle.
  *
- * @param cnx The server connection.
- * @param req The incoming WebSocket message.
+ * @param handle The handle that was closed.
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void ws_svr_client_process(vws_svr_cnx* cnx, vws_msg* req);
+static void svr_on_handle_close(uv_handle_t* handle);
 
+/**
+ * @brief Callback for closure of a client handle whose connection is freed
+ * elsewhere. It gives the handle back to its pool.
+ *
+ * @param handle The handle that was closed.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_on_stream_close(uv_handle_t* handle);
 
+/**
+ * @brief Callback for reading data.
+ *
+ * This function is invoked when data is read from a client.
+ *
+ * @param client The client from which data was read.
+ * @param size The number of bytes read.
+ * @param buf The buffer containing the data.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_on_read(uv_stream_t* client, ssize_t size, const uv_buf_t* buf);
 
+/** Number of responses a batch holds without allocating */
+#define SVR_BATCH_INLINE 8
 
 /**
- * @defgroup MessageServerFunctions
- *
- * @brief Functions that support message server operation
+ * @brief A single vectored write carrying one or more responses for the same
+ * connection. The write request is embedded and small batches keep their items
+ * inline, so a batch is normally a single pooled object.
  *
+ * @ingroup ServerFunctions
  */
+typedef struct
+{
+    /**< The write request. Must be first: req.data points back at the batch */
+    uv_write_t req;
+
+    /**< The connection written to */
+    vws_svr_cnx* cnx;
+
+    /**< The responses in the batch */
+    vws_svr_data** items;
+
+    /**< Number of responses */
+    size_t count;
+
+    /**< Capacity of items */
+    size_t capacity;
+
+    /**< Storage for items until there are more than SVR_BATCH_INLINE */
+    vws_svr_data* inline_items[SVR_BATCH_INLINE];
+
+    /**< Whether the batch carries a fragment. Its completion lets the
+     * connection's held back message data go. */
+    bool fragment;
+
+    /**< When the write was issued (uv_hrtime()) */
+    uint64_t started;
+
+} svr_write_batch;
 
 /**
- * @brief Convert incoming WebSocket messages to VRTQL messages for processing.
+ * @brief Gets a new, empty batch for a connection from the pool.
  *
- * @param cnx The server connection.
- * @param wsm The incoming WebSocket message.
+ * @param cnx The connection.
+ * @return The batch.
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_ws_msg_in(vws_svr_cnx* cnx, vws_msg* wsm);
+static svr_write_batch* svr_batch_new(vws_svr_cnx* cnx);
 
 /**
- * @brief Callback function for handling incoming VRTQL messages from a client.
+ * @brief Pauses or resumes reading from a connection according to how many
+ * bytes are waiting to be written to it and the server's watermarks.
  *
- * @param cnx The server connection.
- * @param m The incoming VRTQL message.
+ * @param cnx The connection.
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_msg_in(vws_svr_cnx* cnx, vrtql_msg* m);
+static void svr_cnx_check_backpressure(vws_svr_cnx* cnx);
 
 /**
- * @brief Callback function for sending VRTQL messages to a client.
+ * @brief Adds a response to the batch for its connection, creating the batch
+ * if this is the first response for that connection in this wakeup.
  *
- * @param cnx The server connection.
- * @param m The outgoing VRTQL message.
+ * @param batches Map of connection to batch for the current wakeup.
+ * @param data The response.
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_msg_out(vws_svr_cnx* cnx, vrtql_msg* m);
+static void svr_batch_add(struct sc_map_64v* batches, vws_svr_data* data);
 
 /**
- * @brief Default VRTQL message processing function.
+ * @brief Appends a response to a batch.
  *
- * @param cnx The server connection.
- * @param req The incoming VRTQL message.
+ * @param batch The batch.
+ * @param data The response.
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_process(vws_svr_cnx* cnx, vrtql_msg* req);
+static void svr_batch_push(svr_write_batch* batch, vws_svr_data* data);
 
+/**
+ * @brief Holds message data back if the connection has a fragment being
+ * written or message data already waiting. Otherwise notes whether it is a
+ * fragment about to be written.
+ *
+ * @param data The response.
+ * @return True if data was held, false if it is to be written now.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_cnx_hold(vws_svr_data* data);
 
+/**
+ * @brief Notes a fragment about to be written: the next message data waits
+ * for its write to complete, and until the last fragment only its own outbox
+ * may follow it.
+ *
+ * @param cnx The connection.
+ * @param outbox The outbox of the data's lane.
+ * @param data The data being written.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_cnx_note(vws_svr_cnx* cnx,
+                         struct sc_queue_ptr* outbox,
+                         vws_svr_data* data);
 
+/**
+ * @brief Writes held message data, up to and including the next fragment.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_cnx_pump(vws_svr_cnx* cnx);
 
 /**
- * @defgroup ConnectionMap
+ * @brief Queues a frame to every loop, which passes it on to its subscribers
+ * to a topic. The caller's reference is given up.
  *
- * @brief Functions that provide access to the connection map
+ * @param server The server.
+ * @param topic The topic name.
+ * @param b The frame.
  *
- * The connection map tracks all active connections. These functions simplify
- * the map API and include memory management and other server-specific
- * functionality where appropriate.
+ * @ingroup ServerFunctions
+ */
+static void svr_broadcast_send( vws_tcp_svr* server,
+                                cstr topic,
+                                vws_svr_buffer* b );
+
+/**
+ * @brief Frees memory allocated with vws.malloc() that was handed to a shared
+ * buffer.
  *
- * @ingroup ConnectionMap
+ * @param data The memory.
+ * @param arg Not used.
+ *
+ * @ingroup ServerFunctions
  */
+static void svr_buffer_free_data(ucstr data, void* arg);
 
 /**
- * @brief Get the connection corresponding to a client from the connection map.
+ * @brief Unmaps a file mapped by vws_file_map() that was handed to a shared
+ * buffer.
  *
- * @param map The connection map.
- * @param key The client (used as key in the map).
- * @return The corresponding server connection.
+ * @param data The mapped data.
+ * @param arg The size of the mapping.
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key);
+static void svr_buffer_unmap(ucstr data, void* arg);
 
 /**
- * @brief Set a connection for a client in the connection map.
+ * @brief Gives a connection a slot and sets its ID.
  *
- * @param map The connection map.
- * @param key The client (used as key in the map).
- * @param value The server connection.
- * @return Success or failure status.
+ * @param cnx The connection.
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static int8_t svr_cnx_map_set( vws_svr_cnx_map* map,
-                               uv_stream_t* key,
-                               vws_svr_cnx* value );
+static void svr_slot_acquire(vws_svr_cnx* cnx);
 
 /**
- * @brief Remove a client's connection from the connection map.
+ * @brief Gives up a connection's slot. Its ID no longer matches.
  *
- * @param map The connection map.
- * @param key The client (used as key in the map).
+ * @param cnx The connection.
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key);
+static void svr_slot_release(vws_svr_cnx* cnx);
 
 /**
- * @brief Clear all connections from the connection map.
+ * @brief Looks up a slot by index.
  *
- * @param map The connection map.
+ * @param server The server.
+ * @param index The slot index.
+ * @return The slot, or NULL if it was never handed out.
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static void svr_cnx_map_clear(vws_svr_cnx_map* map);
+static vws_svr_slot* svr_slot_at(vws_tcp_svr* server, uint32_t index);
 
 /**
- * @defgroup QueueGroup
+ * @brief Looks up the slot a connection ID refers to.
  *
- * @brief Queue functions which bridge the network thread and workers
+ * @param server The server.
+ * @param id The connection ID.
+ * @return The slot, or NULL if the ID no longer matches. Unless called on the
+ *   loop that owns the connection, the slot may move on at any time after.
  *
- * The network thread and worker threads pass data via queues. These queues
- * contain vws_svr_data instances. There is a requests queue which passes
- * data from the network thread to workers for processing. There is a response
- * queue that passed data from worker queues to the network thread. When passed
- * from network thread to work, data take form of incoming data from the
- * client. When passed from the worker threads the the networking thread, data
- * take the form of outgoing data to be sent back to the client.
+ * @ingroup ServerFunctions
+ */
+static vws_svr_slot* svr_slot_get(vws_tcp_svr* server, uint64_t id);
+
+/**
+ * @brief Queues data to a loop, on the lane its flags call for, and wakes the
+ * loop up.
  *
- * Queues have built-in synchronization mechanisms that allow the data to be
- * safely passed between threads, as well as ways to gracefull put waiting
- * threads to sleep until data arrives for processing.
+ * @param loop The loop.
+ * @param data The data.
+ *
+ * @ingroup ServerFunctions
  */
+static void svr_loop_push(vws_svr_loop* loop, vws_svr_data* data);
 
 /**
- * @brief Initializes a server queue.
+ * @brief Wakes a loop to empty its response queues, unless it has already been
+ * woken and has not yet emptied them. Call it after queuing.
  *
- * This function sets up the provided queue with the given capacity. It also
- * initializes the synchronization mechanisms associated with the queue.
+ * @param loop The loop.
  *
- * @param queue Pointer to the server queue to be initialized.
- * @param capacity The maximum capacity of the queue.
- * @param name The queue name
+ * @ingroup ServerFunctions
+ */
+static void svr_loop_wake(vws_svr_loop* loop);
+
+/**
+ * @brief Allocates a zeroed set of metrics.
  *
- * @ingroup QueueGroup
+ * @return The metrics.
+ *
+ * @ingroup ServerFunctions
  */
-void queue_init(vws_svr_queue* queue, int capacity, cstr name);
+static vws_svr_metrics* svr_metrics_new();
 
 /**
- * @brief Destroys a server queue.
+ * @brief Makes a set of metrics the calling thread's own for a server. Loop
+ * and worker threads bind theirs when they start.
  *
- * This function cleans up the resources associated with the provided queue.
- * It also handles the synchronization mechanisms associated with the queue.
+ * @param server The server, or NULL to unbind.
+ * @param m The metrics.
  *
- * @param queue Pointer to the server queue to be destroyed.
+ * @ingroup ServerFunctions
+ */
+static void svr_metrics_bind(vws_tcp_svr* server, vws_svr_metrics* m);
+
+/**
+ * @brief Gets the metrics the calling thread updates for a server: its own
+ * if it is one of the server's threads, the server's shared set otherwise.
+ * Used where code can run on either a loop or a worker.
  *
- * @ingroup QueueGroup
+ * @param server The server.
+ * @return The metrics.
+ *
+ * @ingroup ServerFunctions
  */
-void queue_destroy(vws_svr_queue* queue);
+static vws_svr_metrics* svr_metrics(vws_tcp_svr* server);
 
 /**
- * @brief Pushes data to the server queue.
+ * @brief Adds to a counter. Each thread has its own counters, so the add
+ * never contends. It is atomic so snapshots read whole values.
  *
- * This function adds data to the end of the provided queue. It also handles
- * the necessary synchronization to ensure thread safety.
+ * @param counter The counter.
+ * @param n The amount.
  *
- * @param queue Pointer to the server queue.
- * @param data Data to be added to the queue.
+ * @ingroup ServerFunctions
+ */
+static void svr_count(uint64_t* counter, uint64_t n);
+
+/**
+ * @brief Records a value in a histogram.
  *
- * @ingroup QueueGroup
+ * @param h The histogram.
+ * @param value The value.
+ *
+ * @ingroup ServerFunctions
  */
-void queue_push(vws_svr_queue* queue, vws_svr_data* data);
+static void svr_histogram_record(vws_svr_histogram* h, uint64_t value);
 
 /**
- * @brief Pops data from the server queue.
+ * @brief Adds one set of metrics into another.
  *
- * This function removes and returns data from the front of the provided queue.
- * It also handles the necessary synchronization to ensure thread safety.
+ * @param to The total.
+ * @param from The metrics to add, which may be being updated.
  *
- * @param queue Pointer to the server queue.
- * @return A data element from the front of the queue.
+ * @ingroup ServerFunctions
+ */
+static void svr_metrics_merge(vws_svr_metrics* to, vws_svr_metrics* from);
+
+/**
+ * @brief Returns the number of items in a queue, which is only a rough
+ * figure while the queue is in use.
  *
- * @ingroup QueueGroup
+ * @param queue The queue.
+ * @return The depth.
+ *
+ * @ingroup ServerFunctions
  */
-vws_svr_data* queue_pop(vws_svr_queue* queue);
+static size_t queue_depth(vws_svr_queue* queue);
 
 /**
- * @brief Checks if the server queue is empty.
+ * @brief Picks requests to sample. Called in the network thread for each
+ * request it queues to a worker. One in vws_tcp_svr.sample_rate gets a timing
+ * started from the time of the read it came from.
  *
- * This function checks whether the provided queue is empty.
- * It also handles the necessary synchronization to ensure thread safety.
+ * @param c The connection
+ * @param data The request
  *
- * @param queue Pointer to the server queue.
- * @return True if the queue is empty, false otherwise.
+ * @ingroup ServerFunctions
+ */
+static void svr_sample_start(vws_svr_cnx* c, vws_svr_data* data);
+
+/**
+ * @brief Finishes a sample: passes its timing to on_sample and frees it.
  *
- * @ingroup QueueGroup
+ * @param server The server
+ * @param t The timing
+ *
+ * @ingroup ServerFunctions
  */
-bool queue_empty(vws_svr_queue* queue);
+static void svr_sample_end(vws_tcp_svr* server, vws_svr_timing* t);
 
-//------------------------------------------------------------------------------
-// Threads
-//------------------------------------------------------------------------------
+// Timing of the sampled request a worker is handling. The first item the
+// handler creates takes it.
+static __thread vws_svr_timing* svr_timing_current = NULL;
 
-void worker_thread(void* arg)
+// When the request a worker is handling was queued (uv_hrtime()), 0 outside
+// of a request
+static __thread uint64_t svr_request_queued = 0;
+
+/**
+ * @brief Messages a worker has collected for a process_batch() callback (see
+ * vws_svr.process_batch), all from one connection.
+ *
+ * @ingroup ServerFunctions
+ */
+typedef struct
 {
-    vws_tcp_svr* server = (vws_tcp_svr*)arg;
+    /**< The connection the messages came from */
+    vws_svr_cnx* cnx;
 
-    // Set thread tracing level to server.
-    vws.tracelevel = server->trace;
+    /**< The messages, oldest first */
+    void* items[VWS_SVR_BATCH];
 
-    if (vws.tracelevel >= VT_THREAD)
-    {
-        vws.trace(VL_INFO, "worker_thread(): Starting");
-    }
+    /**< Number of messages */
+    size_t count;
+
+    /**< Passes the messages to the server's process_batch() */
+    void (*flush)(vws_svr_cnx* cnx, void** items, size_t n);
+
+} svr_msg_batch;
+
+// Messages the worker has collected so far
+static __thread svr_msg_batch svr_msg_batch_current;
+
+/**
+ * @brief Adds a message to the worker's batch. The batch is passed on first
+ * if it is full or holds messages of another connection.
+ *
+ * @param cnx The connection.
+ * @param m The message.
+ * @param flush Passes a batch to the server's process_batch().
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_msg_batch_add( vws_svr_cnx* cnx,
+                               void* m,
+                               void (*flush)(vws_svr_cnx*, void**, size_t) );
+
+/**
+ * @brief Passes the messages the worker has collected on, if any. Done after
+ * each batch of requests, and before anything that lets go of a connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_msg_batch_flush();
+
+/**
+ * @brief Adds a connection to a topic on its loop.
+ *
+ * @param cnx The connection.
+ * @param name The topic name.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_topic_add(vws_svr_cnx* cnx, cstr name);
+
+/**
+ * @brief Removes a connection from a topic on its loop, freeing the topic
+ * once it has no subscribers left.
+ *
+ * @param cnx The connection.
+ * @param name The topic name.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_topic_remove(vws_svr_cnx* cnx, cstr name);
+
+/**
+ * @brief Removes a connection from every topic it is subscribed to.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_topic_remove_all(vws_svr_cnx* cnx);
+
+/**
+ * @brief Frees a topic.
+ *
+ * @param topic The topic.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_topic_free(vws_svr_topic* topic);
+
+/**
+ * @brief Writes a broadcast frame to every subscriber of its topic on a loop.
+ *
+ * @param loop The loop.
+ * @param data The publish item. It is freed.
+ * @param batching Whether responses are gathered into per-connection batches.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_topic_publish( vws_svr_loop* loop,
+                               vws_svr_data* data,
+                               bool batching );
+
+/**
+ * @brief Sends all responses in a batch with a single uv_write(). A small
+ * batch to a connection with no writes queued is tried with uv_try_write()
+ * first (vws_tcp_svr.try_write), and completed on the spot if the socket
+ * takes it all.
+ *
+ * @param batch The batch. It is freed once the write completes.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_batch_send(svr_write_batch* batch);
+
+/**
+ * @brief Callback for batch write completion. Frees the batch and all of
+ * its responses.
+ *
+ * @param req The write request.
+ * @param status The status of the write operation.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_on_batch_write_complete(uv_write_t* req, int status);
+
+/** Largest TLS record payload. Encryption coalesces small writes up to this. */
+#define SVR_TLS_RECORD 16384
+
+/**
+ * @brief Feeds ciphertext read from a TLS connection into its session and
+ * passes the plaintext that comes out to the server's on_read() handler. Sends
+ * any records the session produced along the way (handshake, tickets, alerts)
+ * and closes the connection if the session fails.
+ *
+ * @param cnx The connection.
+ * @param size The number of bytes read.
+ * @param buf The read buffer. It is reused to hold the plaintext.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_tls_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf);
+
+/**
+ * @brief Encrypts the responses in a batch and replaces them with a single
+ * response holding the resulting TLS records, along with any other output
+ * pending in the session. Small responses are coalesced into full records.
+ *
+ * @param batch The batch.
+ * @return true if successful, false if the session failed.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_tls_encrypt(svr_write_batch* batch);
+
+/**
+ * @brief Writes plaintext into a TLS session through a coalescing buffer. Data
+ * is only handed to SSL_write() once a full record's worth has accumulated;
+ * pass a NULL data pointer to write out whatever is left.
+ *
+ * @param ssl The TLS session.
+ * @param chunk The coalescing buffer (SVR_TLS_RECORD bytes).
+ * @param used The number of bytes in chunk.
+ * @param data The data to write, or NULL to flush chunk.
+ * @param size The number of bytes of data.
+ * @return true if successful, false if the session failed.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_tls_write( SSL* ssl,
+                           unsigned char* chunk,
+                           size_t* used,
+                           const void* data,
+                           size_t size );
+
+/**
+ * @brief Sends any TLS records waiting in a connection's session.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_tls_flush(vws_svr_cnx* cnx);
+
+/**
+ * @defgroup Connection Functions
+ *
+ * @brief Functions that support connection operation
+ *
+ * Connections always refer to client-side connections, on the server. They are
+ * active connections established within the main UV loop.
+ *
+ * @ingroup ServerFunctions
+ */
+
+/**
+ * @brief Creates a new server connection.
+ *
+ * @param s The server for the connection.
+ * @param c The client for the connection.
+ * @return A new server connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static vws_svr_cnx* svr_cnx_new(vws_svr_loop* l, uv_stream_t* c);
+
+/**
+ * @brief Frees a server connection.
+ *
+ * @param c The connection to be freed.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_cnx_free(vws_svr_cnx* c);
+
+/**
+ * @brief Actively close a client connection
+ *
+ * @param c The connection
+ */
+static void svr_cnx_close(vws_svr_cnx* c);
+
+/**
+ * @brief Callback for client connection.
+ *
+ * This function is triggered when a new client connection is established.  It
+ * is responsible for processing any steps necessary at the start of a
+ * connection.
+ *
+ * @param c The connection structure representing the client that has connected.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_connect(vws_svr_cnx* c);
+
+/**
+ * @brief Callback for client disconnection.
+ *
+ * This function is triggered when a client connection is terminated. It is
+ * responsible for processing any cleanup or other steps necessary at the end of
+ * a connection.
+ *
+ * @param c The connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_disconnect(vws_svr_cnx* c);
+
+/**
+ * @brief Callback for client read operations.
+ *
+ * This function is triggered when data is read from a client connection. It is
+ * responsible for processing the received data.
+ *
+ * @param c The connection that sent the data.
+ * @param size The size of the data that was read.
+ * @param buf The buffer containing the data that was read.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf);
+
+/**
+ * @brief Callback for processing client data in (ingress)
+ *
+ * This function processes data arriving from client to worker thread. It is
+ * responsible for handling the actual computation or other work associated with
+ * the data. This takes place in the context of worker_thread().
+ *
+ * @param data The incoming data from the client to process.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_data_in(vws_svr_data* data);
+
+/**
+ * @brief Callback for processing client data in (ingress)
+ *
+ * This function is triggered to process data arriving from worker thread to be
+ * send back to client. It is responsible for transferring the data from the
+ * response argument (vws_svr_data ) onto the wire (client socket via
+ * libuv). actual computation or other work associated with the data. This takes
+ * place in the context of uv_thread().
+ *
+ * @param data The outgoing data from worker to client
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_data_out(vws_svr_data* data);
+
+/**
+ * @brief Callback for backpressure changes on a connection. The default only
+ * traces. This takes place in the context of uv_thread().
+ *
+ * @param c The connection
+ * @param paused True if reading was paused, false if resumed
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_backpressure(vws_svr_cnx* c, bool paused);
+
+/**
+ * @brief Default keepalive callback. Does nothing.
+ *
+ * @param c The connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_keepalive(vws_svr_cnx* c);
+
+/**
+ * @brief Starts the loop's timer wheel if keepalive or idle_timeout is set.
+ *
+ * @param loop The loop.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_timer_start(vws_svr_loop* loop);
+
+/**
+ * @brief Puts a connection in the timer wheel slot for its next deadline, if
+ * it has one.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_timer_add(vws_svr_cnx* cnx);
+
+/**
+ * @brief Takes a connection out of the timer wheel.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_timer_remove(vws_svr_cnx* cnx);
+
+/**
+ * @brief Turns the timer wheel one slot. Each connection in the slot is
+ * checked against its deadlines: closed if idle too long, sent a keepalive if
+ * quiet, and put back for its next deadline.
+ *
+ * Reads only note the time. Nothing moves in the wheel until a connection's
+ * slot comes round, so activity costs nothing and each tick costs only the
+ * connections in its slot.
+ *
+ * @param handle The timer.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_on_tick(uv_timer_t* handle);
+
+/**
+ * @brief Default handoff callback. Hands every connection off, with no state.
+ *
+ * @param c The connection
+ * @param state Not used
+ * @return True
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_client_handoff(vws_svr_cnx* c, vws_buffer* state);
+
+/**
+ * @brief Default adopt callback. Does nothing.
+ *
+ * @param c The connection
+ * @param state Not used
+ * @param size Not used
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_adopt(vws_svr_cnx* c, ucstr state, size_t size);
+
+/** Handoff message types */
+#define SVR_HANDOFF_HELLO    1 /* Protocol version, first from the old process */
+#define SVR_HANDOFF_LISTENER 2 /* A listening socket */
+#define SVR_HANDOFF_CNX      3 /* A connection and its state */
+#define SVR_HANDOFF_DONE     4 /* Nothing more to come */
+
+/** Handoff protocol version. Changes with the layout of the messages. */
+#define SVR_HANDOFF_VERSION  1
+
+/** Largest handoff message accepted. A connection's state holds at most part
+ * of a message and a frame still being read. */
+#define SVR_HANDOFF_SIZE_MAX (VWS_MESSAGE_MAX + VWS_FRAME_MAX)
+
+/**
+ * @brief A connection received from another process, waiting for
+ * vws_tcp_svr_run() to adopt it.
+ */
+typedef struct svr_adoptee
+{
+    /**< The socket */
+    int fd;
+
+    /**< The SVR_HANDOFF_CNX message it came with */
+    unsigned char* data;
+
+    /**< The size of data */
+    size_t size;
+
+} svr_adoptee;
+
+/**
+ * @brief A handoff to another process (vws_tcp_svr_handoff()), or the
+ * connections received from one (vws_tcp_svr_takeover()).
+ */
+typedef struct vws_svr_handoff
+{
+    /**< Unix socket to the new process */
+    int fd;
+
+    /**< Serializes messages sent from the loops */
+    uv_mutex_t lock;
+
+    /**< Signaled as each loop finishes */
+    uv_cond_t done;
+
+    /**< Loops still handing off */
+    int loops;
+
+    /**< Connections handed off */
+    int count;
+
+    /**< Whether sending to the new process has failed */
+    bool failed;
+
+    /**< When connections that have not drained are closed (uv_hrtime()) */
+    uint64_t deadline;
+
+    /**< Connections received, in the order they came */
+    svr_adoptee* adoptees;
+
+    /**< Number of connections in adoptees */
+    size_t adoptee_count;
+
+    /**< Number of entries allocated in adoptees */
+    size_t adoptee_allocated;
+
+} vws_svr_handoff;
+
+/**
+ * @brief Sends a handoff message: a type, a size and the data, with a file
+ * descriptor passed along if one is given. Blocks until it is all sent.
+ *
+ * @param sock The Unix socket.
+ * @param type The message type.
+ * @param data The data.
+ * @param size The size of data.
+ * @param fd The descriptor to pass, -1 if none.
+ * @return True on success, false otherwise.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_handoff_send( int sock,
+                              uint32_t type,
+                              ucstr data,
+                              size_t size,
+                              int fd );
+
+/**
+ * @brief Receives a handoff message.
+ *
+ * @param sock The Unix socket.
+ * @param type Receives the message type.
+ * @param data Receives the data, allocated with vws.malloc(). NULL if empty.
+ * @param size Receives the size of data.
+ * @param fd Receives the descriptor passed with it, -1 if none.
+ * @return True on success, false on error or timeout.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_handoff_recv( int sock,
+                              uint32_t* type,
+                              unsigned char** data,
+                              size_t* size,
+                              int* fd );
+
+/**
+ * @brief Checks that the process at the other end of a handoff socket runs as
+ * the same user as this one. Sockets are only passed to or taken from such a
+ * process.
+ *
+ * @param sock The Unix socket.
+ * @return True if it does, false otherwise.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_handoff_peer(int sock);
+
+/**
+ * @brief Removes a Unix socket file left at path, but nothing else.
+ *
+ * @param path The path.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_unlink_socket(cstr path);
+
+/**
+ * @brief Starts handing off on a loop. Closes its listener, stops reading from
+ * its connections and sends a marker through each one's worker.
+ *
+ * @param loop The loop.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_handoff_begin(vws_svr_loop* loop);
+
+/**
+ * @brief Hands off the loop's connections that have drained, and closes those
+ * that have run out of time. Finishes the loop when none are left.
+ *
+ * @param handle The loop's handoff timer.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_on_handoff_tick(uv_timer_t* handle);
+
+/**
+ * @brief Saves a drained connection and passes its socket to the new process.
+ * If on_handoff declines it, or it cannot be sent, it is served here again.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_handoff_cnx(vws_svr_cnx* cnx);
+
+/**
+ * @brief Goes back to serving a connection that is not being handed off.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_handoff_keep(vws_svr_cnx* cnx);
+
+/**
+ * @brief Ends the loop's part in the handoff and tells the waiting thread.
+ *
+ * @param loop The loop.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_handoff_end(vws_svr_loop* loop);
+
+/**
+ * @brief Adopts a connection received from another process on a loop. Runs
+ * before the loop does.
+ *
+ * @param loop The loop.
+ * @param a The connection.
+ * @return True on success, false if the socket could not be opened.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_adopt(vws_svr_loop* loop, svr_adoptee* a);
+
+/**
+ * @brief Creates an empty handoff.
+ *
+ * @return The handoff.
+ *
+ * @ingroup ServerFunctions
+ */
+static vws_svr_handoff* svr_handoff_new();
+
+/**
+ * @brief Frees a handoff, closing any sockets it still holds.
+ *
+ * @param h The handoff.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_handoff_free(vws_svr_handoff* h);
+
+/**
+ * @brief Starts listening on an inherited socket.
+ *
+ * @param loop The loop.
+ * @param fd The socket. The loop's listener takes ownership of it.
+ * @return 0 on success, -1 otherwise.
+ *
+ * @ingroup ServerFunctions
+ */
+static int svr_loop_inherit(vws_svr_loop* loop, int fd);
+
+/**
+ * @brief Tells whether a socket is a Unix domain socket.
+ *
+ * @param fd The socket.
+ * @return True for AF_UNIX, false for anything else.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_fd_is_local(int fd);
+
+/**
+ * @brief Allocates and initializes a stream handle for a connection or
+ * listener: a uv_pipe_t for a Unix domain socket, a uv_tcp_t otherwise.
+ *
+ * @param loop The loop.
+ * @param local Whether the socket is a Unix domain socket.
+ * @param client Whether it is a client connection rather than a listener.
+ * @return The handle, with data set to NULL, or NULL on error.
+ *
+ * @ingroup ServerFunctions
+ */
+static uv_stream_t* svr_stream_new( vws_svr_loop* loop,
+                                    bool local,
+                                    bool client );
+
+#if defined(VWS_SHM)
+
+/**
+ * @brief A connection's end of a shared memory transport (shm.h). Only its
+ * loop touches it.
+ */
+typedef struct vws_svr_shm
+{
+    vrtql_shm* shm;              /**< The transport                          */
+    uv_poll_t* poll;             /**< Watches its eventfd                    */
+    struct sc_queue_ptr backlog; /**< Replies waiting for room in the ring   */
+} vws_svr_shm;
+
+/**
+ * @brief Takes the descriptors a client has passed on a Unix socket. Client
+ * pipes are opened in IPC mode so that libuv receives them, and hands them
+ * over one at a time as handles.
+ *
+ * @param s The client's stream.
+ * @param fds Receives the descriptors. Any beyond max are closed.
+ * @param max The most to keep. 0 closes them all.
+ * @return The number kept.
+ *
+ * @ingroup ServerFunctions
+ */
+static int svr_pipe_take(uv_stream_t* s, int* fds, int max);
+
+/**
+ * @brief Reads what the client has put in the ring and passes each message to
+ * the connection's worker, as the WebSocket path does. Also sends replies
+ * that were waiting for room.
+ *
+ * @param handle The poll handle on the transport's eventfd.
+ * @param status The status.
+ * @param events The events.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_shm_on_poll(uv_poll_t* handle, int status, int events);
+
+/**
+ * @brief Writes a serialized reply into the ring, or holds it back until
+ * there is room. A reply too large for the ring closes the connection.
+ *
+ * @param cnx The connection.
+ * @param data The reply. This takes ownership of it.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_shm_out(vws_svr_cnx* cnx, vws_svr_data* data);
+
+/**
+ * @brief Writes replies held back for room in the ring.
+ *
+ * @param cnx The connection.
+ * @return True if none are left.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_shm_flush(vws_svr_cnx* cnx);
+
+/**
+ * @brief Ends a connection's shared memory transport, if any.
+ *
+ * @param cnx The connection.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_shm_close(vws_svr_cnx* cnx);
+
+#endif
+
+
+
+
+/**
+ * @defgroup WebSocketServerFunctions
+ *
+ * @brief Functions that support message server operation
+ *
+ */
+
+/**
+ * @brief WebSocket server constructor.
+ *
+ * @param server The WebSocket server instance.
+ * @param nt The number of threads to run in the worker pool.
+ * @param bl The connection backlog for listen(). If set to 0, it uses the
+ *        default value (128).
+ * @param qs The maximum queue size for requests and responses. If set to 0, it
+ *        uses the default value (1024).
+ */
+static void ws_svr_ctor(vws_svr* server, int nt, int bl, int qs);
+
+/**
+ * @brief WebSocket server destructor.
+ *
+ * @param server The WebSocket server instance to free.
+ */
+static void ws_svr_dtor(vws_svr* server);
+
+/**
+ * @brief Callback for client connection.
+ *
+ * This function is triggered when a new client connection is established.  It
+ * is responsible for processing any steps necessary at the start of a
+ * connection.
+ *
+ * @param c The connection structure representing the client that has connected.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_connect(vws_svr_cnx* c);
+
+/**
+ * @brief Callback for client disconnection.
+ *
+ * This function is triggered when a client connection is terminated. It is
+ * responsible for processing any cleanup or other steps necessary at the end of
+ * a connection.
+ *
+ * @param c The connection
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_disconnect(vws_svr_cnx* c);
+
+/**
+ * @brief Sends a ping to a quiet WebSocket connection. Runs in the network
+ * thread. The pong that comes back counts as activity.
+ *
+ * @param c The connection
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_keepalive(vws_svr_cnx* c);
+
+/**
+ * @brief Saves a WebSocket connection for handoff. The state is the streaming
+ * state and the data still to be processed: the frames of a message part way
+ * received, serialized again, followed by what has not been parsed yet.
+ * Connections that have not upgraded, or that use permessage-deflate, whose
+ * compression context cannot be carried over, are declined.
+ *
+ * @param c The connection
+ * @param state Receives the state
+ * @return True if the connection can be handed off
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static bool ws_svr_client_handoff(vws_svr_cnx* c, vws_buffer* state);
+
+/**
+ * @brief Restores a WebSocket connection from the state saved by
+ * ws_svr_client_handoff(), then processes the data in it as if just read.
+ *
+ * @param c The connection
+ * @param state The state
+ * @param size The size of state
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_adopt(vws_svr_cnx* c, ucstr state, size_t size);
+
+/**
+ * @brief Callback for client read operations.
+ *
+ * This function is triggered when data is read from a client connection. It is
+ * responsible for processing the received data.
+ *
+ * @param c The connection that sent the data.
+ * @param size The size of the data that was read.
+ * @param buf The buffer containing the data that was read.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf);
+
+/**
+ * @brief Builds the 101 response to an upgrade request from the fixed
+ * template, in a single allocation sized up front.
+ *
+ * @param c The connection being upgraded.
+ * @param accept The accept key.
+ * @param proto The protocol to confirm.
+ * @param ext The extensions header value, or NULL for none.
+ * @return The response, ready to send.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static vws_svr_data* ws_svr_upgrade_reply( vws_svr_cnx* c,
+                                           cstr accept,
+                                           cstr proto,
+                                           cstr ext );
+
+/**
+ * @brief Copies raw socket data and queues it to the connection's worker. Used
+ * when vws_svr.worker_parse is set.
+ *
+ * @param c The connection that sent the data.
+ * @param data The data.
+ * @param size The number of bytes.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_forward(vws_svr_cnx* c, ucstr data, size_t size);
+
+/**
+ * @brief Answers a plain HTTP request through vws_svr.on_http and gets the
+ * connection ready for the next one. Runs in the network thread.
+ *
+ * @param c The connection.
+ * @param size The size of the request at the front of the receive buffer.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_http(vws_svr_cnx* c, size_t size);
+
+/**
+ * @brief Callback for processing client data in (ingress) for msg server
+ *
+ * This function processes data arriving from client to worker thread. It
+ * collects data until there is a complete message. It passes message to
+ * ws_svr_client_msg_in() for processing. This takes place in the context of
+ * worker_thread(). If vws_svr.worker_parse is set, the data is raw socket data
+ * which is parsed into frames and messages here.
+ *
+ * @param server The server instance
+ * @param data The incoming data from the client to process.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_data_in(vws_svr_data* data);
+
+/**
+ * @brief Sends data from a server connection to a client WebSocket connection.
+ *        This TAKES OWNERSHIP of the buffer data and sets the buffer to zero.
+ *
+ * @param cnx The server connection.
+ * @param buffer The data to send.
+ * @param opcode The opcode for the WebSocket frame.
+ * @param priority Whether to send it on the priority lane.
+ */
+static void ws_svr_client_data_out( vws_svr_cnx* cnx,
+                                    vws_buffer* buffer,
+                                    unsigned char opcode,
+                                    bool priority );
+
+/**
+ * @brief Queues a data message larger than vws_svr.max_frame to go out as a
+ * series of fragments. The payload is not copied: the fragments point into
+ * a shared buffer over it, which is freed with the last of them.
+ *
+ * @param cnx The connection.
+ * @param b The payload. The caller's reference is taken over.
+ * @param opcode The message opcode.
+ * @param compressed Whether the payload was compressed.
+ * @param flags Flags to set on every item queued, in addition to the message
+ *   and fragment flags.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_fragment_out( vws_svr_cnx* cnx,
+                                        vws_svr_buffer* b,
+                                        unsigned char opcode,
+                                        bool compressed,
+                                        uint64_t flags );
+
+/**
+ * @brief Queues a data message whose payload is a file mapped with
+ * vws_file_map(). The frames point into the mapping, which is unmapped with
+ * the last of them. It is not compressed.
+ *
+ * @param cnx The connection.
+ * @param data The mapped payload. It is taken over.
+ * @param size The payload size.
+ * @param opcode The message opcode.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_mapped_out( vws_svr_cnx* cnx,
+                                      ucstr data,
+                                      size_t size,
+                                      unsigned char opcode );
+
+/**
+ * @brief Process a WebSocket frame received from a client.
+ *
+ * @param c The WebSocket connection.
+ * @param f The incoming frame to process.
+ */
+static void ws_svr_process_frame(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Passes streamed message data from a connection to vws_svr.on_stream.
+ *
+ * @param c The connection
+ * @param opcode The message opcode
+ * @param data The fragment payload
+ * @param size The payload size
+ * @param begin True for the first fragment of a message
+ * @param end True for the last fragment of a message
+ */
+static void ws_svr_client_stream( vws_cnx* c,
+                                  unsigned char opcode,
+                                  ucstr data,
+                                  size_t size,
+                                  bool begin,
+                                  bool end );
+
+/**
+ * @brief Whether WebSocket data is parsed in the workers rather than the
+ * network thread: if asked for, or if messages are streamed.
+ *
+ * @param server The server
+ * @return True if workers parse.
+ */
+static bool ws_svr_worker_parse(vws_svr* server);
+
+/**
+ * @brief Callback for client message processing
+ *
+ * This function is triggered when a message is read from a client
+ * connection. It is responsible for processing the message. This takes place in
+ * the context of worker_thread().
+ *
+ * @param c The connection that sent the data.
+ * @param m The message to process
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_msg_in(vws_svr_cnx* c, vws_msg* m);
+
+/**
+ * @brief Passes a batch of WebSocket messages to vws_svr.process_batch.
+ *
+ * @param cnx The connection.
+ * @param items The messages.
+ * @param n The number of messages.
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_batch_in(vws_svr_cnx* cnx, void** items, size_t n);
+
+/**
+ * @brief Callback for sending message to client. It takes a message as input,
+ * serializes it to a binary WebSocket message and then sends it to the
+ * uv_thread() to send back to client. This takes place in the context of
+ * worker_thread() (only to be called within that context).
+ *
+ * This function sends a message back to a client.
+ *
+ * @param c The connection that sent the data.
+ * @param m The message to send
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_msg_out(vws_svr_cnx* c, vws_msg* m);
+
+/**
+ * @brief Default WebSocket message processing function. This is mean to be
+ * overriden by application to perform message processing, specifically by
+ * assigning the vws_svr.process callback to the desired processing
+ * handler. The default implementation simple drops (deletes) the incoming
+ * message.
+ *
+ * @param cnx The server connection.
+ * @param req The incoming WebSocket message.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void ws_svr_client_process(vws_svr_cnx* cnx, vws_msg* req);
+
+
+
+
+/**
+ * @defgroup MessageServerFunctions
+ *
+ * @brief Functions that support message server operation
+ *
+ */
+
+/**
+ * @brief Convert incoming WebSocket messages to VRTQL messages for processing.
+ *
+ * @param cnx The server connection.
+ * @param wsm The incoming WebSocket message.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_ws_msg_in(vws_svr_cnx* cnx, vws_msg* wsm);
+
+/**
+ * @brief Checks whether a request's deadline (VM_DEADLINE) passed while it
+ * was queued. The time is counted from when the loop queued it to the worker.
+ *
+ * @param m The request
+ * @return True if it has a deadline and it has passed, false otherwise.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static bool msg_svr_expired(vrtql_msg* m);
+
+/**
+ * @brief Callback function for handling incoming VRTQL messages from a client.
+ *
+ * @param cnx The server connection.
+ * @param m The incoming VRTQL message.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_msg_in(vws_svr_cnx* cnx, vrtql_msg* m);
+
+/**
+ * @brief Passes a batch of VRTQL messages to vrtql_msg_svr.process_batch.
+ *
+ * @param cnx The connection.
+ * @param items The messages.
+ * @param n The number of messages.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_batch_in(vws_svr_cnx* cnx, void** items, size_t n);
+
+/**
+ * @brief Callback function for sending VRTQL messages to a client.
+ *
+ * @param cnx The server connection.
+ * @param m The outgoing VRTQL message.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_msg_out(vws_svr_cnx* cnx, vrtql_msg* m);
+
+/**
+ * @brief Sends the reply to a deferred RPC call (see vrtql_msg_svr_rpc_env()).
+ * It can run on any thread, so it leaves framing to the connection's loop.
+ *
+ * @param r The reply token.
+ * @param m The reply.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_rpc_deliver(vrtql_rpc_reply* r, vrtql_msg* m);
+
+/**
+ * @brief Default VRTQL message processing function.
+ *
+ * @param cnx The server connection.
+ * @param req The incoming VRTQL message.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_process(vws_svr_cnx* cnx, vrtql_msg* req);
+
+/**
+ * @brief Reads from a client. Takes up a shared memory offer, which comes with
+ * a ping, before handing the data to the WebSocket server. The pong then tells
+ * the client whether it was taken.
+ *
+ * @param c The server connection.
+ * @param size The number of bytes read.
+ * @param buf The data.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf);
+
+#if defined(VWS_SHM)
+
+/**
+ * @brief Sets up shared memory from the descriptors a client has passed, if
+ * it passed any.
+ *
+ * @param cnx The server connection.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_shm_attach(vws_svr_cnx* cnx);
+
+#endif
+
+
+
+
+/**
+ * @defgroup ConnectionMap
+ *
+ * @brief Functions that provide access to the connection map
+ *
+ * The connection map tracks all active connections. These functions simplify
+ * the map API and include memory management and other server-specific
+ * functionality where appropriate.
+ *
+ * @ingroup ConnectionMap
+ */
+
+/**
+ * @brief Get the connection corresponding to a client from the connection map.
+ *
+ * @param map The connection map.
+ * @param key The client (used as key in the map).
+ * @return The corresponding server connection.
+ *
+ * @ingroup ConnectionMap
+ */
+static vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key);
+
+/**
+ * @brief Set a connection for a client in the connection map.
+ *
+ * @param map The connection map.
+ * @param key The client (used as key in the map).
+ * @param value The server connection.
+ * @return Success or failure status.
+ *
+ * @ingroup ConnectionMap
+ */
+static int8_t svr_cnx_map_set( vws_svr_cnx_map* map,
+                               uv_stream_t* key,
+                               vws_svr_cnx* value );
+
+/**
+ * @brief Remove a client's connection from the connection map.
+ *
+ * @param map The connection map.
+ * @param key The client (used as key in the map).
+ *
+ * @ingroup ConnectionMap
+ */
+static void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key);
+
+/**
+ * @brief Clear all connections from the connection map.
+ *
+ * @param map The connection map.
+ *
+ * @ingroup ConnectionMap
+ */
+static void svr_cnx_map_clear(vws_svr_cnx_map* map);
+
+/**
+ * @defgroup QueueGroup
+ *
+ * @brief Queue functions which bridge the network thread and workers
+ *
+ * The network thread and worker threads pass data via queues. These queues
+ * contain vws_svr_data instances. Each worker has a requests queue which passes
+ * data from the network thread to it for processing. There is a response
+ * queue that passed data from worker queues to the network thread. When passed
+ * from network thread to work, data take form of incoming data from the
+ * client. When passed from the worker threads the the networking thread, data
+ * take the form of outgoing data to be sent back to the client.
+ *
+ * Queues have built-in synchronization mechanisms that allow the data to be
+ * safely passed between threads, as well as ways to gracefull put waiting
+ * threads to sleep until data arrives for processing.
+ */
+
+/**
+ * @brief Initializes a server queue.
+ *
+ * This function sets up the provided queue with the given capacity. It also
+ * initializes the synchronization mechanisms associated with the queue.
+ *
+ * @param queue Pointer to the server queue to be initialized.
+ * @param capacity The maximum capacity of the queue.
+ * @param name The queue name
+ *
+ * @ingroup QueueGroup
+ */
+void queue_init(vws_svr_queue* queue, int capacity, cstr name);
+
+/**
+ * @brief Destroys a server queue.
+ *
+ * This function cleans up the resources associated with the provided queue,
+ * freeing any data still in it. It also handles the synchronization mechanisms
+ * associated with the queue.
+ *
+ * @param queue Pointer to the server queue to be destroyed.
+ *
+ * @ingroup QueueGroup
+ */
+void queue_destroy(vws_svr_queue* queue);
+
+/**
+ * @brief Frees data left undelivered because the server is stopping. A release
+ * marker takes its connection with it, as does a connection's turn if the
+ * requests it carries end in one.
+ *
+ * @param data The data to free.
+ *
+ * @ingroup QueueGroup
+ */
+static void queue_drop(vws_svr_data* data);
+
+/**
+ * @brief Pushes data to the server queue.
+ *
+ * This function adds data to the end of the provided queue. It also handles
+ * the necessary synchronization to ensure thread safety.
+ *
+ * @param queue Pointer to the server queue.
+ * @param data Data to be added to the queue.
+ *
+ * @ingroup QueueGroup
+ */
+void queue_push(vws_svr_queue* queue, vws_svr_data* data);
+
+/**
+ * @brief Pops data from the server queue.
+ *
+ * This function removes and returns data from the front of the provided queue.
+ * It also handles the necessary synchronization to ensure thread safety.
+ *
+ * @param queue Pointer to the server queue.
+ * @return A data element from the front of the queue.
+ *
+ * @ingroup QueueGroup
+ */
+vws_svr_data* queue_pop(vws_svr_queue* queue);
+
+/**
+ * @brief Pops data from the server queue if there is any, without blocking.
+ *
+ * @param queue Pointer to the server queue.
+ * @return A data element from the front of the queue, or NULL if empty.
+ *
+ * @ingroup QueueGroup
+ */
+vws_svr_data* queue_try_pop(vws_svr_queue* queue);
+
+/**
+ * @brief Pops up to max data elements from the server queue at once, without
+ * blocking. They are claimed together with a single update of the head.
+ *
+ * @param queue Pointer to the server queue.
+ * @param items Set to the data elements, oldest first.
+ * @param max The most to pop.
+ * @return The number popped, 0 if the queue is empty.
+ *
+ * @ingroup QueueGroup
+ */
+static size_t queue_pop_batch( vws_svr_queue* queue,
+                               vws_svr_data** items,
+                               size_t max );
+
+/**
+ * @brief Checks if the server queue is empty.
+ *
+ * This function checks whether the provided queue is empty. It takes no locks,
+ * so the answer may already be stale when it returns.
+ *
+ * @param queue Pointer to the server queue.
+ * @return True if the queue is empty, false otherwise.
+ *
+ * @ingroup QueueGroup
+ */
+bool queue_empty(vws_svr_queue* queue);
+
+/**
+ * @brief Halts a server queue and wakes all threads sleeping on it.
+ *
+ * @param queue Pointer to the server queue.
+ *
+ * @ingroup QueueGroup
+ */
+void queue_halt(vws_svr_queue* queue);
+
+/**
+ * @brief Adds data to the server queue if there is room, without blocking.
+ *
+ * @param queue Pointer to the server queue.
+ * @param data Data to be added to the queue.
+ * @return True if added, false if the queue is full.
+ *
+ * @ingroup QueueGroup
+ */
+static bool queue_try_push(vws_svr_queue* queue, vws_svr_data* data);
+
+/**
+ * @brief Wakes one sleeping thread if there are any.
+ *
+ * @param queue Pointer to the server queue.
+ * @param cond The condition to signal.
+ * @param sleepers The number of threads sleeping on cond.
+ *
+ * @ingroup QueueGroup
+ */
+static void queue_wake(vws_svr_queue* queue, uv_cond_t* cond, int* sleepers);
+
+/**
+ * @brief Records when data is queued, for the queue wait metrics and sampled
+ * timings. Done by queue_push() and by anything queuing data elsewhere.
+ *
+ * @param data The data.
+ *
+ * @ingroup QueueGroup
+ */
+static void queue_stamp(vws_svr_data* data);
+
+//------------------------------------------------------------------------------
+// Threads
+//------------------------------------------------------------------------------
+
+void worker_thread(void* arg)
+{
+    vws_svr_worker* worker = (vws_svr_worker*)arg;
+    vws_tcp_svr* server    = worker->server;
+
+    // Set thread tracing level to server.
+    vws.tracelevel = server->trace;
+
+    if (vws.tracelevel >= VT_THREAD)
+    {
+        vws.trace(VL_INFO, "worker_thread(): Starting");
+    }
+
+    // Before anything of the thread's own is allocated
+    svr_pin(worker->cpus, worker->cpu_count);
+
+    svr_metrics_bind(server, worker->metrics);
+    vws_svr_metrics* metrics = worker->metrics;
+
+    // Request scoped memory, reset after every request
+    vws_arena* arena = NULL;
+
+    if (server->arena_size > 0)
+    {
+        arena = vws_arena_new(server->arena_size);
+    }
+
+    bool steal = svr_stealing(server);
+
+    // Requests taken off the queue together
+    size_t size          = (steal || server->batch == 0) ? 1 : server->batch;
+    vws_svr_data** batch = vws.malloc(sizeof(vws_svr_data*) * size);
+
+    while (true)
+    {
+        //> Wait for arrival
+
+        vws_svr_data* request = NULL;
+
+        if (steal == true)
+        {
+            // Our own queue first. Failing that, a connection waiting behind
+            // a busy worker.
+            request = queue_try_pop(&worker->requests);
+
+            if (request == NULL)
+            {
+                request = svr_worker_steal(worker);
+            }
+        }
+
+        if (request == NULL)
+        {
+            // This will put the thread to sleep on a condition variable until
+            // something arrives in queue.
+            __atomic_store_n(&worker->busy, false, __ATOMIC_RELEASE);
+            request = queue_pop(&worker->requests);
+            __atomic_store_n(&worker->busy, true, __ATOMIC_RELEASE);
+        }
+
+        // If there's no request (null request), check the server's state
+        if (request == NULL)
+        {
+            // If server is in halting state, return
+            if (server->state == VS_HALTING)
+            {
+                if (vws.tracelevel >= VT_THREAD)
+                {
+                    vws.trace(VL_INFO, "worker_thread(): Exiting");
+                }
+
+                vws_arena_free(arena);
+                vws.free(batch);
+
+                return;
+            }
+            else
+            {
+                // If not halting, skip to the next iteration of the loop
+                continue;
+            }
+        }
+
+        // Whatever else is waiting, up to the batch size
+        batch[0] = request;
+        size_t n = 1;
+
+        if (size > 1)
+        {
+            n += queue_pop_batch(&worker->requests, batch + 1, size - 1);
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (vws_is_flag(&batch[i]->flags, VM_SVR_DATA_RUN))
+            {
+                worker_run(worker, batch[i], arena);
+            }
+            else
+            {
+                worker_handle(worker, batch[i], arena);
+            }
+        }
+
+        // Hand over messages collected for process_batch()
+        svr_msg_batch_flush();
+
+        if (arena != NULL)
+        {
+            vws_arena_reset(arena);
+        }
+    }
+}
+
+void worker_handle( vws_svr_worker* worker,
+                    vws_svr_data* request,
+                    vws_arena* arena )
+{
+    vws_tcp_svr* server      = worker->server;
+    vws_svr_metrics* metrics = worker->metrics;
+
+    if (vws_is_flag(&request->flags, VM_SVR_DATA_RELEASE))
+    {
+        // Everything queued before it for this connection is done. Send it
+        // back so the connection is released behind any responses.
+        svr_msg_batch_flush();
+        vws_tcp_svr_send(server, request);
+        return;
+    }
+
+    if (vws_is_flag(&request->flags, VM_SVR_DATA_HANDOFF))
+    {
+        // Likewise, the connection can be handed off behind its responses
+        svr_msg_batch_flush();
+        vws_tcp_svr_send(server, request);
+        return;
+    }
+
+    uint64_t now = uv_hrtime();
+    svr_count(&metrics->requests, 1);
+    svr_histogram_record(&metrics->requests_wait, now - request->queued);
+
+    if (request->timing != NULL)
+    {
+        // Passed on to the response
+        request->timing->dequeued = now;
+        svr_timing_current        = request->timing;
+        request->timing           = NULL;
+    }
+
+    // The request is usually gone by the end. Only its address is used.
+    vws_svr_cnx* cnx   = request->cnx;
+    svr_request_queued = request->queued;
+    VWS_PROBE1(work_begin, request);
+    vws.arena = arena;
+    server->on_data_in(request);
+    vws.arena = NULL;
+    VWS_PROBE1(work_end, request);
+    svr_request_queued = 0;
+
+    if (server->pool.min < server->pool_size)
+    {
+        // The last this worker touches the connection for the request.
+        // Once nothing is pending the loop may move it to another worker, so
+        // nothing of it may be left in the batch.
+        svr_msg_batch_flush();
+        __atomic_sub_fetch(&cnx->pending, 1, __ATOMIC_RELEASE);
+    }
+
+    if (svr_timing_current != NULL)
+    {
+        // The handler sent nothing
+        svr_timing_current->handled = uv_hrtime();
+        svr_sample_end(server, svr_timing_current);
+        svr_timing_current = NULL;
+    }
+
+    svr_histogram_record(&metrics->processing, uv_hrtime() - now);
+}
+
+void worker_run(vws_svr_worker* worker, vws_svr_data* turn, vws_arena* arena)
+{
+    vws_svr_cnx* cnx = turn->cnx;
+
+    // Its next turn comes here, unless this worker is busy by then
+    __atomic_store_n(&cnx->worker, worker, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        for (int n = 0; n < VWS_SVR_RUN_BATCH; n++)
+        {
+            svr_spin_lock(&cnx->run_lock);
+            bool empty = (sc_queue_size(&cnx->run) == 0);
+
+            if (empty == true && svr_msg_batch_current.count > 0)
+            {
+                // Hand over its messages while the connection is still ours,
+                // then look again
+                svr_spin_unlock(&cnx->run_lock);
+                svr_msg_batch_flush();
+
+                continue;
+            }
+
+            if (empty == true)
+            {
+                // Done. The next request starts a new turn.
+                cnx->scheduled = false;
+                svr_spin_unlock(&cnx->run_lock);
+                vws_svr_data_free(turn);
+
+                return;
+            }
+
+            vws_svr_data* request = sc_queue_del_last(&cnx->run);
+
+            // Nothing is queued behind a release or handoff, and the loop may
+            // free the connection once it has it. Let go of it first.
+            bool last = vws_is_flag(&request->flags, VM_SVR_DATA_RELEASE) ||
+                        vws_is_flag(&request->flags, VM_SVR_DATA_HANDOFF);
+
+            if (last == true)
+            {
+                cnx->scheduled = false;
+            }
+
+            svr_spin_unlock(&cnx->run_lock);
+
+            if (last == true)
+            {
+                vws_svr_data_free(turn);
+                worker_handle(worker, request, arena);
+
+                return;
+            }
+
+            worker_handle(worker, request, arena);
+        }
+
+        // Give the other connections a turn. This one goes to the back, unless
+        // the queue is full, in which case it carries on. Another worker may
+        // take it from there, so its messages have to be handed over first.
+        svr_msg_batch_flush();
+
+        if (queue_try_push(&worker->requests, turn) == true)
+        {
+            return;
+        }
+    }
+}
+
+void loop_thread(void* arg)
+{
+    vws_svr_loop* loop = (vws_svr_loop*)arg;
+
+    // Set thread tracing level to server.
+    vws.tracelevel = loop->server->trace;
+
+    if (vws.tracelevel >= VT_THREAD)
+    {
+        vws.trace(VL_INFO, "loop_thread(): Starting");
+    }
+
+    svr_loop_pin(loop);
+    svr_loop_reserve(loop);
+
+    svr_metrics_bind(loop->server, loop->metrics);
+
+    uv_run(loop->loop, UV_RUN_DEFAULT);
+
+    // Close the listening socket handle, unless it went with a handoff. The
+    // close completes when the loop is run down in the server destructor.
+    if (loop->listener != NULL)
+    {
+        uv_close((uv_handle_t*)loop->listener, svr_on_handle_close);
+    }
+
+    if (vws.tracelevel >= VT_THREAD)
+    {
+        vws.trace(VL_INFO, "loop_thread(): Exiting");
+    }
+}
+
+void uv_thread(uv_async_t* handle)
+{
+    vws_svr_loop* loop  = (vws_svr_loop*)handle->data;
+    vws_tcp_svr* server = loop->server;
+
+    if (server->state == VS_HALTING)
+    {
+        if (vws.tracelevel >= VT_THREAD)
+        {
+            vws.trace(VL_INFO, "uv_thread(): stop");
+        }
+
+        // The first loop owns the workers. Worker threads must all exit before
+        // we can shutdown libuv as they must release their mutexes and
+        // condition variables first, otherwise uv_stop() will not actually stop
+        // the loop.
+        if (loop == &server->loops[0])
+        {
+            for (int i = 0; i < server->pool.started; i++)
+            {
+                uv_thread_join(&server->workers[i].thread);
+            }
+
+            if (server->pool.timer != NULL)
+            {
+                uv_close((uv_handle_t*)server->pool.timer, svr_on_handle_close);
+                server->pool.timer = NULL;
+            }
+        }
+
+        // Don't leave a handoff waiting on the loop
+        if (loop->handoff != NULL)
+        {
+            svr_handoff_end(loop);
+        }
+
+        // Stop the loop. This will cause uv_run() to return in
+        // vws_tcp_svr_run() (or loop_thread()).
+        uv_stop(loop->loop);
+
+        return;
+    }
+
+    if (loop->handed_off == false && loop->handoff == NULL)
+    {
+        if (__atomic_load_n(&server->handoff, __ATOMIC_ACQUIRE) != NULL)
+        {
+            svr_handoff_begin(loop);
+        }
+    }
+
+    // Unless on_data_out has been overridden, gather every response for a
+    // connection into one vectored write per wakeup. The map lives with the
+    // loop so its memory is reused from one wakeup to the next.
+    bool batching = (server->on_data_out == svr_client_data_out);
+
+    struct sc_map_64v* batches = &loop->batches;
+
+    vws_svr_data* data;
+
+    while (true)
+    {
+        if ((data = uv_thread_next(loop)) == NULL)
+        {
+            // Empty. From here on workers wake us again. One may have queued
+            // after we looked while the flag was still set, so look again.
+            __atomic_store_n(&loop->signaled, false, __ATOMIC_SEQ_CST);
+
+            if ((data = uv_thread_next(loop)) == NULL)
+            {
+                break;
+            }
+
+            __atomic_store_n(&loop->signaled, true, __ATOMIC_SEQ_CST);
+        }
+
+        if (loop->responses.state != VS_RUNNING)
+        {
+            // Nothing more goes out. What was taken off the queue goes the
+            // way of what is still in it.
+            queue_drop(data);
+            break;
+        }
+
+        uv_thread_dispatch(loop, data, batching);
+    }
+
+    uint64_t key; svr_write_batch* batch;
+    sc_map_foreach(batches, key, batch)
+    {
+        svr_batch_send(batch);
+    }
+
+    sc_map_clear_64v(batches);
+}
+
+vws_svr_data* uv_thread_next(vws_svr_loop* loop)
+{
+    vws_svr_data* data = queue_try_pop(&loop->priority);
+
+    if (data == NULL)
+    {
+        data = queue_try_pop(&loop->responses);
+    }
+
+    return data;
+}
+
+void uv_thread_dispatch( vws_svr_loop* loop,
+                         vws_svr_data* data,
+                         bool batching )
+{
+    vws_tcp_svr* server        = loop->server;
+    struct sc_map_64v* batches = &loop->batches;
+
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_RELEASE))
+    {
+        // Priority responses sent before the release may have gone into their
+        // queue after we last looked. They must be handled while the
+        // connection still exists.
+        vws_svr_data* p;
+        while ((p = queue_try_pop(&loop->priority)) != NULL)
+        {
+            uv_thread_dispatch(loop, p, batching);
+        }
+
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace(VL_INFO, "uv_thread(): release %p", data->cnx);
+        }
+
+        server->on_disconnect(data->cnx);
+        svr_topic_remove_all(data->cnx);
+        svr_cnx_free(data->cnx);
+        vws_svr_data_free(data);
+
+        return;
+    }
+
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_HANDOFF))
+    {
+        // As with a release, priority responses sent before it come first
+        vws_svr_data* p;
+        while ((p = queue_try_pop(&loop->priority)) != NULL)
+        {
+            uv_thread_dispatch(loop, p, batching);
+        }
+
+        vws_svr_cnx* cnx = data->cnx;
+
+        if (cnx->handle != NULL && cnx->handoff == 1)
+        {
+            // Write out the responses gathered for it. The handoff timer
+            // takes it from here once they have gone.
+            svr_write_batch* batch;
+            batch = sc_map_get_64v(batches, (uint64_t)cnx);
+
+            if (sc_map_found(batches) == true)
+            {
+                sc_map_del_64v(batches, (uint64_t)cnx);
+                svr_batch_send(batch);
+            }
+
+            cnx->handoff = 2;
+        }
+
+        vws_svr_data_free(data);
+
+        return;
+    }
+
+    uint64_t now = uv_hrtime();
+    svr_count(&loop->metrics->responses, 1);
+    svr_histogram_record(&loop->metrics->responses_wait, now - data->queued);
+
+    if (data->timing != NULL)
+    {
+        data->timing->dispatched = now;
+    }
+
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_PUBLISH))
+    {
+        svr_topic_publish(loop, data, batching);
+        return;
+    }
+
+    if (data->cnx == NULL)
+    {
+        // Sent by ID. Only this loop gives up the slots of its connections, so
+        // if the ID still matches here the connection is alive.
+        vws_svr_slot* slot = svr_slot_get(server, data->id);
+
+        if (slot == NULL)
+        {
+            vws_svr_data_free(data);
+            return;
+        }
+
+        data->cnx = slot->cnx;
+    }
+
+    if (data->cnx->handle == NULL)
+    {
+        // The socket has already closed. Drop it.
+        vws_svr_data_free(data);
+        return;
+    }
+
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_UNFRAMED))
+    {
+        // Only the loop knows for sure how the connection is carried now
+        vws_clear_flag(&data->flags, VM_SVR_DATA_UNFRAMED);
+
+        if (data->cnx->shm != NULL)
+        {
+            vws_set_flag(&data->flags, VM_SVR_DATA_SHM);
+        }
+        else
+        {
+            data->header_size = vws_frame_header( data->header,
+                                                  1,
+                                                  BINARY_FRAME,
+                                                  data->size );
+
+            vws_set_flag(&data->flags, VM_SVR_DATA_MESSAGE);
+        }
+    }
+
+    #if defined(VWS_SHM)
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_SHM))
+    {
+        svr_shm_out(data->cnx, data);
+        return;
+    }
+    #endif
+
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_CLOSE))
+    {
+        // Write out anything that came before the close
+        svr_write_batch* batch;
+        batch = sc_map_get_64v(batches, (uint64_t)data->cnx);
+
+        if (sc_map_found(batches) == true)
+        {
+            sc_map_del_64v(batches, (uint64_t)data->cnx);
+            svr_batch_send(batch);
+        }
+
+        // Close connection
+        uv_handle_t* handle = (uv_handle_t*)data->cnx->handle;
+
+        if (uv_is_closing(handle) == 0)
+        {
+            if (data->cnx->ssl != NULL)
+            {
+                SSL_shutdown(data->cnx->ssl);
+                svr_tls_flush(data->cnx);
+            }
+
+            uv_close(handle, svr_on_close);
+        }
+
+        vws_svr_data_free(data);
+    }
+    else if (vws_is_flag(&data->flags, VM_SVR_DATA_SUBSCRIBE))
+    {
+        svr_topic_add(data->cnx, data->data);
+        vws_svr_data_free(data);
+    }
+    else if (vws_is_flag(&data->flags, VM_SVR_DATA_UNSUBSCRIBE))
+    {
+        svr_topic_remove(data->cnx, data->data);
+        vws_svr_data_free(data);
+    }
+    else if (batching == true)
+    {
+        if (svr_cnx_hold(data) == false)
+        {
+            svr_batch_add(batches, data);
+        }
+    }
+    else
+    {
+        server->on_data_out(data);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Server API
+//------------------------------------------------------------------------------
+
+vws_svr_data* vws_svr_data_new(vws_svr_cnx* c, vws_buffer* buffer)
+{
+    // The data is freed as it is, so it has to be the start of the allocation
+    vws_buffer_rewind(buffer);
+
+    vws_svr_data* item = vws_svr_data_own(c, buffer->data, buffer->size);
+
+    // We take ownership of buffer data so we clear the buffer.
+    buffer->data      = NULL;
+    buffer->size      = 0;
+    buffer->allocated = 0;
+
+    return item;
+}
+
+vws_svr_data* vws_svr_data_own(vws_svr_cnx* c, ucstr data, size_t size)
+{
+    vws_svr_data* item;
+    item = (vws_svr_data*)vws_pool_get(VP_SVR_DATA, sizeof(vws_svr_data));
+
+    item->cnx         = c;
+    item->size        = size;
+    item->data        = data;
+    item->flags       = 0;
+    item->header_size = 0;
+    item->shared      = NULL;
+    item->id          = 0;
+    item->timing      = NULL;
+
+    if (svr_timing_current != NULL)
+    {
+        // The first item a worker's handler creates is its response
+        item->timing       = svr_timing_current;
+        svr_timing_current = NULL;
+    }
+
+    return item;
+}
+
+vws_svr_data* vws_svr_data_share( vws_svr_cnx* c,
+                                  vws_svr_buffer* b,
+                                  size_t offset,
+                                  size_t size )
+{
+    vws_svr_data* item = vws_svr_data_own(c, b->data + offset, size);
+    item->flags        = VM_SVR_DATA_BORROWED;
+    item->shared       = vws_svr_buffer_ref(b);
+
+    return item;
+}
+
+vws_svr_buffer* vws_svr_buffer_new(size_t size)
+{
+    // The data follows the header in the same block
+    vws_svr_buffer* b = vws.malloc(sizeof(vws_svr_buffer) + size);
+    b->refs           = 1;
+    b->data           = (ucstr)(b + 1);
+    b->size           = size;
+    b->on_free        = NULL;
+    b->arg            = NULL;
+
+    return b;
+}
+
+vws_svr_buffer* vws_svr_buffer_wrap( ucstr data,
+                                     size_t size,
+                                     vws_svr_buffer_free on_free,
+                                     void* arg )
+{
+    vws_svr_buffer* b = vws.malloc(sizeof(vws_svr_buffer));
+    b->refs           = 1;
+    b->data           = data;
+    b->size           = size;
+    b->on_free        = on_free;
+    b->arg            = arg;
+
+    return b;
+}
+
+vws_svr_buffer* vws_svr_buffer_ref(vws_svr_buffer* b)
+{
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+void vws_svr_buffer_release(vws_svr_buffer* b)
+{
+    // Acquire-release so that whoever frees it sees every use of the data
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    if (b->on_free != NULL)
+    {
+        b->on_free(b->data, b->arg);
+    }
+
+    vws.free(b);
+}
+
+void vws_svr_data_free(vws_svr_data* t)
+{
+    if (t != NULL)
+    {
+        if (vws_is_flag(&t->flags, VM_SVR_DATA_BORROWED) == false)
+        {
+            vws.free(t->data);
+        }
+
+        if (t->shared != NULL)
+        {
+            vws_svr_buffer_release(t->shared);
+        }
+
+        vws.free(t->timing);
+        vws_pool_put(VP_SVR_DATA, t);
+    }
+}
+
+vws_tcp_svr* vws_tcp_svr_new(int num_threads, int backlog, int queue_size)
+{
+    vws_tcp_svr* server = vws.malloc(sizeof(vws_tcp_svr));
+    return tcp_svr_ctor(server, num_threads, backlog, queue_size);
+}
+
+uint8_t vws_tcp_svr_state(vws_tcp_svr* server)
+{
+    return server->state;
+}
+
+void vws_tcp_svr_free(vws_tcp_svr* server)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+
+    tcp_svr_dtor(server);
+    vws.free(server);
+}
+
+int vws_tcp_svr_send(vws_tcp_svr* server, vws_svr_data* data)
+{
+    // Responses go to the loop that owns the connection's socket
+    svr_loop_push(data->cnx->loop, data);
+
+    return 0;
+}
+
+int vws_tcp_svr_send_to(vws_tcp_svr* server, uint64_t id, vws_svr_data* data)
+{
+    vws_svr_slot* slot = svr_slot_get(server, id);
+
+    if (slot != NULL)
+    {
+        // The loop is only good if the generation held while we read it
+        uint32_t loop = __atomic_load_n(&slot->loop, __ATOMIC_ACQUIRE);
+
+        if (svr_slot_get(server, id) != NULL)
+        {
+            data->cnx = NULL;
+            data->id  = id;
+            svr_loop_push(&server->loops[loop], data);
+
+            return 0;
+        }
+    }
+
+    vws_svr_data_free(data);
+
+    return -1;
+}
+
+int vws_tcp_svr_set_loops(vws_tcp_svr* server, int n)
+{
+    if (server->state != VS_HALTED)
+    {
+        vws.error(VE_RT, "Cannot change loops while server is running");
+        return -1;
+    }
+
+    if (n < 1)
+    {
+        n = 1;
+    }
+
+    int queue_size = (int)server->loops[0].responses.capacity;
+
+    // Loops hold mutexes and are pointed to by their handles, so rather than
+    // move them we rebuild the set.
+    for (int i = 0; i < server->loop_count; i++)
+    {
+        svr_loop_destroy(&server->loops[i]);
+        queue_destroy(&server->loops[i].responses);
+        queue_destroy(&server->loops[i].priority);
+    }
+
+    vws.free(server->loops);
+    server->loops = vws.malloc(sizeof(vws_svr_loop) * n);
+
+    for (int i = 0; i < n; i++)
+    {
+        svr_loop_init(server, &server->loops[i], queue_size);
+    }
+
+    server->loop_count = n;
+
+    return 0;
+}
+
+int vws_tcp_svr_set_pool(vws_tcp_svr* server, int min, int max)
+{
+    if (server->state != VS_HALTED)
+    {
+        vws.error(VE_RT, "Cannot change the pool while server is running");
+        return -1;
+    }
+
+    if (min < 1)
+    {
+        min = 1;
+    }
+
+    if (max < min)
+    {
+        max = min;
+    }
+
+    int queue_size = (int)server->workers[0].requests.capacity;
+
+    svr_workers_destroy(server);
+    svr_workers_init(server, max, queue_size);
+    server->pool.min = min;
+
+    return 0;
+}
+
+int vws_tcp_svr_set_affinity( vws_tcp_svr* server,
+                              vws_svr_affinity_t mode,
+                              cstr cpus )
+{
+    if (server->state != VS_HALTED)
+    {
+        vws.error(VE_RT, "Cannot change affinity while server is running");
+        return -1;
+    }
+
+    if (mode == VWS_SVR_AFFINITY_NONE)
+    {
+        vws.free(server->cpus);
+        server->cpus      = NULL;
+        server->cpu_count = 0;
+        server->affinity  = mode;
+
+        return 0;
+    }
+
+#if defined(__linux__)
+
+    int* list = NULL;
+    int count = 0;
+
+    if (cpus != NULL)
+    {
+        count = svr_cpus_parse(cpus, &list);
+    }
+    else
+    {
+        // Every CPU the process may run on
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            list = vws.malloc(sizeof(int) * CPU_COUNT(&set));
+
+            for (int i = 0; i < CPU_SETSIZE; i++)
+            {
+                if (CPU_ISSET(i, &set))
+                {
+                    list[count++] = i;
+                }
+            }
+        }
+    }
+
+    if (count <= 0)
+    {
+        vws.free(list);
+        vws.error(VE_RT, "Invalid CPU list");
+        return -1;
+    }
+
+    vws.free(server->cpus);
+    server->cpus      = list;
+    server->cpu_count = count;
+    server->affinity  = mode;
+
+    return 0;
+
+#else
+
+    vws.error(VE_RT, "Thread affinity is not supported on this platform");
+    return -1;
+
+#endif
+}
+
+int vws_tcp_svr_tls(vws_tcp_svr* server, cstr cert, cstr key)
+{
+    if (server->state != VS_HALTED)
+    {
+        vws.error(VE_RT, "Cannot enable TLS while server is running");
+        return -1;
+    }
+
+    if (vws_socket_ssl_init() == false)
+    {
+        // Error already set
+        return -1;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(vws_ssl_ctx, cert) != 1)
+    {
+        vws.error(VE_SYS, "Failed to load certificate %s", cert);
+        ERR_clear_error();
+        return -1;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(vws_ssl_ctx, key, SSL_FILETYPE_PEM) != 1)
+    {
+        vws.error(VE_SYS, "Failed to load private key %s", key);
+        ERR_clear_error();
+        return -1;
+    }
+
+    if (SSL_CTX_check_private_key(vws_ssl_ctx) != 1)
+    {
+        vws.error(VE_SYS, "Private key does not match certificate");
+        ERR_clear_error();
+        return -1;
+    }
+
+    // Let returning clients skip the full handshake: stateful resumption from
+    // the server cache and stateless resumption via session tickets.
+    // vws_socket_ssl_init() has already turned on the server cache.
+    static const unsigned char sid_ctx[] = "vws_tcp_svr";
+    SSL_CTX_set_session_id_context(vws_ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_clear_options(vws_ssl_ctx, SSL_OP_NO_TICKET);
+
+    // Give the record buffers back while a session has nothing in flight.
+    // Otherwise every idle TLS connection holds tens of kilobytes.
+    SSL_CTX_set_mode(vws_ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    server->ssl_ctx = vws_ssl_ctx;
+
+    return 0;
+}
+
+int vws_tcp_svr_run(vws_tcp_svr* server, cstr host, int port)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_run(%p): Starting worker %i threads",
+                   server,
+                   server->pool.min );
+    }
+
+    // Every inherited socket needs a loop to accept from it
+    if (server->listen_fd_count > server->loop_count)
+    {
+        vws_tcp_svr_set_loops(server, server->listen_fd_count);
+    }
+
+    svr_place(server);
+    svr_pool_start(server);
+
+    //> Create listening sockets
+
+    if (server->listen_fd_count > 0)
+    {
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace( VL_INFO,
+                       "vws_tcp_svr_run(%p): Inherit %i sockets (%i loops)",
+                       server, server->listen_fd_count, server->loop_count );
+        }
+
+        int count = server->listen_fd_count;
+
+        for (int i = 0; i < server->loop_count; i++)
+        {
+            // Loops beyond the sockets share them
+            int fd = server->listen_fds[i % count];
+            fd     = (i < count) ? fd : dup(fd);
+
+            if (svr_loop_inherit(&server->loops[i], fd) != 0)
+            {
+                return -1;
+            }
+        }
+
+        // The listeners own them now
+        vws.free(server->listen_fds);
+        server->listen_fds      = NULL;
+        server->listen_fd_count = 0;
+    }
+    else
+    {
+        struct sockaddr_in addr;
+        uv_ip4_addr(host, port, &addr);
+
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace( VL_INFO,
+                       "vws_tcp_svr_run(%p): Bind %s:%lu (%i loops)",
+                       server, host, port, server->loop_count );
+        }
+
+        for (int i = 0; i < server->loop_count; i++)
+        {
+            if (svr_loop_listen(&server->loops[i], &addr) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_run(%s): Listen %s:%lu",
+                   server, host, port );
+    }
+
+    //> Start server
+
+    // Set state to running
+    server->state = VS_RUNNING;
+
+    //> Adopt connections taken over from another process
+
+    // None of the loops is running yet, so this thread can set up their
+    // handles. The connections are dealt out round-robin.
+    vws_svr_handoff* h = server->handoff;
+
+    if (h != NULL)
+    {
+        for (size_t i = 0; i < h->adoptee_count; i++)
+        {
+            vws_svr_loop* l = &server->loops[i % server->loop_count];
+            svr_adopt(l, &h->adoptees[i]);
+        }
+
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace( VL_INFO,
+                       "vws_tcp_svr_run(%p): Adopted %lu connections",
+                       server, h->adoptee_count );
+        }
+
+        server->handoff = NULL;
+        svr_handoff_free(h);
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_run(%s): Starting uv_run()", server);
+    }
+
+    // Additional loops each get their own thread
+    for (int i = 1; i < server->loop_count; i++)
+    {
+        vws_svr_loop* l = &server->loops[i];
+        uv_thread_create(&l->thread, loop_thread, l);
+    }
+
+    // Run UV loop. This runs indefinitely, passing network I/O and and out of
+    // system until server is shutdown by vws_tcp_svr_stop() (by external
+    // thread).
+    svr_loop_pin(&server->loops[0]);
+    svr_loop_reserve(&server->loops[0]);
+    svr_metrics_bind(server, server->loops[0].metrics);
+    uv_run(server->loops[0].loop, UV_RUN_DEFAULT);
+
+    //> Shutdown server
+
+    for (int i = 1; i < server->loop_count; i++)
+    {
+        uv_thread_join(&server->loops[i].thread);
+    }
+
+    // Close the listening socket handle, unless it went with a handoff
+    if (server->loops[0].listener != NULL)
+    {
+        uv_close((uv_handle_t*)server->loops[0].listener, svr_on_handle_close);
+    }
+
+    svr_shutdown(server);
+    svr_metrics_bind(NULL, NULL);
+
+    // Give back pooled objects cached by this thread, which may now exit
+    vws_pool_flush();
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_run(%p): Shutdown complete", server);
+    }
+
+    // Set state to halted
+    server->state = VS_HALTED;
+
+    return 0;
+}
+
+void vws_tcp_svr_stop(vws_tcp_svr* server)
+{
+    // Set shutdown flags
+    server->state = VS_HALTING;
+
+    for (int i = 0; i < server->loop_count; i++)
+    {
+        queue_halt(&server->loops[i].responses);
+        queue_halt(&server->loops[i].priority);
+    }
+
+    // Wakeup all worker threads
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop worker threads");
+    }
+
+    svr_stop_workers(server);
+
+    // Wakeup the main event loop to shutdown main thread
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop network threads");
+    }
+
+    for (int i = 0; i < server->loop_count; i++)
+    {
+        uv_async_send(server->loops[i].wakeup);
+    }
+
+    while (server->state != VS_HALTED)
+    {
+        sleep(1);
+    }
+}
+
+int vws_tcp_svr_inetd_run(vws_tcp_svr* server, int sockfd)
+{
+    if (sockfd < 0)
+    {
+        vws.error(VE_RT, "Invalid server or socket descriptor provided");
+        return 1;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_run(%p): Starting worker %i threads",
+                   server,
+                   server->pool_size );
+    }
+
+    // A single connection has no use for an adaptive pool
+    server->pool.min = server->pool_size;
+
+    svr_place(server);
+    svr_pool_start(server);
+
+    // Go into non-blocking mode as we are using poll() for socket_read() and
+    // socket_write().
+    if (vws_socket_set_nonblocking(sockfd) == false)
+    {
+        vws.error(VE_RT, "Failed to set socket to nonblocking");
+        return 1;
+    }
+
+    // Set to inetd mode. There is only one socket, so only the first loop is
+    // used.
+    server->inetd_mode = 1;
+    vws_svr_loop* loop = &server->loops[0];
+
+    // Initialize and adopt the existing socket descriptor.
+    uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+
+    if (uv_tcp_init(loop->loop, c))
+    {
+        // Handle uv_tcp_init failure.
+        vws.error(VE_RT, "Failed to initialize new TCP handle");
+        vws.free(c);
+        return 1;
+    }
+
+    if (uv_tcp_open(c, sockfd))
+    {
+        // Handle uv_tcp_open failure.
+        vws.error(VE_RT, "Failed to adopt the socket descriptor.");
+        vws.free(c);
+        return 1;
+    }
+
+    //> Add connection to registry and initialize
+
+    // The connection rides on the handle, so callbacks need no lookup
+    vws_svr_cnx* cnx = svr_cnx_new(loop, (uv_stream_t*)c);
+    c->data          = cnx;
+
+    if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
+    {
+        vws.error(VE_RT, "Failed to start reading from client");
+        svr_cnx_free(cnx);
+        vws.free(c);
+        return 1;
+    }
+
+    if (svr_cnx_map_set(&loop->cnxs, (uv_stream_t*)c, cnx) == false)
+    {
+        vws.error(VE_FATAL, "Connection already registered");
+    }
+
+    //> Call svr_on_connect() handler
+
+    svr_timer_add(cnx);
+    server->on_connect(cnx);
+
+    svr_timer_start(loop);
+
+    // Now, the handle is associated with the socket and is ready to be used.
+    // Start the libuv loop.
+    svr_loop_pin(loop);
+    svr_metrics_bind(server, loop->metrics);
+    uv_run(loop->loop, UV_RUN_DEFAULT);
+    svr_metrics_bind(NULL, NULL);
+
+    return 0;
+}
+
+void vws_tcp_svr_inetd_stop(vws_tcp_svr* server)
+{
+    vws_svr_loop* loop = &server->loops[0];
+
+    // Set shutdown flags
+    server->state = VS_HALTING;
+    queue_halt(&loop->responses);
+    queue_halt(&loop->priority);
+
+    // Stop the loop. We have not more I/O to deal with. We don't want the loop
+    // to run any more for any reason.
+    uv_stop(loop->loop);
+
+    // Wakeup all worker threads
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop worker threads");
+    }
+
+    svr_stop_workers(server);
+
+    // Wakeup the main event loop to shutdown main thread
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop main thread");
+    }
+
+    // Wait for all threads to complete
+    uv_thread(loop->wakeup);
+    svr_shutdown(server);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): done");
+    }
+
+    // Set state to halted
+    server->state = VS_HALTED;
+}
+
+//------------------------------------------------------------------------------
+// Handoff between processes
+//------------------------------------------------------------------------------
+
+int vws_tcp_svr_inherit(vws_tcp_svr* server, int fd)
+{
+    if (server->state != VS_HALTED)
+    {
+        vws.error(VE_RT, "Cannot inherit sockets while server is running");
+        return -1;
+    }
+
+    int listening  = 0;
+    socklen_t size = sizeof(listening);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) != 0
+        || listening == 0)
+    {
+        vws.error(VE_RT, "Descriptor %i is not a listening socket", fd);
+        return -1;
+    }
+
+    size_t n           = sizeof(int) * (server->listen_fd_count + 1);
+    server->listen_fds = vws.realloc(server->listen_fds, n);
+    server->listen_fds[server->listen_fd_count++] = fd;
+
+    return 0;
+}
+
+int vws_tcp_svr_listen_unix(vws_tcp_svr* server, cstr path)
+{
+    if (server->state != VS_HALTED)
+    {
+        vws.error(VE_RT, "Cannot listen while server is running");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    size_t n = strlen(path);
+
+    if (n == 0 || n >= sizeof(addr.sun_path))
+    {
+        vws.error(VE_RT, "Invalid Unix socket path: %s", path);
+        return -1;
+    }
+
+    memcpy(addr.sun_path, path, n);
+
+    // An abstract name is the bytes after a leading NUL, with no terminator
+    // and no file to clean up.
+    bool abstract  = (path[0] == '@');
+    socklen_t size = offsetof(struct sockaddr_un, sun_path) + n;
+
+    if (abstract == true)
+    {
+        addr.sun_path[0] = '\0';
+    }
+    else
+    {
+        size++;
+
+        // Remove a socket left behind by an earlier run
+        svr_unlink_socket(path);
+    }
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s < 0)
+    {
+        vws.error(VE_RT, "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if ( bind(s, (struct sockaddr*)&addr, size) != 0 ||
+         listen(s, server->backlog) != 0 )
+    {
+        vws.error(VE_RT, "Failed to listen on %s: %s", path, strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_listen_unix(%p): Listen %s",
+                   server, path );
+    }
+
+    return vws_tcp_svr_inherit(server, s);
+}
+
+int vws_tcp_svr_activate(vws_tcp_svr* server)
+{
+    cstr pid = getenv("LISTEN_PID");
+    cstr fds = getenv("LISTEN_FDS");
+
+    if (pid == NULL || fds == NULL)
+    {
+        return 0;
+    }
+
+    // They may have been meant for a parent process
+    if (strtol(pid, NULL, 10) != (long)getpid())
+    {
+        return 0;
+    }
+
+    int n = atoi(fds);
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    // Passed sockets start after stdin, stdout and stderr
+    for (int i = 0; i < n; i++)
+    {
+        int fd = 3 + i;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        if (vws_tcp_svr_inherit(server, fd) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_activate(%p): %i sockets", server, n);
+    }
+
+    return n;
+}
+
+int vws_tcp_svr_takeover(vws_tcp_svr* server, cstr path, int timeout)
+{
+    if (server->state != VS_HALTED)
+    {
+        vws.error(VE_RT, "Cannot take over while server is running");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        vws.error(VE_RT, "Handoff path too long: %s", path);
+        return -1;
+    }
+
+    memcpy(addr.sun_path, path, strlen(path));
+
+    //> Wait for the old process
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s < 0)
+    {
+        vws.error(VE_RT, "Failed to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+
+    svr_unlink_socket(path);
+
+    // Only this user may connect. No one can before listen(), so there is no
+    // window in which the socket is open to others.
+    if ( bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+         chmod(path, S_IRUSR | S_IWUSR) != 0 ||
+         listen(s, 1) != 0 )
+    {
+        vws.error(VE_RT, "Failed to listen on %s: %s", path, strerror(errno));
+        close(s);
+        svr_unlink_socket(path);
+        return -1;
+    }
+
+    struct pollfd p;
+    p.fd     = s;
+    p.events = POLLIN;
+
+    int rc;
+    while ((rc = poll(&p, 1, timeout)) < 0 && errno == EINTR)
+    {
+        // Interrupted by a signal
+    }
+
+    int peer = (rc == 1) ? accept(s, NULL, NULL) : -1;
+
+    close(s);
+    svr_unlink_socket(path);
+
+    if (peer < 0)
+    {
+        vws.error(VE_RT, "No process to take over from on %s", path);
+        return -1;
+    }
+
+    if (svr_handoff_peer(peer) == false)
+    {
+        vws.error(VE_RT, "Handoff from a process of another user refused");
+        close(peer);
+        return -1;
+    }
+
+    struct timeval tv;
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    //> Receive listeners and connections until it is done
+
+    if (server->handoff == NULL)
+    {
+        server->handoff = svr_handoff_new();
+    }
+
+    vws_svr_handoff* h = server->handoff;
+    size_t start       = h->adoptee_count;
+    bool hello         = false;
+    rc                 = -1;
+
+    while (true)
+    {
+        uint32_t type; unsigned char* data; size_t size; int fd;
+
+        if (svr_handoff_recv(peer, &type, &data, &size, &fd) == false)
+        {
+            vws.error(VE_RT, "Handoff interrupted");
+            break;
+        }
+
+        if (hello == false)
+        {
+            uint32_t version = 0;
+
+            if (type == SVR_HANDOFF_HELLO && size == sizeof(version))
+            {
+                memcpy(&version, data, sizeof(version));
+            }
+
+            vws.free(data);
+
+            if (version != SVR_HANDOFF_VERSION)
+            {
+                vws.error(VE_RT, "Handoff from an incompatible version");
+                break;
+            }
+
+            hello = true;
+            continue;
+        }
+
+        if (type == SVR_HANDOFF_DONE)
+        {
+            vws.free(data);
+            rc = 0;
+            break;
+        }
+
+        struct stat st;
+
+        if ( type == SVR_HANDOFF_CNX && fd >= 0 &&
+             fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode) )
+        {
+            if (h->adoptee_count == h->adoptee_allocated)
+            {
+                h->adoptee_allocated = h->adoptee_allocated * 2 + 16;
+                size_t n    = sizeof(svr_adoptee) * h->adoptee_allocated;
+                h->adoptees = vws.realloc(h->adoptees, n);
+            }
+
+            svr_adoptee* a = &h->adoptees[h->adoptee_count++];
+            a->fd          = fd;
+            a->data        = data;
+            a->size        = size;
+
+            continue;
+        }
+
+        vws.free(data);
+
+        if (type == SVR_HANDOFF_LISTENER && fd >= 0)
+        {
+            if (vws_tcp_svr_inherit(server, fd) == 0)
+            {
+                continue;
+            }
+        }
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    close(peer);
+
+    int received = (int)(h->adoptee_count - start);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_takeover(%p): %i sockets, %i connections",
+                   server, server->listen_fd_count, received );
+    }
+
+    return (rc == 0) ? received : -1;
+}
+
+int vws_tcp_svr_handoff(vws_tcp_svr* server, cstr path, int timeout)
+{
+    if (server->state != VS_RUNNING || server->inetd_mode == 1)
+    {
+        vws.error(VE_RT, "Server is not running");
+        return -1;
+    }
+
+    if (server->handoff != NULL || server->loops[0].handed_off == true)
+    {
+        vws.error(VE_RT, "Server has already handed off");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        vws.error(VE_RT, "Handoff path too long: %s", path);
+        return -1;
+    }
+
+    memcpy(addr.sun_path, path, strlen(path));
+
+    //> Connect to the new process
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s < 0 || connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        vws.error(VE_RT, "Failed to connect to %s: %s", path, strerror(errno));
+
+        if (s >= 0)
+        {
+            close(s);
+        }
+
+        return -1;
+    }
+
+    // The sockets go to another instance of this server, not whoever got the
+    // path first
+    if (svr_handoff_peer(s) == false)
+    {
+        vws.error(VE_RT, "Handoff to a process of another user refused");
+        close(s);
+        return -1;
+    }
+
+    // The loops send on it. One that stops reading must not hold them up.
+    struct timeval tv;
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    //> Pass the listening sockets
+
+    uint32_t version = SVR_HANDOFF_VERSION;
+    bool ok          = svr_handoff_send( s,
+                                         SVR_HANDOFF_HELLO,
+                                         (ucstr)&version,
+                                         sizeof(version),
+                                         -1 );
+
+    for (int i = 0; ok == true && i < server->loop_count; i++)
+    {
+        uv_os_fd_t fd;
+        uv_handle_t* listener = (uv_handle_t*)server->loops[i].listener;
+
+        ok = (uv_fileno(listener, &fd) == 0)
+          && svr_handoff_send(s, SVR_HANDOFF_LISTENER, NULL, 0, fd);
+    }
+
+    if (ok == false)
+    {
+        vws.error(VE_RT, "Failed to pass listening sockets: %s", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    //> Hand off the connections
+
+    // Each loop stops accepting and hands off its own connections as they
+    // drain. Wait for them all.
+    vws_svr_handoff* h = svr_handoff_new();
+    h->fd              = s;
+    h->loops           = server->loop_count;
+    h->deadline        = uv_hrtime() + (uint64_t)timeout * 1000000;
+
+    __atomic_store_n(&server->handoff, h, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < server->loop_count; i++)
+    {
+        uv_async_send(server->loops[i].wakeup);
+    }
+
+    uv_mutex_lock(&h->lock);
+
+    while (h->loops > 0)
+    {
+        uv_cond_wait(&h->done, &h->lock);
+    }
+
+    uv_mutex_unlock(&h->lock);
+
+    ok        = (h->failed == false);
+    ok        = ok && svr_handoff_send(s, SVR_HANDOFF_DONE, NULL, 0, -1);
+    int count = h->count;
+
+    __atomic_store_n(&server->handoff, NULL, __ATOMIC_RELEASE);
+    svr_handoff_free(h);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_handoff(%p): %i connections",
+                   server, count );
+    }
+
+    if (ok == false)
+    {
+        vws.error(VE_RT, "Handoff to %s failed", path);
+        return -1;
+    }
+
+    return count;
+}
+
+vws_svr_handoff* svr_handoff_new()
+{
+    vws_svr_handoff* h = vws.malloc(sizeof(vws_svr_handoff));
+    memset(h, 0, sizeof(vws_svr_handoff));
+    h->fd = -1;
+
+    uv_mutex_init(&h->lock);
+    uv_cond_init(&h->done);
+
+    return h;
+}
+
+void svr_handoff_free(vws_svr_handoff* h)
+{
+    if (h == NULL)
+    {
+        return;
+    }
+
+    if (h->fd >= 0)
+    {
+        close(h->fd);
+    }
+
+    // Connections never adopted
+    for (size_t i = 0; i < h->adoptee_count; i++)
+    {
+        if (h->adoptees[i].fd >= 0)
+        {
+            close(h->adoptees[i].fd);
+        }
+
+        vws.free(h->adoptees[i].data);
+    }
+
+    vws.free(h->adoptees);
+    uv_cond_destroy(&h->done);
+    uv_mutex_destroy(&h->lock);
+    vws.free(h);
+}
+
+bool svr_handoff_send( int sock,
+                       uint32_t type,
+                       ucstr data,
+                       size_t size,
+                       int fd )
+{
+    if (size > UINT32_MAX)
+    {
+        return false;
+    }
+
+    uint32_t head[2] = { type, (uint32_t)size };
+
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len  = sizeof(head);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len  = size;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = (size > 0) ? 2 : 1;
+
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    if (fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control    = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level     = SOL_SOCKET;
+        cmsg->cmsg_type      = SCM_RIGHTS;
+        cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        // The descriptor goes with the first byte only
+        msg.msg_control    = NULL;
+        msg.msg_controllen = 0;
+
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base  = (char*)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len  -= n;
+        }
+    }
+
+    return true;
+}
+
+bool svr_handoff_recv( int sock,
+                       uint32_t* type,
+                       unsigned char** data,
+                       size_t* size,
+                       int* fd )
+{
+    uint32_t head[2];
+    size_t got = 0;
+
+    *data = NULL;
+    *size = 0;
+    *fd   = -1;
+
+    //> Header, with the descriptor if one was passed
+
+    while (got < sizeof(head))
+    {
+        struct iovec iov;
+        iov.iov_base = (char*)head + got;
+        iov.iov_len  = sizeof(head) - got;
+
+        union
+        {
+            struct cmsghdr align;
+            char buffer[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        ssize_t n = recvmsg(sock, &msg, 0);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            if (*fd >= 0)
+            {
+                close(*fd);
+            }
+
+            return false;
+        }
+
+        // A message carries at most one descriptor. Any others are closed.
+        struct cmsghdr* cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+
+            int* fds = (int*)CMSG_DATA(cmsg);
+            size_t k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for (size_t i = 0; i < k; i++)
+            {
+                int passed;
+                memcpy(&passed, fds + i, sizeof(int));
+
+                if (*fd < 0)
+                {
+                    *fd = passed;
+                    fcntl(*fd, F_SETFD, FD_CLOEXEC);
+                }
+                else
+                {
+                    close(passed);
+                }
+            }
+        }
+
+        got += n;
+    }
+
+    *type = head[0];
+    *size = head[1];
+
+    if (*size == 0)
+    {
+        return true;
+    }
+
+    if (*size > SVR_HANDOFF_SIZE_MAX)
+    {
+        *size = 0;
+
+        if (*fd >= 0)
+        {
+            close(*fd);
+        }
+
+        return false;
+    }
+
+    //> Data
+
+    *data = vws.malloc(*size);
+    got   = 0;
+
+    while (got < *size)
+    {
+        ssize_t n = recv(sock, *data + got, *size - got, 0);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            vws.free(*data);
+            *data = NULL;
+
+            if (*fd >= 0)
+            {
+                close(*fd);
+            }
+
+            return false;
+        }
+
+        got += n;
+    }
+
+    return true;
+}
+
+bool svr_handoff_peer(int sock)
+{
+#if defined(__linux__)
+    struct ucred cred;
+    socklen_t n = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &n) != 0)
+    {
+        return false;
+    }
+
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(sock, &uid, &gid) != 0)
+    {
+        return false;
+    }
+
+    return uid == geteuid();
+#endif
+}
+
+void svr_unlink_socket(cstr path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+}
+
+void svr_handoff_begin(vws_svr_loop* loop)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_handoff_begin(%p)", loop);
+    }
+
+    // The new process has the listening socket. Stop accepting from it here.
+    if (loop->listener != NULL)
+    {
+        uv_close((uv_handle_t*)loop->listener, svr_on_handle_close);
+        loop->listener = NULL;
+    }
+
+    uint64_t key; vws_svr_cnx* cnx;
+    sc_map_foreach(&loop->cnxs, key, cnx)
+    {
+        uv_handle_t* handle = (uv_handle_t*)cnx->handle;
+
+        // TLS sessions cannot be carried over. They stay.
+        if (handle == NULL || uv_is_closing(handle) != 0 || cnx->ssl != NULL)
+        {
+            continue;
+        }
+
+        uv_read_stop(cnx->handle);
+        cnx->handoff = 1;
+
+        // When this comes back out of the worker, everything read from the
+        // connection has been processed and its responses are in the queues
+        vws_svr_data* marker = vws_svr_data_own(cnx, NULL, 0);
+        vws_set_flag(&marker->flags, VM_SVR_DATA_HANDOFF);
+        svr_cnx_queue(cnx, marker);
+    }
+
+    loop->handoff       = vws.malloc(sizeof(uv_timer_t));
+    loop->handoff->data = loop;
+    uv_timer_init(loop->loop, loop->handoff);
+    uv_timer_start(loop->handoff, svr_on_handoff_tick, 0, 10);
+}
+
+void svr_on_handoff_tick(uv_timer_t* handle)
+{
+    vws_svr_loop* loop = (vws_svr_loop*)handle->data;
+    vws_svr_handoff* h = loop->server->handoff;
+    bool expired       = (uv_hrtime() >= h->deadline);
+    bool waiting       = false;
+
+    uint64_t key; vws_svr_cnx* cnx;
+    sc_map_foreach(&loop->cnxs, key, cnx)
+    {
+        uv_stream_t* stream = cnx->handle;
+
+        if (cnx->handoff == 0 || stream == NULL)
+        {
+            continue;
+        }
+
+        if (uv_is_closing((uv_handle_t*)stream) != 0)
+        {
+            continue;
+        }
+
+        // Nothing left to process, hold or write
+        bool drained = (cnx->handoff == 2)
+                    && (sc_queue_size(&cnx->outbox) == 0)
+                    && (sc_queue_size(&cnx->priority_outbox) == 0)
+                    && (cnx->open_outbox == NULL)
+                    && (cnx->fragment_pending == false)
+                    && (uv_stream_get_write_queue_size(stream) == 0);
+
+        if (drained == true)
+        {
+            svr_handoff_cnx(cnx);
+        }
+        else if (expired == true)
+        {
+            if (vws.tracelevel >= VT_SERVICE)
+            {
+                vws.trace(VL_INFO, "svr_on_handoff_tick(%p): timeout", stream);
+            }
+
+            uv_close((uv_handle_t*)stream, svr_on_close);
+        }
+        else
+        {
+            waiting = true;
+        }
+    }
+
+    if (waiting == false)
+    {
+        svr_handoff_end(loop);
+    }
+}
+
+void svr_handoff_cnx(vws_svr_cnx* cnx)
+{
+    vws_tcp_svr* server = cnx->server;
+    vws_svr_handoff* h  = server->handoff;
+
+    if (h->failed == true)
+    {
+        svr_handoff_keep(cnx);
+        return;
+    }
+
+    vws_buffer* state = vws_buffer_new();
+
+    if (server->on_handoff(cnx, state) == false)
+    {
+        vws_buffer_free(state);
+        svr_handoff_keep(cnx);
+        return;
+    }
+
+    //> Serialize
+
+    // Whether it has upgraded, its format, its topics and then the state.
+    // Each topic is a length and a NUL-terminated name.
+    vws_buffer* record     = vws_buffer_new();
+    unsigned char flags[2] = { cnx->upgraded, (unsigned char)cnx->format };
+    uint32_t topics        = 0;
+
+    vws_buffer_append(record, flags, sizeof(flags));
+    vws_buffer_append(record, (ucstr)&topics, sizeof(topics));
+
+    if (cnx->subscriptions > 0)
+    {
+        const char* name; vws_svr_topic* topic;
+        sc_map_foreach(&cnx->loop->topics, name, topic)
+        {
+            sc_map_get_64(&topic->index, (uint64_t)cnx);
+
+            if (sc_map_found(&topic->index) == true)
+            {
+                uint32_t size = strlen(name) + 1;
+                vws_buffer_append(record, (ucstr)&size, sizeof(size));
+                vws_buffer_append(record, (ucstr)name, size);
+                topics++;
+            }
+        }
+
+        memcpy(record->data + sizeof(flags), &topics, sizeof(topics));
+    }
+
+    vws_buffer_append(record, state->data, state->size);
+    vws_buffer_free(state);
+
+    if (record->size > SVR_HANDOFF_SIZE_MAX)
+    {
+        // More than the new process accepts
+        vws_buffer_free(record);
+        svr_handoff_keep(cnx);
+        return;
+    }
+
+    //> Send
+
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)cnx->handle, &fd);
+
+    uv_mutex_lock(&h->lock);
+
+    bool sent = svr_handoff_send( h->fd,
+                                  SVR_HANDOFF_CNX,
+                                  record->data,
+                                  record->size,
+                                  fd );
+    int error = errno;
+
+    if (sent == true)
+    {
+        h->count++;
+    }
+    else
+    {
+        h->failed = true;
+    }
+
+    uv_mutex_unlock(&h->lock);
+
+    vws_buffer_free(record);
+
+    if (sent == false)
+    {
+        vws.error(VE_WARN, "Failed to hand off connection: %s", strerror(error));
+        svr_handoff_keep(cnx);
+        return;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_handoff_cnx(%p): sent", cnx->handle);
+    }
+
+    // The new process has its own descriptor for the socket. This only closes
+    // ours, and the connection is released here as usual.
+    uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+}
+
+void svr_handoff_keep(vws_svr_cnx* cnx)
+{
+    cnx->handoff = 0;
+
+    if (cnx->paused == false)
+    {
+        uv_read_start(cnx->handle, svr_on_realloc, svr_on_read);
+    }
+}
+
+void svr_handoff_end(vws_svr_loop* loop)
+{
+    vws_svr_handoff* h = loop->server->handoff;
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_handoff_end(%p)", loop);
+    }
+
+    uv_close((uv_handle_t*)loop->handoff, svr_on_handle_close);
+    loop->handoff    = NULL;
+    loop->handed_off = true;
+
+    // The last this loop touches the handoff
+    uv_mutex_lock(&h->lock);
+    h->loops--;
+    uv_cond_signal(&h->done);
+    uv_mutex_unlock(&h->lock);
+}
+
+bool svr_adopt(vws_svr_loop* loop, svr_adoptee* a)
+{
+    vws_tcp_svr* server = loop->server;
+    uv_stream_t* c      = svr_stream_new(loop, svr_fd_is_local(a->fd), true);
+
+    if (c == NULL)
+    {
+        return false;
+    }
+
+    int rc;
+
+    if (c->type == UV_NAMED_PIPE)
+    {
+        rc = uv_pipe_open((uv_pipe_t*)c, a->fd);
+    }
+    else
+    {
+        rc = uv_tcp_open((uv_tcp_t*)c, a->fd);
+    }
+
+    if (rc != 0)
+    {
+        vws.error(VE_RT, "Failed to adopt connection");
+        uv_close((uv_handle_t*)c, svr_on_handle_close);
+        return false;
+    }
+
+    // The handle owns it now
+    a->fd = -1;
+
+    // This process may tune its sockets differently
+    if (c->type == UV_TCP)
+    {
+        uv_os_fd_t fd;
+        uv_fileno((uv_handle_t*)c, &fd);
+        vws_sockopts_apply(fd, &loop->server->sockopts);
+    }
+
+    //> Add connection to registry and initialize
+
+    vws_svr_cnx* cnx = svr_cnx_new(loop, c);
+    c->data          = cnx;
+
+    if (svr_cnx_map_set(&loop->cnxs, c, cnx) == false)
+    {
+        vws.error(VE_FATAL, "Connection already registered");
+    }
+
+    svr_timer_add(cnx);
+    server->on_connect(cnx);
+
+    //> Restore what svr_handoff_cnx() saved
+
+    ucstr data  = a->data;
+    size_t size = a->size;
+    size_t pos  = 2 + sizeof(uint32_t);
+    bool valid  = (size >= pos);
+
+    if (valid == true)
+    {
+        uint32_t topics;
+        memcpy(&topics, data + 2, sizeof(topics));
+
+        // Each topic takes a length and at least a NUL
+        valid = (data[0] <= 1) && (data[1] <= VM_JSON_FORMAT)
+             && (topics <= (size - pos) / (sizeof(uint32_t) + 1));
+
+        if (valid == true)
+        {
+            cnx->upgraded = data[0];
+            cnx->format   = data[1];
+        }
+
+        for (uint32_t i = 0; valid == true && i < topics; i++)
+        {
+            uint32_t n = 0;
+
+            if (pos + sizeof(n) <= size)
+            {
+                memcpy(&n, data + pos, sizeof(n));
+                pos += sizeof(n);
+            }
+
+            valid = (n > 0) && (n <= size - pos) && (data[pos + n - 1] == 0);
+
+            if (valid == true)
+            {
+                svr_topic_add(cnx, (cstr)data + pos);
+                pos += n;
+            }
+        }
+    }
+
+    if (valid == false)
+    {
+        vws.error(VE_RT, "Invalid handoff record");
+        uv_close((uv_handle_t*)c, svr_on_close);
+    }
+    else
+    {
+        server->on_adopt(cnx, data + pos, size - pos);
+
+        if (uv_is_closing((uv_handle_t*)c) == 0)
+        {
+            uv_read_start(c, svr_on_realloc, svr_on_read);
+        }
+    }
+
+    vws.free(a->data);
+    a->data = NULL;
+
+    return true;
+}
+
+int svr_loop_inherit(vws_svr_loop* loop, int fd)
+{
+    vws_tcp_svr* server = loop->server;
+
+    int rc;
+    uv_stream_t* socket = svr_stream_new(loop, svr_fd_is_local(fd), false);
+
+    if (socket == NULL)
+    {
+        return -1;
+    }
+
+    socket->data   = loop;
+    loop->listener = socket;
+
+    if (socket->type == UV_NAMED_PIPE)
+    {
+        rc = uv_pipe_open((uv_pipe_t*)socket, fd);
+    }
+    else
+    {
+        rc = uv_tcp_open((uv_tcp_t*)socket, fd);
+    }
+
+    if (rc)
+    {
+        vws.error(VE_RT, "Inherit error %s", uv_strerror(rc));
+        return -1;
+    }
+
+    // The socket is listening already. This only starts accepting.
+    rc = uv_listen(socket, server->backlog, svr_on_connect);
+
+    if (rc)
+    {
+        vws.error(VE_RT, "Listen error %s", uv_strerror(rc));
+        return -1;
+    }
+
+    svr_timer_start(loop);
+
+    return 0;
+}
+
+bool svr_fd_is_local(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t size = sizeof(addr);
+
+    if (getsockname(fd, (struct sockaddr*)&addr, &size) != 0)
+    {
+        return false;
+    }
+
+    return addr.ss_family == AF_UNIX;
+}
+
+uv_stream_t* svr_stream_new(vws_svr_loop* loop, bool local, bool client)
+{
+    uv_stream_t* s;
+    int rc;
+
+    if (local == true)
+    {
+        // IPC mode receives descriptors passed by clients rather than dropping
+        // them (see svr_pipe_take()). A listener can't be in IPC mode.
+        #if defined(VWS_SHM)
+        int ipc = client;
+        #else
+        int ipc = 0;
+        #endif
+
+        s  = vws.malloc(sizeof(uv_pipe_t));
+        rc = uv_pipe_init(loop->loop, (uv_pipe_t*)s, ipc);
+    }
+    else
+    {
+        // Client handles come and go with connections, so they are pooled
+        if (client == true)
+        {
+            s = vws_pool_get(VP_SVR_TCP, sizeof(uv_tcp_t));
+        }
+        else
+        {
+            s = vws.malloc(sizeof(uv_tcp_t));
+        }
+
+        rc = uv_tcp_init(loop->loop, (uv_tcp_t*)s);
+    }
+
+    if (rc != 0)
+    {
+        vws.error(VE_RT, "Failed to initialize handle: %s", uv_strerror(rc));
+        vws.free(s);
+        return NULL;
+    }
+
+    s->data = NULL;
+
+    return s;
+}
+
+#if defined(VWS_SHM)
+
+int svr_pipe_take(uv_stream_t* s, int* fds, int max)
+{
+    uv_pipe_t* pipe = (uv_pipe_t*)s;
+    int kept        = 0;
+
+    while (uv_pipe_pending_count(pipe) > 0)
+    {
+        // libuv only gives them up by opening a handle on each. Keep a copy
+        // of the descriptor and let the handle go.
+        uv_pipe_t* h = vws.malloc(sizeof(uv_pipe_t));
+        uv_pipe_init(s->loop, h, 0);
+
+        int fd = -1;
+        uv_os_fd_t handle_fd;
+
+        if (uv_accept(s, (uv_stream_t*)h) == 0
+            && uv_fileno((uv_handle_t*)h, &handle_fd) == 0)
+        {
+            fd = (kept < max) ? fcntl(handle_fd, F_DUPFD_CLOEXEC, 0) : -1;
+        }
+
+        uv_close((uv_handle_t*)h, svr_on_handle_close);
+
+        if (fd >= 0)
+        {
+            fds[kept++] = fd;
+        }
+    }
+
+    return kept;
+}
+
+void svr_shm_on_poll(uv_poll_t* handle, int status, int events)
+{
+    vws_svr_cnx* cnx = (vws_svr_cnx*)handle->data;
+    vws_svr_shm* s   = cnx->shm;
+
+    // Reset the eventfd. Wakeups only say to look at the rings.
+    uint64_t n;
+    while (read(vrtql_shm_fd(s->shm), &n, sizeof(n)) < 0 && errno == EINTR)
+    {
+    }
+
+    // The client may have made room for replies held back
+    svr_shm_flush(cnx);
+
+    if (cnx->handle == NULL || uv_is_closing((uv_handle_t*)cnx->handle) != 0)
+    {
+        return;
+    }
+
+    //> Pass each message to the connection's worker
+
+    do
+    {
+        size_t size;
+        ucstr data;
+
+        while ((data = vrtql_shm_peek(s->shm, &size)) != NULL)
+        {
+            // Copy it out so that the client can reuse the space straight away
+            vws_msg* wsm = vws_msg_new();
+            wsm->opcode  = BINARY_FRAME;
+            vws_buffer_append(wsm->data, data, size);
+            vrtql_shm_pop(s->shm);
+
+            vws_svr_data* block;
+            block = vws_svr_data_own(cnx, (ucstr)wsm, sizeof(vws_msg*));
+            vws_set_flag(&block->flags, VM_SVR_DATA_SHM);
+            svr_sample_start(cnx, block);
+            svr_cnx_queue(cnx, block);
+        }
+    }
+    while (vrtql_shm_idle(s->shm) == false);
+}
+
+void svr_shm_out(vws_svr_cnx* cnx, vws_svr_data* data)
+{
+    vws_svr_shm* s = cnx->shm;
+
+    if (s == NULL)
+    {
+        vws_svr_data_free(data);
+        return;
+    }
+
+    if (svr_shm_flush(cnx) == true)
+    {
+        int rc = vrtql_shm_write(s->shm, (ucstr)data->data, data->size);
+
+        if (rc == 1)
+        {
+            vws_svr_data_free(data);
+            return;
+        }
+
+        if (rc < 0)
+        {
+            vws.error(VE_RT, "Reply larger than half the shared memory ring");
+            vws_svr_data_free(data);
+
+            uv_handle_t* handle = (uv_handle_t*)cnx->handle;
+
+            if (uv_is_closing(handle) == 0)
+            {
+                uv_close(handle, svr_on_close);
+            }
+
+            return;
+        }
+    }
+
+    // The client wakes us once it has made room
+    sc_queue_add_last(&s->backlog, data);
+}
+
+bool svr_shm_flush(vws_svr_cnx* cnx)
+{
+    vws_svr_shm* s = cnx->shm;
+
+    while (sc_queue_size(&s->backlog) > 0)
+    {
+        vws_svr_data* data = sc_queue_peek_first(&s->backlog);
+
+        if (vrtql_shm_write(s->shm, (ucstr)data->data, data->size) != 1)
+        {
+            return false;
+        }
+
+        vws_svr_data_free(sc_queue_del_first(&s->backlog));
+    }
+
+    return true;
+}
+
+void svr_shm_close(vws_svr_cnx* cnx)
+{
+    vws_svr_shm* s = cnx->shm;
+
+    if (s == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&cnx->shm, NULL, __ATOMIC_RELEASE);
+
+    uv_poll_stop(s->poll);
+    s->poll->data = NULL;
+    uv_close((uv_handle_t*)s->poll, svr_on_handle_close);
+
+    vws_svr_data* data;
+    sc_queue_foreach (&s->backlog, data)
+    {
+        vws_svr_data_free(data);
+    }
+
+    sc_queue_term(&s->backlog);
+    vrtql_shm_free(s->shm);
+    vws.free(s);
+}
+
+#endif /* VWS_SHM */
+
+//------------------------------------------------------------------------------
+// Server construction / destruction
+//------------------------------------------------------------------------------
+
+vws_tcp_svr* tcp_svr_ctor(vws_tcp_svr* svr, int nt, int backlog, int queue_size)
+{
+    if (backlog == 0)
+    {
+        // Room for a reconnect storm. The kernel caps it at somaxconn.
+        backlog = 4096;
+    }
+
+    if (queue_size == 0)
+    {
+        queue_size = 1024;
+    }
+
+    if (nt == 0)
+    {
+        nt = 1;
+    }
+
+    svr->next_worker     = 0;
+    svr->on_connect      = svr_client_connect;
+    svr->on_disconnect   = svr_client_disconnect;
+    svr->on_read         = svr_client_read;
+    svr->on_data_in      = svr_client_data_in;
+    svr->on_data_out     = svr_client_data_out;
+    svr->on_backpressure = svr_client_backpressure;
+    svr->on_keepalive    = svr_client_keepalive;
+    svr->keepalive       = 0;
+    svr->idle_timeout    = 0;
+    svr->on_sample       = NULL;
+    svr->sample_rate     = 0;
+    svr->write_high      = 8 * 1024 * 1024;
+    svr->write_low       = 1024 * 1024;
+    svr->try_write       = 16 * 1024;
+    svr->batch           = 16;
+    svr->arena_size      = 0;
+    svr->backlog         = backlog;
+    svr->defer_accept    = 0;
+    svr->fastopen        = 0;
+    svr->cnx_reserve     = 0;
+    svr->steal           = false;
+
+    vws_sockopts_init(&svr->sockopts);
+    svr->loops           = vws.malloc(sizeof(vws_svr_loop));
+    svr->loop_count      = 1;
+    svr->state           = VS_HALTED;
+    svr->trace           = vws.tracelevel;
+    svr->inetd_mode      = 0;
+    svr->ssl_ctx         = NULL;
+    svr->metrics         = svr_metrics_new();
+    svr->affinity        = VWS_SVR_AFFINITY_NONE;
+    svr->cpus            = NULL;
+    svr->cpu_count       = 0;
+    svr->on_handoff      = svr_client_handoff;
+    svr->on_adopt        = svr_client_adopt;
+    svr->listen_fds      = NULL;
+    svr->listen_fd_count = 0;
+    svr->handoff         = NULL;
+
+    memset(&svr->slots, 0, sizeof(vws_svr_slots));
+    uv_mutex_init(&svr->slots.lock);
+
+    svr_loop_init(svr, &svr->loops[0], queue_size);
+    svr_workers_init(svr, nt, queue_size);
+
+    memset(&svr->pool, 0, sizeof(vws_svr_pool));
+    svr->pool.min       = nt;
+    svr->pool.grow_wait = 1000;
+    svr->pool.park_idle = 5000;
+
+    return svr;
+}
+
+void svr_workers_init(vws_tcp_svr* server, int n, int queue_size)
+{
+    server->workers   = vws.malloc(sizeof(vws_svr_worker) * n);
+    server->pool_size = n;
+
+    for (int i = 0; i < n; i++)
+    {
+        vws_svr_worker* w = &server->workers[i];
+        w->server         = server;
+        w->metrics        = svr_metrics_new();
+        w->cpus           = NULL;
+        w->cpu_count      = 0;
+        w->busy           = false;
+        queue_init(&w->requests, queue_size, "requests");
+    }
+}
+
+void svr_workers_destroy(vws_tcp_svr* server)
+{
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        vws_svr_worker* w = &server->workers[i];
+        queue_destroy(&w->requests);
+        vws.free(w->metrics);
+        vws.free(w->cpus);
+    }
+
+    vws.free(server->workers);
+    server->workers   = NULL;
+    server->pool_size = 0;
+}
+
+void svr_pool_start(vws_tcp_svr* server)
+{
+    vws_svr_pool* pool = &server->pool;
+
+    for (int i = 0; i < pool->min; i++)
+    {
+        vws_svr_worker* w = &server->workers[i];
+        uv_thread_create(&w->thread, worker_thread, w);
+    }
+
+    pool->started  = pool->min;
+    pool->active   = pool->min;
+    pool->requests = 0;
+    pool->wait     = 0;
+    pool->idle     = 0;
+
+    if (pool->min < server->pool_size)
+    {
+        pool->timer       = vws.malloc(sizeof(uv_timer_t));
+        pool->timer->data = server;
+        uv_timer_init(server->loops[0].loop, pool->timer);
+
+        uv_timer_start( pool->timer,
+                        svr_on_pool_tick,
+                        VWS_SVR_POOL_TICK,
+                        VWS_SVR_POOL_TICK );
+    }
+}
+
+void svr_on_pool_tick(uv_timer_t* handle)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)handle->data;
+    vws_svr_pool* pool  = &server->pool;
+
+    if (server->state != VS_RUNNING)
+    {
+        return;
+    }
+
+    // Queued now, and taken off the queues since the last check
+    uint64_t depth    = 0;
+    uint64_t requests = 0;
+    uint64_t wait     = 0;
+
+    for (int i = 0; i < pool->started; i++)
+    {
+        vws_svr_histogram* h = &server->workers[i].metrics->requests_wait;
+        depth    += queue_depth(&server->workers[i].requests);
+        requests += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        wait     += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    }
+
+    uint64_t taken = requests - pool->requests;
+    uint64_t mean  = (taken > 0) ? (wait - pool->wait) / taken : 0;
+    uint64_t high  = (uint64_t)pool->grow_wait * 1000;
+    int active     = pool->active;
+
+    pool->requests = requests;
+    pool->wait     = wait;
+
+    if ((depth > (uint64_t)active) || (mean > high))
+    {
+        pool->idle = 0;
+
+        if (active == server->pool_size)
+        {
+            return;
+        }
+
+        if (active == pool->started)
+        {
+            vws_svr_worker* w = &server->workers[active];
+            uv_thread_create(&w->thread, worker_thread, w);
+            pool->started++;
+        }
+
+        // New connections go to it from now on, and connections move to it
+        // from backed up workers
+        __atomic_store_n(&pool->active, active + 1, __ATOMIC_RELEASE);
+
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace( VL_INFO,
+                       "svr_on_pool_tick(): %i workers (depth %llu, %llu ns)",
+                       active + 1,
+                       (unsigned long long)depth,
+                       (unsigned long long)mean );
+        }
+
+        return;
+    }
+
+    // Quiet: nothing queued, and waits well under the threshold
+    if ((depth > 0) || (mean * 4 > high))
+    {
+        pool->idle = 0;
+        return;
+    }
+
+    pool->idle += VWS_SVR_POOL_TICK;
+
+    if ((pool->idle >= pool->park_idle) && (active > pool->min))
+    {
+        // The last active worker takes no new connections, and the ones it
+        // has move off it as they next send something
+        __atomic_store_n(&pool->active, active - 1, __ATOMIC_RELEASE);
+        pool->idle = 0;
+
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace( VL_INFO,
+                       "svr_on_pool_tick(): %i workers",
+                       active - 1 );
+        }
+    }
+}
+
+vws_svr_worker* svr_worker_next(vws_svr_loop* l)
+{
+    vws_tcp_svr* s = l->server;
+    int active     = __atomic_load_n(&s->pool.active, __ATOMIC_ACQUIRE);
+    int nl         = s->loop_count;
+    int index      = (int)(l - s->loops);
+    int own        = (active - index + nl - 1) / nl;
+
+    if (s->affinity == VWS_SVR_AFFINITY_NODE && own > 0)
+    {
+        // Only to the loop's own workers, which share its node: index,
+        // index + nl, index + 2 * nl and so on. Only this loop touches
+        // next_worker.
+        unsigned int n = l->next_worker++;
+        return &s->workers[index + nl * (n % own)];
+    }
+
+    unsigned int n = __atomic_fetch_add(&s->next_worker, 1, __ATOMIC_RELAXED);
+    return &s->workers[n % active];
+}
+
+vws_svr_worker* svr_cnx_worker(vws_svr_cnx* cnx)
+{
+    vws_tcp_svr* s = cnx->server;
+
+    if (s->pool.min == s->pool_size)
+    {
+        // Fixed pool
+        return cnx->worker;
+    }
+
+    // With nothing pending no worker refers to the connection, so it can move
+    // without reordering anything
+    if (__atomic_load_n(&cnx->pending, __ATOMIC_ACQUIRE) == 0)
+    {
+        int active   = __atomic_load_n(&s->pool.active, __ATOMIC_ACQUIRE);
+        int index    = (int)(cnx->worker - s->workers);
+        bool parked  = (index >= active);
+
+        if (parked || queue_depth(&cnx->worker->requests) > 0)
+        {
+            vws_svr_worker* w = svr_worker_next(cnx->loop);
+
+            if (parked || queue_depth(&w->requests) == 0)
+            {
+                cnx->worker = w;
+            }
+        }
+    }
+
+    __atomic_add_fetch(&cnx->pending, 1, __ATOMIC_RELAXED);
+
+    return cnx->worker;
+}
+
+void svr_cnx_queue(vws_svr_cnx* cnx, vws_svr_data* data)
+{
+    if (svr_stealing(cnx->server) == false)
+    {
+        // Markers are sent straight back by the worker, so they don't count
+        // as pending
+        bool marker = vws_is_flag(&data->flags, VM_SVR_DATA_RELEASE) ||
+                      vws_is_flag(&data->flags, VM_SVR_DATA_HANDOFF);
+
+        vws_svr_worker* w = marker ? cnx->worker : svr_cnx_worker(cnx);
+        queue_push(&w->requests, data);
+
+        return;
+    }
+
+    queue_stamp(data);
+
+    svr_spin_lock(&cnx->run_lock);
+    vws_queue_lazy(&cnx->run);
+    sc_queue_add_first(&cnx->run, data);
+
+    bool start     = (cnx->scheduled == false);
+    cnx->scheduled = true;
+    svr_spin_unlock(&cnx->run_lock);
+
+    if (start == true)
+    {
+        // The connection had nothing waiting. Give it a turn.
+        vws_svr_data* turn = vws_svr_data_own(cnx, NULL, 0);
+        vws_set_flag(&turn->flags, VM_SVR_DATA_RUN);
+        queue_push(&svr_cnx_run_worker(cnx)->requests, turn);
+    }
+}
+
+bool svr_stealing(vws_tcp_svr* server)
+{
+    return server->steal == true && server->pool.min == server->pool_size;
+}
+
+vws_svr_worker* svr_cnx_run_worker(vws_svr_cnx* cnx)
+{
+    vws_tcp_svr* s    = cnx->server;
+    vws_svr_worker* w = __atomic_load_n(&cnx->worker, __ATOMIC_RELAXED);
+
+    bool idle = __atomic_load_n(&w->busy, __ATOMIC_ACQUIRE) == false &&
+                queue_depth(&w->requests) == 0;
+
+    if (idle == true)
+    {
+        return w;
+    }
+
+    // Busy. The connection has nothing in flight, so it can move to a worker
+    // that is idle without reordering anything.
+    int n     = s->pool_size;
+    int index = (int)(w - s->workers);
+
+    for (int i = 1; i < n; i++)
+    {
+        vws_svr_worker* other = &s->workers[(index + i) % n];
+
+        if (__atomic_load_n(&other->busy, __ATOMIC_ACQUIRE) == false &&
+            queue_depth(&other->requests) == 0)
+        {
+            __atomic_store_n(&cnx->worker, other, __ATOMIC_RELAXED);
+            return other;
+        }
+    }
+
+    return w;
+}
+
+vws_svr_data* svr_worker_steal(vws_svr_worker* worker)
+{
+    vws_tcp_svr* s = worker->server;
+    int n          = s->pool_size;
+    int index      = (int)(worker - s->workers);
+
+    for (int i = 1; i < n; i++)
+    {
+        vws_svr_worker* victim = &s->workers[(index + i) % n];
+
+        // An idle worker gets to its own queue itself
+        if (__atomic_load_n(&victim->busy, __ATOMIC_ACQUIRE) == false)
+        {
+            continue;
+        }
+
+        // The queue only holds turns, each with all of a connection's
+        // requests behind it
+        vws_svr_data* turn = queue_try_pop(&victim->requests);
+
+        if (turn != NULL)
+        {
+            svr_count(&worker->metrics->steals, 1);
+            return turn;
+        }
+    }
+
+    return NULL;
+}
+
+void svr_msg_batch_add( vws_svr_cnx* cnx,
+                        void* m,
+                        void (*flush)(vws_svr_cnx*, void**, size_t) )
+{
+    svr_msg_batch* b = &svr_msg_batch_current;
+
+    if (b->count == VWS_SVR_BATCH || (b->count > 0 && b->cnx != cnx))
+    {
+        svr_msg_batch_flush();
+    }
+
+    b->cnx               = cnx;
+    b->flush             = flush;
+    b->items[b->count++] = m;
+}
+
+void svr_msg_batch_flush()
+{
+    svr_msg_batch* b = &svr_msg_batch_current;
+
+    if (b->count == 0)
+    {
+        return;
+    }
+
+    // The callback may add to the batch again
+    size_t n = b->count;
+    b->count = 0;
+    b->flush(b->cnx, b->items, n);
+}
+
+void svr_spin_lock(bool* lock)
+{
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+        {
+            // Spin
+        }
+    }
+}
+
+void svr_spin_unlock(bool* lock)
+{
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+void svr_loop_init(vws_tcp_svr* server, vws_svr_loop* loop, int queue_size)
+{
+    loop->server      = server;
+    loop->loop        = (uv_loop_t*)vws.malloc(sizeof(uv_loop_t));
+    loop->read_buffer = uv_buf_init(vws.malloc(65536), 65536);
+    loop->listener    = NULL;
+
+    loop->write_bufs      = NULL;
+    loop->write_bufs_size = 0;
+
+    uv_loop_init(loop->loop);
+    sc_map_init_64v(&loop->cnxs, 0, 0);
+    sc_map_init_64v(&loop->batches, 0, 0);
+    sc_map_init_sv(&loop->topics, 0, 0);
+    queue_init(&loop->responses, queue_size, "responses");
+    queue_init(&loop->priority, queue_size, "priority");
+
+    loop->wakeup       = vws.malloc(sizeof(uv_async_t));
+    loop->wakeup->data = loop;
+    loop->signaled     = false;
+    uv_async_init(loop->loop, loop->wakeup, uv_thread);
+
+    loop->timer        = vws.malloc(sizeof(uv_timer_t));
+    loop->timer->data  = loop;
+    uv_timer_init(loop->loop, loop->timer);
+
+    size_t size        = sizeof(vws_svr_cnx*) * VWS_SVR_TIMER_SLOTS;
+    loop->wheel        = vws.malloc(size);
+    loop->wheel_cursor = 0;
+    memset(loop->wheel, 0, size);
+
+    loop->metrics      = svr_metrics_new();
+    loop->read_time    = 0;
+    loop->sample_count = 0;
+    loop->cpus         = NULL;
+    loop->cpu_count    = 0;
+    loop->next_worker  = 0;
+    loop->handoff      = NULL;
+    loop->handed_off   = false;
+}
+
+void svr_loop_destroy(vws_svr_loop* loop)
+{
+    // Close the loop async handle
+    uv_close((uv_handle_t*)loop->wakeup, svr_on_handle_close);
+    uv_close((uv_handle_t*)loop->timer, svr_on_handle_close);
+
+    //> Shutdown libuv
+
+    // Client handles still open carry their connection, which is freed with
+    // the map below. Close them as plain handles.
+    uint64_t key; vws_svr_cnx* cnx;
+    sc_map_foreach(&loop->cnxs, key, cnx)
+    {
+        uv_handle_t* handle = (uv_handle_t*)cnx->handle;
+
+        if (handle != NULL && uv_is_closing(handle) == 0)
+        {
+            handle->data = NULL;
+            uv_close(handle, svr_on_stream_close);
+        }
+    }
+
+    // Walk the loop to close everything
+    uv_walk(loop->loop, on_uv_walk, NULL);
+
+    while (uv_loop_close(loop->loop))
+    {
+        // Run the loop until there are no more active handles
+        while (uv_loop_alive(loop->loop))
+        {
+            uv_run(loop->loop, UV_RUN_DEFAULT);
+        }
+    }
+
+    // Free loop
+    vws.free(loop->loop);
+
+    // Free read buffer
+    vws.free(loop->read_buffer.base);
+    vws.free(loop->write_bufs);
+    vws.free(loop->wheel);
+    vws.free(loop->metrics);
+    vws.free(loop->cpus);
+
+    // Free connection map
+    svr_cnx_map_clear(&loop->cnxs);
+    sc_map_term_64v(&loop->cnxs);
+    sc_map_term_64v(&loop->batches);
+
+    // Free topics. Their connections are gone with the map above.
+    const char* name; vws_svr_topic* topic;
+    sc_map_foreach(&loop->topics, name, topic)
+    {
+        svr_topic_free(topic);
+    }
+
+    sc_map_term_sv(&loop->topics);
+}
+
+// Most CPUs a list may name
+#if defined(__linux__)
+#define SVR_CPU_MAX CPU_SETSIZE
+#else
+#define SVR_CPU_MAX 1024
+#endif
+
+// Sets a thread's CPUs to a copy of some of a list
+static void svr_cpus_set(int** cpus, int* count, const int* from, int n)
+{
+    vws.free(*cpus);
+    *cpus  = NULL;
+    *count = n;
+
+    if (n > 0)
+    {
+        *cpus = vws.malloc(sizeof(int) * n);
+        memcpy(*cpus, from, sizeof(int) * n);
+    }
+}
+
+void svr_place(vws_tcp_svr* server)
+{
+    int nl = server->loop_count;
+    int nw = server->pool_size;
+
+    for (int i = 0; i < nl; i++)
+    {
+        vws_svr_loop* l = &server->loops[i];
+        svr_cpus_set(&l->cpus, &l->cpu_count, NULL, 0);
+        l->next_worker  = 0;
+    }
+
+    for (int i = 0; i < nw; i++)
+    {
+        vws_svr_worker* w = &server->workers[i];
+        svr_cpus_set(&w->cpus, &w->cpu_count, NULL, 0);
+    }
+
+    int* cpus = server->cpus;
+    int n     = server->cpu_count;
+
+    if (server->affinity == VWS_SVR_AFFINITY_CPU)
+    {
+        // Loops first, then workers, one CPU each
+        for (int i = 0; i < nl; i++)
+        {
+            vws_svr_loop* l = &server->loops[i];
+            svr_cpus_set(&l->cpus, &l->cpu_count, &cpus[i % n], 1);
+        }
+
+        for (int i = 0; i < nw; i++)
+        {
+            vws_svr_worker* w = &server->workers[i];
+            svr_cpus_set(&w->cpus, &w->cpu_count, &cpus[(nl + i) % n], 1);
+        }
+
+        return;
+    }
+
+    if (server->affinity != VWS_SVR_AFFINITY_NODE)
+    {
+        return;
+    }
+
+    //> Group the server's CPUs by node
+
+    int** groups    = vws.malloc(sizeof(int*) * n);
+    int* sizes      = vws.malloc(sizeof(int) * n);
+    int group_count = 0;
+    int* nodes      = NULL;
+    int node_count  = svr_cpus_read("/sys/devices/system/node/online", &nodes);
+
+    for (int i = 0; i < node_count; i++)
+    {
+        char path[64];
+        snprintf( path, sizeof(path),
+                  "/sys/devices/system/node/node%i/cpulist", nodes[i] );
+
+        int* node_cpus = NULL;
+        int size       = svr_cpus_read(path, &node_cpus);
+        int* group     = vws.malloc(sizeof(int) * n);
+        int used       = 0;
+
+        // The server's CPUs on the node, in the order they were given
+        for (int c = 0; c < n; c++)
+        {
+            for (int j = 0; j < size; j++)
+            {
+                if (node_cpus[j] == cpus[c])
+                {
+                    group[used++] = cpus[c];
+                    break;
+                }
+            }
+        }
+
+        vws.free(node_cpus);
+
+        if (used == 0)
+        {
+            vws.free(group);
+            continue;
+        }
+
+        groups[group_count]  = group;
+        sizes[group_count++] = used;
+    }
+
+    vws.free(nodes);
+
+    if (group_count == 0)
+    {
+        // No NUMA information. All CPUs make one node.
+        groups[0]   = vws.malloc(sizeof(int) * n);
+        sizes[0]    = n;
+        group_count = 1;
+        memcpy(groups[0], cpus, sizeof(int) * n);
+    }
+
+    //> Loops take nodes in turn and their workers follow them
+
+    for (int i = 0; i < nl; i++)
+    {
+        vws_svr_loop* l = &server->loops[i];
+        int g           = i % group_count;
+        svr_cpus_set(&l->cpus, &l->cpu_count, groups[g], sizes[g]);
+    }
+
+    for (int i = 0; i < nw; i++)
+    {
+        vws_svr_worker* w = &server->workers[i];
+        int g             = (i % nl) % group_count;
+        svr_cpus_set(&w->cpus, &w->cpu_count, groups[g], sizes[g]);
+    }
+
+    for (int i = 0; i < group_count; i++)
+    {
+        vws.free(groups[i]);
+    }
+
+    vws.free(groups);
+    vws.free(sizes);
+}
+
+void svr_pin(const int* cpus, int count)
+{
+    if (cpus == NULL)
+    {
+        return;
+    }
+
+#if defined(__linux__)
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int i = 0; i < count; i++)
+    {
+        CPU_SET(cpus[i], &set);
+    }
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    if (rc != 0)
+    {
+        vws.trace(VL_WARN, "svr_pin(): cannot set affinity: %s", strerror(rc));
+    }
+
+#endif
+}
+
+void svr_loop_pin(vws_svr_loop* loop)
+{
+    if (loop->cpus == NULL)
+    {
+        return;
+    }
+
+    svr_pin(loop->cpus, loop->cpu_count);
+
+    // Nothing has been read yet. The buffer is touched on every read, so
+    // allocate it again from this thread, on its node.
+    size_t size = loop->read_buffer.len;
+    vws.free(loop->read_buffer.base);
+    loop->read_buffer = uv_buf_init(vws.malloc(size), size);
+}
+
+void svr_loop_reserve(vws_svr_loop* loop)
+{
+    size_t n = loop->server->cnx_reserve;
+
+    if (n == 0)
+    {
+        return;
+    }
+
+    // After pinning, so the memory is on the loop's node
+    vws_pool_reserve(VP_SVR_CNX, sizeof(vws_svr_cnx), n);
+    vws_pool_reserve(VP_SVR_TCP, sizeof(uv_tcp_t), n);
+}
+
+int svr_cpus_parse(cstr list, int** cpus)
+{
+    int* out         = NULL;
+    int count        = 0;
+    size_t allocated = 0;
+    cstr p           = list;
+
+    while (isspace((unsigned char)*p))
+    {
+        p++;
+    }
+
+    while (*p != '\0')
+    {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last  = first;
+
+        if (end == p || first < 0)
+        {
+            goto error;
+        }
+
+        p = end;
+
+        if (*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+
+            if (end == p || last < first)
+            {
+                goto error;
+            }
+
+            p = end;
+        }
+
+        if (last >= SVR_CPU_MAX)
+        {
+            goto error;
+        }
+
+        for (long c = first; c <= last; c++)
+        {
+            if ((size_t)count == allocated)
+            {
+                allocated = allocated ? allocated * 2 : 16;
+                out       = vws.realloc(out, sizeof(int) * allocated);
+            }
+
+            out[count++] = (int)c;
+        }
+
+        while (isspace((unsigned char)*p))
+        {
+            p++;
+        }
+
+        if (*p == ',')
+        {
+            p++;
+        }
+        else if (*p != '\0')
+        {
+            goto error;
+        }
+    }
+
+    *cpus = out;
+    return count;
+
+error:
+
+    vws.free(out);
+    *cpus = NULL;
+    return -1;
+}
+
+int svr_cpus_read(cstr path, int** cpus)
+{
+    *cpus   = NULL;
+    FILE* f = fopen(path, "r");
+
+    if (f == NULL)
+    {
+        return -1;
+    }
+
+    char line[4096];
+    bool ok = (fgets(line, sizeof(line), f) != NULL);
+    fclose(f);
+
+    if (ok == false)
+    {
+        return -1;
+    }
+
+    return svr_cpus_parse(line, cpus);
+}
+
+int svr_loop_listen(vws_svr_loop* loop, const struct sockaddr_in* addr)
+{
+    vws_tcp_svr* server = loop->server;
+
+    int rc;
+    uv_tcp_t* socket = vws.malloc(sizeof(uv_tcp_t));
+
+    // Create the socket up front so that options can be set before bind
+    uv_tcp_init_ex(loop->loop, socket, AF_INET);
+    socket->data   = loop;
+    loop->listener = (uv_stream_t*)socket;
+
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)socket, &fd);
+
+    if (server->loop_count > 1)
+    {
+#ifdef SO_REUSEPORT
+        int on = 1;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+        {
+            vws.error(VE_RT, "Failed to set SO_REUSEPORT");
+            return -1;
+        }
+#else
+        vws.error(VE_RT, "SO_REUSEPORT not supported on this platform");
+        return -1;
+#endif
+    }
+
+    if (server->defer_accept > 0)
+    {
+#ifdef TCP_DEFER_ACCEPT
+        int secs = server->defer_accept;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)))
+        {
+            vws.error(VE_RT, "Failed to set TCP_DEFER_ACCEPT");
+            return -1;
+        }
+#else
+        vws.trace(VL_WARN, "TCP_DEFER_ACCEPT not supported on this platform");
+#endif
+    }
+
+    if (server->fastopen > 0)
+    {
+#ifdef TCP_FASTOPEN
+        int qlen = server->fastopen;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)))
+        {
+            vws.error(VE_RT, "Failed to set TCP_FASTOPEN");
+            return -1;
+        }
+#else
+        vws.trace(VL_WARN, "TCP_FASTOPEN not supported on this platform");
+#endif
+    }
+
+    rc = uv_tcp_bind(socket, (const struct sockaddr*)addr, 0);
+
+    if (rc)
+    {
+        vws.error(VE_RT, "Bind error %s", uv_strerror(rc));
+        return -1;
+    }
+
+    rc = uv_listen((uv_stream_t*)socket, server->backlog, svr_on_connect);
+
+    if (rc)
+    {
+        vws.error(VE_RT, "Listen error %s", uv_strerror(rc));
+        return -1;
+    }
+
+    svr_timer_start(loop);
+
+    return 0;
+}
+
+void on_uv_close(uv_handle_t* handle)
+{
+    if (handle != NULL)
+    {
+        // Client handles carry their connection on handle->data, but it is
+        // cleared before they get here. Anything else must be freed in the
+        // appropriate place. It is ignored here because it's impossible to
+        // tell what it is by the very nature of uv_handle_t. We will generate
+        // a warning however.
+        if (handle->data != NULL)
+        {
+            vws.trace( VL_WARN,
+                       "on_uv_close(): libuv resource not properly freed: %p",
+                       (void*)handle->data );
+        }
+    }
+}
+
+void on_uv_walk(uv_handle_t* handle, void* arg)
+{
+    vws.trace(VL_INFO, "on_uv_walk(): %p", (void*)handle);
+
+    // If this handle has not been closed, it should have been. Nevertheless we
+    // will make an attempt to close it.
+    if (uv_is_closing(handle) == 0)
+    {
+        uv_close(handle, (uv_close_cb)on_uv_close);
+    }
+}
+
+void tcp_svr_dtor(vws_tcp_svr* svr)
+{
+    //> Stop/shutdown server
+
+    if (svr->state == VS_RUNNING)
+    {
+        vws_tcp_svr_stop(svr);
+    }
+
+    svr_shutdown(svr);
+
+    svr_workers_destroy(svr);
+    vws.free(svr->cpus);
+
+    for (int i = 0; i < svr->loop_count; i++)
+    {
+        svr_loop_destroy(&svr->loops[i]);
+
+        // Still there if the server never ran, e.g. after a failed takeover
+        queue_destroy(&svr->loops[i].responses);
+        queue_destroy(&svr->loops[i].priority);
+    }
+
+    vws.free(svr->loops);
+
+    for (int i = 0; i < VWS_SVR_SLOT_PAGES; i++)
+    {
+        vws.free(svr->slots.pages[i]);
+    }
+
+    vws.free(svr->slots.free);
+    uv_mutex_destroy(&svr->slots.lock);
+    vws.free(svr->metrics);
+
+    // Sockets inherited or received but never run
+    for (int i = 0; i < svr->listen_fd_count; i++)
+    {
+        close(svr->listen_fds[i]);
+    }
+
+    vws.free(svr->listen_fds);
+    svr_handoff_free(svr->handoff);
+
+    // The loops and workers have flushed their pools on the way out, and what
+    // was freed here went to this thread's. Give it all back.
+    vws_pool_shutdown();
+}
+
+//------------------------------------------------------------------------------
+// Client connection callbacks
+//------------------------------------------------------------------------------
+
+void svr_client_connect(vws_svr_cnx* c)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_client_connect(%p)", c->handle);
+    }
+}
+
+void svr_client_disconnect(vws_svr_cnx* c)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_client_disconnect(%p)", c->handle);
+    }
+}
+
+void svr_client_keepalive(vws_svr_cnx* c)
+{
+    // Default: nothing the peer can answer at this level
+}
+
+bool svr_client_handoff(vws_svr_cnx* c, vws_buffer* state)
+{
+    // Default: nothing to carry over at this level
+    return true;
+}
+
+void svr_client_adopt(vws_svr_cnx* c, ucstr state, size_t size)
+{
+    // Default: nothing to restore
+}
+
+void svr_client_backpressure(vws_svr_cnx* c, bool paused)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "svr_client_backpressure(%p): %s",
+                   c->handle,
+                   paused ? "paused" : "resumed" );
+    }
+}
+
+void svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf)
+{
+    // Copy data out of the read buffer and queue to worker pool for processing
+    ucstr block = vws.malloc(size);
+    memcpy(block, buf->base, size);
+
+    vws_svr_data* data = vws_svr_data_own(c, block, size);
+    svr_sample_start(c, data);
+    svr_cnx_queue(c, data);
+}
+
+void svr_client_data_in(vws_svr_data* req)
+{
+    vws_tcp_svr* server = req->cnx->server;
+
+    // Default: Do nothing. Drop data.
+    vws_svr_data_free(req);
+}
+
+void svr_client_data_out(vws_svr_data* data)
+{
+    if (data->size == 0 && data->header_size == 0)
+    {
+        vws.trace(VL_INFO, "svr_client_data_out(): no data");
+        vws.error(VL_WARN, "svr_client_data_out(): no data");
+        return;
+    }
+
+    // A batch of one. Header and data go out as separate buffers in a single
+    // write.
+    svr_write_batch* batch = svr_batch_new(data->cnx);
+    batch->items[batch->count++] = data;
+    svr_batch_send(batch);
+}
+
+//------------------------------------------------------------------------------
+// Server Utilities
+//------------------------------------------------------------------------------
+
+vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key)
+{
+    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
+
+    // If entry exists
+    if (sc_map_found(map) == true)
+    {
+        return cnx;
+    }
+
+    return NULL;
+}
+
+void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key)
+{
+    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
+
+    // If entry exists
+    if (sc_map_found(map) == true)
+    {
+        sc_map_del_64v(map, (uint64_t)key);
+
+        // Call on_disconnect() handler
+        cnx->server->on_disconnect(cnx);
+
+        // Cleanup
+        vws.free(cnx);
+    }
+}
+
+int8_t svr_cnx_map_set( vws_svr_cnx_map* map,
+                        uv_stream_t* key,
+                        vws_svr_cnx* value )
+{
+    // See if we have an existing entry
+    sc_map_get_64v(map, (uint64_t)key);
+
+    if (sc_map_found(map) == true)
+    {
+        // Exsiting entry. Return false.
+        return 0;
+    }
+
+    sc_map_put_64v(map, (uint64_t)key, value);
+
+    // True
+    return 1;
+}
+
+void svr_cnx_map_clear(vws_svr_cnx_map* map)
+{
+    uint64_t key; vws_svr_cnx* cnx;
+    sc_map_foreach(map, key, cnx)
+    {
+        cnx->server->on_disconnect(cnx);
+        svr_cnx_free(cnx);
+    }
+
+    sc_map_clear_64v(map);
+}
+
+vws_svr_cnx* svr_cnx_new(vws_svr_loop* l, uv_stream_t* handle)
+{
+    vws_tcp_svr* s   = l->server;
+    vws_svr_cnx* cnx = vws_pool_get(VP_SVR_CNX, sizeof(vws_svr_cnx));
+    cnx->server      = s;
+    cnx->loop        = l;
+    cnx->handle      = handle;
+    cnx->data        = NULL;
+    cnx->format      = VM_MPACK_FORMAT;
+    cnx->paused      = false;
+    cnx->ssl         = NULL;
+
+    // Outboxes are allocated on first use. Most connections are idle.
+    memset(&cnx->outbox, 0, sizeof(cnx->outbox));
+    memset(&cnx->priority_outbox, 0, sizeof(cnx->priority_outbox));
+    cnx->open_outbox      = NULL;
+    cnx->fragment_pending = false;
+    cnx->subscriptions    = 0;
+    cnx->last_read        = uv_now(l->loop);
+    cnx->keepalive_sent   = false;
+    cnx->timer_slot       = -1;
+    cnx->timer_next       = NULL;
+    cnx->timer_prev       = NULL;
+    cnx->handoff          = 0;
+    cnx->shm              = NULL;
+
+    svr_count(&svr_metrics(s)->connections, 1);
+    VWS_PROBE1(accept, cnx);
+
+    svr_slot_acquire(cnx);
+
+    if (s->ssl_ctx != NULL)
+    {
+        // Memory BIOs leave all socket I/O to libuv. The session just turns
+        // ciphertext into plaintext and back.
+        cnx->ssl = SSL_new(s->ssl_ctx);
+        SSL_set_bio(cnx->ssl, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+        SSL_set_accept_state(cnx->ssl);
+    }
+
+    // Bind to a worker. All requests from this connection go to it so they are
+    // processed in order. Several loops may accept at once.
+    cnx->worker      = svr_worker_next(l);
+    cnx->pending     = 0;
+    cnx->run_lock    = false;
+    cnx->scheduled   = false;
+    memset(&cnx->run, 0, sizeof(cnx->run));
+
+    // Initialize HTTP state. The parser is created when the request starts
+    // to arrive, and freed on upgrade.
+    cnx->upgraded    = false;
+    cnx->http        = NULL;
+
+    return cnx;
+}
+
+void svr_cnx_free(vws_svr_cnx* c)
+{
+    if (c != NULL)
+    {
+        if (c->http != NULL)
+        {
+            vws_http_msg_free(c->http);
+        }
+
+        if (c->ssl != NULL)
+        {
+            SSL_free(c->ssl);
+        }
+
+        // Message data that never went out
+        vws_svr_data* data;
+        sc_queue_foreach (&c->outbox, data)
+        {
+            vws_svr_data_free(data);
+        }
+
+        sc_queue_term(&c->outbox);
+
+        sc_queue_foreach (&c->priority_outbox, data)
+        {
+            vws_svr_data_free(data);
+        }
+
+        sc_queue_term(&c->priority_outbox);
+
+        // Requests that never got a turn
+        sc_queue_foreach (&c->run, data)
+        {
+            vws_svr_data_free(data);
+        }
+
+        sc_queue_term(&c->run);
+
+        svr_slot_release(c);
+
+        vws_pool_put(VP_SVR_CNX, c);
+    }
+}
+
+void svr_cnx_close(vws_svr_cnx* c)
+{
+    vws_tcp_svr_close(c);
+}
+
+void svr_stop_workers(vws_tcp_svr* server)
+{
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        queue_halt(&server->workers[i].requests);
+    }
+}
+
+void svr_shutdown(vws_tcp_svr* server)
+{
+    if (server->state == VS_HALTED)
+    {
+        return;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_shutdown(%p): Shutdown starting", server);
+    }
+
+    // Cleanup libuv
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        queue_destroy(&server->workers[i].requests);
+    }
+
+    for (int i = 0; i < server->loop_count; i++)
+    {
+        queue_destroy(&server->loops[i].responses);
+        queue_destroy(&server->loops[i].priority);
+    }
+}
+
+void svr_on_connect(uv_stream_t* socket, int status)
+{
+    vws_svr_loop* loop  = (vws_svr_loop*) socket->data;
+    vws_tcp_svr* server = loop->server;
+
+    if (status < 0)
+    {
+        cstr e = uv_strerror(status);
+        vws.error(VE_RT, "Error in connection callback: %s", e);
+        return;
+    }
+
+    // libuv calls this for each connection it accepts, until accept() would
+    // block, so a storm is drained in one wakeup. Setting a connection up
+    // takes nothing from the allocator while the pools have state to hand.
+
+    // Clients of a Unix socket listener come in on pipe handles
+    uv_stream_t* c = svr_stream_new(loop, socket->type == UV_NAMED_PIPE, true);
+
+    if (c == NULL)
+    {
+        // Error already set
+        return;
+    }
+
+    if (uv_accept(socket, c) != 0)
+    {
+        uv_close((uv_handle_t*)c, svr_on_stream_close);
+        return;
+    }
+
+    // Responses are already coalesced per wakeup. Nagle would only hold back
+    // the tail of a reply until the client's delayed ACK fires, so nodelay is
+    // on by default. A failure to tune the socket is only reported.
+    if (c->type == UV_TCP)
+    {
+        uv_os_fd_t fd;
+        uv_fileno((uv_handle_t*)c, &fd);
+        vws_sockopts_apply(fd, &server->sockopts);
+    }
+
+    if (uv_read_start(c, svr_on_realloc, svr_on_read) != 0)
+    {
+        vws.error(VE_RT, "Failed to start reading from client");
+        return;
+    }
+
+    //> Add connection to registry and initialize
+
+    // The connection rides on the handle, so callbacks need no lookup. The map
+    // is only an index for shutdown.
+    vws_svr_cnx* cnx = svr_cnx_new(loop, c);
+    c->data          = cnx;
+
+    if (svr_cnx_map_set(&loop->cnxs, c, cnx) == false)
+    {
+        vws.error(VE_FATAL, "Connection already registered");
+    }
+
+    //> Call svr_on_connect() handler
+
+    svr_timer_add(cnx);
+    server->on_connect(cnx);
+}
+
+void svr_on_read(uv_stream_t* c, ssize_t nread, const uv_buf_t* buf)
+{
+    vws_svr_cnx* cnx    = (vws_svr_cnx*)c->data;
+    vws_tcp_svr* server = cnx->server;
+
+    if (nread < 0)
+    {
+        uv_close((uv_handle_t*)c, svr_on_close);
+        return;
+    }
+
+    if (nread == 0)
+    {
+        // Nothing read (EAGAIN)
+        return;
+    }
+
+    // Just note the time. The timer wheel looks at it when it gets round to
+    // the connection.
+    cnx->last_read      = uv_now(cnx->loop->loop);
+    cnx->keepalive_sent = false;
+
+    svr_count(&svr_metrics(server)->bytes_in, nread);
+
+    if (server->sample_rate > 0)
+    {
+        cnx->loop->read_time = uv_hrtime();
+    }
+
+    if (cnx->ssl != NULL)
+    {
+        svr_tls_read(cnx, nread, buf);
+    }
+    else
+    {
+        server->on_read(cnx, nread, buf);
+    }
+
+    #if defined(VWS_SHM)
+    // Whoever wanted passed descriptors has taken them by now
+    if (c->type == UV_NAMED_PIPE && uv_is_closing((uv_handle_t*)c) == 0)
+    {
+        svr_pipe_take(c, NULL, 0);
+    }
+    #endif
+}
+
+svr_write_batch* svr_batch_new(vws_svr_cnx* cnx)
+{
+    svr_write_batch* batch;
+    batch           = vws_pool_get(VP_SVR_WRITE, sizeof(svr_write_batch));
+    batch->req.data = batch;
+    batch->cnx      = cnx;
+    batch->count    = 0;
+    batch->capacity = SVR_BATCH_INLINE;
+    batch->items    = batch->inline_items;
+    batch->fragment = false;
+
+    return batch;
+}
+
+void svr_batch_add(struct sc_map_64v* batches, vws_svr_data* data)
+{
+    if (data->size == 0 && data->header_size == 0)
+    {
+        vws_svr_data_free(data);
+        return;
+    }
+
+    svr_write_batch* batch = sc_map_get_64v(batches, (uint64_t)data->cnx);
+
+    if (sc_map_found(batches) == false)
+    {
+        batch = svr_batch_new(data->cnx);
+        sc_map_put_64v(batches, (uint64_t)data->cnx, batch);
+    }
+
+    svr_batch_push(batch, data);
+}
+
+void svr_batch_push(svr_write_batch* batch, vws_svr_data* data)
+{
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_FRAGMENT))
+    {
+        batch->fragment = true;
+    }
+
+    if (batch->count == batch->capacity)
+    {
+        batch->capacity *= 2;
+        size_t size      = sizeof(vws_svr_data*) * batch->capacity;
+
+        if (batch->items == batch->inline_items)
+        {
+            batch->items = vws.malloc(size);
+            memcpy(batch->items, batch->inline_items, sizeof(batch->inline_items));
+        }
+        else
+        {
+            batch->items = vws.realloc(batch->items, size);
+        }
+    }
+
+    batch->items[batch->count++] = data;
+}
+
+void svr_batch_send(svr_write_batch* batch)
+{
+    vws_svr_cnx* cnx         = batch->cnx;
+    vws_svr_metrics* metrics = svr_metrics(cnx->server);
+    batch->started           = uv_hrtime();
+
+    // Count frames by the opcode in the header while the items are still the
+    // plaintext ones
+    for (size_t i = 0; i < batch->count; i++)
+    {
+        vws_svr_data* data = batch->items[i];
+
+        if (data->header_size > 0)
+        {
+            svr_count(&metrics->frames_out[data->header[0] & 0x0F], 1);
+        }
+
+        if (data->timing != NULL)
+        {
+            data->timing->written = batch->started;
+        }
+    }
+
+    if (cnx->ssl != NULL)
+    {
+        if (svr_tls_encrypt(batch) == false)
+        {
+            vws.error(VE_SOCKET, "TLS encryption failed");
+            svr_on_batch_write_complete(&batch->req, UV_ECANCELED);
+
+            if (uv_is_closing((uv_handle_t*)cnx->handle) == 0)
+            {
+                uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+            }
+
+            return;
+        }
+
+        if (batch->count == 0)
+        {
+            svr_on_batch_write_complete(&batch->req, 0);
+            return;
+        }
+    }
+
+    // Each response contributes at most a header and a payload. Small batches
+    // build their buffer list on the stack, bigger ones in the loop's.
+    uv_buf_t stack[SVR_BATCH_INLINE * 2];
+    uv_buf_t* bufs = stack;
+    unsigned int n = 0;
+
+    if (batch->count > SVR_BATCH_INLINE)
+    {
+        vws_svr_loop* loop = cnx->loop;
+        size_t size        = batch->count * 2;
+
+        if (loop->write_bufs_size < size)
+        {
+            loop->write_bufs      = vws.realloc( loop->write_bufs,
+                                                 sizeof(uv_buf_t) * size );
+            loop->write_bufs_size = size;
+        }
+
+        bufs = loop->write_bufs;
+    }
+
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < batch->count; i++)
+    {
+        vws_svr_data* data = batch->items[i];
+
+        if (data->header_size > 0)
+        {
+            bufs[n++] = uv_buf_init((char*)data->header, data->header_size);
+        }
+
+        if (data->size > 0)
+        {
+            bufs[n++] = uv_buf_init(data->data, data->size);
+        }
+
+        bytes += data->header_size + data->size;
+    }
+
+    svr_count(&metrics->bytes_out, bytes);
+    VWS_PROBE3(write, cnx, batch->count, bytes);
+
+    // With nothing queued ahead of it, a small write can go straight to the
+    // socket. Fragments are left to the callback, as completing one pumps out
+    // the next.
+    size_t done = 0;
+
+    if ( bytes <= cnx->server->try_write && batch->fragment == false &&
+         uv_stream_get_write_queue_size(cnx->handle) == 0 )
+    {
+        int rc = uv_try_write(cnx->handle, bufs, n);
+        done   = (rc > 0) ? (size_t)rc : 0;
+    }
+
+    if (done == bytes)
+    {
+        svr_count(&metrics->immediate_writes, 1);
+        svr_on_batch_write_complete(&batch->req, 0);
+
+        return;
+    }
+
+    // Queue what the socket did not take
+    unsigned int first = 0;
+
+    while (done > 0)
+    {
+        if (done >= bufs[first].len)
+        {
+            done -= bufs[first].len;
+            first++;
+        }
+        else
+        {
+            bufs[first].base += done;
+            bufs[first].len  -= done;
+            done              = 0;
+        }
+    }
+
+    // libuv copies the uv_buf_t array, so it can be used again right away
+    int rc = uv_write( &batch->req, cnx->handle,
+                       bufs + first, n - first,
+                       svr_on_batch_write_complete );
+
+    if (rc != 0)
+    {
+        // The socket is already closing, so there will be no callback
+        svr_on_batch_write_complete(&batch->req, rc);
+        return;
+    }
+
+    svr_cnx_check_backpressure(cnx);
+}
+
+void svr_cnx_check_backpressure(vws_svr_cnx* cnx)
+{
+    vws_tcp_svr* server = cnx->server;
+    uv_stream_t* handle = cnx->handle;
+
+    if (server->write_high == 0 || handle == NULL)
+    {
+        return;
+    }
+
+    if (uv_is_closing((uv_handle_t*)handle) != 0)
+    {
+        return;
+    }
+
+    size_t pending = uv_stream_get_write_queue_size(handle);
+
+    if (cnx->paused == false && pending >= server->write_high)
+    {
+        uv_read_stop(handle);
+        cnx->paused = true;
+        server->on_backpressure(cnx, true);
+    }
+    else if (cnx->paused == true && pending <= server->write_low)
+    {
+        // Reading stays stopped on a connection being handed off
+        if (cnx->handoff == 0)
+        {
+            uv_read_start(handle, svr_on_realloc, svr_on_read);
+        }
+
+        cnx->paused = false;
+        server->on_backpressure(cnx, false);
+    }
+}
+
+bool svr_cnx_hold(vws_svr_data* data)
+{
+    vws_svr_cnx* cnx = data->cnx;
+
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_MESSAGE) == false)
+    {
+        return false;
+    }
+
+    bool priority = vws_is_flag(&data->flags, VM_SVR_DATA_PRIORITY);
+
+    struct sc_queue_ptr* outbox;
+    outbox = priority ? &cnx->priority_outbox : &cnx->outbox;
+    bool hold;
+
+    if (cnx->open_outbox == outbox)
+    {
+        // The rest of a fragmented message, in order
+        hold = cnx->fragment_pending || sc_queue_size(outbox) > 0;
+    }
+    else if (cnx->open_outbox != NULL)
+    {
+        // Data messages cannot interleave. It waits for the other lane to
+        // finish its message.
+        hold = true;
+    }
+    else
+    {
+        // Ordinary data also waits for any priority data ahead of it
+        hold = cnx->fragment_pending
+            || sc_queue_size(outbox) > 0
+            || (priority == false && sc_queue_size(&cnx->priority_outbox) > 0);
+    }
+
+    if (hold == true)
+    {
+        vws_queue_lazy(outbox);
+        sc_queue_add_first(outbox, data);
+        return true;
+    }
+
+    svr_cnx_note(cnx, outbox, data);
+
+    return false;
+}
+
+void svr_cnx_note( vws_svr_cnx* cnx,
+                   struct sc_queue_ptr* outbox,
+                   vws_svr_data* data )
+{
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_FRAGMENT))
+    {
+        cnx->fragment_pending = true;
+
+        // FIN closes the message
+        cnx->open_outbox = (data->header[0] & 0x80) ? NULL : outbox;
+    }
+}
+
+void svr_cnx_pump(vws_svr_cnx* cnx)
+{
+    if (cnx->handle == NULL || uv_is_closing((uv_handle_t*)cnx->handle) != 0)
+    {
+        // Whatever is left is freed with the connection
+        return;
+    }
+
+    svr_write_batch* batch = NULL;
+
+    while (cnx->fragment_pending == false)
+    {
+        // Finish a fragmented message first, then priority data, then the rest
+        struct sc_queue_ptr* outbox = cnx->open_outbox;
+
+        if (outbox == NULL)
+        {
+            outbox = &cnx->priority_outbox;
+
+            if (sc_queue_size(outbox) == 0)
+            {
+                outbox = &cnx->outbox;
+            }
+        }
+
+        if (sc_queue_size(outbox) == 0)
+        {
+            break;
+        }
+
+        vws_svr_data* data = sc_queue_del_last(outbox);
+
+        svr_cnx_note(cnx, outbox, data);
+
+        if (batch == NULL)
+        {
+            batch = svr_batch_new(cnx);
+        }
+
+        svr_batch_push(batch, data);
+    }
+
+    if (batch != NULL)
+    {
+        svr_batch_send(batch);
+    }
+}
+
+void svr_broadcast_send(vws_tcp_svr* server, cstr topic, vws_svr_buffer* b)
+{
+    for (int i = 0; i < server->loop_count; i++)
+    {
+        vws_svr_loop* loop = &server->loops[i];
+
+        // One reference for each loop, which its subscribers share
+        vws_svr_data* item;
+        item = vws_svr_data_own(NULL, (ucstr)vws_strdup(topic), strlen(topic));
+        item->flags  = VM_SVR_DATA_PUBLISH;
+        item->shared = vws_svr_buffer_ref(b);
+
+        queue_push(&loop->responses, item);
+        svr_loop_wake(loop);
+    }
+
+    vws_svr_buffer_release(b);
+}
+
+void svr_buffer_free_data(ucstr data, void* arg)
+{
+    vws.free(data);
+}
+
+void svr_buffer_unmap(ucstr data, void* arg)
+{
+    vws_file_unmap(data, (size_t)(uintptr_t)arg);
+}
+
+void svr_slot_acquire(vws_svr_cnx* cnx)
+{
+    vws_svr_slots* slots = &cnx->server->slots;
+    uint32_t index;
+
+    uv_mutex_lock(&slots->lock);
+
+    if (slots->free_count > 0)
+    {
+        index = slots->free[--slots->free_count];
+    }
+    else
+    {
+        index    = slots->used++;
+        int page = index >> VWS_SVR_SLOT_BITS;
+
+        if (page >= VWS_SVR_SLOT_PAGES)
+        {
+            // Out of slots. The connection works but cannot be sent to by ID.
+            slots->used--;
+            uv_mutex_unlock(&slots->lock);
+            cnx->id = 0;
+
+            return;
+        }
+
+        if (slots->pages[page] == NULL)
+        {
+            size_t size     = sizeof(vws_svr_slot) << VWS_SVR_SLOT_BITS;
+            vws_svr_slot* p = vws.malloc(size);
+            memset(p, 0, size);
+
+            __atomic_store_n(&slots->pages[page], p, __ATOMIC_RELEASE);
+        }
+    }
+
+    uv_mutex_unlock(&slots->lock);
+
+    vws_svr_slot* slot = svr_slot_at(cnx->server, index);
+    uint32_t loop      = (uint32_t)(cnx->loop - cnx->server->loops);
+
+    slot->cnx = cnx;
+    __atomic_store_n(&slot->loop, loop, __ATOMIC_RELEASE);
+
+    // Generation 0 is never used, so no ID is 0
+    if (slot->generation == 0)
+    {
+        __atomic_store_n(&slot->generation, 1, __ATOMIC_RELEASE);
+    }
+
+    cnx->id = ((uint64_t)slot->generation << 32) | index;
+}
+
+void svr_slot_release(vws_svr_cnx* cnx)
+{
+    if (cnx->id == 0)
+    {
+        return;
+    }
+
+    vws_tcp_svr* server  = cnx->server;
+    vws_svr_slots* slots = &server->slots;
+    uint32_t index       = (uint32_t)cnx->id;
+    vws_svr_slot* slot   = svr_slot_at(server, index);
+
+    // Move on first so that the ID stops matching before the slot is reused
+    uint32_t gen = slot->generation + 1;
+    __atomic_store_n(&slot->generation, gen ? gen : 1, __ATOMIC_RELEASE);
+    slot->cnx = NULL;
+
+    uv_mutex_lock(&slots->lock);
+
+    if (slots->free_count == slots->free_allocated)
+    {
+        slots->free_allocated = slots->free_allocated * 2 + 64;
+        size_t size           = slots->free_allocated * sizeof(uint32_t);
+        slots->free           = vws.realloc(slots->free, size);
+    }
+
+    slots->free[slots->free_count++] = index;
+
+    uv_mutex_unlock(&slots->lock);
+}
+
+vws_svr_slot* svr_slot_get(vws_tcp_svr* server, uint64_t id)
+{
+    vws_svr_slot* slot = svr_slot_at(server, (uint32_t)id);
+    uint32_t gen       = (uint32_t)(id >> 32);
+
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != gen)
+    {
+        return NULL;
+    }
+
+    return slot;
+}
+
+vws_svr_slot* svr_slot_at(vws_tcp_svr* server, uint32_t index)
+{
+    uint32_t page = index >> VWS_SVR_SLOT_BITS;
+
+    if (page >= VWS_SVR_SLOT_PAGES)
+    {
+        return NULL;
+    }
+
+    vws_svr_slot* p;
+    p = __atomic_load_n(&server->slots.pages[page], __ATOMIC_ACQUIRE);
+
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    return &p[index & ((1 << VWS_SVR_SLOT_BITS) - 1)];
+}
+
+void svr_loop_push(vws_svr_loop* loop, vws_svr_data* data)
+{
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_PRIORITY))
+    {
+        queue_push(&loop->priority, data);
+    }
+    else
+    {
+        queue_push(&loop->responses, data);
+    }
+
+    // Notify event loop about the new response
+    svr_loop_wake(loop);
+}
+
+void svr_loop_wake(vws_svr_loop* loop)
+{
+    // Whoever sets the flag wakes the loop. The loop clears it once its
+    // queues are empty, and looks again after that, so what we queued is seen
+    // either way.
+    if (__atomic_exchange_n(&loop->signaled, true, __ATOMIC_SEQ_CST) == false)
+    {
+        svr_count(&loop->metrics->wakeups, 1);
+        uv_async_send(loop->wakeup);
+    }
+}
+
+void svr_topic_add(vws_svr_cnx* cnx, cstr name)
+{
+    struct sc_map_sv* topics = &cnx->loop->topics;
+    vws_svr_topic* topic     = sc_map_get_sv(topics, name);
+
+    if (sc_map_found(topics) == false)
+    {
+        topic            = vws.malloc(sizeof(vws_svr_topic));
+        topic->name      = vws_strdup(name);
+        topic->cnxs      = NULL;
+        topic->size      = 0;
+        topic->allocated = 0;
+        sc_map_init_64(&topic->index, 0, 0);
+
+        sc_map_put_sv(topics, topic->name, topic);
+    }
+
+    sc_map_get_64(&topic->index, (uint64_t)cnx);
+
+    if (sc_map_found(&topic->index) == true)
+    {
+        return;
+    }
+
+    if (topic->size == topic->allocated)
+    {
+        topic->allocated = topic->allocated ? topic->allocated * 2 : 16;
+        size_t n         = topic->allocated * sizeof(vws_svr_cnx*);
+        topic->cnxs      = vws.realloc(topic->cnxs, n);
+    }
+
+    sc_map_put_64(&topic->index, (uint64_t)cnx, topic->size);
+    topic->cnxs[topic->size++] = cnx;
+    cnx->subscriptions++;
+}
+
+void svr_topic_remove(vws_svr_cnx* cnx, cstr name)
+{
+    struct sc_map_sv* topics = &cnx->loop->topics;
+    vws_svr_topic* topic     = sc_map_get_sv(topics, name);
+
+    if (sc_map_found(topics) == false)
+    {
+        return;
+    }
+
+    uint64_t slot = sc_map_get_64(&topic->index, (uint64_t)cnx);
+
+    if (sc_map_found(&topic->index) == false)
+    {
+        return;
+    }
+
+    // Move the last subscriber into the slot
+    vws_svr_cnx* last = topic->cnxs[--topic->size];
+    topic->cnxs[slot] = last;
+    sc_map_put_64(&topic->index, (uint64_t)last, slot);
+    sc_map_del_64(&topic->index, (uint64_t)cnx);
+    cnx->subscriptions--;
+
+    if (topic->size == 0)
+    {
+        sc_map_del_sv(topics, topic->name);
+        svr_topic_free(topic);
+    }
+}
+
+void svr_topic_remove_all(vws_svr_cnx* cnx)
+{
+    if (cnx->subscriptions == 0)
+    {
+        return;
+    }
+
+    // Collect the names first: removing the last subscriber frees a topic
+    struct sc_map_sv* topics = &cnx->loop->topics;
+    char** names             = vws.malloc(sizeof(char*) * cnx->subscriptions);
+    size_t count             = 0;
+
+    const char* name; vws_svr_topic* topic;
+    sc_map_foreach(topics, name, topic)
+    {
+        sc_map_get_64(&topic->index, (uint64_t)cnx);
+
+        if (sc_map_found(&topic->index) == true)
+        {
+            names[count++] = vws_strdup(name);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        svr_topic_remove(cnx, names[i]);
+        vws.free(names[i]);
+    }
+
+    vws.free(names);
+}
+
+void svr_topic_free(vws_svr_topic* topic)
+{
+    sc_map_term_64(&topic->index);
+    vws.free(topic->cnxs);
+    vws.free(topic->name);
+    vws.free(topic);
+}
+
+void svr_topic_publish(vws_svr_loop* loop, vws_svr_data* data, bool batching)
+{
+    vws_svr_buffer* b    = data->shared;
+    vws_svr_topic* topic = sc_map_get_sv(&loop->topics, data->data);
 
-    while (true)
+    if (sc_map_found(&loop->topics) == true)
     {
-        //> Wait for arrival
+        // Every subscriber gets the same bytes
+        for (size_t i = 0; i < topic->size; i++)
+        {
+            vws_svr_cnx* cnx = topic->cnxs[i];
 
-        // This will put the thread to sleep on a condition variable until
-        // something arrives in queue.
-        vws_svr_data* request = queue_pop(&server->requests);
+            vws_svr_data* item = vws_svr_data_share(cnx, b, 0, b->size);
+            vws_set_flag(&item->flags, VM_SVR_DATA_MESSAGE);
 
-        // If there's no request (null request), check the server's state
-        if (request == NULL)
-        {
-            // If server is in halting state, return
-            if (server->state == VS_HALTING)
-            {
-                if (vws.tracelevel >= VT_THREAD)
-                {
-                    vws.trace(VL_INFO, "worker_thread(): Exiting");
-                }
+            uv_handle_t* handle = (uv_handle_t*)cnx->handle;
 
-                return;
+            if (handle == NULL || uv_is_closing(handle) != 0)
+            {
+                vws_svr_data_free(item);
             }
-            else
+            else if (batching == false)
             {
-                // If not halting, skip to the next iteration of the loop
-                continue;
+                loop->server->on_data_out(item);
+            }
+            else if (svr_cnx_hold(item) == false)
+            {
+                svr_batch_add(&loop->batches, item);
             }
         }
-
-        server->on_data_in(request);
     }
+
+    vws_svr_data_free(data);
 }
 
-void uv_thread(uv_async_t* handle)
+void svr_on_batch_write_complete(uv_write_t* req, int status)
 {
-    vws_tcp_svr* server = (vws_tcp_svr*)handle->data;
+    svr_write_batch* batch = (svr_write_batch*)req->data;
 
-    if (server->state == VS_HALTING)
+    svr_histogram_record( &svr_metrics(batch->cnx->server)->writes,
+                          uv_hrtime() - batch->started );
+
+    VWS_PROBE2(write_done, batch->cnx, status);
+
+    uint64_t now = 0;
+
+    for (size_t i = 0; i < batch->count; i++)
     {
-        if (vws.tracelevel >= VT_THREAD)
-        {
-            vws.trace(VL_INFO, "uv_thread(): stop");
-        }
+        vws_svr_data* data = batch->items[i];
 
-        // Join worker threads. Worker threads must all exit before we can
-        // shutdown libuv as they must release their mutexes and condition
-        // variables first, otherwise uv_stop() will not actually stop the loop.
-        for (int i = 0; i < server->pool_size; i++)
+        if (data->timing != NULL)
         {
-            uv_thread_join(&server->threads[i]);
+            now                     = (now == 0) ? uv_hrtime() : now;
+            data->timing->completed = now;
+
+            svr_sample_end(batch->cnx->server, data->timing);
+            data->timing = NULL;
         }
+    }
 
-        svr_shutdown(server);
+    // Write completions for a closed socket all come before its close callback,
+    // so the connection is still valid here.
+    if (batch->cnx->paused == true)
+    {
+        svr_cnx_check_backpressure(batch->cnx);
+    }
 
-        return;
+    for (size_t i = 0; i < batch->count; i++)
+    {
+        vws_svr_data_free(batch->items[i]);
     }
 
-    while (queue_empty(&server->responses) == false)
+    if (batch->items != batch->inline_items)
     {
-        vws_svr_data* data = queue_pop(&server->responses);
+        vws.free(batch->items);
+    }
 
-        if ((data == NULL) || (server->responses.state != VS_RUNNING))
-        {
-            return;
-        }
+    vws_svr_cnx* cnx = batch->cnx;
+    bool fragment    = batch->fragment;
 
-        if (vws_is_flag(&data->flags, VM_SVR_DATA_CLOSE))
-        {
-            // Close connection
-            svr_cnx_close(data->cnx);
-        }
-        else
-        {
-            server->on_data_out(data);
-        }
+    vws_pool_put(VP_SVR_WRITE, batch);
+
+    if (fragment == true)
+    {
+        // What was held for the fragment can go now
+        cnx->fragment_pending = false;
+        svr_cnx_pump(cnx);
     }
 }
 
-//------------------------------------------------------------------------------
-// Server API
-//------------------------------------------------------------------------------
-
-vws_svr_data* vws_svr_data_new(vws_svr_cnx* c, vws_buffer* buffer)
+void svr_on_close(uv_handle_t* handle)
 {
-    vws_svr_data* item = vws_svr_data_own(c, buffer->data, buffer->size);
+    vws_svr_cnx* cnx     = (vws_svr_cnx*)handle->data;
+    vws_tcp_svr* server  = cnx->server;
+    vws_svr_cnx_map* map = &cnx->loop->cnxs;
 
-    // We take ownership of buffer data so we clear the buffer.
-    buffer->data = NULL;
-    buffer->size = 0;
+    vws.trace(VL_INFO, "svr_on_close(): %p", handle);
 
-    return item;
-}
+    svr_count(&svr_metrics(server)->disconnections, 1);
 
-vws_svr_data* vws_svr_data_own(vws_svr_cnx* c, ucstr data, size_t size)
-{
-    vws_svr_data* item;
-    item = (vws_svr_data*)vws.malloc(sizeof(vws_svr_data));
+    // Remove from the index and the timer wheel
+    sc_map_del_64v(map, (uint64_t)handle);
+    svr_timer_remove(cnx);
+    cnx->handle = NULL;
 
-    item->cnx   = c;
-    item->size  = size;
-    item->data  = data;
-    item->flags = 0;
+    // Only the loop touches the TLS session and nothing more will be sent
+    // or received, so it can go now.
+    if (cnx->ssl != NULL)
+    {
+        SSL_free(cnx->ssl);
+        cnx->ssl = NULL;
+    }
 
-    return item;
-}
+    #if defined(VWS_SHM)
+    // Likewise shared memory
+    svr_shm_close(cnx);
+    #endif
 
-void vws_svr_data_free(vws_svr_data* t)
-{
-    if (t != NULL)
+    if ((server->state == VS_RUNNING) && (server->inetd_mode == 0))
     {
-        vws.free(t->data);
-        vws.free(t);
+        // The connection's worker may still have requests for it, and
+        // their responses may still be on the way back. Send a release
+        // through the worker. When it comes back out of the response
+        // queue nothing else refers to the connection.
+        vws_svr_data* release = vws_svr_data_own(cnx, NULL, 0);
+        vws_set_flag(&release->flags, VM_SVR_DATA_RELEASE);
+        svr_cnx_queue(cnx, release);
     }
-}
+    else if ((server->state == VS_HALTING) && (server->inetd_mode == 0))
+    {
+        // Workers may still be finishing requests for the connection and
+        // the queues no longer carry releases. Park it in the map under
+        // its own address. It is released with the others once the
+        // workers are gone.
+        sc_map_put_64v(map, (uint64_t)cnx, cnx);
+    }
+    else
+    {
+        // Call on_disconnect() handler
+        server->on_disconnect(cnx);
 
-vws_tcp_svr* vws_tcp_svr_new(int num_threads, int backlog, int queue_size)
-{
-    vws_tcp_svr* server = vws.malloc(sizeof(vws_tcp_svr));
-    return tcp_svr_ctor(server, num_threads, backlog, queue_size);
-}
+        // Cleanup
+        svr_cnx_free(cnx);
+    }
 
-uint8_t vws_tcp_svr_state(vws_tcp_svr* server)
-{
-    return server->state;
+    svr_on_stream_close(handle);
+
+    // If we are running in inetd mode, there is only one socket and its closing
+    // means we are done and should exit process.
+    if ((server->inetd_mode == 1) && (server->state == VS_RUNNING))
+    {
+        vws_tcp_svr_inetd_stop(server);
+    }
 }
 
-void vws_tcp_svr_free(vws_tcp_svr* server)
+void svr_timer_start(vws_svr_loop* loop)
 {
-    if (server == NULL)
+    vws_tcp_svr* server = loop->server;
+
+    if (server->keepalive == 0 && server->idle_timeout == 0)
     {
         return;
     }
 
-    tcp_svr_dtor(server);
-    vws.free(server);
+    if (uv_is_active((uv_handle_t*)loop->timer) == 0)
+    {
+        uv_timer_start( loop->timer,
+                        svr_on_tick,
+                        VWS_SVR_TIMER_TICK,
+                        VWS_SVR_TIMER_TICK );
+    }
 }
 
-int vws_tcp_svr_send(vws_tcp_svr* server, vws_svr_data* data)
+void svr_timer_add(vws_svr_cnx* cnx)
 {
-    queue_push(&server->responses, data);
-
-    // Notify event loop about the new response
-    uv_async_send(server->wakeup);
+    vws_tcp_svr* server = cnx->server;
+    vws_svr_loop* loop  = cnx->loop;
+    uint64_t now        = uv_now(loop->loop);
+    uint64_t due        = UINT64_MAX;
 
-    return 0;
-}
+    if (server->keepalive > 0)
+    {
+        // Once a keepalive is out, look again later in case the connection
+        // has been read from and gone quiet again by then.
+        due = cnx->keepalive_sent ? now + server->keepalive
+                                  : cnx->last_read + server->keepalive;
+    }
 
-int vws_tcp_svr_run(vws_tcp_svr* server, cstr host, int port)
-{
-    if (vws.tracelevel >= VT_SERVICE)
+    if (server->idle_timeout > 0)
     {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%p): Starting worker %i threads",
-                   server,
-                   server->pool_size );
+        uint64_t idle = cnx->last_read + server->idle_timeout;
+        due           = (idle < due) ? idle : due;
     }
 
-    for (int i = 0; i < server->pool_size; i++)
+    if (due == UINT64_MAX)
     {
-        uv_thread_create(&server->threads[i], worker_thread, server);
+        return;
     }
 
-    //> Create listening socket
+    // Round up to whole ticks. Anything past one turn of the wheel goes in
+    // the furthest slot and is put back again when it comes round.
+    uint64_t ticks = 1;
 
-    uv_tcp_t* socket = vws.malloc(sizeof(uv_tcp_t));
+    if (due > now)
+    {
+        ticks = (due - now + VWS_SVR_TIMER_TICK - 1) / VWS_SVR_TIMER_TICK;
+        ticks = (ticks == 0) ? 1 : ticks;
+    }
 
-    uv_tcp_init(server->loop, socket);
-    socket->data = server;
+    if (ticks >= VWS_SVR_TIMER_SLOTS)
+    {
+        ticks = VWS_SVR_TIMER_SLOTS - 1;
+    }
 
-    //> Bind to address
+    uint32_t slot = (loop->wheel_cursor + ticks) & (VWS_SVR_TIMER_SLOTS - 1);
 
-    int rc;
-    struct sockaddr_in addr;
-    uv_ip4_addr(host, port, &addr);
-    rc = uv_tcp_bind(socket, (const struct sockaddr*)&addr, 0);
+    cnx->timer_slot = (int32_t)slot;
+    cnx->timer_prev = NULL;
+    cnx->timer_next = loop->wheel[slot];
 
-    if (vws.tracelevel >= VT_SERVICE)
+    if (cnx->timer_next != NULL)
     {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%p): Bind %s:%lu",
-                   server, host, port );
+        cnx->timer_next->timer_prev = cnx;
     }
 
-    if (rc)
+    loop->wheel[slot] = cnx;
+}
+
+void svr_timer_remove(vws_svr_cnx* cnx)
+{
+    if (cnx->timer_slot < 0)
     {
-        vws.error(VE_RT, "Bind error %s", uv_strerror(rc));
-        return -1;
+        return;
     }
 
-    //> Listen
-
-    rc = uv_listen((uv_stream_t*)socket, server->backlog, svr_on_connect);
-
-    if (rc)
+    if (cnx->timer_prev != NULL)
     {
-        vws.error(VE_RT, "Listen error %s", uv_strerror(rc));
-        return -1;
+        cnx->timer_prev->timer_next = cnx->timer_next;
+    }
+    else
+    {
+        cnx->loop->wheel[cnx->timer_slot] = cnx->timer_next;
     }
 
-    if (vws.tracelevel >= VT_SERVICE)
+    if (cnx->timer_next != NULL)
     {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%s): Listen %s:%lu",
-                   server, host, port );
+        cnx->timer_next->timer_prev = cnx->timer_prev;
     }
 
-    //> Start server
+    cnx->timer_slot = -1;
+    cnx->timer_next = NULL;
+    cnx->timer_prev = NULL;
+}
 
-    // Set state to running
-    server->state = VS_RUNNING;
+void svr_on_tick(uv_timer_t* handle)
+{
+    vws_svr_loop* loop  = (vws_svr_loop*)handle->data;
+    vws_tcp_svr* server = loop->server;
+    uint64_t now        = uv_now(loop->loop);
 
-    if (vws.tracelevel >= VT_SERVICE)
+    // Take the whole slot. Connections go back into later slots as they are
+    // checked.
+    uint32_t slot     = loop->wheel_cursor;
+    vws_svr_cnx* next = loop->wheel[slot];
+    loop->wheel[slot] = NULL;
+
+    while (next != NULL)
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_run(%s): Starting uv_run()", server);
-    }
+        vws_svr_cnx* cnx = next;
+        next             = cnx->timer_next;
 
-    // Run UV loop. This runs indefinitely, passing network I/O and and out of
-    // system until server is shutdown by vws_tcp_svr_stop() (by external
-    // thread).
-    uv_run(server->loop, UV_RUN_DEFAULT);
+        cnx->timer_slot = -1;
+        cnx->timer_next = NULL;
+        cnx->timer_prev = NULL;
 
-    //> Shutdown server
+        uv_handle_t* h = (uv_handle_t*)cnx->handle;
 
-    // Close the listening socket handle
-    uv_close((uv_handle_t*)socket, svr_on_close);
+        if (h == NULL || uv_is_closing(h) != 0)
+        {
+            continue;
+        }
 
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "vws_tcp_svr_run(%p): Shutdown complete", server);
-    }
+        uint64_t quiet = now - cnx->last_read;
 
-    // Set state to halted
-    server->state = VS_HALTED;
+        if (server->idle_timeout > 0 && quiet >= server->idle_timeout)
+        {
+            if (vws.tracelevel >= VT_SERVICE)
+            {
+                vws.trace(VL_INFO, "svr_on_tick(%p): idle timeout", h);
+            }
 
-    return 0;
+            uv_close(h, svr_on_close);
+            continue;
+        }
+
+        if (server->keepalive > 0 && cnx->keepalive_sent == false)
+        {
+            if (quiet >= server->keepalive)
+            {
+                cnx->keepalive_sent = true;
+                server->on_keepalive(cnx);
+            }
+        }
+
+        svr_timer_add(cnx);
+    }
+
+    loop->wheel_cursor = (slot + 1) & (VWS_SVR_TIMER_SLOTS - 1);
 }
 
-void vws_tcp_svr_stop(vws_tcp_svr* server)
+void svr_on_handle_close(uv_handle_t* handle)
 {
-    // Set shutdown flags
-    server->state           = VS_HALTING;
-    server->requests.state  = VS_HALTING;
-    server->responses.state = VS_HALTING;
+    vws.free(handle);
+}
 
-    // Wakeup all worker threads
-    if (vws.tracelevel >= VT_SERVICE)
+void svr_on_stream_close(uv_handle_t* handle)
+{
+    if (handle->type == UV_TCP)
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop worker threads");
+        vws_pool_put(VP_SVR_TCP, handle);
     }
-
-    uv_mutex_lock(&server->requests.mutex);
-    uv_cond_broadcast(&server->requests.cond);
-    uv_mutex_unlock(&server->requests.mutex);
-
-    // Wakeup the main event loop to shutdown main thread
-    if (vws.tracelevel >= VT_SERVICE)
+    else
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop main thread");
+        vws.free(handle);
     }
+}
 
-    uv_async_send(server->wakeup);
+void svr_on_realloc(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+{
+    vws_svr_cnx* cnx = (vws_svr_cnx*)handle->data;
 
-    while (server->state != VS_HALTED)
-    {
-        sleep(1);
-    }
+    // Ignore the suggested size. We always offer the full read buffer.
+    *buf = cnx->loop->read_buffer;
 }
 
-int vws_tcp_svr_inetd_run(vws_tcp_svr* server, int sockfd)
+void svr_tls_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
 {
-    if (sockfd < 0)
+    vws_tcp_svr* server = cnx->server;
+    uv_stream_t* handle = cnx->handle;
+
+    // The memory BIO copies the ciphertext, which frees up the read buffer to
+    // take the plaintext.
+    BIO_write(SSL_get_rbio(cnx->ssl), buf->base, (int)size);
+
+    int n;
+    while ((n = SSL_read(cnx->ssl, buf->base, (int)buf->len)) > 0)
     {
-        vws.error(VE_RT, "Invalid server or socket descriptor provided");
-        return 1;
+        uv_buf_t plain = uv_buf_init(buf->base, n);
+        server->on_read(cnx, n, &plain);
     }
 
-    if (vws.tracelevel >= VT_SERVICE)
+    int err = SSL_get_error(cnx->ssl, n);
+
+    // Send whatever the session has to say: handshake messages, session
+    // tickets, alerts.
+    svr_tls_flush(cnx);
+
+    if (err == SSL_ERROR_WANT_READ)
     {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%p): Starting worker %i threads",
-                   server,
-                   server->pool_size );
+        // Needs more ciphertext
+        return;
     }
 
-    for (int i = 0; i < server->pool_size; i++)
+    if (err != SSL_ERROR_ZERO_RETURN && vws.tracelevel >= VT_SERVICE)
     {
-        uv_thread_create(&server->threads[i], worker_thread, server);
+        char msg[256];
+        ERR_error_string_n(ERR_get_error(), msg, sizeof(msg));
+        vws.trace(VL_WARN, "svr_tls_read(%p): %s", cnx, msg);
     }
 
-    // Go into non-blocking mode as we are using poll() for socket_read() and
-    // socket_write().
-    if (vws_socket_set_nonblocking(sockfd) == false)
+    ERR_clear_error();
+
+    // Peer sent close_notify or the session failed
+    if (uv_is_closing((uv_handle_t*)handle) == 0)
     {
-        vws.error(VE_RT, "Failed to set socket to nonblocking");
-        return 1;
+        uv_close((uv_handle_t*)handle, svr_on_close);
     }
+}
 
-    // Set to inetd mode
-    server->inetd_mode = 1;
+bool svr_tls_write( SSL* ssl,
+                    unsigned char* chunk,
+                    size_t* used,
+                    const void* data,
+                    size_t size )
+{
+    if (data != NULL && *used + size <= SVR_TLS_RECORD)
+    {
+        memcpy(chunk + *used, data, size);
+        *used += size;
 
-    // Initialize and adopt the existing socket descriptor.
-    uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+        return true;
+    }
 
-    if (uv_tcp_init(server->loop, c))
+    if (*used > 0)
     {
-        // Handle uv_tcp_init failure.
-        vws.error(VE_RT, "Failed to initialize new TCP handle");
-        vws.free(c);
-        return 1;
+        if (SSL_write(ssl, chunk, (int)*used) <= 0)
+        {
+            return false;
+        }
+
+        *used = 0;
     }
 
-    if (uv_tcp_open(c, sockfd))
+    if (data == NULL)
     {
-        // Handle uv_tcp_open failure.
-        vws.error(VE_RT, "Failed to adopt the socket descriptor.");
-        vws.free(c);
-        return 1;
+        return true;
     }
 
-    // Associate server with this handle for callbacks.
-    c->data = server;
-
-    if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
+    if (size < SVR_TLS_RECORD)
     {
-        vws.error(VE_RT, "Failed to start reading from client");
-        vws.free(c);
-        return 1;
+        memcpy(chunk, data, size);
+        *used = size;
+
+        return true;
     }
 
-    //> Add connection to registry and initialize
+    // Large payloads go straight in
+    return SSL_write(ssl, data, (int)size) > 0;
+}
+
+bool svr_tls_encrypt(svr_write_batch* batch)
+{
+    SSL* ssl    = batch->cnx->ssl;
+    bool ok     = true;
+    size_t used = 0;
+    unsigned char chunk[SVR_TLS_RECORD];
 
-    vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
+    // A sampled response's timing moves to the records. One item can carry
+    // only one, so any others in the batch end here.
+    vws_svr_timing* timing = NULL;
 
-    if (svr_cnx_map_set(&server->cnxs, (uv_stream_t*)c, cnx) == false)
+    for (size_t i = 0; i < batch->count; i++)
     {
-        vws.error(VE_FATAL, "Connection already registered");
-    }
+        vws_svr_data* data = batch->items[i];
 
-    //> Call svr_on_connect() handler
+        if (data->timing != NULL && timing == NULL)
+        {
+            timing       = data->timing;
+            data->timing = NULL;
+        }
+        else if (data->timing != NULL)
+        {
+            svr_sample_end(batch->cnx->server, data->timing);
+            data->timing = NULL;
+        }
 
-    server->on_connect(cnx);
+        if (ok == true && data->header_size > 0)
+        {
+            ok = svr_tls_write(ssl, chunk, &used, data->header, data->header_size);
+        }
 
-    // Now, the handle is associated with the socket and is ready to be used.
-    // Start the libuv loop.
-    uv_run(server->loop, UV_RUN_DEFAULT);
+        if (ok == true && data->size > 0)
+        {
+            ok = svr_tls_write(ssl, chunk, &used, data->data, data->size);
+        }
 
-    return 0;
-}
+        vws_svr_data_free(data);
+    }
 
-void vws_tcp_svr_inetd_stop(vws_tcp_svr* server)
-{
-    // Set shutdown flags
-    server->state           = VS_HALTING;
-    server->requests.state  = VS_HALTING;
-    server->responses.state = VS_HALTING;
+    batch->count = 0;
 
-    // Stop the loop. We have not more I/O to deal with. We don't want the loop
-    // to run any more for any reason.
-    uv_stop(server->loop);
+    if (ok == true)
+    {
+        ok = svr_tls_write(ssl, chunk, &used, NULL, 0);
+    }
 
-    // Wakeup all worker threads
-    if (vws.tracelevel >= VT_SERVICE)
+    if (ok == false)
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop worker threads");
+        vws.free(timing);
+        ERR_clear_error();
+        return false;
     }
 
-    uv_mutex_lock(&server->requests.mutex);
-    uv_cond_broadcast(&server->requests.cond);
-    uv_mutex_unlock(&server->requests.mutex);
+    // Collect the records into one response
+    BIO* wbio   = SSL_get_wbio(ssl);
+    size_t size = BIO_ctrl_pending(wbio);
 
-    // Wakeup the main event loop to shutdown main thread
-    if (vws.tracelevel >= VT_SERVICE)
+    if (size > 0)
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop main thread");
+        ucstr records = vws.malloc(size);
+        BIO_read(wbio, records, (int)size);
+        vws_svr_data* item = vws_svr_data_own(batch->cnx, records, size);
+        item->timing       = timing;
+
+        batch->items[batch->count++] = item;
+    }
+    else if (timing != NULL)
+    {
+        svr_sample_end(batch->cnx->server, timing);
     }
 
-    // Wait for all threads to complete
-    uv_thread(server->wakeup);
+    return true;
+}
 
-    if (vws.tracelevel >= VT_SERVICE)
+void svr_tls_flush(vws_svr_cnx* cnx)
+{
+    if (BIO_ctrl_pending(SSL_get_wbio(cnx->ssl)) > 0)
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): done");
+        // An empty batch picks up the pending records when it is encrypted
+        svr_batch_send(svr_batch_new(cnx));
     }
-
-    // Set state to halted
-    server->state = VS_HALTED;
 }
 
 //------------------------------------------------------------------------------
-// Server construction / destruction
+// Metrics
 //------------------------------------------------------------------------------
 
-vws_tcp_svr* tcp_svr_ctor(vws_tcp_svr* svr, int nt, int backlog, int queue_size)
+// The calling thread's metrics and the server they belong to
+static __thread vws_tcp_svr* svr_metrics_owner     = NULL;
+static __thread vws_svr_metrics* svr_metrics_local = NULL;
+
+vws_svr_metrics* svr_metrics_new()
 {
-    if (backlog == 0)
-    {
-        backlog = 128;
-    }
+    return vws.calloc(1, sizeof(vws_svr_metrics));
+}
 
-    if (queue_size == 0)
+void svr_metrics_bind(vws_tcp_svr* server, vws_svr_metrics* m)
+{
+    svr_metrics_owner = server;
+    svr_metrics_local = m;
+}
+
+vws_svr_metrics* svr_metrics(vws_tcp_svr* server)
+{
+    if (svr_metrics_owner == server)
     {
-        queue_size = 1024;
+        return svr_metrics_local;
     }
 
-    svr->threads       = vws.malloc(sizeof(uv_thread_t) * nt);
-    svr->pool_size     = nt;
-    svr->on_connect    = svr_client_connect;
-    svr->on_disconnect = svr_client_disconnect;
-    svr->on_read       = svr_client_read;
-    svr->on_data_in    = svr_client_data_in;
-    svr->on_data_out   = svr_client_data_out;
-    svr->backlog       = backlog;
-    svr->loop          = (uv_loop_t*)vws.malloc(sizeof(uv_loop_t));
-    svr->state         = VS_HALTED;
-    svr->trace         = vws.tracelevel;
-    svr->inetd_mode    = 0;
-
-    uv_loop_init(svr->loop);
-    sc_map_init_64v(&svr->cnxs, 0, 0);
-    queue_init(&svr->requests, queue_size, "requests");
-    queue_init(&svr->responses, queue_size, "responses");
-
-    svr->wakeup = vws.malloc(sizeof(uv_async_t));
-    svr->wakeup->data = svr;
-    uv_async_init(svr->loop, svr->wakeup, uv_thread);
+    return server->metrics;
+}
 
-    return svr;
+void svr_count(uint64_t* counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-void on_uv_close(uv_handle_t* handle)
+/**
+ * @brief Gets the histogram bucket for a value.
+ *
+ * @param value The value.
+ * @return The bucket index.
+ */
+static size_t histogram_bucket(uint64_t value)
 {
-    if (handle != NULL)
+    if (value < VWS_SVR_HIST_SUB)
     {
-        // As a policy we don't put heap data on handle->data. If that is ever
-        // done then it must be freed in the appropriate place. It is ignored
-        // here because it's impossible to tell what it is by the very nature of
-        // uv_handle_t. We will generate a warning however.
-        if (handle->data != NULL)
-        {
-            vws.trace( VL_WARN,
-                       "on_uv_close(): libuv resource not properly freed: %p",
-                       (void*)handle->data );
-        }
+        return (size_t)value;
     }
-}
 
-void on_uv_walk(uv_handle_t* handle, void* arg)
-{
-    vws.trace(VL_INFO, "on_uv_walk(): %p", (void*)handle);
+    // The top bit picks the power of two, the three below it the sub-bucket
+    int top      = 63 - __builtin_clzll(value);
+    size_t index = (size_t)(top - 2) * VWS_SVR_HIST_SUB
+                 + ((value >> (top - 3)) & (VWS_SVR_HIST_SUB - 1));
 
-    // If this handle has not been closed, it should have been. Nevertheless we
-    // will make an attempt to close it.
-    if (uv_is_closing(handle) == 0)
+    if (index >= VWS_SVR_HIST_BUCKETS)
     {
-        uv_close(handle, (uv_close_cb)on_uv_close);
+        index = VWS_SVR_HIST_BUCKETS - 1;
     }
+
+    return index;
 }
 
-void tcp_svr_dtor(vws_tcp_svr* svr)
+/**
+ * @brief Gets the largest value that falls in a histogram bucket.
+ *
+ * @param index The bucket index.
+ * @return The value.
+ */
+static uint64_t histogram_upper(size_t index)
 {
-    //> Stop/shutdown server
-
-    if (svr->state == VS_RUNNING)
+    if (index < VWS_SVR_HIST_SUB)
     {
-        vws_tcp_svr_stop(svr);
+        return index;
     }
 
-    svr_shutdown(svr);
-    vws.free(svr->threads);
+    int top        = (int)(index / VWS_SVR_HIST_SUB) + 2;
+    uint64_t sub   = index % VWS_SVR_HIST_SUB;
+    uint64_t width = 1ULL << (top - 3);
 
-    // Close the server async handle
-    uv_close((uv_handle_t*)svr->wakeup, svr_on_close);
+    return ((VWS_SVR_HIST_SUB + sub) << (top - 3)) + width - 1;
+}
 
-    //> Shutdown libuv
+void svr_histogram_record(vws_svr_histogram* h, uint64_t value)
+{
+    svr_count(&h->buckets[histogram_bucket(value)], 1);
+    svr_count(&h->count, 1);
+    svr_count(&h->sum, value);
 
-    // Walk the loop to close everything
-    uv_walk(svr->loop, on_uv_walk, NULL);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
 
-    while (uv_loop_close(svr->loop))
+    while (value > max)
     {
-        // Run the loop until there are no more active handles
-        while (uv_loop_alive(svr->loop))
+        if (__atomic_compare_exchange_n( &h->max, &max, value, true,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED ))
         {
-            uv_run(svr->loop, UV_RUN_DEFAULT);
+            break;
         }
     }
-
-    // Free loop
-    vws.free(svr->loop);
-
-    // Free connection map
-    svr_cnx_map_clear(&svr->cnxs);
-    sc_map_term_64v(&svr->cnxs);
 }
 
-//------------------------------------------------------------------------------
-// Client connection callbacks
-//------------------------------------------------------------------------------
-
-void svr_client_connect(vws_svr_cnx* c)
+uint64_t vws_svr_histogram_percentile(const vws_svr_histogram* h, double p)
 {
-    if (vws.tracelevel >= VT_SERVICE)
+    if (h->count == 0)
     {
-        vws.trace(VL_INFO, "svr_client_connect(%p)", c->handle);
+        return 0;
     }
-}
 
-void svr_client_disconnect(vws_svr_cnx* c)
-{
-    if (vws.tracelevel >= VT_SERVICE)
+    // The rank of the value we want, counting from 1
+    uint64_t rank = (uint64_t)((p / 100.0) * (double)h->count + 0.5);
+
+    if (rank < 1)
     {
-        vws.trace(VL_INFO, "svr_client_disconnect(%p)", c->handle);
+        rank = 1;
     }
-}
 
-void svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf)
-{
-    vws_tcp_svr* server = c->server;
+    uint64_t seen = 0;
 
-    // Queue data to worker pool for processing
-    vws_svr_data* data = vws_svr_data_own(c, (ucstr)buf->base, size);
-    queue_push(&server->requests, data);
-}
+    for (size_t i = 0; i < VWS_SVR_HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
 
-void svr_client_data_in(vws_svr_data* req)
-{
-    vws_tcp_svr* server = req->cnx->server;
+        if (seen >= rank)
+        {
+            uint64_t upper = histogram_upper(i);
+            return (upper < h->max) ? upper : h->max;
+        }
+    }
 
-    // Default: Do nothing. Drop data.
-    vws_svr_data_free(req);
+    return h->max;
 }
 
-void svr_client_data_out(vws_svr_data* data)
+/**
+ * @brief Adds one histogram into another.
+ *
+ * @param to The total.
+ * @param from The histogram to add.
+ */
+static void histogram_merge(vws_svr_histogram* to, vws_svr_histogram* from)
 {
-    if (data->size == 0)
+    to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum   += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+
+    if (max > to->max)
     {
-        vws.trace(VL_INFO, "svr_client_data_out(): no data");
-        vws.error(VL_WARN, "svr_client_data_out(): no data");
-        return;
+        to->max = max;
     }
 
-    uv_buf_t buf    = uv_buf_init(data->data, data->size);
-    uv_write_t* req = (uv_write_t*)vws.malloc(sizeof(uv_write_t));
-    req->data       = data;
-
-    uv_write(req, data->cnx->handle, &buf, 1, svr_on_write_complete);
+    for (size_t i = 0; i < VWS_SVR_HIST_BUCKETS; i++)
+    {
+        to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+    }
 }
 
-//------------------------------------------------------------------------------
-// Server Utilities
-//------------------------------------------------------------------------------
-
-vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key)
+void svr_metrics_merge(vws_svr_metrics* to, vws_svr_metrics* from)
 {
-    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
-
-    // If entry exists
-    if (sc_map_found(map) == true)
+    #define MERGE(field) \
+        to->field += __atomic_load_n(&from->field, __ATOMIC_RELAXED)
+
+    MERGE(connections);
+    MERGE(disconnections);
+    MERGE(bytes_in);
+    MERGE(bytes_out);
+    MERGE(requests);
+    MERGE(responses);
+    MERGE(steals);
+    MERGE(immediate_writes);
+    MERGE(expired);
+    MERGE(wakeups);
+
+    for (int i = 0; i < VWS_SVR_OPCODES; i++)
     {
-        return cnx;
+        MERGE(frames_in[i]);
+        MERGE(frames_out[i]);
+        MERGE(messages_in[i]);
+        MERGE(messages_out[i]);
     }
 
-    return NULL;
+    #undef MERGE
+
+    histogram_merge(&to->requests_wait, &from->requests_wait);
+    histogram_merge(&to->responses_wait, &from->responses_wait);
+    histogram_merge(&to->processing, &from->processing);
+    histogram_merge(&to->writes, &from->writes);
 }
 
-void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key)
+void vws_tcp_svr_metrics(vws_tcp_svr* server, vws_svr_metrics* out)
 {
-    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
+    memset(out, 0, sizeof(vws_svr_metrics));
 
-    // If entry exists
-    if (sc_map_found(map) == true)
+    svr_metrics_merge(out, server->metrics);
+
+    for (int i = 0; i < server->loop_count; i++)
     {
-        sc_map_del_64v(map, (uint64_t)key);
+        vws_svr_loop* loop = &server->loops[i];
+        svr_metrics_merge(out, loop->metrics);
 
-        // Call on_disconnect() handler
-        cnx->server->on_disconnect(cnx);
+        out->responses_depth += queue_depth(&loop->responses);
+        out->responses_depth += queue_depth(&loop->priority);
+    }
 
-        // Cleanup
-        vws.free(cnx);
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        vws_svr_worker* worker = &server->workers[i];
+        svr_metrics_merge(out, worker->metrics);
+
+        out->requests_depth += queue_depth(&worker->requests);
     }
 }
 
-int8_t svr_cnx_map_set( vws_svr_cnx_map* map,
-                        uv_stream_t* key,
-                        vws_svr_cnx* value )
+void svr_sample_start(vws_svr_cnx* c, vws_svr_data* data)
 {
-    // See if we have an existing entry
-    sc_map_get_64v(map, (uint64_t)key);
+    vws_tcp_svr* server = c->server;
+    vws_svr_loop* loop  = c->loop;
 
-    if (sc_map_found(map) == true)
+    if (server->sample_rate == 0 || server->on_sample == NULL)
     {
-        // Exsiting entry. Return false.
-        return 0;
+        return;
     }
 
-    sc_map_put_64v(map, (uint64_t)key, value);
+    if (++loop->sample_count < server->sample_rate)
+    {
+        return;
+    }
 
-    // True
-    return 1;
+    loop->sample_count = 0;
+    data->timing       = vws.calloc(1, sizeof(vws_svr_timing));
+    data->timing->read = loop->read_time;
 }
 
-void svr_cnx_map_clear(vws_svr_cnx_map* map)
+void svr_sample_end(vws_tcp_svr* server, vws_svr_timing* t)
 {
-    uint64_t key; vws_svr_cnx* cnx;
-    sc_map_foreach(map, key, cnx)
-    {
-        cnx->server->on_disconnect(cnx);
-        vws.free(cnx);
-    }
-
-    sc_map_clear_64v(map);
+    server->on_sample(server, t);
+    vws.free(t);
 }
 
-vws_svr_cnx* svr_cnx_new(vws_tcp_svr* s, uv_stream_t* handle)
+//------------------------------------------------------------------------------
+// Queue API
+//------------------------------------------------------------------------------
+
+void queue_init(vws_svr_queue* queue, int size, cstr name)
 {
-    vws_svr_cnx* cnx = vws.malloc(sizeof(vws_svr_cnx));
-    cnx->server      = s;
-    cnx->handle      = handle;
-    cnx->data        = NULL;
-    cnx->format      = VM_MPACK_FORMAT;
+    // Capacity must be a power of two so positions can be masked
+    size_t capacity = 1;
+    while (capacity < (size_t)size)
+    {
+        capacity <<= 1;
+    }
 
-    // Initialize HTTP state
-    cnx->upgraded    = false;
-    cnx->http        = vws_http_msg_new(HTTP_REQUEST);
+    size_t bytes    = capacity * sizeof(vws_svr_queue_cell);
+    queue->buffer   = (vws_svr_queue_cell*)vws.malloc(bytes);
+    queue->capacity = capacity;
+    queue->head     = 0;
+    queue->tail     = 0;
+    queue->waiting  = 0;
+    queue->blocked  = 0;
+    queue->state    = VS_RUNNING;
+    queue->name     = vws_strdup(name);
 
-    return cnx;
+    // Each cell starts out writable for the position that maps to it
+    for (size_t i = 0; i < capacity; i++)
+    {
+        queue->buffer[i].seq  = i;
+        queue->buffer[i].data = NULL;
+    }
+
+    // Initialize mutex and condition variables
+    uv_mutex_init(&queue->mutex);
+    uv_cond_init(&queue->cond);
+    uv_cond_init(&queue->space);
 }
 
-void svr_cnx_free(vws_svr_cnx* c)
+void queue_destroy(vws_svr_queue* queue)
 {
-    if (c != NULL)
+    if (queue->buffer != NULL)
     {
-        if (c->http != NULL)
+        // Whatever was still waiting when the server stopped
+        vws_svr_data* data;
+        while ((data = queue_try_pop(queue)) != NULL)
         {
-            vws_http_msg_free(c->http);
+            queue_drop(data);
         }
 
-        vws.free(c);
+        vws.free(queue->name);
+        uv_mutex_destroy(&queue->mutex);
+        uv_cond_destroy(&queue->cond);
+        uv_cond_destroy(&queue->space);
+        vws.free(queue->buffer);
+        queue->buffer = NULL;
+        queue->state  = VS_HALTED;
     }
 }
 
-void svr_cnx_close(vws_svr_cnx* c)
+void queue_drop(vws_svr_data* data)
 {
-    vws_tcp_svr_close(c);
-}
+    vws_svr_cnx* cnx = data->cnx;
 
-void svr_shutdown(vws_tcp_svr* server)
-{
-    if (server->state == VS_HALTED)
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_RUN))
     {
+        vws_svr_data_free(data);
+
+        // The turn never came. Nothing follows a release, so stop there.
+        while (sc_queue_size(&cnx->run) > 0)
+        {
+            vws_svr_data* request = sc_queue_del_last(&cnx->run);
+            bool last = vws_is_flag(&request->flags, VM_SVR_DATA_RELEASE);
+
+            queue_drop(request);
+
+            if (last == true)
+            {
+                break;
+            }
+        }
+
         return;
     }
 
-    if (vws.tracelevel >= VT_SERVICE)
+    if (vws_is_flag(&data->flags, VM_SVR_DATA_RELEASE))
     {
-        vws.trace(VL_INFO, "svr_shutdown(%p): Shutdown starting", server);
-    }
+        vws_svr_data_free(data);
 
-    // Cleanup libuv
-    queue_destroy(&server->requests);
-    queue_destroy(&server->responses);
+        cnx->server->on_disconnect(cnx);
+        svr_topic_remove_all(cnx);
+        svr_cnx_free(cnx);
 
-    // Stop the loop. This will cause uv_run() to return in vws_tcp_svr_run()
-    // which will also return.
-    uv_stop(server->loop);
+        return;
+    }
+
+    vws_svr_data_free(data);
 }
 
-void svr_on_connect(uv_stream_t* socket, int status)
+void queue_halt(vws_svr_queue* queue)
 {
-    vws_tcp_svr* server = (vws_tcp_svr*) socket->data;
-
-    if (status < 0)
-    {
-        cstr e = uv_strerror(status);
-        vws.error(VE_RT, "Error in connection callback: %s", e);
-        return;
-    }
+    uv_mutex_lock(&queue->mutex);
+    queue->state = VS_HALTING;
+    uv_cond_broadcast(&queue->cond);
+    uv_cond_broadcast(&queue->space);
+    uv_mutex_unlock(&queue->mutex);
+}
 
-    uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+bool queue_try_push(vws_svr_queue* queue, vws_svr_data* data)
+{
+    size_t mask = queue->capacity - 1;
+    size_t pos  = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
 
-    if (c == NULL)
+    while (true)
     {
-        vws.error(VE_RT, "Failed to allocate memory for client");
-        return;
-    }
+        vws_svr_queue_cell* cell = &queue->buffer[pos & mask];
+        size_t seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t df = (intptr_t)seq - (intptr_t)pos;
 
-    c->data = server;
+        if (df == 0)
+        {
+            // Slot is free. Claim it.
+            if (__atomic_compare_exchange_n( &queue->tail, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED ))
+            {
+                cell->data = data;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-    if (uv_tcp_init(server->loop, c) != 0)
-    {
-        vws.error(VE_RT, "Failed to initialize client");
-        return;
-    }
+                return true;
+            }
 
-    if (uv_accept(socket, (uv_stream_t*)c) == 0)
-    {
-        if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
+            // Lost the race, pos has been reloaded
+        }
+        else if (df < 0)
         {
-            vws.error(VE_RT, "Failed to start reading from client");
-            return;
+            // Slot still holds data from one lap ago: full
+            return false;
+        }
+        else
+        {
+            // Another producer got here first
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
         }
     }
-    else
+}
+
+vws_svr_data* queue_try_pop(vws_svr_queue* queue)
+{
+    size_t mask = queue->capacity - 1;
+    size_t pos  = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    while (true)
     {
-        uv_close((uv_handle_t*)c, svr_on_close);
-    }
+        vws_svr_queue_cell* cell = &queue->buffer[pos & mask];
+        size_t seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t df = (intptr_t)seq - (intptr_t)(pos + 1);
 
-    //> Add connection to registry and initialize
+        if (df == 0)
+        {
+            // Slot is ready. Claim it.
+            if (__atomic_compare_exchange_n( &queue->head, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED ))
+            {
+                vws_svr_data* data = cell->data;
 
-    vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
+                // Make the slot writable for the next lap
+                __atomic_store_n(&cell->seq, pos + mask + 1, __ATOMIC_RELEASE);
 
-    if (svr_cnx_map_set(&server->cnxs, (uv_stream_t*)c, cnx) == false)
-    {
-        vws.error(VE_FATAL, "Connection already registered");
-    }
+                VWS_PROBE2(queue_pop, queue->name, data);
 
-    //> Call svr_on_connect() handler
+                // Wake a producer blocked on a full queue
+                queue_wake(queue, &queue->space, &queue->blocked);
 
-    server->on_connect(cnx);
+                return data;
+            }
+        }
+        else if (df < 0)
+        {
+            // Empty
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
 }
 
-void svr_on_read(uv_stream_t* c, ssize_t nread, const uv_buf_t* buf)
+size_t queue_pop_batch(vws_svr_queue* queue, vws_svr_data** items, size_t max)
 {
-    vws_tcp_svr* server = (vws_tcp_svr*)c->data;
+    size_t mask = queue->capacity - 1;
+    size_t pos  = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
 
-    if (nread < 0)
+    while (true)
     {
-        uv_close((uv_handle_t*)c, svr_on_close);
-        vws.free(buf->base);
-        return;
-    }
+        // Count the slots ready from the head on
+        size_t n = 0;
 
-    struct sc_map_64v* map = &server->cnxs;
-    vws_svr_cnx* cnx       = sc_map_get_64v(map, (uint64_t)c);
+        while (n < max)
+        {
+            vws_svr_queue_cell* cell = &queue->buffer[(pos + n) & mask];
+            size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
 
-    if (sc_map_found(map) == true)
-    {
-        server->on_read(cnx, nread, buf);
-    }
-}
+            if (seq != pos + n + 1)
+            {
+                break;
+            }
 
-void svr_on_write_complete(uv_write_t* req, int status)
-{
-    vws_svr_data_free((vws_svr_data*)req->data);
-    vws.free(req);
-}
+            n++;
+        }
 
-void svr_on_close(uv_handle_t* handle)
-{
-    vws_tcp_svr* server  = handle->data;
-    vws_svr_cnx_map* map = &server->cnxs;
-    vws_svr_cnx* cnx     = sc_map_get_64v(map, (uint64_t)handle);
+        if (n == 0)
+        {
+            vws_svr_queue_cell* cell = &queue->buffer[pos & mask];
+            size_t seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            intptr_t df = (intptr_t)seq - (intptr_t)(pos + 1);
 
-    vws.trace(VL_INFO, "svr_on_close(): %p", handle);
+            if (df <= 0)
+            {
+                // Empty
+                return 0;
+            }
 
-    // If entry exists
-    if (sc_map_found(map) == true)
-    {
-        // Call on_disconnect() handler
-        server->on_disconnect(cnx);
+            // Another consumer got there first
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+            continue;
+        }
 
-        // Remove from map
-        sc_map_del_64v(map, (uint64_t)handle);
+        // Claim them all at once
+        if (__atomic_compare_exchange_n( &queue->head, &pos, pos + n, true,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED ))
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                vws_svr_queue_cell* cell = &queue->buffer[(pos + i) & mask];
+                items[i] = cell->data;
 
-        // Cleanup
-        vws.free(cnx);
-    }
+                // Make the slot writable for the next lap
+                __atomic_store_n( &cell->seq,
+                                  pos + i + mask + 1,
+                                  __ATOMIC_RELEASE );
 
-    vws.free(handle);
+                VWS_PROBE2(queue_pop, queue->name, items[i]);
+            }
 
-    // If we are running in inetd mode, there is only one socket and its closing
-    // means we are done and should exit process.
-    if ((server->inetd_mode == 1) && (server->state == VS_RUNNING))
-    {
-        vws_tcp_svr_inetd_stop(server);
+            // Wake a producer blocked on a full queue
+            queue_wake(queue, &queue->space, &queue->blocked);
+
+            return n;
+        }
+
+        // Lost the race, pos has been reloaded
     }
 }
 
-void svr_on_realloc(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+void queue_wake(vws_svr_queue* queue, uv_cond_t* cond, int* sleepers)
 {
-    buf->base = (char*)vws.realloc(buf->base, size);
-    buf->len  = size;
-}
+    // Pairs with the increment of sleepers in queue_push()/queue_pop(). Either
+    // the sleeper sees our update when it rechecks under the mutex, or we see
+    // it here and signal.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-//------------------------------------------------------------------------------
-// Queue API
-//------------------------------------------------------------------------------
+    if (__atomic_load_n(sleepers, __ATOMIC_RELAXED) > 0)
+    {
+        uv_mutex_lock(&queue->mutex);
+        uv_cond_signal(cond);
+        uv_mutex_unlock(&queue->mutex);
+    }
+}
 
-void queue_init(vws_svr_queue* queue, int size, cstr name)
+size_t queue_depth(vws_svr_queue* queue)
 {
-    queue->buffer   = (vws_svr_data**)vws.malloc(size * sizeof(vws_svr_data*));
-    queue->size     = 0;
-    queue->capacity = size;
-    queue->head     = 0;
-    queue->tail     = 0;
-    queue->state    = VS_RUNNING;
-    queue->name     = strdup(name);
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
 
-    // Initialize mutex and condition variable
-    uv_mutex_init(&queue->mutex);
-    uv_cond_init(&queue->cond);
+    return (tail > head) ? tail - head : 0;
 }
 
-void queue_destroy(vws_svr_queue* queue)
+void queue_stamp(vws_svr_data* data)
 {
-    if (queue->buffer != NULL)
+    data->queued = uv_hrtime();
+
+    if (data->timing != NULL)
     {
-        vws.free(queue->name);
-        uv_mutex_destroy(&queue->mutex);
-        uv_cond_destroy(&queue->cond);
-        vws.free(queue->buffer);
-        queue->buffer = NULL;
-        queue->state  = VS_HALTED;
+        // Requests are queued once on the way in, responses once on the way
+        // out
+        if (data->timing->queued == 0)
+        {
+            data->timing->queued = data->queued;
+        }
+        else
+        {
+            data->timing->handled = data->queued;
+        }
     }
 }
 
 void queue_push(vws_svr_queue* queue, vws_svr_data* data)
 {
+    queue_stamp(data);
+
     if (queue->state != VS_RUNNING)
     {
-        vws.free(data);
-        return;
-    }
+        // A connection's release or turn is kept, so the connection goes
+        // when the queue is destroyed
+        bool marker = vws_is_flag(&data->flags, VM_SVR_DATA_RELEASE) ||
+                      vws_is_flag(&data->flags, VM_SVR_DATA_RUN);
 
-    uv_mutex_lock(&queue->mutex);
+        if (marker && queue->buffer != NULL && queue_try_push(queue, data))
+        {
+            return;
+        }
 
-    while (queue->size == queue->capacity)
-    {
-        uv_cond_wait(&queue->cond, &queue->mutex);
+        vws_svr_data_free(data);
+        return;
     }
 
-    if (queue->state != VS_RUNNING)
+    if (queue_try_push(queue, data) == false)
     {
-        uv_cond_signal(&queue->cond);
+        // Full. Sleep until a consumer makes room.
+        uv_mutex_lock(&queue->mutex);
+        __atomic_add_fetch(&queue->blocked, 1, __ATOMIC_SEQ_CST);
+
+        bool added;
+        while ((added = queue_try_push(queue, data)) == false)
+        {
+            if (queue->state != VS_RUNNING)
+            {
+                break;
+            }
+
+            uv_cond_wait(&queue->space, &queue->mutex);
+        }
+
+        __atomic_sub_fetch(&queue->blocked, 1, __ATOMIC_SEQ_CST);
         uv_mutex_unlock(&queue->mutex);
-        return;
+
+        if (added == false)
+        {
+            // Halted while waiting
+            vws_svr_data_free(data);
+            return;
+        }
     }
 
-    queue->buffer[queue->tail] = data;
-    queue->tail = (queue->tail + 1) % queue->capacity;
-    queue->size++;
+    VWS_PROBE2(queue_push, queue->name, data);
 
-    // Signal condition variable
-    uv_cond_signal(&queue->cond);
-    uv_mutex_unlock(&queue->mutex);
+    // Wake a consumer if one is sleeping
+    queue_wake(queue, &queue->cond, &queue->waiting);
 }
 
 vws_svr_data* queue_pop(vws_svr_queue* queue)
 {
-    uv_mutex_lock(&queue->mutex);
-
-    while (queue->size == 0 && queue->state == VS_RUNNING)
+    while (true)
     {
-        uv_cond_wait(&queue->cond, &queue->mutex);
-    }
+        if (queue->state == VS_HALTING)
+        {
+            return NULL;
+        }
 
-    if (queue->state == VS_HALTING)
-    {
-        uv_cond_broadcast(&queue->cond);
-        uv_mutex_unlock(&queue->mutex);
+        vws_svr_data* data = queue_try_pop(queue);
 
-        return NULL;
-    }
+        if (data != NULL)
+        {
+            return data;
+        }
 
-    vws_svr_data* data = queue->buffer[queue->head];
-    queue->head        = (queue->head + 1) % queue->capacity;
-    queue->size--;
+        // Empty. Sleep until a producer adds something.
+        uv_mutex_lock(&queue->mutex);
+        __atomic_add_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
 
-    uv_mutex_unlock(&queue->mutex);
+        while (queue->state == VS_RUNNING && queue_empty(queue) == true)
+        {
+            uv_cond_wait(&queue->cond, &queue->mutex);
+        }
 
-    return data;
+        __atomic_sub_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+        uv_mutex_unlock(&queue->mutex);
+    }
 }
 
 bool queue_empty(vws_svr_queue* queue)
 {
-    uv_mutex_lock(&queue->mutex);
-    bool empty = (queue->size == 0);
-    uv_mutex_unlock(&queue->mutex);
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
 
-    return empty;
+    return head == tail;
 }
 
 //------------------------------------------------------------------------------
@@ -1552,6 +7936,8 @@ void ws_svr_process_frame(vws_cnx* c, vws_frame* f)
 {
     vws_svr_cnx* cnx = (vws_svr_cnx*)c->data;
 
+    svr_count(&svr_metrics(cnx->server)->frames_in[f->opcode & 0x0F], 1);
+
     switch (f->opcode)
     {
         case CLOSE_FRAME:
@@ -1579,6 +7965,7 @@ void ws_svr_process_frame(vws_cnx* c, vws_frame* f)
         case CONTINUATION_FRAME:
         {
             // Add to queue
+            vws_queue_lazy(&c->queue);
             sc_queue_add_first(&c->queue, f);
 
             break;
@@ -1589,9 +7976,11 @@ void ws_svr_process_frame(vws_cnx* c, vws_frame* f)
             // Generate the PONG response
             vws_buffer* buffer = vws_generate_pong_frame(f->data, f->size);
 
-            // Send back to cliane Send the PONG response
+            // Send back to cliane Send the PONG response. It goes on the
+            // priority lane so that it is not held up behind a backlog.
             vws_svr_data* response;
             response = vws_svr_data_new(cnx, buffer);
+            vws_set_flag(&response->flags, VM_SVR_DATA_PRIORITY);
             vws_tcp_svr_send(cnx->server, response);
 
             // Free buffer
@@ -1622,6 +8011,24 @@ void ws_svr_process_frame(vws_cnx* c, vws_frame* f)
     vws.success();
 }
 
+void ws_svr_client_stream( vws_cnx* c,
+                           unsigned char opcode,
+                           ucstr data,
+                           size_t size,
+                           bool begin,
+                           bool end )
+{
+    vws_svr_cnx* cnx = (vws_svr_cnx*)c->data;
+    vws_svr* server  = (vws_svr*)cnx->server;
+
+    server->on_stream(cnx, opcode, data, size, begin, end);
+}
+
+bool ws_svr_worker_parse(vws_svr* server)
+{
+    return server->worker_parse == 1 || server->on_stream != NULL;
+}
+
 void ws_svr_client_connect(vws_svr_cnx* c)
 {
     if (vws.tracelevel >= VT_SERVICE)
@@ -1629,11 +8036,111 @@ void ws_svr_client_connect(vws_svr_cnx* c)
         vws.trace(VL_INFO, "ws_svr_client_connect(%p)", c->handle);
     }
 
+    vws_svr* server = (vws_svr*)c->server;
+
     // Create a new vws_cnx
     vws_cnx* cnx = (void*)vws_cnx_new();
     cnx->process = ws_svr_process_frame;
+    vws_cnx_set_zero_copy(cnx);
+    cnx->spill   = server->spill;
     cnx->data    = (void*)c;   // Link cnx -> c
     c->data      = (void*)cnx; // Link c -> cnx
+
+    if (server->on_stream != NULL)
+    {
+        vws_cnx_set_stream(cnx, ws_svr_client_stream);
+    }
+
+    if (server->deflate == 1)
+    {
+        vws_cnx_set_deflate( cnx,
+                             server->deflate_window_bits,
+                             server->deflate_no_context_takeover );
+    }
+}
+
+void ws_svr_client_keepalive(vws_svr_cnx* c)
+{
+    if (c->upgraded == false)
+    {
+        return;
+    }
+
+    // An empty ping is just a header. We are on the loop, so it is written
+    // straight away. Control frames may go out between fragments.
+    vws_svr_data* ping = vws_svr_data_own(c, NULL, 0);
+    ping->header_size  = vws_frame_header(ping->header, 1, PING_FRAME, 0);
+
+    svr_client_data_out(ping);
+}
+
+bool ws_svr_client_handoff(vws_svr_cnx* cnx, vws_buffer* state)
+{
+    vws_cnx* c = (vws_cnx*)cnx->data;
+
+    // Neither a request still being answered, a compression context, shared
+    // memory nor a message part way written to a file can be carried over
+    if (cnx->upgraded == false || vws_cnx_is_deflate(c) == true
+        || cnx->shm != NULL || c->spill_fd >= 0)
+    {
+        return false;
+    }
+
+    // Streaming state
+    unsigned char head[5];
+    head[0] = c->stream_opcode;
+    memcpy(head + 1, &c->stream_utf8, sizeof(uint32_t));
+    vws_buffer_append(state, head, sizeof(head));
+
+    // Frames of a message part way received, oldest first. Their payload has
+    // been unmasked, so they go unmasked.
+    for (size_t i = sc_queue_size(&c->queue); i > 0; i--)
+    {
+        vws_frame* f = sc_queue_at(&c->queue, i - 1);
+        ucstr data   = f->borrowed ? c->base.buffer->data + f->pos : f->data;
+
+        unsigned char header[14];
+        size_t n = vws_frame_header(header, f->fin, f->opcode, f->size);
+        vws_buffer_append(state, header, n);
+        vws_buffer_append(state, data, f->size);
+    }
+
+    // Then what has not been parsed yet
+    vws_buffer* b = c->base.buffer;
+    vws_buffer_append(state, b->data + c->parsed, b->size - c->parsed);
+
+    return true;
+}
+
+void ws_svr_client_adopt(vws_svr_cnx* cnx, ucstr state, size_t size)
+{
+    vws_cnx* c = (vws_cnx*)cnx->data;
+
+    if (size < 5)
+    {
+        return;
+    }
+
+    // Streaming is between messages or part way through a data message
+    unsigned char code = state[0];
+
+    if (code != 0 && code != TEXT_FRAME && code != BINARY_FRAME)
+    {
+        vws.error(VE_RT, "Invalid handoff state");
+        uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+        return;
+    }
+
+    c->stream_opcode = code;
+    memcpy(&c->stream_utf8, state + 1, sizeof(uint32_t));
+
+    if (size > 5)
+    {
+        // The connection has upgraded, so this is processed as frames just
+        // read from it
+        uv_buf_t buf = uv_buf_init((char*)state + 5, size - 5);
+        cnx->server->on_read(cnx, buf.len, &buf);
+    }
 }
 
 void ws_svr_client_disconnect(vws_svr_cnx* c)
@@ -1656,11 +8163,155 @@ void vws_tcp_svr_close(vws_svr_cnx* cnx)
     vws_svr_data* reply;
     reply = vws_svr_data_own(cnx, NULL, 0);
 
-    // Set connection close flag
-    vws_set_flag(&reply->flags, VM_SVR_DATA_CLOSE);
+    // Set connection close flag
+    vws_set_flag(&reply->flags, VM_SVR_DATA_CLOSE);
+
+    // Queue the data to uv_thread() to send out on wire
+    vws_tcp_svr_send(cnx->server, reply);
+}
+
+void vws_tcp_svr_subscribe(vws_svr_cnx* cnx, cstr topic)
+{
+    vws_svr_data* request;
+    request = vws_svr_data_own(cnx, (ucstr)vws_strdup(topic), strlen(topic));
+    vws_set_flag(&request->flags, VM_SVR_DATA_SUBSCRIBE);
+
+    // Queued behind the data already sent to the connection
+    vws_tcp_svr_send(cnx->server, request);
+}
+
+void vws_tcp_svr_unsubscribe(vws_svr_cnx* cnx, cstr topic)
+{
+    vws_svr_data* request;
+    request = vws_svr_data_own(cnx, (ucstr)vws_strdup(topic), strlen(topic));
+    vws_set_flag(&request->flags, VM_SVR_DATA_UNSUBSCRIBE);
+
+    vws_tcp_svr_send(cnx->server, request);
+}
+
+void vws_tcp_svr_publish( vws_tcp_svr* server,
+                          cstr topic,
+                          ucstr data,
+                          size_t size )
+{
+    vws_svr_buffer* b = vws_svr_buffer_new(size);
+    memcpy(b->data, data, size);
+
+    svr_broadcast_send(server, topic, b);
+}
+
+vws_svr_data* ws_svr_upgrade_reply( vws_svr_cnx* c,
+                                    cstr accept,
+                                    cstr proto,
+                                    cstr ext )
+{
+    static const char head[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: ";
+
+    static const char mid[] =
+        "\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Protocol: ";
+
+    static const char ext_head[] = "\r\nSec-WebSocket-Extensions: ";
+    static const char tail[]     = "\r\n\r\n";
+
+    size_t accept_size = strlen(accept);
+    size_t proto_size  = strlen(proto);
+    size_t ext_size    = (ext != NULL) ? strlen(ext) : 0;
+
+    size_t size = sizeof(head) - 1 + accept_size
+                + sizeof(mid)  - 1 + proto_size
+                + sizeof(tail) - 1;
+
+    if (ext != NULL)
+    {
+        size += sizeof(ext_head) - 1 + ext_size;
+    }
+
+    ucstr data = vws.malloc(size);
+    ucstr p    = data;
+
+    memcpy(p, head, sizeof(head) - 1);  p += sizeof(head) - 1;
+    memcpy(p, accept, accept_size);     p += accept_size;
+    memcpy(p, mid, sizeof(mid) - 1);    p += sizeof(mid) - 1;
+    memcpy(p, proto, proto_size);       p += proto_size;
+
+    if (ext != NULL)
+    {
+        memcpy(p, ext_head, sizeof(ext_head) - 1);
+        p += sizeof(ext_head) - 1;
+        memcpy(p, ext, ext_size);
+        p += ext_size;
+    }
+
+    memcpy(p, tail, sizeof(tail) - 1);
+
+    return vws_svr_data_own(c, data, size);
+}
+
+void ws_svr_client_http(vws_svr_cnx* cnx, size_t size)
+{
+    vws_svr* server   = (vws_svr*)cnx->server;
+    vws_cnx* c        = (vws_cnx*)cnx->data;
+    vws_http_msg* req = cnx->http;
+    cstr data         = (cstr)c->base.buffer->data;
+
+    vws_buffer* body = vws_buffer_new();
+    int status       = server->on_http(cnx, req, data, size, body);
+    bool keep_alive  = (llhttp_should_keep_alive(req->parser) == 1);
+
+    cstr reason;
+    switch (status)
+    {
+        case 200: reason = "OK";                    break;
+        case 204: reason = "No Content";            break;
+        case 400: reason = "Bad Request";           break;
+        case 404: reason = "Not Found";             break;
+        case 405: reason = "Method Not Allowed";    break;
+        case 503: reason = "Service Unavailable";   break;
+        default:  reason = (status < 400) ? "OK" : "Error";
+    }
+
+    vws_buffer* http = vws_buffer_new();
+    vws_buffer_printf(http, "HTTP/1.1 %i %s\r\n", status, reason);
+    vws_buffer_printf(http, "Content-Type: text/plain; charset=utf-8\r\n");
+    vws_buffer_printf(http, "Content-Length: %zu\r\n", body->size);
+
+    if (keep_alive == false)
+    {
+        vws_buffer_printf(http, "Connection: close\r\n");
+    }
+
+    vws_buffer_printf(http, "\r\n");
+    vws_buffer_append(http, body->data, body->size);
+    vws_buffer_free(body);
+
+    // Send directly out as we are in uv_thread()
+    vws_svr_data* reply = vws_svr_data_new(cnx, http);
+    server->base.on_data_out(reply);
+    vws_buffer_free(http);
+
+    // Done with this request. The next one gets a fresh parser.
+    vws_buffer_drain(c->base.buffer, size);
+    vws_http_msg_free(cnx->http);
+    cnx->http = NULL;
 
-    // Queue the data to uv_thread() to send out on wire
-    vws_tcp_svr_send(cnx->server, reply);
+    if (keep_alive == false)
+    {
+        svr_cnx_close(cnx);
+        return;
+    }
+
+    // Pipelined requests are already in the buffer
+    if (c->base.buffer->size > 0)
+    {
+        uv_buf_t none = uv_buf_init(NULL, 0);
+        ws_svr_client_read(cnx, 0, &none);
+    }
 }
 
 // Runs in uv_thread()
@@ -1669,17 +8320,27 @@ void ws_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
     vws_tcp_svr* server = cnx->server;
     vws_cnx* c          = (vws_cnx*)cnx->data;
 
-    // Add to client socket buffer
-    vws_buffer_append(c->base.buffer, (ucstr)buf->base, size);
+    // Once upgraded, the worker owns the connection buffer. Pass it a copy of
+    // the bytes as they are. The read buffer belongs to the server.
+    if (cnx->upgraded == true && ws_svr_worker_parse((vws_svr*)server))
+    {
+        ws_svr_client_forward(cnx, (ucstr)buf->base, size);
+        return;
+    }
 
-    // Free libuv memory
-    vws.free(buf->base);
+    // Add to client socket buffer. The read buffer belongs to the server.
+    vws_buffer_append(c->base.buffer, (ucstr)buf->base, size);
 
     // If we are in HTTP mode
     if (cnx->upgraded == false)
     {
         // Parse incoming data as HTTP request.
 
+        if (cnx->http == NULL)
+        {
+            cnx->http = vws_http_msg_handshake_new();
+        }
+
         ucstr data  = c->base.buffer->data;
         size_t size = c->base.buffer->size;
         ssize_t n   = vws_http_msg_parse(cnx->http, (cstr)data, size);
@@ -1690,6 +8351,12 @@ void ws_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
             // Check for parsing errors
             enum llhttp_errno err = llhttp_get_errno(cnx->http->parser);
 
+            if (err == HPE_OK && cnx->http->done == false)
+            {
+                // The body is still to come
+                return;
+            }
+
             // If there was a parsing error, close connection
             if(err != HPE_PAUSED)
             {
@@ -1703,53 +8370,75 @@ void ws_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
                 return;
             }
 
-            // Drain HTTP request data from cnx->data buffer
-            vws_buffer_drain(c->base.buffer, n);
-
-            //> Generate HTTP response and send
+            // A plain request is served by on_http, if there is one
+            vws_svr* ws    = (vws_svr*)server;
+            bool upgrading = (cnx->http->spans[VWS_HTTP_UPGRADE].size > 0);
 
-            vws_buffer* http = vws_buffer_new();
+            if (ws->on_http != NULL && upgrading == false)
+            {
+                ws_svr_client_http(cnx, n);
+                return;
+            }
 
-            struct sc_map_str* headers = &cnx->http->headers;
-            cstr key   = vws_map_get(headers, "sec-websocket-key");
-            cstr proto = vws_map_get(headers, "sec-websocket-protocol");
+            //> Generate HTTP response and send
 
-            vws_buffer_printf(http, "HTTP/1.1 101 Switching Protocols\r\n");
-            vws_buffer_printf(http, "Upgrade: websocket\r\n");
-            vws_buffer_printf(http, "Connection: Upgrade\r\n");
+            // The parser recorded where the headers we need are. Copy them
+            // out before the request is drained from the buffer.
+            vws_http_msg* req = cnx->http;
+            cstr request      = (cstr)data;
 
-            cstr ac = vws_accept_key(key);
-            vws_buffer_printf(http, "Sec-WebSocket-Accept: %s\r\n", ac);
-            vws.free(ac);
+            char key[64];
+            char proto[256];
+            char offer[512];
+            char upgrade[16];
 
-            vws_buffer_printf(http, "Sec-WebSocket-Version: 13\r\n");
-            vws_buffer_printf(http, "Sec-WebSocket-Protocol: ");
+            cstr k, p, o, u;
+            k = vws_http_msg_span(req, request, VWS_HTTP_KEY, key, 64);
+            p = vws_http_msg_span(req, request, VWS_HTTP_PROTOCOL, proto, 256);
+            u = vws_http_msg_span(req, request, VWS_HTTP_UPGRADE, upgrade, 16);
+            o = vws_http_msg_span( req, request, VWS_HTTP_EXTENSIONS,
+                                   offer, 512 );
 
-            if (proto != NULL)
+            for (size_t i = 0; u != NULL && upgrade[i] != '\0'; i++)
             {
-                vws_buffer_printf(http, "%s\r\n", proto);
+                upgrade[i] = tolower(upgrade[i]);
             }
-            else
+
+            // Drain HTTP request data from cnx->data buffer
+            vws_buffer_drain(c->base.buffer, n);
+
+            char ac[VWS_ACCEPT_KEY_SIZE];
+
+            if (u == NULL || strcmp(u, "websocket") != 0
+                || vws_accept_key_into(k, ac) == false)
             {
-                vws_buffer_printf(http, "vrtql\r\n");
+                vws.error(VE_RT, "Not a WebSocket upgrade request");
+                svr_cnx_close(cnx);
+                return;
             }
 
-            vws_buffer_printf(http, "\r\n");
+            // Negotiate permessage-deflate
+            cstr ext = vws_cnx_accept_deflate(c, o);
 
-            // Package up response
             vws_svr_data* reply;
-            reply = vws_svr_data_new(cnx, http);
+            reply = ws_svr_upgrade_reply( cnx,
+                                          ac,
+                                          (p != NULL) ? p : "vrtql",
+                                          ext );
+
+            if (ext != NULL)
+            {
+                vws.free(ext);
+            }
 
             // Send directly out as we are in uv_thread()
             server->on_data_out(reply);
 
-            // Cleanup. Buffer data was passed to reply.
-            vws_buffer_free(http);
-
             //> Change state to WebSocket mode
 
             // Set the flag that we are in WebSocket mode
             cnx->upgraded = true;
+            VWS_PROBE1(upgrade, cnx);
 
             // Free HTTP request as we don't need it anymore
             vws_http_msg_free(cnx->http);
@@ -1762,6 +8451,17 @@ void ws_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
                 // No more data in the socket buffer. Done for now.
                 return;
             }
+
+            if (ws_svr_worker_parse((vws_svr*)server))
+            {
+                // Hand what is left over to the worker along with the buffer
+                ucstr data  = c->base.buffer->data;
+                size_t size = c->base.buffer->size;
+                ws_svr_client_forward(cnx, data, size);
+                vws_buffer_drain(c->base.buffer, size);
+
+                return;
+            }
         }
         else
         {
@@ -1789,11 +8489,23 @@ void ws_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
             // Pass message pointer in block
             vws_svr_data* block;
             block = vws_svr_data_own(cnx, (ucstr)wsm, sizeof(vws_msg*));
-            queue_push(&server->requests, block);
+            svr_sample_start(cnx, block);
+            svr_cnx_queue(cnx, block);
         }
     }
 }
 
+void ws_svr_client_forward(vws_svr_cnx* cnx, ucstr data, size_t size)
+{
+    ucstr copy = vws.malloc(size);
+    memcpy(copy, data, size);
+
+    // The connection's worker gets the bytes in the order they arrived
+    vws_svr_data* block = vws_svr_data_own(cnx, copy, size);
+    svr_sample_start(cnx, block);
+    svr_cnx_queue(cnx, block);
+}
+
 // Runs in worker_thread()
 void ws_svr_client_data_in(vws_svr_data* block)
 {
@@ -1803,6 +8515,29 @@ void ws_svr_client_data_in(vws_svr_data* block)
     vws_svr* server  = (vws_svr*)cnx->server;
     vws_cnx* c       = (vws_cnx*)cnx->data;
 
+    bool parsed = vws_is_flag(&block->flags, VM_SVR_DATA_SHM);
+
+    if (ws_svr_worker_parse(server) && parsed == false)
+    {
+        // Data is raw socket data. Parse it here, in the worker.
+        vws_buffer_append(c->base.buffer, (ucstr)block->data, block->size);
+        vws_svr_data_free(block);
+
+        if (vws_cnx_ingress(c) > 0)
+        {
+            vws_svr_metrics* metrics = svr_metrics(cnx->server);
+
+            vws_msg* wsm;
+            while ((wsm = vws_msg_pop(c)) != NULL)
+            {
+                svr_count(&metrics->messages_in[wsm->opcode & 0x0F], 1);
+                server->on_msg_in(cnx, wsm);
+            }
+        }
+
+        return;
+    }
+
     // Data simply contains a pointer to a websocket message
     vws_msg* wsm = (vws_msg*)block->data;
 
@@ -1811,45 +8546,135 @@ void ws_svr_client_data_in(vws_svr_data* block)
     block->size = 0;
     vws_svr_data_free(block);
 
+    svr_count(&svr_metrics(cnx->server)->messages_in[wsm->opcode & 0x0F], 1);
+
     //> Process connection buffer data for complete messages
     server->on_msg_in(cnx, wsm);
 }
 
 void ws_svr_client_data_out( vws_svr_cnx* cnx,
                              vws_buffer* buffer,
-                             unsigned char opcode )
+                             unsigned char opcode,
+                             bool priority )
 {
-    // Create a binary websocket frame containing message
-    vws_frame* frame;
-    ucstr data  = buffer->data;
-    size_t size = buffer->size;
-    frame       = vws_frame_new(data, size, opcode);
+    vws_svr* server = (vws_svr*)cnx->server;
+    uint64_t flags  = priority ? VM_SVR_DATA_PRIORITY : 0;
 
-    // This frame is from server to we don't mask it
-    frame->mask = 0;
+    svr_count(&svr_metrics(cnx->server)->messages_out[opcode & 0x0F], 1);
+
+    // Compress data messages if permessage-deflate was negotiated
+    vws_cnx* c      = (vws_cnx*)cnx->data;
+    bool compressed = false;
+    bool data_frame = (opcode == TEXT_FRAME || opcode == BINARY_FRAME);
+
+    if (c != NULL && data_frame == true)
+    {
+        compressed = vws_cnx_deflate(c, buffer);
+    }
 
-    // Serialize frame: frame is freed by function
-    vws_buffer* fdata = vws_serialize(frame);
+    size_t max = server->max_frame;
+
+    if (data_frame == true && max > 0 && buffer->size > max)
+    {
+        // Take over the payload. The fragments point into it and it is freed
+        // with the last of them.
+        vws_buffer_rewind(buffer);
+
+        vws_svr_buffer* b = vws_svr_buffer_wrap( buffer->data,
+                                                 buffer->size,
+                                                 svr_buffer_free_data,
+                                                 NULL );
+        buffer->data      = NULL;
+        buffer->size      = 0;
+        buffer->allocated = 0;
+
+        ws_svr_client_fragment_out(cnx, b, opcode, compressed, flags);
+        return;
+    }
 
-    // Pack frame binary into queue data
+    // Take over the payload as is. It goes out on the wire behind the frame
+    // header as a separate buffer, so it is never copied.
     vws_svr_data* response;
-    response = vws_svr_data_new(cnx, fdata);
+    response = vws_svr_data_new(cnx, buffer);
+
+    // This frame is from server to we don't mask it
+    response->header_size = vws_frame_header( response->header,
+                                              1,
+                                              opcode,
+                                              response->size );
+
+    if (compressed == true)
+    {
+        // RSV1 marks a compressed message
+        response->header[0] |= 0x40;
+    }
+
+    if (data_frame == true)
+    {
+        flags |= VM_SVR_DATA_MESSAGE;
+    }
+
+    vws_set_flag(&response->flags, flags);
 
     // Queue the data to uv_thread() to send out on wire
     vws_tcp_svr_send(cnx->server, response);
+}
+
+void ws_svr_client_fragment_out( vws_svr_cnx* cnx,
+                                 vws_svr_buffer* b,
+                                 unsigned char opcode,
+                                 bool compressed,
+                                 uint64_t flags )
+{
+    size_t max  = ((vws_svr*)cnx->server)->max_frame;
+    size_t size = b->size;
+
+    for (size_t offset = 0; offset < size; offset += max)
+    {
+        size_t n  = (size - offset < max) ? size - offset : max;
+        bool last = (offset + n == size);
 
-    // Free buffers
-    vws_buffer_free(fdata);
+        vws_svr_data* f = vws_svr_data_share(cnx, b, offset, n);
+        vws_set_flag(&f->flags, flags
+                              | VM_SVR_DATA_MESSAGE
+                              | VM_SVR_DATA_FRAGMENT);
+
+        unsigned char code = (offset == 0) ? opcode : CONTINUATION_FRAME;
+        f->header_size     = vws_frame_header(f->header, last, code, n);
+
+        if (offset == 0 && compressed == true)
+        {
+            // RSV1 goes on the first frame only
+            f->header[0] |= 0x40;
+        }
+
+        vws_tcp_svr_send(cnx->server, f);
+    }
+
+    vws_svr_buffer_release(b);
 }
 
 void ws_svr_client_msg_in(vws_svr_cnx* cnx, vws_msg* m)
 {
     vws_svr* server = (vws_svr*)cnx->server;
 
+    if (server->process_batch != NULL)
+    {
+        // Collected and passed on with the others from the connection
+        svr_msg_batch_add(cnx, m, ws_svr_client_batch_in);
+        return;
+    }
+
     // Route to application-specific processing callback
     server->process(cnx, m);
 }
 
+void ws_svr_client_batch_in(vws_svr_cnx* cnx, void** items, size_t n)
+{
+    vws_svr* server = (vws_svr*)cnx->server;
+    server->process_batch(cnx, (vws_msg**)items, n);
+}
+
 void ws_svr_client_process(vws_svr_cnx* cnx, vws_msg* m)
 {
     // Default: Do nothing. Drop message.
@@ -1858,10 +8683,124 @@ void ws_svr_client_process(vws_svr_cnx* cnx, vws_msg* m)
 
 void ws_svr_client_msg_out(vws_svr_cnx* cnx, vws_msg* m)
 {
-    ws_svr_client_data_out(cnx, m->data, m->opcode);
+    if (m->mapped == true)
+    {
+        // Hand over the mapping rather than the buffer
+        ws_svr_client_mapped_out(cnx, m->data->data, m->data->size, m->opcode);
+
+        m->data->data = NULL;
+        m->data->size = 0;
+        m->mapped     = false;
+    }
+    else
+    {
+        ws_svr_client_data_out(cnx, m->data, m->opcode, false);
+    }
+
     vws_msg_free(m);
 }
 
+int vws_svr_send_file(vws_svr_cnx* cnx, int fd, uint64_t offset, size_t size)
+{
+    ucstr data = vws_file_map(fd, offset, &size);
+
+    if (data == NULL)
+    {
+        // Error already set
+        return -1;
+    }
+
+    ws_svr_client_mapped_out(cnx, data, size, BINARY_FRAME);
+
+    return 0;
+}
+
+void vws_svr_relay( vws_svr_cnx* cnx,
+                    unsigned char opcode,
+                    ucstr data,
+                    size_t size,
+                    bool begin,
+                    bool end )
+{
+    ucstr copy = NULL;
+
+    if (size > 0)
+    {
+        copy = vws.malloc(size);
+        memcpy(copy, data, size);
+    }
+
+    vws_svr_data* f    = vws_svr_data_own(cnx, copy, size);
+    unsigned char code = (begin == true) ? opcode : CONTINUATION_FRAME;
+    f->header_size     = vws_frame_header(f->header, end, code, size);
+    uint64_t flags     = VM_SVR_DATA_MESSAGE;
+
+    if (begin == false || end == false)
+    {
+        flags |= VM_SVR_DATA_FRAGMENT;
+    }
+
+    vws_set_flag(&f->flags, flags);
+
+    if (begin == true)
+    {
+        svr_count(&svr_metrics(cnx->server)->messages_out[opcode & 0x0F], 1);
+    }
+
+    vws_tcp_svr_send(cnx->server, f);
+}
+
+void ws_svr_client_mapped_out( vws_svr_cnx* cnx,
+                               ucstr data,
+                               size_t size,
+                               unsigned char opcode )
+{
+    svr_count(&svr_metrics(cnx->server)->messages_out[opcode & 0x0F], 1);
+
+    // The frames point into the mapping, which goes with the last of them. The
+    // size rides on the argument for the unmap.
+    vws_svr_buffer* b = vws_svr_buffer_wrap( data,
+                                             size,
+                                             svr_buffer_unmap,
+                                             (void*)(uintptr_t)size );
+
+    size_t max = ((vws_svr*)cnx->server)->max_frame;
+
+    if (max > 0 && size > max)
+    {
+        ws_svr_client_fragment_out(cnx, b, opcode, false, 0);
+        return;
+    }
+
+    vws_svr_data* response = vws_svr_data_share(cnx, b, 0, size);
+    response->header_size  = vws_frame_header( response->header,
+                                               1,
+                                               opcode,
+                                               size );
+
+    vws_set_flag(&response->flags, VM_SVR_DATA_MESSAGE);
+    vws_svr_buffer_release(b);
+
+    vws_tcp_svr_send(cnx->server, response);
+}
+
+void vws_svr_publish( vws_svr* server,
+                      cstr topic,
+                      ucstr data,
+                      size_t size,
+                      unsigned char opcode )
+{
+    // Frame it once for everyone. Server frames are not masked.
+    unsigned char header[14];
+    uint8_t n = vws_frame_header(header, 1, opcode, size);
+
+    vws_svr_buffer* b = vws_svr_buffer_new(n + size);
+    memcpy(b->data, header, n);
+    memcpy(b->data + n, data, size);
+
+    svr_broadcast_send((vws_tcp_svr*)server, topic, b);
+}
+
 void ws_svr_ctor(vws_svr* server, int nt, int bl, int qs)
 {
     tcp_svr_ctor((vws_tcp_svr*)server, nt, bl, qs);
@@ -1871,6 +8810,9 @@ void ws_svr_ctor(vws_svr* server, int nt, int bl, int qs)
     server->base.on_disconnect = ws_svr_client_disconnect;
     server->base.on_read       = ws_svr_client_read;
     server->base.on_data_in    = ws_svr_client_data_in;
+    server->base.on_keepalive  = ws_svr_client_keepalive;
+    server->base.on_handoff    = ws_svr_client_handoff;
+    server->base.on_adopt      = ws_svr_client_adopt;
 
     // Message handling
     server->on_msg_in          = ws_svr_client_msg_in;
@@ -1879,6 +8821,21 @@ void ws_svr_ctor(vws_svr* server, int nt, int bl, int qs)
     // Application functions
     server->process            = ws_svr_client_process;
     server->send               = ws_svr_client_msg_out;
+    server->process_batch      = NULL;
+
+    // Parse on the network thread
+    server->worker_parse       = 0;
+    server->on_stream          = NULL;
+
+    // No compression unless enabled
+    server->deflate                     = 0;
+    server->deflate_window_bits         = 15;
+    server->deflate_no_context_takeover = false;
+
+    // One frame per message, reassembled in memory
+    server->max_frame                   = 0;
+    server->spill                       = 0;
+    server->on_http                     = NULL;
 }
 
 vws_svr* vws_svr_new(int num_threads, int backlog, int queue_size)
@@ -1918,11 +8875,13 @@ void msg_svr_client_ws_msg_in(vws_svr_cnx* cnx, vws_msg* wsm)
 {
     // Deserialize message
 
-    vrtql_msg* msg = vrtql_msg_new(HTTP_REQUEST);
-    ucstr data     = wsm->data->data;
-    size_t size    = wsm->data->size;
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+    vrtql_msg* msg        = vrtql_msg_new(HTTP_REQUEST);
+
+    bool ok = (server->lazy == true) ? vrtql_msg_deserialize_ws_lazy(msg, wsm)
+                                     : vrtql_msg_deserialize_ws(msg, wsm);
 
-    if (vrtql_msg_deserialize(msg, data, size) == false)
+    if (ok == false)
     {
         // Deserialized failed
 
@@ -1944,34 +8903,105 @@ void msg_svr_client_ws_msg_in(vws_svr_cnx* cnx, vws_msg* wsm)
     // Free websocket message
     vws_msg_free(wsm);
 
+    if (msg_svr_expired(msg) == true)
+    {
+        // The client has given up on it. Don't spend a worker on it.
+        svr_count(&svr_metrics(cnx->server)->expired, 1);
+        vrtql_msg_free(msg);
+
+        return;
+    }
+
     // Process message
-    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
     server->on_msg_in(cnx, msg);
 }
 
+bool msg_svr_expired(vrtql_msg* m)
+{
+    cstr deadline = vrtql_msg_get_routing(m, VM_DEADLINE);
+
+    if (deadline == NULL || svr_request_queued == 0)
+    {
+        return false;
+    }
+
+    uint64_t limit = strtoull(deadline, NULL, 10) * 1000000;
+
+    return (uv_hrtime() - svr_request_queued) > limit;
+}
+
 // Receive/handle incoming VRTQL messages
 void msg_svr_client_msg_in(vws_svr_cnx* cnx, vrtql_msg* m)
 {
     vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
 
+    if (server->process_batch != NULL)
+    {
+        // Collected and passed on with the others from the connection
+        svr_msg_batch_add(cnx, m, msg_svr_client_batch_in);
+        return;
+    }
+
     // Route to application-specific processing callback
     server->process(cnx, m);
 }
 
+void msg_svr_client_batch_in(vws_svr_cnx* cnx, void** items, size_t n)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+    server->process_batch(cnx, (vrtql_msg**)items, n);
+}
+
 // Send VRTQL messages
 void msg_svr_client_msg_out(vws_svr_cnx* cnx, vrtql_msg* m)
 {
     // Serialize message
     vws_buffer* mdata = vrtql_msg_serialize(m);
 
-    // Send to base class
-    ws_svr_client_data_out(cnx, mdata, BINARY_FRAME);
+    #if defined(VWS_SHM)
+    if (__atomic_load_n(&cnx->shm, __ATOMIC_ACQUIRE) != NULL)
+    {
+        // No framing. The loop copies it into the ring.
+        vws_svr_data* reply = vws_svr_data_new(cnx, mdata);
+        vws_set_flag(&reply->flags, VM_SVR_DATA_SHM);
+        vws_tcp_svr_send(cnx->server, reply);
+
+        vws_buffer_free(mdata);
+        vrtql_msg_free(m);
+
+        return;
+    }
+    #endif
+
+    // Send to base class. Priority messages skip ahead of ordinary ones.
+    bool priority = vws_is_flag(&m->flags, VM_MSG_PRIORITY);
+    ws_svr_client_data_out(cnx, mdata, BINARY_FRAME, priority);
 
     // Cleanup
     vws_buffer_free(mdata);
     vrtql_msg_free(m);
 }
 
+void msg_svr_rpc_deliver(vrtql_rpc_reply* r, vrtql_msg* m)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)r->target;
+    vws_buffer* mdata   = vrtql_msg_serialize(m);
+
+    vws_svr_data* reply = vws_svr_data_new(NULL, mdata);
+    vws_set_flag(&reply->flags, VM_SVR_DATA_UNFRAMED);
+
+    if (vws_is_flag(&m->flags, VM_MSG_PRIORITY))
+    {
+        vws_set_flag(&reply->flags, VM_SVR_DATA_PRIORITY);
+    }
+
+    svr_count(&svr_metrics(server)->messages_out[BINARY_FRAME], 1);
+    vws_tcp_svr_send_to(server, r->id, reply);
+
+    vws_buffer_free(mdata);
+    vrtql_msg_free(m);
+}
+
 // Process incoming VRTQL messages
 void msg_svr_client_process(vws_svr_cnx* cnx, vrtql_msg* req)
 {
@@ -1979,21 +9009,105 @@ void msg_svr_client_process(vws_svr_cnx* cnx, vrtql_msg* req)
     vrtql_msg_free(req);
 }
 
+void msg_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
+{
+    #if defined(VWS_SHM)
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    if (server->shm == 1 && cnx->shm == NULL && cnx->upgraded == true)
+    {
+        msg_svr_shm_attach(cnx);
+    }
+    #endif
+
+    ws_svr_client_read(cnx, size, buf);
+}
+
+#if defined(VWS_SHM)
+
+void msg_svr_shm_attach(vws_svr_cnx* cnx)
+{
+    uv_stream_t* handle = cnx->handle;
+
+    if (handle->type != UV_NAMED_PIPE)
+    {
+        return;
+    }
+
+    int fds[3];
+    int n = svr_pipe_take(handle, fds, 3);
+
+    if (n == 0)
+    {
+        return;
+    }
+
+    if (n < 3)
+    {
+        vws.error(VE_RT, "Incomplete shared memory offer");
+
+        for (int i = 0; i < n; i++)
+        {
+            close(fds[i]);
+        }
+
+        return;
+    }
+
+    vrtql_shm* shm = vrtql_shm_accept(fds);
+
+    if (shm == NULL)
+    {
+        // Error already set. The pong tells the client.
+        return;
+    }
+
+    vws_svr_shm* s = vws.malloc(sizeof(vws_svr_shm));
+    s->shm         = shm;
+    s->poll        = vws.malloc(sizeof(uv_poll_t));
+    s->poll->data  = cnx;
+    sc_queue_init(&s->backlog);
+
+    uv_poll_init(cnx->loop->loop, s->poll, vrtql_shm_fd(shm));
+    uv_poll_start(s->poll, UV_READABLE, svr_shm_on_poll);
+
+    // Workers look at this to decide where replies go
+    __atomic_store_n(&cnx->shm, s, __ATOMIC_RELEASE);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "msg_svr_shm_attach(%p): attached", cnx);
+    }
+}
+
+#endif /* VWS_SHM */
+
 vrtql_msg_svr* vrtql_msg_svr_new(int num_threads, int backlog, int queue_size)
 {
     vrtql_msg_svr* server = vws.malloc(sizeof(vrtql_msg_svr));
     ws_svr_ctor((vws_svr*)server, num_threads, backlog, queue_size);
 
     // Server base function overrides
-    server->base.process = msg_svr_client_ws_msg_in;
+    server->base.process      = msg_svr_client_ws_msg_in;
+    server->base.base.on_read = msg_svr_client_read;
 
     // Message handling
     server->on_msg_in    = msg_svr_client_msg_in;
     server->on_msg_out   = msg_svr_client_msg_out;
 
     // Application functions
-    server->process      = msg_svr_client_process;
-    server->send         = msg_svr_client_msg_out;
+    server->process       = msg_svr_client_process;
+    server->send          = msg_svr_client_msg_out;
+    server->process_batch = NULL;
+
+    // Sockets only unless enabled
+    server->shm          = 0;
+
+    // Decode everything up front
+    server->lazy         = false;
+
+    // Not a node until vrtql_cluster_new()
+    server->cluster      = NULL;
 
     return server;
 }
@@ -2008,3 +9122,26 @@ void vrtql_msg_svr_free(vrtql_msg_svr* server)
     ws_svr_dtor((vws_svr*)server);
     vws.free(server);
 }
+
+void vrtql_msg_svr_rpc_env(vws_svr_cnx* cnx, vrtql_rpc_env* e)
+{
+    vrtql_rpc_env_init(e);
+
+    e->deliver = msg_svr_rpc_deliver;
+    e->target  = cnx->server;
+    e->id      = cnx->id;
+}
+
+void vrtql_msg_svr_publish(vrtql_msg_svr* server, cstr topic, vrtql_msg* m)
+{
+    vws_buffer* mdata = vrtql_msg_serialize(m);
+
+    vws_svr_publish( (vws_svr*)server,
+                     topic,
+                     mdata->data,
+                     mdata->size,
+                     BINARY_FRAME );
+
+    vws_buffer_free(mdata);
+    vrtql_msg_free(m);
+}
@@ -2,10 +2,12 @@
 #define VRTQL_SVR_DECLARE
 
 #include <uv.h>
+#include <openssl/ssl.h>
 
 #include "vws.h"
 #include "message.h"
 #include "http_message.h"
+#include "rpc.h"
 
 /**
  * @file server.h
@@ -17,11 +19,13 @@
  * threads that process the data.
  *
  * The networking thread evenly distributes incoming data from clients to the
- * worker threads using a synchronized queue. The worker threads process the
- * data and may send back replies. The server maintains two queues: a request
- * queue that transfers incoming client data to the worker threads for
- * processing, and a response queue that transfers data from the worker threads
- * back to the network thread for sending it back to the client.
+ * worker threads using synchronized queues. The worker threads process the
+ * data and may send back replies. Each worker has its own request queue that
+ * transfers incoming client data to it for processing, and the server has a
+ * response queue that transfers data from the worker threads back to the
+ * network thread for sending it back to the client. Every connection is bound
+ * to one worker when it is accepted, so requests from a given connection are
+ * always processed one at a time and in the order they arrived.
  *
  * The data items are stored in a generic structure called vws_svr_data, which
  * holds the data and the associated connection. The worker threads retrieve
@@ -58,10 +62,133 @@ struct vws_svr_cnx;
 typedef enum
 {
     /* uv_thread() is to close connection */
-    VM_SVR_DATA_CLOSE  = (1 << 1)
+    VM_SVR_DATA_CLOSE   = (1 << 1),
+
+    /* The connection has closed and every request queued before this has been
+     * processed. uv_thread() is to release the connection. */
+    VM_SVR_DATA_RELEASE = (1 << 2),
+
+    /* Part of a WebSocket data message. These go out in the order they were
+     * sent, held back behind any fragmented message still going out. Other
+     * data (control frames) is written straight away. */
+    VM_SVR_DATA_MESSAGE  = (1 << 3),
+
+    /* One fragment of a larger message. Each is written on its own and the
+     * next message data waits for the write to complete, so that control
+     * frames can go out in between. */
+    VM_SVR_DATA_FRAGMENT = (1 << 4),
+
+    /* The data is not the item's to free. It belongs to the shared buffer the
+     * item holds, if any, or to its sender. */
+    VM_SVR_DATA_BORROWED = (1 << 5),
+
+    /* Priority response. It is queued to the loop on its own lane, which
+     * uv_thread() empties first, and on the connection it goes ahead of any
+     * ordinary message data still waiting to be written. */
+    VM_SVR_DATA_PRIORITY = (1 << 6),
+
+    /* uv_thread() is to add the connection to the topic named in data */
+    VM_SVR_DATA_SUBSCRIBE = (1 << 7),
+
+    /* uv_thread() is to remove the connection from the topic named in data */
+    VM_SVR_DATA_UNSUBSCRIBE = (1 << 8),
+
+    /* The shared buffer is to be written to every subscriber of the topic
+     * named in data on the loop. It has no connection. */
+    VM_SVR_DATA_PUBLISH = (1 << 9),
+
+    /* The connection is being handed off to another process and every request
+     * queued before this has been processed. uv_thread() may hand it off once
+     * its output has drained. */
+    VM_SVR_DATA_HANDOFF = (1 << 10),
+
+    /* Travels through the connection's shared memory (shm.h) rather than its
+     * socket. Going to a worker, data is a parsed message (vws_msg*). Going
+     * to the loop, it is a serialized message for the ring. */
+    VM_SVR_DATA_SHM = (1 << 11),
+
+    /* A connection's turn on a worker, with work stealing (see
+     * vws_tcp_svr.steal). The worker processes requests from the connection's
+     * run queue. An idle worker may take it while it waits. */
+    VM_SVR_DATA_RUN = (1 << 12),
+
+    /* A whole binary message with no frame header yet, sent by ID from
+     * outside the connection's worker. The loop frames it, or sends it through
+     * the connection's shared memory if it has any. */
+    VM_SVR_DATA_UNFRAMED = (1 << 13)
 
 } vws_svr_data_state_t;
 
+struct vws_svr_buffer;
+
+/**
+ * @brief Callback that frees memory wrapped in a shared buffer.
+ *
+ * @param data The memory
+ * @param arg The argument given to vws_svr_buffer_wrap()
+ */
+typedef void (*vws_svr_buffer_free)(ucstr data, void* arg);
+
+/**
+ * @brief A reference counted block of memory that any number of vws_svr_data
+ * items can point into, on any number of connections and threads. It is freed
+ * when the last reference is released. The same bytes can so be written to
+ * many connections, or kept by a worker after they have been sent, without
+ * being copied.
+ *
+ * The data must not change while items point at it.
+ */
+typedef struct vws_svr_buffer
+{
+    /**< The number of references held. Changed atomically. */
+    int refs;
+
+    /**< The memory */
+    ucstr data;
+
+    /**< The number of bytes of data */
+    size_t size;
+
+    /**< Frees data with the buffer, NULL if data is stored with the buffer or
+     * is not to be freed */
+    vws_svr_buffer_free on_free;
+
+    /**< Argument passed to on_free */
+    void* arg;
+
+} vws_svr_buffer;
+
+/**
+ * @brief When a sampled request reached each stage of the server, in
+ * uv_hrtime() nanoseconds. A stage it never reached is 0. The timing travels
+ * from the request to the first item the handler sends, so the breakdown
+ * covers the whole trip from read to written response.
+ */
+typedef struct vws_svr_timing
+{
+    /**< Data read from the socket */
+    uint64_t read;
+
+    /**< Request put on the worker queue */
+    uint64_t queued;
+
+    /**< Worker took the request off the queue */
+    uint64_t dequeued;
+
+    /**< Handler sent its response, or returned without one */
+    uint64_t handled;
+
+    /**< Loop took the response off the response queue */
+    uint64_t dispatched;
+
+    /**< Response handed to the socket */
+    uint64_t written;
+
+    /**< Write completed */
+    uint64_t completed;
+
+} vws_svr_timing;
+
 /**
  * @brief Struct representing server data for inter-thread communication
  * between the main network thread and worker threads. This is the way data is
@@ -84,35 +211,80 @@ typedef struct
     /**< Message state flags */
     uint64_t flags;
 
+    /**< Optional header written to the wire ahead of data in the same write.
+     * This lets a frame header go out in front of a payload without copying
+     * the payload. */
+    unsigned char header[14];
+
+    /**< The number of header bytes, 0 if none */
+    uint8_t header_size;
+
+    /**< Shared buffer the data points into, NULL if none. The item holds a
+     * reference to it, which is released when the item is freed. */
+    vws_svr_buffer* shared;
+
+    /**< Connection ID the data is addressed to when cnx is NULL (see
+     * vws_tcp_svr_send_to()), 0 otherwise */
+    uint64_t id;
+
+    /**< When the data was queued (uv_hrtime()), for the queue wait metrics */
+    uint64_t queued;
+
+    /**< Stage times when the data is part of a sampled request, NULL
+     * otherwise. Freed with the item. */
+    vws_svr_timing* timing;
+
 } vws_svr_data;
 
+/**
+ * @brief A slot in a server queue. The sequence number tells producers and
+ * consumers whether the slot is free to write or ready to read.
+ */
+typedef struct
+{
+    /**< Slot sequence number */
+    size_t seq;
+
+    /**< The data */
+    vws_svr_data* data;
+
+} vws_svr_queue_cell;
+
 /**
  * @brief Struct representing a server queue, including information about
- * buffer, size, capacity, and threading.
+ * buffer, capacity, and threading. This is a bounded lock-free
+ * multi-producer/multi-consumer ring. The mutex and condition variables are
+ * only used to put threads to sleep when the queue is empty (or full).
  */
 typedef struct
 {
     /**< The buffer holding data in the queue */
-    vws_svr_data** buffer;
+    vws_svr_queue_cell* buffer;
 
-    /**< Current size of the queue */
-    int size;
+    /**< Maximum capacity of the queue (power of 2) */
+    size_t capacity;
 
-    /**< Maximum capacity of the queue */
-    int capacity;
+    /**< Head position of the queue (next slot to read) */
+    size_t head;
 
-    /**< Head position of the queue */
-    int head;
+    /**< Tail position of the queue (next slot to write) */
+    size_t tail;
 
-    /**< Tail position of the queue */
-    int tail;
+    /**< Number of consumers sleeping on cond */
+    int waiting;
 
-    /**< Mutex for thread safety */
+    /**< Number of producers sleeping on space */
+    int blocked;
+
+    /**< Mutex for sleeping */
     uv_mutex_t mutex;
 
-    /**< Condition variable for thread synchronization */
+    /**< Signaled when data arrives */
     uv_cond_t cond;
 
+    /**< Signaled when space frees up in a full queue */
+    uv_cond_t space;
+
     /**< Current state of the queue */
     uint8_t state;
 
@@ -122,6 +294,161 @@ typedef struct
 } vws_svr_queue;
 
 struct vws_tcp_svr;
+struct vws_svr_loop;
+struct vws_svr_handoff;
+struct vws_svr_shm;
+
+//------------------------------------------------------------------------------
+// Metrics
+//------------------------------------------------------------------------------
+
+/** Sub-buckets per power of two in a histogram. Values are kept to within
+ * one part in eight. */
+#define VWS_SVR_HIST_SUB 8
+
+/** Buckets in a histogram. Covers values up to 2^40 (about 18 minutes in
+ * nanoseconds). Larger values are counted in the last bucket. */
+#define VWS_SVR_HIST_BUCKETS 304
+
+/** Number of WebSocket opcodes counted */
+#define VWS_SVR_OPCODES 16
+
+/**
+ * @brief A log-linear latency histogram in nanoseconds. Values from 0 to 7
+ * have a bucket each. Above that, each power of two is split into
+ * VWS_SVR_HIST_SUB buckets.
+ */
+typedef struct vws_svr_histogram
+{
+    /**< Number of values recorded */
+    uint64_t count;
+
+    /**< Sum of the values recorded */
+    uint64_t sum;
+
+    /**< Largest value recorded */
+    uint64_t max;
+
+    /**< Count of values in each bucket */
+    uint64_t buckets[VWS_SVR_HIST_BUCKETS];
+
+} vws_svr_histogram;
+
+/**
+ * @brief Server metrics. Each loop and worker thread keeps its own set,
+ * which only it updates, so counting never contends.
+ * vws_tcp_svr_metrics() adds them up into a snapshot.
+ */
+typedef struct vws_svr_metrics
+{
+    /**< Connections accepted */
+    uint64_t connections;
+
+    /**< Connections closed */
+    uint64_t disconnections;
+
+    /**< Bytes read from sockets */
+    uint64_t bytes_in;
+
+    /**< Bytes handed to sockets for writing */
+    uint64_t bytes_out;
+
+    /**< WebSocket frames received, by opcode */
+    uint64_t frames_in[VWS_SVR_OPCODES];
+
+    /**< WebSocket frames written, by opcode */
+    uint64_t frames_out[VWS_SVR_OPCODES];
+
+    /**< WebSocket messages received, by opcode */
+    uint64_t messages_in[VWS_SVR_OPCODES];
+
+    /**< WebSocket messages sent, by opcode */
+    uint64_t messages_out[VWS_SVR_OPCODES];
+
+    /**< Requests taken off worker queues */
+    uint64_t requests;
+
+    /**< Responses taken off loop queues */
+    uint64_t responses;
+
+    /**< Times a worker woke a loop to send responses. Workers only wake a
+     * loop that is not already awake, so this is usually far below
+     * responses. */
+    uint64_t wakeups;
+
+    /**< Connections a worker took from another worker's queue (work
+     * stealing) */
+    uint64_t steals;
+
+    /**< Writes the socket took in full from uv_try_write(), never queued */
+    uint64_t immediate_writes;
+
+    /**< Requests dropped unprocessed because their deadline (VM_DEADLINE)
+     * passed while they were queued */
+    uint64_t expired;
+
+    /**< Requests waiting in worker queues. Filled in by the snapshot. With
+     * work stealing, connections waiting for a worker. */
+    uint64_t requests_depth;
+
+    /**< Responses waiting in loop queues. Filled in by the snapshot. */
+    uint64_t responses_depth;
+
+    /**< Time requests spent in worker queues */
+    vws_svr_histogram requests_wait;
+
+    /**< Time responses spent in loop queues */
+    vws_svr_histogram responses_wait;
+
+    /**< Time spent in on_data_in() */
+    vws_svr_histogram processing;
+
+    /**< Time from a write being issued to its completion */
+    vws_svr_histogram writes;
+
+} vws_svr_metrics;
+
+/**
+ * @brief Estimates a percentile of the values in a histogram.
+ *
+ * @param h The histogram
+ * @param p The percentile, from 0 to 100
+ * @return The upper bound of the bucket holding the percentile (never more
+ *   than the largest value recorded), or 0 if the histogram is empty.
+ *
+ * @ingroup ServerFunctions
+ */
+uint64_t vws_svr_histogram_percentile(const vws_svr_histogram* h, double p);
+
+/**
+ * @brief Struct representing a worker thread in the pool along with the queue
+ * of requests dispatched to it.
+ */
+typedef struct vws_svr_worker
+{
+    /**< The server the worker belongs to */
+    struct vws_tcp_svr* server;
+
+    /**< Request queue */
+    vws_svr_queue requests;
+
+    /**< Thread handle */
+    uv_thread_t thread;
+
+    /**< Metrics updated by this worker */
+    vws_svr_metrics* metrics;
+
+    /**< CPUs the worker runs on, NULL if it is not pinned */
+    int* cpus;
+
+    /**< Number of CPUs in cpus */
+    int cpu_count;
+
+    /**< Whether the worker has work in hand rather than sleeping. Read by
+     * other threads looking for an idle worker when work stealing. */
+    bool busy;
+
+} vws_svr_worker;
 
 /**
  * @brief Represents a client connection.
@@ -131,7 +458,8 @@ typedef struct vws_svr_cnx
     /**< The server associated with the connection */
     struct vws_tcp_svr* server;
 
-    /**< The client associated with the connection */
+    /**< The client associated with the connection. NULL once the socket has
+     * closed and the connection is waiting to be released. */
     uv_stream_t* handle;
 
     /* Flag holds the HTTP request that started connection. */
@@ -141,14 +469,94 @@ typedef struct vws_svr_cnx
      *  WebSockets */
     bool upgraded;
 
-    /**< User-defined data associated with the connection */
-    char* data;
+    /**< Whether reading is paused because too much output is pending */
+    bool paused;
 
     /**< The format to serialize. If VM_MPACK_FORMAT, serialize into MessagePack
      *   binary format. If VM_JSON_FORMAT, then serialize into JSON format.
      */
     vrtql_msg_format_t format;
 
+    /**< User-defined data associated with the connection */
+    char* data;
+
+    /**< The worker that processes all requests from this connection. With an
+     * adaptive pool the connection may move to another worker while it has no
+     * requests pending. */
+    vws_svr_worker* worker;
+
+    /**< Requests queued to the worker or being processed, with an adaptive
+     * pool (see vws_tcp_svr_set_pool()). Changed atomically. */
+    uint32_t pending;
+
+    /**< Requests waiting for the connection's turn on a worker, oldest last,
+     * with work stealing (see vws_tcp_svr.steal). Guarded by run_lock. */
+    struct sc_queue_ptr run;
+
+    /**< Spinlock guarding run and scheduled */
+    bool run_lock;
+
+    /**< Whether the connection's turn is on a worker queue or a worker is
+     * running it. There is never more than one, so its requests are processed
+     * in order. */
+    bool scheduled;
+
+    /**< The network loop that owns the connection's socket */
+    struct vws_svr_loop* loop;
+
+    /**< TLS session, NULL for plaintext connections. It is driven entirely by
+     * the owning loop through memory BIOs: ciphertext read from the socket is
+     * fed into it and everything it produces is written to the socket. */
+    SSL* ssl;
+
+    /**< Message data held back while a fragment is being written, oldest
+     * last. Only the owning loop touches it. */
+    struct sc_queue_ptr outbox;
+
+    /**< Priority message data held back, oldest last. It is written ahead of
+     * outbox, but never in the middle of a fragmented message. */
+    struct sc_queue_ptr priority_outbox;
+
+    /**< The outbox of the message whose fragments are going out, NULL if no
+     * fragmented message is part way written */
+    struct sc_queue_ptr* open_outbox;
+
+    /**< Whether a fragment write is in progress */
+    bool fragment_pending;
+
+    /**< The number of topics the connection is subscribed to. Only the owning
+     * loop touches it. */
+    uint32_t subscriptions;
+
+    /**< Connection ID: slot index in the low 32 bits, slot generation in the
+     * high 32 bits. Unlike the pointer, it is safe to hold on to after the
+     * connection is gone. Sends to it are then dropped. */
+    uint64_t id;
+
+    /**< Loop time (ms) of the last read from the connection */
+    uint64_t last_read;
+
+    /**< Whether a keepalive has gone out since the last read */
+    bool keepalive_sent;
+
+    /**< The timer wheel slot the connection is in, -1 if none */
+    int32_t timer_slot;
+
+    /**< Next connection in the same timer wheel slot */
+    struct vws_svr_cnx* timer_next;
+
+    /**< Previous connection in the same timer wheel slot */
+    struct vws_svr_cnx* timer_prev;
+
+    /**< Handoff to another process (see vws_tcp_svr_handoff()): 0 if none is
+     * under way, 1 once reading has stopped, 2 once its worker has nothing
+     * left of it. Only the owning loop touches it. */
+    uint8_t handoff;
+
+    /**< Shared memory transport (shm.h), if the client has attached one. Set
+     * and cleared by the owning loop. */
+    struct vws_svr_shm* shm;
+
 } vws_svr_cnx;
 
 /**
@@ -164,7 +572,9 @@ typedef void (*vws_tcp_svr_connect)(vws_svr_cnx* c);
 typedef void (*vws_tcp_svr_disconnect)(vws_svr_cnx* c);
 
 /**
- * @brief Callback for connection read
+ * @brief Callback for connection read. The buffer belongs to the server and is
+ * reused for the next read, so it is only valid for the duration of the call.
+ * Any data that must outlive the call must be copied out.
  * @param c The connection structure
  * @param n The number of bytes in the buffer
  * @param b The buffer
@@ -178,6 +588,56 @@ typedef void (*vws_tcp_svr_read)(vws_svr_cnx* c, ssize_t n, const uv_buf_t* b);
  */
 typedef void (*vws_tcp_svr_process_data)(vws_svr_data* t);
 
+/**
+ * @brief Callback for backpressure changes. Called in the network thread when
+ * reading from a connection is paused because its pending output went over the
+ * high watermark, and again when it is resumed after dropping to the low
+ * watermark.
+ * @param c The connection structure
+ * @param paused True if reading was paused, false if resumed
+ */
+typedef void (*vws_tcp_svr_backpressure)(vws_svr_cnx* c, bool paused);
+
+/**
+ * @brief Callback for a connection that has been quiet for
+ * vws_tcp_svr.keepalive milliseconds. Called in the network thread, once per
+ * quiet spell, to prompt the peer for a sign of life.
+ * @param c The connection structure
+ */
+typedef void (*vws_tcp_svr_keepalive)(vws_svr_cnx* c);
+
+/**
+ * @brief Callback for a sampled request (see vws_tcp_svr.sample_rate). Called
+ * once its response has been written, in the network thread, or in the worker
+ * if the handler sent nothing. Keep it short.
+ * @param s The server
+ * @param t When the request reached each stage
+ */
+typedef void (*vws_tcp_svr_sample)( struct vws_tcp_svr* s,
+                                    const vws_svr_timing* t );
+
+/**
+ * @brief Callback that saves a connection for handoff to another process (see
+ * vws_tcp_svr_handoff()). Called in the network thread once reading from the
+ * connection has stopped, its worker has nothing left of it and everything
+ * sent to it has been written.
+ * @param c The connection structure
+ * @param state Receives whatever the other process needs to carry on serving
+ *   the connection. It is passed to on_adopt there.
+ * @return True to hand the connection off, false to keep serving it here
+ */
+typedef bool (*vws_tcp_svr_handoff_cnx)(vws_svr_cnx* c, vws_buffer* state);
+
+/**
+ * @brief Callback that restores a connection handed off by another process
+ * (see vws_tcp_svr_takeover()). Called in the network thread after
+ * on_connect, before the connection is read from.
+ * @param c The connection structure
+ * @param state The state saved by on_handoff in the other process
+ * @param size The size of state
+ */
+typedef void (*vws_tcp_svr_adopt_cnx)(vws_svr_cnx* c, ucstr state, size_t size);
+
 /**
  * @brief Enumerates server states
  */
@@ -194,41 +654,325 @@ typedef enum
 
 } vws_tcp_svr_state_t;
 
+/** Milliseconds between timer wheel ticks */
+#define VWS_SVR_TIMER_TICK 250
+
+/** Slots in the timer wheel (a power of two). One turn of the wheel covers
+ * VWS_SVR_TIMER_TICK * VWS_SVR_TIMER_SLOTS milliseconds. */
+#define VWS_SVR_TIMER_SLOTS 256
+
+/** Milliseconds between checks of an adaptive worker pool */
+#define VWS_SVR_POOL_TICK 100
+
+/** Most requests a worker processes from one connection's run queue in a turn
+ * before giving other connections theirs (work stealing) */
+#define VWS_SVR_RUN_BATCH 64
+
+/**
+ * @brief An adaptive worker pool (see vws_tcp_svr_set_pool()). The first loop
+ * checks the request queues every VWS_SVR_POOL_TICK milliseconds. It adds a
+ * worker when more requests are queued than there are active workers, or when
+ * they waited longer than grow_wait on average over the tick. When for
+ * park_idle nothing was queued at a check and the waits stayed under a quarter
+ * of grow_wait, it parks the last active worker.
+ *
+ * Connections are bound to active workers. A parked worker takes no new
+ * connections, and the ones it has move to active workers as they next send
+ * something with nothing pending, so requests of a connection are still
+ * processed in order. Once they have all moved the worker sleeps on its empty
+ * queue. A connection also moves if its worker is backed up while it has
+ * nothing pending, so a burst on one worker spreads to the others.
+ */
+typedef struct vws_svr_pool
+{
+    /**< Fewest active workers */
+    int min;
+
+    /**< Workers new connections are bound to: the first active of them. Only
+     * the first loop changes it. Read atomically. */
+    int active;
+
+    /**< Workers whose threads have been started: the first started */
+    int started;
+
+    /**< Mean microseconds requests may wait in the queues over a tick before
+     * the pool grows (default 1000) */
+    uint32_t grow_wait;
+
+    /**< Milliseconds the pool must stay quiet before it shrinks by one worker
+     * (default 5000) */
+    uint32_t park_idle;
+
+    /**< Timer on the first loop that resizes the pool */
+    uv_timer_t* timer;
+
+    /**< Requests taken off the queues as of the last check */
+    uint64_t requests;
+
+    /**< Their total wait in nanoseconds */
+    uint64_t wait;
+
+    /**< Milliseconds the pool has been quiet, as of the last check */
+    uint32_t idle;
+
+} vws_svr_pool;
+
 /** Abbreviation for the connection map */
 typedef struct sc_map_64v vws_svr_cnx_map;
 
 /**
- * @brief Struct representing a basic server. It does not do anything but
- * process raw data. It does not have any knowledge of WebSockets.
+ * @brief The subscribers to a topic on one loop. They are kept in an array so
+ * that publishing walks contiguous memory. The index locates a connection in
+ * it for subscribe and unsubscribe.
  */
-typedef struct vws_tcp_svr
+typedef struct vws_svr_topic
 {
-    /**< Current state of the server */
-    uint8_t state;
+    /**< The topic name */
+    char* name;
 
-    /**< Asynchronous handle for event-based programming */
-    uv_async_t* wakeup;
+    /**< Subscribed connections */
+    struct vws_svr_cnx** cnxs;
+
+    /**< The number of subscribed connections */
+    size_t size;
+
+    /**< The number of slots allocated in cnxs */
+    size_t allocated;
+
+    /**< Maps each subscribed connection to its slot in cnxs */
+    struct sc_map_64 index;
+
+} vws_svr_topic;
+
+/**
+ * @brief Struct representing a network loop: a libuv loop with its own thread,
+ * listening socket, connections and response queue. Connections stay on the
+ * loop that accepted them for their whole life, so loops never share state.
+ */
+typedef struct vws_svr_loop
+{
+    /**< The server the loop belongs to */
+    struct vws_tcp_svr* server;
 
     /**< Event loop handle */
     uv_loop_t* loop;
 
-    /**< Request queue */
-    vws_svr_queue requests;
+    /**< Asynchronous handle for event-based programming */
+    uv_async_t* wakeup;
 
     /**< Response queue */
     vws_svr_queue responses;
 
+    /**< Priority response queue, drained ahead of responses */
+    vws_svr_queue priority;
+
+    /**< Whether the loop has been woken and not yet emptied its queues.
+     * Workers only call uv_async_send() on wakeup when they are the first to
+     * set it. */
+    bool signaled;
+
+    /**< Index of active connections, keyed by handle. Callbacks find their
+     * connection on handle->data. This is only used to enumerate them at
+     * shutdown. */
+    vws_svr_cnx_map cnxs;
+
+    /**< Per-connection write batches, filled and emptied in each wakeup */
+    struct sc_map_64v batches;
+
+    /**< Topics with subscribers on this loop, keyed by name (vws_svr_topic) */
+    struct sc_map_sv topics;
+
+    /**< Read buffer handed to libuv for every socket read. Reads all happen on
+     * the loop thread and each one is fully handled by on_read before the next
+     * begins, so a single buffer serves all connections on the loop. */
+    uv_buf_t read_buffer;
+
+    /**< Buffer list for batches too big for the one on the stack. It grows as
+     * needed and is kept from one write to the next. */
+    uv_buf_t* write_bufs;
+
+    /**< Number of entries write_bufs has room for */
+    size_t write_bufs_size;
+
+    /**< Listening socket: a uv_tcp_t, or a uv_pipe_t for a Unix socket */
+    uv_stream_t* listener;
+
+    /**< Timer that turns the wheel, running while keepalive or idle_timeout
+     * is set */
+    uv_timer_t* timer;
+
+    /**< Timer wheel: lists of connections due for a check in each tick */
+    struct vws_svr_cnx** wheel;
+
+    /**< The slot the wheel checks on its next tick */
+    uint32_t wheel_cursor;
+
+    /**< Metrics updated by this loop */
+    vws_svr_metrics* metrics;
+
+    /**< When the loop last read from a socket (uv_hrtime()) */
+    uint64_t read_time;
+
+    /**< Requests read, for picking which to sample */
+    uint32_t sample_count;
+
+    /**< Thread handle. The first loop runs in the thread that called
+     * vws_tcp_svr_run(). */
+    uv_thread_t thread;
+
+    /**< CPUs the loop runs on, NULL if it is not pinned */
+    int* cpus;
+
+    /**< Number of CPUs in cpus */
+    int cpu_count;
+
+    /**< Worker of its own the next accepted connection is bound to, with
+     * VWS_SVR_AFFINITY_NODE (round-robin) */
+    unsigned int next_worker;
+
+    /**< Timer that hands off drained connections while a handoff to another
+     * process is under way on the loop, NULL otherwise */
+    uv_timer_t* handoff;
+
+    /**< Whether the loop has finished handing off */
+    bool handed_off;
+
+} vws_svr_loop;
+
+/** Bits of slot index per page of the connection slot table */
+#define VWS_SVR_SLOT_BITS 12
+
+/** Maximum pages in the connection slot table (1M connections) */
+#define VWS_SVR_SLOT_PAGES 256
+
+/**
+ * @brief A connection slot. The generation changes every time the slot is
+ * given up, so IDs issued for earlier connections in it no longer match.
+ */
+typedef struct vws_svr_slot
+{
+    /**< The connection, NULL if the slot is free */
+    struct vws_svr_cnx* cnx;
+
+    /**< Current generation. Changed atomically. */
+    uint32_t generation;
+
+    /**< Index of the loop that owns the connection */
+    uint32_t loop;
+
+} vws_svr_slot;
+
+/**
+ * @brief The connection slot table. Pages are allocated as needed and never
+ * move, so any thread can read a slot without taking the lock. The lock only
+ * guards handing out and taking back slots.
+ */
+typedef struct vws_svr_slots
+{
+    /**< Slot pages */
+    vws_svr_slot* pages[VWS_SVR_SLOT_PAGES];
+
+    /**< Slots handed out so far, free or not */
+    uint32_t used;
+
+    /**< Free slot indexes, used as a stack */
+    uint32_t* free;
+
+    /**< The number of free slot indexes */
+    size_t free_count;
+
+    /**< The number of entries allocated in free */
+    size_t free_allocated;
+
+    /**< Guards everything but reading slots */
+    uv_mutex_t lock;
+
+} vws_svr_slots;
+
+/**
+ * @brief How a server places its threads on CPUs (see
+ * vws_tcp_svr_set_affinity()).
+ */
+typedef enum
+{
+    /**< Leave placement to the OS (default) */
+    VWS_SVR_AFFINITY_NONE,
+
+    /**< Pin every loop and worker to a CPU of its own, in the order given */
+    VWS_SVR_AFFINITY_CPU,
+
+    /**< Give each loop a NUMA node. The loop and its workers run on the CPUs
+     * of that node, and it binds the connections it accepts only to its own
+     * workers, so requests and responses stay on the node. Worker i belongs to
+     * loop i % loop_count. */
+    VWS_SVR_AFFINITY_NODE
+
+} vws_svr_affinity_t;
+
+/**
+ * @brief Struct representing a basic server. It does not do anything but
+ * process raw data. It does not have any knowledge of WebSockets.
+ */
+typedef struct vws_tcp_svr
+{
+    /**< Current state of the server */
+    uint8_t state;
+
+    /**< Network loops. There is always at least one. */
+    vws_svr_loop* loops;
+
+    /**< Number of network loops */
+    int loop_count;
+
+    /**< Connection slots, which connection IDs refer to */
+    vws_svr_slots slots;
+
     /**< Maximum connections allowed */
     int backlog;
 
-    /**< Number of threads in the worker pool */
+    /**< Seconds the kernel holds an accepted connection until the client sends
+     * something (TCP_DEFER_ACCEPT, default 0, off). The loop is then not woken
+     * for clients that connect and say nothing yet. Applies to sockets the
+     * server binds. Linux only. */
+    uint32_t defer_accept;
+
+    /**< Length of the queue of TCP Fast Open connections waiting to be
+     * accepted (TCP_FASTOPEN, default 0, off). A returning client can then
+     * send its request with the SYN and save a round trip. Applies to sockets
+     * the server binds. */
+    uint32_t fastopen;
+
+    /**< TCP options set on each accepted connection. See vws_sockopts for
+     * the defaults. */
+    vws_sockopts sockopts;
+
+    /**< Connections each loop allocates state for when it starts (default 0).
+     * An accept storm is then set up from memory already on hand. Closed
+     * connections give their state back for reuse either way. */
+    uint32_t cnx_reserve;
+
+    /**< Number of workers: the most threads the pool runs */
     int pool_size;
 
-    /**< Thread handles */
-    uv_thread_t* threads;
+    /**< Adaptive pool state. Unless vws_tcp_svr_set_pool() is called every
+     * worker is always active. */
+    vws_svr_pool pool;
 
-    /**< Map of active connections */
-    vws_svr_cnx_map cnxs;
+    /**< Worker pool, each with its own request queue */
+    vws_svr_worker* workers;
+
+    /**< Work stealing (default false). Each connection queues its requests on
+     * a run queue of its own, and only its turn goes on its worker's queue. A
+     * worker runs one connection's requests at a time, in order. A worker
+     * with nothing to do takes waiting connections from a busy worker's
+     * queue, and a connection with nothing queued goes to an idle worker. So
+     * one hot connection keeps its worker busy while the other connections
+     * bound to it move elsewhere. Set before vws_tcp_svr_run(). Ignored with
+     * an adaptive pool (vws_tcp_svr_set_pool()). */
+    bool steal;
+
+    /**< Worker the next accepted connection is bound to (round-robin) */
+    unsigned int next_worker;
 
     /**< Callback function for connect */
     vws_tcp_svr_connect on_connect;
@@ -245,14 +989,156 @@ typedef struct vws_tcp_svr
     /**< Function for processing data from the worker back to the client */
     vws_tcp_svr_process_data on_data_out;
 
+    /**< Callback function for backpressure changes */
+    vws_tcp_svr_backpressure on_backpressure;
+
+    /**< Callback function for quiet connections (see keepalive) */
+    vws_tcp_svr_keepalive on_keepalive;
+
+    /**< Milliseconds without reading from a connection after which
+     * on_keepalive is called (default 0, off). The WebSocket server sends a
+     * ping. */
+    uint32_t keepalive;
+
+    /**< Milliseconds without reading from a connection after which it is
+     * closed (default 0, off) */
+    uint32_t idle_timeout;
+
+    /**< Callback for sampled requests */
+    vws_tcp_svr_sample on_sample;
+
+    /**< Time one request in this many through the server and pass the
+     * breakdown to on_sample (default 0, off) */
+    uint32_t sample_rate;
+
+    /**< Pending write bytes on a connection at which reading from it pauses
+     * (default 8 MB). 0 disables backpressure. A client that does not read its
+     * responses then stops being read from, so it cannot pile up unbounded
+     * output or keep its worker busy. */
+    size_t write_high;
+
+    /**< Pending write bytes on a paused connection at which reading resumes
+     * (default 1 MB) */
+    size_t write_low;
+
+    /**< Largest write tried straight away with uv_try_write() when nothing is
+     * queued on the connection (default 16 KB). The kernel usually takes it
+     * whole, so no write request or callback is needed. Whatever it does not
+     * take is queued as usual. 0 queues every write. */
+    size_t try_write;
+
+    /**< Most requests a worker takes off its queue at once (default 16). They
+     * are claimed together and handled in order. Ignored when work stealing,
+     * where a connection's turn is already a batch of its requests. */
+    uint32_t batch;
+
+    /**< Size of the arena each worker installs in vws.arena while it handles
+     * requests, and resets after each batch of them (default 0, off).
+     * Messages created with vrtql_msg_new() during a request, and the
+     * temporaries of JSON (de)serialization, then cost a pointer bump and are
+     * released together. Set it only if process() keeps nothing it is given
+     * or creates past its return, other than by passing messages to send().
+     * Takes effect when the workers start. */
+    size_t arena_size;
+
+    /**< TLS context used for accepted connections. NULL (default) serves
+     * plaintext. Set by vws_tcp_svr_tls(). */
+    SSL_CTX* ssl_ctx;
+
     /**< Tracing leve (0 is off) */
     uint8_t trace;
 
     /**< inetd mode (default 0). vws_tcp_svr_inetd_run() sets it to 1. */
     uint8_t inetd_mode;
 
+    /**< Metrics updated by threads other than the server's own, such as
+     * application threads sending messages */
+    vws_svr_metrics* metrics;
+
+    /**< Thread placement (vws_svr_affinity_t). Set by
+     * vws_tcp_svr_set_affinity(). */
+    uint8_t affinity;
+
+    /**< CPUs threads are placed on */
+    int* cpus;
+
+    /**< Number of CPUs in cpus */
+    int cpu_count;
+
+    /**< Callback function for handing a connection off to another process */
+    vws_tcp_svr_handoff_cnx on_handoff;
+
+    /**< Callback function for a connection handed off by another process */
+    vws_tcp_svr_adopt_cnx on_adopt;
+
+    /**< Inherited listening sockets (see vws_tcp_svr_inherit()), used by
+     * vws_tcp_svr_run() in place of binding */
+    int* listen_fds;
+
+    /**< Number of sockets in listen_fds */
+    int listen_fd_count;
+
+    /**< Handoff under way to or from another process, NULL if none */
+    struct vws_svr_handoff* handoff;
+
 } vws_tcp_svr;
 
+/**
+ * @brief Creates a shared buffer of the given size, holding one reference for
+ * the caller. Its data is allocated with it, for the caller to fill in.
+ *
+ * @param size The number of bytes
+ * @return A new shared buffer
+ */
+vws_svr_buffer* vws_svr_buffer_new(size_t size);
+
+/**
+ * @brief Creates a shared buffer over memory the caller hands over, holding
+ * one reference for the caller. Nothing is copied.
+ *
+ * @param data The memory
+ * @param size The number of bytes
+ * @param on_free Called to free the memory when the last reference goes. NULL
+ *   leaves it alone.
+ * @param arg Passed to on_free
+ * @return A new shared buffer
+ */
+vws_svr_buffer* vws_svr_buffer_wrap( ucstr data,
+                                     size_t size,
+                                     vws_svr_buffer_free on_free,
+                                     void* arg );
+
+/**
+ * @brief Adds a reference to a shared buffer. Safe from any thread.
+ *
+ * @param b The buffer
+ * @return The buffer
+ */
+vws_svr_buffer* vws_svr_buffer_ref(vws_svr_buffer* b);
+
+/**
+ * @brief Releases a reference to a shared buffer, freeing it with the last.
+ * Safe from any thread.
+ *
+ * @param b The buffer
+ */
+void vws_svr_buffer_release(vws_svr_buffer* b);
+
+/**
+ * @brief Creates a new thread data that points into a shared buffer. It takes
+ * a reference of its own, so the caller keeps theirs.
+ *
+ * @param c The connection
+ * @param b The shared buffer
+ * @param offset Where the data starts in the buffer
+ * @param size The number of bytes
+ * @return A new vws_svr_data instance
+ */
+vws_svr_data* vws_svr_data_share( vws_svr_cnx* c,
+                                  vws_svr_buffer* b,
+                                  size_t offset,
+                                  size_t size );
+
 /**
  * @brief Creates a new thread data. This TAKES OWNERSHIP of the buffer data and
  * sets the buffer to zero.
@@ -286,7 +1172,7 @@ void vws_svr_data_free(vws_svr_data* t);
  *
  * @param pool_size The number of threads to run in the worker pool
  * @param backlog The connection backlog for listen(). If this is set to 0, it
- *   will use the default (128).
+ *   will use the default (4096, capped by the kernel at net.core.somaxconn).
  * @param queue_size The maximum queue size for requests and responses. If this
  *   is set to 0, it will use the default (1024).
  * @return A new VRTQL server.
@@ -300,9 +1186,76 @@ vws_tcp_svr* vws_tcp_svr_new(int pool_size, int backlog, int queue_size);
  */
 void vws_tcp_svr_free(vws_tcp_svr* s);
 
+/**
+ * @brief Sets the number of network loops. Each loop runs in its own thread
+ * with its own SO_REUSEPORT listener on the same address, so the kernel spreads
+ * incoming connections across them. The default is 1. This must be called
+ * before vws_tcp_svr_run(). Has no effect in inetd mode.
+ *
+ * @param server The server.
+ * @param n The number of loops (at least 1).
+ * @return 0 if successful, -1 if the server is running.
+ */
+int vws_tcp_svr_set_loops(vws_tcp_svr* server, int n);
+
+/**
+ * @brief Makes the worker pool adaptive (see vws_svr_pool). Between min and
+ * max workers are active, as the load requires. This must be called before
+ * vws_tcp_svr_run(). It replaces the workers made by vws_tcp_svr_new().
+ * Threads are only started for workers as they are first needed. Has no
+ * effect in inetd mode, which runs max workers.
+ *
+ * @param server The server.
+ * @param min The fewest active workers (at least 1).
+ * @param max The most (at least min).
+ * @return 0 if successful, -1 if the server is running.
+ */
+int vws_tcp_svr_set_pool(vws_tcp_svr* server, int min, int max);
+
+/**
+ * @brief Sets how the server places its loop and worker threads on CPUs. The
+ * threads pin themselves as they start, before they allocate anything of their
+ * own, so their pooled objects, arenas and read buffers are in memory local to
+ * them. This must be called before vws_tcp_svr_run(). It is only supported on
+ * Linux.
+ *
+ * @param server The server.
+ * @param mode The placement.
+ * @param cpus The CPUs to use, as a list of numbers and ranges such as
+ *   "0-7,16-23". If NULL, every CPU the process may run on.
+ * @return 0 if successful, -1 if the server is running, the list is invalid
+ *   or the platform is not supported.
+ */
+int vws_tcp_svr_set_affinity( vws_tcp_svr* server,
+                              vws_svr_affinity_t mode,
+                              cstr cpus );
+
+/**
+ * @brief Enables TLS on all connections accepted by the server. This loads the
+ * certificate chain and private key into the global vws_ssl_ctx (creating it
+ * if needed) and turns on the server session cache and session tickets, so
+ * returning clients can resume without a full handshake. TLS records are
+ * encrypted and decrypted on the loop that owns the connection. The sessions
+ * run over memory BIOs, with libuv doing the socket I/O, so unlike client
+ * sockets (vws_socket.ktls) they can't hand records to the kernel. This must
+ * be called before vws_tcp_svr_run().
+ *
+ * @param server The server.
+ * @param cert Path to the PEM certificate chain file.
+ * @param key Path to the PEM private key file.
+ * @return 0 if successful, -1 otherwise (vws.e holds the error).
+ */
+int vws_tcp_svr_tls(vws_tcp_svr* server, cstr cert, cstr key);
+
 /**
  * @brief Starts a VRTQL server.
  *
+ * If listening sockets have been inherited (vws_tcp_svr_inherit()), the server
+ * listens on them instead and host and port are ignored. It then runs at least
+ * as many loops as there are sockets. Loops beyond that share them. Connections
+ * received by vws_tcp_svr_takeover() are adopted before it starts serving,
+ * spread over the loops.
+ *
  * @param server The server to run.
  * @param host The host to bind the server.
  * @param port The port to bind the server.
@@ -310,6 +1263,101 @@ void vws_tcp_svr_free(vws_tcp_svr* s);
  */
 int vws_tcp_svr_run(vws_tcp_svr* server, cstr host, int port);
 
+/**
+ * @brief Adds a listening socket for vws_tcp_svr_run() to use rather than
+ * binding one, such as one passed down by a service manager or an earlier
+ * instance of the server. The server takes ownership of it. This must be
+ * called before vws_tcp_svr_run().
+ *
+ * @param server The server.
+ * @param fd A socket that is bound and listening.
+ * @return 0 if successful, -1 if the server is running or fd is not a
+ *   listening socket.
+ */
+int vws_tcp_svr_inherit(vws_tcp_svr* server, int fd);
+
+/**
+ * @brief Listens on a Unix domain socket, for clients on the same host such as
+ * a sidecar. Clients connect with vws_socket_connect_unix() (or
+ * vws_connect_unix()) and speak the same protocol as over TCP, without the
+ * loopback TCP stack in between. The socket is added as if inherited (see
+ * vws_tcp_svr_inherit()), so vws_tcp_svr_run() then ignores host and port and
+ * a handoff passes it on like any other listener. To serve TCP as well,
+ * inherit a TCP listener alongside it. This must be called before
+ * vws_tcp_svr_run().
+ *
+ * A socket file left by an earlier run is replaced. The file is not removed
+ * when the server stops, so that a process taking over keeps serving on it.
+ *
+ * @param server The server.
+ * @param path The socket path. A leading '@' names a socket in the Linux
+ *   abstract namespace instead, which needs no file.
+ * @return 0 if successful, -1 otherwise (vws.e holds the error).
+ */
+int vws_tcp_svr_listen_unix(vws_tcp_svr* server, cstr path);
+
+/**
+ * @brief Inherits the sockets passed by systemd socket activation (or anything
+ * else following its protocol): LISTEN_FDS sockets starting at descriptor 3,
+ * if LISTEN_PID is this process. The variables are removed from the
+ * environment so child processes don't take them too. This must be called
+ * before vws_tcp_svr_run().
+ *
+ * @param server The server.
+ * @return The number of sockets inherited (0 if none were passed), -1 on
+ *   error.
+ */
+int vws_tcp_svr_activate(vws_tcp_svr* server);
+
+/**
+ * @brief Takes over from a running instance of the server for a restart with
+ * no downtime. Listens on a Unix socket at path for the old process, which
+ * calls vws_tcp_svr_handoff() with the same path. It receives its listening
+ * sockets, which are inherited (see vws_tcp_svr_inherit()), and then its open
+ * connections one by one as they drain. Returns once the old process is
+ * done. Call vws_tcp_svr_run() next: it adopts the connections, passing the
+ * state each was saved with to on_adopt. New connections wait in the listen
+ * backlog until then.
+ *
+ * Both processes must run the same build of the library, as the same user.
+ * The socket is only open to this user, and a process running as anyone else
+ * is refused. This must be called before vws_tcp_svr_run().
+ *
+ * @param server The server.
+ * @param path The path of the Unix socket. A socket left there is removed.
+ *   Anything else there is left alone, and the call fails.
+ * @param timeout Milliseconds to wait for the old process to connect, and then
+ *   for each message from it.
+ * @return The number of connections received, -1 on error (vws.e holds it).
+ *   Anything received before an error is kept.
+ */
+int vws_tcp_svr_takeover(vws_tcp_svr* server, cstr path, int timeout);
+
+/**
+ * @brief Hands a running server over to a new process waiting in
+ * vws_tcp_svr_takeover(). Call it from a thread other than the server's.
+ *
+ * The listening sockets are passed first, and the loops stop accepting. Each
+ * connection then stops being read from. Once its worker has processed what
+ * was read and everything sent to it has been written, on_handoff saves it and
+ * its socket is passed on with that state, its topics and whether it has
+ * upgraded. Here it is closed as far as this process is concerned: it gets
+ * on_disconnect, and anything still sent to it is dropped. Connections that
+ * have not drained by the timeout are closed. TLS connections, and those
+ * on_handoff declines, stay and are served as before.
+ *
+ * Call vws_tcp_svr_stop() afterwards, once any connections that stayed are
+ * done. A server can only hand off once, and only to a process running as the
+ * same user.
+ *
+ * @param server The server.
+ * @param path The path of the new process's Unix socket.
+ * @param timeout Milliseconds connections have to drain.
+ * @return The number of connections handed off, -1 on error (vws.e holds
+ *   it). If the listening sockets could not be passed, nothing has changed.
+ */
+int vws_tcp_svr_handoff(vws_tcp_svr* server, cstr path, int timeout);
+
 /**
  * @brief Starts a VRTQL server with a single open socket. This is designed to
  * be used with tcpserver.
@@ -336,6 +1384,33 @@ void vws_tcp_svr_inetd_stop(vws_tcp_svr* server);
  */
 int vws_tcp_svr_send(vws_tcp_svr* server, vws_svr_data* data);
 
+/**
+ * @brief Sends data to a connection by ID (vws_svr_cnx.id) rather than by
+ * pointer. It is safe to call from any thread, with an ID kept from any time:
+ * if the connection is gone the data is dropped. The check is made again on
+ * the loop before the data is written, so the connection cannot disappear in
+ * between. data->cnx is ignored.
+ *
+ * @param server The server.
+ * @param id The connection ID.
+ * @param data The data to be sent. It is freed if it cannot be sent.
+ * @return 0 if queued, -1 if the connection is gone.
+ */
+int vws_tcp_svr_send_to(vws_tcp_svr* server, uint64_t id, vws_svr_data* data);
+
+/**
+ * @brief Takes a snapshot of the server's metrics, adding up those of every
+ * loop and worker and reading the current queue depths. It can be called from
+ * any thread at any time. Counters are read one at a time while they are
+ * being updated, so the snapshot is not taken at a single instant.
+ *
+ * @param server The server
+ * @param out Receives the snapshot
+ *
+ * @ingroup ServerFunctions
+ */
+void vws_tcp_svr_metrics(vws_tcp_svr* server, vws_svr_metrics* out);
+
 /**
  * @brief Close a VRTQL server connection.
  *
@@ -343,6 +1418,38 @@ int vws_tcp_svr_send(vws_tcp_svr* server, vws_svr_data* data);
  */
 void vws_tcp_svr_close(vws_svr_cnx* cnx);
 
+/**
+ * @brief Subscribes a connection to a topic. Takes effect in order with the
+ * data sent to the connection. Subscriptions end when the connection closes.
+ *
+ * @param cnx The server connection.
+ * @param topic The topic name.
+ */
+void vws_tcp_svr_subscribe(vws_svr_cnx* cnx, cstr topic);
+
+/**
+ * @brief Unsubscribes a connection from a topic.
+ *
+ * @param cnx The server connection.
+ * @param topic The topic name.
+ */
+void vws_tcp_svr_unsubscribe(vws_svr_cnx* cnx, cstr topic);
+
+/**
+ * @brief Writes data to every connection subscribed to a topic. The data is
+ * copied once into a shared, reference counted buffer. Each loop then writes
+ * that same buffer to its own subscribers. It can be called from any thread.
+ *
+ * @param server The server.
+ * @param topic The topic name.
+ * @param data The bytes to write, as they are to go on the wire.
+ * @param size The number of bytes.
+ */
+void vws_tcp_svr_publish( vws_tcp_svr* server,
+                          cstr topic,
+                          ucstr data,
+                          size_t size );
+
 /**
  * @brief Stops a VRTQL server.
  *
@@ -376,6 +1483,54 @@ typedef void (*vws_svr_process_frame)(vws_svr_cnx* s, vws_frame* f);
  */
 typedef void (*vws_svr_process_msg)(vws_svr_cnx* s, vws_msg* f);
 
+/**
+ * @brief Callback for processing several WebSocket messages from a connection
+ * at once. See vws_svr.process_batch.
+ * @param s The connection
+ * @param m The messages, oldest first. The callback takes them over. The
+ *   array is only valid for the call.
+ * @param n The number of messages
+ */
+typedef void (*vws_svr_process_batch)(vws_svr_cnx* s, vws_msg** m, size_t n);
+
+/** Most messages passed to a single process_batch() call */
+#define VWS_SVR_BATCH 32
+
+/**
+ * @brief Callback for streamed message data. See vws_svr.on_stream.
+ * @param s The connection
+ * @param opcode The message opcode (TEXT_FRAME or BINARY_FRAME)
+ * @param data The fragment payload. Only valid during the call.
+ * @param size The payload size. This may be 0.
+ * @param begin True for the first fragment of a message
+ * @param end True for the last fragment of a message
+ */
+typedef void (*vws_svr_stream)( vws_svr_cnx* s,
+                                unsigned char opcode,
+                                ucstr data,
+                                size_t size,
+                                bool begin,
+                                bool end );
+
+/**
+ * @brief Callback for a plain HTTP request, one that is not a WebSocket
+ * upgrade. See vws_svr.on_http.
+ * @param s The connection
+ * @param req The parsed request. It is in handshake mode: the URL is at
+ *   VWS_HTTP_URL (see vws_http_msg_span()), the method is
+ *   llhttp_get_method(req->parser), and vws_http_msg_headers() builds the
+ *   full header map if it is needed.
+ * @param data The request data req refers to.
+ * @param size The size of data.
+ * @param body Receives the response body.
+ * @return The response status code.
+ */
+typedef int (*vws_svr_http)( vws_svr_cnx* s,
+                             vws_http_msg* req,
+                             cstr data,
+                             size_t size,
+                             vws_buffer* body );
+
 /**
  * @brief Struct representing a WebSocket server. It speaks the WebSocket
  * protocol and processes both WebSocket frames and messages.
@@ -403,6 +1558,59 @@ typedef struct vws_svr
     /**< Derived: for sending messages to the client (calls on_msg_out()) */
     vws_svr_process_msg send;
 
+    /**< Optional: for processing incoming messages in batches, in place of
+     * process() (default NULL). A worker collects the messages of the
+     * requests it takes off its queue together (vws_tcp_svr.batch), and
+     * passes those in a row from the same connection in one call, in order,
+     * up to VWS_SVR_BATCH of them. A handler with a fixed cost per call, such
+     * as a database commit, then pays it once per burst. With an adaptive
+     * pool, a batch only holds the messages of one request. */
+    vws_svr_process_batch process_batch;
+
+    /**< Streaming receive (default NULL). If set, incoming messages are not
+     * reassembled. Each fragment is passed here as it arrives instead, in the
+     * connection's worker, and process is not called. This keeps memory
+     * bounded for large uploads. It implies worker_parse. See
+     * vws_cnx_set_stream(). Set before vws_tcp_svr_run(). */
+    vws_svr_stream on_stream;
+
+    /**< Where WebSocket data is parsed (default 0). If 0, the network thread
+     * parses frames and reassembles messages, and workers receive finished
+     * messages. If 1, the network thread only does the HTTP upgrade, and after
+     * that raw bytes go to the connection's worker, which unmasks, parses and
+     * reassembles them. This spreads parsing over the worker pool, which helps
+     * when clients send large messages. Set before vws_tcp_svr_run(). */
+    uint8_t worker_parse;
+
+    /**< Accept permessage-deflate (RFC 7692) when clients offer it (default
+     * 0). Set before vws_tcp_svr_run(). */
+    uint8_t deflate;
+
+    /**< Window bits (9-15) for compressing responses (default 15) */
+    int deflate_window_bits;
+
+    /**< Reset the response compressor after every message (default false).
+     * Uses less memory per idle connection, compresses less. */
+    bool deflate_no_context_takeover;
+
+    /**< Largest frame payload sent (default 0, no limit). Messages larger
+     * than this go out as continuation frames, one at a time, and control
+     * frames are written in between, so a large message doesn't hold up
+     * ping/pong or closing. Other messages still wait for it. */
+    size_t max_frame;
+
+    /**< Size above which an incoming message is reassembled in a temporary
+     * file and handed over as a mapping (default 0, never). See
+     * vws_cnx.spill. */
+    size_t spill;
+
+    /**< Plain HTTP requests (default NULL). If set, requests that are not a
+     * WebSocket upgrade are passed here and answered on the same connection,
+     * which stays open for more unless the client asks otherwise. Meant for
+     * health checks and metrics scrapes: it runs in the network thread, so
+     * it must be quick. If NULL, such requests close the connection. */
+    vws_svr_http on_http;
+
 } vws_svr;
 
 /**
@@ -410,7 +1618,7 @@ typedef struct vws_svr
  *
  * @param pool_size The number of threads to run in the worker pool
  * @param backlog The connection backlog for listen(). If this is set to 0, it
- *   will use the default (128).
+ *   will use the default (4096, capped by the kernel at net.core.somaxconn).
  * @param queue_size The maximum queue size for requests and responses. If this
  *   is set to 0, it will use the default (1024).
  * @return A new WebSocket server.
@@ -434,6 +1642,66 @@ void vws_svr_free(vws_svr* s);
  */
 int vws_svr_run(vws_svr* server, cstr host, int port);
 
+/**
+ * @brief Sends part of a file as a WebSocket BINARY message. The file is
+ * mapped and written to the socket straight from the page cache, so the
+ * payload is never read into or copied by the process. Like any message it is
+ * fragmented past max_frame. It is not compressed. Safe from any thread.
+ *
+ * @param cnx The connection.
+ * @param fd The file. The caller keeps it and may close it on return. It must
+ *   not shrink until the message has been written.
+ * @param offset Where the payload starts in the file.
+ * @param size The payload size. If 0, the rest of the file.
+ * @return 0 if the message was queued, -1 if the file couldn't be mapped
+ *   (vws.e has the details).
+ */
+int vws_svr_send_file(vws_svr_cnx* cnx, int fd, uint64_t offset, size_t size);
+
+/**
+ * @brief Sends one fragment of a message being relayed from another
+ * connection, as it arrives: the server side of a proxy. Its arguments are
+ * those of a vws_cnx_stream callback, so fragments streamed from an upstream
+ * vws_cnx (vws_cnx_set_stream()) can be passed straight on without
+ * reassembling the message. The payload is copied once, behind its frame
+ * header. A whole message in one fragment goes out as an ordinary message.
+ * Otherwise the connection's other message data waits behind it until its
+ * last fragment, while control frames still go out in between. It is not
+ * compressed. vws_frame_relay() goes the other way.
+ *
+ * Fragments of one message must be relayed in order, from one thread.
+ *
+ * @param cnx The connection.
+ * @param opcode The message opcode. Only used on the first fragment.
+ * @param data The fragment payload. The caller keeps it.
+ * @param size The payload size. This may be 0.
+ * @param begin True for the first fragment of a message.
+ * @param end True for the last fragment of a message.
+ */
+void vws_svr_relay( vws_svr_cnx* cnx,
+                    unsigned char opcode,
+                    ucstr data,
+                    size_t size,
+                    bool begin,
+                    bool end );
+
+/**
+ * @brief Sends a WebSocket message to every connection subscribed to a topic.
+ * It is framed once and the same frame is written to all of them. Broadcasts
+ * are neither compressed nor fragmented.
+ *
+ * @param server The server.
+ * @param topic The topic name.
+ * @param data The message payload.
+ * @param size The payload size.
+ * @param opcode The message opcode (TEXT_FRAME or BINARY_FRAME).
+ */
+void vws_svr_publish( vws_svr* server,
+                      cstr topic,
+                      ucstr data,
+                      size_t size,
+                      unsigned char opcode );
+
 //------------------------------------------------------------------------------
 // Messaging Server
 //------------------------------------------------------------------------------
@@ -445,6 +1713,18 @@ int vws_svr_run(vws_svr* server, cstr host, int port);
  */
 typedef void (*vrtql_svr_process_msg)(vws_svr_cnx* s, vrtql_msg* m);
 
+/**
+ * @brief Callback for processing several messages from a connection at once.
+ * See vrtql_msg_svr.process_batch.
+ * @param s The connection
+ * @param m The messages, oldest first. The callback takes them over. The
+ *   array is only valid for the call.
+ * @param n The number of messages
+ */
+typedef void (*vrtql_svr_process_batch)( vws_svr_cnx* s,
+                                         vrtql_msg** m,
+                                         size_t n );
+
 /**
  * @brief Struct representing a VTQL message server. It is derived from the
  * WebSocket server and operates in terms of VRTQL messages (vrtql_msg) as
@@ -467,6 +1747,25 @@ typedef struct vrtql_msg_svr
     /**< Derived: for sending messages to the client (calls on_msg_out()) */
     vrtql_svr_process_msg send;
 
+    /**< Optional: for processing incoming messages in batches, in place of
+     * process() (default NULL). Works like vws_svr.process_batch. */
+    vrtql_svr_process_batch process_batch;
+
+    /**< Take up shared memory offered by clients on a Unix socket
+     * (vrtql_shm_attach()). Only in builds with SHM. Off by default. */
+    uint8_t shm;
+
+    /**< Deserialize requests lazily (vrtql_msg_deserialize_ws_lazy()): only
+     * routing is decoded before process() is called, and a request forwarded
+     * untouched is sent as the bytes it came in as. Callbacks that use the
+     * headers or content members directly must call vrtql_msg_decode() first.
+     * Off by default. */
+    bool lazy;
+
+    /**< The cluster the server is a node of (cluster.h), NULL if none. Set by
+     * vrtql_cluster_new(). */
+    struct vrtql_cluster* cluster;
+
 } vrtql_msg_svr;
 
 /**
@@ -474,7 +1773,7 @@ typedef struct vrtql_msg_svr
  *
  * @param pool_size The number of threads to run in the worker pool
  * @param backlog The connection backlog for listen(). If this is set to 0, it
- *   will use the default (128).
+ *   will use the default (4096, capped by the kernel at net.core.somaxconn).
  * @param queue_size The maximum queue size for requests and responses. If this
  *   is set to 0, it will use the default (1024).
  * @return A new VRTQL message server.
@@ -498,6 +1797,30 @@ void vrtql_msg_svr_free(vrtql_msg_svr* s);
  */
 int vrtql_msg_svr_run(vrtql_msg_svr* server, cstr host, int port);
 
+/**
+ * @brief Sets up an RPC environment for servicing a request from a message
+ * server connection with vrtql_rpc_service(). Calls can then be deferred
+ * (vrtql_rpc_defer()) and completed later from any thread. The reply is sent
+ * to the connection by ID (vws_tcp_svr_send_to()), so it is dropped if the
+ * connection has gone by then. It goes out uncompressed, in a single frame.
+ *
+ * @param cnx The connection the request came from.
+ * @param e The environment.
+ */
+void vrtql_msg_svr_rpc_env(vws_svr_cnx* cnx, vrtql_rpc_env* e);
+
+/**
+ * @brief Sends a message to every connection subscribed to a topic (see
+ * vws_tcp_svr_subscribe()). The message is serialized once, in its own
+ * format, and the same frame goes to every subscriber. This TAKES OWNERSHIP
+ * of the message.
+ *
+ * @param server The server.
+ * @param topic The topic name.
+ * @param m The message.
+ */
+void vrtql_msg_svr_publish(vrtql_msg_svr* server, cstr topic, vrtql_msg* m);
+
 #ifdef __cplusplus
 }
 #endif
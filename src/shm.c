@@ -0,0 +1,727 @@
+#if defined(VWS_SHM)
+
+// For memfd_create()
+#define _GNU_SOURCE
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+/** Identifies a region, and the layout version it was made with */
+#define SHM_MAGIC   0x6d687376
+#define SHM_VERSION 1
+
+/** The server has taken the region (shm_header.state) */
+#define SHM_ACCEPTED 1
+
+/** Offset of the first ring's data. The header fits in front of it. */
+#define SHM_DATA 4096
+
+/** Length of a record that skips to the start of the ring */
+#define SHM_WRAP UINT32_MAX
+
+/** Largest ring */
+#define SHM_SIZE_MAX (1UL << 30)
+
+//------------------------------------------------------------------------------
+// Internal types
+//------------------------------------------------------------------------------
+
+/**
+ * @brief One direction's ring. Positions only grow: the byte offset is the
+ * position modulo the size. Each record is a 32 bit length followed by the
+ * data, padded to 8 bytes. One that would not fit before the end is preceded
+ * by a SHM_WRAP length and starts over at offset 0.
+ */
+typedef struct shm_ring
+{
+    uint64_t head;           /**< Read up to here (reader)                  */
+    uint8_t pad1[56];        /**< Keeps head and tail on separate lines     */
+    uint64_t tail;           /**< Written up to here (writer)               */
+    uint8_t pad2[56];
+    uint32_t reader_waiting; /**< The reader wants a wakeup for new data    */
+    uint32_t writer_waiting; /**< The writer wants a wakeup for free space  */
+    uint8_t pad3[56];
+} shm_ring;
+
+/**
+ * @brief The start of a region. The data of ring 0 (client to server) is at
+ * SHM_DATA and that of ring 1 (server to client) right after it.
+ */
+typedef struct shm_header
+{
+    uint32_t magic;          /**< SHM_MAGIC                                 */
+    uint32_t version;        /**< SHM_VERSION                               */
+    uint32_t state;          /**< SHM_ACCEPTED once the server has it       */
+    uint32_t reserved;
+    uint64_t size;           /**< Capacity of each ring                     */
+    uint8_t pad[40];
+    shm_ring rings[2];       /**< Client to server, server to client        */
+} shm_header;
+
+struct vrtql_shm
+{
+    vws_cnx* cnx;            /**< The client's connection, NULL on server   */
+    shm_header* header;      /**< The mapping                               */
+    size_t map_size;         /**< Size of the mapping                       */
+    uint64_t size;           /**< Capacity of each ring                     */
+    shm_ring* in;            /**< Ring this side reads                      */
+    unsigned char* in_data;  /**< Its data                                  */
+    shm_ring* out;           /**< Ring this side writes                     */
+    unsigned char* out_data; /**< Its data                                  */
+    uint64_t next;           /**< End of the record vrtql_shm_peek() found  */
+    int wait_fd;             /**< Eventfd the other side writes to wake us  */
+    int peer_fd;             /**< Eventfd we write to wake the other side   */
+};
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Creates a transport over a mapped region.
+ *
+ * @param header The mapping
+ * @param map_size Its size
+ * @param server Whether this is the server's end
+ * @param wait_fd The eventfd this side waits on
+ * @param peer_fd The eventfd of the other side
+ * @return The transport.
+ *
+ * @ingroup ShmFunctions
+ */
+static vrtql_shm* shm_new( shm_header* header,
+                           size_t map_size,
+                           bool server,
+                           int wait_fd,
+                           int peer_fd );
+
+/**
+ * @brief Wakes the other side.
+ *
+ * @param s The transport
+ *
+ * @ingroup ShmFunctions
+ */
+static void shm_signal(vrtql_shm* s);
+
+/**
+ * @brief Waits for the other side to wake this one, handling anything that
+ * arrives on the connection's socket meanwhile.
+ *
+ * @param s The transport
+ * @return 1 if woken, 0 on timeout, -1 if the connection has closed.
+ *
+ * @ingroup ShmFunctions
+ */
+static int shm_wait(vrtql_shm* s);
+
+/**
+ * @brief Passes the region and eventfds to the server on a ping, and waits
+ * for the pong. The server has taken them or not by the time it arrives.
+ *
+ * @param c The connection
+ * @param fds The descriptors to pass
+ * @return True if the pong arrived, false otherwise.
+ *
+ * @ingroup ShmFunctions
+ */
+static bool shm_offer(vws_cnx* c, int fds[3]);
+
+/**
+ * @brief Frame handler used by shm_offer() to spot the pong. Everything else
+ * goes to the connection's handler.
+ *
+ * @param c The connection
+ * @param f The frame
+ *
+ * @ingroup ShmFunctions
+ */
+static void shm_process_frame(vws_cnx* c, vws_frame* f);
+
+/** Set by shm_process_frame() when the pong arrives */
+static __thread bool shm_pong = false;
+
+/** The connection's frame handler while shm_offer() waits */
+static __thread vws_process_frame shm_process_next = NULL;
+
+//------------------------------------------------------------------------------
+//> Shared memory API
+//------------------------------------------------------------------------------
+
+vrtql_shm* vrtql_shm_attach(vws_cnx* c, size_t size)
+{
+    if (vws_cnx_is_connected(c) == false || c->path == NULL)
+    {
+        vws.error(VE_RT, "Shared memory needs a Unix socket connection");
+        return NULL;
+    }
+
+    if (c->base.ssl != NULL || vws_cnx_is_deflate(c))
+    {
+        vws.error(VE_RT, "Shared memory does not support TLS or deflate");
+        return NULL;
+    }
+
+    #if defined(VWS_IO_URING)
+    if (c->base.uring != NULL)
+    {
+        vws.error(VE_RT, "Shared memory does not support io_uring");
+        return NULL;
+    }
+    #endif
+
+    // Anything corked goes out before the offer
+    if (vws_cnx_flush(c) < 0)
+    {
+        return NULL;
+    }
+
+    uint64_t ring = 4096;
+    while (ring < size && ring < SHM_SIZE_MAX)
+    {
+        ring <<= 1;
+    }
+
+    //> Create the region and the eventfds
+
+    size_t map_size = SHM_DATA + 2 * ring;
+    int fds[3];
+
+    fds[0] = memfd_create("vrtql_shm", MFD_CLOEXEC);
+    fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    shm_header* header = MAP_FAILED;
+
+    if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0
+        && ftruncate(fds[0], map_size) == 0)
+    {
+        header = mmap( NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fds[0], 0 );
+    }
+
+    if (header == MAP_FAILED)
+    {
+        vws.error(VE_SYS, "Failed to create shared memory: %s", strerror(errno));
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                close(fds[i]);
+            }
+        }
+
+        return NULL;
+    }
+
+    // The file is zero filled, which leaves both rings empty
+    header->magic   = SHM_MAGIC;
+    header->version = SHM_VERSION;
+    header->size    = ring;
+
+    //> Offer it to the server
+
+    vrtql_shm* s = shm_new(header, map_size, false, fds[2], fds[1]);
+    s->cnx       = c;
+
+    bool offered = shm_offer(c, fds);
+
+    // The server has its own copies, if it took them
+    close(fds[0]);
+
+    if (offered == false)
+    {
+        // Error already set
+        vrtql_shm_free(s);
+        return NULL;
+    }
+
+    if (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) != SHM_ACCEPTED)
+    {
+        vws.error(VE_RT, "Server declined shared memory");
+        vrtql_shm_free(s);
+        return NULL;
+    }
+
+    vws.success();
+
+    return s;
+}
+
+vrtql_shm* vrtql_shm_accept(int fds[3])
+{
+    struct stat st;
+    shm_header* header = MAP_FAILED;
+
+    if (fstat(fds[0], &st) == 0 && st.st_size > SHM_DATA)
+    {
+        header = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fds[0], 0 );
+    }
+
+    close(fds[0]);
+
+    bool valid = (header != MAP_FAILED);
+
+    if (valid == true)
+    {
+        // The client sizes it. Check that it is what it says it is.
+        uint64_t size = header->size;
+
+        valid = (header->magic == SHM_MAGIC)
+             && (header->version == SHM_VERSION)
+             && (size >= 4096) && (size <= SHM_SIZE_MAX)
+             && ((size & (size - 1)) == 0)
+             && ((uint64_t)st.st_size == SHM_DATA + 2 * size);
+    }
+
+    if (valid == false)
+    {
+        vws.error(VE_RT, "Invalid shared memory region");
+
+        if (header != MAP_FAILED)
+        {
+            munmap(header, st.st_size);
+        }
+
+        close(fds[1]);
+        close(fds[2]);
+
+        return NULL;
+    }
+
+    vrtql_shm* s = shm_new(header, st.st_size, true, fds[1], fds[2]);
+
+    // The server reads as soon as it is woken
+    s->in->reader_waiting = 1;
+
+    __atomic_store_n(&header->state, SHM_ACCEPTED, __ATOMIC_RELEASE);
+
+    return s;
+}
+
+void vrtql_shm_free(vrtql_shm* s)
+{
+    if (s == NULL)
+    {
+        return;
+    }
+
+    munmap(s->header, s->map_size);
+    close(s->wait_fd);
+    close(s->peer_fd);
+
+    vws.free(s);
+}
+
+ssize_t vrtql_shm_send(vrtql_shm* s, vrtql_msg* m)
+{
+    vws_buffer* data = vrtql_msg_serialize(m);
+    ssize_t rc       = -1;
+
+    while (true)
+    {
+        int n = vrtql_shm_write(s, data->data, data->size);
+
+        if (n == 1)
+        {
+            rc = data->size;
+            break;
+        }
+
+        if (n < 0)
+        {
+            vws.error(VE_RT, "Message larger than half the ring");
+            break;
+        }
+
+        // Full. The server wakes us once it has made room.
+        if (shm_wait(s) <= 0)
+        {
+            // Error already set
+            break;
+        }
+    }
+
+    vws_buffer_free(data);
+
+    return rc;
+}
+
+vrtql_msg* vrtql_shm_recv(vrtql_shm* s)
+{
+    while (true)
+    {
+        size_t size;
+        ucstr data = vrtql_shm_peek(s, &size);
+
+        if (data != NULL)
+        {
+            vrtql_msg* m = vrtql_msg_new();
+
+            bool ok = vrtql_msg_deserialize(m, data, size);
+            vrtql_shm_pop(s);
+
+            if (ok == false)
+            {
+                // Error already set
+                vrtql_msg_free(m);
+                return NULL;
+            }
+
+            vws.success();
+
+            return m;
+        }
+
+        if (vrtql_shm_idle(s) == true && shm_wait(s) <= 0)
+        {
+            // Error already set
+            return NULL;
+        }
+    }
+}
+
+int vrtql_shm_write(vrtql_shm* s, ucstr data, size_t size)
+{
+    shm_ring* r     = s->out;
+    uint64_t record = (sizeof(uint32_t) + size + 7) & ~7UL;
+
+    if (record > s->size / 2)
+    {
+        return -1;
+    }
+
+    uint64_t tail = r->tail;
+    uint64_t off  = tail & (s->size - 1);
+    uint64_t end  = s->size - off;
+
+    // A record that doesn't fit before the end wastes the rest of the ring
+    uint64_t need = (record > end) ? end + record : record;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    if (s->size - (tail - head) < need)
+    {
+        // Ask for a wakeup, then look again in case the reader made room
+        // before it could see the request.
+        __atomic_store_n(&r->writer_waiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+
+        if (s->size - (tail - head) < need)
+        {
+            return 0;
+        }
+
+        __atomic_store_n(&r->writer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    if (record > end)
+    {
+        *(uint32_t*)(s->out_data + off) = SHM_WRAP;
+        tail += end;
+        off   = 0;
+    }
+
+    *(uint32_t*)(s->out_data + off) = (uint32_t)size;
+    memcpy(s->out_data + off + sizeof(uint32_t), data, size);
+
+    __atomic_store_n(&r->tail, tail + record, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&r->reader_waiting, 0, __ATOMIC_SEQ_CST) != 0)
+    {
+        shm_signal(s);
+    }
+
+    return 1;
+}
+
+ucstr vrtql_shm_peek(vrtql_shm* s, size_t* size)
+{
+    shm_ring* r   = s->in;
+    uint64_t head = r->head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+    {
+        return NULL;
+    }
+
+    uint64_t off = head & (s->size - 1);
+    uint32_t n   = *(uint32_t*)(s->in_data + off);
+
+    if (n == SHM_WRAP)
+    {
+        head += s->size - off;
+        off   = 0;
+        n     = *(uint32_t*)s->in_data;
+    }
+
+    if (n > s->size / 2)
+    {
+        // Only a broken writer gets here. Treat the ring as empty.
+        vws.error(VE_RT, "Invalid shared memory record");
+        return NULL;
+    }
+
+    s->next = head + ((sizeof(uint32_t) + n + 7) & ~7UL);
+    *size   = n;
+
+    return s->in_data + off + sizeof(uint32_t);
+}
+
+void vrtql_shm_pop(vrtql_shm* s)
+{
+    shm_ring* r = s->in;
+
+    __atomic_store_n(&r->head, s->next, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&r->writer_waiting, 0, __ATOMIC_SEQ_CST) != 0)
+    {
+        shm_signal(s);
+    }
+}
+
+bool vrtql_shm_idle(vrtql_shm* s)
+{
+    shm_ring* r = s->in;
+
+    __atomic_store_n(&r->reader_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head)
+    {
+        __atomic_store_n(&r->reader_waiting, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    return true;
+}
+
+int vrtql_shm_fd(vrtql_shm* s)
+{
+    return s->wait_fd;
+}
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+vrtql_shm* shm_new( shm_header* header,
+                    size_t map_size,
+                    bool server,
+                    int wait_fd,
+                    int peer_fd )
+{
+    vrtql_shm* s = vws.calloc(1, sizeof(vrtql_shm));
+
+    unsigned char* data = (unsigned char*)header + SHM_DATA;
+    int in              = server ? 0 : 1;
+    int out             = server ? 1 : 0;
+
+    s->header   = header;
+    s->map_size = map_size;
+    s->size     = header->size;
+    s->in       = &header->rings[in];
+    s->in_data  = data + in * header->size;
+    s->out      = &header->rings[out];
+    s->out_data = data + out * header->size;
+    s->wait_fd  = wait_fd;
+    s->peer_fd  = peer_fd;
+
+    return s;
+}
+
+void shm_signal(vrtql_shm* s)
+{
+    uint64_t one = 1;
+
+    // Fails only if the counter is about to overflow, which wakes it anyway
+    if (write(s->peer_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        vws.error(VE_SYS, "Failed to signal shared memory peer");
+    }
+}
+
+int shm_wait(vrtql_shm* s)
+{
+    vws_cnx* c = s->cnx;
+
+    struct pollfd p[2];
+    p[0].fd     = s->wait_fd;
+    p[0].events = POLLIN;
+    p[1].fd     = c->base.sockfd;
+    p[1].events = POLLIN;
+
+    while (true)
+    {
+        if (vws_cnx_is_connected(c) == false)
+        {
+            return -1;
+        }
+
+        p[1].fd = c->base.sockfd;
+
+        int rc = poll(p, 2, c->base.timeout);
+
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (rc < 0)
+        {
+            vws.error(VE_SYS, "poll() failed");
+            return -1;
+        }
+
+        if (rc == 0)
+        {
+            vws.error(VE_TIMEOUT, "Timeout waiting for shared memory");
+            return 0;
+        }
+
+        if (p[1].revents != 0)
+        {
+            // The socket is still the connection: pings, or the close
+            if (vws_socket_read((vws_socket*)c) < 0)
+            {
+                return -1;
+            }
+
+            vws_cnx_ingress(c);
+        }
+
+        if (p[0].revents != 0)
+        {
+            uint64_t n;
+            while (read(s->wait_fd, &n, sizeof(n)) < 0 && errno == EINTR)
+            {
+            }
+
+            return 1;
+        }
+    }
+}
+
+bool shm_offer(vws_cnx* c, int fds[3])
+{
+    //> Send a ping carrying the descriptors
+
+    vws_buffer* ping = vws_serialize(vws_frame_new(NULL, 0, PING_FRAME));
+
+    struct iovec iov;
+    iov.iov_base = ping->data;
+    iov.iov_len  = ping->size;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+        struct cmsghdr align;
+    } control;
+
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int) * 3);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 3);
+
+    // The descriptors go with the first byte. The rest of the frame follows
+    // as an ordinary write if it doesn't all go at once.
+    ssize_t n;
+    while ((n = sendmsg(c->base.sockfd, &msg, MSG_NOSIGNAL)) < 0)
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            struct pollfd p;
+            p.fd     = c->base.sockfd;
+            p.events = POLLOUT;
+
+            if (poll(&p, 1, c->base.timeout) > 0)
+            {
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    bool sent = (n > 0);
+
+    if (sent == true && (size_t)n < ping->size)
+    {
+        ucstr rest = ping->data + n;
+        sent       = (vws_socket_write((vws_socket*)c, rest, ping->size - n) > 0);
+    }
+
+    vws_buffer_free(ping);
+
+    if (sent == false)
+    {
+        vws.error(VE_SEND, "Failed to offer shared memory");
+        return false;
+    }
+
+    //> Wait for the pong
+
+    shm_pong         = false;
+    shm_process_next = c->process;
+    c->process       = shm_process_frame;
+
+    vws_cnx_ingress(c);
+
+    while (shm_pong == false)
+    {
+        if (vws_socket_read((vws_socket*)c) <= 0)
+        {
+            break;
+        }
+
+        vws_cnx_ingress(c);
+    }
+
+    c->process = shm_process_next;
+
+    if (shm_pong == false)
+    {
+        vws.error(VE_RECV, "No reply to shared memory offer");
+        return false;
+    }
+
+    return true;
+}
+
+void shm_process_frame(vws_cnx* c, vws_frame* f)
+{
+    if (f->opcode == PONG_FRAME && shm_pong == false)
+    {
+        shm_pong = true;
+        vws_frame_free(f);
+        return;
+    }
+
+    shm_process_next(c, f);
+}
+
+#endif /* VWS_SHM */
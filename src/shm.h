@@ -0,0 +1,173 @@
+#ifndef VWS_SHM_DECLARE
+#define VWS_SHM_DECLARE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "websocket.h"
+#include "message.h"
+
+/**
+ * @file shm.h
+ * @brief Shared-memory transport for vrtql messages (Linux, built with
+ * -DSHM=ON)
+ *
+ * A client on the same host as a vrtql_msg_svr can move its messages off the
+ * socket once it is connected. It connects over a Unix socket
+ * (vws_connect_unix()) and calls vrtql_shm_attach(). This creates a shared
+ * memory region holding two rings, one for each direction, and an eventfd for
+ * each side. It passes them to the server along with a WebSocket ping. From
+ * then on, messages sent with vrtql_shm_send() are copied into the ring and
+ * reach the server's process callback as if they had come over the WebSocket.
+ * Replies come back through the other ring to vrtql_shm_recv(). There are no
+ * frames, masking or socket system calls. An eventfd is only written when the
+ * other side has said it is about to sleep.
+ *
+ * The server must enable it (vrtql_msg_svr.shm). The WebSocket connection
+ * stays open alongside: closing it ends the transport. Attach with no requests
+ * outstanding, as replies to messages sent over the WebSocket may come back
+ * through the ring. A message must be no larger than half the ring. A reply
+ * larger than that closes the connection.
+ *
+ * A transport is not thread safe. Use it from one thread, like the connection.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vrtql_shm;
+
+/**
+ * @brief One side's end of a shared-memory transport. Opaque.
+ */
+typedef struct vrtql_shm vrtql_shm;
+
+/**
+ * @brief Moves a connection's messages onto shared memory. See above.
+ *
+ * @param c The connection. Must be connected with vws_connect_unix() and
+ *   not use deflate or io_uring.
+ * @param size The capacity of each ring in bytes. Rounded up to a power of
+ *   two, at least 4096.
+ * @return The transport, or NULL if it could not be set up or the server
+ *   declined it (vws.e has the details). The connection carries on over the
+ *   socket either way.
+ *
+ * @ingroup ShmFunctions
+ */
+vrtql_shm* vrtql_shm_attach(vws_cnx* c, size_t size);
+
+/**
+ * @brief Sets up the server's end of a transport from the descriptors a
+ * client passed with vrtql_shm_attach(), in the order it sent them. This is
+ * used by the server.
+ *
+ * @param fds The memory, the server's eventfd and the client's eventfd. The
+ *   transport takes ownership of them, and they are closed on failure.
+ * @return The transport, or NULL if the region is invalid.
+ *
+ * @ingroup ShmFunctions
+ */
+vrtql_shm* vrtql_shm_accept(int fds[3]);
+
+/**
+ * @brief Frees a transport. The client's connection carries on over the
+ * socket. The server's end is freed when the connection closes.
+ *
+ * @param s The transport.
+ *
+ * @ingroup ShmFunctions
+ */
+void vrtql_shm_free(vrtql_shm* s);
+
+/**
+ * @brief Sends a message through the ring. Waits up to the connection's
+ * timeout for space if the ring is full.
+ *
+ * @param s The transport.
+ * @param m The message. It is not freed.
+ * @return The number of bytes sent, -1 on error or timeout.
+ *
+ * @ingroup ShmFunctions
+ */
+ssize_t vrtql_shm_send(vrtql_shm* s, vrtql_msg* m);
+
+/**
+ * @brief Receives a message from the ring. Waits up to the connection's
+ * timeout for one. Frames arriving on the connection's socket meanwhile (such
+ * as pings) are handled as usual.
+ *
+ * @param s The transport.
+ * @return The message, or NULL on error or timeout. The caller frees it.
+ *
+ * @ingroup ShmFunctions
+ */
+vrtql_msg* vrtql_shm_recv(vrtql_shm* s);
+
+/**
+ * @brief Copies a record into the outgoing ring and wakes the other side if
+ * it is waiting for one.
+ *
+ * @param s The transport.
+ * @param data The record.
+ * @param size The record size.
+ * @return 1 if it was written, 0 if the ring is full (the other side wakes
+ *   this one once it has made room), -1 if it is larger than half the ring.
+ *
+ * @ingroup ShmFunctions
+ */
+int vrtql_shm_write(vrtql_shm* s, ucstr data, size_t size);
+
+/**
+ * @brief Returns the next record in the incoming ring, in place. It stays
+ * valid until vrtql_shm_pop().
+ *
+ * @param s The transport.
+ * @param size Set to the record size.
+ * @return The record, or NULL if the ring is empty.
+ *
+ * @ingroup ShmFunctions
+ */
+ucstr vrtql_shm_peek(vrtql_shm* s, size_t* size);
+
+/**
+ * @brief Releases the record returned by vrtql_shm_peek(), waking the other
+ * side if it is waiting for room.
+ *
+ * @param s The transport.
+ *
+ * @ingroup ShmFunctions
+ */
+void vrtql_shm_pop(vrtql_shm* s);
+
+/**
+ * @brief Tells the other side to wake this one for the next record, unless
+ * one has arrived. Call it when vrtql_shm_peek() returns NULL, before waiting
+ * on vrtql_shm_fd().
+ *
+ * @param s The transport.
+ * @return True if the ring is still empty and it is safe to wait, false if a
+ *   record has arrived.
+ *
+ * @ingroup ShmFunctions
+ */
+bool vrtql_shm_idle(vrtql_shm* s);
+
+/**
+ * @brief Returns the eventfd that becomes readable when the other side wakes
+ * this one. Read it to reset it.
+ *
+ * @param s The transport.
+ * @return The descriptor.
+ *
+ * @ingroup ShmFunctions
+ */
+int vrtql_shm_fd(vrtql_shm* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VWS_SHM_DECLARE */
@@ -3,8 +3,11 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #endif
 
 #if defined(__windows__)
@@ -14,12 +17,20 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <openssl/rand.h>
 
 #include "socket.h"
 
+#if defined(VWS_IO_URING)
+#include "uring.h"
+#endif
+
 //------------------------------------------------------------------------------
 // Internal functions
 //------------------------------------------------------------------------------
@@ -32,17 +43,68 @@ typedef enum
 
 } socket_flags_t;
 
+#if defined(__windows__)
+typedef WSAPOLLFD socket_pollfd;
+#else
+typedef struct pollfd socket_pollfd;
+#endif
+
+/**
+ * @brief Waits for the events in fds on the socket, up to the socket timeout.
+ * Uses the socket's wait callback if it has one, poll() otherwise.
+ *
+ * @param c The socket.
+ * @param fds The descriptor and events to wait for. revents is set on return.
+ * @return As poll(): 1 if ready, 0 on timeout, -1 on error.
+ *
+ * @ingroup SocketFunctions
+ */
+static int socket_poll(vws_socket* c, socket_pollfd* fds);
+
 /**
- * @brief Connects to a host at a specific port and returns the connection
- *        status.
+ * @brief Connects to a host at a specific port, trying its addresses as
+ *        vws_dial does.
  *
  * @param host The host to connect to.
  * @param port The port to connect to.
- * @return The connection status, 0 if successful, an error code otherwise.
+ * @param timeout The time allowed in milliseconds.
+ * @return The connected descriptor (blocking), -1 on error or timeout.
+ *
+ * @ingroup ConnectionFunctions
+ */
+static int connect_to_host(cstr host, int port, int timeout);
+
+/**
+ * @brief Connects to a Unix domain socket.
+ *
+ * @param path The socket path. A leading '@' names a socket in the Linux
+ *   abstract namespace.
+ * @return The connected descriptor, -1 on error (vws.e has the details).
  *
  * @ingroup ConnectionFunctions
  */
-static int connect_to_host(const char* host, const char* port);
+static int connect_to_path(cstr path);
+
+/**
+ * @brief Finishes a connection once the socket is connected (and TLS
+ * established): sets non-blocking mode and runs the handshake handler.
+ *
+ * @param c The socket.
+ * @return True on success. On failure the socket is closed.
+ *
+ * @ingroup SocketFunctions
+ */
+static bool socket_connected(vws_socket* c);
+
+/**
+ * @brief Notes which directions of a TLS connection the kernel took over once
+ * the handshake is done (vws_socket.ktls_on).
+ *
+ * @param c The socket.
+ *
+ * @ingroup SocketFunctions
+ */
+static void socket_ktls_check(vws_socket* c);
 
 /**
  * @brief  Sets a timeout on a socket read/write operations.
@@ -60,6 +122,265 @@ static bool socket_set_timeout(int fd, int sec);
  */
 static void socket_abnormal_close(vws_socket* c);
 
+/**
+ * @brief Reads whatever the socket has, without waiting. See
+ * vws_socket_read_ready().
+ *
+ * @param c The socket.
+ * @param want_write Set to true if TLS has to write before it can read more.
+ * @return The number of bytes read, 0 if nothing was available, -1 on error.
+ *
+ * @ingroup SocketFunctions
+ */
+static ssize_t socket_read_ready(vws_socket* c, bool* want_write);
+
+/**
+ * @brief Makes room at the end of the receive buffer for the next read. The
+ * buffer grows geometrically so a large message costs a handful of
+ * reallocations rather than one per read.
+ *
+ * @param c The socket.
+ * @param want The number of bytes known to be waiting. At least
+ *   c->read_chunk bytes are made available regardless.
+ * @return The number of bytes that can be read into socket_read_tail().
+ *
+ * @ingroup SocketFunctions
+ */
+static int socket_read_space(vws_socket* c, size_t want);
+
+/**
+ * @brief Returns the free space at the end of the receive buffer.
+ *
+ * @param c The socket.
+ * @return Pointer to the first unused byte in the buffer.
+ *
+ * @ingroup SocketFunctions
+ */
+static unsigned char* socket_read_tail(vws_socket* c);
+
+/**
+ * @defgroup SessionFunctions
+ *
+ * @brief TLS session cache for client resumption
+ *
+ * The cache holds the most recent session (or TLS 1.3 ticket) per host:port.
+ * It is shared by all threads and guarded by a spinlock: it is only touched
+ * once per handshake, so the lock is never held for long.
+ */
+
+/**
+ * @brief A cached session. The entry owns both the key and a reference to the
+ * session.
+ *
+ * @ingroup SessionFunctions
+ */
+typedef struct
+{
+    /**< The host:port key */
+    char* key;
+
+    /**< The session */
+    SSL_SESSION* session;
+
+} socket_session;
+
+/**
+ * @brief OpenSSL new session callback. Stores a new client session in the
+ * cache, replacing any previous one for the same host:port.
+ *
+ * @param ssl The connection that received the session.
+ * @param session The session.
+ * @return 1 if the session was cached (the cache keeps the reference), 0
+ *   otherwise.
+ *
+ * @ingroup SessionFunctions
+ */
+static int socket_session_new(SSL* ssl, SSL_SESSION* session);
+
+/**
+ * @brief Looks up the cached session for a host:port.
+ *
+ * @param key The host:port key.
+ * @return The session with a reference taken for the caller, or NULL if there
+ *   is none.
+ *
+ * @ingroup SessionFunctions
+ */
+static SSL_SESSION* socket_session_get(cstr key);
+
+/**
+ * @brief Acquires the session cache lock.
+ *
+ * @ingroup SessionFunctions
+ */
+static void socket_session_lock();
+
+/**
+ * @brief Releases the session cache lock.
+ *
+ * @ingroup SessionFunctions
+ */
+static void socket_session_unlock();
+
+/**
+ * @brief Waits for the socket to become ready for whatever a failed SSL call
+ * needs (reading or writing).
+ *
+ * @param c The socket.
+ * @param rc The return value of the failed SSL call.
+ * @return True if the call can be retried, false on error or timeout.
+ *
+ * @ingroup SessionFunctions
+ */
+static bool socket_ssl_wait(vws_socket* c, int rc);
+
+/**
+ * @brief Sends the first write of a resumed connection as TLS 1.3 early data
+ * and completes the handshake.
+ *
+ * @param c The socket.
+ * @param data The data.
+ * @param size The number of bytes of data.
+ * @return 1 if the server accepted the early data, 0 if it has to be sent
+ *   again (the server rejected it, or it did not fit), -1 on error.
+ *
+ * @ingroup SessionFunctions
+ */
+static int socket_write_early(vws_socket* c, ucstr data, size_t size);
+
+/**
+ * @brief An address to connect to.
+ *
+ * @ingroup DialFunctions
+ */
+typedef struct
+{
+    /**< The address */
+    struct sockaddr_storage addr;
+
+    /**< The size of the address */
+    socklen_t len;
+
+} socket_addr;
+
+/**
+ * @brief A cached resolution. The entry owns both the key and the addresses.
+ *
+ * @ingroup DialFunctions
+ */
+typedef struct
+{
+    /**< The host:port key */
+    char* key;
+
+    /**< The addresses, in the order to try them */
+    socket_addr* addrs;
+
+    /**< The number of addresses */
+    size_t count;
+
+    /**< When the entry goes stale (socket_now()) */
+    uint64_t expires;
+
+} socket_dns;
+
+struct vws_dial
+{
+    /**< The addresses, in the order to try them */
+    socket_addr* addrs;
+
+    /**< The number of addresses */
+    size_t count;
+
+    /**< The next address to try */
+    size_t next;
+
+    /**< The attempt on each address tried so far, waiting for POLLOUT. The
+     * descriptor is -1 once it has failed, which poll() skips. */
+    socket_pollfd* attempts;
+
+    /**< When the next attempt is due (socket_now()) */
+    uint64_t due;
+
+    /**< The connected descriptor, -1 until connected */
+    int fd;
+};
+
+/**
+ * @brief Returns a monotonic clock in milliseconds.
+ *
+ * @return The time.
+ *
+ * @ingroup DialFunctions
+ */
+static uint64_t socket_now();
+
+/**
+ * @brief Resolves a host, from the cache if it has a fresh entry. The
+ * addresses are interleaved by family, starting with the one the resolver
+ * put first (RFC 8305, section 4).
+ *
+ * @param host The host.
+ * @param port The port.
+ * @param count Set to the number of addresses.
+ * @return The addresses, which the caller frees. NULL on error.
+ *
+ * @ingroup DialFunctions
+ */
+static socket_addr* socket_resolve(cstr host, int port, size_t* count);
+
+/**
+ * @brief Starts a connection attempt on the next address.
+ *
+ * @param d The dial.
+ * @return True if it is in progress (or connected already, in which case
+ *   d->fd is set), false if it failed straight away.
+ *
+ * @ingroup DialFunctions
+ */
+static bool socket_dial_start(vws_dial* d);
+
+/**
+ * @brief Closes the attempts still in progress.
+ *
+ * @param d The dial.
+ *
+ * @ingroup DialFunctions
+ */
+static void socket_dial_close(vws_dial* d);
+
+/**
+ * @brief Acquires the DNS cache lock.
+ *
+ * @ingroup DialFunctions
+ */
+static void socket_dns_lock();
+
+/**
+ * @brief Releases the DNS cache lock.
+ *
+ * @ingroup DialFunctions
+ */
+static void socket_dns_unlock();
+
+/** Cached addresses by host:port */
+static struct sc_map_sv socket_dns_cache;
+
+/** Whether socket_dns_cache has been initialized */
+static bool socket_dns_init = false;
+
+/** DNS cache lock */
+static bool socket_dns_locked = false;
+
+/** Cached sessions by host:port */
+static struct sc_map_sv socket_sessions;
+
+/** Whether socket_sessions has been initialized */
+static bool socket_sessions_init = false;
+
+/** Session cache lock */
+static bool socket_sessions_locked = false;
+
 //------------------------------------------------------------------------------
 //> Socket API
 //------------------------------------------------------------------------------
@@ -74,14 +395,24 @@ vws_socket* vws_socket_new()
 
 vws_socket* vws_socket_ctor(vws_socket* s)
 {
-    s->sockfd     = -1;
-    s->buffer     = vws_buffer_new();
-    s->ssl        = NULL;
-    s->timeout    = 10000;
-    s->data       = NULL;
-    s->hs         = NULL;
-    s->disconnect = NULL;
-    s->flush      = true;
+    s->sockfd        = -1;
+    s->buffer        = vws_buffer_new();
+    s->ssl           = NULL;
+    s->timeout       = 10000;
+    s->data          = NULL;
+    s->hs            = NULL;
+    s->disconnect    = NULL;
+    s->flush         = true;
+    s->early_data    = false;
+    s->early_pending = false;
+    s->ssl_key       = NULL;
+    s->read_chunk    = 16384;
+    s->wait          = NULL;
+    s->uring         = NULL;
+    s->ktls          = true;
+    s->ktls_on       = 0;
+
+    vws_sockopts_init(&s->opts);
 
     return s;
 }
@@ -116,6 +447,35 @@ void vws_socket_dtor(vws_socket* s)
 // Utility functions
 //------------------------------------------------------------------------------
 
+int socket_read_space(vws_socket* c, size_t want)
+{
+    vws_buffer* buffer = c->buffer;
+
+    if (want < c->read_chunk)
+    {
+        want = c->read_chunk;
+    }
+
+    // A single read is capped at INT_MAX by SSL_read()
+    if (want > INT_MAX)
+    {
+        want = INT_MAX;
+    }
+
+    if (buffer->allocated - buffer->size < want)
+    {
+        size_t grow = buffer->size / 2;
+        vws_buffer_reserve(buffer, (want > grow) ? want : grow);
+    }
+
+    return (int)want;
+}
+
+unsigned char* socket_read_tail(vws_socket* c)
+{
+    return c->buffer->data + c->buffer->size;
+}
+
 void socket_abnormal_close(vws_socket* c)
 {
     // If disconnect callback is registered
@@ -257,6 +617,97 @@ bool vws_socket_set_nonblocking(int sockfd)
     return true;
 }
 
+bool vws_socket_set_nodelay(vws_socket* s, bool on)
+{
+    int flag = on ? 1 : 0;
+
+    if (setsockopt( s->sockfd, IPPROTO_TCP, TCP_NODELAY,
+                    (const char*)&flag, sizeof(flag) ) != 0)
+    {
+        vws.error(VE_SYS, "setsockopt(TCP_NODELAY) failed");
+        return false;
+    }
+
+    vws.success();
+
+    return true;
+}
+
+void vws_sockopts_init(vws_sockopts* o)
+{
+    o->nodelay      = true;
+    o->sndbuf       = 0;
+    o->rcvbuf       = 0;
+    o->busy_poll    = 0;
+    o->keepalive    = 0;
+    o->user_timeout = 0;
+}
+
+// Sets an int socket option, noting a failure in vws.e
+static bool sockopt_set(int fd, int level, int name, int value, cstr label)
+{
+    if (setsockopt(fd, level, name, (cstr)&value, sizeof(value)) != 0)
+    {
+        vws.error(VE_SYS, "setsockopt(%s) failed", label);
+        return false;
+    }
+
+    return true;
+}
+
+bool vws_sockopts_apply(int fd, const vws_sockopts* o)
+{
+    bool ok = true;
+
+    if (o->nodelay == true)
+    {
+        ok &= sockopt_set(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+
+    if (o->sndbuf > 0)
+    {
+        ok &= sockopt_set(fd, SOL_SOCKET, SO_SNDBUF, o->sndbuf, "SO_SNDBUF");
+    }
+
+    if (o->rcvbuf > 0)
+    {
+        ok &= sockopt_set(fd, SOL_SOCKET, SO_RCVBUF, o->rcvbuf, "SO_RCVBUF");
+    }
+
+#if defined(SO_BUSY_POLL)
+    if (o->busy_poll > 0)
+    {
+        int v = o->busy_poll;
+        ok &= sockopt_set(fd, SOL_SOCKET, SO_BUSY_POLL, v, "SO_BUSY_POLL");
+    }
+#endif
+
+    if (o->keepalive > 0)
+    {
+        ok &= sockopt_set(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+
+#if defined(TCP_KEEPIDLE)
+        int v = o->keepalive;
+        ok &= sockopt_set(fd, IPPROTO_TCP, TCP_KEEPIDLE, v, "TCP_KEEPIDLE");
+#endif
+    }
+
+#if defined(TCP_USER_TIMEOUT)
+    if (o->user_timeout > 0)
+    {
+        int v = (int)o->user_timeout;
+        ok &= sockopt_set(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, v, "TCP_USER_TIMEOUT");
+    }
+#endif
+
+    if (ok == true)
+    {
+        vws.success();
+    }
+
+    return ok;
+}
+
 bool vws_socket_is_connected(vws_socket* c)
 {
     if (c == NULL)
@@ -276,26 +727,38 @@ bool vws_socket_connect(vws_socket* c, cstr host, int port, bool ssl)
         return false;
     }
 
+    int fd = connect_to_host(host, port, c->timeout);
+
+    if (fd < 0)
+    {
+        vws.error(VE_SYS, "Connection failed");
+        vws_socket_close(c);
+        return false;
+    }
+
+    return vws_socket_connect_fd(c, fd, host, port, ssl);
+}
+
+bool vws_socket_connect_fd(vws_socket* c, int fd, cstr host, int port, bool ssl)
+{
+    if (c == NULL)
+    {
+        close(fd);
+        vws.error(VE_RT, "Invalid connection pointer()");
+        return false;
+    }
+
     // Clear socket buffer in case it was previously used in other connection.
     vws_buffer_clear(c->buffer);
 
+    c->sockfd = fd;
+
     if (ssl == true)
     {
-        if (vws_is_flag(&vws.state, CNX_SSL_INIT) == false)
+        if (vws_socket_ssl_init() == false)
         {
-            SSL_library_init();
-            RAND_poll();
-            SSL_load_error_strings();
-
-            vws_ssl_ctx = SSL_CTX_new(TLS_method());
-
-            if (vws_ssl_ctx == NULL)
-            {
-                vws.error(VE_SYS, "Failed to create new SSL context");
-                return false;
-            }
-
-            SSL_CTX_set_options(vws_ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+            // Error already set
+            return false;
         }
 
         c->ssl = SSL_new(vws_ssl_ctx);
@@ -308,17 +771,35 @@ bool vws_socket_connect(vws_socket* c, cstr host, int port, bool ssl)
         }
 
         vws_set_flag(&vws.state, CNX_SSL_INIT);
-    }
 
-    char port_str[20];
-    sprintf(port_str, "%d", port);
-    c->sockfd = connect_to_host(host, port_str);
+        // Offer the last session we had with this host, if any
+        size_t size = strlen(host) + 16;
+        c->ssl_key  = vws.malloc(size);
+        snprintf(c->ssl_key, size, "%s:%d", host, port);
 
-    if (c->sockfd < 0)
-    {
-        vws.error(VE_SYS, "Connection failed");
-        vws_socket_close(c);
-        return false;
+        SSL_set_app_data(c->ssl, c);
+        SSL_set_tlsext_host_name(c->ssl, host);
+
+        // Pull in as much as the socket has on each read rather than a record
+        // at a time. vws_socket_read() drains on SSL_has_pending().
+        SSL_set_read_ahead(c->ssl, 1);
+
+        #if defined(SSL_OP_ENABLE_KTLS)
+        // OpenSSL hands the keys to the kernel at the end of the handshake if
+        // it can, and carries on in user space if not
+        if (c->ktls == true)
+        {
+            SSL_set_options(c->ssl, SSL_OP_ENABLE_KTLS);
+        }
+        #endif
+
+        SSL_SESSION* session = socket_session_get(c->ssl_key);
+
+        if (session != NULL)
+        {
+            SSL_set_session(c->ssl, session);
+            SSL_SESSION_free(session);
+        }
     }
 
     // Set default timeout
@@ -329,18 +810,91 @@ bool vws_socket_connect(vws_socket* c, cstr host, int port, bool ssl)
         return false;
     }
 
+    // Tuning is not worth failing the connection over. Any option that could
+    // not be set has been reported.
+    vws_sockopts_apply(c->sockfd, &c->opts);
+
     if (c->ssl != NULL)
     {
         SSL_set_fd(c->ssl, c->sockfd);
 
-        if (SSL_connect(c->ssl) <= 0)
+        SSL_SESSION* session = SSL_get_session(c->ssl);
+
+        if ( (c->early_data == true) && (session != NULL) &&
+             (SSL_SESSION_get_max_early_data(session) > 0) )
+        {
+            // Leave the handshake to the first write, which goes out as early
+            // data along with the ClientHello
+            c->early_pending = true;
+        }
+        else if (SSL_connect(c->ssl) <= 0)
         {
             vws.error(VE_SYS, "SSL connection failed");
             vws_socket_close(c);
             return false;
         }
-    }
+        else
+        {
+            socket_ktls_check(c);
+        }
+    }
+
+    return socket_connected(c);
+}
+
+bool vws_socket_connect_unix(vws_socket* c, cstr path)
+{
+    if (c == NULL || path == NULL || path[0] == '\0')
+    {
+        vws.error(VE_RT, "Invalid connection pointer or path");
+        return false;
+    }
+
+    // Clear socket buffer in case it was previously used in other connection.
+    vws_buffer_clear(c->buffer);
+
+    c->sockfd = connect_to_path(path);
+
+    if (c->sockfd < 0)
+    {
+        // Error already set
+        vws_socket_close(c);
+        return false;
+    }
+
+    // Set default timeout
+    if (socket_set_timeout(c->sockfd, c->timeout/1000) == false)
+    {
+        // Error already set
+        vws_socket_close(c);
+        return false;
+    }
+
+    return socket_connected(c);
+}
 
+void socket_ktls_check(vws_socket* c)
+{
+    c->ktls_on = 0;
+
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl)))
+    {
+        c->ktls_on |= VWS_KTLS_SEND;
+    }
+
+    if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl)))
+    {
+        c->ktls_on |= VWS_KTLS_RECV;
+    }
+
+    if (vws.tracelevel >= VT_MODULE)
+    {
+        vws.trace(VL_INFO, "socket_ktls_check(%p): %i", c, c->ktls_on);
+    }
+}
+
+bool socket_connected(vws_socket* c)
+{
     #if defined(__bsd__)
 
     // Disable SIGPIPE
@@ -404,202 +958,320 @@ ssize_t vws_socket_read(vws_socket* c)
         return -1;
     }
 
-    struct pollfd fds;
-    int poll_events = POLLIN;
+    #if defined(VWS_IO_URING)
+    if (c->uring != NULL)
+    {
+        ssize_t n = vws_uring_read(c, true);
 
-openssl_reread:
+        if (n < 0)
+        {
+            socket_abnormal_close(c);
+        }
 
-    #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+        return n;
+    }
+    #endif
 
-    fds.fd     = c->sockfd;
-    fds.events = poll_events;
+    int poll_events = POLLIN;
 
-    int rc = poll(&fds, 1, c->timeout);
+    // Try the read before waiting. A busy peer has usually sent something
+    // already, and then poll() only costs a system call to learn what recv()
+    // finds out anyway. Only wait if the read would block. Errors and
+    // disconnects are left to the regular path below, which reports them.
+    if (c->ssl == NULL)
+    {
+        int size            = socket_read_space(c, 0);
+        unsigned char* data = socket_read_tail(c);
+
+        #if defined(__linux__) || defined(__sunos__)
+        ssize_t n = recv(c->sockfd, data, size, MSG_NOSIGNAL);
+        #else
+        ssize_t n = recv(c->sockfd, data, size, 0);
+        #endif
 
-    if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
+        if (n > 0)
+        {
+            c->buffer->size += n;
+            return n;
+        }
+    }
+    else if (SSL_has_pending(c->ssl) == 1)
     {
-        vws.error(VE_SOCKET, "Socket error during poll()");
-        socket_abnormal_close(c);
-        return -1;
+        // TLS holds data from the last read
+        bool want_write = false;
+        ssize_t n       = socket_read_ready(c, &want_write);
+
+        if (n != 0)
+        {
+            return n;
+        }
+
+        vws.success();
+        poll_events = want_write ? POLLOUT : POLLIN;
     }
 
-    #elif defined(__windows__)
+    while (true)
+    {
+        #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
 
-    WSAPOLLFD fds;
-    fds.fd     = c->sockfd;
-    fds.events = POLLIN;
+        struct pollfd fds;
+        fds.fd     = c->sockfd;
+        fds.events = poll_events;
 
-    int rc = WSAPoll(&fds, 1, c->timeout);
+        int rc = socket_poll(c, &fds);
 
-    if (rc == SOCKET_ERROR)
-    {
-        vws.error(VE_SOCKET, "Socket error during WSAPoll()");
-        socket_abnormal_close(c);
+        if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            vws.error(VE_SOCKET, "Socket error during poll()");
+            socket_abnormal_close(c);
+            return -1;
+        }
 
-        return -1;
+        #elif defined(__windows__)
+
+        WSAPOLLFD fds;
+        fds.fd     = c->sockfd;
+        fds.events = poll_events;
+
+        int rc = socket_poll(c, &fds);
+
+        if (rc == SOCKET_ERROR)
+        {
+            vws.error(VE_SOCKET, "Socket error during WSAPoll()");
+            socket_abnormal_close(c);
+
+            return -1;
+        }
+
+        #else
+        #error Platform not supported
+        #endif
+
+        if (rc == -1)
+        {
+            // A signal interrupted the wait (for example a language binding
+            // waking a blocked thread). Nothing was read and the connection is
+            // intact, so report it like a timeout.
+            if (errno == EINTR)
+            {
+                vws.error(VE_TIMEOUT, "poll() interrupted");
+                return 0;
+            }
+
+            vws.error(VE_RT, "poll() failed");
+            return -1;
+        }
+
+        if (rc == 0)
+        {
+            vws.error(VE_TIMEOUT, "poll()");
+            return 0;
+        }
+
+        if ((fds.revents & poll_events) == 0)
+        {
+            return 0;
+        }
+
+        bool want_write = false;
+        ssize_t n       = socket_read_ready(c, &want_write);
+
+        // Plaintext sockets return whatever they got, even nothing. TLS may
+        // have only consumed protocol records (a session ticket, a key update)
+        // or need to write before it can read. Either way, wait again rather
+        // than returning to the caller empty-handed.
+        if (n != 0 || c->ssl == NULL)
+        {
+            return n;
+        }
+
+        poll_events = want_write ? POLLOUT : POLLIN;
     }
+}
 
-    #else
-    #error Platform not supported
-    #endif
+ssize_t vws_socket_read_ready(vws_socket* c, bool* want_write)
+{
+    // Default success unless error
+    vws.success();
 
-    if (rc == -1)
+    if (vws_socket_is_connected(c) == false)
     {
-        vws.error(VE_RT, "poll() failed");
+        vws.error(VE_SOCKET, "vws_socket_read_ready()");
         return -1;
     }
 
-    if (rc == 0)
+    #if defined(VWS_IO_URING)
+    if (c->uring != NULL)
     {
-        vws.error(VE_TIMEOUT, "poll()");
-        return 0;
+        if (want_write != NULL)
+        {
+            *want_write = false;
+        }
+
+        ssize_t n = vws_uring_read(c, false);
+
+        if (n < 0)
+        {
+            socket_abnormal_close(c);
+        }
+
+        return n;
+    }
+    #endif
+
+    bool flag = false;
+    ssize_t n = socket_read_ready(c, &flag);
+
+    if (want_write != NULL)
+    {
+        *want_write = flag;
     }
 
-    ssize_t      n = 0;
-    ucstr data   = &vws.sslbuf[0];
-    ssize_t size = sizeof(vws.sslbuf);
+    return n;
+}
+
+ssize_t socket_read_ready(vws_socket* c, bool* want_write)
+{
+    ssize_t n = 0;
 
-    if (fds.revents & poll_events)
+    if (c->ssl != NULL)
     {
-        if (c->ssl != NULL)
+        // We need running total bc we may make multiple SSL_read() calls.
+        ssize_t total = 0;
+
+        // Drain all data from SSL buffer straight into the receive buffer
+        while (true)
         {
-            // We need running total bc we may make multiple SSL_read() calls.
-            int total = 0;
+            // Make room for whatever TLS has already decrypted, or at least one
+            // chunk.
+            int size = socket_read_space(c, SSL_pending(c->ssl));
 
-            // Drain all data from SSL buffer
-            while ((n = SSL_read(c->ssl, data, size)) > 0)
+            if ((n = SSL_read(c->ssl, socket_read_tail(c), size)) <= 0)
             {
-                // Process received data stored in buf
-                total += n;
-                vws_buffer_append(c->buffer, data, n);
-
-                if (n < size)
-                {
-                    // All available data has been read, break the loop.
-                    break;
-                }
+                break;
             }
 
-            // Check for error conditions
-            if (n <= 0)
+            total           += n;
+            c->buffer->size += n;
+
+            // A short read does not mean TLS is empty: a message spanning
+            // records can leave decrypted bytes (SSL_pending()) or a partially
+            // processed record (SSL_has_pending()) behind. Only stop when both
+            // are gone. Whatever is left is still in the socket and poll() will
+            // tell us about it.
+            if (SSL_pending(c->ssl) == 0 && SSL_has_pending(c->ssl) == 0)
             {
-                int err = SSL_get_error(c->ssl, n);
+                return total;
+            }
+        }
 
-                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
-                {
-                    // SSL needs to do something on socket in order to continue.
+        // Check for error conditions
+        int err = SSL_get_error(c->ssl, n);
 
-                    // If it wants to read data
-                    if (err == SSL_ERROR_WANT_READ)
-                    {
-                        // We are done. We have emptied the read buffer.
-                        return total;
-                    }
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        {
+            // SSL needs to do something on socket in order to continue. If it
+            // wants to write, it's doing some internal negotiation and we need
+            // to help it along by waiting for the socket to become writable.
+            // The next SSL_read() will send out the data it needs to.
+            *want_write = (err == SSL_ERROR_WANT_WRITE);
+
+            // We are done. We have emptied the read buffer.
+            return total;
+        }
+        else if (err == SSL_ERROR_SYSCALL)
+        {
+            #if defined(__windows__)
 
-                    // If it wants to write data
-                    if (err == SSL_ERROR_WANT_WRITE)
-                    {
-                        // It's doing some internal negotiation and we need to
-                        // help it along by running poll() for writes. Then we
-                        // will return to SSL_read() in which SSL will send out
-                        // the data it needs to.
-                        poll_events = POLLOUT;
-                        goto openssl_reread;
-                    }
-                }
-                else if (err == SSL_ERROR_SYSCALL)
-                {
-                    #if defined(__windows__)
+            int err = WSAGetLastError();
 
-                    int err = WSAGetLastError();
+            if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
+            {
+                vws.error(VE_TIMEOUT, "SSL_read()");
+                return total;
+            }
 
-                    if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
-                    {
-                        vws.error(VE_TIMEOUT, "SSL_read()");
-                        return 0;
-                    }
+            #else
 
-                    #else
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+            {
+                vws.error(VE_TIMEOUT, "SSL_read()");
+                return total;
+            }
 
-                    if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
-                    {
-                        vws.error(VE_TIMEOUT, "SSL_read()");
-                        return 0;
-                    }
+            #endif
+        }
 
-                    #endif
-                }
+        // Get the latest OpenSSL error
+        char buf[256];
+        unsigned long ssl_err = ERR_get_error();
+        ERR_error_string_n(ssl_err, buf, sizeof(buf));
+        vws.error(VE_SOCKET, "SSL_read() failed: %s", buf);
 
-                // Get the latest OpenSSL error
-                char buf[256];
-                unsigned long ssl_err = ERR_get_error();
-                ERR_error_string_n(ssl_err, buf, sizeof(buf));
-                vws.error(VE_SOCKET, "SSL_read() failed: %s", buf);
+        // Close socket
+        socket_abnormal_close(c);
 
-                // Close socket
-                socket_abnormal_close(c);
+        return -1;
+    }
 
-                return -1;
-            }
-        }
-        else
-        {
-            // Non-SSL socket is readable, perform recv() operation
-            #if defined(__linux__) || defined(__sunos__)
-            n = recv(c->sockfd, data, size, MSG_NOSIGNAL);
-            #else
-            n = recv(c->sockfd, data, size, 0);
-            #endif
+    // Non-SSL socket is readable, perform recv() operation straight
+    // into the receive buffer
+    int size            = socket_read_space(c, 0);
+    unsigned char* data = socket_read_tail(c);
 
-            if (n == 0)
-            {
-                vws.error(VE_SOCKET, "disconnect");
+    #if defined(__linux__) || defined(__sunos__)
+    n = recv(c->sockfd, data, size, MSG_NOSIGNAL);
+    #else
+    n = recv(c->sockfd, data, size, 0);
+    #endif
 
-                // Close socket
-                socket_abnormal_close(c);
+    if (n == 0)
+    {
+        vws.error(VE_SOCKET, "disconnect");
 
-                return -1;
-            }
+        // Close socket
+        socket_abnormal_close(c);
 
-            if (n <= -1)
-            {
-                #if defined(__windows__)
-                int err = WSAGetLastError();
+        return -1;
+    }
 
-                if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
-                {
-                    vws.error(VE_TIMEOUT, "recv()");
-                    return 0;
-                }
+    if (n <= -1)
+    {
+        #if defined(__windows__)
+        int err = WSAGetLastError();
 
-                #else
+        if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
+        {
+            vws.error(VE_TIMEOUT, "recv()");
+            return 0;
+        }
 
-                if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
-                {
-                    vws.error(VE_TIMEOUT, "recv()");
-                    return 0;
-                }
-                else
-                {
-                    // Error
-                    char buf[256];
-                    strerror_r(errno, buf, sizeof(buf));
-                    vws.error(VE_WARN, "recv() failed: %s", buf);
+        #else
 
-                    // Close socket
-                    socket_abnormal_close(c);
+        if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+        {
+            vws.error(VE_TIMEOUT, "recv()");
+            return 0;
+        }
+        else
+        {
+            // Error
+            char buf[256];
+            strerror_r(errno, buf, sizeof(buf));
+            vws.error(VE_WARN, "recv() failed: %s", buf);
 
-                    return -1;
-                }
-                #endif
-            }
+            // Close socket
+            socket_abnormal_close(c);
 
-            // Should always be true if we get here
-            if (n > 0)
-            {
-                vws_buffer_append(c->buffer, data, n);
-            }
+            return -1;
         }
+        #endif
+    }
+
+    // Should always be true if we get here
+    if (n > 0)
+    {
+        c->buffer->size += n;
     }
 
     return n;
@@ -623,31 +1295,66 @@ ssize_t vws_socket_write(vws_socket* c, const ucstr data, size_t size)
         return -1;
     }
 
-    // But default we will keep looping until we have sent all the data
-    size_t sent     = 0;
-    int poll_events = POLLOUT;
-    int iterations  = 0;
-    while (sent < size)
+    #if defined(VWS_IO_URING)
+    if (c->uring != NULL)
     {
-        // If we attempted at least one poll()/send()
-        if (iterations++ > 0)
+        ssize_t n = vws_uring_write(c, data, size);
+
+        if (n < 0)
         {
-            // And we are not set to flush mode, then we will return here,
-            // sending back how much data we sent. The caller will need to
-            // adjust the buffer accordingly.
-            if (c->flush == false)
-            {
-                break;
-            }
+            socket_abnormal_close(c);
         }
 
-        #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+        return n;
+    }
+    #endif
+
+    if (c->early_pending == true)
+    {
+        c->early_pending = false;
+
+        int rc = socket_write_early(c, data, size);
+
+        if (rc < 0)
+        {
+            // Error already set
+            socket_abnormal_close(c);
+            return -1;
+        }
+
+        if (rc == 1)
+        {
+            return size;
+        }
+
+        // Not accepted as early data. Send it normally.
+    }
+
+    // But default we will keep looping until we have sent all the data
+    size_t sent     = 0;
+    int poll_events = POLLOUT;
+    int iterations  = 0;
+    while (sent < size)
+    {
+        // If we attempted at least one poll()/send()
+        if (iterations++ > 0)
+        {
+            // And we are not set to flush mode, then we will return here,
+            // sending back how much data we sent. The caller will need to
+            // adjust the buffer accordingly.
+            if (c->flush == false)
+            {
+                break;
+            }
+        }
+
+        #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
 
         struct pollfd fds;
         fds.fd     = c->sockfd;
         fds.events = poll_events;
 
-        int rc = poll(&fds, 1, c->timeout);
+        int rc = socket_poll(c, &fds);
 
         if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
         {
@@ -662,7 +1369,7 @@ ssize_t vws_socket_write(vws_socket* c, const ucstr data, size_t size)
         fds.fd     = c->sockfd;
         fds.events = poll_events;
 
-        int rc = WSAPoll(&fds, 1, c->timeout);
+        int rc = socket_poll(c, &fds);
 
         if (rc == SOCKET_ERROR)
         {
@@ -677,6 +1384,13 @@ ssize_t vws_socket_write(vws_socket* c, const ucstr data, size_t size)
 
         if (rc == -1)
         {
+            // Interrupted by a signal. Sends are all or nothing, so treat it
+            // like a timeout and keep going.
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
             vws.error(VE_SYS, "poll() failed");
             return -1;
         }
@@ -693,7 +1407,9 @@ ssize_t vws_socket_write(vws_socket* c, const ucstr data, size_t size)
         ssize_t n = 0;
         if (fds.revents & poll_events)
         {
-            if (c->ssl != NULL)
+            // With kTLS the kernel makes the records, so the data goes
+            // straight to send()
+            if (c->ssl != NULL && (c->ktls_on & VWS_KTLS_SEND) == 0)
             {
                 // SSL socket is writable, perform SSL_write() operation
                 n = SSL_write(c->ssl, data + sent, size - sent);
@@ -806,6 +1522,133 @@ ssize_t vws_socket_write(vws_socket* c, const ucstr data, size_t size)
     return sent;
 }
 
+ssize_t vws_socket_write_ready( vws_socket* c,
+                                const ucstr data,
+                                size_t size,
+                                bool* want_read )
+{
+    // Default success unless error
+    vws.success();
+
+    if (want_read != NULL)
+    {
+        *want_read = false;
+    }
+
+    if (vws_socket_is_connected(c) == false)
+    {
+        vws.error(VE_SOCKET, "vws_socket_write_ready()");
+        return -1;
+    }
+
+    if (data == NULL || size == 0)
+    {
+        vws.error(VE_WARN, "Invalid parameters");
+        return -1;
+    }
+
+    // These have no non-blocking form. They complete the write.
+    #if defined(VWS_IO_URING)
+    if (c->uring != NULL)
+    {
+        return vws_socket_write(c, data, size);
+    }
+    #endif
+
+    if (c->early_pending == true)
+    {
+        return vws_socket_write(c, data, size);
+    }
+
+    ssize_t n;
+
+    // With kTLS it's a plain send(), as in vws_socket_write()
+    if (c->ssl != NULL && (c->ktls_on & VWS_KTLS_SEND) == 0)
+    {
+        // Take what fits and allow the retry of a blocked write to come from
+        // a buffer that has since been compacted or grown.
+        SSL_set_mode( c->ssl,
+                      SSL_MODE_ENABLE_PARTIAL_WRITE |
+                      SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+
+        int len = (size > INT_MAX) ? INT_MAX : (int)size;
+
+        if ((n = SSL_write(c->ssl, data, len)) > 0)
+        {
+            return n;
+        }
+
+        int err = SSL_get_error(c->ssl, n);
+
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        {
+            if (want_read != NULL)
+            {
+                *want_read = (err == SSL_ERROR_WANT_READ);
+            }
+
+            return 0;
+        }
+
+        if (err == SSL_ERROR_SYSCALL)
+        {
+            #if defined(__windows__)
+            int err = WSAGetLastError();
+
+            if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
+            {
+                return 0;
+            }
+            #else
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+            {
+                return 0;
+            }
+            #endif
+        }
+
+        // Get the latest OpenSSL error
+        char buf[256];
+        unsigned long ssl_err = ERR_get_error();
+        ERR_error_string_n(ssl_err, buf, sizeof(buf));
+        vws.error(VE_SOCKET, "SSL_write() failed: %s", buf);
+
+        socket_abnormal_close(c);
+
+        return -1;
+    }
+
+    #if defined(__linux__) || defined(__sunos__)
+    n = send(c->sockfd, data, size, MSG_NOSIGNAL);
+    #else
+    n = send(c->sockfd, data, size, 0);
+    #endif
+
+    if (n >= 0)
+    {
+        return n;
+    }
+
+    #if defined(__windows__)
+    int err = WSAGetLastError();
+
+    if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
+    {
+        return 0;
+    }
+    #else
+    if (errno == EWOULDBLOCK || errno == EAGAIN)
+    {
+        return 0;
+    }
+    #endif
+
+    vws.error(VE_SYS, "send() error");
+    socket_abnormal_close(c);
+
+    return -1;
+}
+
 void vws_socket_close(vws_socket* c)
 {
     if (c->ssl != NULL)
@@ -826,6 +1669,20 @@ void vws_socket_close(vws_socket* c)
         c->ssl = NULL;
     }
 
+    if (c->ssl_key != NULL)
+    {
+        vws.free(c->ssl_key);
+        c->ssl_key = NULL;
+    }
+
+    c->early_pending = false;
+    c->ktls_on       = 0;
+
+    #if defined(VWS_IO_URING)
+    // The ring must be done with the descriptor before it is closed
+    vws_uring_remove(c);
+    #endif
+
     if (c->sockfd >= 0)
     {
         #if defined(__windows__)
@@ -846,58 +1703,112 @@ void vws_socket_close(vws_socket* c)
     }
 }
 
-int connect_to_host(const char* host, const char* port)
+int connect_to_path(cstr path)
 {
-    int sockfd = -1;
-
     #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
 
-    // Resolve the host
-    struct addrinfo hints, *res, *res0;
-    int error;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = PF_UNSPEC; // Accept any family (IPv4 or IPv6)
-    hints.ai_socktype = SOCK_STREAM;
+    size_t size = strlen(path);
 
-    error = getaddrinfo(host, port, &hints, &res0);
+    if (size >= sizeof(addr.sun_path))
+    {
+        vws.error(VE_RT, "Socket path too long");
+        return -1;
+    }
 
-    if (error)
+    memcpy(addr.sun_path, path, size);
+
+    socklen_t len = offsetof(struct sockaddr_un, sun_path) + size;
+
+    if (path[0] == '@')
     {
-        if (vws.tracelevel > 0)
-        {
-            cstr msg = gai_strerror(error);
-            vws.trace(VL_ERROR, "getaddrinfo failed: %s: %s", host, msg);
-        }
+        // Abstract namespace: the name is the bytes after a leading NUL
+        addr.sun_path[0] = '\0';
+    }
+    else
+    {
+        // Include the terminating NUL
+        len++;
+    }
 
-        vws.error(VE_SYS, "getaddrinfo() failed");
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
 
+    if (sockfd == -1)
+    {
+        vws.error(VE_SYS, "Failed to create socket");
         return -1;
     }
 
-    for (res = res0; res; res = res->ai_next)
+    if (connect(sockfd, (struct sockaddr*)&addr, len) == -1)
+    {
+        close(sockfd);
+        vws.error(VE_SYS, "Failed to connect");
+        return -1;
+    }
+
+    return sockfd;
+
+    #else
+
+    vws.error(VE_RT, "Unix domain sockets are not supported");
+    return -1;
+
+    #endif
+}
+
+int connect_to_host(cstr host, int port, int timeout)
+{
+    int sockfd = -1;
+
+    #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+
+    vws_dial* d = vws_dial_new(host, port);
+
+    if (d == NULL)
+    {
+        // Error already set
+        return -1;
+    }
+
+    uint64_t end = socket_now() + timeout;
+    int rc;
+
+    while ((rc = vws_dial_step(d)) == 0)
     {
-        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        uint64_t now = socket_now();
 
-        if (sockfd == -1)
+        if (now >= end)
         {
-            vws.error(VE_SYS, "Failed to create socket");
-            continue;
+            vws.error(VE_TIMEOUT, "Timed out connecting");
+            break;
         }
 
-        if (connect(sockfd, res->ai_addr, res->ai_addrlen) == -1)
-        {
-            close(sockfd);
-            sockfd = -1;
+        // Until an attempt finishes, the next is due or time is up
+        int wait = (int)(end - now);
+        int due  = vws_dial_timeout(d);
 
-            vws.error(VE_SYS, "Failed to connect");
-            continue;
+        if (due > -1 && due < wait)
+        {
+            wait = due;
         }
 
-        break; // If we get here, we must have connected successfully
+        poll(d->attempts, d->next, wait);
+    }
+
+    if (rc == 1)
+    {
+        sockfd = vws_dial_take(d);
     }
 
-    freeaddrinfo(res0); // Free the addrinfo structure for this host
+    vws_dial_free(d);
+
+    if (sockfd == -1)
+    {
+        return -1;
+    }
 
     #elif defined(__windows__)
 
@@ -920,8 +1831,11 @@ int connect_to_host(const char* host, const char* port)
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
 
+    char port_str[20];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
     // Resolve the server address and port
-    if (getaddrinfo(host, port, &hints, &result) != 0)
+    if (getaddrinfo(host, port_str, &hints, &result) != 0)
     {
         vws.error(VE_SYS, "getaddrinfo failed\n");
         return -1;
@@ -972,3 +1886,699 @@ int connect_to_host(const char* host, const char* port)
 
     return sockfd;
 }
+
+//------------------------------------------------------------------------------
+//> Dialing
+//------------------------------------------------------------------------------
+
+#if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+
+vws_dial* vws_dial_new(cstr host, int port)
+{
+    size_t count;
+    socket_addr* addrs = socket_resolve(host, port, &count);
+
+    if (addrs == NULL)
+    {
+        // Error already set
+        return NULL;
+    }
+
+    vws_dial* d = (vws_dial*)vws.malloc(sizeof(vws_dial));
+    d->addrs    = addrs;
+    d->count    = count;
+    d->next     = 0;
+    d->attempts = vws.malloc(count * sizeof(socket_pollfd));
+    d->due      = 0;
+    d->fd       = -1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        d->attempts[i].fd      = -1;
+        d->attempts[i].events  = POLLOUT;
+        d->attempts[i].revents = 0;
+    }
+
+    if (vws_dial_step(d) == -1)
+    {
+        // Error already set
+        vws_dial_free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+void vws_dial_free(vws_dial* d)
+{
+    if (d == NULL)
+    {
+        return;
+    }
+
+    socket_dial_close(d);
+
+    if (d->fd > -1)
+    {
+        close(d->fd);
+    }
+
+    vws.free(d->attempts);
+    vws.free(d->addrs);
+    vws.free(d);
+}
+
+int vws_dial_step(vws_dial* d)
+{
+    if (d->fd > -1)
+    {
+        return 1;
+    }
+
+    // Poll skips the attempts that have failed
+    if (poll(d->attempts, d->next, 0) > 0)
+    {
+        for (size_t i = 0; i < d->next; i++)
+        {
+            socket_pollfd* a = &d->attempts[i];
+
+            if (a->fd < 0 || a->revents == 0)
+            {
+                continue;
+            }
+
+            int err       = 0;
+            socklen_t len = sizeof(err);
+
+            if (getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            {
+                err = errno;
+            }
+
+            if (err == 0)
+            {
+                d->fd = a->fd;
+                a->fd = -1;
+                break;
+            }
+
+            close(a->fd);
+            a->fd = -1;
+
+            errno = err;
+            vws.error(VE_SYS, "Failed to connect");
+
+            // The next address needn't wait its turn
+            d->due = 0;
+        }
+    }
+
+    uint64_t now = socket_now();
+
+    // An attempt that fails straight away makes way for the next one
+    while (d->fd == -1 && d->next < d->count && now >= d->due)
+    {
+        if (socket_dial_start(d) == true)
+        {
+            d->due = now + VWS_DIAL_DELAY;
+        }
+    }
+
+    if (d->fd > -1)
+    {
+        socket_dial_close(d);
+        vws.success();
+
+        return 1;
+    }
+
+    if (d->next == d->count && vws_dial_fds(d, NULL, 0) == 0)
+    {
+        // Error already set by the last failure
+        return -1;
+    }
+
+    return 0;
+}
+
+size_t vws_dial_fds(vws_dial* d, int* fds, size_t n)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < d->next; i++)
+    {
+        if (d->attempts[i].fd < 0)
+        {
+            continue;
+        }
+
+        if (count < n)
+        {
+            fds[count] = d->attempts[i].fd;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+int vws_dial_timeout(vws_dial* d)
+{
+    if (d->next == d->count)
+    {
+        return -1;
+    }
+
+    uint64_t now = socket_now();
+
+    return (d->due > now) ? (int)(d->due - now) : 0;
+}
+
+int vws_dial_take(vws_dial* d)
+{
+    int fd = d->fd;
+
+    if (fd == -1)
+    {
+        vws.error(VE_RT, "Not connected");
+        return -1;
+    }
+
+    d->fd = -1;
+
+    // As connect() leaves it, for the handshake that follows
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags != -1)
+    {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    return fd;
+}
+
+bool socket_dial_start(vws_dial* d)
+{
+    size_t i       = d->next++;
+    socket_addr* a = &d->addrs[i];
+
+    int fd = socket(a->addr.ss_family, SOCK_STREAM, 0);
+
+    if (fd == -1)
+    {
+        vws.error(VE_SYS, "Failed to create socket");
+        return false;
+    }
+
+    if (vws_socket_set_nonblocking(fd) == false)
+    {
+        // Error already set
+        close(fd);
+        return false;
+    }
+
+    if (connect(fd, (struct sockaddr*)&a->addr, a->len) == 0)
+    {
+        // Loopback can connect straight away
+        d->fd = fd;
+        return true;
+    }
+
+    if (errno != EINPROGRESS)
+    {
+        close(fd);
+        vws.error(VE_SYS, "Failed to connect");
+        return false;
+    }
+
+    d->attempts[i].fd = fd;
+
+    return true;
+}
+
+void socket_dial_close(vws_dial* d)
+{
+    for (size_t i = 0; i < d->next; i++)
+    {
+        if (d->attempts[i].fd > -1)
+        {
+            close(d->attempts[i].fd);
+            d->attempts[i].fd = -1;
+        }
+    }
+}
+
+uint64_t socket_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+socket_addr* socket_resolve(cstr host, int port, size_t* count)
+{
+    size_t size = strlen(host) + 16;
+    char* key   = vws.malloc(size);
+    snprintf(key, size, "%s:%d", host, port);
+
+    socket_addr* addrs = NULL;
+    uint64_t now       = socket_now();
+
+    socket_dns_lock();
+
+    if (socket_dns_init == true)
+    {
+        socket_dns* entry = sc_map_get_sv(&socket_dns_cache, key);
+
+        if (sc_map_found(&socket_dns_cache) == true && entry->expires > now)
+        {
+            *count = entry->count;
+            addrs  = vws.malloc(entry->count * sizeof(socket_addr));
+            memcpy(addrs, entry->addrs, entry->count * sizeof(socket_addr));
+        }
+    }
+
+    socket_dns_unlock();
+
+    if (addrs != NULL)
+    {
+        vws.free(key);
+        return addrs;
+    }
+
+    // Resolve outside the lock, as it can take a while
+    struct addrinfo hints, *res, *res0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = PF_UNSPEC; // Accept any family (IPv4 or IPv6)
+    hints.ai_socktype = SOCK_STREAM;
+
+    char port_str[20];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    int error = getaddrinfo(host, port_str, &hints, &res0);
+
+    if (error)
+    {
+        if (vws.tracelevel > 0)
+        {
+            cstr msg = gai_strerror(error);
+            vws.trace(VL_ERROR, "getaddrinfo failed: %s: %s", host, msg);
+        }
+
+        vws.error(VE_SYS, "getaddrinfo() failed");
+        vws.free(key);
+
+        return NULL;
+    }
+
+    size_t n = 0;
+
+    for (res = res0; res; res = res->ai_next)
+    {
+        n++;
+    }
+
+    // The resolver's first choice of family, then the other, taking turns
+    addrs        = vws.malloc(n * sizeof(socket_addr));
+    int first    = res0->ai_family;
+    size_t lead  = 0;
+
+    for (res = res0; res; res = res->ai_next)
+    {
+        if (res->ai_family == first)
+        {
+            lead++;
+        }
+    }
+
+    size_t a = 0;
+    size_t b = 0;
+
+    for (res = res0; res; res = res->ai_next)
+    {
+        // Slot in the interleaved order: the kth of a family goes to 2k (or
+        // 2k+1 for the other), until the shorter family runs out
+        size_t k    = (res->ai_family == first) ? a++ : b++;
+        bool second = (res->ai_family != first);
+        size_t pair = (lead < n - lead) ? lead : n - lead;
+        size_t at   = (k < pair) ? 2 * k + second : pair + k;
+
+        memcpy(&addrs[at].addr, res->ai_addr, res->ai_addrlen);
+        addrs[at].len = res->ai_addrlen;
+    }
+
+    freeaddrinfo(res0);
+
+    socket_dns_lock();
+
+    if (socket_dns_init == false)
+    {
+        sc_map_init_sv(&socket_dns_cache, 0, 0);
+        socket_dns_init = true;
+    }
+
+    socket_dns* entry = sc_map_get_sv(&socket_dns_cache, key);
+
+    if (sc_map_found(&socket_dns_cache) == true)
+    {
+        vws.free(entry->addrs);
+        vws.free(key);
+    }
+    else
+    {
+        entry      = vws.malloc(sizeof(socket_dns));
+        entry->key = key;
+        sc_map_put_sv(&socket_dns_cache, entry->key, entry);
+    }
+
+    entry->count   = n;
+    entry->expires = now + VWS_DNS_TTL * 1000;
+    entry->addrs   = vws.malloc(n * sizeof(socket_addr));
+    memcpy(entry->addrs, addrs, n * sizeof(socket_addr));
+
+    socket_dns_unlock();
+
+    *count = n;
+
+    return addrs;
+}
+
+#else
+
+vws_dial* vws_dial_new(cstr host, int port)
+{
+    vws.error(VE_RT, "Non-blocking connect is not supported");
+    return NULL;
+}
+
+void vws_dial_free(vws_dial* d)
+{
+}
+
+int vws_dial_step(vws_dial* d)
+{
+    return -1;
+}
+
+size_t vws_dial_fds(vws_dial* d, int* fds, size_t n)
+{
+    return 0;
+}
+
+int vws_dial_timeout(vws_dial* d)
+{
+    return -1;
+}
+
+int vws_dial_take(vws_dial* d)
+{
+    return -1;
+}
+
+#endif
+
+void vws_dns_clear()
+{
+    socket_dns_lock();
+
+    if (socket_dns_init == true)
+    {
+        cstr key; socket_dns* entry;
+        sc_map_foreach(&socket_dns_cache, key, entry)
+        {
+            vws.free(entry->addrs);
+            vws.free(entry->key);
+            vws.free(entry);
+        }
+
+        sc_map_clear_sv(&socket_dns_cache);
+    }
+
+    socket_dns_unlock();
+}
+
+void socket_dns_lock()
+{
+    while (__atomic_test_and_set(&socket_dns_locked, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&socket_dns_locked, __ATOMIC_RELAXED))
+        {
+            // Spin
+        }
+    }
+}
+
+void socket_dns_unlock()
+{
+    __atomic_clear(&socket_dns_locked, __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+//> TLS session cache
+//------------------------------------------------------------------------------
+
+bool vws_socket_ssl_init()
+{
+    if (vws_ssl_ctx != NULL)
+    {
+        return true;
+    }
+
+    SSL_library_init();
+    RAND_poll();
+    SSL_load_error_strings();
+
+    vws_ssl_ctx = SSL_CTX_new(TLS_method());
+
+    if (vws_ssl_ctx == NULL)
+    {
+        vws.error(VE_SYS, "Failed to create new SSL context");
+        return false;
+    }
+
+    SSL_CTX_set_options(vws_ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+    // Client sessions are handed to socket_session_new(). TLS 1.3 tickets
+    // arrive after the handshake, so this is the only reliable way to get
+    // hold of them.
+    SSL_CTX_set_session_cache_mode(vws_ssl_ctx, SSL_SESS_CACHE_BOTH);
+    SSL_CTX_sess_set_new_cb(vws_ssl_ctx, socket_session_new);
+
+    return true;
+}
+
+void vws_socket_ssl_clear_sessions()
+{
+    socket_session_lock();
+
+    if (socket_sessions_init == true)
+    {
+        cstr key; socket_session* entry;
+        sc_map_foreach(&socket_sessions, key, entry)
+        {
+            SSL_SESSION_free(entry->session);
+            vws.free(entry->key);
+            vws.free(entry);
+        }
+
+        sc_map_clear_sv(&socket_sessions);
+    }
+
+    socket_session_unlock();
+}
+
+int socket_session_new(SSL* ssl, SSL_SESSION* session)
+{
+    if (SSL_is_server(ssl))
+    {
+        return 0;
+    }
+
+    vws_socket* c = (vws_socket*)SSL_get_app_data(ssl);
+
+    if (c == NULL || c->ssl_key == NULL)
+    {
+        return 0;
+    }
+
+    socket_session_lock();
+
+    if (socket_sessions_init == false)
+    {
+        sc_map_init_sv(&socket_sessions, 0, 0);
+        socket_sessions_init = true;
+    }
+
+    socket_session* entry = sc_map_get_sv(&socket_sessions, c->ssl_key);
+
+    if (sc_map_found(&socket_sessions) == true)
+    {
+        SSL_SESSION_free(entry->session);
+    }
+    else
+    {
+        entry      = vws.malloc(sizeof(socket_session));
+        entry->key = vws_strdup(c->ssl_key);
+        sc_map_put_sv(&socket_sessions, entry->key, entry);
+    }
+
+    entry->session = session;
+
+    socket_session_unlock();
+
+    return 1;
+}
+
+SSL_SESSION* socket_session_get(cstr key)
+{
+    SSL_SESSION* session = NULL;
+
+    socket_session_lock();
+
+    if (socket_sessions_init == true)
+    {
+        socket_session* entry = sc_map_get_sv(&socket_sessions, key);
+
+        if (sc_map_found(&socket_sessions) == true)
+        {
+            if (SSL_SESSION_is_resumable(entry->session))
+            {
+                session = entry->session;
+                SSL_SESSION_up_ref(session);
+            }
+        }
+    }
+
+    socket_session_unlock();
+
+    return session;
+}
+
+void socket_session_lock()
+{
+    while (__atomic_test_and_set(&socket_sessions_locked, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&socket_sessions_locked, __ATOMIC_RELAXED))
+        {
+            // Spin
+        }
+    }
+}
+
+void socket_session_unlock()
+{
+    __atomic_clear(&socket_sessions_locked, __ATOMIC_RELEASE);
+}
+
+int socket_poll(vws_socket* c, socket_pollfd* fds)
+{
+    if (c->wait == NULL)
+    {
+        #if defined(__windows__)
+        return WSAPoll(fds, 1, c->timeout);
+        #else
+        return poll(fds, 1, c->timeout);
+        #endif
+    }
+
+    fds->revents = 0;
+
+    return c->wait(c, fds->events, c->timeout, &fds->revents);
+}
+
+bool socket_ssl_wait(vws_socket* c, int rc)
+{
+    int err = SSL_get_error(c->ssl, rc);
+    int events;
+
+    if (err == SSL_ERROR_WANT_READ)
+    {
+        events = POLLIN;
+    }
+    else if (err == SSL_ERROR_WANT_WRITE)
+    {
+        events = POLLOUT;
+    }
+    else
+    {
+        char buf[256];
+        ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+        vws.error(VE_SOCKET, "TLS handshake failed: %s", buf);
+
+        return false;
+    }
+
+    #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+
+    struct pollfd fds;
+    fds.fd     = c->sockfd;
+    fds.events = events;
+
+    int n = socket_poll(c, &fds);
+
+    #elif defined(__windows__)
+
+    WSAPOLLFD fds;
+    fds.fd     = c->sockfd;
+    fds.events = events;
+
+    int n = socket_poll(c, &fds);
+
+    #else
+    #error Platform not supported
+    #endif
+
+    if (n <= 0 || (fds.revents & (POLLERR | POLLHUP | POLLNVAL)))
+    {
+        vws.error(VE_SOCKET, "TLS handshake failed: poll()");
+        return false;
+    }
+
+    return true;
+}
+
+int socket_write_early(vws_socket* c, ucstr data, size_t size)
+{
+    SSL_SESSION* session = SSL_get_session(c->ssl);
+    bool sent            = false;
+
+    if (size <= SSL_SESSION_get_max_early_data(session))
+    {
+        size_t written;
+        int rc;
+
+        while ((rc = SSL_write_early_data(c->ssl, data, size, &written)) != 1)
+        {
+            if (socket_ssl_wait(c, rc) == false)
+            {
+                return -1;
+            }
+        }
+
+        sent = true;
+    }
+
+    // Finish the handshake. The server's reply to the early data may already
+    // be on its way.
+    int rc;
+    while ((rc = SSL_do_handshake(c->ssl)) != 1)
+    {
+        if (socket_ssl_wait(c, rc) == false)
+        {
+            return -1;
+        }
+    }
+
+    if (sent == true)
+    {
+        if (SSL_get_early_data_status(c->ssl) == SSL_EARLY_DATA_ACCEPTED)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -42,6 +42,66 @@ typedef bool (*vws_socket_hs)(struct vws_socket* s);
  */
 typedef void (*vws_socket_dh)(struct vws_socket* s);
 
+/**
+ * @brief Callback to wait for a socket to become ready, in place of poll().
+ * This lets the socket run under another event loop, such as a language
+ * runtime's scheduler, which does the waiting and switches to other work
+ * meanwhile.
+ *
+ * @param s The socket
+ * @param events The poll() events to wait for (POLLIN, POLLOUT)
+ * @param timeout The timeout in milliseconds
+ * @param revents Set to the events that occurred
+ * @return As poll(): 1 if ready, 0 on timeout, -1 on error with errno set.
+ *   EINTR is treated as a timeout, anything else as a failure.
+ */
+typedef int (*vws_socket_wait)( struct vws_socket* s,
+                                short events,
+                                int timeout,
+                                short* revents );
+
+/**
+ * @brief TCP options set on a connection when it is established, by
+ * vws_socket_connect() on the client and on accept by the server. They don't
+ * apply to Unix sockets. vws_sockopts_init() sets the defaults.
+ */
+typedef struct vws_sockopts
+{
+    /**< Send small writes immediately (TCP_NODELAY). Default true, so small
+     * requests and replies don't wait out Nagle and the peer's delayed ACK. */
+    bool nodelay;
+
+    /**< Send buffer size in bytes (SO_SNDBUF). Default 0, the system's. */
+    int sndbuf;
+
+    /**< Receive buffer size in bytes (SO_RCVBUF). Default 0, the system's. */
+    int rcvbuf;
+
+    /**< Microseconds to busy poll the device queue on a blocking read
+     * (SO_BUSY_POLL, Linux only). Raising it above net.core.busy_read needs
+     * CAP_NET_ADMIN. Default 0, off. */
+    int busy_poll;
+
+    /**< Seconds idle before TCP keepalive probes are sent (SO_KEEPALIVE,
+     * TCP_KEEPIDLE). Default 0, off. */
+    int keepalive;
+
+    /**< Milliseconds sent data may go unacknowledged before the connection is
+     * dropped (TCP_USER_TIMEOUT, Linux only). Default 0, the system's. */
+    unsigned int user_timeout;
+
+} vws_sockopts;
+
+/**
+ * @brief Directions in which the kernel handles TLS records (see
+ * vws_socket.ktls)
+ */
+typedef enum
+{
+    VWS_KTLS_SEND = (1 << 0), /**< Encrypts what is sent  */
+    VWS_KTLS_RECV = (1 << 1)  /**< Decrypts what is read  */
+} vws_ktls_t;
+
 /**
  * @brief A socket
  */
@@ -71,6 +131,45 @@ typedef struct vws_socket
     /** Flag to force writes to poll() until all data flushed. Default true. */
     bool flush;
 
+    /** Flag to send the first write after a resumed TLS connect as TLS 1.3
+     *  early data (0-RTT), saving a round trip. Early data can be replayed by
+     *  an attacker, so only enable this when the first request is idempotent.
+     *  If the server rejects it, it is sent again after the handshake. Default
+     *  false. */
+    bool early_data;
+
+    /** Set while a resumed connection has skipped the handshake in order to
+     *  send early data with the first write. */
+    bool early_pending;
+
+    /** The TLS session cache key (host:port) for this connection */
+    char* ssl_key;
+
+    /** Minimum free space to make at the end of the receive buffer for each
+     *  read. Data is read straight into the buffer, so this is effectively
+     *  the read size. Default 16 KB, the largest TLS record. */
+    size_t read_chunk;
+
+    /** Optional callback that waits for the socket to become ready, in place
+     *  of poll(). Default NULL. */
+    vws_socket_wait wait;
+
+    /** The io_uring the socket is attached to (uring.h). NULL if not attached,
+     *  which is the default. */
+    struct vws_uring_link* uring;
+
+    /** TCP options set on connect. See vws_sockopts for the defaults. */
+    vws_sockopts opts;
+
+    /** Flag to have the kernel encrypt and decrypt TLS records (kTLS) once
+     *  the handshake is done, where the kernel, OpenSSL build and cipher
+     *  allow it. Otherwise OpenSSL does it as usual. Default true. */
+    bool ktls;
+
+    /** What the kernel took on for the connection (vws_ktls_t flags). Set on
+     *  connect. While it encrypts, writes go straight to send(). */
+    uint8_t ktls_on;
+
 } vws_socket;
 
 /**
@@ -133,6 +232,59 @@ void vws_socket_dtor(vws_socket* s);
  */
 bool vws_socket_connect(vws_socket* s, cstr host, int port, bool ssl);
 
+/**
+ * @brief Connects to a Unix domain socket. Everything after the connect --
+ * timeout, non-blocking mode, the handshake handler -- is as
+ * vws_socket_connect(). There is no TLS over a local socket.
+ *
+ * @param s The socket instance
+ * @param path The socket path. A leading '@' names a socket in the Linux
+ *   abstract namespace (the '@' stands for the leading NUL byte).
+ * @return Returns true if the connection is successful, false otherwise.
+ *
+ * @ingroup SocketFunctions
+ */
+bool vws_socket_connect_unix(vws_socket* s, cstr path);
+
+/**
+ * @brief Connects over a TCP socket that is already connected, such as one
+ * from vws_dial_take(). Everything after the connect -- TLS, timeout,
+ * non-blocking mode, the handshake handler -- is as vws_socket_connect().
+ *
+ * @param s The socket instance
+ * @param fd The connected descriptor. The socket takes ownership of it, and
+ *   it is closed on failure.
+ * @param host The host it is connected to (for TLS)
+ * @param port The port it is connected to (for TLS)
+ * @param ssl Flag to enable/disable SSL
+ * @return Returns true if the connection is successful, false otherwise.
+ *
+ * @ingroup SocketFunctions
+ */
+bool vws_socket_connect_fd(vws_socket* s, int fd, cstr host, int port, bool ssl);
+
+/**
+ * @brief Creates the global SSL context (vws_ssl_ctx) if it does not exist
+ * yet. The context keeps the most recent TLS session for each host:port that
+ * client sockets connect to, and offers it on the next connect (for example
+ * from vws_reconnect()) so it can be resumed rather than doing a full
+ * handshake.
+ *
+ * @return Returns true if the context exists, false if it could not be
+ *   created.
+ *
+ * @ingroup SocketFunctions
+ */
+bool vws_socket_ssl_init();
+
+/**
+ * @brief Drops all TLS sessions cached for resumption. The next connect to
+ * every host does a full handshake.
+ *
+ * @ingroup SocketFunctions
+ */
+void vws_socket_ssl_clear_sessions();
+
 /**
  * @brief Sets a timeout on a socket read/write operations. The default
  *        timeout is 10 seconds.
@@ -155,6 +307,39 @@ bool vws_socket_set_timeout(vws_socket* s, int sec);
  */
 bool vws_socket_set_nonblocking(int sockfd);
 
+/**
+ * @brief Turns Nagle's algorithm off (TCP_NODELAY) or back on for a socket.
+ *
+ * @param s The socket.
+ * @param on True to send small writes immediately, false to let TCP delay
+ *   them to coalesce.
+ * @return True if successful, false otherwise.
+ *
+ * @ingroup SocketFunctions
+ */
+bool vws_socket_set_nodelay(vws_socket* s, bool on);
+
+/**
+ * @brief Sets socket options to their defaults.
+ *
+ * @param o The options.
+ *
+ * @ingroup SocketFunctions
+ */
+void vws_sockopts_init(vws_sockopts* o);
+
+/**
+ * @brief Sets options on a TCP socket. Those the platform lacks are skipped.
+ * A failure doesn't stop the rest from being set.
+ *
+ * @param fd The socket descriptor.
+ * @param o The options.
+ * @return True if all were set, false otherwise (vws.e has the last error).
+ *
+ * @ingroup SocketFunctions
+ */
+bool vws_sockopts_apply(int fd, const vws_sockopts* o);
+
 /**
  * @brief Closes the connection to the host.
  *
@@ -195,6 +380,23 @@ void vws_socket_close(vws_socket* c);
  */
 ssize_t vws_socket_read(vws_socket* s);
 
+/**
+ * @brief Reads whatever data the socket has into its buffer without waiting.
+ * This is for callers that already know the socket is readable, such as an
+ * event loop. Over TLS, it drains everything OpenSSL has decrypted or
+ * buffered.
+ *
+ * @param s The socket.
+ * @param want_write Optional. Set to true if TLS must write to the socket
+ *   before it can read any more (renegotiation). Wait for the socket to become
+ *   writable, not readable, before calling again.
+ * @return The number of bytes read, 0 if nothing was available yet, or -1 if
+ *   the connection failed (it has been closed).
+ *
+ * @ingroup SocketFunctions
+ */
+ssize_t vws_socket_read_ready(vws_socket* s, bool* want_write);
+
 /**
  * @brief Writes data from a buffer to a socket
  *
@@ -207,6 +409,146 @@ ssize_t vws_socket_read(vws_socket* s);
  */
 ssize_t vws_socket_write(vws_socket* s, ucstr data, size_t size);
 
+/**
+ * @brief Writes as much of a buffer as the socket takes without waiting. This
+ * is the write counterpart of vws_socket_read_ready(), for callers that keep
+ * their own output queue. Over TLS, a write that would block must be retried
+ * with the same data at its start, although the data may have moved.
+ *
+ * @param s The socket.
+ * @param data The data to write.
+ * @param size The size of the data.
+ * @param want_read Optional. Set to true if TLS must read from the socket
+ *   before it can write any more (renegotiation). Wait for the socket to
+ *   become readable, not writable, before calling again.
+ * @return The number of bytes written, 0 if the socket would block, or -1 if
+ *   the connection failed (it has been closed).
+ *
+ * @ingroup SocketFunctions
+ */
+ssize_t vws_socket_write_ready( vws_socket* s,
+                                ucstr data,
+                                size_t size,
+                                bool* want_read );
+
+//------------------------------------------------------------------------------
+// Dialing
+//------------------------------------------------------------------------------
+
+/**
+ * @defgroup DialFunctions
+ *
+ * @brief Non-blocking TCP connect
+ *
+ * A dial connects to a host without blocking, so an event loop can drive
+ * many at once alongside its connections. vws_socket_connect() drives one to
+ * completion itself.
+ *
+ * Addresses come from a process-wide cache keyed by host:port, so a
+ * reconnect does not wait on DNS. getaddrinfo() does not give the record's
+ * TTL, so entries are kept for VWS_DNS_TTL seconds.
+ *
+ * The addresses are tried as RFC 8305 (Happy Eyeballs) describes: they are
+ * interleaved by family, starting with the family the resolver prefers. One
+ * attempt is started every VWS_DIAL_DELAY milliseconds, or straight away when
+ * the one before fails, and earlier attempts carry on meanwhile. The first to
+ * connect wins and the rest are closed. A dead IPv6 route therefore costs the
+ * delay rather than a TCP timeout.
+ */
+
+/** Seconds a resolved host stays in the cache */
+#define VWS_DNS_TTL 60
+
+/** Milliseconds to wait on an attempt before starting the next alongside it
+ *  (the Connection Attempt Delay of RFC 8305) */
+#define VWS_DIAL_DELAY 250
+
+struct vws_dial;
+
+/**
+ * @brief A connection in progress. Opaque.
+ */
+typedef struct vws_dial vws_dial;
+
+/**
+ * @brief Resolves a host (from the cache if it can) and starts connecting to
+ * it.
+ *
+ * @param host The host to connect to
+ * @param port The port to connect to
+ * @return The dial, or NULL if the host could not be resolved or no attempt
+ *   could be started (vws.e has the details).
+ *
+ * @ingroup DialFunctions
+ */
+vws_dial* vws_dial_new(cstr host, int port);
+
+/**
+ * @brief Frees a dial, closing any attempts still in progress and the
+ * connected socket if it was not taken.
+ *
+ * @param d The dial.
+ *
+ * @ingroup DialFunctions
+ */
+void vws_dial_free(vws_dial* d);
+
+/**
+ * @brief Checks the attempts in progress without waiting and starts the next
+ * one if it is due. Call it when one of vws_dial_fds() becomes writable, or
+ * vws_dial_timeout() has passed.
+ *
+ * @param d The dial.
+ * @return 1 when connected, 0 while still in progress, -1 if every address
+ *   failed (vws.e has the details).
+ *
+ * @ingroup DialFunctions
+ */
+int vws_dial_step(vws_dial* d);
+
+/**
+ * @brief Returns the descriptors of the attempts in progress. Wait for any of
+ * them to become writable (POLLOUT). They change as attempts start and fail,
+ * so fetch them again after each vws_dial_step().
+ *
+ * @param d The dial.
+ * @param fds Set to the descriptors.
+ * @param n The room in fds.
+ * @return The number of descriptors stored.
+ *
+ * @ingroup DialFunctions
+ */
+size_t vws_dial_fds(vws_dial* d, int* fds, size_t n);
+
+/**
+ * @brief Returns how long until the next attempt is due.
+ *
+ * @param d The dial.
+ * @return Milliseconds, or -1 if every address has been tried.
+ *
+ * @ingroup DialFunctions
+ */
+int vws_dial_timeout(vws_dial* d);
+
+/**
+ * @brief Takes the connected socket from a dial, for vws_socket_connect_fd().
+ * It is back in blocking mode.
+ *
+ * @param d The dial.
+ * @return The descriptor, or -1 if the dial has not connected.
+ *
+ * @ingroup DialFunctions
+ */
+int vws_dial_take(vws_dial* d);
+
+/**
+ * @brief Drops all cached addresses. The next connect to every host resolves
+ * it again.
+ *
+ * @ingroup DialFunctions
+ */
+void vws_dns_clear();
+
 #ifdef __cplusplus
 }
 #endif
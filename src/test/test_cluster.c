@@ -0,0 +1,200 @@
+#include "server.h"
+#include "message.h"
+#include "cluster.h"
+
+#define CTEST_MAIN
+#include "ctest.h"
+#include "common.h"
+
+cstr server_host = "127.0.0.1";
+cstr content     = "Lorem ipsum dolor sit amet";
+
+cstr urls[] = { "ws://localhost:8181/websocket",
+                "ws://localhost:8182/websocket" };
+
+// One node per server, found by the server
+vrtql_cluster* nodes[2];
+
+// Subscribes the connection to the topic named by its "subscribe" routing
+// key, and replies once done. Runs in a worker.
+void process_message(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+    cstr topic            = vrtql_msg_get_routing(m, "subscribe");
+
+    if (topic != NULL)
+    {
+        vrtql_cluster_subscribe(server->cluster, cnx, topic);
+    }
+
+    vrtql_msg* reply = vrtql_msg_new();
+    reply->format    = cnx->format;
+    vrtql_msg_set_content(reply, "ok");
+
+    server->send(cnx, reply);
+    vrtql_msg_free(m);
+}
+
+void node_thread(void* arg)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)arg;
+    int port              = (server->cluster == nodes[0]) ? 8181 : 8182;
+
+    vws_tcp_svr_run((vws_tcp_svr*)server, server_host, port);
+}
+
+vrtql_msg_svr* node_start(size_t self, uv_thread_t* tid)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+
+    nodes[self]        = vrtql_cluster_new(server, urls, 2, self);
+    nodes[self]->retry = 100;
+
+    uv_thread_create(tid, node_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    return server;
+}
+
+void node_stop(size_t self, vrtql_msg_svr* server, uv_thread_t* tid)
+{
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(tid);
+    vrtql_cluster_free(nodes[self]);
+    vrtql_msg_svr_free(server);
+}
+
+// Connects a client to a node and subscribes it to a topic
+vws_cnx* client_join(size_t node, cstr topic)
+{
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, urls[node]));
+
+    vrtql_msg* request = vrtql_msg_new();
+    vrtql_msg_set_routing(request, "subscribe", topic);
+    ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+    vrtql_msg_free(request);
+
+    vrtql_msg* reply = vrtql_msg_recv(cnx);
+    ASSERT_NOT_NULL(reply);
+    vrtql_msg_free(reply);
+
+    return cnx;
+}
+
+// Waits until a node knows of the nodes a topic has subscribers on
+void wait_nodes(vrtql_cluster* c, cstr topic, size_t n)
+{
+    for (int i = 0; i < 100 && vrtql_cluster_nodes(c, topic) != n; i++)
+    {
+        vws_msleep(50);
+    }
+
+    ASSERT_EQUAL(n, vrtql_cluster_nodes(c, topic));
+}
+
+void send_to(vws_cnx* cnx, cstr topic)
+{
+    vrtql_msg* m = vrtql_msg_new();
+    vrtql_msg_set_routing(m, "to", topic);
+    vrtql_msg_set_content(m, content);
+    ASSERT_TRUE(vrtql_msg_send(cnx, m) > 0);
+    vrtql_msg_free(m);
+}
+
+void recv_from(vws_cnx* cnx, cstr topic)
+{
+    vrtql_msg* m = vrtql_msg_recv(cnx);
+    ASSERT_NOT_NULL(m);
+    ASSERT_STR(topic, vrtql_msg_get_routing(m, "to"));
+    ASSERT_NULL(vrtql_msg_get_routing(m, "cluster"));
+    ASSERT_EQUAL(strlen(content), m->content->size);
+    ASSERT_TRUE(memcmp(m->content->data, content, strlen(content)) == 0);
+    vrtql_msg_free(m);
+}
+
+CTEST(test_cluster, route)
+{
+    uv_thread_t tids[2];
+    vrtql_msg_svr* servers[2];
+
+    servers[0] = node_start(0, &tids[0]);
+    servers[1] = node_start(1, &tids[1]);
+
+    for (int i = 0; i < 100 && vrtql_cluster_up(nodes[0]) < 1; i++)
+    {
+        vws_msleep(50);
+    }
+
+    ASSERT_EQUAL(1, vrtql_cluster_up(nodes[0]));
+
+    // One client on each node, and two more on the first sharing a topic
+    vws_cnx* a  = client_join(0, "a");
+    vws_cnx* b  = client_join(1, "b");
+    vws_cnx* c1 = client_join(0, "c");
+    vws_cnx* c2 = client_join(1, "c");
+
+    wait_nodes(nodes[0], "b", 1);
+    wait_nodes(nodes[1], "a", 1);
+    wait_nodes(nodes[0], "c", 2);
+    wait_nodes(nodes[1], "c", 2);
+
+    // Across nodes, both ways
+    send_to(a, "b");
+    recv_from(b, "b");
+
+    send_to(b, "a");
+    recv_from(a, "a");
+
+    // To subscribers on both nodes
+    send_to(a, "c");
+    recv_from(c1, "c");
+    recv_from(c2, "c");
+
+    // Unrouted messages still reach the server's own callback
+    vrtql_msg* m = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_send(a, m) > 0);
+    vrtql_msg_free(m);
+
+    m = vrtql_msg_recv(a);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(2, m->content->size);
+    vrtql_msg_free(m);
+
+    // A closed connection's topics are dropped across the cluster
+    vws_disconnect(b);
+    vws_cnx_free(b);
+    wait_nodes(nodes[0], "b", 0);
+
+    // A node that restarts gets the other's topics again
+    node_stop(1, servers[1], &tids[1]);
+    vws_cnx_free(c2);
+
+    servers[1] = node_start(1, &tids[1]);
+
+    wait_nodes(nodes[1], "a", 1);
+    wait_nodes(nodes[0], "c", 1);
+
+    vws_cnx* d = client_join(1, "d");
+    wait_nodes(nodes[0], "d", 1);
+
+    send_to(a, "d");
+    recv_from(d, "d");
+
+    vws_cnx_free(d);
+    vws_cnx_free(c1);
+    vws_cnx_free(a);
+
+    node_stop(1, servers[1], &tids[1]);
+    node_stop(0, servers[0], &tids[0]);
+}
+
+int main(int argc, const char* argv[])
+{
+    return ctest_main(argc, argv);
+}
@@ -1,9 +1,14 @@
+#include <pthread.h>
+
 #include "common.h"
 
 #define CTEST_MAIN
 #include "ctest.h"
 
+#include <openssl/sha.h>
+
 #include "vws.h"
+#include "server.h"
 #include "url.h"
 #include "util/sc_map.h"
 #include "util/sc_queue.h"
@@ -76,8 +81,88 @@ CTEST2(test, base64)
     printf("Base64 Encoded: %s\n", encoded);
     printf("Base64 Decoded: %s\n", decoded);
 
-    free(encoded);
-    free(decoded);
+    ASSERT_STR("SGVsbG8sIFdvcmxkIQ==", encoded);
+    ASSERT_EQUAL(original_length, output_length);
+    ASSERT_STR((cstr)original_data, (cstr)decoded);
+
+    vws.free(encoded);
+    vws.free(decoded);
+
+    // RFC 4648 test vectors
+    cstr plain[]   = { "", "f", "fo", "foo", "foob", "fooba", "foobar" };
+    cstr encoding[] = { "", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=",
+                        "Zm9vYmFy" };
+
+    for (int i = 0; i < 7; i++)
+    {
+        char text[16];
+        size_t n = vws_base64_encode_into((ucstr)plain[i], strlen(plain[i]), text);
+        ASSERT_EQUAL(strlen(encoding[i]), n);
+        ASSERT_STR(encoding[i], text);
+
+        unsigned char bytes[16];
+        ASSERT_TRUE(vws_base64_decode_into(encoding[i], n, bytes, &n));
+        ASSERT_EQUAL(strlen(plain[i]), n);
+        ASSERT_TRUE(memcmp(plain[i], bytes, n) == 0);
+    }
+
+    // All byte values, unpadded
+    unsigned char all[256];
+    char text[VWS_BASE64_SIZE(256)];
+    unsigned char bytes[256];
+    size_t n;
+
+    for (int i = 0; i < 256; i++)
+    {
+        all[i] = i;
+    }
+
+    vws_base64_encode_into(all, 256, text);
+    ASSERT_TRUE(vws_base64_decode_into(text, strlen(text) - 2, bytes, &n));
+    ASSERT_EQUAL(256, n);
+    ASSERT_TRUE(memcmp(all, bytes, 256) == 0);
+
+    // Invalid
+    ASSERT_FALSE(vws_base64_decode_into("Zm9v!A==", 8, bytes, &n));
+    ASSERT_FALSE(vws_base64_decode_into("Zm9vY", 5, bytes, &n));
+    ASSERT_NULL(vws_base64_decode("Zm 9v", &n));
+}
+
+CTEST(test, sha1)
+{
+    cstr input[]  = { "", "abc",
+                      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq" };
+    cstr digest[] = { "2jmj7l5rSw0yVb/vlWAYkK/YBwk=",
+                      "qZk+NkcGgWq6PiVxeFDCbJzQ2J0=",
+                      "hJg+RBw70m66rkqh+VEp5eVGcPE=" };
+
+    for (int i = 0; i < 3; i++)
+    {
+        unsigned char hash[20];
+        char text[VWS_BASE64_SIZE(20)];
+
+        vws_sha1((ucstr)input[i], strlen(input[i]), hash);
+        vws_base64_encode_into(hash, sizeof(hash), text);
+        ASSERT_STR(digest[i], text);
+    }
+
+    // Lengths around the block and padding boundaries, against OpenSSL
+    unsigned char data[200];
+
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (unsigned char)(i * 31 + 7);
+    }
+
+    for (size_t n = 0; n <= sizeof(data); n++)
+    {
+        unsigned char ours[20];
+        unsigned char theirs[20];
+
+        vws_sha1(data, n, ours);
+        SHA1(data, n, theirs);
+        ASSERT_TRUE(memcmp(ours, theirs, 20) == 0);
+    }
 }
 
 CTEST2(test, buffer)
@@ -102,6 +187,141 @@ CTEST2(test, buffer)
     vws_buffer_free(buffer);
 }
 
+CTEST2(test, buffer_consume)
+{
+    vws_buffer* buffer = vws_buffer_new();
+
+    cstr digits = "0123456789";
+    vws_buffer_append(buffer, (ucstr)digits, 10);
+
+    // Consume moves the cursor, the memory stays put
+    unsigned char* start = buffer->data;
+    vws_buffer_consume(buffer, 4);
+    ASSERT_EQUAL(6, buffer->size);
+    ASSERT_TRUE(buffer->data == start + 4);
+    ASSERT_TRUE(memcmp(buffer->data, "456789", 6) == 0);
+
+    // An append that doesn't fit reclaims the consumed space
+    vws_buffer_append(buffer, (ucstr)digits, 10);
+    ASSERT_EQUAL(16, buffer->size);
+    ASSERT_EQUAL(0, buffer->head);
+    ASSERT_TRUE(memcmp(buffer->data, "4567890123456789", 16) == 0);
+
+    // Consuming everything rewinds and keeps the allocation
+    size_t allocated = buffer->allocated;
+    vws_buffer_consume(buffer, 3);
+    vws_buffer_consume(buffer, 13);
+    ASSERT_EQUAL(0, buffer->size);
+    ASSERT_EQUAL(allocated, buffer->allocated);
+    ASSERT_NOT_NULL(buffer->data);
+
+    vws_buffer_consume(buffer, 2);
+    vws_buffer_free(buffer);
+}
+
+CTEST2(test, pool)
+{
+    // The pools are shared with the rest of the library, so objects must be
+    // the size it expects
+    size_t frame = sizeof(vws_frame);
+    size_t cnx   = sizeof(vws_svr_cnx);
+
+    // A returned object is handed out again
+    void* a = vws_pool_get(VP_FRAME, frame);
+    vws_pool_put(VP_FRAME, a);
+    void* b = vws_pool_get(VP_FRAME, frame);
+    ASSERT_TRUE(a == b);
+    vws_pool_put(VP_FRAME, b);
+
+    // Returning more than the thread caches spills to the depot, and the
+    // objects come back from there
+    void* objects[1000];
+
+    for (int i = 0; i < 1000; i++)
+    {
+        objects[i] = vws_pool_get(VP_FRAME, frame);
+        memset(objects[i], i & 0xFF, frame);
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        vws_pool_put(VP_FRAME, objects[i]);
+    }
+
+    vws_pool_flush();
+
+    for (int i = 0; i < 1000; i++)
+    {
+        objects[i] = vws_pool_get(VP_FRAME, frame);
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        vws_pool_put(VP_FRAME, objects[i]);
+    }
+
+    vws_pool_put(VP_FRAME, NULL);
+
+    // Reserved objects are handed out like returned ones
+    vws_pool_reserve(VP_SVR_CNX, cnx, 10);
+
+    for (int i = 0; i < 10; i++)
+    {
+        objects[i] = vws_pool_get(VP_SVR_CNX, cnx);
+        memset(objects[i], 0, cnx);
+    }
+
+    for (int i = 0; i < 10; i++)
+    {
+        vws_pool_put(VP_SVR_CNX, objects[i]);
+    }
+
+    // Everything goes back to the allocator
+    vws_pool_shutdown();
+}
+
+CTEST(test, arena)
+{
+    vws_arena* arena = vws_arena_new(64);
+
+    // Allocations are aligned and come from the arena
+    char* a = vws_arena_alloc(arena, 3);
+    char* b = vws_arena_alloc(arena, 5);
+    ASSERT_TRUE(((uintptr_t)a & 15) == 0);
+    ASSERT_TRUE(((uintptr_t)b & 15) == 0);
+    ASSERT_TRUE(vws_arena_owns(arena, a));
+    ASSERT_TRUE(vws_arena_owns(arena, b));
+    ASSERT_FALSE(vws_arena_owns(arena, &arena));
+
+    // The last allocation grows in place, others are copied
+    memcpy(b, "abcd", 5);
+    ASSERT_TRUE(vws_arena_realloc(arena, b, 5, 20) == b);
+    char* c = vws_arena_realloc(arena, a, 3, 8);
+    ASSERT_TRUE(c != a);
+
+    // Overflowing the first block adds more
+    for (int i = 0; i < 100; i++)
+    {
+        memset(vws_arena_alloc(arena, 100), i, 100);
+    }
+
+    ASSERT_TRUE(arena->blocks->next != NULL);
+
+    // After a reset a single block holds the same work
+    vws_arena_reset(arena);
+    ASSERT_TRUE(arena->blocks->next == NULL);
+
+    for (int i = 0; i < 100; i++)
+    {
+        vws_arena_alloc(arena, 100);
+    }
+
+    ASSERT_TRUE(arena->blocks->next == NULL);
+
+    vws_arena_free(arena);
+    vws_arena_free(NULL);
+}
+
 CTEST2(test, queue)
 {
     const void* elem;
@@ -136,6 +356,134 @@ CTEST(test, trace)
     vws.trace(VL_ERROR,   "vws.trace(%s)",   "ERROR");
 }
 
+static void trace_dump_bytes(const unsigned char* data, size_t size)
+{
+    printf("%zu bytes\n", size);
+}
+
+static void trace_dump_slow(const unsigned char* data, size_t size)
+{
+    // Hold the writer up so the buffer fills
+    vws_msleep(20);
+    printf("%zu bytes\n", size);
+}
+
+CTEST(test, trace_async)
+{
+    // The thread's buffer keeps the size it is first created with, the
+    // smallest there is
+    ASSERT_TRUE(vws_trace_async_start(1));
+    ASSERT_TRUE(vws_trace_async());
+    ASSERT_FALSE(vws_trace_async_start(0));
+
+    vws.trace(VL_INFO, "vws.trace(%s)", "async");
+
+    unsigned char data[] = { 1, 2, 3 };
+    vws_trace_dump("Async Dump", trace_dump_bytes, data, sizeof(data));
+
+    vws_trace_async_stop();
+    ASSERT_FALSE(vws_trace_async());
+    ASSERT_EQUAL(0, vws_trace_dropped());
+
+    // A full buffer drops records rather than making the caller wait
+    ASSERT_TRUE(vws_trace_async_start(0));
+
+    unsigned char block[VWS_TRACE_DUMP_MAX];
+    memset(block, 0, sizeof(block));
+
+    for (int i = 0; i < 10; i++)
+    {
+        vws_trace_dump("Slow Dump", trace_dump_slow, block, sizeof(block));
+    }
+
+    vws_trace_async_stop();
+    ASSERT_TRUE(vws_trace_dropped() > 0);
+}
+
+// Totals of the sites seen by vws_alloc_track_sites()
+typedef struct
+{
+    unsigned long thread;
+    uint64_t most;
+    uint64_t bytes;
+    uint64_t frees;
+    int threads;
+} alloc_totals;
+
+static void alloc_site_sum(const vws_alloc_stats* stats, void* data)
+{
+    alloc_totals* t = (alloc_totals*)data;
+
+    if (stats->thread != t->thread)
+    {
+        t->threads++;
+        return;
+    }
+
+    if (stats->count > t->most)
+    {
+        t->most  = stats->count;
+        t->bytes = stats->bytes;
+    }
+
+    t->frees = stats->frees;
+}
+
+static void* alloc_thread(void* arg)
+{
+    vws.free(vws.malloc(16));
+    return NULL;
+}
+
+CTEST(test, alloc_track)
+{
+    ASSERT_FALSE(vws_alloc_tracking());
+    vws_alloc_track_start();
+    ASSERT_TRUE(vws_alloc_tracking());
+
+    // One site, many times
+    void* blocks[100];
+
+    for (int i = 0; i < 100; i++)
+    {
+        blocks[i] = vws.malloc(32);
+    }
+
+    for (int i = 0; i < 100; i++)
+    {
+        vws.free(blocks[i]);
+    }
+
+    // Another thread gets its own counts
+    pthread_t tid;
+    pthread_create(&tid, NULL, alloc_thread, NULL);
+    pthread_join(tid, NULL);
+
+    vws_alloc_track_stop();
+    ASSERT_FALSE(vws_alloc_tracking());
+
+    // Not counted
+    vws.free(vws.malloc(32));
+
+    alloc_totals t = { (unsigned long)pthread_self(), 0, 0, 0, 0 };
+    vws_alloc_track_sites(alloc_site_sum, &t);
+    ASSERT_EQUAL(100, t.most);
+    ASSERT_EQUAL(3200, t.bytes);
+    ASSERT_EQUAL(100, t.frees);
+    ASSERT_EQUAL(1, t.threads);
+
+    vws_alloc_track_report(stdout, 5);
+
+    // A new start clears the counts
+    vws_alloc_track_start();
+    vws_alloc_track_stop();
+
+    alloc_totals u = { (unsigned long)pthread_self(), 0, 0, 0, 0 };
+    vws_alloc_track_sites(alloc_site_sum, &u);
+    ASSERT_EQUAL(0, u.most);
+    ASSERT_EQUAL(0, u.threads);
+}
+
 CTEST(test, error)
 {
     printf("\n");
@@ -144,6 +492,34 @@ CTEST(test, error)
     vws.error(VE_RT, "Handshake invalid");
 }
 
+CTEST(test, error_text)
+{
+    vws.error(VE_TIMEOUT, "poll()");
+    ASSERT_EQUAL(VE_TIMEOUT, vws.e.code);
+    ASSERT_STR("poll()", vws.e.text);
+
+    vws.error(VE_RT, "Error: %s (%i)", "bad", 42);
+    ASSERT_STR("Error: bad (42)", vws.e.text);
+
+    // The last error text can be an argument
+    vws.error(VE_RT, "again: %s", vws.e.text);
+    ASSERT_STR("again: Error: bad (42)", vws.e.text);
+
+    // Long messages are truncated
+    char text[VWS_ERROR_TEXT_SIZE * 2];
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    vws.error(VE_WARN, text);
+    ASSERT_EQUAL(VWS_ERROR_TEXT_SIZE - 1, strlen(vws.e.text));
+
+    vws_set_error_static(VE_WARN, "static");
+    ASSERT_STR("static", vws.e.text);
+
+    vws.success();
+    ASSERT_EQUAL(VE_SUCCESS, vws.e.code);
+    ASSERT_NULL(vws.e.text);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
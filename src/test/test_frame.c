@@ -0,0 +1,799 @@
+#include "common.h"
+
+#define CTEST_MAIN
+#include "ctest.h"
+
+#include "websocket.h"
+
+//------------------------------------------------------------------------------
+// Masking
+//------------------------------------------------------------------------------
+
+// Reference implementation to check vws_mask() against
+static void naive_mask(unsigned char* dst, ucstr src, size_t n, ucstr key, size_t pos)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = src[i] ^ key[(pos + i) % 4];
+    }
+}
+
+CTEST(test_frame, mask)
+{
+    unsigned char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+    size_t n             = 1031;
+
+    unsigned char* src      = malloc(n);
+    unsigned char* expected = malloc(n);
+    unsigned char* actual   = malloc(n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        src[i] = (unsigned char)(i * 31 + 7);
+    }
+
+    // Cover every kernel boundary and every key alignment
+    for (size_t size = 0; size < n; size += 13)
+    {
+        for (size_t pos = 0; pos < 4; pos++)
+        {
+            naive_mask(expected, src, size, key, pos);
+            vws_mask(actual, src, size, key, pos);
+            ASSERT_TRUE(memcmp(expected, actual, size) == 0);
+        }
+    }
+
+    // In place, then unmask back to the original
+    memcpy(actual, src, n);
+    vws_mask(actual, actual, n, key, 0);
+    naive_mask(expected, src, n, key, 0);
+    ASSERT_TRUE(memcmp(expected, actual, n) == 0);
+
+    vws_mask(actual, actual, n, key, 0);
+    ASSERT_TRUE(memcmp(src, actual, n) == 0);
+
+    // Piecewise masking must match a single pass
+    vws_mask(actual, src, 5, key, 0);
+    vws_mask(actual + 5, src + 5, n - 5, key, 5);
+    ASSERT_TRUE(memcmp(expected, actual, n) == 0);
+
+    free(src);
+    free(expected);
+    free(actual);
+}
+
+CTEST(test_frame, mask_key)
+{
+    // Enough keys to go through several refills of the pool
+    unsigned char keys[1000][4];
+    size_t zero = 0;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        ASSERT_TRUE(vws_mask_key(keys[i]));
+
+        uint32_t k;
+        memcpy(&k, keys[i], 4);
+        zero += (k == 0);
+    }
+
+    // Random keys: no run of repeats, hardly any zero keys
+    size_t repeats = 0;
+    for (int i = 1; i < 1000; i++)
+    {
+        repeats += (memcmp(keys[i], keys[i - 1], 4) == 0);
+    }
+
+    ASSERT_TRUE(repeats < 2);
+    ASSERT_TRUE(zero < 2);
+}
+
+//------------------------------------------------------------------------------
+// UTF-8
+//------------------------------------------------------------------------------
+
+// Reference implementation to check vws_utf8_validate() against. Decodes each
+// character and checks the code point.
+static bool naive_utf8(ucstr s, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n)
+    {
+        unsigned char b = s[i];
+        size_t length;
+        uint32_t cp;
+
+        if (b < 0x80)      { length = 1; cp = b;        }
+        else if (b < 0xC0) { return false;              }
+        else if (b < 0xE0) { length = 2; cp = b & 0x1F; }
+        else if (b < 0xF0) { length = 3; cp = b & 0x0F; }
+        else if (b < 0xF8) { length = 4; cp = b & 0x07; }
+        else               { return false;              }
+
+        if (i + length > n)
+        {
+            return false;
+        }
+
+        for (size_t j = 1; j < length; j++)
+        {
+            if ((s[i + j] & 0xC0) != 0x80)
+            {
+                return false;
+            }
+
+            cp = (cp << 6) | (s[i + j] & 0x3F);
+        }
+
+        uint32_t min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+        if (cp < min[length] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        {
+            return false;
+        }
+
+        i += length;
+    }
+
+    return true;
+}
+
+// Appends a random code point, or now and then a random byte
+static size_t random_utf8(unsigned char* s)
+{
+    uint32_t cp;
+
+    switch (rand() % 8)
+    {
+        case 0:  s[0] = rand() & 0xFF; return 1;
+        case 1:  cp   = 0x80 + rand() % 0x780;     break;
+        case 2:  cp   = 0x800 + rand() % 0xF800;   break;
+        case 3:  cp   = 0x10000 + rand() % 0x100000; break;
+        default: s[0] = rand() & 0x7F; return 1;
+    }
+
+    if (cp < 0x800)
+    {
+        s[0] = 0xC0 | (cp >> 6);
+        s[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+
+    if (cp < 0x10000)
+    {
+        s[0] = 0xE0 | (cp >> 12);
+        s[1] = 0x80 | ((cp >> 6) & 0x3F);
+        s[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+
+    s[0] = 0xF0 | (cp >> 18);
+    s[1] = 0x80 | ((cp >> 12) & 0x3F);
+    s[2] = 0x80 | ((cp >> 6) & 0x3F);
+    s[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+CTEST(test_frame, utf8)
+{
+    cstr valid[] = { "", "hello", "\xC2\x80", "\xDF\xBF", "\xE0\xA0\x80",
+                     "\xED\x9F\xBF", "\xEE\x80\x80", "\xF0\x90\x80\x80",
+                     "\xF4\x8F\xBF\xBF", "caf\xC3\xA9 \xE2\x82\xAC" };
+
+    cstr invalid[] = { "\x80", "\xC0\x80", "\xC1\xBF", "\xC2", "\xC2\x41",
+                       "\xE0\x80\x80", "\xE0\x9F\xBF", "\xED\xA0\x80",
+                       "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF",
+                       "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xFF",
+                       "\xE2\x82" };
+
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++)
+    {
+        size_t n = strlen(valid[i]);
+        ASSERT_EQUAL(VWS_UTF8_ACCEPT, vws_utf8_validate(0, (ucstr)valid[i], n));
+    }
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        size_t n = strlen(invalid[i]);
+        ASSERT_NOT_EQUAL(VWS_UTF8_ACCEPT, vws_utf8_validate(0, (ucstr)invalid[i], n));
+    }
+
+    // Random text of all sizes, checked whole and in two pieces split
+    // anywhere. Even rounds build valid text and may flip one bit in it.
+    unsigned char s[300];
+    srand(1);
+
+    for (int round = 0; round < 20000; round++)
+    {
+        size_t n     = 0;
+        size_t limit = rand() % (sizeof(s) - 4);
+
+        while (n < limit)
+        {
+            size_t before = n;
+            n += random_utf8(s + n);
+
+            if (round % 2 == 0 && naive_utf8(s + before, n - before) == false)
+            {
+                n = before;
+            }
+        }
+
+        if (round % 4 == 0 && n > 0)
+        {
+            s[rand() % n] ^= 1 << (rand() % 8);
+        }
+
+        bool expected  = naive_utf8(s, n);
+        uint32_t whole = vws_utf8_validate(VWS_UTF8_ACCEPT, s, n);
+        ASSERT_EQUAL(expected, whole == VWS_UTF8_ACCEPT);
+
+        size_t split   = (n > 0) ? rand() % (n + 1) : 0;
+        uint32_t state = vws_utf8_validate(VWS_UTF8_ACCEPT, s, split);
+        state          = vws_utf8_validate(state, s + split, n - split);
+        ASSERT_EQUAL(expected, state == VWS_UTF8_ACCEPT);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Frame codec
+//------------------------------------------------------------------------------
+
+CTEST(test_frame, roundtrip)
+{
+    // Sizes span the 7-bit, 16-bit and 64-bit length encodings
+    size_t sizes[] = { 0, 1, 125, 126, 1000, 65535, 65536, 100000 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t n = sizes[s];
+
+        unsigned char* payload = malloc(n + 1);
+        for (size_t i = 0; i < n; i++)
+        {
+            payload[i] = (unsigned char)(i ^ (i >> 8));
+        }
+
+        vws_frame* f = vws_frame_new(payload, n, BINARY_FRAME);
+        vws_buffer* buffer = vws_serialize(f);
+        ASSERT_NOT_NULL(buffer);
+
+        vws_frame* out  = vws_frame_new(NULL, 0, BINARY_FRAME);
+        size_t consumed = 0;
+        fs_t rc = vws_deserialize(buffer->data, buffer->size, out, &consumed);
+
+        ASSERT_TRUE(rc == FRAME_COMPLETE);
+        ASSERT_EQUAL(buffer->size, consumed);
+        ASSERT_EQUAL(n, out->size);
+        ASSERT_EQUAL(1, out->mask);
+
+        if (n > 0)
+        {
+            ASSERT_TRUE(memcmp(payload, out->data, n) == 0);
+        }
+
+        vws_frame_free(out);
+        vws_buffer_free(buffer);
+        free(payload);
+    }
+}
+
+CTEST(test_frame, oversized)
+{
+    // A masked BINARY frame header with a 64-bit length, its key and a few
+    // bytes of payload
+    unsigned char data[20] = { 0x82, 0xFF };
+    memset(data + 10, 0x5A, sizeof(data) - 10);
+
+    // Top bit set, and close enough to 2^64 that offset + size would wrap.
+    // Then one byte over the limit, with the top bit clear.
+    uint64_t lengths[] = { 0xFFFFFFFFFFFFFFF8ULL, VWS_FRAME_MAX + 1 };
+
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            data[2 + i] = (unsigned char)(lengths[l] >> (56 - 8 * i));
+        }
+
+        vws_frame* f    = vws_frame_new(NULL, 0, BINARY_FRAME);
+        size_t consumed = 0;
+        fs_t rc = vws_deserialize(data, sizeof(data), f, &consumed);
+
+        ASSERT_TRUE(rc == FRAME_ERROR);
+        ASSERT_EQUAL(0, consumed);
+        vws_frame_free(f);
+
+        f  = vws_frame_new(NULL, 0, BINARY_FRAME);
+        rc = vws_deserialize_borrow(data, sizeof(data), f, &consumed);
+
+        ASSERT_TRUE(rc == FRAME_ERROR);
+        ASSERT_EQUAL(0, consumed);
+        vws_frame_free(f);
+
+        // On a connection parsing in place, as the server does
+        vws_cnx* c = vws_cnx_new();
+        vws_cnx_set_zero_copy(c);
+        vws_buffer_append(c->base.buffer, data, sizeof(data));
+
+        ASSERT_EQUAL(0, vws_cnx_ingress(c));
+        ASSERT_NULL(vws_msg_pop(c));
+
+        // The payload was left alone
+        ASSERT_EQUAL(0x5A, c->base.buffer->data[sizeof(data) - 1]);
+
+        vws_cnx_free(c);
+    }
+}
+
+CTEST(test_frame, zero_copy)
+{
+    vws_cnx* c = vws_cnx_new();
+    vws_cnx_set_zero_copy(c);
+
+    size_t n = 3000;
+    unsigned char* payload = malloc(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        payload[i] = (unsigned char)(i * 7);
+    }
+
+    // Message split across two frames. BINARY, as the payload isn't UTF-8.
+    vws_frame* f1 = vws_frame_new(payload, 1000, BINARY_FRAME);
+    vws_frame* f2 = vws_frame_new(payload + 1000, n - 1000, CONTINUATION_FRAME);
+    f1->fin = 0;
+
+    vws_buffer* b1 = vws_serialize(f1);
+    vws_buffer* b2 = vws_serialize(f2);
+
+    // First frame plus part of the second
+    vws_buffer_append(c->base.buffer, b1->data, b1->size);
+    vws_buffer_append(c->base.buffer, b2->data, 10);
+
+    vws_cnx_ingress(c);
+    ASSERT_NULL(vws_msg_pop(c));
+    ASSERT_EQUAL(1, sc_queue_size(&c->queue));
+
+    // The first frame borrows from the buffer, which must not have compacted
+    vws_frame* queued = sc_queue_peek_last(&c->queue);
+    ASSERT_EQUAL(1, queued->borrowed);
+    ASSERT_EQUAL(b1->size, c->parsed);
+
+    // The rest of the second frame. This grows (reallocates) the buffer.
+    vws_buffer_append(c->base.buffer, b2->data + 10, b2->size - 10);
+
+    vws_cnx_ingress(c);
+    vws_msg* m = vws_msg_pop(c);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(BINARY_FRAME, m->opcode);
+    ASSERT_EQUAL(n, m->data->size);
+    ASSERT_TRUE(memcmp(payload, m->data->data, n) == 0);
+
+    // Everything consumed, so the buffer is fully drained
+    ASSERT_EQUAL(0, c->base.buffer->size);
+    ASSERT_EQUAL(0, c->parsed);
+
+    vws_msg_free(m);
+    vws_buffer_free(b1);
+    vws_buffer_free(b2);
+    free(payload);
+    vws_cnx_free(c);
+}
+
+CTEST(test_frame, message_tracking)
+{
+    vws_cnx* c = vws_cnx_new();
+
+    // Three messages: single frame, three fragments, single frame
+    ucstr parts[] = { (ucstr)"a", (ucstr)"bb", (ucstr)"ccc",
+                      (ucstr)"dddd", (ucstr)"eeeee" };
+    int fin[]     = { 1, 0, 0, 1, 1 };
+
+    for (int i = 0; i < 5; i++)
+    {
+        size_t n      = strlen((cstr)parts[i]);
+        vws_frame* f  = vws_frame_new(parts[i], n, TEXT_FRAME);
+        f->fin        = fin[i];
+        vws_buffer* b = vws_serialize(f);
+        vws_buffer_append(c->base.buffer, b->data, b->size);
+        vws_buffer_free(b);
+    }
+
+    vws_cnx_ingress(c);
+    ASSERT_EQUAL(3, sc_queue_size(&c->messages));
+    ASSERT_EQUAL(0, c->partial);
+
+    cstr expected[] = { "a", "bbcccdddd", "eeeee" };
+
+    for (int i = 0; i < 3; i++)
+    {
+        vws_msg* m = vws_msg_pop(c);
+        ASSERT_NOT_NULL(m);
+        ASSERT_EQUAL(strlen(expected[i]), m->data->size);
+        ASSERT_TRUE(memcmp(expected[i], m->data->data, m->data->size) == 0);
+        vws_msg_free(m);
+    }
+
+    ASSERT_NULL(vws_msg_pop(c));
+    ASSERT_EQUAL(0, sc_queue_size(&c->messages));
+
+    vws_cnx_free(c);
+}
+
+CTEST(test_frame, utf8_messages)
+{
+    vws_cnx* c = vws_cnx_new();
+
+    // A character split across fragments, a bad TEXT message, then BINARY,
+    // which is not checked
+    ucstr parts[] = { (ucstr)"caf\xC3", (ucstr)"\xA9", (ucstr)"\xC3\x28",
+                      (ucstr)"\xC3\x28" };
+    int fin[]     = { 0, 1, 1, 1 };
+    int code[]    = { TEXT_FRAME, CONTINUATION_FRAME, TEXT_FRAME, BINARY_FRAME };
+
+    for (int i = 0; i < 4; i++)
+    {
+        size_t n      = strlen((cstr)parts[i]);
+        vws_frame* f  = vws_frame_new(parts[i], n, code[i]);
+        f->fin        = fin[i];
+        vws_buffer* b = vws_serialize(f);
+        vws_buffer_append(c->base.buffer, b->data, b->size);
+        vws_buffer_free(b);
+    }
+
+    vws_cnx_ingress(c);
+    ASSERT_EQUAL(3, sc_queue_size(&c->messages));
+
+    vws_msg* m = vws_msg_pop(c);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(5, m->data->size);
+    vws_msg_free(m);
+
+    ASSERT_NULL(vws_msg_pop(c));
+    ASSERT_EQUAL(VE_WARN, vws.e.code);
+
+    m = vws_msg_pop(c);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(BINARY_FRAME, m->opcode);
+    vws_msg_free(m);
+
+    vws_cnx_free(c);
+}
+
+// Feeds a message of count frames of size bytes through c a frame at a time,
+// as if read from the socket, and returns the most the receive buffer held
+static size_t spill_feed(vws_cnx* c, size_t size, int count)
+{
+    unsigned char* data = malloc(size);
+    memset(data, 'x', size);
+    size_t peak = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int code      = (i == 0) ? TEXT_FRAME : CONTINUATION_FRAME;
+        vws_frame* f  = vws_frame_new(data, size, code);
+        f->fin        = (i == count - 1);
+        vws_buffer* b = vws_serialize(f);
+        vws_buffer_append(c->base.buffer, b->data, b->size);
+        vws_buffer_free(b);
+        vws_cnx_ingress(c);
+
+        vws_buffer* r = c->base.buffer;
+
+        if (r->allocated + r->head > peak)
+        {
+            peak = r->allocated + r->head;
+        }
+    }
+
+    free(data);
+
+    return peak;
+}
+
+CTEST(test_frame, spill)
+{
+    // Two megabytes in 16 KB frames, written out once past 100 KB
+    size_t n   = 16384;
+    vws_cnx* c = vws_cnx_new();
+    vws_cnx_set_zero_copy(c);
+    c->spill   = 100000;
+
+    size_t peak = spill_feed(c, n, 128);
+
+    // Frames are released as they are written, so the receive buffer only
+    // ever held a few
+    ASSERT_TRUE(peak < 16 * n);
+    ASSERT_EQUAL(1, sc_queue_size(&c->queue));
+
+    vws_msg* m = vws_msg_pop(c);
+    ASSERT_NOT_NULL(m);
+    ASSERT_TRUE(m->mapped);
+    ASSERT_EQUAL(TEXT_FRAME, m->opcode);
+    ASSERT_EQUAL(128 * n, m->data->size);
+    ASSERT_EQUAL('x', m->data->data[0]);
+    ASSERT_EQUAL('x', m->data->data[128 * n - 1]);
+    vws_msg_free(m);
+    vws_cnx_free(c);
+
+    // Past max_message the rest is dropped rather than written
+    c              = vws_cnx_new();
+    c->spill       = 100000;
+    c->max_message = 500000;
+
+    spill_feed(c, n, 128);
+    ASSERT_NULL(vws_msg_pop(c));
+    ASSERT_EQUAL(0, sc_queue_size(&c->queue));
+    ASSERT_EQUAL(-1, c->spill_fd);
+    vws_cnx_free(c);
+}
+
+// What the stream callback saw, as "<begin><end>:<data>|" per fragment
+static char stream_log[256];
+
+static void stream_cb( vws_cnx* c, unsigned char opcode, ucstr data,
+                       size_t size, bool begin, bool end )
+{
+    size_t n = strlen(stream_log);
+    snprintf( stream_log + n, sizeof(stream_log) - n, "%d%d%d:%.*s|",
+              opcode, begin, end, (int)size, (cstr)data );
+}
+
+CTEST(test_frame, streaming)
+{
+    vws_cnx* c = vws_cnx_new();
+    vws_cnx_set_zero_copy(c);
+    vws_cnx_set_stream(c, stream_cb);
+    stream_log[0] = 0;
+
+    // Single frame, three fragments, then a stray continuation and one more
+    ucstr parts[] = { (ucstr)"a", (ucstr)"bb", (ucstr)"ccc",
+                      (ucstr)"dddd", (ucstr)"x", (ucstr)"eeeee" };
+    int fin[]     = { 1, 0, 0, 1, 1, 1 };
+    int code[]    = { BINARY_FRAME, TEXT_FRAME, CONTINUATION_FRAME,
+                      CONTINUATION_FRAME, CONTINUATION_FRAME, TEXT_FRAME };
+
+    for (int i = 0; i < 6; i++)
+    {
+        size_t n      = strlen((cstr)parts[i]);
+        vws_frame* f  = vws_frame_new(parts[i], n, code[i]);
+        f->fin        = fin[i];
+        vws_buffer* b = vws_serialize(f);
+        vws_buffer_append(c->base.buffer, b->data, b->size);
+        vws_buffer_free(b);
+    }
+
+    vws_cnx_ingress(c);
+
+    ASSERT_STR("211:a|110:bb|100:ccc|101:dddd|111:eeeee|", stream_log);
+
+    // Nothing was queued, and nothing is held in the receive buffer
+    ASSERT_NULL(vws_msg_pop(c));
+    ASSERT_EQUAL(0, sc_queue_size(&c->queue));
+    ASSERT_EQUAL(0, c->base.buffer->size);
+
+    vws_cnx_free(c);
+}
+
+CTEST(test_frame, streaming_max_message)
+{
+    vws_cnx* c = vws_cnx_new();
+    vws_cnx_set_zero_copy(c);
+    vws_cnx_set_stream(c, stream_cb);
+    c->max_message = 4096;
+    stream_log[0]  = 0;
+
+    // Compressed fragments are collected until FIN. The second takes them
+    // past the limit, so they are dropped before the message is complete.
+    unsigned char* data = calloc(1, 3000);
+    int fin[]           = { 0, 0, 1 };
+    int code[]          = { BINARY_FRAME, CONTINUATION_FRAME,
+                            CONTINUATION_FRAME };
+
+    for (int i = 0; i < 3; i++)
+    {
+        vws_frame* f  = vws_frame_new(data, 3000, code[i]);
+        f->fin        = fin[i];
+        f->rsv1       = (i == 0);
+        vws_buffer* b = vws_serialize(f);
+        vws_buffer_append(c->base.buffer, b->data, b->size);
+        vws_buffer_free(b);
+        vws_cnx_ingress(c);
+
+        ASSERT_TRUE(i > 0 || c->stream_buffer != NULL);
+        ASSERT_TRUE(i == 0 || c->stream_buffer == NULL);
+    }
+
+    free(data);
+
+    // Nothing was delivered or kept, the last fragment included
+    ASSERT_STR("", stream_log);
+    ASSERT_EQUAL(0, sc_queue_size(&c->queue));
+
+    vws_cnx_free(c);
+}
+
+//------------------------------------------------------------------------------
+// permessage-deflate
+//------------------------------------------------------------------------------
+
+// Compresses on tx and feeds the frame through rx's receive path
+static void deflate_roundtrip(vws_cnx* tx, vws_cnx* rx, cstr text)
+{
+    vws_buffer* payload = vws_buffer_new();
+    vws_buffer_append(payload, (ucstr)text, strlen(text));
+    ASSERT_TRUE(vws_cnx_deflate(tx, payload));
+    ASSERT_TRUE(payload->size < strlen(text));
+
+    vws_frame* f  = vws_frame_new(payload->data, payload->size, TEXT_FRAME);
+    f->rsv1       = 1;
+    vws_buffer* b = vws_serialize(f);
+    vws_buffer_free(payload);
+
+    vws_buffer_append(rx->base.buffer, b->data, b->size);
+    vws_buffer_free(b);
+    vws_cnx_ingress(rx);
+
+    vws_msg* m = vws_msg_pop(rx);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(strlen(text), m->data->size);
+    ASSERT_TRUE(memcmp(text, m->data->data, m->data->size) == 0);
+    vws_msg_free(m);
+}
+
+CTEST(test_frame, deflate)
+{
+    cstr text = "Lorem ipsum dolor sit amet, Lorem ipsum dolor sit amet, "
+                "Lorem ipsum dolor sit amet, Lorem ipsum dolor sit amet";
+
+    vws_cnx* a = vws_cnx_new();
+    vws_cnx* b = vws_cnx_new();
+
+    // Nothing happens until negotiated
+    ASSERT_FALSE(vws_cnx_is_deflate(a));
+    ASSERT_NULL(vws_cnx_accept_deflate(a, "permessage-deflate"));
+
+    // Unknown offers and parameters are declined
+    vws_cnx_set_deflate(a, 15, false);
+    ASSERT_NULL(vws_cnx_accept_deflate(a, "x-webkit-deflate-frame"));
+    ASSERT_NULL(vws_cnx_accept_deflate(a, "permessage-deflate; bogus"));
+    ASSERT_FALSE(vws_cnx_is_deflate(a));
+
+    // The client's constraints are honored in the response
+    cstr offer = "foo, permessage-deflate; client_max_window_bits; "
+                 "server_max_window_bits=10; server_no_context_takeover";
+    cstr response = vws_cnx_accept_deflate(a, offer);
+    ASSERT_NOT_NULL(response);
+    ASSERT_STR( "permessage-deflate; server_no_context_takeover; "
+                "server_max_window_bits=10", response );
+    vws.free(response);
+    ASSERT_TRUE(vws_cnx_is_deflate(a));
+
+    vws_cnx_set_deflate(b, 15, false);
+    response = vws_cnx_accept_deflate(b, "permessage-deflate");
+    ASSERT_STR("permessage-deflate", response);
+    vws.free(response);
+
+    // Several messages each way, so context takeover is exercised
+    for (int i = 0; i < 3; i++)
+    {
+        deflate_roundtrip(a, b, text);
+        deflate_roundtrip(b, a, text);
+    }
+
+    // Small messages are left alone
+    vws_buffer* small = vws_buffer_new();
+    vws_buffer_append(small, (ucstr)"hello", 5);
+    ASSERT_FALSE(vws_cnx_deflate(a, small));
+    ASSERT_EQUAL(5, small->size);
+    vws_buffer_free(small);
+
+    vws_cnx_free(a);
+    vws_cnx_free(b);
+}
+
+CTEST(test_frame, deflate_window)
+{
+    vws_cnx* c = vws_cnx_new();
+    vws_cnx_set_deflate(c, 15, false);
+
+    // A window of 8 bits cannot be met, nor answered with a larger one
+    cstr offer = "permessage-deflate; server_max_window_bits=8";
+    ASSERT_NULL(vws_cnx_accept_deflate(c, offer));
+    ASSERT_FALSE(vws_cnx_is_deflate(c));
+
+    // The next offer is taken instead
+    offer = "permessage-deflate; server_max_window_bits=8, "
+            "permessage-deflate; server_max_window_bits=9";
+    cstr response = vws_cnx_accept_deflate(c, offer);
+    ASSERT_NOT_NULL(response);
+    ASSERT_STR("permessage-deflate; server_max_window_bits=9", response);
+    vws.free(response);
+
+    vws_cnx_free(c);
+}
+
+CTEST(test_frame, max_message)
+{
+    vws_cnx* a = vws_cnx_new();
+    vws_cnx* b = vws_cnx_new();
+
+    vws_cnx_set_deflate(a, 15, false);
+    vws_cnx_set_deflate(b, 15, false);
+    vws.free(vws_cnx_accept_deflate(a, "permessage-deflate"));
+    vws.free(vws_cnx_accept_deflate(b, "permessage-deflate"));
+
+    ASSERT_EQUAL(VWS_MESSAGE_MAX, b->max_message);
+    b->max_message = 4096;
+
+    // A megabyte of zeros compresses to about a kilobyte
+    size_t n            = 1024 * 1024;
+    vws_buffer* payload = vws_buffer_new();
+    vws_buffer_reserve(payload, n);
+    memset(payload->data, 0, n);
+    payload->size = n;
+
+    ASSERT_TRUE(vws_cnx_deflate(a, payload));
+    ASSERT_TRUE(payload->size < b->max_message);
+
+    vws_frame* f  = vws_frame_new(payload->data, payload->size, BINARY_FRAME);
+    f->rsv1       = 1;
+    vws_buffer* z = vws_serialize(f);
+    vws_buffer_free(payload);
+
+    vws_buffer_append(b->base.buffer, z->data, z->size);
+    vws_buffer_free(z);
+    vws_cnx_ingress(b);
+
+    // Inflating stops at the limit and the message is dropped
+    ASSERT_NULL(vws_msg_pop(b));
+    ASSERT_EQUAL(0, sc_queue_size(&b->queue));
+
+    // Uncompressed messages are held to it as well
+    vws_cnx* c     = vws_cnx_new();
+    c->max_message = 4096;
+
+    unsigned char* data = calloc(1, 5000);
+    f                   = vws_frame_new(data, 5000, BINARY_FRAME);
+    vws_buffer* plain   = vws_serialize(f);
+    free(data);
+
+    vws_buffer_append(c->base.buffer, plain->data, plain->size);
+    vws_buffer_free(plain);
+    vws_cnx_ingress(c);
+
+    ASSERT_NULL(vws_msg_pop(c));
+    ASSERT_EQUAL(0, sc_queue_size(&c->queue));
+
+    vws_cnx_free(a);
+    vws_cnx_free(b);
+    vws_cnx_free(c);
+}
+
+int main(int argc, const char* argv[])
+{
+    return ctest_main(argc, argv);
+}
+
+//------------------------------------------------------------------------------
+// Handshake
+//------------------------------------------------------------------------------
+
+CTEST(test_frame, accept_key)
+{
+    // The example from RFC 6455, section 1.3
+    cstr key = "dGhlIHNhbXBsZSBub25jZQ==";
+    char ac[VWS_ACCEPT_KEY_SIZE];
+
+    ASSERT_TRUE(vws_accept_key_into(key, ac));
+    ASSERT_STR("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", ac);
+
+    // The allocating version agrees
+    cstr heap = vws_accept_key(key);
+    ASSERT_STR(ac, heap);
+    vws.free((void*)heap);
+
+    // A missing key is refused rather than hashed
+    ASSERT_FALSE(vws_accept_key_into(NULL, ac));
+}
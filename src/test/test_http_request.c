@@ -29,6 +29,46 @@ CTEST(test_rpc, call)
     vws_http_msg_free(req);
 }
 
+CTEST(test_rpc, handshake)
+{
+    char* data = "GET /websocket HTTP/1.1\r\n"
+                 "Host: example.com\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "SEC-WEBSOCKET-KEY: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                 "Sec-WebSocket-Version: 13\r\n"
+                 "\r\n";
+
+    vws_http_msg* req = vws_http_msg_handshake_new();
+
+    // Arrives in two pieces, split inside the key. Each call passes all the
+    // data so far.
+    size_t size  = strlen(data);
+    size_t split = strstr(data, "NhbX") - data;
+
+    ASSERT_EQUAL((int)split, vws_http_msg_parse(req, data, split));
+    ASSERT_FALSE(req->headers_complete);
+    ASSERT_EQUAL((int)size, vws_http_msg_parse(req, data, size));
+    ASSERT_TRUE(req->headers_complete);
+
+    char value[64];
+    cstr key = vws_http_msg_span(req, data, VWS_HTTP_KEY, value, 64);
+    ASSERT_STR("dGhlIHNhbXBsZSBub25jZQ==", key);
+
+    cstr upgrade = vws_http_msg_span(req, data, VWS_HTTP_UPGRADE, value, 64);
+    ASSERT_STR("websocket", upgrade);
+
+    ASSERT_NULL(vws_http_msg_span(req, data, VWS_HTTP_PROTOCOL, value, 64));
+    ASSERT_NULL(vws_http_msg_span(req, data, VWS_HTTP_KEY, value, 8));
+
+    // Nothing else is kept until asked for
+    ASSERT_EQUAL(0, (int)sc_map_size_str(&req->headers));
+    ASSERT_TRUE(vws_http_msg_headers(req, data, size));
+    ASSERT_STR("example.com", vws_map_get(&req->headers, "host"));
+
+    vws_http_msg_free(req);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
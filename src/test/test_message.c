@@ -6,6 +6,7 @@
 #include "message.h"
 #include "mpack-reader.h"
 #include "mpack-writer.h"
+#include "util/yyjson.h"
 
 CTEST(test_message, mpack_serialization)
 {
@@ -86,6 +87,373 @@ CTEST(test_message, json_serialization)
     vrtql_msg_free(receive);
 }
 
+CTEST(test_message, header_storage)
+{
+    vrtql_msg* msg = vrtql_msg_new();
+
+    // Common keys are interned, the rest land in the arena
+    vrtql_msg_set_routing(msg, "tag", "abc");
+    vrtql_msg_set_header(msg, "id", "session.login");
+    vrtql_msg_set_header(msg, "rc", "0");
+
+    // Replacing a value keeps the key and releases nothing twice
+    vrtql_msg_set_header(msg, "rc", "1");
+    vrtql_msg_set_routing(msg, "tag", vrtql_msg_get_routing(msg, "tag"));
+
+    ASSERT_STR("1", vrtql_msg_get_header(msg, "rc"));
+    ASSERT_STR("abc", vrtql_msg_get_routing(msg, "tag"));
+
+    // Enough headers to spill out of the inline arena
+    char key[32]; char value[64];
+
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(key, sizeof(key), "key-%i", i);
+        snprintf(value, sizeof(value), "value-%i", i);
+        vrtql_msg_set_header(msg, key, value);
+    }
+
+    ASSERT_TRUE(msg->blocks != NULL);
+    ASSERT_EQUAL(102, sc_map_size_str(&msg->headers));
+
+    vrtql_msg_clear_header(msg, "key-50");
+    ASSERT_NULL(vrtql_msg_get_header(msg, "key-50"));
+    ASSERT_STR("value-99", vrtql_msg_get_header(msg, "key-99"));
+
+    // Round trip, and deserializing into a used message
+    vws_buffer* binary = vrtql_msg_serialize(msg);
+    ASSERT_TRUE(vrtql_msg_deserialize(msg, binary->data, binary->size));
+    vws_buffer_free(binary);
+
+    ASSERT_EQUAL(101, sc_map_size_str(&msg->headers));
+    ASSERT_STR("session.login", vrtql_msg_get_header(msg, "id"));
+    ASSERT_STR("value-0", vrtql_msg_get_header(msg, "key-0"));
+
+    vrtql_msg_free(msg);
+}
+
+CTEST(test_message, borrowed_content)
+{
+    vrtql_msg* msg = vrtql_msg_new();
+    vrtql_msg_set_routing(msg, "tag", "abc");
+    vrtql_msg_set_header(msg, "id", "session.login");
+    vrtql_msg_set_content(msg, "payload");
+
+    vws_buffer* binary = vrtql_msg_serialize(msg);
+    vrtql_msg_free(msg);
+
+    // Wrap it up as it would come off the wire
+    vws_msg* wsm = vws_msg_new();
+    vws_buffer_append(wsm->data, binary->data, binary->size);
+    vws_buffer_free(binary);
+
+    ucstr wire = wsm->data->data;
+
+    msg = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize_ws(msg, wsm));
+    vws_msg_free(wsm);
+
+    // The content is the wire buffer, not a copy of it
+    ASSERT_TRUE(msg->content->data > wire);
+    ASSERT_TRUE(msg->content->data - msg->content->head == wire);
+    ASSERT_EQUAL(7, msg->content->size);
+    ASSERT_TRUE(strncmp("payload", (cstr)msg->content->data, 7) == 0);
+
+    ASSERT_STR("abc", vrtql_msg_get_routing(msg, "tag"));
+    ASSERT_STR("session.login", vrtql_msg_get_header(msg, "id"));
+    ASSERT_NULL(msg->blocks);
+
+    // Content can still be replaced
+    vrtql_msg_set_content(msg, "other");
+    ASSERT_EQUAL(5, msg->content->size);
+    ASSERT_EQUAL(0, msg->content->head);
+
+    vrtql_msg_free(msg);
+}
+
+CTEST(test_message, presized_serialization)
+{
+    vrtql_msg* msg = vrtql_msg_new();
+
+    // Cross each string, map and bin length boundary in the encoding
+    char value[70000];
+    memset(value, 'x', sizeof(value));
+
+    size_t sizes[] = { 0, 31, 32, 255, 256, 65535, 65536 };
+    char key[32];
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        value[sizes[i]] = 0;
+        snprintf(key, sizeof(key), "key-%zu", sizes[i]);
+        vrtql_msg_set_header(msg, key, value);
+        value[sizes[i]] = 'x';
+    }
+
+    for (int i = 0; i < 20; i++)
+    {
+        snprintf(key, sizeof(key), "route-%i", i);
+        vrtql_msg_set_routing(msg, key, "r");
+    }
+
+    vrtql_msg_set_content_binary(msg, value, 65536);
+
+    vws_buffer* binary = vrtql_msg_serialize(msg);
+    ASSERT_NOT_NULL(binary);
+    ASSERT_EQUAL(binary->size, binary->allocated);
+
+    // Framed, masked and unmasked, the payload is the same encoding
+    for (int mask = 0; mask < 2; mask++)
+    {
+        vws_buffer* wire = vrtql_msg_serialize_frame(msg, mask);
+        ASSERT_NOT_NULL(wire);
+        ASSERT_EQUAL(wire->size, wire->allocated);
+
+        vws_frame* f    = vws_frame_new(NULL, 0, BINARY_FRAME);
+        size_t consumed = 0;
+        fs_t rc         = vws_deserialize(wire->data, wire->size, f, &consumed);
+
+        ASSERT_EQUAL(FRAME_COMPLETE, rc);
+        ASSERT_EQUAL(wire->size, consumed);
+        ASSERT_EQUAL(binary->size, f->size);
+        ASSERT_TRUE(memcmp(binary->data, f->data, f->size) == 0);
+
+        vws_frame_free(f);
+        vws_buffer_free(wire);
+    }
+
+    vrtql_msg* copy = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize(copy, binary->data, binary->size));
+    ASSERT_EQUAL(7, sc_map_size_str(&copy->headers));
+    ASSERT_EQUAL(20, sc_map_size_str(&copy->routing));
+    ASSERT_EQUAL(65535, strlen(vrtql_msg_get_header(copy, "key-65535")));
+    ASSERT_EQUAL(65536, copy->content->size);
+
+    vrtql_msg_free(copy);
+    vws_buffer_free(binary);
+    vrtql_msg_free(msg);
+}
+
+CTEST(test_message, json_streaming)
+{
+    vrtql_msg* msg = vrtql_msg_new();
+    msg->format    = VM_JSON_FORMAT;
+
+    cstr text = "quote \" slash \\ tab \t line \n bell \a \xc3\xa9";
+    vrtql_msg_set_routing(msg, "to", "a\"b");
+    vrtql_msg_set_header(msg, "id", "x.y");
+    vrtql_msg_set_header(msg, "note", text);
+    vrtql_msg_set_content(msg, text);
+
+    vws_buffer* json = vrtql_msg_serialize(msg);
+    ASSERT_NOT_NULL(json);
+
+    // Parses as JSON, with the strings intact
+    yyjson_doc* doc  = yyjson_read((cstr)json->data, json->size, 0);
+    yyjson_val* root = yyjson_doc_get_root(doc);
+    ASSERT_TRUE(yyjson_is_arr(root));
+    ASSERT_EQUAL(3, yyjson_arr_size(root));
+    ASSERT_STR(text, yyjson_get_str(yyjson_arr_get(root, 2)));
+    ASSERT_STR("a\"b", yyjson_get_str(yyjson_obj_get(yyjson_arr_get(root, 0), "to")));
+    yyjson_doc_free(doc);
+
+    // Copying decode
+    vrtql_msg* copy = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize(copy, json->data, json->size));
+    ASSERT_EQUAL(VM_JSON_FORMAT, copy->format);
+    ASSERT_STR(text, vrtql_msg_get_header(copy, "note"));
+    ASSERT_EQUAL(strlen(text), copy->content->size);
+    ASSERT_TRUE(memcmp(text, copy->content->data, strlen(text)) == 0);
+    vrtql_msg_free(copy);
+
+    // In place decode keeps the content in the frame's buffer
+    vws_msg* wsm = vws_msg_new();
+    vws_buffer_append(wsm->data, json->data, json->size);
+    vws_buffer_free(json);
+
+    copy = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize_ws(copy, wsm));
+    vws_msg_free(wsm);
+
+    ASSERT_TRUE(copy->content->head > 0);
+    ASSERT_EQUAL(strlen(text), copy->content->size);
+    ASSERT_TRUE(memcmp(text, copy->content->data, strlen(text)) == 0);
+    ASSERT_STR("a\"b", vrtql_msg_get_routing(copy, "to"));
+    ASSERT_STR("x.y", vrtql_msg_get_header(copy, "id"));
+    vrtql_msg_free(copy);
+
+    // Empty content still makes a three element array
+    vrtql_msg_clear_content(msg);
+    json = vrtql_msg_serialize(msg);
+    copy = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize(copy, json->data, json->size));
+    ASSERT_EQUAL(0, copy->content->size);
+    vrtql_msg_free(copy);
+    vws_buffer_free(json);
+
+    vrtql_msg_free(msg);
+}
+
+CTEST(test_message, json_raw_content)
+{
+    vrtql_msg* msg = vrtql_msg_new();
+    msg->format    = VM_JSON_FORMAT;
+
+    // Brackets and escaped quotes inside strings must not confuse the split
+    cstr content = "{\"a\":[1,2,{\"b\":\"]}\\\"\"}],\"c\":null}";
+    vrtql_msg_set_header(msg, "id", "x.y");
+    vrtql_msg_set_routing(msg, "to", "[a]");
+    vrtql_msg_set_content(msg, content);
+    vws_set_flag(&msg->flags, VM_MSG_RAW_JSON);
+
+    vws_buffer* json = vrtql_msg_serialize(msg);
+
+    // Embedded as a value, so the whole thing is still valid JSON
+    yyjson_doc* doc = yyjson_read((cstr)json->data, json->size, 0);
+    ASSERT_TRUE(yyjson_is_obj(yyjson_arr_get(yyjson_doc_get_root(doc), 2)));
+    yyjson_doc_free(doc);
+
+    vrtql_msg* copy = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize(copy, json->data, json->size));
+    ASSERT_TRUE(vws_is_flag(&copy->flags, VM_MSG_RAW_JSON));
+    ASSERT_EQUAL(strlen(content), copy->content->size);
+    ASSERT_TRUE(memcmp(content, copy->content->data, strlen(content)) == 0);
+    ASSERT_STR("x.y", vrtql_msg_get_header(copy, "id"));
+    ASSERT_STR("[a]", vrtql_msg_get_routing(copy, "to"));
+    vrtql_msg_free(copy);
+
+    // Taken straight from the frame when decoding one
+    vws_msg* wsm = vws_msg_new();
+    vws_buffer_append(wsm->data, json->data, json->size);
+    vws_buffer_free(json);
+
+    copy = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize_ws(copy, wsm));
+    vws_msg_free(wsm);
+    ASSERT_TRUE(copy->content->head > 0);
+    ASSERT_EQUAL(strlen(content), copy->content->size);
+
+    // A string is not raw, whatever it holds
+    vrtql_msg_set_routing(msg, "to", "b");
+    vws_clear_flag(&msg->flags, VM_MSG_RAW_JSON);
+    json = vrtql_msg_serialize(msg);
+    ASSERT_TRUE(vrtql_msg_deserialize(copy, json->data, json->size));
+    ASSERT_FALSE(vws_is_flag(&copy->flags, VM_MSG_RAW_JSON));
+    ASSERT_STR("b", vrtql_msg_get_routing(copy, "to"));
+    ASSERT_EQUAL(strlen(content), copy->content->size);
+    vws_buffer_free(json);
+
+    // Whitespace and scalars
+    cstr text = " [ {\"k\":\"v\"} ,\n{} , 42 ] ";
+    ASSERT_TRUE(vrtql_msg_deserialize(copy, (ucstr)text, strlen(text)));
+    ASSERT_TRUE(vws_is_flag(&copy->flags, VM_MSG_RAW_JSON));
+    ASSERT_EQUAL(2, copy->content->size);
+    ASSERT_TRUE(memcmp("42", copy->content->data, 2) == 0);
+
+    // Malformed
+    text = "[{},{},{\"a\":1]";
+    ASSERT_FALSE(vrtql_msg_deserialize(copy, (ucstr)text, strlen(text)));
+
+    vrtql_msg_free(copy);
+    vrtql_msg_free(msg);
+}
+
+CTEST(test_message, lazy)
+{
+    vrtql_msg* msg = vrtql_msg_new();
+    vrtql_msg_set_routing(msg, "to", "queue");
+    vrtql_msg_set_header(msg, "id", "x.y");
+    vrtql_msg_set_content(msg, "content");
+
+    vrtql_msg_format_t formats[] = { VM_MPACK_FORMAT, VM_JSON_FORMAT };
+
+    for (int i = 0; i < 2; i++)
+    {
+        msg->format      = formats[i];
+        vws_buffer* data = vrtql_msg_serialize(msg);
+
+        // Routing only
+        vrtql_msg* copy = vrtql_msg_new();
+        ASSERT_TRUE(vrtql_msg_deserialize_lazy(copy, data->data, data->size));
+        ASSERT_TRUE(vws_is_flag(&copy->flags, VM_MSG_LAZY));
+        ASSERT_EQUAL(formats[i], copy->format);
+        ASSERT_STR("queue", vrtql_msg_get_routing(copy, "to"));
+        ASSERT_EQUAL(0, copy->content->size);
+        ASSERT_TRUE(vws_is_flag(&copy->flags, VM_MSG_LAZY));
+
+        // Forwarded as it came
+        vws_buffer* out = vrtql_msg_serialize(copy);
+        ASSERT_EQUAL(data->size, out->size);
+        ASSERT_TRUE(memcmp(data->data, out->data, out->size) == 0);
+        vws_buffer_free(out);
+
+        // The rest on first use
+        ASSERT_STR("x.y", vrtql_msg_get_header(copy, "id"));
+        ASSERT_FALSE(vws_is_flag(&copy->flags, VM_MSG_LAZY));
+        ASSERT_NULL(copy->raw);
+        ASSERT_EQUAL(7, vrtql_msg_get_content_size(copy));
+        ASSERT_TRUE(memcmp("content", copy->content->data, 7) == 0);
+        ASSERT_STR("queue", vrtql_msg_get_routing(copy, "to"));
+
+        // Changing routing re-encodes
+        ASSERT_TRUE(vrtql_msg_deserialize_lazy(copy, data->data, data->size));
+        vrtql_msg_set_routing(copy, "to", "elsewhere");
+        ASSERT_FALSE(vws_is_flag(&copy->flags, VM_MSG_LAZY));
+        out = vrtql_msg_serialize(copy);
+        vrtql_msg* check = vrtql_msg_new();
+        ASSERT_TRUE(vrtql_msg_deserialize(check, out->data, out->size));
+        ASSERT_STR("elsewhere", vrtql_msg_get_routing(check, "to"));
+        ASSERT_STR("x.y", vrtql_msg_get_header(check, "id"));
+        ASSERT_EQUAL(7, check->content->size);
+        vrtql_msg_free(check);
+        vws_buffer_free(out);
+
+        // As does changing format
+        ASSERT_TRUE(vrtql_msg_deserialize_lazy(copy, data->data, data->size));
+        copy->format = formats[1 - i];
+        out          = vrtql_msg_serialize_frame(copy, false);
+        ASSERT_NOT_NULL(out);
+        ASSERT_FALSE(vws_is_flag(&copy->flags, VM_MSG_LAZY));
+        vws_buffer_free(out);
+
+        // Frames from the raw bytes too
+        ASSERT_TRUE(vrtql_msg_deserialize_lazy(copy, data->data, data->size));
+        out = vrtql_msg_serialize_frame(copy, false);
+        ASSERT_TRUE(vws_is_flag(&copy->flags, VM_MSG_LAZY));
+        ASSERT_TRUE(out->size > data->size);
+        ASSERT_TRUE(memcmp( data->data,
+                            out->data + out->size - data->size,
+                            data->size ) == 0);
+        vws_buffer_free(out);
+
+        // Taken from the frame without copying
+        vws_msg* wsm = vws_msg_new();
+        vws_buffer_append(wsm->data, data->data, data->size);
+        ucstr payload = wsm->data->data;
+        ASSERT_TRUE(vrtql_msg_deserialize_ws_lazy(copy, wsm));
+        vws_msg_free(wsm);
+        ASSERT_TRUE(copy->raw->data == payload);
+        ASSERT_TRUE(vrtql_msg_decode(copy));
+        ASSERT_STR("x.y", vrtql_msg_get_header(copy, "id"));
+        ASSERT_EQUAL(7, copy->content->size);
+
+        vrtql_msg_free(copy);
+        vws_buffer_free(data);
+    }
+
+    // Bad headers only show when decoded
+    cstr text = "[{\"to\":\"q\"},[],\"x\"]";
+    ASSERT_TRUE(vrtql_msg_deserialize_lazy(msg, (ucstr)text, strlen(text)));
+    ASSERT_STR("q", vrtql_msg_get_routing(msg, "to"));
+    ASSERT_FALSE(vrtql_msg_decode(msg));
+    ASSERT_EQUAL(0, msg->content->size);
+
+    text = "[[],{},\"x\"]";
+    ASSERT_FALSE(vrtql_msg_deserialize_lazy(msg, (ucstr)text, strlen(text)));
+
+    vrtql_msg_free(msg);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -1,5 +1,9 @@
+#include <ctype.h>
+#include <unistd.h>
+
 #include "server.h"
 #include "message.h"
+#include "rpc.h"
 
 #define CTEST_MAIN
 #include "ctest.h"
@@ -36,6 +40,59 @@ void process_message(vws_svr_cnx* cnx, vrtql_msg* m)
     vrtql_msg_free(m);
 }
 
+// Echo content back as an RPC response, keeping the caller's tag.
+void process_rpc(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    vrtql_msg* reply = vrtql_msg_new();
+    reply->format    = cnx->format;
+
+    vrtql_msg_set_routing(reply, "tag", vrtql_msg_get_routing(m, "tag"));
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    server->send(cnx, reply);
+    vrtql_msg_free(m);
+}
+
+// RPC Call: test.echo
+vrtql_msg* rpc_echo(vrtql_rpc_env* e, vrtql_msg* m)
+{
+    vrtql_msg* reply = vrtql_msg_new();
+    vrtql_msg_set_header(reply, "rc", "0");
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    return reply;
+}
+
+vrtql_rpc_system* rpc_system = NULL;
+
+// Service messages through the RPC system
+void process_rpc_service(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    cstr t    = vrtql_msg_get_routing(m, "tag");
+    char* tag = (t != NULL) ? strdup(t) : NULL;
+
+    vrtql_rpc_env env;
+    vrtql_msg* reply = vrtql_rpc_service(rpc_system, &env, m);
+
+    if (reply == NULL)
+    {
+        reply = vrtql_msg_new();
+        vrtql_msg_set_header(reply, "rc", "1");
+    }
+
+    if (tag != NULL)
+    {
+        vrtql_msg_set_routing(reply, "tag", tag);
+        free(tag);
+    }
+
+    server->send(cnx, reply);
+}
+
 void server_thread(void* arg)
 {
     vws_tcp_svr* server = (vws_tcp_svr*)arg;
@@ -151,6 +208,1782 @@ CTEST(test_msg_server, echo)
     vrtql_msg_svr_free(server);
 }
 
+CTEST(test_msg_server, worker_parse)
+{
+    vrtql_msg_svr* server     = vrtql_msg_svr_new(10, 0, 0);
+    server->process           = process_message;
+    server->base.worker_parse = 1;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    // Wait for server to start up
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    client_test(2, 20);
+
+    // Shutdown
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+CTEST(test_msg_server, deflate)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+    server->base.deflate  = 1;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    vws_cnx_set_deflate(cnx, 12, true);
+    ASSERT_TRUE(vws_connect(cnx, uri));
+    ASSERT_TRUE(vws_cnx_is_deflate(cnx));
+
+    // Large enough to be compressed both ways
+    vws_buffer* payload = vws_buffer_new();
+
+    for (int i = 0; i < 100; i++)
+    {
+        vws_buffer_append(payload, (ucstr)content, strlen(content));
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        vrtql_msg* request = vrtql_msg_new();
+        vws_buffer_append(request->content, payload->data, payload->size);
+        ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+        vrtql_msg_free(request);
+
+        vrtql_msg* reply = vrtql_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(payload->size, reply->content->size);
+        ASSERT_TRUE(memcmp(payload->data, reply->content->data, payload->size) == 0);
+        vrtql_msg_free(reply);
+    }
+
+    vws_buffer_free(payload);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+CTEST(test_msg_server, unix_socket)
+{
+    cstr path = "@vws_test_msg_unix";
+
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+    ASSERT_EQUAL(0, vws_tcp_svr_listen_unix((vws_tcp_svr*)server, path));
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Same handshake and framing, over the Unix socket
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect_unix(cnx, path, uri));
+
+    for (int i = 0; i < 2; i++)
+    {
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_content(request, content);
+        ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+        vrtql_msg_free(request);
+
+        vrtql_msg* reply = vrtql_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(strlen(content), reply->content->size);
+        vrtql_msg_free(reply);
+
+        // Reconnects to the same socket
+        vws_disconnect(cnx);
+        ASSERT_TRUE(vws_reconnect(cnx));
+    }
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+typedef struct fragment_result
+{
+    vws_buffer* message;
+    size_t expected;
+    int frames;
+    int messages;
+    int matched;
+} fragment_result;
+
+static fragment_result fragments;
+
+static void fragment_stream( vws_cnx* c, unsigned char opcode, ucstr data,
+                             size_t size, bool begin, bool end )
+{
+    if (begin == true)
+    {
+        vws_buffer_clear(fragments.message);
+    }
+
+    fragments.frames += (size <= 1000);
+    vws_buffer_append(fragments.message, data, size);
+
+    if (end == true)
+    {
+        vrtql_msg* reply = vrtql_msg_new();
+        ucstr m          = fragments.message->data;
+        size_t n         = fragments.message->size;
+
+        if (vrtql_msg_deserialize(reply, m, n) == true)
+        {
+            fragments.matched += (reply->content->size == fragments.expected);
+        }
+
+        fragments.messages++;
+        vrtql_msg_free(reply);
+    }
+}
+
+CTEST(test_msg_server, fragmentation)
+{
+    vrtql_msg_svr* server  = vrtql_msg_svr_new(2, 0, 0);
+    server->process        = process_message;
+    server->base.max_frame = 1000;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx   = vws_cnx_new();
+    cnx->max_frame = 1000;
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    vws_buffer* payload = vws_buffer_new();
+
+    for (int i = 0; i < 400; i++)
+    {
+        vws_buffer_append(payload, (ucstr)content, strlen(content));
+    }
+
+    // Requests go out fragmented too
+    for (int i = 0; i < 3; i++)
+    {
+        vrtql_msg* request = vrtql_msg_new();
+        vws_buffer_append(request->content, payload->data, payload->size);
+        ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+        vrtql_msg_free(request);
+    }
+
+    // Watch the replies come back a frame at a time
+    fragments.message  = vws_buffer_new();
+    fragments.expected = payload->size;
+    vws_cnx_set_stream(cnx, fragment_stream);
+
+    while (fragments.messages < 3 && vws_socket_read(&cnx->base) > 0)
+    {
+        vws_cnx_ingress(cnx);
+    }
+
+    ASSERT_EQUAL(3, fragments.messages);
+    ASSERT_EQUAL(3, fragments.matched);
+
+    // Replies are a little over 10k each
+    ASSERT_TRUE(fragments.frames >= 3 * 11);
+
+    vws_buffer_free(fragments.message);
+    vws_buffer_free(payload);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// The file both sides send from, and its contents
+static int file_fd           = -1;
+static vws_buffer* file_data = NULL;
+static int file_matched      = 0;
+
+// Check the message against the file, then send the file back
+static void process_file(vws_svr_cnx* cnx, vws_msg* m)
+{
+    ucstr expect = file_data->data + 100;
+    size_t size  = file_data->size - 100;
+
+    if (m->data->size == size && memcmp(m->data->data, expect, size) == 0)
+    {
+        __atomic_add_fetch(&file_matched, 1, __ATOMIC_SEQ_CST);
+    }
+
+    vws_svr_send_file(cnx, file_fd, 100, 0);
+    vws_msg_free(m);
+}
+
+CTEST(test_msg_server, send_file)
+{
+    char path[] = "/tmp/vws_test_fileXXXXXX";
+    file_fd     = mkstemp(path);
+    ASSERT_TRUE(file_fd >= 0);
+    unlink(path);
+
+    file_data = vws_buffer_new();
+
+    for (int i = 0; i < 10000; i++)
+    {
+        vws_buffer_append(file_data, (ucstr)content, strlen(content));
+    }
+
+    ASSERT_EQUAL(file_data->size, write(file_fd, file_data->data, file_data->size));
+
+    vws_svr* server = vws_svr_new(2, 0, 0);
+    server->process = process_file;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    // Whole messages, then fragmented both ways
+    for (int i = 0; i < 2; i++)
+    {
+        server->max_frame = (i == 0) ? 0 : 16384;
+        cnx->max_frame    = server->max_frame;
+
+        ASSERT_TRUE(vws_msg_send_file(cnx, file_fd, 100, 0) > 0);
+
+        vws_msg* reply = vws_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(file_data->size - 100, reply->data->size);
+        ASSERT_TRUE(memcmp( reply->data->data,
+                            file_data->data + 100,
+                            reply->data->size ) == 0);
+        vws_msg_free(reply);
+    }
+
+    ASSERT_EQUAL(2, file_matched);
+
+    // Past the end of the file. The connection carries on.
+    ASSERT_EQUAL(-1, vws_msg_send_file(cnx, file_fd, file_data->size + 1, 0));
+    ASSERT_TRUE(vws_cnx_is_connected(cnx));
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+
+    vws_buffer_free(file_data);
+    close(file_fd);
+}
+
+// Messages past this size are spilled to a file on both sides
+#define SPILL_SIZE 100000
+
+static int spill_mapped = 0;
+
+// Check the message came as a mapping if and only if it is large, and echo it
+static void process_spill(vws_svr_cnx* cnx, vws_msg* m)
+{
+    if (m->mapped == (m->data->size > SPILL_SIZE))
+    {
+        __atomic_add_fetch(&spill_mapped, 1, __ATOMIC_SEQ_CST);
+    }
+
+    vws_svr* server = (vws_svr*)cnx->server;
+    server->send(cnx, m);
+}
+
+CTEST(test_msg_server, spill)
+{
+    vws_svr* server = vws_svr_new(2, 0, 0);
+    server->process = process_spill;
+    server->spill   = SPILL_SIZE;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    cnx->spill   = SPILL_SIZE;
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    vws_buffer* payload = vws_buffer_new();
+
+    while (payload->size < 1000000)
+    {
+        vws_buffer_append(payload, (ucstr)content, strlen(content));
+    }
+
+    // Large and small, whole and then fragmented both ways
+    size_t sizes[] = { payload->size, strlen(content) };
+
+    for (int i = 0; i < 4; i++)
+    {
+        size_t size       = sizes[i % 2];
+        server->max_frame = (i < 2) ? 0 : 16384;
+        cnx->max_frame    = server->max_frame;
+
+        ASSERT_TRUE(vws_msg_send_binary(cnx, payload->data, size) > 0);
+
+        vws_msg* reply = vws_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(size > SPILL_SIZE, reply->mapped);
+        ASSERT_EQUAL(size, reply->data->size);
+        ASSERT_TRUE(memcmp(reply->data->data, payload->data, size) == 0);
+        vws_msg_free(reply);
+    }
+
+    ASSERT_EQUAL(4, spill_mapped);
+
+    vws_buffer_free(payload);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+// Reply with a very large message, two small ones and then a priority one.
+void process_priority(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+    cstr names[]          = {"1", "2", "3", "p"};
+
+    for (int i = 0; i < 4; i++)
+    {
+        vrtql_msg* reply = vrtql_msg_new();
+        reply->format    = cnx->format;
+        vrtql_msg_set_header(reply, "n", names[i]);
+
+        if (i == 0)
+        {
+            // Far more than the socket buffers hold, so it is still going out
+            // when the rest are sent.
+            vws_buffer_reserve(reply->content, 16 << 20);
+            memset(reply->content->data, 'x', 16 << 20);
+            reply->content->size = 16 << 20;
+        }
+
+        if (i == 3)
+        {
+            vws_set_flag(&reply->flags, VM_MSG_PRIORITY);
+        }
+
+        server->send(cnx, reply);
+    }
+
+    vrtql_msg_free(m);
+}
+
+CTEST(test_msg_server, priority)
+{
+    vrtql_msg_svr* server  = vrtql_msg_svr_new(2, 0, 0);
+    server->process        = process_priority;
+    server->base.max_frame = 65536;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    vrtql_msg* request = vrtql_msg_new();
+    vrtql_msg_set_content(request, content);
+    ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+    vrtql_msg_free(request);
+
+    // Let everything be queued before reading
+    vws_msleep(200);
+
+    char order[5] = {0};
+
+    for (int i = 0; i < 4; i++)
+    {
+        vrtql_msg* reply = vrtql_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+
+        cstr n   = vrtql_msg_get_header(reply, "n");
+        order[i] = (n != NULL) ? n[0] : '?';
+
+        if (order[i] == '1')
+        {
+            ASSERT_EQUAL(16 << 20, (int)reply->content->size);
+        }
+
+        vrtql_msg_free(reply);
+    }
+
+    // The priority reply cannot enter the large message part way, but it goes
+    // ahead of the small ones waiting behind it.
+    ASSERT_NOT_NULL(strchr(order, 'p'));
+    ASSERT_TRUE(strchr(order, 'p') < strchr(order, '2'));
+    ASSERT_TRUE(strchr(order, '2') < strchr(order, '3'));
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// Subscribe, unsubscribe and publish on request, acknowledging each.
+void process_pubsub(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+    cstr action           = vrtql_msg_get_header(m, "action");
+
+    if (strcmp(action, "subscribe") == 0)
+    {
+        vws_tcp_svr_subscribe(cnx, "ticks");
+    }
+    else if (strcmp(action, "unsubscribe") == 0)
+    {
+        vws_tcp_svr_unsubscribe(cnx, "ticks");
+    }
+    else if (strcmp(action, "publish") == 0)
+    {
+        vrtql_msg* tick = vrtql_msg_new();
+        vrtql_msg_set_header(tick, "action", "tick");
+        vws_buffer_append(tick->content, m->content->data, m->content->size);
+        vrtql_msg_svr_publish(server, "ticks", tick);
+    }
+
+    vrtql_msg* reply = vrtql_msg_new();
+    reply->format    = cnx->format;
+    vrtql_msg_set_header(reply, "action", action);
+    server->send(cnx, reply);
+
+    vrtql_msg_free(m);
+}
+
+// Sends a request and returns the next message received.
+static vrtql_msg* pubsub_call(vws_cnx* cnx, cstr action, cstr content)
+{
+    vrtql_msg* request = vrtql_msg_new();
+    vrtql_msg_set_header(request, "action", action);
+    vrtql_msg_set_content(request, content);
+    vrtql_msg_send(cnx, request);
+    vrtql_msg_free(request);
+
+    return vrtql_msg_recv(cnx);
+}
+
+// Checks received message has the given action and frees it.
+static bool pubsub_is(vrtql_msg* m, cstr action)
+{
+    if (m == NULL)
+    {
+        return false;
+    }
+
+    cstr value = vrtql_msg_get_header(m, "action");
+    bool match = (value != NULL && strcmp(value, action) == 0);
+    vrtql_msg_free(m);
+
+    return match;
+}
+
+CTEST(test_msg_server, pubsub)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_pubsub;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnxs[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        cnxs[i] = vws_cnx_new();
+        ASSERT_TRUE(vws_connect(cnxs[i], uri));
+    }
+
+    // The first two subscribe. The reply comes after the subscription.
+    ASSERT_TRUE(pubsub_is(pubsub_call(cnxs[0], "subscribe", ""), "subscribe"));
+    ASSERT_TRUE(pubsub_is(pubsub_call(cnxs[1], "subscribe", ""), "subscribe"));
+
+    // The third publishes and gets only its reply
+    ASSERT_TRUE(pubsub_is(pubsub_call(cnxs[2], "publish", "1"), "publish"));
+
+    for (int i = 0; i < 2; i++)
+    {
+        vrtql_msg* tick = vrtql_msg_recv(cnxs[i]);
+        ASSERT_NOT_NULL(tick);
+        ASSERT_EQUAL(1, (int)tick->content->size);
+        ASSERT_TRUE(pubsub_is(tick, "tick"));
+    }
+
+    // Once unsubscribed, the first gets no more ticks. The second still does.
+    ASSERT_TRUE(pubsub_is(pubsub_call(cnxs[0], "unsubscribe", ""), "unsubscribe"));
+    ASSERT_TRUE(pubsub_is(pubsub_call(cnxs[2], "publish", "2"), "publish"));
+    ASSERT_TRUE(pubsub_is(vrtql_msg_recv(cnxs[1]), "tick"));
+
+    // Anything the first got would have been queued ahead of this reply
+    ASSERT_TRUE(pubsub_is(pubsub_call(cnxs[0], "echo", ""), "echo"));
+
+    // Subscriptions go with the connection
+    vws_disconnect(cnxs[1]);
+    ASSERT_TRUE(pubsub_is(pubsub_call(cnxs[2], "publish", "3"), "publish"));
+
+    for (int i = 0; i < 3; i++)
+    {
+        vws_disconnect(cnxs[i]);
+        vws_cnx_free(cnxs[i]);
+    }
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+typedef struct rpc_result
+{
+    int completed;
+    int matched;
+} rpc_result;
+
+static void rpc_done(vrtql_rpc* rpc, vrtql_msg* reply, void* data)
+{
+    rpc_result* result = (rpc_result*)rpc->data;
+    char expected[32];
+
+    result->completed++;
+
+    if (reply == NULL)
+    {
+        return;
+    }
+
+    // Each call carries its own index as content
+    snprintf(expected, sizeof(expected), "%i", (int)(intptr_t)data);
+
+    ucstr content = reply->content->data;
+    size_t size   = reply->content->size;
+
+    if (size == strlen(expected) && strncmp(expected, (cstr)content, size) == 0)
+    {
+        result->matched++;
+    }
+
+    vrtql_msg_free(reply);
+}
+
+// Serve /health, nothing else
+int process_http( vws_svr_cnx* cnx,
+                  vws_http_msg* req,
+                  cstr data,
+                  size_t size,
+                  vws_buffer* body )
+{
+    char url[64];
+
+    if (vws_http_msg_span(req, data, VWS_HTTP_URL, url, 64) == NULL
+        || strcmp(url, "/health") != 0)
+    {
+        return 404;
+    }
+
+    vws_buffer_append(body, (ucstr)"ok", 2);
+
+    return 200;
+}
+
+// Reads one whole response, whose body is short, off the socket
+bool http_response(vws_socket* s)
+{
+    while ( s->buffer->data == NULL
+            || strstr((cstr)s->buffer->data, "\r\n\r\n") == NULL )
+    {
+        if (vws_socket_read(s) <= 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+CTEST(test_msg_server, http)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+    server->base.on_http  = process_http;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    cstr health = "GET /health HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    cstr other  = "GET /other HTTP/1.1\r\nHost: localhost\r\n"
+                  "Connection: close\r\n\r\n";
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    // Two requests on the same connection
+    for (int i = 0; i < 2; i++)
+    {
+        vws_socket_write(s, (ucstr)health, strlen(health));
+        ASSERT_TRUE(http_response(s));
+
+        cstr r = (cstr)s->buffer->data;
+        ASSERT_TRUE(strncmp(r, "HTTP/1.1 200 OK\r\n", 17) == 0);
+        ASSERT_NOT_NULL(strstr(r, "Content-Length: 2\r\n"));
+
+        while (strstr((cstr)s->buffer->data, "\r\n\r\nok") == NULL)
+        {
+            ASSERT_TRUE(vws_socket_read(s) > 0);
+        }
+
+        vws_buffer_clear(s->buffer);
+    }
+
+    // Then one that asks for the connection to be closed
+    vws_socket_write(s, (ucstr)other, strlen(other));
+    ASSERT_TRUE(http_response(s));
+    ASSERT_TRUE(strncmp((cstr)s->buffer->data, "HTTP/1.1 404", 12) == 0);
+
+    while (vws_socket_read(s) >= 0)
+    {
+    }
+
+    vws_socket_free(s);
+
+    // WebSocket clients still get through
+    client_test(1, 5);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+CTEST(test_msg_server, keepalive)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+
+    vws_tcp_svr* base = (vws_tcp_svr*)server;
+    base->keepalive   = 200;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state(base) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    // Stay quiet long enough for the server to ask after us
+    vws_msleep(600);
+
+    vws_buffer* b = cnx->base.buffer;
+
+    while (b->size < 2 && vws_socket_read(&cnx->base) > 0)
+    {
+    }
+
+    ASSERT_TRUE(b->size >= 2);
+    ASSERT_EQUAL(0x89, b->data[0]);
+    ASSERT_EQUAL(0x00, b->data[1]);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop(base);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+CTEST(test_msg_server, metrics)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    client_test(2, 10);
+
+    vws_svr_metrics* m = vws.malloc(sizeof(vws_svr_metrics));
+    vws_tcp_svr_metrics((vws_tcp_svr*)server, m);
+
+    ASSERT_TRUE(m->connections >= 2);
+    ASSERT_TRUE(m->bytes_in > 0);
+    ASSERT_TRUE(m->bytes_out > 0);
+
+    uint64_t in  = m->messages_in[TEXT_FRAME] + m->messages_in[BINARY_FRAME];
+    uint64_t out = m->messages_out[TEXT_FRAME] + m->messages_out[BINARY_FRAME];
+    ASSERT_TRUE(in > 0);
+    ASSERT_TRUE(out > 0);
+
+    ASSERT_TRUE(m->requests > 0);
+    ASSERT_TRUE(m->responses > 0);
+    ASSERT_TRUE(m->wakeups > 0);
+    ASSERT_TRUE(m->wakeups <= m->responses);
+    ASSERT_TRUE(m->processing.count > 0);
+    ASSERT_TRUE(m->writes.count > 0);
+
+    uint64_t p50 = vws_svr_histogram_percentile(&m->processing, 50);
+    uint64_t p99 = vws_svr_histogram_percentile(&m->processing, 99);
+    ASSERT_TRUE(p50 <= p99);
+    ASSERT_TRUE(p99 <= m->processing.max);
+
+    vws.free(m);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+static int samples_taken = 0;
+static int samples_ordered = 0;
+
+static void on_sample(vws_tcp_svr* s, const vws_svr_timing* t)
+{
+    bool ordered = t->read > 0
+                && t->read       <= t->queued
+                && t->queued     <= t->dequeued
+                && t->dequeued   <= t->handled
+                && t->handled    <= t->dispatched
+                && t->dispatched <= t->written
+                && t->written    <= t->completed;
+
+    __atomic_add_fetch(&samples_taken, 1, __ATOMIC_RELAXED);
+
+    if (ordered == true)
+    {
+        __atomic_add_fetch(&samples_ordered, 1, __ATOMIC_RELAXED);
+    }
+}
+
+CTEST(test_msg_server, sampling)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+
+    vws_tcp_svr* tcp = (vws_tcp_svr*)server;
+    tcp->on_sample   = on_sample;
+    tcp->sample_rate = 2;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    client_test(2, 10);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+
+    // Every other request, each with all its stages in order
+    int taken = __atomic_load_n(&samples_taken, __ATOMIC_RELAXED);
+    ASSERT_TRUE(taken > 0);
+    ASSERT_EQUAL(taken, __atomic_load_n(&samples_ordered, __ATOMIC_RELAXED));
+}
+
+CTEST(test_msg_server, rpc_pipeline)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_rpc;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    rpc_result result = {0, 0};
+    vrtql_rpc* rpc    = vrtql_rpc_new(cnx);
+    rpc->data         = &result;
+
+    // Put every call in flight before reading a single response
+    int calls = 1000;
+
+    for (int i = 0; i < calls; i++)
+    {
+        char content[32];
+        snprintf(content, sizeof(content), "%i", i);
+
+        vrtql_msg* req = vrtql_msg_new();
+        vrtql_msg_set_content(req, content);
+        ASSERT_TRUE(vrtql_rpc_send(rpc, req, rpc_done, (void*)(intptr_t)i));
+        vrtql_msg_free(req);
+    }
+
+    ASSERT_EQUAL(calls, (int)vrtql_rpc_pending(rpc));
+
+    int tries = 0;
+    while (vrtql_rpc_pending(rpc) > 0 && tries++ < 100)
+    {
+        ASSERT_TRUE(vrtql_rpc_poll(rpc) >= 0);
+    }
+
+    ASSERT_EQUAL(calls, result.completed);
+    ASSERT_EQUAL(calls, result.matched);
+
+    // A synchronous call still works alongside
+    vrtql_msg* req = vrtql_msg_new();
+    vrtql_msg_set_content(req, content);
+    ASSERT_TRUE(vrtql_rpc_send(rpc, req, rpc_done, (void*)(intptr_t)-1));
+    vrtql_msg* reply = vrtql_rpc_exec(rpc, req);
+    ASSERT_NOT_NULL(reply);
+    vrtql_msg_free(reply);
+    vrtql_msg_free(req);
+
+    // The async call answered while waiting in exec was completed, not lost
+    ASSERT_EQUAL(calls + 1, result.completed);
+
+    vrtql_rpc_free(rpc);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// Calls to test.later waiting for the completer, with their content
+static vrtql_rpc_reply* deferred_tokens[256];
+static char* deferred_content[256];
+static int deferred_count   = 0;
+static int deferred_release = 0;
+static uv_mutex_t deferred_lock;
+
+// RPC Call: test.later. Answered later by deferred_thread().
+vrtql_msg* rpc_later(vrtql_rpc_env* e, vrtql_msg* m)
+{
+    vrtql_rpc_reply* r = vrtql_rpc_defer(e, m);
+
+    if (r == NULL)
+    {
+        return NULL;
+    }
+
+    uv_mutex_lock(&deferred_lock);
+    deferred_tokens[deferred_count]  = r;
+    deferred_content[deferred_count] = strndup( (cstr)m->content->data,
+                                                m->content->size );
+    deferred_count++;
+    uv_mutex_unlock(&deferred_lock);
+
+    return NULL;
+}
+
+// Service messages through the RPC system, letting calls be deferred
+void process_rpc_deferred(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    cstr t    = vrtql_msg_get_routing(m, "tag");
+    char* tag = (t != NULL) ? strdup(t) : NULL;
+
+    vrtql_rpc_env env;
+    vrtql_msg_svr_rpc_env(cnx, &env);
+    vrtql_msg* reply = vrtql_rpc_service(rpc_system, &env, m);
+
+    if (reply == NULL && env.deferred == true)
+    {
+        free(tag);
+        return;
+    }
+
+    if (reply == NULL)
+    {
+        reply = vrtql_msg_new();
+        vrtql_msg_set_header(reply, "rc", "1");
+    }
+
+    if (tag != NULL)
+    {
+        vrtql_msg_set_routing(reply, "tag", tag);
+        free(tag);
+    }
+
+    server->send(cnx, reply);
+}
+
+// Completes the deferred calls, from a thread of its own, once released
+void deferred_thread(void* arg)
+{
+    while (__atomic_load_n(&deferred_release, __ATOMIC_SEQ_CST) == 0)
+    {
+        vws_msleep(10);
+    }
+
+    uv_mutex_lock(&deferred_lock);
+
+    for (int i = 0; i < deferred_count; i++)
+    {
+        vrtql_msg* reply = vrtql_msg_new();
+        vrtql_msg_set_header(reply, "rc", "0");
+        vrtql_msg_set_content(reply, deferred_content[i]);
+
+        vrtql_rpc_complete(deferred_tokens[i], reply);
+        free(deferred_content[i]);
+    }
+
+    uv_mutex_unlock(&deferred_lock);
+}
+
+CTEST(test_msg_server, rpc_defer)
+{
+    rpc_system               = vrtql_rpc_system_new();
+    vrtql_rpc_module* module = vrtql_rpc_module_new("test");
+    vrtql_rpc_module_set(module, "echo", rpc_echo);
+    vrtql_rpc_module_set(module, "later", rpc_later);
+    vrtql_rpc_system_set(rpc_system, module);
+
+    uv_mutex_init(&deferred_lock);
+
+    // A single worker
+    vrtql_msg_svr* server = vrtql_msg_svr_new(1, 0, 0);
+    server->process       = process_rpc_deferred;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    uv_thread_t completer;
+    uv_thread_create(&completer, deferred_thread, NULL);
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    rpc_result result = {0, 0};
+    vrtql_rpc* rpc    = vrtql_rpc_new(cnx);
+    rpc->data         = &result;
+
+    int calls = 100;
+
+    for (int i = 0; i < calls; i++)
+    {
+        char content[32];
+        snprintf(content, sizeof(content), "%i", i);
+
+        vrtql_msg* req = vrtql_msg_new();
+        vrtql_msg_set_header(req, "id", "test.later");
+        vrtql_msg_set_content(req, content);
+        ASSERT_TRUE(vrtql_rpc_send(rpc, req, rpc_done, (void*)(intptr_t)i));
+        vrtql_msg_free(req);
+    }
+
+    // None of them holds up the worker
+    vrtql_msg* req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", "test.echo");
+    vrtql_msg_set_content(req, content);
+    vrtql_msg* reply = vrtql_rpc_exec(rpc, req);
+    ASSERT_NOT_NULL(reply);
+    ASSERT_STR("0", vrtql_msg_get_header(reply, "rc"));
+    vrtql_msg_free(reply);
+    vrtql_msg_free(req);
+
+    ASSERT_EQUAL(0, result.completed);
+    ASSERT_EQUAL(calls, __atomic_load_n(&deferred_count, __ATOMIC_SEQ_CST));
+
+    // Complete them all from the other thread
+    __atomic_store_n(&deferred_release, 1, __ATOMIC_SEQ_CST);
+
+    int tries = 0;
+    while (vrtql_rpc_pending(rpc) > 0 && tries++ < 100)
+    {
+        ASSERT_TRUE(vrtql_rpc_poll(rpc) >= 0);
+    }
+
+    ASSERT_EQUAL(calls, result.completed);
+    ASSERT_EQUAL(calls, result.matched);
+
+    // Calls in a batch cannot be deferred. They fail in place.
+    vrtql_rpc_batch* b = vrtql_rpc_batch_new();
+    req                = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", "test.later");
+    vrtql_rpc_batch_add(b, req);
+
+    ASSERT_TRUE(vrtql_rpc_batch_exec(rpc, b));
+    reply = vrtql_rpc_batch_reply(b, 0);
+    ASSERT_NOT_NULL(reply);
+    ASSERT_TRUE(strcmp(vrtql_msg_get_header(reply, "rc"), "0") != 0);
+    vrtql_rpc_batch_free(b);
+
+    vrtql_rpc_free(rpc);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    uv_thread_join(&completer);
+    uv_mutex_destroy(&deferred_lock);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+    vrtql_rpc_system_free(rpc_system);
+}
+
+CTEST(test_msg_server, rpc_batch)
+{
+    rpc_system               = vrtql_rpc_system_new();
+    vrtql_rpc_module* module  = vrtql_rpc_module_new("test");
+    vrtql_rpc_module_set(module, "echo", rpc_echo);
+    vrtql_rpc_system_set(rpc_system, module);
+
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_rpc_service;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+    vrtql_rpc* rpc = vrtql_rpc_new(cnx);
+
+    // Many calls, one round-trip. Every 10th call does not exist.
+    int calls          = 50;
+    vrtql_rpc_batch* b = vrtql_rpc_batch_new();
+
+    for (int i = 0; i < calls; i++)
+    {
+        char content[32];
+        snprintf(content, sizeof(content), "%i", i);
+
+        vrtql_msg* req = vrtql_msg_new();
+        vrtql_msg_set_header(req, "id", (i % 10) ? "test.echo" : "test.none");
+        vrtql_msg_set_content(req, content);
+        vrtql_rpc_batch_add(b, req);
+    }
+
+    ASSERT_TRUE(vrtql_rpc_batch_exec(rpc, b));
+
+    for (int i = 0; i < calls; i++)
+    {
+        vrtql_msg* reply = vrtql_rpc_batch_reply(b, i);
+        ASSERT_NOT_NULL(reply);
+
+        cstr rc = vrtql_msg_get_header(reply, "rc");
+        ASSERT_NOT_NULL(rc);
+
+        if (i % 10 == 0)
+        {
+            ASSERT_TRUE(strcmp(rc, "0") != 0);
+            ASSERT_NOT_NULL(vrtql_msg_get_header(reply, "msg"));
+            continue;
+        }
+
+        char content[32];
+        snprintf(content, sizeof(content), "%i", i);
+
+        ASSERT_STR("0", rc);
+        ASSERT_EQUAL(strlen(content), reply->content->size);
+        ASSERT_TRUE(strncmp(content, (cstr)reply->content->data, reply->content->size) == 0);
+    }
+
+    // Batches can be reused
+    ASSERT_TRUE(vrtql_rpc_batch_exec(rpc, b));
+    ASSERT_NOT_NULL(vrtql_rpc_batch_reply(b, calls - 1));
+    ASSERT_NULL(vrtql_rpc_batch_reply(b, calls));
+
+    vrtql_rpc_batch_free(b);
+    vrtql_rpc_free(rpc);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+    vrtql_rpc_system_free(rpc_system);
+}
+
+// Messages the server was given from its worker arenas
+static int arena_messages = 0;
+
+// Echo headers and content back. Runs in a worker with an arena.
+static void process_arena(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    if (vws_is_flag(&m->flags, VM_MSG_ARENA))
+    {
+        __atomic_add_fetch(&arena_messages, 1, __ATOMIC_RELAXED);
+    }
+
+    vrtql_msg* reply = vrtql_msg_new();
+    reply->format    = cnx->format;
+
+    cstr key; cstr value;
+    sc_map_foreach(&m->headers, key, value)
+    {
+        vrtql_msg_set_header(reply, key, value);
+    }
+
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    server->send(cnx, reply);
+    vrtql_msg_free(m);
+}
+
+CTEST(test_msg_server, arena)
+{
+    vrtql_msg_svr* server        = vrtql_msg_svr_new(2, 0, 0);
+    server->process              = process_arena;
+    server->base.base.arena_size = 1024;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    // JSON with more headers than fit in a message, so the server parses
+    // documents and spills strings into blocks, all from the arena
+    int count = 100;
+
+    for (int i = 0; i < count; i++)
+    {
+        vrtql_msg* request = vrtql_msg_new();
+        request->format    = VM_JSON_FORMAT;
+
+        for (int j = 0; j < 40; j++)
+        {
+            char key[16];
+            char value[32];
+            snprintf(key, sizeof(key), "key-%i", j);
+            snprintf(value, sizeof(value), "value-%i-%i", i, j);
+            vrtql_msg_set_header(request, key, value);
+        }
+
+        vrtql_msg_set_content(request, content);
+        ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+        vrtql_msg_free(request);
+
+        vrtql_msg* reply = vrtql_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+
+        char value[32];
+        snprintf(value, sizeof(value), "value-%i-39", i);
+        ASSERT_STR(value, vrtql_msg_get_header(reply, "key-39"));
+        ASSERT_EQUAL(strlen(content), reply->content->size);
+
+        vrtql_msg_free(reply);
+    }
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+
+    ASSERT_EQUAL(count, __atomic_load_n(&arena_messages, __ATOMIC_RELAXED));
+}
+
+// Calls to the batch handler and the largest batch it was given
+static int batch_calls = 0;
+static int batch_most  = 0;
+
+// Echo each message of the batch. The first call is slow so that the rest
+// of the requests pile up behind it.
+static void process_batch(vws_svr_cnx* cnx, vrtql_msg** m, size_t n)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    if (__atomic_fetch_add(&batch_calls, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        vws_msleep(100);
+    }
+
+    if ((int)n > batch_most)
+    {
+        batch_most = (int)n;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vrtql_msg* reply = vrtql_msg_new();
+        reply->format    = cnx->format;
+        vws_buffer_append( reply->content,
+                           m[i]->content->data, m[i]->content->size );
+
+        server->send(cnx, reply);
+        vrtql_msg_free(m[i]);
+    }
+}
+
+CTEST(test_msg_server, process_batch)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(1, 0, 0);
+    server->process_batch = process_batch;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    // Send them all, then read the replies
+    int count = 200;
+
+    for (int i = 0; i < count; i++)
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%i", i);
+
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_content(request, text);
+        ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+        vrtql_msg_free(request);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%i", i);
+
+        vrtql_msg* reply = vrtql_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(strlen(text), reply->content->size);
+        ASSERT_TRUE(memcmp(reply->content->data, text, strlen(text)) == 0);
+        vrtql_msg_free(reply);
+    }
+
+    // Handled in batches, but never more at once than allowed
+    ASSERT_TRUE(batch_calls < count);
+    ASSERT_TRUE(batch_most > 1);
+    ASSERT_TRUE(batch_most <= VWS_SVR_BATCH);
+
+    // The loop is woken once for many of the responses
+    vws_svr_metrics* m = vws.malloc(sizeof(vws_svr_metrics));
+    vws_tcp_svr_metrics((vws_tcp_svr*)server, m);
+    ASSERT_TRUE(m->wakeups < (uint64_t)count);
+    vws.free(m);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// Requests processed by process_deadline
+static int deadline_seen = 0;
+
+// Echo, taking long enough over the first request for the ones behind it to
+// expire
+static void process_deadline(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    if (__atomic_fetch_add(&deadline_seen, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        vws_msleep(300);
+    }
+
+    vrtql_msg* reply = vrtql_msg_new();
+    reply->format    = cnx->format;
+
+    cstr tag = vrtql_msg_get_routing(m, "tag");
+
+    if (tag != NULL)
+    {
+        vrtql_msg_set_routing(reply, "tag", tag);
+    }
+
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    server->send(cnx, reply);
+    vrtql_msg_free(m);
+}
+
+CTEST(test_msg_server, deadline)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(1, 0, 0);
+    server->process       = process_deadline;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    // The first has no deadline and holds up the worker. The next five give up
+    // long before it is done. The last can wait.
+    cstr deadlines[] = { NULL, "50", "50", "50", "50", "50", "10000" };
+    int count        = sizeof(deadlines) / sizeof(deadlines[0]);
+
+    for (int i = 0; i < count; i++)
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%i", i);
+
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_content(request, text);
+
+        if (deadlines[i] != NULL)
+        {
+            vrtql_msg_set_routing(request, VM_DEADLINE, deadlines[i]);
+        }
+
+        ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+        vrtql_msg_free(request);
+    }
+
+    // Only the first and last are answered
+    int answered[] = { 0, count - 1 };
+
+    for (int i = 0; i < 2; i++)
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%i", answered[i]);
+
+        vrtql_msg* reply = vrtql_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(strlen(text), reply->content->size);
+        ASSERT_TRUE(memcmp(reply->content->data, text, strlen(text)) == 0);
+        vrtql_msg_free(reply);
+    }
+
+    ASSERT_EQUAL(2, deadline_seen);
+
+    vws_svr_metrics* m = vws.malloc(sizeof(vws_svr_metrics));
+    vws_tcp_svr_metrics((vws_tcp_svr*)server, m);
+    ASSERT_EQUAL(count - 2, m->expired);
+    vws.free(m);
+
+    // RPC calls carry the time the client waits for them
+    vrtql_rpc* rpc = vrtql_rpc_new(cnx);
+
+    vrtql_msg* req = vrtql_msg_new();
+    vrtql_msg_set_content(req, content);
+    vrtql_msg* reply = vrtql_rpc_exec(rpc, req);
+    ASSERT_NOT_NULL(reply);
+
+    char expected[24];
+    snprintf(expected, sizeof(expected), "%i", cnx->base.timeout * 5);
+    ASSERT_STR(expected, vrtql_msg_get_routing(req, VM_DEADLINE));
+
+    vrtql_msg_free(reply);
+    vrtql_msg_free(req);
+    vrtql_rpc_free(rpc);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// Sends requests back as they are, unless the routing says otherwise.
+// Counts those still undecoded when they arrive.
+static int lazy_seen = 0;
+
+void process_lazy(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    if (vws_is_flag(&m->flags, VM_MSG_LAZY) == true)
+    {
+        __atomic_add_fetch(&lazy_seen, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (vrtql_msg_get_routing(m, "upper") != NULL)
+    {
+        // Needs the content
+        for (size_t i = 0; i < vrtql_msg_get_content_size(m); i++)
+        {
+            m->content->data[i] = toupper(m->content->data[i]);
+        }
+    }
+
+    server->send(cnx, m);
+}
+
+CTEST(test_msg_server, lazy)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_lazy;
+    server->lazy          = true;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    vrtql_msg_format_t formats[] = { VM_MPACK_FORMAT, VM_JSON_FORMAT };
+
+    for (int i = 0; i < 2; i++)
+    {
+        for (int upper = 0; upper < 2; upper++)
+        {
+            vrtql_msg* request = vrtql_msg_new();
+            request->format    = formats[i];
+            vrtql_msg_set_routing(request, "to", "me");
+            vrtql_msg_set_header(request, "id", "lazy");
+            vrtql_msg_set_content(request, "abc");
+
+            if (upper == 1)
+            {
+                vrtql_msg_set_routing(request, "upper", "1");
+            }
+
+            ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+            vrtql_msg_free(request);
+
+            vrtql_msg* reply = vrtql_msg_recv(cnx);
+            ASSERT_NOT_NULL(reply);
+            ASSERT_EQUAL(formats[i], reply->format);
+            ASSERT_STR("me", vrtql_msg_get_routing(reply, "to"));
+            ASSERT_STR("lazy", vrtql_msg_get_header(reply, "id"));
+            ASSERT_EQUAL(3, reply->content->size);
+
+            cstr expected = (upper == 1) ? "ABC" : "abc";
+            ASSERT_TRUE(memcmp(reply->content->data, expected, 3) == 0);
+            vrtql_msg_free(reply);
+        }
+    }
+
+    ASSERT_EQUAL(4, lazy_seen);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// The proxy's upstream connection and the reply it is relaying back
+static vws_cnx* relay_upstream = NULL;
+static bool relay_done         = false;
+static int relay_fragments     = 0;
+
+// Upstream to client, a fragment at a time
+static void relay_out( vws_cnx* c,
+                       unsigned char opcode,
+                       ucstr data,
+                       size_t size,
+                       bool begin,
+                       bool end )
+{
+    vws_svr_relay((vws_svr_cnx*)c->data, opcode, data, size, begin, end);
+    relay_fragments++;
+    relay_done = end;
+}
+
+// Client to upstream, a fragment at a time. Runs in the proxy's worker.
+static void relay_in( vws_svr_cnx* cnx,
+                      unsigned char opcode,
+                      ucstr data,
+                      size_t size,
+                      bool begin,
+                      bool end )
+{
+    if (relay_upstream == NULL)
+    {
+        relay_upstream = vws_cnx_new();
+        vws_connect_unix(relay_upstream, "@vws_test_relay", uri);
+        relay_upstream->data = (char*)cnx;
+        vws_cnx_set_stream(relay_upstream, relay_out);
+    }
+
+    vws_frame_relay(relay_upstream, opcode, data, size, begin, end);
+
+    if (end == true)
+    {
+        // Pass the reply back as it comes
+        relay_done = false;
+
+        while (relay_done == false && vws_socket_read(&relay_upstream->base) > 0)
+        {
+            vws_cnx_ingress(relay_upstream);
+        }
+    }
+}
+
+static void process_echo(vws_svr_cnx* cnx, vws_msg* m)
+{
+    vws_svr* server = (vws_svr*)cnx->server;
+    server->send(cnx, m);
+}
+
+CTEST(test_msg_server, relay)
+{
+    // The upstream server echoes in 1000 byte fragments
+    vws_svr* origin   = vws_svr_new(1, 0, 0);
+    origin->process   = process_echo;
+    origin->max_frame = 1000;
+    ASSERT_EQUAL(0, vws_tcp_svr_listen_unix((vws_tcp_svr*)origin, "@vws_test_relay"));
+
+    uv_thread_t origin_tid;
+    uv_thread_create(&origin_tid, server_thread, origin);
+
+    vws_svr* proxy   = vws_svr_new(1, 0, 0);
+    proxy->on_stream = relay_in;
+
+    uv_thread_t proxy_tid;
+    uv_thread_create(&proxy_tid, server_thread, proxy);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)origin) != VS_RUNNING ||
+           vws_tcp_svr_state((vws_tcp_svr*)proxy) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx   = vws_cnx_new();
+    cnx->max_frame = 3000;
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    vws_buffer* payload = vws_buffer_new();
+
+    for (int i = 0; i < 400; i++)
+    {
+        vws_buffer_append(payload, (ucstr)content, strlen(content));
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_binary(cnx, payload->data, payload->size) > 0);
+
+        vws_msg* reply = vws_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(BINARY_FRAME, reply->opcode);
+        ASSERT_EQUAL(payload->size, reply->data->size);
+        ASSERT_TRUE(memcmp(reply->data->data, payload->data, payload->size) == 0);
+        vws_msg_free(reply);
+    }
+
+    // Small ones pass through whole
+    ASSERT_TRUE(vws_msg_send_text(cnx, "hello") > 0);
+    vws_msg* reply = vws_msg_recv(cnx);
+    ASSERT_NOT_NULL(reply);
+    ASSERT_EQUAL(TEXT_FRAME, reply->opcode);
+    ASSERT_EQUAL(5, reply->data->size);
+    ASSERT_TRUE(memcmp(reply->data->data, "hello", 5) == 0);
+    vws_msg_free(reply);
+
+    // Replies came back in the origin's fragments, not reassembled
+    ASSERT_EQUAL(3 * 11 + 1, relay_fragments);
+
+    vws_buffer_free(payload);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)proxy);
+    uv_thread_join(&proxy_tid);
+    vws_svr_free(proxy);
+
+    vws_disconnect(relay_upstream);
+    vws_cnx_free(relay_upstream);
+    relay_upstream = NULL;
+
+    vws_tcp_svr_stop((vws_tcp_svr*)origin);
+    uv_thread_join(&origin_tid);
+    vws_svr_free(origin);
+}
+
+// Responses to calls made through the pool
+static int pool_replies = 0;
+
+static void pool_reply(vrtql_rpc* rpc, vrtql_msg* reply, void* data)
+{
+    if (reply != NULL)
+    {
+        pool_replies++;
+        vrtql_msg_free(reply);
+    }
+}
+
+void second_server_thread(void* arg)
+{
+    vws_tcp_svr_run((vws_tcp_svr*)arg, server_host, server_port + 1);
+}
+
+CTEST(test_msg_server, rpc_pool)
+{
+    // Only the first endpoint is up to begin with
+    vrtql_msg_svr* first = vrtql_msg_svr_new(2, 0, 0);
+    first->process       = process_rpc;
+
+    uv_thread_t first_tid;
+    uv_thread_create(&first_tid, server_thread, first);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)first) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    cstr urls[]          = { uri, "ws://localhost:8182/websocket" };
+    vrtql_rpc_pool* pool = vrtql_rpc_pool_new(urls, 2, 2);
+    ASSERT_EQUAL(4, pool->size);
+    ASSERT_EQUAL(2, vrtql_rpc_pool_up(pool));
+
+    // Spread evenly over the connections that are up
+    for (int i = 0; i < 8; i++)
+    {
+        vrtql_msg* req = vrtql_msg_new();
+        vrtql_msg_set_content(req, content);
+        ASSERT_TRUE(vrtql_rpc_pool_send(pool, req, pool_reply, NULL));
+        vrtql_msg_free(req);
+    }
+
+    ASSERT_EQUAL(4, vrtql_rpc_pending(pool->cnxs[0].rpc));
+    ASSERT_EQUAL(4, vrtql_rpc_pending(pool->cnxs[2].rpc));
+
+    for (int i = 0; i < 50 && pool_replies < 8; i++)
+    {
+        ASSERT_TRUE(vrtql_rpc_pool_poll(pool, 100) >= 0);
+    }
+
+    ASSERT_EQUAL(8, pool_replies);
+
+    vrtql_msg* req   = vrtql_msg_new();
+    vrtql_msg_set_content(req, content);
+    vrtql_msg* reply = vrtql_rpc_pool_exec(pool, req);
+    ASSERT_NOT_NULL(reply);
+    ASSERT_EQUAL(strlen(content), reply->content->size);
+    vrtql_msg_free(reply);
+
+    // The second comes up and is connected in the background
+    vrtql_msg_svr* second = vrtql_msg_svr_new(2, 0, 0);
+    second->process       = process_rpc;
+
+    uv_thread_t second_tid;
+    uv_thread_create(&second_tid, second_server_thread, second);
+
+    for (int i = 0; i < 100 && vrtql_rpc_pool_up(pool) < 4; i++)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_EQUAL(4, vrtql_rpc_pool_up(pool));
+
+    // The first goes away. Calls carry on over the second, at worst losing
+    // those already sent on each connection to the first.
+    vws_tcp_svr_stop((vws_tcp_svr*)first);
+    uv_thread_join(&first_tid);
+    vrtql_msg_svr_free(first);
+
+    int answered = 0;
+
+    for (int i = 0; i < 10; i++)
+    {
+        reply = vrtql_rpc_pool_exec(pool, req);
+
+        if (reply != NULL)
+        {
+            answered++;
+            vrtql_msg_free(reply);
+        }
+    }
+
+    ASSERT_TRUE(answered >= 8);
+    ASSERT_EQUAL(2, vrtql_rpc_pool_up(pool));
+
+    vrtql_msg_free(req);
+    vrtql_rpc_pool_free(pool);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)second);
+    uv_thread_join(&second_tid);
+    vrtql_msg_svr_free(second);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
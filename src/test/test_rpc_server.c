@@ -76,6 +76,52 @@ CTEST(test_rpc, server_side_service)
     vrtql_rpc_system_free(system);
 }
 
+CTEST(test_rpc, server_side_dispatch)
+{
+    vrtql_rpc_system* system = vrtql_rpc_system_new();
+    vrtql_rpc_module* module = vrtql_rpc_module_new("session");
+    vrtql_rpc_module_set(module, "login", session_login);
+    vrtql_rpc_system_set(system, module);
+
+    // Calls added after registration are dispatched too
+    vrtql_rpc_module_set(module, "info", session_info);
+
+    vrtql_rpc_env env;
+    vrtql_msg* req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", "session.info");
+    vrtql_msg* reply = vrtql_rpc_service(system, &env, req);
+    ASSERT_TRUE(reply != NULL);
+    vrtql_msg_free(reply);
+
+    // Unknown call and malformed ID
+    req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", "session.none");
+    ASSERT_TRUE(vrtql_rpc_service(system, &env, req) == NULL);
+    ASSERT_STR("RPC does not exist", vws.e.text);
+
+    req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", "session");
+    ASSERT_TRUE(vrtql_rpc_service(system, &env, req) == NULL);
+    ASSERT_STR("Invalid ID format", vws.e.text);
+
+    // Numeric call IDs need no "id" at all
+    ASSERT_TRUE(vrtql_rpc_system_bind(system, "session.login", 3));
+    ASSERT_FALSE(vrtql_rpc_system_bind(system, "session.none", 4));
+
+    req = vrtql_msg_new();
+    vrtql_msg_set_header(req, VRTQL_RPC_CID, "3");
+    reply = vrtql_rpc_service(system, &env, req);
+    ASSERT_TRUE(reply != NULL);
+    vrtql_msg_free(reply);
+
+    // Unbound number without an id
+    req = vrtql_msg_new();
+    vrtql_msg_set_header(req, VRTQL_RPC_CID, "2");
+    ASSERT_TRUE(vrtql_rpc_service(system, &env, req) == NULL);
+
+    vrtql_rpc_system_free(system);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -1,3 +1,9 @@
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+
 #include "server.h"
 #include "socket.h"
 
@@ -5,6 +11,7 @@
 #include "ctest.h"
 
 #include "common.h"
+#include "config.h"
 
 cstr server_host = "127.0.0.1";
 int  server_port = 8181;
@@ -67,7 +74,10 @@ void client_thread(void* arg)
     // Get reply
     ssize_t n = vws_socket_read(s);
     ASSERT_TRUE(n > 0);
-    vws.trace(VL_INFO, "[CLIENT] Receive: %s", s->buffer->data);
+    vws.trace( VL_INFO,
+               "[CLIENT] Receive: %.*s",
+               (int)s->buffer->size,
+               s->buffer->data );
 
     // Disconnect and cleanup.
     vws_socket_free(s);
@@ -116,6 +126,1280 @@ CTEST(test_server, echo)
     vws.trace(VL_INFO, "[CLIENT] Done");
 }
 
+CTEST(test_server, loops)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(4, 0, 0);
+    vws.tracelevel      = VT_THREAD;
+    server->on_data_in  = process_data;
+
+    ASSERT_EQUAL(0, vws_tcp_svr_set_loops(server, 4));
+    ASSERT_EQUAL(4, server->loop_count);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    // Wait for server to start up
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Cannot change loops while running
+    ASSERT_EQUAL(-1, vws_tcp_svr_set_loops(server, 2));
+
+    int nc = 10;
+    uv_thread_t* threads = vws.malloc(sizeof(uv_thread_t) * nc);
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_create(&threads[i], client_thread, NULL);
+    }
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_join(&threads[i]);
+    }
+
+    free(threads);
+
+    // Shutdown server
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+// Opens a burst of connections before using any of them
+void storm_thread(void* arg)
+{
+    vws_socket* s[20];
+
+    for (int i = 0; i < 20; i++)
+    {
+        s[i] = vws_socket_new();
+        ASSERT_TRUE(vws_socket_connect(s[i], server_host, server_port, false));
+    }
+
+    for (int i = 0; i < 20; i++)
+    {
+        vws_socket_write(s[i], (ucstr)content, strlen(content));
+        ASSERT_TRUE(vws_socket_read(s[i]) > 0);
+        vws_socket_free(s[i]);
+    }
+}
+
+CTEST(test_server, accept_storm)
+{
+    vws_tcp_svr* server  = vws_tcp_svr_new(4, 0, 0);
+    server->on_data_in   = process_data;
+    server->cnx_reserve  = 64;
+    server->defer_accept = 1;
+    server->fastopen     = 16;
+
+    ASSERT_EQUAL(4096, server->backlog);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // More connections than the reserve, so some are allocated on the spot
+    int nc = 10;
+    uv_thread_t* threads = vws.malloc(sizeof(uv_thread_t) * nc);
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_create(&threads[i], storm_thread, NULL);
+    }
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_join(&threads[i]);
+    }
+
+    free(threads);
+
+    vws_svr_metrics m;
+    vws_tcp_svr_metrics(server, &m);
+    ASSERT_EQUAL(nc * 20, m.connections);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+int sockopts_seen = 0;
+
+// Echo, noting whether the connection was tuned
+void process_sockopts(vws_svr_data* req)
+{
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)req->cnx->handle, &fd);
+
+    int nodelay = 0, keepalive = 0;
+    socklen_t size = sizeof(int);
+    getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &size);
+    getsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, &size);
+
+    if (nodelay == 1 && keepalive == 1)
+    {
+        __atomic_add_fetch(&sockopts_seen, 1, __ATOMIC_SEQ_CST);
+    }
+
+    process_data(req);
+}
+
+CTEST(test_server, sockopts)
+{
+    vws_tcp_svr* server        = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in         = process_sockopts;
+    server->sockopts.keepalive = 60;
+    server->sockopts.rcvbuf    = 65536;
+
+    ASSERT_TRUE(server->sockopts.nodelay);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s        = vws_socket_new();
+    s->opts.keepalive    = 30;
+    s->opts.user_timeout = 5000;
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    int nodelay = 0, keepalive = 0;
+    socklen_t size = sizeof(int);
+    getsockopt(s->sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &size);
+    getsockopt(s->sockfd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, &size);
+    ASSERT_EQUAL(1, nodelay);
+    ASSERT_EQUAL(1, keepalive);
+
+#if defined(TCP_USER_TIMEOUT)
+    unsigned int timeout = 0;
+    size = sizeof(timeout);
+    getsockopt(s->sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, &size);
+    ASSERT_EQUAL(5000, timeout);
+#endif
+
+    vws_socket_write(s, (ucstr)content, strlen(content));
+    ASSERT_TRUE(vws_socket_read(s) > 0);
+    vws_socket_free(s);
+
+    ASSERT_EQUAL(1, sockopts_seen);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+int affinity_strays = 0;
+
+// Echo, counting requests handled by a worker of another loop
+void process_affinity(vws_svr_data* req)
+{
+    vws_tcp_svr* server = req->cnx->server;
+    int loop            = (int)(req->cnx->loop - server->loops);
+    int worker          = (int)(req->cnx->worker - server->workers);
+
+    if (worker % server->loop_count != loop)
+    {
+        __atomic_add_fetch(&affinity_strays, 1, __ATOMIC_SEQ_CST);
+    }
+
+    process_data(req);
+}
+
+CTEST(test_server, affinity)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(4, 0, 0);
+    server->on_data_in  = process_affinity;
+
+    vws_svr_affinity_t cpu  = VWS_SVR_AFFINITY_CPU;
+    vws_svr_affinity_t node = VWS_SVR_AFFINITY_NODE;
+
+    ASSERT_EQUAL(-1, vws_tcp_svr_set_affinity(server, cpu, ""));
+    ASSERT_EQUAL(-1, vws_tcp_svr_set_affinity(server, cpu, "3-1"));
+    ASSERT_EQUAL(-1, vws_tcp_svr_set_affinity(server, cpu, "0;1"));
+    ASSERT_EQUAL(0, vws_tcp_svr_set_affinity(server, cpu, "0-2,5"));
+    ASSERT_EQUAL(4, server->cpu_count);
+    ASSERT_EQUAL(5, server->cpus[3]);
+
+    // Every CPU the process may use, by node
+    ASSERT_EQUAL(0, vws_tcp_svr_set_affinity(server, node, NULL));
+    ASSERT_TRUE(server->cpu_count > 0);
+    ASSERT_EQUAL(0, vws_tcp_svr_set_loops(server, 2));
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Everything is placed
+    ASSERT_EQUAL(-1, vws_tcp_svr_set_affinity(server, cpu, NULL));
+
+    for (int i = 0; i < server->loop_count; i++)
+    {
+        ASSERT_NOT_NULL(server->loops[i].cpus);
+    }
+
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        ASSERT_NOT_NULL(server->workers[i].cpus);
+    }
+
+    int nc = 10;
+    uv_thread_t* threads = vws.malloc(sizeof(uv_thread_t) * nc);
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_create(&threads[i], client_thread, NULL);
+    }
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_join(&threads[i]);
+    }
+
+    free(threads);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+
+    // Connections only went to their own loop's workers
+    ASSERT_EQUAL(0, affinity_strays);
+}
+
+int pool_clients_done = 0;
+
+// Echo after a delay, so requests back up in the queues
+void process_slow(vws_svr_data* req)
+{
+    vws_msleep(2);
+    process_data(req);
+}
+
+// Sends numbered chunks as separate writes and checks they all come back in
+// order, whichever workers they went through
+static void echo_in_order(vws_socket* s)
+{
+    int count       = 50;
+    vws_buffer* out = vws_buffer_new();
+
+    for (int i = 0; i < count; i++)
+    {
+        char chunk[16];
+        int n = snprintf(chunk, sizeof(chunk), "%07i;", i);
+        vws_buffer_append(out, (ucstr)chunk, n);
+        vws_socket_write(s, (ucstr)chunk, n);
+        vws_msleep(1);
+    }
+
+    while (s->buffer->size < out->size)
+    {
+        if (vws_socket_read(s) <= 0)
+        {
+            break;
+        }
+    }
+
+    ASSERT_EQUAL(out->size, s->buffer->size);
+    ASSERT_TRUE(memcmp(out->data, s->buffer->data, out->size) == 0);
+
+    vws_buffer_free(out);
+}
+
+void pool_client_thread(void* arg)
+{
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    echo_in_order(s);
+    vws_socket_free(s);
+
+    __atomic_add_fetch(&pool_clients_done, 1, __ATOMIC_SEQ_CST);
+}
+
+CTEST(test_server, pool)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(1, 0, 0);
+    server->on_data_in  = process_slow;
+
+    ASSERT_EQUAL(0, vws_tcp_svr_set_pool(server, 1, 4));
+    ASSERT_EQUAL(4, server->pool_size);
+    server->pool.grow_wait = 100;
+    server->pool.park_idle = 300;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_EQUAL(-1, vws_tcp_svr_set_pool(server, 1, 2));
+    ASSERT_EQUAL(1, server->pool.started);
+
+    int nc = 8;
+    uv_thread_t* threads = vws.malloc(sizeof(uv_thread_t) * nc);
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_create(&threads[i], pool_client_thread, NULL);
+    }
+
+    // The backlog grows the pool
+    int most = 0;
+
+    while (__atomic_load_n(&pool_clients_done, __ATOMIC_SEQ_CST) < nc)
+    {
+        int active = __atomic_load_n(&server->pool.active, __ATOMIC_SEQ_CST);
+        most       = (active > most) ? active : most;
+        vws_msleep(10);
+    }
+
+    for (int i = 0; i < nc; i++)
+    {
+        uv_thread_join(&threads[i]);
+    }
+
+    free(threads);
+    ASSERT_TRUE(most > 1);
+
+    // And it shrinks back when the load is gone
+    for (int i = 0; i < 100; i++)
+    {
+        if (__atomic_load_n(&server->pool.active, __ATOMIC_SEQ_CST) == 1)
+        {
+            break;
+        }
+
+        vws_msleep(50);
+    }
+
+    ASSERT_EQUAL(1, __atomic_load_n(&server->pool.active, __ATOMIC_SEQ_CST));
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+int steal_workers = 0;
+
+// Slow echo, noting which workers handle requests
+void process_steal(vws_svr_data* req)
+{
+    vws_tcp_svr* server = req->cnx->server;
+    uv_thread_t self    = uv_thread_self();
+
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        if (uv_thread_equal(&self, &server->workers[i].thread))
+        {
+            __atomic_or_fetch(&steal_workers, 1 << i, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    process_slow(req);
+}
+
+void steal_client_thread(void* arg)
+{
+    echo_in_order((vws_socket*)arg);
+}
+
+CTEST(test_server, steal)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in  = process_steal;
+    server->steal       = true;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Connections are bound round-robin: the first and third to the first
+    // worker, the second, which stays quiet, to the other
+    vws_socket* s[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        s[i] = vws_socket_new();
+        ASSERT_TRUE(vws_socket_connect(s[i], server_host, server_port, false));
+        vws_msleep(50);
+    }
+
+    uv_thread_t threads[2];
+    uv_thread_create(&threads[0], steal_client_thread, s[0]);
+    uv_thread_create(&threads[1], steal_client_thread, s[2]);
+    uv_thread_join(&threads[0]);
+    uv_thread_join(&threads[1]);
+
+    // The idle worker took some of the work, and each connection's requests
+    // still came back in order
+    ASSERT_EQUAL(3, steal_workers);
+
+    for (int i = 0; i < 3; i++)
+    {
+        vws_socket_free(s[i]);
+    }
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+int shared_freed = 0;
+
+void shared_free(ucstr data, void* arg)
+{
+    __atomic_add_fetch((int*)arg, 1, __ATOMIC_SEQ_CST);
+}
+
+// Reply with the whole content and then part of it, both from one buffer.
+void process_shared(vws_svr_data* req)
+{
+    vws_tcp_svr* server = req->cnx->server;
+
+    vws_svr_buffer* b;
+    b = vws_svr_buffer_wrap( (ucstr)content,
+                             strlen(content),
+                             shared_free,
+                             &shared_freed );
+
+    vws_tcp_svr_send(server, vws_svr_data_share(req->cnx, b, 0, b->size));
+    vws_tcp_svr_send(server, vws_svr_data_share(req->cnx, b, 6, 5));
+
+    // The replies keep the buffer alive until they are written
+    vws_svr_buffer_release(b);
+    vws_svr_data_free(req);
+}
+
+CTEST(test_server, shared)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in  = process_shared;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+    vws_socket_write(s, (ucstr)content, strlen(content));
+
+    size_t expected = strlen(content) + 5;
+
+    while (s->buffer->size < expected && vws_socket_read(s) > 0)
+    {
+    }
+
+    cstr data = (cstr)s->buffer->data;
+
+    ASSERT_EQUAL(expected, s->buffer->size);
+    ASSERT_TRUE(strncmp(data, content, strlen(content)) == 0);
+    ASSERT_TRUE(strncmp(data + strlen(content), "ipsum", 5) == 0);
+
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+
+    // Freed once, after both replies went out
+    ASSERT_EQUAL(1, shared_freed);
+}
+
+uint64_t last_id = 0;
+
+// Echo back by connection ID rather than pointer
+void process_by_id(vws_svr_data* req)
+{
+    vws_tcp_svr* server = req->cnx->server;
+    uint64_t id         = req->cnx->id;
+
+    char* data = (char*)vws.malloc(req->size);
+    memcpy(data, req->data, req->size);
+
+    vws_svr_data* reply = vws_svr_data_own(NULL, (ucstr)data, req->size);
+    vws_svr_data_free(req);
+
+    __atomic_store_n(&last_id, id, __ATOMIC_SEQ_CST);
+    vws_tcp_svr_send_to(server, id, reply);
+}
+
+CTEST(test_server, send_to)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in  = process_by_id;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+    vws_socket_write(s, (ucstr)content, strlen(content));
+
+    while (s->buffer->size < strlen(content) && vws_socket_read(s) > 0)
+    {
+    }
+
+    ASSERT_EQUAL(strlen(content), s->buffer->size);
+
+    uint64_t id = __atomic_load_n(&last_id, __ATOMIC_SEQ_CST);
+    ASSERT_TRUE(id != 0);
+
+    vws_socket_free(s);
+
+    // Once the connection is released its ID no longer matches
+    int rc = 0;
+
+    for (int i = 0; i < 50 && rc == 0; i++)
+    {
+        vws_msleep(20);
+
+        vws_svr_data* data = vws_svr_data_own(NULL, NULL, 0);
+        rc = vws_tcp_svr_send_to(server, id, data);
+    }
+
+    ASSERT_EQUAL(-1, rc);
+
+    // A made up ID is rejected too
+    vws_svr_data* data = vws_svr_data_own(NULL, NULL, 0);
+    ASSERT_EQUAL(-1, vws_tcp_svr_send_to(server, 0xffffffffffffULL, data));
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+CTEST(test_server, idle_timeout)
+{
+    vws_tcp_svr* server  = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in   = process_data;
+    server->idle_timeout = 300;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Say nothing and wait to be closed
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    uint64_t start = uv_hrtime();
+    ssize_t n      = 0;
+
+    while (n >= 0 && (uv_hrtime() - start) < 5000000000ULL)
+    {
+        n = vws_socket_read(s);
+    }
+
+    ASSERT_TRUE(n < 0);
+    ASSERT_TRUE((uv_hrtime() - start) >= 250000000ULL);
+
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+int    bp_paused  = 0;
+int    bp_resumed = 0;
+size_t bp_total   = 32 * 1024 * 1024;
+
+void process_backpressure(vws_svr_cnx* c, bool paused)
+{
+    if (paused == true)
+    {
+        __atomic_add_fetch(&bp_paused, 1, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        __atomic_add_fetch(&bp_resumed, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void bp_writer_thread(void* arg)
+{
+    vws_socket* s = (vws_socket*)arg;
+
+    size_t chunk = 64 * 1024;
+    ucstr data   = vws.calloc(1, chunk);
+
+    for (size_t sent = 0; sent < bp_total; sent += chunk)
+    {
+        ASSERT_TRUE(vws_socket_write(s, data, chunk) == (ssize_t)chunk);
+    }
+
+    vws.free(data);
+}
+
+CTEST(test_server, backpressure)
+{
+    vws_tcp_svr* server     = vws_tcp_svr_new(2, 0, 0);
+    vws.tracelevel          = 0;
+    server->on_data_in      = process_data;
+    server->on_backpressure = process_backpressure;
+    server->write_high      = 256 * 1024;
+    server->write_low       = 64 * 1024;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    // Send without reading until the server stops reading from us
+    uv_thread_t writer;
+    uv_thread_create(&writer, bp_writer_thread, s);
+
+    for (int i = 0; i < 100; i++)
+    {
+        if (__atomic_load_n(&bp_paused, __ATOMIC_SEQ_CST) > 0)
+        {
+            break;
+        }
+
+        vws_msleep(100);
+    }
+
+    ASSERT_TRUE(__atomic_load_n(&bp_paused, __ATOMIC_SEQ_CST) > 0);
+
+    // Read everything back. This drains the server and resumes reading.
+    size_t received = 0;
+    while (received < bp_total)
+    {
+        ssize_t n = vws_socket_read(s);
+        ASSERT_TRUE(n > 0);
+        received += n;
+        vws_buffer_clear(s->buffer);
+    }
+
+    uv_thread_join(&writer);
+
+    ASSERT_TRUE(__atomic_load_n(&bp_resumed, __ATOMIC_SEQ_CST) > 0);
+
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+size_t try_total = 4 * 1024 * 1024;
+
+// Reply with more than the socket takes in one go
+void process_large(vws_svr_data* req)
+{
+    vws_tcp_svr* server = req->cnx->server;
+
+    char* data = (char*)vws.malloc(try_total);
+
+    for (size_t i = 0; i < try_total; i++)
+    {
+        data[i] = (char)(i & 0xFF);
+    }
+
+    vws_svr_data* reply = vws_svr_data_own(req->cnx, (ucstr)data, try_total);
+    vws_svr_data_free(req);
+    vws_tcp_svr_send(server, reply);
+}
+
+CTEST(test_server, try_write)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    vws.tracelevel      = 0;
+    server->on_data_in  = process_large;
+    server->try_write   = try_total;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    // The socket takes part of it straight away and the rest is queued. It
+    // all arrives, in order.
+    for (int round = 0; round < 2; round++)
+    {
+        ASSERT_TRUE(vws_socket_write(s, (ucstr)content, strlen(content)) > 0);
+
+        while (s->buffer->size < try_total)
+        {
+            ASSERT_TRUE(vws_socket_read(s) > 0);
+        }
+
+        ASSERT_EQUAL(try_total, s->buffer->size);
+
+        for (size_t i = 0; i < try_total; i++)
+        {
+            if (s->buffer->data[i] != (unsigned char)(i & 0xFF))
+            {
+                ASSERT_FAIL();
+            }
+        }
+
+        vws_buffer_clear(s->buffer);
+    }
+
+    // Small replies normally go out without being queued
+    server->on_data_in = process_data;
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)content, strlen(content)) > 0);
+    ASSERT_TRUE(vws_socket_read(s) > 0);
+
+    vws_svr_metrics m;
+    vws_tcp_svr_metrics(server, &m);
+    ASSERT_TRUE(m.immediate_writes > 0);
+
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+cstr handoff_path  = "/tmp/vws_test_handoff";
+int  handoff_taken = 0;
+
+// The new process: takes over, then runs with what it was given
+void takeover_thread(void* arg)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)arg;
+
+    handoff_taken = vws_tcp_svr_takeover(server, handoff_path, 5000);
+    vws_tcp_svr_run(server, server_host, server_port);
+}
+
+CTEST(test_server, handoff)
+{
+    vws_tcp_svr* old = vws_tcp_svr_new(2, 0, 0);
+    old->on_data_in  = process_data;
+
+    uv_thread_t old_tid;
+    uv_thread_create(&old_tid, server_thread, old);
+
+    while (old->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+    vws_socket_write(s, (ucstr)content, strlen(content));
+
+    while (s->buffer->size < strlen(content) && vws_socket_read(s) > 0)
+    {
+    }
+
+    ASSERT_EQUAL(strlen(content), s->buffer->size);
+    vws_buffer_clear(s->buffer);
+
+    //> Hand over to a new server
+
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in  = process_data;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, takeover_thread, server);
+
+    // Until the new server is listening for it
+    int n = -1;
+
+    for (int i = 0; i < 50 && n < 0; i++)
+    {
+        vws_msleep(50);
+        n = vws_tcp_svr_handoff(old, handoff_path, 2000);
+    }
+
+    ASSERT_EQUAL(1, n);
+
+    vws_tcp_svr_stop(old);
+    uv_thread_join(&old_tid);
+    vws_tcp_svr_free(old);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_EQUAL(1, handoff_taken);
+
+    //> The connection carries on with the new server
+
+    vws_socket_write(s, (ucstr)content, strlen(content));
+
+    while (s->buffer->size < strlen(content) && vws_socket_read(s) > 0)
+    {
+    }
+
+    ASSERT_EQUAL(strlen(content), s->buffer->size);
+    vws_socket_free(s);
+
+    // And it accepts on the listening socket it inherited
+    s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+    vws_socket_write(s, (ucstr)content, strlen(content));
+
+    while (s->buffer->size < strlen(content) && vws_socket_read(s) > 0)
+    {
+    }
+
+    ASSERT_EQUAL(strlen(content), s->buffer->size);
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+CTEST(test_server, handoff_path)
+{
+    // A file that is not a socket is neither removed nor listened on
+    FILE* f = fopen(handoff_path, "w");
+    ASSERT_NOT_NULL(f);
+    fclose(f);
+
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    ASSERT_EQUAL(-1, vws_tcp_svr_takeover(server, handoff_path, 100));
+
+    struct stat st;
+    ASSERT_EQUAL(0, lstat(handoff_path, &st));
+    ASSERT_TRUE(S_ISREG(st.st_mode));
+
+    unlink(handoff_path);
+    vws_tcp_svr_free(server);
+}
+
+cstr unix_path     = "/tmp/vws_test_unix";
+cstr unix_abstract = "@vws_test_unix";
+
+static void unix_echo(cstr path)
+{
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect_unix(s, path));
+    vws_socket_write(s, (ucstr)content, strlen(content));
+
+    while (s->buffer->size < strlen(content) && vws_socket_read(s) > 0)
+    {
+    }
+
+    ASSERT_EQUAL(strlen(content), s->buffer->size);
+    ASSERT_TRUE(memcmp(s->buffer->data, content, strlen(content)) == 0);
+    vws_socket_free(s);
+}
+
+CTEST(test_server, unix_socket)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in  = process_data;
+
+    // A socket file and an abstract name, one loop each
+    ASSERT_EQUAL(0, vws_tcp_svr_listen_unix(server, unix_path));
+    ASSERT_EQUAL(0, vws_tcp_svr_listen_unix(server, unix_abstract));
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_EQUAL(2, server->loop_count);
+
+    unix_echo(unix_path);
+    unix_echo(unix_abstract);
+
+    // Not listening on TCP
+    vws_socket* s = vws_socket_new();
+    ASSERT_FALSE(vws_socket_connect(s, server_host, server_port, false));
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+
+    unlink(unix_path);
+}
+
+CTEST(test_server, dial)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    server->on_data_in  = process_data;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Driven by hand, as an event loop would
+    vws_dial* d = vws_dial_new("localhost", server_port);
+    ASSERT_NOT_NULL(d);
+
+    int rc;
+
+    while ((rc = vws_dial_step(d)) == 0)
+    {
+        int fds[8];
+        size_t n = vws_dial_fds(d, fds, 8);
+        ASSERT_TRUE(n > 0);
+
+        struct pollfd p[8];
+
+        for (size_t i = 0; i < n && i < 8; i++)
+        {
+            p[i].fd     = fds[i];
+            p[i].events = POLLOUT;
+        }
+
+        poll(p, n, vws_dial_timeout(d));
+    }
+
+    ASSERT_EQUAL(1, rc);
+
+    int fd = vws_dial_take(d);
+    ASSERT_TRUE(fd > -1);
+    ASSERT_EQUAL(-1, vws_dial_take(d));
+    vws_dial_free(d);
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect_fd(s, fd, "localhost", server_port, false));
+    vws_socket_write(s, (ucstr)content, strlen(content));
+
+    while (s->buffer->size < strlen(content) && vws_socket_read(s) > 0)
+    {
+    }
+
+    ASSERT_EQUAL(strlen(content), s->buffer->size);
+    vws_socket_free(s);
+
+    // From the cache, and resolved again once it is cleared
+    s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, "localhost", server_port, false));
+    vws_socket_free(s);
+
+    vws_dns_clear();
+
+    s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, "localhost", server_port, false));
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+
+    // Every address refused
+    d = vws_dial_new("localhost", server_port);
+
+    if (d != NULL)
+    {
+        while ((rc = vws_dial_step(d)) == 0)
+        {
+            vws_msleep(10);
+        }
+
+        ASSERT_EQUAL(-1, rc);
+        vws_dial_free(d);
+    }
+
+    s = vws_socket_new();
+    ASSERT_FALSE(vws_socket_connect(s, "localhost", server_port, false));
+    vws_socket_free(s);
+
+    ASSERT_NULL(vws_dial_new("host.invalid", server_port));
+}
+
+// Echoes messages of several sizes over a TLS connection
+static void tls_sizes(bool ktls)
+{
+    vws_socket* s = vws_socket_new();
+    s->ktls       = ktls;
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, true));
+
+    if (ktls == false)
+    {
+        ASSERT_EQUAL(0, s->ktls_on);
+    }
+
+    // Small messages and one spanning many TLS records
+    size_t sizes[] = { strlen(content), 1000, 100000 };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t size         = sizes[i];
+        unsigned char* data = vws.malloc(size);
+
+        for (size_t j = 0; j < size; j++)
+        {
+            data[j] = content[j % strlen(content)];
+        }
+
+        ASSERT_TRUE(vws_socket_write(s, data, size) == (ssize_t)size);
+
+        for (int tries = 0; s->buffer->size < size && tries < 100; tries++)
+        {
+            // 0 means no application data yet, e.g. only a session ticket
+            ASSERT_TRUE(vws_socket_read(s) >= 0);
+        }
+
+        ASSERT_EQUAL(size, s->buffer->size);
+        ASSERT_TRUE(memcmp(data, s->buffer->data, size) == 0);
+
+        vws_buffer_clear(s->buffer);
+        vws.free(data);
+    }
+
+    vws_socket_free(s);
+}
+
+CTEST(test_server, tls)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    vws.tracelevel      = 0;
+    server->on_data_in  = process_data;
+
+    ASSERT_TRUE(vws_tcp_svr_tls( server,
+                                 PKG_TEST_DIR "/files/cert.pem",
+                                 PKG_TEST_DIR "/files/key.pem" ) == 0);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // With kTLS, where the kernel has it, and without
+    tls_sizes(true);
+    tls_sizes(false);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+static bool tls_echo(vws_socket* s)
+{
+    size_t size = strlen(content);
+
+    if (vws_socket_write(s, (ucstr)content, size) != (ssize_t)size)
+    {
+        return false;
+    }
+
+    for (int tries = 0; s->buffer->size < size && tries < 100; tries++)
+    {
+        if (vws_socket_read(s) < 0)
+        {
+            return false;
+        }
+    }
+
+    bool rc = (s->buffer->size == size);
+    vws_buffer_clear(s->buffer);
+
+    return rc;
+}
+
+CTEST(test_server, tls_resume)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    vws.tracelevel      = 0;
+    server->on_data_in  = process_data;
+
+    ASSERT_TRUE(vws_tcp_svr_tls( server,
+                                 PKG_TEST_DIR "/files/cert.pem",
+                                 PKG_TEST_DIR "/files/key.pem" ) == 0);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket_ssl_clear_sessions();
+
+    // First connect is a full handshake. The exchange picks up the ticket.
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, true));
+    ASSERT_FALSE(SSL_session_reused(s->ssl));
+    ASSERT_TRUE(tls_echo(s));
+    vws_socket_disconnect(s);
+
+    // Reconnect resumes
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, true));
+    ASSERT_TRUE(SSL_session_reused(s->ssl));
+    ASSERT_TRUE(tls_echo(s));
+    vws_socket_disconnect(s);
+
+    // Early data is opt-in. The server does not take it, so the request goes
+    // again after the handshake.
+    s->early_data = true;
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, true));
+    ASSERT_TRUE(tls_echo(s));
+    ASSERT_TRUE(SSL_session_reused(s->ssl));
+    vws_socket_disconnect(s);
+
+    // No cached session, full handshake
+    vws_socket_ssl_clear_sessions();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, true));
+    ASSERT_FALSE(SSL_session_reused(s->ssl));
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+CTEST(test_server, tls_latency)
+{
+    vws_tcp_svr* server = vws_tcp_svr_new(2, 0, 0);
+    vws.tracelevel      = 0;
+    server->on_data_in  = process_data;
+
+    ASSERT_TRUE(vws_tcp_svr_tls( server,
+                                 PKG_TEST_DIR "/files/cert.pem",
+                                 PKG_TEST_DIR "/files/key.pem" ) == 0);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (server->state != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, true));
+
+    // Messages that span several TLS records
+    size_t size         = 40000;
+    int count           = 500;
+    unsigned char* data = vws.malloc(size);
+    uint64_t* samples   = vws.malloc(sizeof(uint64_t) * count);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = content[i % strlen(content)];
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t start = now_ns();
+
+        ASSERT_TRUE(vws_socket_write(s, data, size) == (ssize_t)size);
+
+        for (int tries = 0; s->buffer->size < size && tries < 100; tries++)
+        {
+            ASSERT_TRUE(vws_socket_read(s) >= 0);
+        }
+
+        samples[i] = now_ns() - start;
+
+        ASSERT_EQUAL(size, s->buffer->size);
+        vws_buffer_clear(s->buffer);
+    }
+
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+
+    printf( "\n  TLS echo %zu bytes x %i: p50 %.1f us, p99 %.1f us\n",
+            size,
+            count,
+            samples[count / 2] / 1000.0,
+            samples[count * 99 / 100] / 1000.0 );
+
+    vws.free(samples);
+    vws.free(data);
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    vws_tcp_svr_free(server);
+}
+
+CTEST(test_server, data_consumed)
+{
+    // A buffer whose front has been consumed no longer starts at its
+    // allocation. Taking it over must not free an interior pointer.
+    vws_buffer* buffer = vws_buffer_new();
+    vws_buffer_append(buffer, (ucstr)"header:", 7);
+    vws_buffer_append(buffer, (ucstr)content, strlen(content));
+    vws_buffer_consume(buffer, 7);
+    ASSERT_EQUAL(7, buffer->head);
+
+    vws_svr_data* data = vws_svr_data_new(NULL, buffer);
+    ASSERT_EQUAL(strlen(content), data->size);
+    ASSERT_TRUE(memcmp(data->data, content, data->size) == 0);
+
+    ASSERT_NULL(buffer->data);
+    ASSERT_EQUAL(0, buffer->head);
+    ASSERT_EQUAL(0, buffer->size);
+
+    vws_svr_data_free(data);
+    vws_buffer_free(buffer);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -0,0 +1,157 @@
+#include "server.h"
+#include "message.h"
+#include "shm.h"
+
+#define CTEST_MAIN
+#include "ctest.h"
+#include "common.h"
+
+cstr server_path = "@vws_test_shm";
+cstr uri         = "ws://localhost/websocket";
+cstr content     = "Lorem ipsum dolor sit amet";
+
+// Echo the content back. Runs in a worker.
+void process_message(vws_svr_cnx* cnx, vrtql_msg* m)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)cnx->server;
+
+    vrtql_msg* reply = vrtql_msg_new();
+    reply->format    = cnx->format;
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    server->send(cnx, reply);
+    vrtql_msg_free(m);
+}
+
+void server_thread(void* arg)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)arg;
+    vws_tcp_svr_run(server, NULL, 0);
+}
+
+vrtql_msg_svr* server_start(bool shm)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = process_message;
+    server->shm           = shm;
+
+    ASSERT_EQUAL(0, vws_tcp_svr_listen_unix((vws_tcp_svr*)server, server_path));
+
+    return server;
+}
+
+CTEST(test_shm, echo)
+{
+    vrtql_msg_svr* server = server_start(true);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect_unix(cnx, server_path, uri));
+
+    vrtql_shm* shm = vrtql_shm_attach(cnx, 4096);
+    ASSERT_NOT_NULL(shm);
+
+    for (int i = 0; i < 100; i++)
+    {
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_content(request, content);
+        ASSERT_TRUE(vrtql_shm_send(shm, request) > 0);
+        vrtql_msg_free(request);
+
+        vrtql_msg* reply = vrtql_shm_recv(shm);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(strlen(content), reply->content->size);
+        ASSERT_TRUE(memcmp(reply->content->data, content, strlen(content)) == 0);
+        vrtql_msg_free(reply);
+    }
+
+    // More than the rings hold, so both sides have to wait for room
+    int count = 1000;
+
+    for (int i = 0; i < count; i++)
+    {
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_content(request, content);
+        ASSERT_TRUE(vrtql_shm_send(shm, request) > 0);
+        vrtql_msg_free(request);
+
+        // Only start reading halfway through
+        if (i >= count / 2)
+        {
+            vrtql_msg* reply = vrtql_shm_recv(shm);
+            ASSERT_NOT_NULL(reply);
+            vrtql_msg_free(reply);
+        }
+    }
+
+    for (int i = 0; i < count / 2; i++)
+    {
+        vrtql_msg* reply = vrtql_shm_recv(shm);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(strlen(content), reply->content->size);
+        vrtql_msg_free(reply);
+    }
+
+    // Too large for the ring
+    vrtql_msg* request = vrtql_msg_new();
+    vws_buffer_reserve(request->content, 4096);
+    request->content->size = 4096;
+    ASSERT_EQUAL(-1, vrtql_shm_send(shm, request));
+    vrtql_msg_free(request);
+
+    vrtql_shm_free(shm);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+CTEST(test_shm, declined)
+{
+    // Not enabled on the server
+    vrtql_msg_svr* server = server_start(false);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect_unix(cnx, server_path, uri));
+    ASSERT_NULL(vrtql_shm_attach(cnx, 4096));
+
+    // The connection carries on over the socket
+    vrtql_msg* request = vrtql_msg_new();
+    vrtql_msg_set_content(request, content);
+    ASSERT_TRUE(vrtql_msg_send(cnx, request) > 0);
+    vrtql_msg_free(request);
+
+    vrtql_msg* reply = vrtql_msg_recv(cnx);
+    ASSERT_NOT_NULL(reply);
+    ASSERT_EQUAL(strlen(content), reply->content->size);
+    vrtql_msg_free(reply);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+int main(int argc, const char* argv[])
+{
+    return ctest_main(argc, argv);
+}
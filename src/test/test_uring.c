@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "websocket.h"
+#include "uring.h"
+
+#define CTEST_MAIN
+#include "ctest.h"
+
+#include "common.h"
+
+cstr content = "content";
+cstr uri     = "ws://localhost:8181/websocket";
+
+#define check_reply(c, value)                                             \
+{                                                                         \
+    vws_msg* m = vws_msg_recv(c);                                         \
+    ASSERT_TRUE(m != NULL);                                               \
+    ASSERT_TRUE(strncmp((cstr)m->data->data, value, m->data->size) == 0); \
+    vws_msg_free(m);                                                      \
+}
+
+CTEST(test, send_receive)
+{
+    vws_uring* u = vws_uring_new(64, 16, 4096);
+    ASSERT_TRUE(u != NULL);
+
+    vws_cnx* c = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(c, uri));
+    ASSERT_TRUE(vws_uring_add(u, &c->base));
+    ASSERT_FALSE(vws_uring_add(u, &c->base));
+
+    for (int i = 0; i < 10; i++)
+    {
+        ASSERT_TRUE(vws_frame_send_text(c, content) > 0);
+        check_reply(c, content);
+    }
+
+    // A message larger than a receive buffer spans several completions
+    size_t size = 64 * 1024;
+    char* large = malloc(size + 1);
+    memset(large, 'x', size);
+    large[size] = 0;
+
+    ASSERT_TRUE(vws_frame_send_text(c, large) > 0);
+    check_reply(c, large);
+    free(large);
+
+    // Detach and carry on with poll()
+    vws_uring_remove(&c->base);
+    ASSERT_TRUE(c->base.uring == NULL);
+    ASSERT_TRUE(vws_frame_send_text(c, content) > 0);
+    check_reply(c, content);
+
+    vws_cnx_free(c);
+    vws_uring_free(u);
+}
+
+CTEST(test, wait)
+{
+    // Drive several connections from one thread
+    int clients  = 8;
+    int rounds   = 10;
+    int received = 0;
+
+    vws_uring* u = vws_uring_new(64, 64, 4096);
+    ASSERT_TRUE(u != NULL);
+
+    vws_cnx* cnxs[8];
+
+    for (int i = 0; i < clients; i++)
+    {
+        cnxs[i] = vws_cnx_new();
+        ASSERT_TRUE(vws_connect(cnxs[i], uri));
+        ASSERT_TRUE(vws_uring_add(u, &cnxs[i]->base));
+    }
+
+    for (int n = 0; n < rounds; n++)
+    {
+        for (int i = 0; i < clients; i++)
+        {
+            ASSERT_TRUE(vws_frame_send_text(cnxs[i], content) > 0);
+        }
+    }
+
+    int tries = 0;
+    while (received < clients * rounds && tries++ < 100)
+    {
+        ASSERT_TRUE(vws_uring_wait(u, 100) >= 0);
+
+        vws_socket* s;
+        while ((s = vws_uring_next(u)) != NULL)
+        {
+            vws_cnx* c = (vws_cnx*)s;
+
+            ASSERT_TRUE(vws_socket_read_ready(s, NULL) >= 0);
+            ASSERT_TRUE(vws_cnx_ingress(c) >= 0);
+
+            vws_msg* m;
+            while ((m = vws_msg_pop(c)) != NULL)
+            {
+                ASSERT_TRUE(strncmp((cstr)m->data->data, content, m->data->size) == 0);
+                vws_msg_free(m);
+                received++;
+            }
+        }
+    }
+
+    ASSERT_EQUAL(clients * rounds, received);
+
+    for (int i = 0; i < clients; i++)
+    {
+        vws_cnx_free(cnxs[i]);
+    }
+
+    vws_uring_free(u);
+}
+
+int main(int argc, const char* argv[])
+{
+    return ctest_main(argc, argv);
+}
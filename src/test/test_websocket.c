@@ -3,6 +3,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <string.h>
 #endif
 
@@ -12,6 +13,7 @@
 
 #include "websocket.h"
 #include "message.h"
+#include "reactor.h"
 
 #define CTEST_MAIN
 #include "ctest.h"
@@ -94,6 +96,189 @@ CTEST2(test, message)
     vrtql_msg_free(reply);
 }
 
+static void reactor_on_msg(vws_reactor* r, vws_cnx* c, vws_msg* m)
+{
+    int* received = (int*)r->data;
+
+    if (strncmp((cstr)m->data->data, content, m->data->size) == 0)
+    {
+        (*received)++;
+    }
+
+    vws_msg_free(m);
+}
+
+CTEST(test, reactor)
+{
+    // Drive several connections from one thread
+    int clients    = 8;
+    int rounds     = 10;
+    int received   = 0;
+    vws_reactor* r = vws_reactor_new();
+    ASSERT_TRUE(r != NULL);
+    r->on_msg      = reactor_on_msg;
+    r->data        = &received;
+
+    vws_cnx* cnxs[8];
+
+    for (int i = 0; i < clients; i++)
+    {
+        cnxs[i] = vws_cnx_new();
+        ASSERT_TRUE(vws_connect(cnxs[i], uri));
+        ASSERT_TRUE(vws_reactor_add(r, cnxs[i]));
+    }
+
+    ASSERT_TRUE(vws_reactor_size(r) == (size_t)clients);
+    ASSERT_FALSE(vws_reactor_add(r, cnxs[0]));
+
+    for (int n = 0; n < rounds; n++)
+    {
+        for (int i = 0; i < clients; i++)
+        {
+            ASSERT_TRUE(vws_frame_send_text(cnxs[i], content) > 0);
+        }
+    }
+
+    int tries = 0;
+    while (received < clients * rounds && tries++ < 100)
+    {
+        ASSERT_TRUE(vws_reactor_run(r, 100) >= 0);
+    }
+
+    ASSERT_EQUAL(clients * rounds, received);
+
+    for (int i = 0; i < clients; i++)
+    {
+        ASSERT_TRUE(vws_reactor_remove(r, cnxs[i]));
+        vws_cnx_free(cnxs[i]);
+    }
+
+    ASSERT_TRUE(vws_reactor_size(r) == 0);
+
+    vws_reactor_free(r);
+}
+
+// Waits with poll(), counting the calls
+static int wait_counted(vws_socket* s, short events, int timeout, short* revents)
+{
+    (*(int*)s->data)++;
+
+    struct pollfd fds;
+    fds.fd     = s->sockfd;
+    fds.events = events;
+
+    int rc   = poll(&fds, 1, timeout);
+    *revents = fds.revents;
+
+    return rc;
+}
+
+CTEST(test, wait_callback)
+{
+    int waits  = 0;
+    vws_cnx* c = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(c, uri));
+
+    // Route the socket's waits through the callback
+    c->base.data = (char*)&waits;
+    c->base.wait = wait_counted;
+
+    ASSERT_TRUE(vws_msg_send_text(c, content) > 0);
+    check_reply(c, content);
+
+    // Reads only wait when there is nothing to read yet
+    int before      = waits;
+    c->base.timeout = 100;
+    ASSERT_TRUE(vws_socket_read(&c->base) == 0);
+    ASSERT_TRUE(waits > before);
+
+    c->base.wait = NULL;
+    c->base.data = NULL;
+
+    vws_cnx_free(c);
+}
+
+CTEST(test, cork)
+{
+    vws_cnx* c = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(c, uri));
+
+    vws_cnx_cork(c, 0);
+
+    // Frames are queued until flushed
+    for (int i = 0; i < 100; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_text(c, content) > 0);
+    }
+
+    ASSERT_TRUE(c->out->size > 100 * strlen(content));
+    ASSERT_TRUE(vws_cnx_flush(c) > 0);
+    ASSERT_EQUAL(0, c->out->size);
+
+    for (int i = 0; i < 100; i++)
+    {
+        check_reply(c, content);
+    }
+
+    // Waiting for a reply flushes what is queued
+    ASSERT_TRUE(vws_msg_send_text(c, content) > 0);
+    check_reply(c, content);
+
+    // A small threshold flushes as it goes
+    vws_cnx_cork(c, 64);
+
+    for (int i = 0; i < 20; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_text(c, content) > 0);
+        ASSERT_TRUE(c->out->size < 64);
+    }
+
+    ASSERT_TRUE(vws_cnx_uncork(c) >= 0);
+    ASSERT_TRUE(c->out == NULL);
+
+    for (int i = 0; i < 20; i++)
+    {
+        check_reply(c, content);
+    }
+
+    vws_cnx_free(c);
+}
+
+static void count_sent(vws_cnx* c, uint64_t count)
+{
+    *(uint64_t*)c->data += count;
+}
+
+CTEST(test, async)
+{
+    uint64_t completed = 0;
+    vws_cnx* c         = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(c, uri));
+
+    c->data = (char*)&completed;
+    vws_cnx_set_async(c, count_sent);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_text(c, content) > 0);
+        ASSERT_TRUE(c->sent + (vws_cnx_pending(c) > 0) >= c->sends);
+    }
+
+    ASSERT_EQUAL(1000, c->sends);
+    ASSERT_TRUE(vws_cnx_flush(c) >= 0);
+    ASSERT_EQUAL(0, vws_cnx_pending(c));
+    ASSERT_EQUAL(1000, c->sent);
+    ASSERT_EQUAL(1000, completed);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        check_reply(c, content);
+    }
+
+    c->data = NULL;
+    vws_cnx_free(c);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -0,0 +1,812 @@
+#if defined(VWS_IO_URING)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "util/sc_map.h"
+#include "util/sc_queue.h"
+
+/** Operation of a completion, in the low bit of its user_data. The rest is
+ * the id of the socket's link. */
+#define URING_RECV 0
+#define URING_SEND 1
+
+/** Buffer group of the provided receive buffers */
+#define URING_BGID 0
+
+/** Most provided buffers a ring can have */
+#define URING_BUFFERS_MAX 32768
+
+//------------------------------------------------------------------------------
+// Internal types
+//------------------------------------------------------------------------------
+
+/**
+ * @brief A socket's attachment to a ring
+ */
+typedef struct vws_uring_link
+{
+    struct vws_uring* ring; /**< The ring                                   */
+    vws_socket* socket;     /**< The socket                                 */
+    uint64_t id;            /**< Key in the ring's links, in user_data      */
+    size_t received;        /**< Bytes received not yet returned by a read  */
+    int error;              /**< Result that ended the recv, if closed      */
+    bool armed;             /**< A multishot recv is in flight              */
+    bool closed;            /**< The peer closed or the recv failed         */
+    bool removing;          /**< Being detached, don't arm again            */
+    bool ready;             /**< Queued for vws_uring_next()                */
+    bool sending;           /**< A send is in flight                        */
+    ssize_t sent;           /**< Result of the last send                    */
+} vws_uring_link;
+
+struct vws_uring
+{
+    int fd;                       /**< The ring descriptor                   */
+
+    void* ring;                   /**< SQ and CQ rings (one mapping)         */
+    size_t ring_size;             /**< Size of the ring mapping              */
+    struct io_uring_sqe* sqes;    /**< Submission queue entries              */
+    size_t sqes_size;             /**< Size of the sqes mapping              */
+
+    unsigned* sq_head;            /**< SQ head (kernel)                      */
+    unsigned* sq_tail;            /**< SQ tail (us)                          */
+    unsigned* sq_array;           /**< SQ index array                        */
+    unsigned sq_mask;             /**< SQ index mask                         */
+    unsigned sq_entries;          /**< SQ size                               */
+
+    unsigned* cq_head;            /**< CQ head (us)                          */
+    unsigned* cq_tail;            /**< CQ tail (kernel)                      */
+    unsigned cq_mask;             /**< CQ index mask                         */
+    struct io_uring_cqe* cqes;    /**< Completion queue entries              */
+
+    struct io_uring_buf_ring* br; /**< Provided buffer ring                  */
+    size_t br_size;               /**< Size of the buffer ring mapping       */
+    unsigned char* buffers;       /**< Receive buffer memory                 */
+    unsigned buf_count;           /**< Number of receive buffers             */
+    size_t buf_size;              /**< Size of each receive buffer           */
+    unsigned short buf_tail;      /**< Buffer ring tail                      */
+
+    struct sc_map_64v links;      /**< Attached sockets by link id           */
+    struct sc_queue_64 ready;     /**< Link ids for vws_uring_next()         */
+    uint64_t next_id;             /**< Last link id handed out               */
+};
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Sets up the kernel ring and maps it.
+ *
+ * @param u The ring
+ * @param entries The submission queue size
+ * @return True on success, false otherwise.
+ *
+ * @ingroup UringFunctions
+ */
+static bool uring_setup(vws_uring* u, unsigned entries);
+
+/**
+ * @brief Registers the provided receive buffers with the kernel.
+ *
+ * @param u The ring
+ * @return True on success, false otherwise.
+ *
+ * @ingroup UringFunctions
+ */
+static bool uring_setup_buffers(vws_uring* u);
+
+/**
+ * @brief Hands a receive buffer back to the kernel.
+ *
+ * @param u The ring
+ * @param bid The buffer id
+ *
+ * @ingroup UringFunctions
+ */
+static void uring_buffer_put(vws_uring* u, unsigned short bid);
+
+/**
+ * @brief Queues a submission. It is submitted by the next uring_enter().
+ *
+ * @param u The ring
+ * @param op The operation (IORING_OP_*)
+ * @param fd The socket descriptor
+ * @param addr The operation's address
+ * @param len The operation's length
+ * @param user_data The value to identify the completion by
+ * @return The entry, for setting anything else the operation needs.
+ *
+ * @ingroup UringFunctions
+ */
+static struct io_uring_sqe* uring_prep( vws_uring* u,
+                                        int op,
+                                        int fd,
+                                        uint64_t addr,
+                                        unsigned len,
+                                        uint64_t user_data );
+
+/**
+ * @brief Submits everything queued and optionally waits for completions.
+ *
+ * @param u The ring
+ * @param wait The number of completions to wait for (0 or 1)
+ * @param timeout Maximum time to wait in milliseconds, -1 for no limit
+ * @return As io_uring_enter(): -1 with errno set on error, ETIME on timeout.
+ *
+ * @ingroup UringFunctions
+ */
+static int uring_enter(vws_uring* u, unsigned wait, int timeout);
+
+/**
+ * @brief Processes every completion in the completion queue.
+ *
+ * @param u The ring
+ * @return The number of completions processed.
+ *
+ * @ingroup UringFunctions
+ */
+static int uring_reap(vws_uring* u);
+
+/**
+ * @brief Processes one completion.
+ *
+ * @param u The ring
+ * @param cqe The completion
+ *
+ * @ingroup UringFunctions
+ */
+static void uring_complete(vws_uring* u, struct io_uring_cqe* cqe);
+
+/**
+ * @brief Queues a multishot recv for a socket.
+ *
+ * @param link The socket's link
+ *
+ * @ingroup UringFunctions
+ */
+static void uring_arm(vws_uring_link* link);
+
+/**
+ * @brief Queues a link for vws_uring_next(), once.
+ *
+ * @param u The ring
+ * @param link The link
+ *
+ * @ingroup UringFunctions
+ */
+static void uring_ready(vws_uring* u, vws_uring_link* link);
+
+/**
+ * @brief Looks up a link by id.
+ *
+ * @param u The ring
+ * @param id The link id
+ * @return The link, or NULL if it has been detached.
+ *
+ * @ingroup UringFunctions
+ */
+static vws_uring_link* uring_lookup(vws_uring* u, uint64_t id);
+
+//------------------------------------------------------------------------------
+//> Uring API
+//------------------------------------------------------------------------------
+
+vws_uring* vws_uring_new(unsigned entries, unsigned buffers, size_t size)
+{
+    vws_uring* u = vws.calloc(1, sizeof(vws_uring));
+    u->fd        = -1;
+
+    // The buffer ring size must be a power of two
+    unsigned count = 1;
+    while (count < buffers && count < URING_BUFFERS_MAX)
+    {
+        count <<= 1;
+    }
+
+    u->buf_count = count;
+    u->buf_size  = size;
+
+    sc_map_init_64v(&u->links, 0, 0);
+    sc_queue_init(&u->ready);
+
+    if (uring_setup(u, entries) == false || uring_setup_buffers(u) == false)
+    {
+        vws_uring_free(u);
+        return NULL;
+    }
+
+    vws.success();
+
+    return u;
+}
+
+void vws_uring_free(vws_uring* u)
+{
+    if (u == NULL)
+    {
+        return;
+    }
+
+    // Detach whatever is still attached
+    while (sc_map_size_64v(&u->links) > 0)
+    {
+        vws_uring_link* link;
+        sc_map_foreach_value(&u->links, link)
+        {
+            break;
+        }
+
+        vws_uring_remove(link->socket);
+    }
+
+    if (u->ring != NULL)
+    {
+        munmap(u->ring, u->ring_size);
+    }
+
+    if (u->sqes != NULL)
+    {
+        munmap(u->sqes, u->sqes_size);
+    }
+
+    if (u->fd >= 0)
+    {
+        close(u->fd);
+    }
+
+    if (u->br != NULL)
+    {
+        munmap(u->br, u->br_size);
+    }
+
+    vws.free(u->buffers);
+
+    sc_map_term_64v(&u->links);
+    sc_queue_term(&u->ready);
+
+    vws.free(u);
+}
+
+bool vws_uring_add(vws_uring* u, vws_socket* s)
+{
+    if (vws_socket_is_connected(s) == false)
+    {
+        vws.error(VE_SOCKET, "vws_uring_add(): not connected");
+        return false;
+    }
+
+    if (s->ssl != NULL)
+    {
+        vws.error(VE_WARN, "vws_uring_add(): TLS sockets can't use io_uring");
+        return false;
+    }
+
+    if (s->uring != NULL)
+    {
+        vws.error(VE_WARN, "vws_uring_add(): already attached");
+        return false;
+    }
+
+    vws_uring_link* link = vws.calloc(1, sizeof(vws_uring_link));
+    link->ring           = u;
+    link->socket         = s;
+    link->id             = ++u->next_id;
+
+    sc_map_put_64v(&u->links, link->id, link);
+    s->uring = link;
+
+    uring_arm(link);
+
+    if (uring_enter(u, 0, 0) < 0)
+    {
+        vws.error(VE_SYS, "io_uring_enter(): %s", strerror(errno));
+        vws_uring_remove(s);
+
+        return false;
+    }
+
+    vws.success();
+
+    return true;
+}
+
+void vws_uring_remove(vws_socket* s)
+{
+    vws_uring_link* link = s->uring;
+
+    if (link == NULL)
+    {
+        return;
+    }
+
+    vws_uring* u   = link->ring;
+    link->removing = true;
+
+    // Cancel the recv and wait for its last completion, after which the
+    // kernel no longer refers to the socket.
+    if (link->armed == true)
+    {
+        struct io_uring_sqe* sqe;
+        sqe = uring_prep(u, IORING_OP_ASYNC_CANCEL, -1, 0, 0, 0);
+        sqe->addr = link->id << 1 | URING_RECV;
+
+        while (link->armed == true)
+        {
+            if (uring_enter(u, 1, -1) < 0 && errno != EINTR)
+            {
+                break;
+            }
+
+            uring_reap(u);
+        }
+    }
+
+    sc_map_del_64v(&u->links, link->id);
+    s->uring = NULL;
+
+    vws.free(link);
+}
+
+int vws_uring_wait(vws_uring* u, int timeout)
+{
+    vws.success();
+
+    int n = uring_reap(u);
+
+    if (n > 0 || timeout == 0)
+    {
+        if (uring_enter(u, 0, 0) < 0)
+        {
+            vws.error(VE_SYS, "io_uring_enter(): %s", strerror(errno));
+            return -1;
+        }
+
+        return n + uring_reap(u);
+    }
+
+    if (uring_enter(u, 1, timeout) < 0)
+    {
+        if (errno == ETIME || errno == EINTR)
+        {
+            return 0;
+        }
+
+        vws.error(VE_SYS, "io_uring_enter(): %s", strerror(errno));
+        return -1;
+    }
+
+    return uring_reap(u);
+}
+
+vws_socket* vws_uring_next(vws_uring* u)
+{
+    while (sc_queue_size(&u->ready) > 0)
+    {
+        vws_uring_link* link = uring_lookup(u, sc_queue_del_first(&u->ready));
+
+        // Detached since it was queued
+        if (link == NULL)
+        {
+            continue;
+        }
+
+        link->ready = false;
+
+        return link->socket;
+    }
+
+    return NULL;
+}
+
+ssize_t vws_uring_read(vws_socket* s, bool wait)
+{
+    vws_uring_link* link = s->uring;
+    vws_uring* u         = link->ring;
+
+    uring_reap(u);
+
+    while (true)
+    {
+        if (link->received > 0)
+        {
+            ssize_t n      = link->received;
+            link->received = 0;
+
+            return n;
+        }
+
+        if (link->closed == true)
+        {
+            if (link->error == 0)
+            {
+                vws.error(VE_SOCKET, "Connection closed by peer");
+            }
+            else
+            {
+                vws.error(VE_SOCKET, "recv(): %s", strerror(-link->error));
+            }
+
+            return -1;
+        }
+
+        if (link->armed == false)
+        {
+            uring_arm(link);
+        }
+
+        if (uring_enter(u, wait ? 1 : 0, s->timeout) < 0)
+        {
+            if (errno == ETIME)
+            {
+                vws.error(VE_TIMEOUT, "io_uring_enter()");
+                return 0;
+            }
+
+            if (errno == EINTR)
+            {
+                vws.error(VE_TIMEOUT, "io_uring_enter() interrupted");
+                return 0;
+            }
+
+            vws.error(VE_SYS, "io_uring_enter(): %s", strerror(errno));
+            return -1;
+        }
+
+        if (uring_reap(u) == 0 && wait == false)
+        {
+            return 0;
+        }
+    }
+}
+
+ssize_t vws_uring_write(vws_socket* s, ucstr data, size_t size)
+{
+    vws_uring_link* link = s->uring;
+    vws_uring* u         = link->ring;
+    size_t total         = 0;
+
+    while (total < size)
+    {
+        struct io_uring_sqe* sqe = uring_prep( u,
+                                               IORING_OP_SEND,
+                                               s->sockfd,
+                                               (uint64_t)(uintptr_t)(data + total),
+                                               size - total,
+                                               link->id << 1 | URING_SEND );
+        sqe->msg_flags = MSG_NOSIGNAL;
+        link->sending  = true;
+
+        // One system call submits the send and waits for it. Completions for
+        // other sockets that arrive meanwhile are processed on the way.
+        while (link->sending == true)
+        {
+            if (uring_enter(u, 1, -1) < 0 && errno != EINTR)
+            {
+                vws.error(VE_SYS, "io_uring_enter(): %s", strerror(errno));
+                return -1;
+            }
+
+            uring_reap(u);
+        }
+
+        if (link->sent < 0)
+        {
+            vws.error(VE_SOCKET, "send(): %s", strerror(-link->sent));
+            return -1;
+        }
+
+        total += link->sent;
+
+        // Not in flush mode, the caller handles partial writes.
+        if (s->flush == false)
+        {
+            break;
+        }
+    }
+
+    return total;
+}
+
+//------------------------------------------------------------------------------
+//> Internal functions
+//------------------------------------------------------------------------------
+
+bool uring_setup(vws_uring* u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+    if (u->fd < 0)
+    {
+        vws.error(VE_SYS, "io_uring_setup(): %s", strerror(errno));
+        return false;
+    }
+
+    // One mapping for both rings (5.4) and timeouts on wait (5.11)
+    if ( (p.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+         (p.features & IORING_FEAT_EXT_ARG) == 0 )
+    {
+        vws.error(VE_SYS, "io_uring: kernel too old");
+        return false;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size   = (sq_size > cq_size) ? sq_size : cq_size;
+
+    void* ring = mmap( NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING );
+
+    if (ring == MAP_FAILED)
+    {
+        vws.error(VE_SYS, "io_uring mmap(): %s", strerror(errno));
+        return false;
+    }
+
+    u->ring      = ring;
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    void* sqes = mmap( NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES );
+
+    if (sqes == MAP_FAILED)
+    {
+        vws.error(VE_SYS, "io_uring mmap(): %s", strerror(errno));
+        return false;
+    }
+
+    unsigned char* base = ring;
+
+    u->sqes       = sqes;
+    u->sq_head    = (unsigned*)(base + p.sq_off.head);
+    u->sq_tail    = (unsigned*)(base + p.sq_off.tail);
+    u->sq_array   = (unsigned*)(base + p.sq_off.array);
+    u->sq_mask    = *(unsigned*)(base + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head    = (unsigned*)(base + p.cq_off.head);
+    u->cq_tail    = (unsigned*)(base + p.cq_off.tail);
+    u->cq_mask    = *(unsigned*)(base + p.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+
+    return true;
+}
+
+bool uring_setup_buffers(vws_uring* u)
+{
+    u->br_size = u->buf_count * sizeof(struct io_uring_buf);
+
+    // The ring must be page aligned, which mmap() guarantees
+    void* br = mmap( NULL, u->br_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+    if (br == MAP_FAILED)
+    {
+        vws.error(VE_SYS, "io_uring mmap(): %s", strerror(errno));
+        return false;
+    }
+
+    u->br = br;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)br;
+    reg.ring_entries = u->buf_count;
+    reg.bgid         = URING_BGID;
+
+    if (syscall(__NR_io_uring_register, u->fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        vws.error(VE_SYS, "io_uring buffer ring: %s", strerror(errno));
+        return false;
+    }
+
+    u->buffers = vws.malloc(u->buf_count * u->buf_size);
+
+    for (unsigned i = 0; i < u->buf_count; i++)
+    {
+        uring_buffer_put(u, (unsigned short)i);
+    }
+
+    return true;
+}
+
+void uring_buffer_put(vws_uring* u, unsigned short bid)
+{
+    struct io_uring_buf* b = &u->br->bufs[u->buf_tail & (u->buf_count - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(u->buffers + bid * u->buf_size);
+    b->len  = u->buf_size;
+    b->bid  = bid;
+
+    u->buf_tail++;
+    __atomic_store_n(&u->br->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe* uring_prep( vws_uring* u,
+                                 int op,
+                                 int fd,
+                                 uint64_t addr,
+                                 unsigned len,
+                                 uint64_t user_data )
+{
+    unsigned tail = *u->sq_tail;
+
+    // Full. Submit what is there to make room.
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+    {
+        uring_enter(u, 0, 0);
+    }
+
+    unsigned index           = tail & u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = addr;
+    sqe->len       = len;
+    sqe->user_data = user_data;
+
+    u->sq_array[index] = index;
+
+    // The kernel only reads the queue in io_uring_enter(), so the caller may
+    // still fill in the rest after this.
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+int uring_enter(vws_uring* u, unsigned wait, int timeout)
+{
+    unsigned queued = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags  = 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+
+    if (wait > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+
+        if (timeout >= 0)
+        {
+            ts.tv_sec      = timeout / 1000;
+            ts.tv_nsec     = (timeout % 1000) * 1000000;
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts         = (uint64_t)(uintptr_t)&ts;
+            flags         |= IORING_ENTER_EXT_ARG;
+        }
+    }
+
+    if (queued == 0 && wait == 0)
+    {
+        return 0;
+    }
+
+    if (flags & IORING_ENTER_EXT_ARG)
+    {
+        return syscall( __NR_io_uring_enter, u->fd, queued, wait, flags,
+                        &arg, sizeof(arg) );
+    }
+
+    return syscall(__NR_io_uring_enter, u->fd, queued, wait, flags, NULL, 0);
+}
+
+int uring_reap(vws_uring* u)
+{
+    unsigned head = *u->cq_head;
+    int n         = 0;
+
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        uring_complete(u, &u->cqes[head & u->cq_mask]);
+
+        head++;
+        n++;
+
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
+
+void uring_complete(vws_uring* u, struct io_uring_cqe* cqe)
+{
+    vws_uring_link* link = uring_lookup(u, cqe->user_data >> 1);
+    int res              = cqe->res;
+
+    if ((cqe->user_data & 1) == URING_SEND)
+    {
+        if (link != NULL)
+        {
+            link->sent    = res;
+            link->sending = false;
+        }
+
+        return;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (link != NULL && res > 0)
+        {
+            ucstr data = u->buffers + bid * u->buf_size;
+            vws_buffer_append(link->socket->buffer, data, res);
+
+            link->received += res;
+            uring_ready(u, link);
+        }
+
+        uring_buffer_put(u, bid);
+    }
+
+    // Multishot recv ended
+    if (link != NULL && (cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        link->armed = false;
+
+        if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED))
+        {
+            // Peer closed, or the recv failed
+            link->closed = true;
+            link->error  = res;
+            uring_ready(u, link);
+        }
+        else if (res != -ECANCELED && link->removing == false)
+        {
+            // It ran out of buffers, or the kernel ended it. Start another.
+            uring_arm(link);
+        }
+    }
+}
+
+void uring_arm(vws_uring_link* link)
+{
+    struct io_uring_sqe* sqe = uring_prep( link->ring,
+                                           IORING_OP_RECV,
+                                           link->socket->sockfd,
+                                           0,
+                                           0,
+                                           link->id << 1 | URING_RECV );
+
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    link->armed    = true;
+}
+
+void uring_ready(vws_uring* u, vws_uring_link* link)
+{
+    if (link->ready == false)
+    {
+        link->ready = true;
+        sc_queue_add_last(&u->ready, link->id);
+    }
+}
+
+vws_uring_link* uring_lookup(vws_uring* u, uint64_t id)
+{
+    vws_uring_link* link = sc_map_get_64v(&u->links, id);
+
+    if (sc_map_found(&u->links) == false)
+    {
+        return NULL;
+    }
+
+    return link;
+}
+
+#endif /* VWS_IO_URING */
@@ -0,0 +1,150 @@
+#ifndef VWS_URING_DECLARE
+#define VWS_URING_DECLARE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "socket.h"
+
+/**
+ * @file uring.h
+ * @brief io_uring socket backend (Linux, built with -DIO_URING=ON)
+ *
+ * A socket attached to a ring reads and writes through io_uring instead of
+ * poll() plus recv()/send(). Each socket keeps a multishot recv armed. The
+ * kernel completes it into buffers from a ring of provided buffers registered
+ * with the ring, and the data is appended to the socket's receive buffer as
+ * the completions are reaped. A read that finds data already reaped makes no
+ * system call at all, and one that has to wait makes a single io_uring_enter().
+ * A write is one io_uring_enter() that submits the send and waits for it.
+ *
+ * Many sockets can share a ring. Every io_uring_enter() then submits whatever
+ * any of them has queued and reaps completions for all of them, so a client
+ * with many connections drives them all with one system call per wait. Use
+ * vws_uring_wait() and vws_uring_next() to do this from one thread, much like
+ * the reactor (reactor.h).
+ *
+ * A ring is not thread safe: a ring and the sockets attached to it must be used
+ * from one thread. Only plaintext sockets can be attached. TLS sockets keep
+ * using poll(), as OpenSSL does its own socket I/O. Needs Linux 6.0 or later
+ * (multishot recv).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vws_uring;
+
+/**
+ * @brief An io_uring shared by the sockets attached to it. Opaque.
+ */
+typedef struct vws_uring vws_uring;
+
+/**
+ * @brief Creates a new ring.
+ *
+ * @param entries The submission queue size. Rounded up to a power of two.
+ * @param buffers The number of receive buffers shared by the attached sockets.
+ *   Rounded up to a power of two.
+ * @param size The size of each receive buffer.
+ * @return The ring, or NULL if io_uring or a feature it needs is not
+ *   available (vws.e has the details).
+ *
+ * @ingroup UringFunctions
+ */
+vws_uring* vws_uring_new(unsigned entries, unsigned buffers, size_t size);
+
+/**
+ * @brief Frees a ring. The sockets attached to it are detached first and go
+ * back to poll().
+ *
+ * @param u The ring.
+ *
+ * @ingroup UringFunctions
+ */
+void vws_uring_free(vws_uring* u);
+
+/**
+ * @brief Attaches a connected socket to a ring. From then on it reads and
+ * writes through the ring, until it is closed or detached.
+ *
+ * @param u The ring.
+ * @param s The socket. Must be connected and not use TLS.
+ * @return True on success, false otherwise.
+ *
+ * @ingroup UringFunctions
+ */
+bool vws_uring_add(vws_uring* u, vws_socket* s);
+
+/**
+ * @brief Detaches a socket from its ring. Its recv is cancelled and anything
+ * already received stays in its receive buffer. Closing a socket detaches it.
+ *
+ * @param s The socket.
+ *
+ * @ingroup UringFunctions
+ */
+void vws_uring_remove(vws_socket* s);
+
+/**
+ * @brief Submits what the attached sockets have queued and waits for
+ * completions, moving received data into their receive buffers. Sockets that
+ * receive data or are closed by the peer are then returned by
+ * vws_uring_next().
+ *
+ * @param u The ring.
+ * @param timeout Maximum time to wait in milliseconds. -1 waits indefinitely,
+ *   0 returns immediately.
+ * @return The number of completions processed, 0 on timeout, -1 on error.
+ *
+ * @ingroup UringFunctions
+ */
+int vws_uring_wait(vws_uring* u, int timeout);
+
+/**
+ * @brief Returns the next socket with data in its receive buffer, or that
+ * the peer closed, since it was last returned. For a connection, follow with
+ * vws_socket_read_ready() (which returns -1 once the peer has closed) and then
+ * vws_cnx_ingress() and vws_msg_pop().
+ *
+ * @param u The ring.
+ * @return The socket, or NULL if there are no more.
+ *
+ * @ingroup UringFunctions
+ */
+vws_socket* vws_uring_next(vws_uring* u);
+
+/**
+ * @brief Reads through the ring for vws_socket_read(). Waits up to the socket
+ * timeout for data.
+ *
+ * @param s The socket.
+ * @param wait Whether to wait for data if none has been received yet
+ *   (vws_socket_read()) or not (vws_socket_read_ready()).
+ * @return The number of bytes added to the receive buffer, 0 on timeout, -1
+ *   on error or if the peer has closed. The caller closes the socket.
+ *
+ * @ingroup UringFunctions
+ */
+ssize_t vws_uring_read(vws_socket* s, bool wait);
+
+/**
+ * @brief Writes through the ring for vws_socket_write().
+ *
+ * @param s The socket.
+ * @param data The data.
+ * @param size The number of bytes.
+ * @return The number of bytes written, -1 on error. The caller closes the
+ *   socket.
+ *
+ * @ingroup UringFunctions
+ */
+ssize_t vws_uring_write(vws_socket* s, ucstr data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VWS_URING_DECLARE */
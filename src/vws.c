@@ -3,23 +3,30 @@
 #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #if defined(__windows__)
 #include <windows.h>
 #endif
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <inttypes.h>
 
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
-#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <openssl/ssl.h>
@@ -39,6 +46,37 @@ static void vws_error_clear_default();
 // Function to process an error by default
 static int vws_error_default_process(int code, cstr message);
 
+// Functions to lock and unlock a pool depot
+static void pool_lock(bool* lock);
+static void pool_unlock(bool* lock);
+
+// Function to release a list of pooled objects with vws.free()
+struct pool_node;
+static void pool_release(struct pool_node* node);
+
+// Function to arrange for the calling thread's cache to be flushed at exit
+static void pool_register();
+
+// Thread exit handler which flushes the thread's cache to the depots
+static void pool_thread_exit(void* arg);
+
+// Function to put a record in the calling thread's trace buffer
+static void trace_async_put( int kind,
+                             vws_log_level_t level,
+                             cstr title,
+                             vws_trace_dump_cb dump,
+                             const void* data,
+                             size_t size );
+
+// Function to format a message into the calling thread's trace buffer
+static void trace_async_vput(vws_log_level_t level, cstr format, va_list ap);
+
+// Function to count an allocation against its call site
+static void alloc_record(void* site, size_t size);
+
+// Function to count a free
+static void alloc_record_free();
+
 //------------------------------------------------------------------------------
 // Tracing
 //------------------------------------------------------------------------------
@@ -53,6 +91,11 @@ static int vws_error_default_process(int code, cstr message);
 #define ANSI_COLOR_CYAN    "\x1b[36m"
 #define ANSI_COLOR_WHITE   "\x1b[37m"
 
+// Asynchronous trace record kinds
+#define TRACE_PAD     0
+#define TRACE_MESSAGE 1
+#define TRACE_DUMP    2
+
 #ifdef __windows__
 // Windows Mutex for thread-safe logging
 HANDLE log_mutex;
@@ -134,6 +177,16 @@ void vws_trace(vws_log_level_t level, const char* format, ...)
         return;
     }
 
+    if (vws_trace_async() == true)
+    {
+        va_list args;
+        va_start(args, format);
+        trace_async_vput(level, format, args);
+        va_end(args);
+
+        return;
+    }
+
     time_t raw_time;
     struct tm time_info;
     char stamp[20];
@@ -224,10 +277,477 @@ void vws_trace(vws_log_level_t level, const char* format, ...)
 #endif
 }
 
+/**
+ * @brief Prints the banner around a trace dump.
+ *
+ * @param title The banner title, or NULL for the closing line
+ */
+static void trace_banner(cstr title)
+{
+    if (title == NULL)
+    {
+        printf("------------------------------------------------------\n");
+        return;
+    }
+
+    printf("\n\n");
+    printf("+----------------------------------------------------+\n");
+    printf("| %-51s|\n", title);
+    printf("+----------------------------------------------------+\n");
+}
+
+void vws_trace_dump( cstr title,
+                     vws_trace_dump_cb dump,
+                     const unsigned char* data,
+                     size_t size )
+{
+    if (vws_trace_async() == true)
+    {
+        if (size > VWS_TRACE_DUMP_MAX)
+        {
+            size = VWS_TRACE_DUMP_MAX;
+        }
+
+        trace_async_put(TRACE_DUMP, VL_DEBUG, title, dump, data, size);
+
+        return;
+    }
+
+    vws_trace_lock();
+    trace_banner(title);
+    dump(data, size);
+    trace_banner(NULL);
+    vws_trace_unlock();
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous tracing
+//------------------------------------------------------------------------------
+
+// Default size of a thread's trace buffer
+#define TRACE_RING_SIZE (1024 * 1024)
+
+// How long the writer sleeps when it finds nothing to write (microseconds)
+#define TRACE_IDLE_US 1000
+
+// A record in a trace buffer. Records are padded to a multiple of 8 bytes and
+// never wrap: one that would is preceded by a pad record to the end.
+typedef struct
+{
+    uint32_t size;          /**< Size of the record including this header */
+    uint8_t kind;           /**< The record kind                          */
+    uint8_t level;          /**< The log level                            */
+    uint16_t reserved;      /**< Unused                                   */
+    uint32_t length;        /**< Size of the data after this header       */
+    uint32_t reserved2;     /**< Unused                                   */
+    uint64_t time;          /**< Wall clock time in nanoseconds           */
+    cstr title;             /**< Dump title                               */
+    vws_trace_dump_cb dump; /**< Dump function                            */
+} trace_record;
+
+// A thread's trace buffer. Its thread is the only writer and the background
+// thread the only reader, so the two counters are all the coordination there
+// is.
+typedef struct trace_ring
+{
+    unsigned char* data;     /**< The buffer                                */
+    size_t size;             /**< Size of the buffer, a power of two        */
+    uint64_t head;           /**< Bytes read, only moved by the writer      */
+    uint64_t tail;           /**< Bytes written, only moved by the thread   */
+    uint64_t dropped;        /**< Records dropped because it was full       */
+    unsigned long tid;       /**< The thread it belongs to                  */
+    bool orphaned;           /**< Its thread has exited                     */
+    struct trace_ring* next; /**< Next buffer in the writer's list          */
+} trace_ring;
+
+// The calling thread's buffer
+static __thread trace_ring* trace_local = NULL;
+
+// Whether asynchronous tracing is on
+static bool trace_async_on = false;
+
+// The writer thread and the buffers it reads. The list lock is only taken when
+// a thread gets its buffer and when the writer walks the list.
+static pthread_t trace_writer;
+static bool trace_stopping       = false;
+static size_t trace_ring_size    = TRACE_RING_SIZE;
+static trace_ring* trace_rings   = NULL;
+static bool trace_rings_lock     = false;
+static pthread_key_t trace_key;
+static bool trace_key_created    = false;
+static uint64_t trace_dropped    = 0;
+
+static void trace_ring_orphan(void* arg)
+{
+    trace_ring* ring = (trace_ring*)arg;
+    __atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Gets the calling thread's trace buffer, creating it on first use.
+ *
+ * @return The buffer.
+ */
+static trace_ring* trace_ring_get()
+{
+    if (trace_local != NULL)
+    {
+        return trace_local;
+    }
+
+    trace_ring* ring = malloc(sizeof(trace_ring));
+    ring->data       = malloc(trace_ring_size);
+    ring->size       = trace_ring_size;
+    ring->head       = 0;
+    ring->tail       = 0;
+    ring->dropped    = 0;
+    ring->tid        = (unsigned long)pthread_self();
+    ring->orphaned   = false;
+
+    // The writer frees it once its thread has gone and it has been drained
+    pthread_setspecific(trace_key, ring);
+
+    pool_lock(&trace_rings_lock);
+    ring->next  = trace_rings;
+    trace_rings = ring;
+    pool_unlock(&trace_rings_lock);
+
+    trace_local = ring;
+
+    return ring;
+}
+
+/**
+ * @brief Reserves space for a record in the calling thread's buffer.
+ *
+ * @param ring The buffer
+ * @param size The size of the record, a multiple of 8
+ * @return The record, or NULL if there is no room.
+ */
+static trace_record* trace_ring_reserve(trace_ring* ring, size_t size)
+{
+    uint64_t head   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail   = ring->tail;
+    size_t offset   = tail & (ring->size - 1);
+    size_t contig   = ring->size - offset;
+    size_t pad      = (contig < size) ? contig : 0;
+
+    if (size > ring->size || (tail - head) + pad + size > ring->size)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if (pad > 0)
+    {
+        // Skip to the start of the buffer
+        trace_record* skip = (trace_record*)(ring->data + offset);
+        skip->size         = (uint32_t)pad;
+        skip->kind         = TRACE_PAD;
+        tail              += pad;
+        offset             = 0;
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return (trace_record*)(ring->data + offset);
+}
+
+/**
+ * @brief Publishes the record last reserved in the calling thread's buffer.
+ *
+ * @param ring The buffer
+ * @param r The record
+ */
+static void trace_ring_commit(trace_ring* ring, trace_record* r)
+{
+    __atomic_store_n(&ring->tail, ring->tail + r->size, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Gets the wall clock time in nanoseconds.
+ *
+ * @return The time.
+ */
+static uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Rounds a size up to a multiple of 8
+#define TRACE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+void trace_async_put( int kind,
+                      vws_log_level_t level,
+                      cstr title,
+                      vws_trace_dump_cb dump,
+                      const void* data,
+                      size_t size )
+{
+    trace_ring* ring = trace_ring_get();
+    size_t total     = TRACE_ALIGN(sizeof(trace_record) + size);
+    trace_record* r  = trace_ring_reserve(ring, total);
+
+    if (r == NULL)
+    {
+        return;
+    }
+
+    r->size   = (uint32_t)total;
+    r->kind   = (uint8_t)kind;
+    r->level  = (uint8_t)level;
+    r->length = (uint32_t)size;
+    r->time   = trace_now();
+    r->title  = title;
+    r->dump   = dump;
+
+    memcpy(r + 1, data, size);
+    trace_ring_commit(ring, r);
+}
+
+void trace_async_vput(vws_log_level_t level, cstr format, va_list ap)
+{
+    // Most messages are short. Format on the stack and copy once the length is
+    // known.
+    char text[512];
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(text, sizeof(text), format, copy);
+    va_end(copy);
+
+    if (n < 0)
+    {
+        return;
+    }
+
+    if ((size_t)n < sizeof(text))
+    {
+        trace_async_put(TRACE_MESSAGE, level, NULL, NULL, text, n);
+        return;
+    }
+
+    char* big = malloc(n + 1);
+    vsnprintf(big, n + 1, format, ap);
+    trace_async_put(TRACE_MESSAGE, level, NULL, NULL, big, n);
+    free(big);
+}
+
+/**
+ * @brief Formats and writes a record.
+ *
+ * @param ring The buffer it came from
+ * @param r The record
+ * @param stamp The cached timestamp text
+ * @param second The second the cached text is for
+ */
+static void trace_write( trace_ring* ring,
+                         trace_record* r,
+                         char* stamp,
+                         time_t* second )
+{
+    time_t t = (time_t)(r->time / 1000000000ULL);
+
+    if (t != *second)
+    {
+        struct tm time_info;
+        localtime_r(&t, &time_info);
+        strftime(stamp, 20, "%Y-%m-%d %H:%M:%S", &time_info);
+        *second = t;
+    }
+
+    if (r->kind == TRACE_DUMP)
+    {
+        trace_banner(r->title);
+        r->dump((const unsigned char*)(r + 1), r->length);
+        trace_banner(NULL);
+
+        return;
+    }
+
+    fprintf( stderr, "%s[%s.%06u] [%lu] [%s]%s %.*s\n",
+             log_level_infos[r->level].color,
+             stamp,
+             (unsigned)((r->time % 1000000000ULL) / 1000),
+             ring->tid,
+             log_level_infos[r->level].level,
+             ANSI_COLOR_RESET,
+             (int)r->length,
+             (const char*)(r + 1) );
+}
+
+/**
+ * @brief Writes out everything in the buffers. Buffers of threads that have
+ * exited are freed once drained.
+ *
+ * @return The number of records written.
+ */
+static size_t trace_drain()
+{
+    static char stamp[20];
+    static time_t second = -1;
+    size_t count         = 0;
+
+    pool_lock(&trace_rings_lock);
+
+    trace_ring** link = &trace_rings;
+
+    while (*link != NULL)
+    {
+        trace_ring* ring = *link;
+        bool orphaned    = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        uint64_t tail    = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64_t head    = ring->head;
+
+        while (head != tail)
+        {
+            size_t offset   = head & (ring->size - 1);
+            trace_record* r = (trace_record*)(ring->data + offset);
+
+            if (r->kind != TRACE_PAD)
+            {
+                trace_write(ring, r, stamp, &second);
+                count++;
+            }
+
+            head += r->size;
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        }
+
+        uint64_t dropped = __atomic_exchange_n( &ring->dropped, 0,
+                                                __ATOMIC_RELAXED );
+
+        if (dropped > 0)
+        {
+            __atomic_fetch_add(&trace_dropped, dropped, __ATOMIC_RELAXED);
+
+            fprintf( stderr, "[%lu] %" PRIu64 " trace records dropped\n",
+                     ring->tid, dropped );
+        }
+
+        if (orphaned == true)
+        {
+            *link = ring->next;
+            free(ring->data);
+            free(ring);
+            continue;
+        }
+
+        link = &ring->next;
+    }
+
+    pool_unlock(&trace_rings_lock);
+
+    if (count > 0)
+    {
+        fflush(stderr);
+        fflush(stdout);
+    }
+
+    return count;
+}
+
+static void* trace_writer_thread(void* arg)
+{
+    while (__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE) == false)
+    {
+        if (trace_drain() == 0)
+        {
+            usleep(TRACE_IDLE_US);
+        }
+    }
+
+    // Whatever came in before tracing was turned off
+    trace_drain();
+
+    return NULL;
+}
+
+bool vws_trace_async_start(size_t size)
+{
+    if (vws_trace_async() == true)
+    {
+        vws.error(VE_WARN, "asynchronous tracing already on");
+        return false;
+    }
+
+    if (size == 0)
+    {
+        size = TRACE_RING_SIZE;
+    }
+
+    // Round up to a power of two, big enough for the largest dump
+    size_t n = 1024;
+
+    while (n < size || n < 2 * (VWS_TRACE_DUMP_MAX + sizeof(trace_record)))
+    {
+        n <<= 1;
+    }
+
+    trace_ring_size = n;
+    trace_stopping  = false;
+    trace_dropped   = 0;
+
+    if (trace_key_created == false)
+    {
+        pthread_key_create(&trace_key, trace_ring_orphan);
+        trace_key_created = true;
+    }
+
+    if (pthread_create(&trace_writer, NULL, trace_writer_thread, NULL) != 0)
+    {
+        vws.error(VE_SYS, "failed to start trace writer");
+        return false;
+    }
+
+    __atomic_store_n(&trace_async_on, true, __ATOMIC_RELEASE);
+
+    vws.success();
+
+    return true;
+}
+
+void vws_trace_async_stop()
+{
+    if (vws_trace_async() == false)
+    {
+        return;
+    }
+
+    __atomic_store_n(&trace_async_on, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_stopping, true, __ATOMIC_RELEASE);
+
+    pthread_join(trace_writer, NULL);
+}
+
+bool vws_trace_async()
+{
+    return __atomic_load_n(&trace_async_on, __ATOMIC_ACQUIRE);
+}
+
+uint64_t vws_trace_dropped()
+{
+    return __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+}
+
 //------------------------------------------------------------------------------
 // Memory allocation
 //------------------------------------------------------------------------------
 
+// The address an allocation function returns to, which is the call site
+#if defined(_MSC_VER)
+#define ALLOC_CALLER() _ReturnAddress()
+#else
+#define ALLOC_CALLER() __builtin_return_address(0)
+#endif
+
+// Whether allocation tracking is on
+static bool alloc_tracking = false;
+
+#define ALLOC_TRACKING() __atomic_load_n(&alloc_tracking, __ATOMIC_RELAXED)
+
 void* vws_malloc(size_t size)
 {
     void* ptr = malloc(size);
@@ -237,6 +757,11 @@ void* vws_malloc(size_t size)
         return vws.malloc_error(size);
     }
 
+    if (ALLOC_TRACKING())
+    {
+        alloc_record(ALLOC_CALLER(), size);
+    }
+
     return ptr;
 }
 
@@ -252,6 +777,11 @@ void* vws_malloc_error(size_t size)
 
 void vws_free(void* data)
 {
+    if (ALLOC_TRACKING() && data != NULL)
+    {
+        alloc_record_free();
+    }
+
     free(data);
 }
 
@@ -264,6 +794,11 @@ void* vws_calloc(size_t nmemb, size_t size)
         return vws.calloc_error(nmemb, size);
     }
 
+    if (ALLOC_TRACKING())
+    {
+        alloc_record(ALLOC_CALLER(), nmemb * size);
+    }
+
     return ptr;
 }
 
@@ -286,6 +821,11 @@ void* vws_realloc(void* ptr, size_t size)
         return vws.realloc_error(ptr, size);
     }
 
+    if (ALLOC_TRACKING())
+    {
+        alloc_record(ALLOC_CALLER(), size);
+    }
+
     return ptr;
 }
 
@@ -299,60 +839,303 @@ void* vws_realloc_error(void* ptr, size_t size)
     return NULL;
 }
 
+char* vws_strdup(cstr s)
+{
+    size_t size = strlen(s) + 1;
+    char* copy  = vws.malloc(size);
+
+    if (copy != NULL)
+    {
+        memcpy(copy, s, size);
+    }
+
+    return copy;
+}
+
 //------------------------------------------------------------------------------
-// Error handling
+// Allocation tracking
 //------------------------------------------------------------------------------
 
-// Sets the last error for the current thread
-void vws_set_error(vws_error_code_t code, const char* message)
+// Call sites a thread's table holds, a power of two. Allocations from sites
+// beyond these are counted together.
+#define ALLOC_SITES 1024
+
+// Allocations counted against one call site
+typedef struct
+{
+    void* site;             /**< The call site, NULL if the slot is free    */
+    uint64_t count;         /**< Allocations                                */
+    uint64_t bytes;         /**< Bytes requested                            */
+} alloc_site;
+
+// A thread's counts. Only its thread writes to it. Tables are kept when their
+// threads exit so their counts can still be reported.
+typedef struct alloc_table
 {
-    if (vws.e.text != NULL)
+    unsigned long tid;              /**< The thread it belongs to           */
+    uint64_t generation;            /**< Tracking run the counts belong to  */
+    uint64_t frees;                 /**< Frees                              */
+    alloc_site other;               /**< Sites that did not fit             */
+    alloc_site sites[ALLOC_SITES];  /**< Sites, open addressed              */
+    struct alloc_table* next;       /**< Next table                         */
+} alloc_table;
+
+// The calling thread's table
+static __thread alloc_table* alloc_local = NULL;
+
+// Every table. Each call to vws_alloc_track_start() starts a new generation,
+// and a table with counts from an earlier one is cleared by its own thread
+// when it next counts something.
+static alloc_table* alloc_tables  = NULL;
+static bool alloc_tables_lock     = false;
+static uint64_t alloc_generation  = 0;
+
+static alloc_table* alloc_table_get()
+{
+    uint64_t generation = __atomic_load_n(&alloc_generation, __ATOMIC_ACQUIRE);
+    alloc_table* t      = alloc_local;
+
+    if (t == NULL)
     {
-        vws.free(vws.e.text);
-        vws.e.text = NULL;
-    }
+        // Not from the hooks, which would count this and recurse
+        t      = calloc(1, sizeof(alloc_table));
+        t->tid = (unsigned long)pthread_self();
 
-    vws.e.code = code;
+        pool_lock(&alloc_tables_lock);
+        t->next      = alloc_tables;
+        alloc_tables = t;
+        pool_unlock(&alloc_tables_lock);
 
-    if (message != NULL)
+        alloc_local = t;
+    }
+
+    if (__atomic_load_n(&t->generation, __ATOMIC_RELAXED) != generation)
     {
-        vws.e.text = strdup(message);
+        // Hide the table from readers while it is cleared
+        __atomic_store_n(&t->generation, 0, __ATOMIC_RELEASE);
+
+        t->frees = 0;
+        memset(&t->other, 0, sizeof(t->other));
+        memset(t->sites, 0, sizeof(t->sites));
+
+        __atomic_store_n(&t->generation, generation, __ATOMIC_RELEASE);
     }
+
+    return t;
 }
 
-// Get the error value for the current thread
-vws_error_value vws_get_error()
+static void alloc_count(alloc_site* s, size_t size)
 {
-    return vws.e;
+    __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->bytes, s->bytes + size, __ATOMIC_RELAXED);
 }
 
-int vws_error_default_submit(int code, cstr format, ...)
+void alloc_record(void* site, size_t size)
 {
-    va_list args, args_copy;
-    va_start(args, format);
+    alloc_table* t = alloc_table_get();
+    size_t slot    = ((uintptr_t)site >> 2) * 0x9E3779B97F4A7C15ULL >> 32;
 
-    va_copy(args_copy, args);
-
-    // Determine the length of the formatted string
-    int length = vsnprintf(NULL, 0, format, args_copy);
+    for (size_t i = 0; i < ALLOC_SITES; i++)
+    {
+        alloc_site* s = &t->sites[(slot + i) & (ALLOC_SITES - 1)];
 
-    va_end(args_copy);  // End args_copy. We're done with it now.
+        if (s->site == site)
+        {
+            alloc_count(s, size);
+            return;
+        }
 
-    // Allocate a buffer for the formatted string
-    char* buffer = malloc(length + 1);
+        if (s->site == NULL)
+        {
+            // Publish the site only once its counts are in
+            alloc_count(s, size);
+            __atomic_store_n(&s->site, site, __ATOMIC_RELEASE);
+            return;
+        }
+    }
 
-    // Format the string into the buffer
-    vsnprintf(buffer, length + 1, format, args);
+    alloc_count(&t->other, size);
+}
 
-    // Set
-    vws_set_error(code, buffer);
+void alloc_record_free()
+{
+    alloc_table* t = alloc_table_get();
+    __atomic_store_n(&t->frees, t->frees + 1, __ATOMIC_RELAXED);
+}
 
-    // Process
-    vws.process_error(code, buffer);
+void vws_alloc_track_start()
+{
+    if (ALLOC_TRACKING())
+    {
+        return;
+    }
 
-    // Cleanup
-    vws.free(buffer);
-    va_end(args);
+    __atomic_fetch_add(&alloc_generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&alloc_tracking, true, __ATOMIC_RELEASE);
+}
+
+void vws_alloc_track_stop()
+{
+    __atomic_store_n(&alloc_tracking, false, __ATOMIC_RELEASE);
+}
+
+bool vws_alloc_tracking()
+{
+    return ALLOC_TRACKING();
+}
+
+void vws_alloc_track_sites(vws_alloc_site_cb cb, void* data)
+{
+    uint64_t generation = __atomic_load_n(&alloc_generation, __ATOMIC_ACQUIRE);
+
+    pool_lock(&alloc_tables_lock);
+
+    for (alloc_table* t = alloc_tables; t != NULL; t = t->next)
+    {
+        if (__atomic_load_n(&t->generation, __ATOMIC_ACQUIRE) != generation)
+        {
+            continue;
+        }
+
+        vws_alloc_stats stats;
+        stats.thread = t->tid;
+        stats.frees  = __atomic_load_n(&t->frees, __ATOMIC_RELAXED);
+
+        for (size_t i = 0; i <= ALLOC_SITES; i++)
+        {
+            alloc_site* s = (i < ALLOC_SITES) ? &t->sites[i] : &t->other;
+
+            stats.site  = __atomic_load_n(&s->site, __ATOMIC_ACQUIRE);
+            stats.count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+            stats.bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+
+            if (stats.count > 0 && (stats.site != NULL || i == ALLOC_SITES))
+            {
+                cb(&stats, data);
+            }
+        }
+    }
+
+    pool_unlock(&alloc_tables_lock);
+}
+
+// Collects the sites for vws_alloc_track_report()
+typedef struct
+{
+    vws_alloc_stats* sites;
+    size_t size;
+    size_t capacity;
+} alloc_report;
+
+static void alloc_report_add(const vws_alloc_stats* stats, void* data)
+{
+    alloc_report* r = (alloc_report*)data;
+
+    if (r->size == r->capacity)
+    {
+        r->capacity = (r->capacity == 0) ? 256 : r->capacity * 2;
+        r->sites    = realloc(r->sites, r->capacity * sizeof(vws_alloc_stats));
+    }
+
+    r->sites[r->size++] = *stats;
+}
+
+static int alloc_report_compare(const void* a, const void* b)
+{
+    uint64_t x = ((const vws_alloc_stats*)a)->count;
+    uint64_t y = ((const vws_alloc_stats*)b)->count;
+
+    return (x < y) - (x > y);
+}
+
+void vws_alloc_track_report(FILE* out, size_t limit)
+{
+    // Collected with the system allocator so the report does not count itself
+    alloc_report r = { NULL, 0, 0 };
+    vws_alloc_track_sites(alloc_report_add, &r);
+
+    qsort(r.sites, r.size, sizeof(vws_alloc_stats), alloc_report_compare);
+
+    fprintf(out, "%-20s %12s %14s  %s\n", "thread", "count", "bytes", "site");
+
+    for (size_t i = 0; i < r.size && (limit == 0 || i < limit); i++)
+    {
+        vws_alloc_stats* s = &r.sites[i];
+
+        fprintf( out, "%-20lu %12" PRIu64 " %14" PRIu64 "  %p\n",
+                 s->thread, s->count, s->bytes, s->site );
+    }
+
+    free(r.sites);
+}
+
+//------------------------------------------------------------------------------
+// Error handling
+//------------------------------------------------------------------------------
+
+// Holds the last error text of the thread. Errors never allocate: timeouts
+// and would-block are routine, and reporting a failed vws.malloc() must not
+// call it again.
+static __thread char error_text[VWS_ERROR_TEXT_SIZE];
+
+// Sets the last error for the current thread
+void vws_set_error(vws_error_code_t code, cstr message)
+{
+    vws.e.code = code;
+    vws.e.text = NULL;
+
+    if (message != NULL)
+    {
+        if (message != error_text)
+        {
+            size_t n = strnlen(message, sizeof(error_text) - 1);
+            memmove(error_text, message, n);
+            error_text[n] = 0;
+        }
+
+        vws.e.text = error_text;
+    }
+}
+
+void vws_set_error_static(vws_error_code_t code, cstr message)
+{
+    vws.e.code = code;
+    vws.e.text = message;
+}
+
+// Get the error value for the current thread
+vws_error_value vws_get_error()
+{
+    return vws.e;
+}
+
+int vws_error_default_submit(int code, cstr format, ...)
+{
+    if (format == NULL)
+    {
+        vws_set_error(code, NULL);
+    }
+    else if (strchr(format, '%') == NULL)
+    {
+        // Most messages have nothing to format. The format may not be static,
+        // so it is still copied.
+        vws_set_error(code, format);
+    }
+    else
+    {
+        // Formatted on the stack, as an argument may be the last error text
+        char text[VWS_ERROR_TEXT_SIZE];
+
+        va_list args;
+        va_start(args, format);
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+
+        vws_set_error(code, text);
+    }
+
+    // Process
+    vws.process_error(code, vws.e.text);
 
     return 0;
 }
@@ -384,7 +1167,7 @@ int vws_error_default_process(int code, cstr message)
             case VE_SYS:
             case VE_RT:
             {
-                vws.trace(VL_INFO, "error %i: %s", message);
+                vws.trace(VL_INFO, "error %i: %s", code, message);
                 break;
             }
 
@@ -428,202 +1211,703 @@ int vws_error_default_process(int code, cstr message)
 
 void vws_error_clear_default()
 {
-    vws_set_error(VE_SUCCESS, NULL);
+    vws_set_error_static(VE_SUCCESS, NULL);
 }
 
 void vws_error_success_default()
 {
-    vws_set_error(VE_SUCCESS, NULL);
+    vws_set_error_static(VE_SUCCESS, NULL);
 }
 
 // Global SSL context
 SSL_CTX* vws_ssl_ctx = NULL;
 
-// Initialization of the vrtql environment. The environment is initialized with
-// default error handling functions and the trace flag is turned off
-__thread vws_env vws =
-{
-    .malloc        = vws_malloc,
-    .malloc_error  = vws_malloc_error,
-    .calloc        = vws_calloc,
-    .calloc_error  = vws_calloc_error,
-    .realloc       = vws_realloc,
-    .realloc_error = vws_realloc_error,
-    .free          = vws_free,
-    .error         = vws_error_default_submit,
-    .process_error = vws_error_default_process,
-    .clear_error   = vws_error_clear_default,
-    .success       = vws_error_success_default,
-    .e             = {.code=VE_SUCCESS, .text=NULL},
-    .trace         = vws_trace,
-    .tracelevel    = 0,
-    .state         = 0
-};
-
 //------------------------------------------------------------------------------
-// Buffer
+// Object pools
 //------------------------------------------------------------------------------
 
-vws_buffer* vws_buffer_new()
+// Most objects a thread keeps before handing half to the depot
+#define POOL_CACHE_MAX 256
+
+// Most objects a depot keeps before releasing them with vws.free()
+#define POOL_DEPOT_MAX 4096
+
+// Number of objects moved between a thread and a depot at a time
+#define POOL_BATCH     (POOL_CACHE_MAX / 2)
+
+// Free objects are linked through their first word
+typedef struct pool_node
 {
-    vws_buffer* buffer = vws.malloc(sizeof(vws_buffer));
+    struct pool_node* next;
+} pool_node;
 
-    buffer->data      = NULL;
-    buffer->allocated = 0;
-    buffer->size      = 0;
+// A list of free objects
+typedef struct
+{
+    pool_node* head;
+    size_t count;
+} pool_list;
 
-    return buffer;
-}
+// Per-thread free lists
+static __thread pool_list pool_cache[VP_MAX];
 
-void vws_buffer_clear(vws_buffer* buffer)
+// Set once the thread's cache will be flushed when it exits
+static __thread bool pool_registered = false;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+// Shared depots, each guarded by a spinlock. They are only touched once per
+// batch, so the lock is held briefly and rarely.
+static pool_list pool_depot[VP_MAX];
+static bool pool_depot_lock[VP_MAX];
+
+void pool_lock(bool* lock)
 {
-    if (buffer != NULL)
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
     {
-        if (buffer->data != NULL)
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
         {
-            vws.free(buffer->data);
+            // Spin
         }
-
-        buffer->data      = NULL;
-        buffer->allocated = 0;
-        buffer->size      = 0;
     }
 }
 
-void vws_buffer_free(vws_buffer* buffer)
+void pool_unlock(bool* lock)
 {
-    if (buffer != NULL)
-    {
-        vws_buffer_clear(buffer);
-        vws.free(buffer);
-    }
+    __atomic_clear(lock, __ATOMIC_RELEASE);
 }
 
-void vws_buffer_printf(vws_buffer* buffer, cstr format, ...)
+void* vws_pool_get(vws_pool_t pool, size_t size)
 {
-    va_list args, args_copy;
-    va_start(args, format);
+    pool_list* cache = &pool_cache[pool];
 
-    va_copy(args_copy, args);
+    if (cache->head == NULL)
+    {
+        if (pool_registered == false)
+        {
+            pool_register();
+        }
 
-    // Determine the length of the formatted string
-    int length = vsnprintf(NULL, 0, format, args_copy);
+        // Refill from the depot
+        pool_list* depot = &pool_depot[pool];
+        pool_lock(&pool_depot_lock[pool]);
 
-    va_end(args_copy);
+        while (depot->head != NULL && cache->count < POOL_BATCH)
+        {
+            pool_node* node = depot->head;
+            depot->head     = node->next;
+            depot->count--;
 
-    // Allocate a buffer for the formatted string
-    char* data = malloc(length + 1);
+            node->next      = cache->head;
+            cache->head     = node;
+            cache->count++;
+        }
 
-    // Format the string into the buffer
-    vsnprintf(data, length + 1, format, args);
+        pool_unlock(&pool_depot_lock[pool]);
 
-    vws_buffer_append(buffer, (ucstr)data, length);
+        if (cache->head == NULL)
+        {
+            // Objects hold the free list link while they are in the pool
+            if (size < sizeof(pool_node))
+            {
+                size = sizeof(pool_node);
+            }
 
-    // Cleanup
-    vws.free(data);
-    va_end(args);
+            return vws.malloc(size);
+        }
+    }
+
+    pool_node* node = cache->head;
+    cache->head     = node->next;
+    cache->count--;
+
+    return node;
 }
 
-void vws_buffer_append(vws_buffer* buffer, ucstr data, size_t size)
+void vws_pool_put(vws_pool_t pool, void* object)
 {
-    if (buffer == NULL || data == NULL)
+    if (object == NULL)
     {
         return;
     }
 
-    size_t total_size = buffer->size + size;
+    if (pool_registered == false)
+    {
+        pool_register();
+    }
 
-    if (total_size > buffer->allocated)
+    pool_list* cache = &pool_cache[pool];
+    pool_node* node  = (pool_node*)object;
+    node->next       = cache->head;
+    cache->head      = node;
+    cache->count++;
+
+    if (cache->count < POOL_CACHE_MAX)
     {
-        buffer->allocated = total_size * 1.5;
+        return;
+    }
 
-        ucstr mem;
-        if (buffer->data == NULL)
+    // Hand a batch to the depot
+    pool_list* depot = &pool_depot[pool];
+    pool_node* spill = NULL;
+
+    pool_lock(&pool_depot_lock[pool]);
+
+    while (cache->count > POOL_BATCH)
+    {
+        node        = cache->head;
+        cache->head = node->next;
+        cache->count--;
+
+        if (depot->count < POOL_DEPOT_MAX)
         {
-            mem = (ucstr)vws.malloc(buffer->allocated);
+            node->next  = depot->head;
+            depot->head = node;
+            depot->count++;
         }
         else
         {
-            mem = (ucstr)vws.realloc(buffer->data, buffer->allocated);
+            node->next = spill;
+            spill      = node;
         }
-
-        buffer->data = mem;
     }
 
-    memcpy(buffer->data + buffer->size, data, size);
-    buffer->size = total_size;
-}
+    pool_unlock(&pool_depot_lock[pool]);
 
-void vws_buffer_drain(vws_buffer* buffer, size_t size)
-{
-    if (buffer == NULL || buffer->data == NULL)
+    // Release what the depot has no room for outside the lock
+    while (spill != NULL)
     {
-        return;
+        node  = spill;
+        spill = spill->next;
+        vws.free(node);
     }
+}
 
-    if (size >= buffer->size)
+void vws_pool_reserve(vws_pool_t pool, size_t size, size_t count)
+{
+    if (size < sizeof(pool_node))
     {
-        // When size >= buffer->size, clear the whole buffer
-        vws_buffer_clear(buffer);
+        size = sizeof(pool_node);
     }
-    else
+
+    for (size_t i = 0; i < count; i++)
     {
-        memmove(buffer->data, buffer->data + size, buffer->size - size);
-        buffer->size -= size;
-        buffer->data[buffer->size] = 0;
+        vws_pool_put(pool, vws.malloc(size));
     }
 }
 
-//------------------------------------------------------------------------------
-// Map
-//------------------------------------------------------------------------------
-
-cstr vws_map_get(struct sc_map_str* map, cstr key)
+void vws_pool_flush()
 {
-    // See if we have an existing entry
-    cstr v = sc_map_get_str(map, key);
-
-    if (sc_map_found(map) == false)
+    for (int i = 0; i < VP_MAX; i++)
     {
-        return NULL;
-    }
+        pool_list* cache = &pool_cache[i];
+        pool_list* depot = &pool_depot[i];
 
-    return v;
+        if (cache->head == NULL)
+        {
+            continue;
+        }
+
+        pool_lock(&pool_depot_lock[i]);
+
+        while (cache->head != NULL)
+        {
+            pool_node* node = cache->head;
+            cache->head     = node->next;
+            node->next      = depot->head;
+            depot->head     = node;
+            depot->count++;
+        }
+
+        cache->count = 0;
+
+        pool_unlock(&pool_depot_lock[i]);
+    }
 }
 
-void vws_map_set(struct sc_map_str* map, cstr key, cstr value)
+void vws_pool_shutdown()
 {
-    // See if we have an existing entry
-    sc_map_get_str(map, key);
-
-    if (sc_map_found(map) == false)
+    for (int i = 0; i < VP_MAX; i++)
     {
-        // We don't. Therefore we need to allocate new key.
-        key = strdup(key);
-    }
+        pool_list* cache = &pool_cache[i];
+        pool_list* depot = &pool_depot[i];
 
-    cstr v = sc_map_put_str(map, key, strdup(value));
+        pool_release(cache->head);
+        cache->head  = NULL;
+        cache->count = 0;
 
-    if (sc_map_found(map) == true)
-    {
-        vws.free(v);
+        // Take the whole depot, and free it outside the lock
+        pool_lock(&pool_depot_lock[i]);
+
+        pool_node* held = depot->head;
+        depot->head     = NULL;
+        depot->count    = 0;
+
+        pool_unlock(&pool_depot_lock[i]);
+
+        pool_release(held);
     }
 }
 
-void vws_map_remove(struct sc_map_str* map, cstr key)
+void pool_release(pool_node* node)
 {
-    // See if we have an existing entry
-    cstr v = sc_map_get_str(map, key);
-
-    if (sc_map_found(map) == true)
+    while (node != NULL)
     {
-        vws.free(v);
+        pool_node* next = node->next;
+        vws.free(node);
+        node = next;
     }
+}
 
-    sc_map_del_str(map, key);
+static void pool_key_create()
+{
+    pthread_key_create(&pool_key, pool_thread_exit);
 }
 
-void vws_map_clear(struct sc_map_str* map)
+void pool_register()
+{
+    pthread_once(&pool_key_once, pool_key_create);
+
+    // The destructor only runs for a non-NULL value
+    pthread_setspecific(pool_key, &pool_registered);
+    pool_registered = true;
+}
+
+void pool_thread_exit(void* arg)
+{
+    vws_pool_flush();
+}
+
+//------------------------------------------------------------------------------
+// Arenas
+//------------------------------------------------------------------------------
+
+// Alignment of arena allocations, enough for any type
+#define ARENA_ALIGN 16
+
+static vws_arena_block* arena_block_new(size_t size)
+{
+    vws_arena_block* b = vws.malloc(sizeof(vws_arena_block) + size);
+    b->next            = NULL;
+    b->size            = size;
+    b->used            = 0;
+
+    return b;
+}
+
+vws_arena* vws_arena_new(size_t size)
+{
+    vws_arena* arena = vws.malloc(sizeof(vws_arena));
+    arena->blocks    = NULL;
+    arena->size      = size;
+    arena->last      = 0;
+
+    return arena;
+}
+
+void vws_arena_free(vws_arena* arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+
+    while (arena->blocks != NULL)
+    {
+        vws_arena_block* next = arena->blocks->next;
+        vws.free(arena->blocks);
+        arena->blocks = next;
+    }
+
+    vws.free(arena);
+}
+
+void* vws_arena_alloc(vws_arena* arena, size_t size)
+{
+    vws_arena_block* b = arena->blocks;
+    size_t at          = 0;
+
+    if (b != NULL)
+    {
+        // Pad up to the alignment
+        uintptr_t next = (uintptr_t)(b->data + b->used);
+        at             = b->used + ((0 - next) & (ARENA_ALIGN - 1));
+    }
+
+    if ((b == NULL) || (at + size > b->size))
+    {
+        // Each new block doubles the last, so a burst needs few of them
+        size_t bytes = (b == NULL) ? arena->size : b->size * 2;
+
+        if (size + ARENA_ALIGN > bytes)
+        {
+            bytes = size + ARENA_ALIGN;
+        }
+
+        b             = arena_block_new(bytes);
+        b->next       = arena->blocks;
+        arena->blocks = b;
+
+        uintptr_t next = (uintptr_t)b->data;
+        at             = (0 - next) & (ARENA_ALIGN - 1);
+    }
+
+    arena->last = at;
+    b->used     = at + size;
+
+    return b->data + at;
+}
+
+void* vws_arena_realloc(vws_arena* arena, void* ptr, size_t old, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return vws_arena_alloc(arena, size);
+    }
+
+    vws_arena_block* b = arena->blocks;
+
+    // The last allocation can move the end of its block
+    if ((ptr == b->data + arena->last) && (arena->last + size <= b->size))
+    {
+        b->used = arena->last + size;
+        return ptr;
+    }
+
+    if (size <= old)
+    {
+        return ptr;
+    }
+
+    void* data = vws_arena_alloc(arena, size);
+    memcpy(data, ptr, old);
+
+    return data;
+}
+
+bool vws_arena_owns(vws_arena* arena, const void* ptr)
+{
+    const unsigned char* p = (const unsigned char*)ptr;
+
+    for (vws_arena_block* b = arena->blocks; b != NULL; b = b->next)
+    {
+        if ((p >= b->data) && (p < b->data + b->size))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void vws_arena_reset(vws_arena* arena)
+{
+    vws_arena_block* b = arena->blocks;
+    arena->last        = 0;
+
+    if (b == NULL)
+    {
+        return;
+    }
+
+    if (b->next == NULL)
+    {
+        b->used = 0;
+        return;
+    }
+
+    // Replace the blocks with one as large as all of them
+    size_t size = 0;
+
+    while (b != NULL)
+    {
+        vws_arena_block* next = b->next;
+        size                 += b->size;
+        vws.free(b);
+        b                     = next;
+    }
+
+    arena->blocks = arena_block_new(size);
+    arena->size   = size;
+}
+
+// Initialization of the vrtql environment. The environment is initialized with
+// default error handling functions and the trace flag is turned off
+__thread vws_env vws =
+{
+    .malloc        = vws_malloc,
+    .malloc_error  = vws_malloc_error,
+    .calloc        = vws_calloc,
+    .calloc_error  = vws_calloc_error,
+    .realloc       = vws_realloc,
+    .realloc_error = vws_realloc_error,
+    .free          = vws_free,
+    .error         = vws_error_default_submit,
+    .process_error = vws_error_default_process,
+    .clear_error   = vws_error_clear_default,
+    .success       = vws_error_success_default,
+    .e             = {.code=VE_SUCCESS, .text=NULL},
+    .trace         = vws_trace,
+    .tracelevel    = 0,
+    .state         = 0,
+    .arena         = NULL
+};
+
+//------------------------------------------------------------------------------
+// Buffer
+//------------------------------------------------------------------------------
+
+vws_buffer* vws_buffer_new()
+{
+    vws_buffer* buffer = vws_pool_get(VP_BUFFER, sizeof(vws_buffer));
+
+    buffer->data      = NULL;
+    buffer->allocated = 0;
+    buffer->size      = 0;
+    buffer->head      = 0;
+
+    return buffer;
+}
+
+void vws_buffer_clear(vws_buffer* buffer)
+{
+    if (buffer != NULL)
+    {
+        if (buffer->data != NULL)
+        {
+            vws.free(buffer->data - buffer->head);
+        }
+
+        buffer->data      = NULL;
+        buffer->allocated = 0;
+        buffer->size      = 0;
+        buffer->head      = 0;
+    }
+}
+
+void vws_buffer_free(vws_buffer* buffer)
+{
+    if (buffer != NULL)
+    {
+        vws_buffer_clear(buffer);
+        vws_pool_put(VP_BUFFER, buffer);
+    }
+}
+
+void vws_buffer_printf(vws_buffer* buffer, cstr format, ...)
+{
+    va_list args, args_copy;
+    va_start(args, format);
+
+    va_copy(args_copy, args);
+
+    // Determine the length of the formatted string
+    int length = vsnprintf(NULL, 0, format, args_copy);
+
+    va_end(args_copy);
+
+    // Allocate a buffer for the formatted string
+    char* data = vws.malloc(length + 1);
+
+    // Format the string into the buffer
+    vsnprintf(data, length + 1, format, args);
+
+    vws_buffer_append(buffer, (ucstr)data, length);
+
+    // Cleanup
+    vws.free(data);
+    va_end(args);
+}
+
+void vws_buffer_append(vws_buffer* buffer, ucstr data, size_t size)
+{
+    if (buffer == NULL || data == NULL)
+    {
+        return;
+    }
+
+    size_t total_size = buffer->size + size;
+
+    if (total_size > buffer->allocated)
+    {
+        // Reclaim consumed space first, which may make growing unnecessary
+        vws_buffer_rewind(buffer);
+    }
+
+    if (total_size > buffer->allocated)
+    {
+        buffer->allocated = total_size * 1.5;
+
+        ucstr mem;
+        if (buffer->data == NULL)
+        {
+            mem = (ucstr)vws.malloc(buffer->allocated);
+        }
+        else
+        {
+            mem = (ucstr)vws.realloc(buffer->data, buffer->allocated);
+        }
+
+        buffer->data = mem;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size = total_size;
+}
+
+void vws_buffer_reserve(vws_buffer* buffer, size_t size)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    size_t total_size = buffer->size + size;
+
+    if (total_size > buffer->allocated)
+    {
+        vws_buffer_rewind(buffer);
+    }
+
+    if (total_size > buffer->allocated)
+    {
+        ucstr mem;
+        if (buffer->data == NULL)
+        {
+            mem = (ucstr)vws.malloc(total_size);
+        }
+        else
+        {
+            mem = (ucstr)vws.realloc(buffer->data, total_size);
+        }
+
+        buffer->data      = mem;
+        buffer->allocated = total_size;
+    }
+}
+
+void vws_buffer_drain(vws_buffer* buffer, size_t size)
+{
+    if (buffer == NULL || buffer->data == NULL)
+    {
+        return;
+    }
+
+    if (size >= buffer->size)
+    {
+        // When size >= buffer->size, clear the whole buffer
+        vws_buffer_clear(buffer);
+    }
+    else
+    {
+        memmove(buffer->data, buffer->data + size, buffer->size - size);
+        buffer->size -= size;
+        buffer->data[buffer->size] = 0;
+    }
+}
+
+void vws_buffer_consume(vws_buffer* buffer, size_t size)
+{
+    if (buffer == NULL || buffer->data == NULL)
+    {
+        return;
+    }
+
+    if (size >= buffer->size)
+    {
+        // Empty. Rewind the cursor for free and keep the memory.
+        buffer->data      -= buffer->head;
+        buffer->allocated += buffer->head;
+        buffer->head       = 0;
+        buffer->size       = 0;
+
+        return;
+    }
+
+    buffer->data      += size;
+    buffer->head      += size;
+    buffer->allocated -= size;
+    buffer->size      -= size;
+}
+
+void vws_buffer_rewind(vws_buffer* buffer)
+{
+    if (buffer->head == 0)
+    {
+        return;
+    }
+
+    unsigned char* start = buffer->data - buffer->head;
+
+    memmove(start, buffer->data, buffer->size);
+
+    buffer->data       = start;
+    buffer->allocated += buffer->head;
+    buffer->head       = 0;
+}
+
+//------------------------------------------------------------------------------
+// Map
+//------------------------------------------------------------------------------
+
+cstr vws_map_get(struct sc_map_str* map, cstr key)
+{
+    // See if we have an existing entry
+    cstr v = sc_map_get_str(map, key);
+
+    if (sc_map_found(map) == false)
+    {
+        return NULL;
+    }
+
+    return v;
+}
+
+void vws_map_set(struct sc_map_str* map, cstr key, cstr value)
+{
+    cstr stored = NULL;
+
+    // See if we have an existing entry
+    sc_map_get_str(map, key);
+
+    if (sc_map_found(map) == true)
+    {
+        // We do. sc_map_put_str() replaces the stored key along with the
+        // value, so find the stored key in order to free it afterwards.
+        cstr k;
+        sc_map_foreach_key(map, k)
+        {
+            if (strcmp(k, key) == 0)
+            {
+                stored = k;
+                break;
+            }
+        }
+    }
+
+    cstr v = sc_map_put_str(map, vws_strdup(key), vws_strdup(value));
+
+    if (sc_map_found(map) == true)
+    {
+        vws.free(v);
+        vws.free(stored);
+    }
+}
+
+void vws_map_remove(struct sc_map_str* map, cstr key)
+{
+    // See if we have an existing entry
+    cstr v = sc_map_get_str(map, key);
+
+    if (sc_map_found(map) == true)
+    {
+        vws.free(v);
+    }
+
+    sc_map_del_str(map, key);
+}
+
+void vws_map_clear(struct sc_map_str* map)
 {
     cstr key; cstr value;
     sc_map_foreach(map, key, value)
@@ -635,6 +1919,156 @@ void vws_map_clear(struct sc_map_str* map)
     sc_map_clear_str(map);
 }
 
+//------------------------------------------------------------------------------
+// File mapping
+//------------------------------------------------------------------------------
+
+ucstr vws_file_map(int fd, uint64_t offset, size_t* size)
+{
+#if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+    {
+        vws.error(VE_SYS, "fstat() failed");
+        return NULL;
+    }
+
+    uint64_t end = (uint64_t)st.st_size;
+    size_t n     = *size;
+
+    if (n == 0 && offset < end)
+    {
+        n = end - offset;
+    }
+
+    if (n == 0 || offset > end || n > end - offset)
+    {
+        vws.error(VE_RT, "File range out of bounds");
+        return NULL;
+    }
+
+    // The mapping has to start on a page
+    size_t page  = (size_t)sysconf(_SC_PAGESIZE);
+    size_t delta = offset % page;
+
+    void* base = mmap(NULL, n + delta, PROT_READ, MAP_SHARED, fd, offset - delta);
+
+    if (base == MAP_FAILED)
+    {
+        vws.error(VE_SYS, "mmap() failed");
+        return NULL;
+    }
+
+    // It is read once, front to back
+    madvise(base, n + delta, MADV_SEQUENTIAL);
+
+    *size = n;
+    vws.success();
+
+    return (ucstr)base + delta;
+
+#else
+
+    vws.error(VE_RT, "File mapping not supported on this platform");
+    return NULL;
+
+#endif
+}
+
+void vws_file_unmap(ucstr data, size_t size)
+{
+#if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+
+    size_t page  = (size_t)sysconf(_SC_PAGESIZE);
+    size_t delta = (uintptr_t)data % page;
+
+    munmap((void*)(data - delta), size + delta);
+
+#endif
+}
+
+int vws_file_temp()
+{
+#if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+
+    cstr dir = getenv("TMPDIR");
+
+    if (dir == NULL || *dir == 0)
+    {
+        dir = "/tmp";
+    }
+
+    int fd = -1;
+
+#if defined(O_TMPFILE)
+    // Never has a name at all
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+
+    if (fd < 0)
+    {
+        // Not supported by the kernel or file system. Create and unlink.
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/vws.XXXXXX", dir);
+
+        fd = mkstemp(path);
+
+        if (fd >= 0)
+        {
+            unlink(path);
+        }
+    }
+
+    if (fd < 0)
+    {
+        vws.error(VE_SYS, "Failed to create temporary file in %s", dir);
+    }
+
+    return fd;
+
+#else
+
+    vws.error(VE_RT, "Temporary files not supported");
+    return -1;
+
+#endif
+}
+
+bool vws_file_write(int fd, ucstr data, size_t size)
+{
+#if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+
+    while (size > 0)
+    {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            vws.error(VE_SYS, "write() failed");
+            return false;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return true;
+
+#else
+
+    vws.error(VE_RT, "Temporary files not supported");
+    return false;
+
+#endif
+}
+
 //------------------------------------------------------------------------------
 // UUID
 //------------------------------------------------------------------------------
@@ -655,73 +2089,303 @@ char* vws_generate_uuid()
     // Format the UUID as a string
     char* encoded_uuid = vws_base64_encode(uuid, sizeof(uuid));
 
-    if (encoded_uuid == NULL)
+    // 16 bytes encode to 22 characters and two padding characters. Replace
+    // the padding.
+    encoded_uuid[22] = '_';
+    encoded_uuid[23] = '_';
+
+    return encoded_uuid;
+}
+
+//------------------------------------------------------------------------------
+// SHA-1
+//------------------------------------------------------------------------------
+
+// OpenSSL 3 routes SHA1() through an EVP digest fetched on every call, which
+// costs several times the hash itself for handshake-sized input. The
+// low-level API goes straight to the assembly (SHA-NI where the CPU has it).
+// It is deprecated, so builds without deprecated APIs use the portable code.
+#if !defined(OPENSSL_NO_DEPRECATED_3_0)
+#define VWS_SHA1_OPENSSL
+#endif
+
+#if defined(VWS_SHA1_OPENSSL)
+
+void vws_sha1(const unsigned char* data, size_t size, unsigned char* digest)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, data, size);
+    SHA1_Final(digest, &ctx);
+
+#pragma GCC diagnostic pop
+}
+
+#else
+
+#define SHA1_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// Processes one 64-byte block
+static void sha1_block(uint32_t* h, const unsigned char* block)
+{
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; i++)
     {
-        return NULL;
+        w[i] = ((uint32_t)block[i * 4] << 24)     |
+               ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8)  |
+               ((uint32_t)block[i * 4 + 3]);
     }
 
-    // Remove padding characters and dashes
-    size_t encoded_uuid_length = strlen(encoded_uuid);
-    for (size_t i = 0; i < encoded_uuid_length; i++)
+    for (int i = 16; i < 80; i++)
     {
-        if ( encoded_uuid[i] == '='  ||
-             encoded_uuid[i] == '\n' ||
-             encoded_uuid[i] == '\r' ||
-             encoded_uuid[i] == '-'   )
-        {
-            encoded_uuid[i] = '_';
-        }
+        w[i] = SHA1_ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
     }
 
-    return encoded_uuid;
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    // One loop per round function keeps the rounds free of branches
+    #define SHA1_ROUND(f, k, i)                                       \
+    {                                                                 \
+        uint32_t t = SHA1_ROTL(a, 5) + (f) + e + (k) + w[i];          \
+        e = d;                                                        \
+        d = c;                                                        \
+        c = SHA1_ROTL(b, 30);                                         \
+        b = a;                                                        \
+        a = t;                                                        \
+    }
+
+    for (int i = 0; i < 20; i++)
+    {
+        SHA1_ROUND(d ^ (b & (c ^ d)), 0x5A827999, i);
+    }
+
+    for (int i = 20; i < 40; i++)
+    {
+        SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1, i);
+    }
+
+    for (int i = 40; i < 60; i++)
+    {
+        SHA1_ROUND((b & c) | (d & (b | c)), 0x8F1BBCDC, i);
+    }
+
+    for (int i = 60; i < 80; i++)
+    {
+        SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6, i);
+    }
+
+    #undef SHA1_ROUND
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+void vws_sha1(const unsigned char* data, size_t size, unsigned char* digest)
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    size_t i      = 0;
+
+    for (; i + 64 <= size; i += 64)
+    {
+        sha1_block(h, data + i);
+    }
+
+    // The rest, 0x80, zeros and the length in bits. One or two blocks.
+    unsigned char last[128] = { 0 };
+    size_t rest             = size - i;
+    size_t blocks           = (rest + 9 <= 64) ? 1 : 2;
+
+    memcpy(last, data + i, rest);
+    last[rest] = 0x80;
+
+    uint64_t bits = (uint64_t)size * 8;
+
+    for (int j = 0; j < 8; j++)
+    {
+        last[blocks * 64 - 1 - j] = (unsigned char)(bits >> (j * 8));
+    }
+
+    for (size_t j = 0; j < blocks; j++)
+    {
+        sha1_block(h, last + j * 64);
+    }
+
+    for (int j = 0; j < 5; j++)
+    {
+        digest[j * 4]     = h[j] >> 24;
+        digest[j * 4 + 1] = h[j] >> 16;
+        digest[j * 4 + 2] = h[j] >> 8;
+        digest[j * 4 + 3] = h[j];
+    }
 }
 
+#endif
+
 //------------------------------------------------------------------------------
 // Base 64
 //------------------------------------------------------------------------------
 
-char* vws_base64_encode(const unsigned char* data, size_t length)
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Value plus one of each character in the alphabet. Everything else is 0, so
+// subtracting one leaves invalid characters with their high bits set.
+static const unsigned char base64_values[256] =
+{
+    ['A'] =  1, ['B'] =  2, ['C'] =  3, ['D'] =  4, ['E'] =  5, ['F'] =  6,
+    ['G'] =  7, ['H'] =  8, ['I'] =  9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+    ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18,
+    ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+    ['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30,
+    ['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+    ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42,
+    ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+    ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54,
+    ['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60,
+    ['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64
+};
+
+size_t vws_base64_encode_into(const unsigned char* data, size_t size, char* out)
+{
+    char* o  = out;
+    size_t i = 0;
+
+    for (; i + 3 <= size; i += 3)
+    {
+        uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+
+        o[0] = base64_alphabet[(v >> 18) & 0x3F];
+        o[1] = base64_alphabet[(v >> 12) & 0x3F];
+        o[2] = base64_alphabet[(v >> 6) & 0x3F];
+        o[3] = base64_alphabet[v & 0x3F];
+        o   += 4;
+    }
+
+    if (i < size)
+    {
+        uint32_t v = data[i] << 16;
+
+        if (i + 1 < size)
+        {
+            v |= data[i + 1] << 8;
+        }
+
+        o[0] = base64_alphabet[(v >> 18) & 0x3F];
+        o[1] = base64_alphabet[(v >> 12) & 0x3F];
+        o[2] = (i + 1 < size) ? base64_alphabet[(v >> 6) & 0x3F] : '=';
+        o[3] = '=';
+        o   += 4;
+    }
+
+    *o = '\0';
+
+    return o - out;
+}
+
+bool vws_base64_decode_into( cstr data,
+                             size_t length,
+                             unsigned char* out,
+                             size_t* size )
 {
-    BIO* bio    = BIO_new(BIO_s_mem());
-    BIO* base64 = BIO_new(BIO_f_base64());
+    // Padding is optional
+    while (length > 0 && data[length - 1] == '=')
+    {
+        length--;
+    }
+
+    if (length % 4 == 1)
+    {
+        vws.error(VE_RT, "Invalid base64 length");
+        return false;
+    }
+
+    const unsigned char* in = (const unsigned char*)data;
+    unsigned char* o        = out;
+    uint32_t bad            = 0;
+    size_t i                = 0;
+
+    // OR all values together and check for invalid characters once
+    for (; i + 4 <= length; i += 4)
+    {
+        uint32_t a = base64_values[in[i]] - 1;
+        uint32_t b = base64_values[in[i + 1]] - 1;
+        uint32_t c = base64_values[in[i + 2]] - 1;
+        uint32_t d = base64_values[in[i + 3]] - 1;
+
+        bad |= a | b | c | d;
+
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+
+        o[0] = v >> 16;
+        o[1] = v >> 8;
+        o[2] = v;
+        o   += 3;
+    }
+
+    if (i < length)
+    {
+        // Two or three characters left, giving one or two bytes
+        uint32_t a = base64_values[in[i]] - 1;
+        uint32_t b = base64_values[in[i + 1]] - 1;
+        uint32_t c = (i + 2 < length) ? base64_values[in[i + 2]] - 1u : 0;
+
+        bad |= a | b | c;
+
+        uint32_t v = (a << 18) | (b << 12) | (c << 6);
+
+        *o++ = v >> 16;
+
+        if (i + 2 < length)
+        {
+            *o++ = v >> 8;
+        }
+    }
 
-    BIO_set_flags(base64, BIO_FLAGS_BASE64_NO_NL);
-    BIO_push(base64, bio);
-    BIO_write(base64, data, length);
-    BIO_flush(base64);
+    if (bad > 63)
+    {
+        vws.error(VE_RT, "Invalid base64 character");
+        return false;
+    }
 
-    BUF_MEM* ptr;
-    BIO_get_mem_ptr(base64, &ptr);
-    size_t output_length = ptr->length;
-    char* encoded_data   = (char*)vws.malloc(output_length + 1);
+    *size = o - out;
 
-    memcpy(encoded_data, ptr->data, output_length);
-    encoded_data[output_length] = '\0';
+    return true;
+}
 
-    BIO_free_all(base64);
+char* vws_base64_encode(const unsigned char* data, size_t length)
+{
+    char* encoded = (char*)vws.malloc(VWS_BASE64_SIZE(length));
+    vws_base64_encode_into(data, length, encoded);
 
-    return encoded_data;
+    return encoded;
 }
 
 unsigned char* vws_base64_decode(const char* data, size_t* size)
 {
-    BIO* bio    = BIO_new_mem_buf(data, -1);
-    BIO* base64 = BIO_new(BIO_f_base64());
+    size_t length = strlen(data);
 
-    BIO_set_flags(base64, BIO_FLAGS_BASE64_NO_NL);
-    BIO_push(base64, bio);
+    // One spare byte for the terminator
+    unsigned char* decoded = (unsigned char*)vws.malloc(length * 3 / 4 + 1);
 
-    // Determine the size of the decoded data
-    size_t encoded_length = strlen(data);
-    size_t decoded_length = (encoded_length * 3) / 4;  // Rough estimate
-    unsigned char* decoded_data = (unsigned char*)vws.malloc(decoded_length);
+    if (vws_base64_decode_into(data, length, decoded, size) == false)
+    {
+        vws.free(decoded);
+        *size = 0;
 
-    // Decode the base64 data
-    *size = BIO_read(base64, decoded_data, encoded_length);
+        return NULL;
+    }
 
-    BIO_free_all(base64);
+    decoded[*size] = '\0';
 
-    return decoded_data;
+    return decoded;
 }
 
 //------------------------------------------------------------------------------
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 #include <openssl/ssl.h>
 
@@ -53,15 +55,48 @@ typedef enum vws_tl_t
     VT_ALL         = 9
 } vws_tl_t;
 
+/** Size of the per-thread buffer holding the last error text, including the
+ *  terminator. Longer messages are truncated. */
+#define VWS_ERROR_TEXT_SIZE 256
+
 /**
  * @brief Defines a structure for vrtql errors.
  */
 typedef struct
 {
     uint64_t code;  /**< Error code */
-    char* text;     /**< Error text */
+    cstr text;      /**< Error text, NULL if none. Points to a per-thread
+                         buffer or a static string and is only valid until
+                         the next error or success on the thread. */
 } vws_error_value;
 
+/**
+ * @brief Sets the last error for the current thread. The message is copied
+ * into a per-thread buffer, so no memory is allocated. This only records the
+ * error. Use vws.error() to report one.
+ *
+ * @param code The error code.
+ * @param message The error text, or NULL.
+ */
+void vws_set_error(vws_error_code_t code, cstr message);
+
+/**
+ * @brief Sets the last error for the current thread without copying the
+ * message. For fixed messages on hot paths.
+ *
+ * @param code The error code.
+ * @param message The error text, or NULL. Must be a string literal or have
+ *   static storage.
+ */
+void vws_set_error_static(vws_error_code_t code, cstr message);
+
+/**
+ * @brief Gets the last error for the current thread.
+ *
+ * @return The error value.
+ */
+vws_error_value vws_get_error();
+
 /**< The SSL context for the connection. */
 extern SSL_CTX* vws_ssl_ctx;
 
@@ -136,6 +171,74 @@ void vws_trace_lock();
  */
 void vws_trace_unlock();
 
+/**
+ * @brief Callback that prints the data of a trace dump, as
+ * vws_dump_websocket_frame() does for frames.
+ *
+ * @param data The data
+ * @param size The size of the data
+ */
+typedef void (*vws_trace_dump_cb)(const unsigned char* data, size_t size);
+
+/**
+ * @brief Dumps data to the trace under a banner. Normally this prints right
+ * away, holding the trace lock. With asynchronous tracing on, the data is
+ * copied (up to VWS_TRACE_DUMP_MAX bytes) into the thread's trace buffer and
+ * the writer thread calls the dump function.
+ *
+ * @param title The banner title. It must stay valid (a string literal).
+ * @param dump The function that prints the data
+ * @param data The data
+ * @param size The size of the data
+ */
+void vws_trace_dump( cstr title,
+                     vws_trace_dump_cb dump,
+                     const unsigned char* data,
+                     size_t size );
+
+/**< Most data a dump copies into an asynchronous trace buffer */
+#define VWS_TRACE_DUMP_MAX 4096
+
+/**
+ * @brief Turns on asynchronous tracing. Rather than taking the trace lock and
+ * writing to stderr, vws_trace() and vws_trace_dump() put a record into a
+ * buffer of the calling thread's own, without locking, and return. A
+ * background thread formats the records and writes them out. When a buffer
+ * is full records are dropped rather than making the caller wait.
+ *
+ * Only the message text is formatted by the caller, since its arguments may
+ * not outlive the call. Timestamps, thread IDs, levels and dumps are kept
+ * binary and formatted by the writer.
+ *
+ * @param size The size of each thread's buffer in bytes, rounded up to a power
+ *   of two. 0 uses 1 MB. A thread's buffer is made at its first trace and kept
+ *   for the life of the thread.
+ * @return True on success, false if already on or the writer could not be
+ *   started.
+ */
+bool vws_trace_async_start(size_t size);
+
+/**
+ * @brief Turns asynchronous tracing off. Everything recorded so far is
+ * written out before this returns.
+ */
+void vws_trace_async_stop();
+
+/**
+ * @brief Checks whether asynchronous tracing is on.
+ *
+ * @return True if on, false otherwise.
+ */
+bool vws_trace_async();
+
+/**
+ * @brief Returns the number of records dropped because a thread's buffer was
+ * full, since asynchronous tracing was turned on.
+ *
+ * @return The number of records.
+ */
+uint64_t vws_trace_dropped();
+
 /**
  * @brief Callback for tracing
  */
@@ -240,7 +343,7 @@ typedef struct
     vws_trace_cb trace;                 /**< Error clear function        */
     uint8_t tracelevel;                   /**< Tracing leve (0 is off)     */
     uint64_t state;                       /**< Contains global state flags */
-    unsigned char sslbuf[4096];           /**< Thread-local SSL buffer */
+    struct vws_arena* arena;              /**< Request arena, if any       */
 } vws_env;
 
 /**
@@ -248,16 +351,258 @@ typedef struct
  */
 extern __thread vws_env vws;
 
+//------------------------------------------------------------------------------
+// Memory
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Copies a string into memory from vws.malloc(). Use this rather than
+ * strdup() for anything the library frees with vws.free().
+ *
+ * @param s The string.
+ * @return The copy.
+ */
+char* vws_strdup(cstr s);
+
+/**
+ * @brief Allocations counted against one call site on one thread (see
+ * vws_alloc_track_start()).
+ */
+typedef struct
+{
+    unsigned long thread;   /**< The thread the allocations were made on    */
+    void* site;             /**< Code address of the call to vws.malloc(),
+                             *   vws.calloc() or vws.realloc(). NULL for the
+                             *   allocations that did not fit in the table. */
+    uint64_t count;         /**< Allocations                                */
+    uint64_t bytes;         /**< Bytes requested                            */
+    uint64_t frees;         /**< Calls to vws.free() on the thread          */
+} vws_alloc_stats;
+
+/**
+ * @brief Callback for vws_alloc_track_sites().
+ *
+ * @param stats The counts for one site on one thread.
+ * @param data The user data passed to vws_alloc_track_sites().
+ */
+typedef void (*vws_alloc_site_cb)(const vws_alloc_stats* stats, void* data);
+
+/**
+ * @brief Turns on allocation tracking. The default vws.malloc(), vws.calloc()
+ * and vws.realloc() then count every allocation, and its size, against the
+ * address it was called from and the calling thread. vws.free() counts frees
+ * per thread. Each start clears the previous counts. Allocations made through
+ * replaced hooks are not seen.
+ *
+ * Tracking costs a table lookup per allocation. When it is off, the hooks pay
+ * for a single relaxed load.
+ */
+void vws_alloc_track_start();
+
+/**
+ * @brief Turns off allocation tracking. The counts are kept until the next
+ * start.
+ */
+void vws_alloc_track_stop();
+
+/**
+ * @brief Returns whether allocation tracking is on.
+ *
+ * @return True if on, false otherwise.
+ */
+bool vws_alloc_tracking();
+
+/**
+ * @brief Calls a function with the counts of every site on every thread. It
+ * may be called while tracking is on, in which case the counts are a snapshot
+ * taken as the tables are walked.
+ *
+ * @param cb The function.
+ * @param data User data passed to the function.
+ */
+void vws_alloc_track_sites(vws_alloc_site_cb cb, void* data);
+
+/**
+ * @brief Writes the sites with the most allocations, one per line with their
+ * thread, count, bytes and address. Resolve the addresses with addr2line -f
+ * -e <binary> (subtracting the load address for a shared library).
+ *
+ * @param out Where to write.
+ * @param limit The most sites to write, or 0 for all of them.
+ */
+void vws_alloc_track_report(FILE* out, size_t limit);
+
 /**
  * @brief Defines a buffer for vrtql.
+ *
+ * After vws_buffer_consume() data points head bytes into the allocation, so
+ * the allocation starts at data - head. Code that takes ownership of data, to
+ * free it later, must call vws_buffer_rewind() first so that data is the start
+ * of the allocation again.
  */
 typedef struct vws_buffer
 {
     unsigned char* data; /**< The data in the buffer                       */
     size_t allocated;    /**< The amount of space allocated for the buffer */
     size_t size;         /**< The current size of the data in the buffer   */
+    size_t head;         /**< Consumed bytes ahead of data, not reclaimed  */
 } vws_buffer;
 
+//------------------------------------------------------------------------------
+// Object pools
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Object pools for the structs allocated and freed for every frame and
+ * message. Each pool holds objects of one type.
+ */
+typedef enum
+{
+    VP_BUFFER,      /**< vws_buffer                                     */
+    VP_FRAME,       /**< vws_frame                                      */
+    VP_MSG,         /**< vws_msg                                        */
+    VP_SVR_DATA,    /**< vws_svr_data                                   */
+    VP_SVR_WRITE,   /**< Server write requests                          */
+    VP_SVR_CNX,     /**< vws_svr_cnx                                    */
+    VP_SVR_TCP,     /**< uv_tcp_t handles of server connections         */
+    VP_MAX          /**< Number of pools                                */
+} vws_pool_t;
+
+/**
+ * @brief Gets an object from a pool. Each thread keeps its own free list, so
+ * this normally takes no lock. When the thread's list is empty it takes a batch
+ * from the pool's shared depot, and when that is empty it calls vws.malloc().
+ *
+ * @param pool The pool.
+ * @param size The object size. It must be the same on every call for a pool.
+ * @return An uninitialized object.
+ */
+void* vws_pool_get(vws_pool_t pool, size_t size);
+
+/**
+ * @brief Returns an object to a pool. It may be returned on a different thread
+ * from the one that got it. A thread that returns more objects than it gets
+ * hands the surplus to the shared depot in batches, where other threads can
+ * pick them up. Objects beyond what the depot holds are released with
+ * vws.free().
+ *
+ * @param pool The pool.
+ * @param object The object. If NULL, nothing happens.
+ */
+void vws_pool_put(vws_pool_t pool, void* object);
+
+/**
+ * @brief Allocates objects ahead of need and returns them to a pool, so that a
+ * burst of gets doesn't wait on the allocator. Those the calling thread does
+ * not cache go to the shared depot, up to what it holds.
+ *
+ * @param pool The pool.
+ * @param size The object size, as given to vws_pool_get().
+ * @param count The number of objects.
+ */
+void vws_pool_reserve(vws_pool_t pool, size_t size, size_t count);
+
+/**
+ * @brief Moves all objects cached by the calling thread to the shared depots.
+ * This happens by itself when a thread exits. Call it to hand the objects over
+ * sooner, e.g. from a thread that carries on with other work.
+ */
+void vws_pool_flush();
+
+/**
+ * @brief Releases the objects cached by the calling thread and everything in
+ * the shared depots with vws.free(). Other threads' caches are left alone, so
+ * call it once they have flushed or exited, e.g. when a server is torn down.
+ * The pools still work afterwards, starting empty.
+ */
+void vws_pool_shutdown();
+
+//------------------------------------------------------------------------------
+// Arenas
+//------------------------------------------------------------------------------
+
+/**
+ * @brief A block of arena storage.
+ */
+typedef struct vws_arena_block
+{
+    struct vws_arena_block* next; /**< The previous block              */
+    size_t size;                  /**< Bytes available in data         */
+    size_t used;                  /**< Bytes used in data              */
+    unsigned char data[];         /**< The storage                     */
+} vws_arena_block;
+
+/**
+ * @brief A bump allocator for short-lived objects. Allocating moves a pointer
+ * along the current block, and everything is released at once by
+ * vws_arena_reset(). There is no freeing of single allocations.
+ *
+ * A server worker installs its arena in vws.arena while it handles a request
+ * and resets it afterwards (see vws_tcp_svr.arena_size). Code that sees
+ * vws.arena set may take request-scoped memory from it, as vrtql_msg_new()
+ * does. Nothing allocated from it may outlive the request.
+ */
+typedef struct vws_arena
+{
+    vws_arena_block* blocks; /**< The current block, then older ones     */
+    size_t size;             /**< Size of the first block                */
+    size_t last;             /**< Offset of the last allocation          */
+} vws_arena;
+
+/**
+ * @brief Creates an arena.
+ *
+ * @param size The size of its first block. Blocks are allocated as needed.
+ * @return The arena.
+ */
+vws_arena* vws_arena_new(size_t size);
+
+/**
+ * @brief Frees an arena and everything allocated from it.
+ *
+ * @param arena The arena. If NULL, nothing happens.
+ */
+void vws_arena_free(vws_arena* arena);
+
+/**
+ * @brief Allocates from an arena. The memory is aligned for any type.
+ *
+ * @param arena The arena.
+ * @param size The size.
+ * @return The memory. It is not cleared.
+ */
+void* vws_arena_alloc(vws_arena* arena, size_t size);
+
+/**
+ * @brief Resizes an arena allocation. The last allocation grows in place if
+ * its block has room, otherwise the data is copied to a new allocation.
+ *
+ * @param arena The arena.
+ * @param ptr A previous allocation, or NULL.
+ * @param old The size of the previous allocation.
+ * @param size The new size.
+ * @return The memory.
+ */
+void* vws_arena_realloc(vws_arena* arena, void* ptr, size_t old, size_t size);
+
+/**
+ * @brief Returns whether memory came from an arena.
+ *
+ * @param arena The arena.
+ * @param ptr The memory.
+ * @return True if ptr is in one of the arena's blocks, false otherwise.
+ */
+bool vws_arena_owns(vws_arena* arena, const void* ptr);
+
+/**
+ * @brief Releases everything allocated from an arena. If it had to add blocks
+ * they are replaced by a single one that holds them all, so the next round of
+ * the same work fits in one block.
+ *
+ * @param arena The arena.
+ */
+void vws_arena_reset(vws_arena* arena);
+
 //------------------------------------------------------------------------------
 // Buffer
 //------------------------------------------------------------------------------
@@ -323,6 +668,15 @@ void vws_buffer_printf(vws_buffer* buffer, cstr format, ...);
  */
 void vws_buffer_append(vws_buffer* buffer, ucstr data, size_t size);
 
+/**
+ * @brief Ensures a vrtql buffer can take size more bytes without growing. Use
+ * this ahead of a series of appends whose total size is known.
+ *
+ * @param buffer The buffer to reserve space in
+ * @param size The number of additional bytes
+ */
+void vws_buffer_reserve(vws_buffer* buffer, size_t size);
+
 /**
  * @brief Drains a vrtql buffer by a given size.
  *
@@ -331,6 +685,34 @@ void vws_buffer_append(vws_buffer* buffer, ucstr data, size_t size);
  */
 void vws_buffer_drain(vws_buffer* buffer, size_t size);
 
+/**
+ * @brief Consumes data from the front of a vrtql buffer by moving a read
+ * cursor rather than moving the remaining data. The space is reclaimed when
+ * the buffer is emptied or when an append would otherwise have to grow the
+ * allocation, so a series of small consumes costs O(1) each instead of a
+ * memmove of everything behind them.
+ *
+ * Unlike vws_buffer_drain() this keeps the allocation when the buffer is
+ * emptied so that it is reused by the next append. buffer->data still points
+ * at the first unconsumed byte but no longer at the start of the allocation,
+ * so ownership of buffer->data must not be taken from a consumed buffer
+ * without calling vws_buffer_rewind() first.
+ *
+ * @param buffer The buffer to consume from
+ * @param size The number of bytes to consume
+ */
+void vws_buffer_consume(vws_buffer* buffer, size_t size);
+
+/**
+ * @brief Moves the unconsumed data of a vrtql buffer back to the start of its
+ * allocation, reclaiming the space left by vws_buffer_consume(). Afterwards
+ * head is 0 and buffer->data can be taken over and freed with vws.free(). Does
+ * nothing if nothing has been consumed.
+ *
+ * @param buffer The buffer to rewind
+ */
+void vws_buffer_rewind(vws_buffer* buffer);
+
 //------------------------------------------------------------------------------
 // Map
 //------------------------------------------------------------------------------
@@ -467,6 +849,48 @@ void vws_set_flag(uint64_t* flags, uint64_t flag);
  */
 void vws_clear_flag(uint64_t* flags, uint64_t flag);
 
+/**
+ * @brief Maps part of a file into memory, read only. Pages are read in from
+ * the page cache as they are touched, so the data can be written to a socket
+ * without being read or copied in user space first. The file must not shrink
+ * while it is mapped.
+ *
+ * @param fd The file. It may be closed once it is mapped.
+ * @param offset Where to start. It need not be page aligned.
+ * @param size The number of bytes. If 0, the rest of the file, and it is set
+ *   to that.
+ * @return The data, or NULL if the range is empty, runs past the end of the
+ *   file or can't be mapped (vws.e has the details). Unmap it with
+ *   vws_file_unmap().
+ */
+ucstr vws_file_map(int fd, uint64_t offset, size_t* size);
+
+/**
+ * @brief Unmaps data mapped by vws_file_map().
+ *
+ * @param data The data.
+ * @param size Its size.
+ */
+void vws_file_unmap(ucstr data, size_t size);
+
+/**
+ * @brief Creates an anonymous temporary file in $TMPDIR (or /tmp). It has no
+ * name, so it is removed when the last descriptor and mapping of it go.
+ *
+ * @return The descriptor, or -1 on error (vws.e has the details).
+ */
+int vws_file_temp();
+
+/**
+ * @brief Appends data to a file, retrying short and interrupted writes.
+ *
+ * @param fd The file.
+ * @param data The data.
+ * @param size The number of bytes.
+ * @return true if it was all written, false otherwise (vws.e has the details).
+ */
+bool vws_file_write(int fd, ucstr data, size_t size);
+
 /**
  * @brief Generates a UUID.
  *
@@ -474,12 +898,26 @@ void vws_clear_flag(uint64_t* flags, uint64_t flag);
  */
 char* vws_generate_uuid();
 
+/**
+ * @brief Computes the SHA-1 digest of data in one shot, without allocating.
+ * For the WebSocket handshake, which hashes about 60 bytes per connection.
+ * Not for security purposes.
+ *
+ * @param data The data
+ * @param size The size of the data
+ * @param digest Receives the 20-byte digest
+ */
+void vws_sha1(const unsigned char* data, size_t size, unsigned char* digest);
+
+/** Size of the Base64 encoding of n bytes, including the terminator */
+#define VWS_BASE64_SIZE(n) ((((n) + 2) / 3) * 4 + 1)
+
 /**
  * @brief Encodes data as Base64.
  *
  * @param data The data to encode
  * @param size The size of the data
- * @return Returns a Base64-encoded string
+ * @return Returns a Base64-encoded string, allocated with vws.malloc()
  */
 char* vws_base64_encode(const unsigned char* data, size_t size);
 
@@ -488,10 +926,35 @@ char* vws_base64_encode(const unsigned char* data, size_t size);
  *
  * @param data The Base64 string to decode
  * @param size Pointer to size which will be filled with the size of the decoded data
- * @return Returns a pointer to the decoded data
+ * @return Returns a pointer to the decoded data, allocated with vws.malloc()
+ *   and followed by a terminator, or NULL if data is not valid Base64
  */
 unsigned char* vws_base64_decode(const char* data, size_t* size);
 
+/**
+ * @brief Encodes data as Base64 (with padding, no line breaks) into a buffer.
+ *
+ * @param data The data to encode
+ * @param size The size of the data
+ * @param out The output. Must hold VWS_BASE64_SIZE(size) bytes.
+ * @return The length of the encoding, not counting the terminator
+ */
+size_t vws_base64_encode_into(const unsigned char* data, size_t size, char* out);
+
+/**
+ * @brief Decodes Base64 into a buffer. Padding is optional.
+ *
+ * @param data The Base64 text
+ * @param length The length of the text
+ * @param out The output. Must hold length * 3 / 4 bytes.
+ * @param size Receives the size of the decoded data
+ * @return True on success, false if data is not valid Base64
+ */
+bool vws_base64_decode_into( cstr data,
+                             size_t length,
+                             unsigned char* out,
+                             size_t* size );
+
 #ifdef __cplusplus
 }
 #endif
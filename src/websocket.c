@@ -1,6 +1,7 @@
 #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #endif
 
 #if defined(__windows__)
@@ -9,11 +10,21 @@
 #include <ws2tcpip.h>
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VWS_MASK_X86
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VWS_MASK_NEON
+#endif
+
 #include <openssl/rand.h>
+#include <zlib.h>
 
 #include "http_message.h"
 #include "websocket.h"
 #include "url.h"
+#include "probe.h"
 
 #define MAX_BUFFER_SIZE 1024
 
@@ -33,7 +44,10 @@ typedef enum
     CNX_SSL_INIT = (1 << 3),
 
     /** The connection is in server mode. */
-    CNX_SERVER = (1 << 4)
+    CNX_SERVER = (1 << 4),
+
+    /** Incoming frames borrow their payload from the receive buffer. */
+    CNX_ZERO_COPY = (1 << 5)
 
 } cnx_flags_t;
 
@@ -124,9 +138,80 @@ typedef enum
  * @brief Attempts connection based on previously parsed URL
  *
  * @param c The websocket connection.
+ * @param fd A socket already connected to the host, or -1 to connect.
  * @return Returns true if the connection is successful, false otherwise.
  */
-static bool cnx_connect();
+static bool cnx_connect(vws_cnx* c, int fd);
+
+/**
+ * @brief Compacts the receive buffer in zero-copy mode. Drains all parsed bytes
+ *        up to the first frame still borrowing from the buffer and rebases the
+ *        remaining borrowed frames.
+ *
+ * @param c The websocket connection.
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void cnx_compact(vws_cnx* c);
+
+/**
+ * @brief Accounts for a frame just serialized into the output buffer: traces
+ *        it, records where it ends for async completions and writes the
+ *        buffer out if it is due.
+ *
+ * @param c The websocket connection.
+ * @param start Where the frame starts in the output buffer.
+ * @param fin Whether the frame has FIN set.
+ * @return The size of the frame, or -1 if writing failed.
+ *
+ * @ingroup ConnectionFunctions
+ */
+static ssize_t cnx_queued(vws_cnx* c, size_t start, bool fin);
+
+/**
+ * @brief Drops n written bytes from the front of the output buffer and reports
+ *        the async messages they complete.
+ *
+ * @param c The websocket connection.
+ * @param n The number of bytes written.
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void cnx_wrote(vws_cnx* c, size_t n);
+
+/**
+ * @brief Empties the output buffer without writing it.
+ *
+ * @param c The websocket connection.
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void cnx_out_reset(vws_cnx* c);
+
+/**
+ * @brief Writes all of the data to the socket, however many writes it takes.
+ *        For frames written in pieces, which cannot be left half sent.
+ *
+ * @param c The websocket connection.
+ * @param data The data.
+ * @param size The number of bytes.
+ * @return True on success, false if the connection failed.
+ *
+ * @ingroup ConnectionFunctions
+ */
+static bool cnx_write_all(vws_cnx* c, ucstr data, size_t size);
+
+/**
+ * @brief Fails the connection after a protocol violation (RFC 6455 7.1.7).
+ *        Marks it closing and sends a CLOSE frame with the given code, unless
+ *        in server mode, where the server owns the socket.
+ *
+ * @param c The websocket connection.
+ * @param code The close code.
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void cnx_fail(vws_cnx* c, uint16_t code);
 
 /**
  * @brief Generates a new, random WebSocket key for the handshake process.
@@ -211,6 +296,228 @@ static ssize_t socket_wait_for_frame(vws_cnx* c);
  */
 static void process_frame(vws_cnx* c, vws_frame* frame);
 
+/**
+ * @brief Parses the frame header, filling in everything but the payload.
+ *
+ * @param data The raw network data.
+ * @param size The size of the data.
+ * @param f The vws_frame to parse into.
+ * @param consumed Set to the total frame size (header and payload) if the
+ *        frame is complete.
+ * @return FRAME_COMPLETE if all of the frame is present, FRAME_ERROR if its
+ *         length is invalid or over VWS_FRAME_MAX, FRAME_INCOMPLETE otherwise.
+ *
+ * @ingroup FrameFunctions
+ */
+static fs_t frame_parse_header( ucstr data,
+                                size_t size,
+                                vws_frame* f,
+                                size_t* consumed );
+
+/**
+ * @brief Returns the payload of a frame queued on a connection. Borrowed
+ *        frames are resolved against the current receive buffer as it may have
+ *        been reallocated since the frame was parsed.
+ *
+ * @param c The websocket connection.
+ * @param f The frame.
+ * @return The frame payload.
+ *
+ * @ingroup FrameFunctions
+ */
+static ucstr frame_payload(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Hands a data frame to the connection's stream callback.
+ *
+ * @param c The websocket connection.
+ * @param f The frame. It is freed.
+ * @return True if the frame was a data frame and was consumed, false if it
+ *         should be processed as usual.
+ *
+ * @ingroup FrameFunctions
+ */
+static bool frame_stream(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Makes a borrowed frame own a copy of its payload.
+ *
+ * @param c The websocket connection.
+ * @param f The frame.
+ *
+ * @ingroup FrameFunctions
+ */
+static void frame_detach(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Serializes a frame onto the end of a buffer.
+ *
+ * @param f The frame. It is freed.
+ * @param out The buffer to append to.
+ * @return True on success, false otherwise (nothing is appended).
+ *
+ * @ingroup FrameFunctions
+ */
+static bool frame_serialize(vws_frame* f, vws_buffer* out);
+
+/**
+ * @brief Signature of a masking kernel. The key passed in is already aligned
+ *        to src[0], so kernels always start at key byte 0.
+ *
+ * @ingroup FrameFunctions
+ */
+typedef void (*mask_kernel)( unsigned char* dst,
+                             ucstr src,
+                             size_t size,
+                             const unsigned char key[4] );
+
+/**
+ * @brief Portable masking kernel. Works 8 bytes at a time using 64-bit XOR,
+ *        finishing the tail one byte at a time.
+ *
+ * @ingroup FrameFunctions
+ */
+static void mask_scalar( unsigned char* dst,
+                         ucstr src,
+                         size_t size,
+                         const unsigned char key[4] );
+
+#if defined(VWS_MASK_X86)
+
+/**
+ * @brief SSE2 masking kernel. Works 16 bytes at a time.
+ *
+ * @ingroup FrameFunctions
+ */
+static void mask_sse2( unsigned char* dst,
+                       ucstr src,
+                       size_t size,
+                       const unsigned char key[4] );
+
+/**
+ * @brief AVX2 masking kernel. Works 32 bytes at a time.
+ *
+ * @ingroup FrameFunctions
+ */
+static void mask_avx2( unsigned char* dst,
+                       ucstr src,
+                       size_t size,
+                       const unsigned char key[4] );
+
+#elif defined(VWS_MASK_NEON)
+
+/**
+ * @brief NEON masking kernel. Works 16 bytes at a time.
+ *
+ * @ingroup FrameFunctions
+ */
+static void mask_neon( unsigned char* dst,
+                       ucstr src,
+                       size_t size,
+                       const unsigned char key[4] );
+
+#endif
+
+/**
+ * @brief Selects the best masking kernel supported by the running CPU.
+ *
+ * @return The masking kernel.
+ *
+ * @ingroup FrameFunctions
+ */
+static mask_kernel mask_select();
+
+/** Masking keys generated per refill of the thread's key pool */
+#define MASK_POOL_BLOCKS 4
+
+/** Refills after which the key pool is reseeded */
+#define MASK_POOL_RESEED 65536
+
+/**
+ * @brief A thread's pool of masking keys. Keys are cut from a ChaCha20
+ *        keystream seeded from RAND_bytes(), so the DRBG is only called once
+ *        per MASK_POOL_RESEED refills.
+ */
+typedef struct mask_pool
+{
+    uint32_t state[16];                        /**< ChaCha20 state           */
+    unsigned char keys[MASK_POOL_BLOCKS * 64]; /**< Unused keystream         */
+    size_t pos;                                /**< Next unused byte in keys */
+    size_t refills;                            /**< Refills since seeding    */
+    bool seeded;                               /**< The state is keyed       */
+} mask_pool;
+
+/**
+ * @brief Generates one 64-byte ChaCha20 block and advances the block counter.
+ *
+ * @param state The ChaCha20 state.
+ * @param out Receives the block.
+ *
+ * @ingroup FrameFunctions
+ */
+static void mask_chacha20(uint32_t* state, unsigned char* out);
+
+/**
+ * @brief Refills the calling thread's key pool, seeding it first if needed.
+ *
+ * @param pool The pool.
+ * @return True on success, false if RAND_bytes() failed.
+ *
+ * @ingroup FrameFunctions
+ */
+static bool mask_pool_refill(mask_pool* pool);
+
+/**
+ * @brief Signature of a UTF-8 kernel. Kernels validate text that starts and
+ *        ends on character boundaries.
+ *
+ * @ingroup FrameFunctions
+ */
+typedef bool (*utf8_kernel)(ucstr data, size_t size);
+
+/**
+ * @brief Advances the UTF-8 state by one byte.
+ *
+ * @param state The state. Between characters it is VWS_UTF8_ACCEPT. Within one
+ *        it packs the number of bytes still needed (bits 0-7) and the range of
+ *        the next byte (bits 8-15 and 16-23).
+ * @param byte The byte.
+ * @return The new state.
+ *
+ * @ingroup FrameFunctions
+ */
+static uint32_t utf8_step(uint32_t state, unsigned char byte);
+
+/**
+ * @brief Portable UTF-8 kernel. Skips ASCII 8 bytes at a time and steps
+ *        through the rest one byte at a time.
+ *
+ * @ingroup FrameFunctions
+ */
+static bool utf8_scalar(ucstr data, size_t size);
+
+#if defined(VWS_MASK_X86)
+
+/**
+ * @brief AVX2 UTF-8 kernel. Works 32 bytes at a time, using the lookup
+ *        algorithm of Keiser and Lemire ("Validating UTF-8 In Less Than One
+ *        Instruction Per Byte", 2021).
+ *
+ * @ingroup FrameFunctions
+ */
+static bool utf8_avx2(ucstr data, size_t size);
+
+#endif
+
+/**
+ * @brief Selects the best UTF-8 kernel supported by the running CPU.
+ *
+ * @return The UTF-8 kernel.
+ *
+ * @ingroup FrameFunctions
+ */
+static utf8_kernel utf8_select();
+
 
 
 
@@ -232,6 +539,144 @@ static void process_frame(vws_cnx* c, vws_frame* frame);
  */
 static bool has_complete_message(vws_cnx* c);
 
+/**
+ * @brief Accounts for a data frame just added to the front of the queue,
+ *        recording the message size once its final frame arrives.
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ * @param f The queued frame.
+ *
+ * @ingroup MessageFunctions
+ */
+static void cnx_frame_queued(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Accounts for a single frame taken off the back of the queue outside
+ *        of vws_msg_pop().
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ * @param f The dequeued frame.
+ *
+ * @ingroup MessageFunctions
+ */
+static void cnx_frame_dequeued(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Writes the message being received to a temporary file once it has
+ *        passed c->spill. Called after each data frame is queued. The frames
+ *        written are freed, releasing the receive data they borrow, and when
+ *        the final frame is in the file is mapped and queued as a single
+ *        frame in their place.
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ *
+ * @ingroup MessageFunctions
+ */
+static void cnx_spill(vws_cnx* c);
+
+/**
+ * @brief Writes a frame of the message being spilled to c->spill_fd, unless
+ *        the message is being dropped, and frees it.
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ * @param f The frame, already taken off the queue.
+ *
+ * @ingroup MessageFunctions
+ */
+static void cnx_spill_frame(vws_cnx* c, vws_frame* f);
+
+/**
+ * @defgroup DeflateFunctions
+ *
+ * @brief Functions that implement permessage-deflate (RFC 7692)
+ *
+ */
+
+/**
+ * @brief Messages smaller than this are sent uncompressed. Deciding before
+ *        compressing keeps both ends' windows in step.
+ *
+ * @ingroup DeflateFunctions
+ */
+#define DEFLATE_MIN_SIZE 32
+
+// Bytes of a file masked at a time by vws_msg_send_file()
+#define FILE_CHUNK_SIZE 65536
+
+/**
+ * @brief Per-connection permessage-deflate state.
+ *
+ * @ingroup DeflateFunctions
+ */
+struct vws_deflate
+{
+    /**< Compressor for outgoing messages */
+    z_stream tx;
+
+    /**< Decompressor for incoming messages */
+    z_stream rx;
+
+    /**< Configured compressor window bits */
+    int config_bits;
+
+    /**< Configured context takeover setting */
+    bool config_nct;
+
+    /**< Negotiated compressor window bits */
+    int window_bits;
+
+    /**< Negotiated: reset the compressor after every message */
+    bool no_context_takeover;
+
+    /**< Whether the extension was negotiated */
+    bool enabled;
+
+    /**< Whether tx has been initialized */
+    bool tx_ready;
+
+    /**< Whether rx has been initialized */
+    bool rx_ready;
+};
+
+/**
+ * @brief Releases the zlib streams and restores the configured settings, ready
+ *        for a new negotiation.
+ *
+ * @param d The deflate state.
+ *
+ * @ingroup DeflateFunctions
+ */
+static void deflate_reset(struct vws_deflate* d);
+
+/**
+ * @brief Applies a Sec-WebSocket-Extensions header. On the server it is the
+ *        client's offer, on the client it is the server's response.
+ *
+ * @param d The deflate state.
+ * @param header The header value.
+ * @param server True if negotiating as server.
+ * @param client_nct Set to true if the client asked for
+ *        client_no_context_takeover (server only).
+ * @return Returns true if permessage-deflate was agreed.
+ *
+ * @ingroup DeflateFunctions
+ */
+static bool deflate_negotiate( struct vws_deflate* d,
+                               cstr header,
+                               bool server,
+                               bool* client_nct );
+
+/**
+ * @brief Cuts the next token ending in delim from a string, trimming spaces.
+ *
+ * @param s The string, advanced past the token.
+ * @param delim The delimiter.
+ * @return The token, or NULL if there are no more.
+ *
+ * @ingroup DeflateFunctions
+ */
+static char* deflate_token(char** s, char delim);
+
 
 
 
@@ -269,15 +714,38 @@ static void dump_websocket_header(const ws_header* header);
 //> Connection API
 //------------------------------------------------------------------------------
 
-bool cnx_connect(vws_cnx* c)
+bool cnx_connect(vws_cnx* c, int fd)
 {
     if (c->url->host == NULL)
     {
+        if (fd > -1)
+        {
+            close(fd);
+        }
+
         vws.error(VE_MEM, "Invalid or missing host");
         return false;
     }
 
+    // Connecting clears the socket buffer. Any frames left over from the last
+    // connection must no longer point into it.
+    vws_frame* f;
+    sc_queue_foreach (&c->queue, f)
+    {
+        frame_detach(c, f);
+    }
+
+    c->parsed = 0;
+
+    // Frames queued for the last connection are not sent on this one
+    cnx_out_reset(c);
+
     // Connect to the server
+    if (c->path != NULL)
+    {
+        return vws_socket_connect_unix((vws_socket*)c, c->path);
+    }
+
     cstr default_port = strcmp(c->url->protocol, "wss") == 0 ? "443" : "80";
     cstr port = c->url->port != NULL ? c->url->port : default_port;
 
@@ -287,7 +755,29 @@ bool cnx_connect(vws_cnx* c)
         ssl = true;
     }
 
-    return vws_socket_connect((vws_socket*)c, c->url->host, atoi(port), ssl);
+    vws_socket* s = (vws_socket*)c;
+    bool ok;
+
+    if (fd > -1)
+    {
+        ok = vws_socket_connect_fd(s, fd, c->url->host, atoi(port), ssl);
+    }
+    else
+    {
+        ok = vws_socket_connect(s, c->url->host, atoi(port), ssl);
+    }
+
+    if (ok == false)
+    {
+        return false;
+    }
+
+    if (c->out != NULL)
+    {
+        vws_socket_set_nodelay((vws_socket*)c, true);
+    }
+
+    return true;
 }
 
 vws_cnx* vws_cnx_new()
@@ -301,12 +791,31 @@ vws_cnx* vws_cnx_new()
     c->base.hs    = socket_handshake;
     c->flags      = CNX_CLOSED;
     c->url        = NULL;
-    c->key        = generate_websocket_key();
+    c->path       = NULL;
+    c->key        = NULL;
     c->process    = process_frame;
     c->disconnect = NULL;
     c->data       = NULL;
-
-    sc_queue_init(&c->queue);
+    c->parsed     = 0;
+    c->partial    = 0;
+    c->deflate    = NULL;
+    c->spill_fd   = -1;
+
+    c->stream        = NULL;
+    c->stream_opcode = 0;
+    c->stream_buffer = NULL;
+    c->stream_utf8   = VWS_UTF8_ACCEPT;
+    c->max_frame     = 0;
+    c->max_message   = VWS_MESSAGE_MAX;
+    c->out           = NULL;
+    c->cork          = 0;
+    c->async         = false;
+    c->on_sent       = NULL;
+    c->sends         = 0;
+    c->sent          = 0;
+    c->out_written   = 0;
+
+    // The queues are zeroed above and allocated on first use
 
     return c;
 }
@@ -329,6 +838,7 @@ void vws_cnx_free(vws_cnx* c)
 
     // Free receive queue
     sc_queue_term(&c->queue);
+    sc_queue_term(&c->messages);
 
     // Free URL
     if (c->url != NULL)
@@ -337,9 +847,33 @@ void vws_cnx_free(vws_cnx* c)
         c->url = NULL;
     }
 
+    vws.free(c->path);
+    c->path = NULL;
+
     // Free websocket key
     vws.free(c->key);
 
+    // Free compression state
+    if (c->deflate != NULL)
+    {
+        deflate_reset(c->deflate);
+        vws.free(c->deflate);
+        c->deflate = NULL;
+    }
+
+    // Free any partly streamed compressed message
+    vws_buffer_free(c->stream_buffer);
+
+    // And any partly spilled one
+    if (c->spill_fd >= 0)
+    {
+        close(c->spill_fd);
+    }
+
+    // Free output buffer
+    vws_buffer_free(c->out);
+    sc_queue_term(&c->out_ends);
+
     // Call base constructor
     vws_socket_dtor((vws_socket*)c);
 }
@@ -349,6 +883,294 @@ void vws_cnx_set_server_mode(vws_cnx* c)
     vws_set_flag(&c->flags, CNX_SERVER);
 }
 
+void vws_cnx_set_zero_copy(vws_cnx* c)
+{
+    vws_set_flag(&c->flags, CNX_ZERO_COPY);
+}
+
+void vws_cnx_set_stream(vws_cnx* c, vws_cnx_stream cb)
+{
+    c->stream = cb;
+}
+
+void vws_cnx_cork(vws_cnx* c, size_t threshold)
+{
+    if (c->out == NULL)
+    {
+        c->out = vws_buffer_new();
+    }
+
+    c->cork = (threshold == 0) ? VWS_CORK_SIZE : threshold;
+
+    if (vws_socket_is_connected((vws_socket*)c) == true)
+    {
+        vws_socket_set_nodelay((vws_socket*)c, true);
+    }
+}
+
+ssize_t vws_cnx_flush(vws_cnx* c)
+{
+    vws.success();
+
+    if (c->out == NULL || c->out->size == 0)
+    {
+        return 0;
+    }
+
+    if (vws_cnx_is_connected(c) == false)
+    {
+        vws.error(VE_SOCKET, "vws_cnx_flush()");
+        cnx_out_reset(c);
+
+        return -1;
+    }
+
+    ssize_t total = 0;
+
+    while (c->out->size > 0)
+    {
+        ssize_t n = vws_socket_write((vws_socket*)c, c->out->data, c->out->size);
+
+        if (n < 0)
+        {
+            // Error already set
+            cnx_out_reset(c);
+            return -1;
+        }
+
+        // Not in flush mode (see vws_socket.flush). The rest stays queued.
+        if (n == 0)
+        {
+            break;
+        }
+
+        total += n;
+        cnx_wrote(c, n);
+    }
+
+    return total;
+}
+
+ssize_t vws_cnx_uncork(vws_cnx* c)
+{
+    ssize_t n = vws_cnx_flush(c);
+
+    c->cork = 0;
+
+    // Async sends keep using the buffer
+    if (c->async == false)
+    {
+        vws_buffer_free(c->out);
+        c->out = NULL;
+    }
+
+    return n;
+}
+
+void vws_cnx_set_async(vws_cnx* c, vws_cnx_sent cb)
+{
+    if (c->out == NULL)
+    {
+        c->out = vws_buffer_new();
+    }
+
+    vws_queue_lazy(&c->out_ends);
+
+    c->async   = true;
+    c->on_sent = cb;
+}
+
+ssize_t vws_cnx_send_ready(vws_cnx* c)
+{
+    vws.success();
+
+    if (c->out == NULL || c->out->size == 0)
+    {
+        return 0;
+    }
+
+    if (vws_cnx_is_connected(c) == false)
+    {
+        vws.error(VE_SOCKET, "vws_cnx_send_ready()");
+        cnx_out_reset(c);
+
+        return -1;
+    }
+
+    ssize_t total = 0;
+
+    while (c->out->size > 0)
+    {
+        ssize_t n = vws_socket_write_ready( (vws_socket*)c,
+                                            c->out->data,
+                                            c->out->size,
+                                            NULL );
+
+        if (n < 0)
+        {
+            // Error already set
+            cnx_out_reset(c);
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            break;
+        }
+
+        total += n;
+        cnx_wrote(c, n);
+    }
+
+    return total;
+}
+
+size_t vws_cnx_pending(vws_cnx* c)
+{
+    return (c->out == NULL) ? 0 : c->out->size;
+}
+
+ssize_t cnx_queued(vws_cnx* c, size_t start, bool fin)
+{
+    ssize_t n = c->out->size - start;
+
+    if (vws.tracelevel >= VT_PROTOCOL)
+    {
+        vws_trace_dump( "Frame Sent",
+                        vws_dump_websocket_frame,
+                        c->out->data + start,
+                        n );
+    }
+
+    if (c->async == false)
+    {
+        // Corked
+        if (c->out->size >= c->cork && vws_cnx_flush(c) < 0)
+        {
+            return -1;
+        }
+
+        return n;
+    }
+
+    if (fin == true)
+    {
+        sc_queue_add_last(&c->out_ends, c->out_written + c->out->size);
+        c->sends++;
+    }
+
+    if ((c->cork == 0 || c->out->size >= c->cork) && vws_cnx_send_ready(c) < 0)
+    {
+        return -1;
+    }
+
+    return n;
+}
+
+void cnx_wrote(vws_cnx* c, size_t n)
+{
+    vws_buffer_consume(c->out, n);
+    c->out_written += n;
+
+    uint64_t done = 0;
+
+    while ( sc_queue_size(&c->out_ends) > 0 &&
+            sc_queue_peek_first(&c->out_ends) <= c->out_written )
+    {
+        sc_queue_del_first(&c->out_ends);
+        done++;
+    }
+
+    if (done > 0)
+    {
+        c->sent += done;
+
+        if (c->on_sent != NULL)
+        {
+            c->on_sent(c, done);
+        }
+    }
+}
+
+void cnx_out_reset(vws_cnx* c)
+{
+    if (c->out != NULL)
+    {
+        vws_buffer_clear(c->out);
+    }
+
+    if (c->out_ends.elems != NULL)
+    {
+        sc_queue_clear(&c->out_ends);
+    }
+
+    c->out_written = 0;
+}
+
+void cnx_fail(vws_cnx* c, uint16_t code)
+{
+    if (vws_is_flag(&c->flags, CNX_CLOSING))
+    {
+        return;
+    }
+
+    vws_set_flag(&c->flags, CNX_CLOSING);
+
+    if ( vws_is_flag(&c->flags, CNX_SERVER) ||
+         vws_socket_is_connected((vws_socket*)c) == false )
+    {
+        return;
+    }
+
+    // The close code, in network byte order
+    unsigned char payload[2] = { code >> 8, code & 0xFF };
+
+    vws_frame* f       = vws_frame_new(payload, sizeof(payload), CLOSE_FRAME);
+    vws_buffer* buffer = vws_serialize(f);
+
+    vws_socket_write((vws_socket*)c, buffer->data, buffer->size);
+    vws_buffer_free(buffer);
+}
+
+void cnx_compact(vws_cnx* c)
+{
+    if (c->parsed == 0)
+    {
+        return;
+    }
+
+    vws_buffer* b = c->base.buffer;
+
+    // Find the start of the oldest frame still borrowing from the buffer
+    size_t start = c->parsed;
+
+    vws_frame* f;
+    sc_queue_foreach (&c->queue, f)
+    {
+        if (f->borrowed && (f->pos - f->offset) < start)
+        {
+            start = f->pos - f->offset;
+        }
+    }
+
+    if (start == 0)
+    {
+        return;
+    }
+
+    vws_buffer_consume(b, start);
+    c->parsed -= start;
+
+    sc_queue_foreach (&c->queue, f)
+    {
+        if (f->borrowed)
+        {
+            f->pos  -= start;
+            f->data  = b->data + f->pos;
+        }
+    }
+}
+
 bool vws_connect(vws_cnx* c, cstr uri)
 {
     if (c == NULL)
@@ -365,7 +1187,65 @@ bool vws_connect(vws_cnx* c, cstr uri)
 
     c->url = (vws_url_data*)url_parse(uri);
 
-    return cnx_connect(c);
+    vws.free(c->path);
+    c->path = NULL;
+
+    return cnx_connect(c, -1);
+}
+
+bool vws_connect_fd(vws_cnx* c, int fd, cstr uri)
+{
+    if (c == NULL)
+    {
+        close(fd);
+        vws.error(VE_RT, "Invalid connection pointer()");
+        return false;
+    }
+
+    if (c->url != NULL)
+    {
+        url_free((url_data_t*)c->url);
+    }
+
+    c->url = (vws_url_data*)url_parse(uri);
+
+    vws.free(c->path);
+    c->path = NULL;
+
+    return cnx_connect(c, fd);
+}
+
+bool vws_connect_unix(vws_cnx* c, cstr path, cstr uri)
+{
+    if (c == NULL || path == NULL)
+    {
+        vws.error(VE_RT, "Invalid connection pointer or path");
+        return false;
+    }
+
+    if (c->url != NULL)
+    {
+        url_free((url_data_t*)c->url);
+    }
+
+    c->url = (vws_url_data*)url_parse(uri);
+
+    if (c->url == NULL || strcmp(c->url->protocol, "ws") != 0)
+    {
+        if (c->url != NULL)
+        {
+            url_free((url_data_t*)c->url);
+            c->url = NULL;
+        }
+
+        vws.error(VE_RT, "Unix socket URL must use the ws scheme");
+        return false;
+    }
+
+    vws.free(c->path);
+    c->path = vws_strdup(path);
+
+    return cnx_connect(c, -1);
 }
 
 bool vws_reconnect(vws_cnx* c)
@@ -377,7 +1257,7 @@ bool vws_reconnect(vws_cnx* c)
 
     if (c->url != NULL)
     {
-        cnx_connect(c);
+        return cnx_connect(c, -1);
     }
 
     return false;
@@ -398,6 +1278,10 @@ bool socket_handshake(vws_socket* s)
 {
     vws_cnx* c = (vws_cnx*)s;
 
+    // A fresh key for each handshake. Only clients need one.
+    vws.free(c->key);
+    c->key = generate_websocket_key();
+
     // Send the WebSocket handshake request
     const char* rt =
         "GET %s HTTP/1.1\r\n"
@@ -408,10 +1292,25 @@ bool socket_handshake(vws_socket* s)
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Key: %s\r\n"
         "Sec-WebSocket-Version: 13\r\n"
+        "%s"
         "\r\n";
 
+    // Offer permessage-deflate if enabled
+    char ext[128] = "";
+
+    if (c->deflate != NULL)
+    {
+        deflate_reset(c->deflate);
+
+        snprintf( ext, sizeof(ext),
+                  "Sec-WebSocket-Extensions: permessage-deflate; "
+                  "client_max_window_bits%s\r\n",
+                  c->deflate->config_nct ? "; client_no_context_takeover" : "" );
+    }
+
     char req[MAX_BUFFER_SIZE];
-    snprintf(req, sizeof(req), rt, c->url->path, c->url->host, c->url->href, c->key);
+    snprintf( req, sizeof(req), rt,
+              c->url->path, c->url->host, c->url->href, c->key, ext );
 
     ssize_t n;
     size_t total = 0;
@@ -532,6 +1431,28 @@ bool socket_handshake(vws_socket* s)
         return false;
     }
 
+    // Did the server accept permessage-deflate?
+    cstr extensions = vws_map_get(headers, "sec-websocket-extensions");
+
+    if (extensions != NULL)
+    {
+        if (c->deflate == NULL)
+        {
+            vws.error(VE_RT, "Server sent extensions that were not offered");
+            vws_http_msg_free(http);
+            return false;
+        }
+
+        if (deflate_negotiate(c->deflate, extensions, false, NULL) == false)
+        {
+            vws.error(VE_RT, "Server sent an unsupported extension response");
+            vws_http_msg_free(http);
+            return false;
+        }
+
+        c->deflate->enabled = true;
+    }
+
     vws_http_msg_free(http);
 
     return true;
@@ -553,6 +1474,9 @@ void vws_disconnect(vws_cnx* c)
         c->disconnect(c);
     }
 
+    // Send whatever is corked ahead of the close frame
+    vws_cnx_flush(c);
+
     c->flags = CNX_CLOSED;
 
     vws_buffer* buffer = vws_generate_close_frame();
@@ -595,18 +1519,158 @@ ssize_t vws_frame_send_data(vws_cnx* c, ucstr data, size_t size, int oc)
 
 ssize_t vws_msg_send_text(vws_cnx* c, cstr data)
 {
-    return vws_frame_send_data(c, (ucstr)data, strlen(data), 0x1);
+    return vws_msg_send_data(c, (ucstr)data, strlen(data), 0x1);
 }
 
 ssize_t vws_msg_send_binary(vws_cnx* c, ucstr data, size_t size)
 {
-    return vws_frame_send_data(c, data, size, 0x2);
+    return vws_msg_send_data(c, data, size, 0x2);
 }
 
 ssize_t vws_msg_send_data(vws_cnx* c, ucstr data, size_t size, int oc)
 {
-    return vws_frame_send(c, vws_frame_new(data, size, oc));
-}
+    size_t max = c->max_frame;
+
+    if (max == 0 || size <= max)
+    {
+        return vws_frame_send(c, vws_frame_new(data, size, oc));
+    }
+
+    ssize_t total = 0;
+
+    for (size_t offset = 0; offset < size; offset += max)
+    {
+        size_t n           = (size - offset < max) ? size - offset : max;
+        unsigned char code = (offset == 0) ? oc : CONTINUATION_FRAME;
+        vws_frame* f       = vws_frame_new(data + offset, n, code);
+        f->fin             = (offset + n == size);
+
+        ssize_t sent = vws_frame_send(c, f);
+
+        if (sent < 0)
+        {
+            return -1;
+        }
+
+        total += sent;
+    }
+
+    return total;
+}
+
+ssize_t vws_msg_send_file(vws_cnx* c, int fd, uint64_t offset, size_t size)
+{
+    if (vws_cnx_is_connected(c) == false)
+    {
+        vws.error(VE_SOCKET, "vws_msg_send_file()");
+        return -1;
+    }
+
+    // The file goes out around the output buffer, so what is queued goes first
+    if (c->out != NULL && vws_cnx_flush(c) < 0)
+    {
+        // Error already set
+        return -1;
+    }
+
+    if (c->out != NULL && c->out->size > 0)
+    {
+        vws.error(VE_RT, "Output still queued");
+        return -1;
+    }
+
+    ucstr data = vws_file_map(fd, offset, &size);
+
+    if (data == NULL)
+    {
+        // Error already set
+        return -1;
+    }
+
+    size_t max            = (c->max_frame > 0) ? c->max_frame : size;
+    size_t chunk          = (size < FILE_CHUNK_SIZE) ? size : FILE_CHUNK_SIZE;
+    unsigned char* masked = vws.malloc(chunk);
+    ssize_t total         = 0;
+
+    for (size_t pos = 0; pos < size; pos += max)
+    {
+        size_t n           = (size - pos < max) ? size - pos : max;
+        unsigned char code = (pos == 0) ? BINARY_FRAME : CONTINUATION_FRAME;
+
+        // The header, with the masking bit and key
+        unsigned char header[14];
+        size_t hs  = vws_frame_header(header, (pos + n == size), code, n);
+        ucstr key  = header + hs;
+        header[1] |= 0x80;
+
+        if (vws_mask_key(header + hs) == false)
+        {
+            // Error already set
+            total = -1;
+            break;
+        }
+
+        hs += 4;
+
+        if (cnx_write_all(c, header, hs) == false)
+        {
+            total = -1;
+            break;
+        }
+
+        total += hs;
+
+        // The payload is masked a chunk at a time as it goes out. This is the
+        // only copy made of it.
+        for (size_t done = 0; done < n && total >= 0; done += chunk)
+        {
+            size_t k = (n - done < chunk) ? n - done : chunk;
+            vws_mask(masked, data + pos + done, k, key, done);
+
+            if (cnx_write_all(c, masked, k) == false)
+            {
+                total = -1;
+                break;
+            }
+
+            total += k;
+        }
+
+        if (total < 0)
+        {
+            break;
+        }
+    }
+
+    vws.free(masked);
+    vws_file_unmap(data, size);
+
+    if (total >= 0)
+    {
+        vws.success();
+    }
+
+    return total;
+}
+
+bool cnx_write_all(vws_cnx* c, ucstr data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = vws_socket_write((vws_socket*)c, data, size);
+
+        if (n < 0)
+        {
+            // Error already set
+            return false;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
 
 ssize_t vws_frame_send(vws_cnx* c, vws_frame* frame)
 {
@@ -615,19 +1679,68 @@ ssize_t vws_frame_send(vws_cnx* c, vws_frame* frame)
         return -1;
     }
 
-    vws_buffer* binary = vws_serialize(frame);
+    // Compress data messages that fit in one frame
+    bool data_frame = (frame->opcode == TEXT_FRAME || frame->opcode == BINARY_FRAME);
 
-    if (vws.tracelevel >= VT_PROTOCOL)
+    if (data_frame && frame->fin == 1 && vws_cnx_is_deflate(c))
+    {
+        vws_buffer payload;
+        payload.data      = frame->data;
+        payload.size      = frame->size;
+        payload.allocated = frame->size;
+        payload.head      = 0;
+
+        if (vws_cnx_deflate(c, &payload) == true)
+        {
+            frame->data = payload.data;
+            frame->size = payload.size;
+            frame->rsv1 = 1;
+        }
+    }
+
+    if (c->out == NULL)
+    {
+        return vws_frame_write(c, vws_serialize(frame));
+    }
+
+    // Corked or async: serialize straight into the output buffer
+    size_t start = c->out->size;
+    bool fin     = frame->fin;
+
+    if (frame_serialize(frame, c->out) == false)
+    {
+        // Error already set
+        return -1;
+    }
+
+    return cnx_queued(c, start, fin);
+}
+
+ssize_t vws_frame_write(vws_cnx* c, vws_buffer* binary)
+{
+    if (binary == NULL)
+    {
+        // Error already set
+        return -1;
+    }
+
+    if (c->out != NULL && binary->data != NULL)
     {
-        vws_trace_lock();
-        printf("\n\n");
-        printf("+----------------------------------------------------+\n");
-        printf("| Frame Sent                                         |\n");
-        printf("+----------------------------------------------------+\n");
+        size_t start = c->out->size;
+        bool fin     = (binary->data[0] & 0x80) != 0;
+
+        vws_buffer_append(c->out, binary->data, binary->size);
+        vws_buffer_free(binary);
+
+        return cnx_queued(c, start, fin);
+    }
 
-        vws_dump_websocket_frame(binary->data, binary->size);
-        printf("------------------------------------------------------\n");
-        vws_trace_unlock();
+    if (vws.tracelevel >= VT_PROTOCOL)
+    {
+        vws_trace_dump( "Frame Sent",
+                        vws_dump_websocket_frame,
+                        binary->data,
+                        binary->size );
     }
 
     ssize_t n = 0;
@@ -635,12 +1748,13 @@ ssize_t vws_frame_send(vws_cnx* c, vws_frame* frame)
     if (binary->data != NULL)
     {
         n = vws_socket_write((vws_socket*)c, binary->data, binary->size);
-        vws_buffer_free(binary);
+    }
 
-        if (vws_cnx_is_connected(c) == false)
-        {
-            return -1;
-        }
+    vws_buffer_free(binary);
+
+    if (vws_cnx_is_connected(c) == false)
+    {
+        return -1;
     }
 
     vws.success();
@@ -648,15 +1762,66 @@ ssize_t vws_frame_send(vws_cnx* c, vws_frame* frame)
     return n;
 }
 
+ssize_t vws_frame_relay( vws_cnx* c,
+                         unsigned char opcode,
+                         ucstr data,
+                         size_t size,
+                         bool begin,
+                         bool end )
+{
+    if (vws_cnx_is_connected(c) == false)
+    {
+        return -1;
+    }
+
+    // The header, with the masking bit and key
+    unsigned char code = (begin == true) ? opcode : CONTINUATION_FRAME;
+    unsigned char header[14];
+    size_t hs  = vws_frame_header(header, end, code, size);
+    header[1] |= 0x80;
+
+    if (vws_mask_key(header + hs) == false)
+    {
+        // Error already set
+        return -1;
+    }
+
+    hs += 4;
+
+    // Masked straight from the source into the frame. This is the only copy.
+    vws_buffer* out = (c->out != NULL) ? c->out : vws_buffer_new();
+    size_t start    = out->size;
+    size_t need     = hs + size;
+
+    if (out->allocated - out->size < need)
+    {
+        // Geometrically, as the output buffer may take fragment after fragment
+        vws_buffer_reserve(out, (out->size > need) ? out->size : need);
+    }
+
+    memcpy(out->data + start, header, hs);
+    vws_mask(out->data + start + hs, data, size, header + hs - 4, 0);
+    out->size += need;
+
+    if (c->out != NULL)
+    {
+        // Corked or async
+        return cnx_queued(c, start, end);
+    }
+
+    return vws_frame_write(c, out);
+}
+
 //------------------------------------------------------------------------------
 //> Message API
 //------------------------------------------------------------------------------
 
 vws_msg* vws_msg_new()
 {
-    vws_msg* m = vws.malloc(sizeof(vws_msg));
+    vws_msg* m = vws_pool_get(VP_MSG, sizeof(vws_msg));
     m->opcode  = 0;
     m->data    = vws_buffer_new();
+    m->mapped  = false;
 
     return m;
 }
@@ -665,8 +1830,14 @@ void vws_msg_free(vws_msg* m)
 {
     if (m != NULL)
     {
+        if (m->mapped == true)
+        {
+            vws_file_unmap(m->data->data, m->data->size);
+            m->data->data = NULL;
+        }
+
         vws_buffer_free(m->data);
-        vws.free(m);
+        vws_pool_put(VP_MSG, m);
     }
 }
 
@@ -699,289 +1870,1569 @@ vws_msg* vws_msg_recv(vws_cnx* c)
 }
 
 //------------------------------------------------------------------------------
-//> Frame API
+//> Deflate API
 //------------------------------------------------------------------------------
 
-vws_frame* vws_frame_new(ucstr data, size_t s, unsigned char oc)
+void vws_cnx_set_deflate(vws_cnx* c, int window_bits, bool no_context_takeover)
 {
-    vws_frame* f = vws.malloc(sizeof(vws_frame));
-
-    // We must make our own copy of the data for deterministic memory management
+    if (c->deflate == NULL)
+    {
+        c->deflate = vws.calloc(1, sizeof(struct vws_deflate));
+    }
 
-    f->fin    = 1;
-    f->opcode = oc;
-    f->mask   = 1;
-    f->offset = 0;
-    f->size   = s;
-    f->data   = NULL;
+    // zlib does not support an 8 bit window for raw deflate
+    if (window_bits < 9)
+    {
+        window_bits = 9;
+    }
 
-    if (f->size > 0)
+    if (window_bits > 15)
     {
-        f->data = vws.malloc(f->size);
-        memcpy(f->data, data, f->size);
+        window_bits = 15;
     }
 
-    return f;
+    c->deflate->config_bits = window_bits;
+    c->deflate->config_nct  = no_context_takeover;
+
+    deflate_reset(c->deflate);
 }
 
-void vws_frame_free(vws_frame* f)
+bool vws_cnx_is_deflate(vws_cnx* c)
 {
-    if (f != NULL)
+    return (c->deflate != NULL) && (c->deflate->enabled == true);
+}
+
+cstr vws_cnx_accept_deflate(vws_cnx* c, cstr offer)
+{
+    if (c->deflate == NULL || offer == NULL)
     {
-        if (f->data != NULL)
-        {
-            vws.free(f->data);
-            f->data = NULL;
-        }
+        return NULL;
+    }
 
-        f->size = 0;
+    struct vws_deflate* d = c->deflate;
+    deflate_reset(d);
+
+    bool client_nct = false;
 
-        vws.free(f);
+    if (deflate_negotiate(d, offer, true, &client_nct) == false)
+    {
+        return NULL;
     }
-}
 
-vws_frame* vws_frame_recv(vws_cnx* c)
-{
-    // Default success unless error
-    vws.success();
+    char response[128];
+    int n = snprintf(response, sizeof(response), "permessage-deflate");
 
-    if (vws_cnx_is_connected(c) == false)
+    if (d->no_context_takeover == true)
     {
-        return NULL;
+        n += snprintf( response + n, sizeof(response) - n,
+                       "; server_no_context_takeover" );
     }
 
-    while (true)
+    if (client_nct == true)
     {
-        if (sc_queue_size(&c->queue) > 0)
-        {
-            return sc_queue_del_last(&c->queue);
-        }
+        n += snprintf( response + n, sizeof(response) - n,
+                       "; client_no_context_takeover" );
+    }
 
-        if (socket_wait_for_frame(c) <= 0)
-        {
-            break;
-        }
+    if (d->window_bits < 15)
+    {
+        n += snprintf( response + n, sizeof(response) - n,
+                       "; server_max_window_bits=%i",
+                       d->window_bits );
     }
 
-    return NULL;
+    d->enabled = true;
+
+    char* value = vws.malloc(n + 1);
+    memcpy(value, response, n + 1);
+
+    return value;
 }
 
-vws_buffer* vws_serialize(vws_frame* f)
+bool vws_cnx_deflate(vws_cnx* c, vws_buffer* buffer)
 {
-    if (f == NULL)
+    if (vws_cnx_is_deflate(c) == false || buffer->size < DEFLATE_MIN_SIZE)
     {
-        vws.error(VE_RT, "empty frame");
-
-        return NULL;
+        return false;
     }
 
-    //> Section 1: Size calculation
+    struct vws_deflate* d = c->deflate;
 
-    // Calculate the frame size
-    size_t payload_length = f->size;
+    if (d->tx_ready == false)
+    {
+        if (deflateInit2( &d->tx,
+                          Z_DEFAULT_COMPRESSION,
+                          Z_DEFLATED,
+                          -d->window_bits,
+                          8,
+                          Z_DEFAULT_STRATEGY ) != Z_OK)
+        {
+            vws.error(VE_RT, "deflateInit2() failed");
+            return false;
+        }
 
-    // Set the mask bit and payload length. Maximum frame size with extended
-    // payload length and masking key
-    unsigned char header[14];
+        d->tx_ready = true;
+    }
 
-    // Minimum frame size
-    size_t header_size = 2;
+    size_t capacity     = deflateBound(&d->tx, buffer->size) + 16;
+    unsigned char* out  = vws.malloc(capacity);
+    size_t produced     = 0;
 
-    // Set the FIN bit and opcode
-    header[0] = f->fin << 7 | f->opcode;
+    d->tx.next_in       = buffer->data;
+    d->tx.avail_in      = buffer->size;
 
-    if (payload_length <= 125)
-    {
-        header[1] = payload_length;
-    }
-    else if (payload_length <= 65535)
+    // Sync flush ends the output on a byte boundary with an empty stored
+    // block. Keep going until zlib has room to spare, which means it is done.
+    do
     {
-        header[1] = 126;
-        header[2] = (payload_length >> 8) & 0xFF;
-        header[3] = payload_length & 0xFF;
+        if (produced == capacity)
+        {
+            capacity *= 2;
+            out       = vws.realloc(out, capacity);
+        }
 
-        // Additional bytes for payload length
-        header_size += 2;
-    }
-    else
-    {
-        header[1] = 127;
-        header[2] = (((uint64_t) payload_length) >> 56) & 0xFF;
-        header[3] = (((uint64_t) payload_length) >> 48) & 0xFF;
-        header[4] = (((uint64_t) payload_length) >> 40) & 0xFF;
-        header[5] = (((uint64_t) payload_length) >> 32) & 0xFF;
-        header[6] = (((uint64_t) payload_length) >> 24) & 0xFF;
-        header[7] = (((uint64_t) payload_length) >> 16) & 0xFF;
-        header[8] = (((uint64_t) payload_length) >> 8)  & 0xFF;
-        header[9] = payload_length & 0xFF;
-        // Additional bytes for payload length
-        header_size += 8;
-    }
+        d->tx.next_out  = out + produced;
+        d->tx.avail_out = capacity - produced;
 
-    //> Section 2: Frame allocation
+        deflate(&d->tx, Z_SYNC_FLUSH);
 
-    size_t frame_size = header_size + payload_length;
+        produced = capacity - d->tx.avail_out;
+    }
+    while (d->tx.avail_out == 0);
 
-    if (f->mask)
+    // The empty block's 00 00 FF FF is implied on the wire (RFC 7692 7.2.1)
+    if (produced >= 4)
     {
-        // Set the masking bit
-        header[1] |= 0x80;
-
-        // Additional bytes for masking key
-        frame_size += 4;
+        produced -= 4;
     }
 
-    // Allocate memory for the frame
-    unsigned char* frame_data = (unsigned char*)vws.malloc(frame_size);
+    if (d->no_context_takeover == true)
+    {
+        deflateReset(&d->tx);
+    }
 
-    // Copy the header to the frame
-    memcpy(frame_data, header, header_size);
+    vws_buffer_clear(buffer);
+    buffer->data      = out;
+    buffer->size      = produced;
+    buffer->allocated = capacity;
 
-    //> Section 3: Masking
+    return true;
+}
 
-    if (f->mask)
+bool vws_cnx_inflate(vws_cnx* c, vws_buffer* buffer)
+{
+    if (vws_cnx_is_deflate(c) == false)
     {
-        // Generate a random masking key
+        vws.error(VE_RT, "permessage-deflate not negotiated");
+        return false;
+    }
 
-        unsigned char masking_key[4];
+    struct vws_deflate* d = c->deflate;
 
-        if (RAND_bytes(masking_key, sizeof(masking_key)) != 1)
+    if (d->rx_ready == false)
+    {
+        // The largest window decodes data compressed with any smaller one
+        if (inflateInit2(&d->rx, -15) != Z_OK)
         {
-            vws.error(VE_RT, "RAND_bytes() failed");
-            vws.free(frame_data);
-            return NULL;
+            vws.error(VE_RT, "inflateInit2() failed");
+            return false;
         }
 
-        // Copy the masking key to the frame
-        memcpy(frame_data + header_size, masking_key, 4);
+        d->rx_ready = true;
+    }
 
-        // Apply masking to the payload data
-        size_t payload_start = header_size + 4;
-        for (size_t i = 0; i < payload_length; i++)
+    // Put back the tail the sender removed
+    static const unsigned char tail[4] = {0x00, 0x00, 0xFF, 0xFF};
+    vws_buffer_append(buffer, tail, sizeof(tail));
+
+    // Never hold more than one byte over the limit, which is enough to tell
+    // it was passed
+    size_t max      = c->max_message;
+    size_t capacity = buffer->size * 4 < 1024 ? 1024 : buffer->size * 4;
+
+    if (max > 0 && capacity > max + 1)
+    {
+        capacity = max + 1;
+    }
+
+    unsigned char* out = vws.malloc(capacity);
+    size_t produced    = 0;
+
+    d->rx.next_in      = buffer->data;
+    d->rx.avail_in     = buffer->size;
+
+    while (true)
+    {
+        if (produced == capacity)
+        {
+            capacity *= 2;
+
+            if (max > 0 && capacity > max + 1)
+            {
+                capacity = max + 1;
+            }
+
+            out = vws.realloc(out, capacity);
+        }
+
+        d->rx.next_out  = out + produced;
+        d->rx.avail_out = capacity - produced;
+
+        int rc   = inflate(&d->rx, Z_SYNC_FLUSH);
+        produced = capacity - d->rx.avail_out;
+
+        if (max > 0 && produced > max)
+        {
+            vws.free(out);
+            cnx_fail(c, WS_CLOSE_TOO_BIG);
+            vws.error(VE_WARN, "inflated message larger than max_message");
+
+            return false;
+        }
+
+        if (rc == Z_STREAM_END)
+        {
+            // The sender ended the stream. Anything after it is our tail.
+            inflateReset(&d->rx);
+            break;
+        }
+
+        if (rc != Z_OK && rc != Z_BUF_ERROR)
+        {
+            vws.error(VE_RT, "inflate() failed");
+            vws.free(out);
+            return false;
+        }
+
+        if (d->rx.avail_in == 0 && d->rx.avail_out > 0)
+        {
+            break;
+        }
+    }
+
+    vws_buffer_clear(buffer);
+    buffer->data      = out;
+    buffer->size      = produced;
+    buffer->allocated = capacity;
+
+    return true;
+}
+
+void deflate_reset(struct vws_deflate* d)
+{
+    if (d->tx_ready == true)
+    {
+        deflateEnd(&d->tx);
+    }
+
+    if (d->rx_ready == true)
+    {
+        inflateEnd(&d->rx);
+    }
+
+    memset(&d->tx, 0, sizeof(z_stream));
+    memset(&d->rx, 0, sizeof(z_stream));
+
+    d->tx_ready            = false;
+    d->rx_ready            = false;
+    d->enabled             = false;
+    d->window_bits         = d->config_bits;
+    d->no_context_takeover = d->config_nct;
+}
+
+bool deflate_negotiate( struct vws_deflate* d,
+                        cstr header,
+                        bool server,
+                        bool* client_nct )
+{
+    size_t size = strlen(header);
+    char* copy  = vws.malloc(size + 1);
+    memcpy(copy, header, size + 1);
+
+    bool agreed = false;
+    char* rest  = copy;
+    char* offer;
+
+    // Offers are separated by commas, parameters by semicolons. The first
+    // permessage-deflate offer we can satisfy wins.
+    while (agreed == false && (offer = deflate_token(&rest, ',')) != NULL)
+    {
+        char* name = deflate_token(&offer, ';');
+
+        if (name == NULL || strcmp(name, "permessage-deflate") != 0)
+        {
+            continue;
+        }
+
+        int bits  = d->config_bits;
+        bool nct  = d->config_nct;
+        bool cnct = false;
+        bool ok   = true;
+        char* param;
+
+        while (ok == true && (param = deflate_token(&offer, ';')) != NULL)
+        {
+            char* value = strchr(param, '=');
+
+            if (value != NULL)
+            {
+                *value++ = '\0';
+
+                // Values may be quoted
+                if (*value == '"')
+                {
+                    value++;
+                    value[strcspn(value, "\"")] = '\0';
+                }
+            }
+
+            // The parameters that constrain our compressor depend on which
+            // side we are.
+            cstr our_nct  = server ? "server_no_context_takeover"
+                                   : "client_no_context_takeover";
+            cstr our_bits = server ? "server_max_window_bits"
+                                   : "client_max_window_bits";
+            cstr peer_nct  = server ? "client_no_context_takeover"
+                                    : "server_no_context_takeover";
+            cstr peer_bits = server ? "client_max_window_bits"
+                                    : "server_max_window_bits";
+
+            if (strcmp(param, our_nct) == 0)
+            {
+                nct = true;
+            }
+            else if (strcmp(param, our_bits) == 0)
+            {
+                int n = (value != NULL) ? atoi(value) : 0;
+
+                // zlib cannot compress with a window of 8 bits, and a larger
+                // one may not be given back (RFC 7692 7.1.2.1), so an offer
+                // of 8 is declined.
+                if (n < 9 || n > 15)
+                {
+                    ok = false;
+                }
+                else if (n < bits)
+                {
+                    bits = n;
+                }
+            }
+            else if (strcmp(param, peer_nct) == 0)
+            {
+                // The peer resets its compressor. Nothing for us to do.
+                cnct = true;
+            }
+            else if (strcmp(param, peer_bits) == 0)
+            {
+                // We always decompress with the largest window
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+
+        if (ok == true)
         {
-            frame_data[payload_start + i] = f->data[i] ^ masking_key[i % 4];
+            d->window_bits         = bits;
+            d->no_context_takeover = nct;
+            agreed                 = true;
+
+            if (server == true && client_nct != NULL)
+            {
+                *client_nct = cnct;
+            }
         }
     }
+
+    vws.free(copy);
+
+    return agreed;
+}
+
+char* deflate_token(char** s, char delim)
+{
+    if (*s == NULL)
+    {
+        return NULL;
+    }
+
+    char* token = *s;
+    char* end   = strchr(token, delim);
+
+    if (end != NULL)
+    {
+        *end = '\0';
+        *s   = end + 1;
+    }
     else
     {
-        // Copy the payload data without masking
-        memcpy(frame_data + header_size, f->data, payload_length);
+        *s = NULL;
     }
 
-    //> Section 4: Finalizing
+    // Trim spaces
+    while (*token == ' ' || *token == '\t')
+    {
+        token++;
+    }
 
-    // Free the frame
-    vws_frame_free(f);
+    size_t n = strlen(token);
+    while (n > 0 && (token[n - 1] == ' ' || token[n - 1] == '\t'))
+    {
+        token[--n] = '\0';
+    }
+
+    return token;
+}
+
+//------------------------------------------------------------------------------
+//> Frame API
+//------------------------------------------------------------------------------
+
+vws_frame* vws_frame_new(ucstr data, size_t s, unsigned char oc)
+{
+    vws_frame* f = vws_pool_get(VP_FRAME, sizeof(vws_frame));
+
+    // We must make our own copy of the data for deterministic memory management
+
+    f->fin      = 1;
+    f->opcode   = oc;
+    f->mask     = 1;
+    f->rsv1     = 0;
+    f->offset   = 0;
+    f->size     = s;
+    f->data     = NULL;
+    f->borrowed = 0;
+    f->pos      = 0;
+    f->mapped   = 0;
+
+    if (f->size > 0)
+    {
+        f->data = vws.malloc(f->size);
+        memcpy(f->data, data, f->size);
+    }
+
+    return f;
+}
+
+void vws_frame_free(vws_frame* f)
+{
+    if (f != NULL)
+    {
+        if (f->mapped == 1)
+        {
+            vws_file_unmap(f->data, f->size);
+        }
+        else if (f->data != NULL && f->borrowed == 0)
+        {
+            vws.free(f->data);
+        }
+
+        f->data   = NULL;
+        f->size   = 0;
+        f->mapped = 0;
+
+        vws_pool_put(VP_FRAME, f);
+    }
+}
+
+vws_frame* vws_frame_recv(vws_cnx* c)
+{
+    // Default success unless error
+    vws.success();
+
+    if (vws_cnx_is_connected(c) == false)
+    {
+        return NULL;
+    }
+
+    while (true)
+    {
+        if (sc_queue_size(&c->queue) > 0)
+        {
+            vws_frame* f = sc_queue_del_last(&c->queue);
+            cnx_frame_dequeued(c, f);
+
+            // The caller owns the frame from here, so it can't keep pointing
+            // into the receive buffer.
+            frame_detach(c, f);
+            cnx_compact(c);
+
+            return f;
+        }
+
+        if (socket_wait_for_frame(c) <= 0)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+size_t vws_frame_header( unsigned char* header,
+                         unsigned char fin,
+                         unsigned char opcode,
+                         size_t size )
+{
+    // Minimum frame size
+    size_t header_size = 2;
+
+    // Set the FIN bit and opcode
+    header[0] = fin << 7 | opcode;
+
+    if (size <= 125)
+    {
+        header[1] = size;
+    }
+    else if (size <= 65535)
+    {
+        header[1] = 126;
+        header[2] = (size >> 8) & 0xFF;
+        header[3] = size & 0xFF;
+
+        // Additional bytes for payload length
+        header_size += 2;
+    }
+    else
+    {
+        header[1] = 127;
+        header[2] = (((uint64_t) size) >> 56) & 0xFF;
+        header[3] = (((uint64_t) size) >> 48) & 0xFF;
+        header[4] = (((uint64_t) size) >> 40) & 0xFF;
+        header[5] = (((uint64_t) size) >> 32) & 0xFF;
+        header[6] = (((uint64_t) size) >> 24) & 0xFF;
+        header[7] = (((uint64_t) size) >> 16) & 0xFF;
+        header[8] = (((uint64_t) size) >> 8)  & 0xFF;
+        header[9] = size & 0xFF;
+
+        // Additional bytes for payload length
+        header_size += 8;
+    }
+
+    return header_size;
+}
+
+vws_buffer* vws_serialize(vws_frame* f)
+{
+    if (f == NULL)
+    {
+        vws.error(VE_RT, "empty frame");
+
+        return NULL;
+    }
 
-    // Create the vws_buffer to hold the frame data
     vws_buffer* buffer = vws_buffer_new();
 
-    // Have buffer take ownership of data
-    buffer->data = frame_data;
-    buffer->size = frame_size;
+    if (frame_serialize(f, buffer) == false)
+    {
+        vws_buffer_free(buffer);
+        return NULL;
+    }
 
     vws.success();
 
     return buffer;
 }
 
-fs_t vws_deserialize(ucstr data, size_t size, vws_frame* f, size_t* consumed)
+bool frame_serialize(vws_frame* f, vws_buffer* out)
 {
-    // Check if the data contains the minimum required frame header bytes
-    if (size < 2)
+    //> Section 1: Size calculation
+
+    // Calculate the frame size
+    size_t payload_length = f->size;
+
+    // Maximum frame size with extended payload length and masking key
+    unsigned char header[14];
+
+    // Set the FIN bit, opcode and payload length
+    size_t header_size = vws_frame_header(header, f->fin, f->opcode, payload_length);
+
+    // RSV1 marks a compressed message
+    header[0] |= (f->rsv1 & 0x01) << 6;
+
+    //> Section 2: Frame allocation
+
+    size_t frame_size = header_size + payload_length;
+
+    if (f->mask)
     {
-        return FRAME_INCOMPLETE;
+        // Set the masking bit
+        header[1] |= 0x80;
+
+        // Additional bytes for masking key
+        frame_size += 4;
+    }
+
+    // Make room at the end of the buffer. Grow it geometrically, as a corked
+    // connection appends frame after frame.
+    if (out->allocated - out->size < frame_size)
+    {
+        size_t grow = (out->size > frame_size) ? out->size : frame_size;
+        vws_buffer_reserve(out, grow);
+    }
+
+    unsigned char* frame_data = out->data + out->size;
+
+    // Copy the header to the frame
+    memcpy(frame_data, header, header_size);
+
+    //> Section 3: Masking
+
+    if (f->mask)
+    {
+        // Generate a random masking key
+
+        unsigned char masking_key[4];
+
+        if (vws_mask_key(masking_key) == false)
+        {
+            // Error already set
+            vws_frame_free(f);
+            return false;
+        }
+
+        // Copy the masking key to the frame
+        memcpy(frame_data + header_size, masking_key, 4);
+
+        // Apply masking to the payload data
+        size_t payload_start = header_size + 4;
+        vws_mask(frame_data + payload_start, f->data, payload_length, masking_key, 0);
+    }
+    else
+    {
+        // Copy the payload data without masking
+        memcpy(frame_data + header_size, f->data, payload_length);
     }
 
-    // Read the first byte (FIN bit and opcode)
-    f->fin    = (data[0] >> 7) & 0x01;
-    f->opcode = data[0] & 0x0F;
+    //> Section 4: Finalizing
+
+    out->size += frame_size;
+
+    // Free the frame
+    vws_frame_free(f);
+
+    return true;
+}
+
+fs_t vws_deserialize(ucstr data, size_t size, vws_frame* f, size_t* consumed)
+{
+    size_t required_bytes = 0;
+    fs_t rc = frame_parse_header(data, size, f, &required_bytes);
+
+    if (rc != FRAME_COMPLETE)
+    {
+        return rc;
+    }
+
+    // Allocate the frame data
+    f->data     = vws.malloc(f->size);
+    f->borrowed = 0;
+
+    if (f->mask)
+    {
+        // Create a temp variable for the masking key
+        unsigned char mask[4];
+        memcpy(mask, data + f->offset - 4, 4);
+
+        // Read the payload data and apply the masking
+        vws_mask(f->data, data + f->offset, f->size, mask, 0);
+    }
+    else
+    {
+        // Copy the payload data
+        memcpy(f->data, data + f->offset, f->size);
+    }
+
+    // Update the bytes consumed
+    *consumed = required_bytes;
+
+    return FRAME_COMPLETE;
+}
+
+fs_t vws_deserialize_borrow( unsigned char* data,
+                             size_t size,
+                             vws_frame* f,
+                             size_t* consumed )
+{
+    size_t required_bytes = 0;
+    fs_t rc = frame_parse_header(data, size, f, &required_bytes);
+
+    if (rc != FRAME_COMPLETE)
+    {
+        return rc;
+    }
+
+    // Point straight at the payload
+    f->data     = data + f->offset;
+    f->borrowed = 1;
+
+    if (f->mask)
+    {
+        // Unmask in place
+        unsigned char mask[4];
+        memcpy(mask, data + f->offset - 4, 4);
+        vws_mask(f->data, f->data, f->size, mask, 0);
+    }
+
+    // Update the bytes consumed
+    *consumed = required_bytes;
+
+    return FRAME_COMPLETE;
+}
+
+fs_t frame_parse_header(ucstr data, size_t size, vws_frame* f, size_t* consumed)
+{
+    // Check if the data contains the minimum required frame header bytes
+    if (size < 2)
+    {
+        return FRAME_INCOMPLETE;
+    }
+
+    // Read the first byte (FIN bit, RSV1 bit and opcode)
+    f->fin    = (data[0] >> 7) & 0x01;
+    f->rsv1   = (data[0] >> 6) & 0x01;
+    f->opcode = data[0] & 0x0F;
+
+    // Read the second byte (mask bit and payload length)
+    f->mask = (data[1] >> 7) & 0x01;
+    f->size = data[1] & 0x7F;
+
+    // Check if the payload length requires additional bytes
+    size_t size_bytes = 0;
+    if (f->size == 126)
+    {
+        size_bytes = 2;
+    }
+    else if (f->size == 127)
+    {
+        size_bytes = 8;
+    }
+
+    // Check if the data contains complete frame header and payload
+    size_t required_bytes = 2 + size_bytes;
+
+    if (size < required_bytes)
+    {
+        return FRAME_INCOMPLETE;
+    }
+
+    // Read the payload
+    if (size_bytes > 0)
+    {
+        f->size = 0;
+        for (size_t i = 0; i < size_bytes; i++)
+        {
+            f->size = (f->size << 8) | data[2 + i];
+        }
+    }
+
+    // The top bit of a 64-bit length must be 0 (RFC 6455 5.2). Anything over
+    // VWS_FRAME_MAX is refused too, before the length is used, so that
+    // offset + size cannot wrap.
+    if ((f->size >> 63) != 0 || f->size > VWS_FRAME_MAX)
+    {
+        return FRAME_ERROR;
+    }
+
+    // Store the payload offset, which follows the masking key if present
+    f->offset = 2 + size_bytes + (f->mask ? 4 : 0);
+
+    // Check if the data contains the masking key and payload data, without
+    // adding the two
+    if (size < f->offset || f->size > size - f->offset)
+    {
+        return FRAME_INCOMPLETE;
+    }
+
+    *consumed = f->offset + f->size;
+
+    return FRAME_COMPLETE;
+}
+
+ucstr frame_payload(vws_cnx* c, vws_frame* f)
+{
+    if (f->borrowed)
+    {
+        return c->base.buffer->data + f->pos;
+    }
+
+    return f->data;
+}
+
+bool frame_stream(vws_cnx* c, vws_frame* f)
+{
+    bool begin = false;
+
+    switch (f->opcode)
+    {
+        case TEXT_FRAME:
+        case BINARY_FRAME:
+        {
+            begin            = true;
+            c->stream_opcode = f->opcode;
+            c->stream_utf8   = VWS_UTF8_ACCEPT;
+
+            // A new message drops whatever was left of an unfinished one
+            vws_buffer_free(c->stream_buffer);
+            c->stream_buffer = NULL;
+
+            if (f->rsv1 == 1)
+            {
+                c->stream_buffer = vws_buffer_new();
+            }
+
+            break;
+        }
+
+        case CONTINUATION_FRAME:
+        {
+            if (c->stream_opcode == 0)
+            {
+                // Not part of any message
+                vws_frame_free(f);
+                return true;
+            }
+
+            break;
+        }
+
+        default:
+        {
+            return false;
+        }
+    }
+
+    bool end           = (f->fin == 1);
+    unsigned char code = c->stream_opcode;
+
+    if (end == true)
+    {
+        c->stream_opcode = 0;
+    }
+
+    if (c->stream_buffer == NULL)
+    {
+        if (code == TEXT_FRAME)
+        {
+            uint32_t utf8 = vws_utf8_validate( c->stream_utf8,
+                                               frame_payload(c, f),
+                                               f->size );
+            c->stream_utf8 = utf8;
+
+            if (utf8 == VWS_UTF8_REJECT || (end == true && utf8 != VWS_UTF8_ACCEPT))
+            {
+                // Drop the rest of the message
+                c->stream_opcode = 0;
+                vws_frame_free(f);
+                cnx_fail(c, WS_CLOSE_INVALID_PAYLOAD);
+                vws.error(VE_WARN, "streamed TEXT message is not valid UTF-8");
+
+                return true;
+            }
+        }
+
+        c->stream(c, code, frame_payload(c, f), f->size, begin, end);
+        vws_frame_free(f);
+
+        return true;
+    }
+
+    // Compressed: the fragments are one deflate stream, so collect them. They
+    // are held until the end, so the limit is checked as they come in.
+    size_t max = c->max_message;
+
+    if (max > 0 && (f->size > max || c->stream_buffer->size > max - f->size))
+    {
+        // Drop the rest of the message and give up on the connection
+        c->stream_opcode = 0;
+        vws_buffer_free(c->stream_buffer);
+        c->stream_buffer = NULL;
+        vws_frame_free(f);
+        cnx_fail(c, WS_CLOSE_TOO_BIG);
+        vws.error(VE_WARN, "streamed message larger than max_message");
+
+        return true;
+    }
+
+    vws_buffer_append(c->stream_buffer, frame_payload(c, f), f->size);
+    vws_frame_free(f);
+
+    if (end == true)
+    {
+        vws_buffer* b    = c->stream_buffer;
+        c->stream_buffer = NULL;
+
+        if (vws_cnx_inflate(c, b) == false)
+        {
+            vws.error(VE_WARN, "streamed message failed to inflate");
+        }
+        else if ( code == TEXT_FRAME &&
+                  vws_utf8_validate(VWS_UTF8_ACCEPT, b->data, b->size) != VWS_UTF8_ACCEPT )
+        {
+            cnx_fail(c, WS_CLOSE_INVALID_PAYLOAD);
+            vws.error(VE_WARN, "streamed TEXT message is not valid UTF-8");
+        }
+        else
+        {
+            c->stream(c, code, b->data, b->size, true, true);
+        }
+
+        vws_buffer_free(b);
+    }
+
+    return true;
+}
+
+void frame_detach(vws_cnx* c, vws_frame* f)
+{
+    if (f->borrowed == 0)
+    {
+        return;
+    }
+
+    ucstr src   = frame_payload(c, f);
+    f->data     = NULL;
+    f->borrowed = 0;
+
+    if (f->size > 0)
+    {
+        f->data = vws.malloc(f->size);
+        memcpy(f->data, src, f->size);
+    }
+}
+
+void vws_mask(unsigned char* dst, ucstr src, size_t size, ucstr key, size_t pos)
+{
+    // Resolved once per process. All threads select the same kernel so a race
+    // on first use is harmless.
+    static mask_kernel kernel = NULL;
+
+    mask_kernel k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+
+    if (k == NULL)
+    {
+        k = mask_select();
+        __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+    }
+
+    // Rotate the key so that it lines up with src[0]
+    unsigned char aligned[4];
+    for (size_t i = 0; i < 4; i++)
+    {
+        aligned[i] = key[(pos + i) & 3];
+    }
+
+    k(dst, src, size, aligned);
+}
+
+//------------------------------------------------------------------------------
+// Masking kernels
+//------------------------------------------------------------------------------
+
+void mask_scalar(unsigned char* dst, ucstr src, size_t size, const unsigned char key[4])
+{
+    // Build a 64-bit key from two copies of the 4-byte key. Using memcpy keeps
+    // the bytes in memory order so this is independent of endianness.
+    uint64_t k64;
+    memcpy(&k64, key, 4);
+    memcpy((unsigned char*)&k64 + 4, key, 4);
+
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        word ^= k64;
+        memcpy(dst + i, &word, 8);
+    }
+
+    // Tail. We have consumed a multiple of 4 bytes so the key is still aligned.
+    for (; i < size; i++)
+    {
+        dst[i] = src[i] ^ key[i & 3];
+    }
+}
+
+#if defined(VWS_MASK_X86)
+
+void mask_sse2(unsigned char* dst, ucstr src, size_t size, const unsigned char key[4])
+{
+    int32_t k32;
+    memcpy(&k32, key, 4);
+
+    __m128i k128 = _mm_set1_epi32(k32);
+    size_t i     = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(v, k128));
+    }
+
+    mask_scalar(dst + i, src + i, size - i, key);
+}
+
+__attribute__((target("avx2")))
+void mask_avx2(unsigned char* dst, ucstr src, size_t size, const unsigned char key[4])
+{
+    int32_t k32;
+    memcpy(&k32, key, 4);
+
+    __m256i k256 = _mm256_set1_epi32(k32);
+    size_t i     = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(v, k256));
+    }
+
+    // Clear the upper halves before running SSE code. Leaving them dirty makes
+    // every following legacy SSE instruction pay a state transition, which
+    // costs more than masking a small payload.
+    _mm256_zeroupper();
+
+    mask_sse2(dst + i, src + i, size - i, key);
+}
+
+#elif defined(VWS_MASK_NEON)
+
+void mask_neon(unsigned char* dst, ucstr src, size_t size, const unsigned char key[4])
+{
+    uint32_t k32;
+    memcpy(&k32, key, 4);
+
+    uint8x16_t k128 = vreinterpretq_u8_u32(vdupq_n_u32(k32));
+    size_t i        = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(src + i);
+        vst1q_u8(dst + i, veorq_u8(v, k128));
+    }
+
+    mask_scalar(dst + i, src + i, size - i, key);
+}
+
+#endif
+
+static __thread mask_pool mask_keys;
+
+bool vws_mask_key(unsigned char* key)
+{
+    mask_pool* pool = &mask_keys;
+
+    if (pool->seeded == false || pool->pos == sizeof(pool->keys))
+    {
+        if (mask_pool_refill(pool) == false)
+        {
+            return false;
+        }
+    }
+
+    memcpy(key, pool->keys + pool->pos, 4);
+
+    // Don't leave used keys lying around
+    memset(pool->keys + pool->pos, 0, 4);
+    pool->pos += 4;
+
+    return true;
+}
+
+bool mask_pool_refill(mask_pool* pool)
+{
+    if (pool->seeded == false || pool->refills == MASK_POOL_RESEED)
+    {
+        // "expand 32-byte k", then a random key, block counter and nonce
+        unsigned char seed[48];
+
+        if (RAND_bytes(seed, sizeof(seed)) != 1)
+        {
+            vws.error(VE_RT, "RAND_bytes() failed");
+            return false;
+        }
+
+        pool->state[0] = 0x61707865;
+        pool->state[1] = 0x3320646e;
+        pool->state[2] = 0x79622d32;
+        pool->state[3] = 0x6b206574;
+
+        memcpy(&pool->state[4], seed, sizeof(seed));
+        memset(seed, 0, sizeof(seed));
+
+        pool->refills = 0;
+        pool->seeded  = true;
+    }
+
+    for (int i = 0; i < MASK_POOL_BLOCKS; i++)
+    {
+        mask_chacha20(pool->state, pool->keys + i * 64);
+    }
+
+    pool->pos = 0;
+    pool->refills++;
+
+    return true;
+}
+
+#define MASK_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define MASK_QR(a, b, c, d)                                                   \
+    a += b; d ^= a; d = MASK_ROTL(d, 16);                                     \
+    c += d; b ^= c; b = MASK_ROTL(b, 12);                                     \
+    a += b; d ^= a; d = MASK_ROTL(d, 8);                                      \
+    c += d; b ^= c; b = MASK_ROTL(b, 7)
+
+void mask_chacha20(uint32_t* state, unsigned char* out)
+{
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        MASK_QR(x[0], x[4], x[8],  x[12]);
+        MASK_QR(x[1], x[5], x[9],  x[13]);
+        MASK_QR(x[2], x[6], x[10], x[14]);
+        MASK_QR(x[3], x[7], x[11], x[15]);
+        MASK_QR(x[0], x[5], x[10], x[15]);
+        MASK_QR(x[1], x[6], x[11], x[12]);
+        MASK_QR(x[2], x[7], x[8],  x[13]);
+        MASK_QR(x[3], x[4], x[9],  x[14]);
+    }
+
+    // Any byte order will do: the output is only used as random bytes
+    for (int i = 0; i < 16; i++)
+    {
+        x[i] += state[i];
+    }
+
+    memcpy(out, x, 64);
+
+    // 64-bit block counter in words 12 and 13
+    if (++state[12] == 0)
+    {
+        state[13]++;
+    }
+}
+
+#undef MASK_QR
+#undef MASK_ROTL
+
+mask_kernel mask_select()
+{
+#if defined(VWS_MASK_X86)
+
+    #if defined(__GNUC__) || defined(__clang__)
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return mask_avx2;
+    }
+
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return mask_sse2;
+    }
+
+    #endif
+
+    return mask_scalar;
+
+#elif defined(VWS_MASK_NEON)
+
+    return mask_neon;
+
+#else
+
+    return mask_scalar;
+
+#endif
+}
+
+//------------------------------------------------------------------------------
+// UTF-8 validation
+//------------------------------------------------------------------------------
+
+uint32_t vws_utf8_validate(uint32_t state, ucstr data, size_t size)
+{
+    // Resolved once per process, as for vws_mask()
+    static utf8_kernel kernel = NULL;
+
+    utf8_kernel k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+
+    if (k == NULL)
+    {
+        k = utf8_select();
+        __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+    }
+
+    // Finish the character left open by the last piece
+    size_t i = 0;
+
+    while (state != VWS_UTF8_ACCEPT && i < size)
+    {
+        if (state == VWS_UTF8_REJECT)
+        {
+            return state;
+        }
+
+        state = utf8_step(state, data[i++]);
+    }
+
+    if (state != VWS_UTF8_ACCEPT)
+    {
+        return state;
+    }
+
+    // Hold back a character cut off at the end. Its lead byte is one of the
+    // last three.
+    size_t end = size;
+
+    for (size_t n = 1; n <= 3 && n <= size - i; n++)
+    {
+        unsigned char b = data[size - n];
+
+        if ((b & 0xC0) == 0x80)
+        {
+            continue;
+        }
+
+        size_t length = (b >= 0xF0) ? 4 : (b >= 0xE0) ? 3 : (b >= 0xC0) ? 2 : 1;
+
+        if (length > n)
+        {
+            end = size - n;
+        }
+
+        break;
+    }
+
+    if (k(data + i, end - i) == false)
+    {
+        return VWS_UTF8_REJECT;
+    }
+
+    for (i = end; i < size; i++)
+    {
+        state = utf8_step(state, data[i]);
+    }
+
+    return state;
+}
+
+uint32_t utf8_step(uint32_t state, unsigned char byte)
+{
+    if (state == VWS_UTF8_ACCEPT)
+    {
+        if (byte < 0x80)
+        {
+            return VWS_UTF8_ACCEPT;
+        }
+
+        // C0 and C1 can only start overlong forms, F5 and up are above U+10FFFF
+        if (byte < 0xC2 || byte > 0xF4)
+        {
+            return VWS_UTF8_REJECT;
+        }
+
+        if (byte < 0xE0)
+        {
+            return 1 | (0x80 << 8) | (0xBF << 16);
+        }
+
+        if (byte < 0xF0)
+        {
+            // E0 80-9F would be overlong, ED A0-BF a surrogate
+            uint32_t lo = (byte == 0xE0) ? 0xA0 : 0x80;
+            uint32_t hi = (byte == 0xED) ? 0x9F : 0xBF;
+
+            return 2 | (lo << 8) | (hi << 16);
+        }
 
-    // Read the second byte (mask bit and payload length)
-    f->mask = (data[1] >> 7) & 0x01;
-    f->size = data[1] & 0x7F;
+        // F0 80-8F would be overlong, F4 90-BF above U+10FFFF
+        uint32_t lo = (byte == 0xF0) ? 0x90 : 0x80;
+        uint32_t hi = (byte == 0xF4) ? 0x8F : 0xBF;
 
-    // Check if the payload length requires additional bytes
-    size_t size_bytes = 0;
-    if (f->size == 126)
-    {
-        size_bytes = 2;
+        return 3 | (lo << 8) | (hi << 16);
     }
-    else if (f->size == 127)
+
+    uint32_t need = state & 0xFF;
+
+    if (byte < ((state >> 8) & 0xFF) || byte > ((state >> 16) & 0xFF))
     {
-        size_bytes = 8;
+        return VWS_UTF8_REJECT;
     }
 
-    // Check if the data contains complete frame header and payload
-    size_t required_bytes = 2 + size_bytes;
-
-    if (size < required_bytes)
+    if (need == 1)
     {
-        return FRAME_INCOMPLETE;
+        return VWS_UTF8_ACCEPT;
     }
 
-    // Read the payload
-    if (size_bytes > 0)
+    return (need - 1) | (0x80 << 8) | (0xBF << 16);
+}
+
+//------------------------------------------------------------------------------
+// UTF-8 kernels
+//------------------------------------------------------------------------------
+
+bool utf8_scalar(ucstr data, size_t size)
+{
+    uint32_t state = VWS_UTF8_ACCEPT;
+    size_t i       = 0;
+
+    while (i < size)
     {
-        f->size = 0;
-        for (size_t i = 0; i < size_bytes; i++)
+        if (state == VWS_UTF8_ACCEPT && i + 8 <= size)
         {
-            f->size = (f->size << 8) | data[2 + i];
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+
+            if ((word & 0x8080808080808080ULL) == 0)
+            {
+                i += 8;
+                continue;
+            }
         }
-    }
 
-    // Check if the frame has masking key and payload data
-    if (f->mask)
-    {
-        // Check if the data contains the masking key and payload data
-        required_bytes += 4 + f->size;
+        state = utf8_step(state, data[i++]);
 
-        if (size < required_bytes)
+        if (state == VWS_UTF8_REJECT)
         {
-            return FRAME_INCOMPLETE;
+            return false;
         }
+    }
 
-        // Store the payload offset
-        f->offset = 2 + size_bytes + 4;
+    return state == VWS_UTF8_ACCEPT;
+}
 
-        // Allocate the frame data
-        f->data = vws.malloc(f->size);
+#if defined(VWS_MASK_X86)
+
+// Error classes of the lookup algorithm. Each table maps a nibble of a byte
+// pair to the errors it is consistent with. A pair is in error if all three
+// agree on one.
+#define UTF8_TOO_SHORT      (1 << 0) // Lead byte not followed by continuation
+#define UTF8_TOO_LONG       (1 << 1) // ASCII followed by continuation
+#define UTF8_OVERLONG_3     (1 << 2) // E0 80-9F
+#define UTF8_TOO_LARGE      (1 << 3) // F4 90-BF, or F5-FF
+#define UTF8_SURROGATE      (1 << 4) // ED A0-BF
+#define UTF8_OVERLONG_2     (1 << 5) // C0-C1
+#define UTF8_TOO_LARGE_1000 (1 << 6) // F5-FF 80-8F
+#define UTF8_OVERLONG_4     (1 << 6) // F0 80-8F
+#define UTF8_TWO_CONTS      (1 << 7) // Two continuations, valid only if the
+                                     // third or fourth byte of a character
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
 
-        // Create a temp variable for the masking key
-        unsigned char mask[4];
-        memcpy(mask, data + 2 + size_bytes, 4);
+/**
+ * @brief Checks 32 bytes of UTF-8 given the 32 before them.
+ *
+ * @return Nonzero bytes where there are errors.
+ */
+__attribute__((target("avx2")))
+static inline __m256i utf8_avx2_check(__m256i input, __m256i prev_input)
+{
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+        // 0_______ ________ : ASCII
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        // 10______ ________ : continuation
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        // 1100____ ________ : two byte lead
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        // 1101____ ________ : two byte lead
+        UTF8_TOO_SHORT,
+        // 1110____ ________ : three byte lead
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        // 1111____ ________ : four byte lead
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4 );
+
+    const __m256i byte_1_low_table = _mm256_setr_epi8(
+        // ____0000 ________
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        // ____0001 ________
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        // ____001_ ________
+        UTF8_CARRY,
+        UTF8_CARRY,
+        // ____0100 ________
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        // ____0101 ________ and up
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        // ____1101 ________
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 );
+
+    const __m256i byte_2_high_table = _mm256_setr_epi8(
+        // ________ 0_______ : ASCII
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        // ________ 1000____
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        // ________ 1001____
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE,
+        // ________ 101_____
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+        // ________ 11______ : lead byte
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT );
+
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    // The input shifted right by 1, 2 and 3 bytes, pulling in the end of the
+    // previous block
+    __m256i carried = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1   = _mm256_alignr_epi8(input, carried, 16 - 1);
+    __m256i prev2   = _mm256_alignr_epi8(input, carried, 16 - 2);
+    __m256i prev3   = _mm256_alignr_epi8(input, carried, 16 - 3);
+
+    __m256i byte_1_high = _mm256_shuffle_epi8(
+        byte_1_high_table,
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble) );
+
+    __m256i byte_1_low = _mm256_shuffle_epi8(
+        byte_1_low_table,
+        _mm256_and_si256(prev1, nibble) );
+
+    __m256i byte_2_high = _mm256_shuffle_epi8(
+        byte_2_high_table,
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble) );
+
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(byte_1_high, byte_1_low), byte_2_high );
+
+    // Two continuations in a row must be the third or fourth byte of a
+    // character, so 2 or 3 bytes back there must be a 3 or 4 byte lead
+    __m256i third  = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must23 = _mm256_and_si256( _mm256_or_si256(third, fourth),
+                                       _mm256_set1_epi8((char)0x80) );
+
+    return _mm256_xor_si256(must23, special);
+}
 
-        // Read the payload data and apply the masking
-        for (size_t i = 0; i < f->size; i++)
+__attribute__((target("avx2")))
+bool utf8_avx2(ucstr data, size_t size)
+{
+    // A lead byte in the last three bytes of a block is incomplete. Bytes above
+    // these limits start a character longer than what is left.
+    const __m256i limits = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1) );
+
+    __m256i prev       = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    __m256i error      = _mm256_setzero_si256();
+    size_t i           = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i input = _mm256_loadu_si256((const __m256i*)(data + i));
+
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+            // ASCII. Only an unfinished character before it can be wrong.
+            error = _mm256_or_si256(error, incomplete);
+        }
+        else
         {
-            f->data[i] = data[f->offset + i] ^ mask[i % 4];
+            error      = _mm256_or_si256(error, utf8_avx2_check(input, prev));
+            incomplete = _mm256_subs_epu8(input, limits);
         }
+
+        prev = input;
+    }
+
+    if (i < size)
+    {
+        // Pad the tail with ASCII, which ends any character left open
+        unsigned char tail[32] = { 0 };
+        memcpy(tail, data + i, size - i);
+
+        __m256i input = _mm256_loadu_si256((const __m256i*)tail);
+        error         = _mm256_or_si256(error, utf8_avx2_check(input, prev));
     }
     else
     {
-        // Check if the data contains the payload data
+        error = _mm256_or_si256(error, incomplete);
+    }
 
-        required_bytes += f->size;
+    bool valid = _mm256_testz_si256(error, error);
 
-        if (size < required_bytes)
-        {
-            return FRAME_INCOMPLETE;
-        }
+    // As in mask_avx2()
+    _mm256_zeroupper();
 
-        // Store the payload offset
-        f->offset = 2 + size_bytes;
+    return valid;
+}
 
-        // Allocate the frame data
-        f->data = vws.malloc(f->size);
+#endif
 
-        // Copy the payload data
-        memcpy(f->data, data + f->offset, f->size);
+utf8_kernel utf8_select()
+{
+#if defined(VWS_MASK_X86) && (defined(__GNUC__) || defined(__clang__))
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return utf8_avx2;
     }
 
-    // Update the bytes consumed
-    *consumed = required_bytes;
+#endif
 
-    return FRAME_COMPLETE;
+    return utf8_scalar;
 }
 
 //------------------------------------------------------------------------------
@@ -1015,6 +3466,7 @@ void process_frame(vws_cnx* c, vws_frame* f)
         case CONTINUATION_FRAME:
         {
             // Add to queue
+            vws_queue_lazy(&c->queue);
             sc_queue_add_first(&c->queue, f);
 
             break;
@@ -1064,48 +3516,60 @@ char* generate_websocket_key()
     }
 
     // Base64-encode the random bytes
-    char* encoded_key = vws_base64_encode(random_bytes, sizeof(random_bytes));
+    return vws_base64_encode(random_bytes, sizeof(random_bytes));
+}
+
+cstr vws_accept_key(cstr key)
+{
+    char* encoded = (char*)vws.malloc(VWS_ACCEPT_KEY_SIZE);
 
-    if (encoded_key == NULL)
+    if (vws_accept_key_into(key, encoded) == false)
     {
-        return NULL;
+        encoded[0] = '\0';
     }
 
-    return encoded_key;
+    return encoded;
 }
 
-cstr vws_accept_key(cstr key)
+bool vws_accept_key_into(cstr key, char* out)
 {
-    // Concatenate the key and WebSocket GUID
-    const char* websocket_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    size_t key_length          = strlen(key);
-    size_t guid_length         = strlen(websocket_guid);
-    size_t input_length        = key_length + guid_length;
-    char* input                = (char*)vws.malloc(input_length + 1);
+    // Concatenate the key and WebSocket GUID. A client key is 24 characters,
+    // so the stack is plenty.
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char input[128];
 
-    strncpy(input, key, key_length);
-    strncpy(input + key_length, websocket_guid, guid_length);
-    input[input_length] = '\0';
+    size_t key_length  = (key != NULL) ? strlen(key) : 0;
+    size_t guid_length = sizeof(guid) - 1;
 
-    // Compute the SHA-1 hash of the concatenated value
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((const unsigned char*)input, input_length, hash);
+    if (key_length == 0 || key_length + guid_length > sizeof(input))
+    {
+        vws.error(VE_RT, "Invalid WebSocket key");
+        return false;
+    }
+
+    memcpy(input, key, key_length);
+    memcpy(input + key_length, guid, guid_length);
 
-    // Base64-encode the hash
-    char* encoded_hash = vws_base64_encode(hash, sizeof(hash));
+    // Compute the SHA-1 hash of the concatenated value
+    unsigned char hash[20];
+    vws_sha1((const unsigned char*)input, key_length + guid_length, hash);
 
-    vws.free(input);
+    // Base64-encode the hash: 28 characters and the terminator
+    vws_base64_encode_into(hash, sizeof(hash), out);
 
-    return encoded_hash;
+    return true;
 }
 
 int verify_handshake(const char* key, const char* response)
 {
-    char* hash = vws_accept_key(key);
-    int result = strcmp(hash, response);
-    vws.free(hash);
+    char hash[VWS_ACCEPT_KEY_SIZE];
+
+    if (vws_accept_key_into(key, hash) == false)
+    {
+        return 0;
+    }
 
-    return result == 0;
+    return strcmp(hash, response) == 0;
 }
 
 ssize_t socket_wait_for_frame(vws_cnx* c)
@@ -1118,12 +3582,23 @@ ssize_t socket_wait_for_frame(vws_cnx* c)
         return -1;
     }
 
-    ssize_t n;
-    unsigned char buf[1024];
+    // The receive buffer may already hold a complete frame (a read can bring
+    // in more than one). Use it before touching the socket.
+    ssize_t n = vws_cnx_ingress(c);
+
+    if (n > 0)
+    {
+        return n;
+    }
+
+    // Anything corked has to go out before waiting for the reply to it
+    if (vws_cnx_flush(c) < 0)
+    {
+        return -1;
+    }
 
     while (true)
     {
-        memset(buf, 0, 1024);
         n = vws_socket_read((vws_socket*)c);
 
         if (n <= 0)
@@ -1144,60 +3619,100 @@ ssize_t socket_wait_for_frame(vws_cnx* c)
 ssize_t vws_cnx_ingress(vws_cnx* c)
 {
     size_t total_consumed = 0;
+    bool zero_copy        = vws_is_flag(&c->flags, CNX_ZERO_COPY);
 
     // Process as many frames as possible
     while (true)
     {
+        // In zero-copy mode, parsed data stays in the buffer until the frames
+        // borrowing it are consumed. New data starts after it.
+        vws_buffer* b = c->base.buffer;
+        size_t start  = zero_copy ? c->parsed : 0;
+
         // If there is no more data in socket buffer
-        if (c->base.buffer->size == 0)
+        if (b->size - start == 0)
         {
             break;
         }
 
         // Attempt to parse complete frame
         size_t consumed  = 0;
-        vws_buffer* b    = c->base.buffer;
         vws_frame* frame = vws_frame_new(NULL, 0, TEXT_FRAME);
 
         if (vws.tracelevel >= VT_PROTOCOL)
         {
-            vws_trace_lock();
-            printf("\n+----------------------------------------------------+\n");
-            printf("| Frame Received                                     |\n");
-            printf("+----------------------------------------------------+\n");
-            vws_dump_websocket_frame(b->data, b->size);
-            printf("------------------------------------------------------\n");
-            vws_trace_unlock();
+            vws_trace_dump( "Frame Received",
+                            vws_dump_websocket_frame,
+                            b->data + start,
+                            b->size - start );
         }
 
-        fs_t rc = vws_deserialize(b->data, b->size, frame, &consumed);
+        fs_t rc;
+
+        if (zero_copy)
+        {
+            rc = vws_deserialize_borrow( b->data + start, b->size - start,
+                                         frame, &consumed );
+        }
+        else
+        {
+            rc = vws_deserialize(b->data, b->size, frame, &consumed);
+        }
 
         if (rc == FRAME_ERROR)
         {
+            // Too large to ever be read. Nothing after it can be either.
+            cnx_fail(c, WS_CLOSE_TOO_BIG);
             vws.error(VE_WARN, "FRAME_ERROR");
             vws_frame_free(frame);
+            cnx_compact(c);
 
             return 0;
         }
 
         if (rc == FRAME_INCOMPLETE)
         {
-            // No complete frame in socket buffer
+            // No more complete frames in socket buffer
             vws_frame_free(frame);
-
-            return 0;
+            break;
         }
 
         // Update
         total_consumed += consumed;
+        VWS_PROBE3(frame, c, frame->opcode, frame->size);
+
+        if (zero_copy)
+        {
+            // Record where the payload lives so it can be found again if the
+            // buffer is reallocated or compacted.
+            frame->pos  = start + frame->offset;
+            c->parsed  += consumed;
+        }
+
+        // We have a frame. Stream it or process it. If the callback queued
+        // it, account for it so vws_msg_pop() doesn't have to walk the queue.
+        if (c->stream == NULL || frame_stream(c, frame) == false)
+        {
+            size_t queued = sc_queue_size(&c->queue);
+
+            c->process(c, frame);
 
-        // We have a frame. Process it.
-        c->process(c, frame);
+            if (sc_queue_size(&c->queue) > queued)
+            {
+                cnx_frame_queued(c, sc_queue_peek_first(&c->queue));
+                cnx_spill(c);
+            }
+        }
 
-        // Drain the consumed frame data from buffer
-        vws_buffer_drain(c->base.buffer, consumed);
+        if (zero_copy == false)
+        {
+            // Drain the consumed frame data from buffer
+            vws_buffer_consume(c->base.buffer, consumed);
+        }
     }
 
+    cnx_compact(c);
+
     vws.success();
 
     return total_consumed;
@@ -1233,12 +3748,62 @@ vws_msg* vws_msg_pop(vws_cnx* c)
         return NULL;
     }
 
-    // Create new message
+    size_t size = sc_queue_del_last(&c->messages);
+
+    if (c->max_message > 0 && size > c->max_message)
+    {
+        // Drop its frames and give up on the connection
+        do
+        {
+            vws_frame* f  = sc_queue_del_last(&c->queue);
+            bool complete = (f->fin == 1);
+            vws_frame_free(f);
+
+            if (complete)
+            {
+                break;
+            }
+        }
+        while (true);
+
+        cnx_compact(c);
+        cnx_fail(c, WS_CLOSE_TOO_BIG);
+        vws.error(VE_WARN, "message larger than max_message");
+
+        return NULL;
+    }
+
     vws_msg* m = vws_msg_new();
 
+    // Large uncompressed messages go to a file rather than memory, unless
+    // they were written to one as they arrived
+    vws_frame* first = sc_queue_peek_last(&c->queue);
+    int fd           = -1;
+
+    if ( c->spill > 0 && size > c->spill &&
+         first->rsv1 == 0 && first->mapped == 0 )
+    {
+        fd = vws_file_temp();
+    }
+
+    if (fd < 0 && first->mapped == 0)
+    {
+        // Sized up front for the whole payload
+        vws_buffer_reserve(m->data, size);
+    }
+
     // Set to sentinel value to detect first frame
     m->opcode = 100;
 
+    // Whether the message is compressed, per its first frame
+    bool compressed = false;
+
+    // UTF-8 state of an uncompressed TEXT message, checked frame by frame
+    uint32_t utf8 = VWS_UTF8_ACCEPT;
+
+    // Whether writing to the file failed. The rest of the frames are dropped.
+    bool failed = false;
+
     do
     {
         vws_frame* f = sc_queue_del_last(&c->queue);
@@ -1247,11 +3812,33 @@ vws_msg* vws_msg_pop(vws_cnx* c)
         // from the first frame only
         if (m->opcode == 100)
         {
-            m->opcode = f->opcode;
+            m->opcode  = f->opcode;
+            compressed = (f->rsv1 == 1);
+        }
+
+        if (m->opcode == TEXT_FRAME && compressed == false)
+        {
+            utf8 = vws_utf8_validate(utf8, frame_payload(c, f), f->size);
         }
 
-        // Copy frame data into message buffer
-        vws_buffer_append(m->data, f->data, f->size);
+        // Copy frame data into message buffer or file
+        if (f->mapped == 1)
+        {
+            // The whole message, already in a file. Hand the mapping over.
+            m->data->data = f->data;
+            m->data->size = f->size;
+            m->mapped     = true;
+            f->data       = NULL;
+            f->mapped     = 0;
+        }
+        else if (fd < 0)
+        {
+            vws_buffer_append(m->data, frame_payload(c, f), f->size);
+        }
+        else if (failed == false)
+        {
+            failed = !vws_file_write(fd, frame_payload(c, f), f->size);
+        }
 
         // Is this the completion frame?
         bool complete = (f->fin == 1);
@@ -1266,21 +3853,206 @@ vws_msg* vws_msg_pop(vws_cnx* c)
     }
     while (true);
 
+    // The message has its own copy now, release the frames' receive data
+    cnx_compact(c);
+
+    if (fd >= 0)
+    {
+        // The mapping keeps the file open
+        ucstr data = (failed == false) ? vws_file_map(fd, 0, &size) : NULL;
+        close(fd);
+
+        if (data == NULL)
+        {
+            // Error already set
+            vws_msg_free(m);
+            return NULL;
+        }
+
+        m->data->data = (unsigned char*)data;
+        m->data->size = size;
+        m->mapped     = true;
+    }
+
+    if (compressed == true && vws_cnx_inflate(c, m->data) == false)
+    {
+        // Corrupt or unexpected. Drop it.
+        vws_msg_free(m);
+        return NULL;
+    }
+
+    if (m->opcode == TEXT_FRAME && compressed == true)
+    {
+        utf8 = vws_utf8_validate(utf8, m->data->data, m->data->size);
+    }
+
+    if (utf8 != VWS_UTF8_ACCEPT)
+    {
+        vws_msg_free(m);
+        cnx_fail(c, WS_CLOSE_INVALID_PAYLOAD);
+        vws.error(VE_WARN, "TEXT message is not valid UTF-8");
+
+        return NULL;
+    }
+
+    VWS_PROBE3(msg_pop, c, m, m->data->size);
+
     return m;
 }
 
 bool has_complete_message(vws_cnx* c)
 {
-    vws_frame* f;
-    sc_queue_foreach (&c->queue, f)
+    return sc_queue_size(&c->messages) > 0;
+}
+
+void cnx_frame_queued(vws_cnx* c, vws_frame* f)
+{
+    c->partial += f->size;
+
+    if (f->fin == 1)
+    {
+        vws_queue_lazy(&c->messages);
+        sc_queue_add_first(&c->messages, c->partial);
+        c->partial = 0;
+    }
+}
+
+void cnx_spill(vws_cnx* c)
+{
+    vws_frame* f = sc_queue_peek_first(&c->queue);
+
+    if (f->opcode != CONTINUATION_FRAME)
+    {
+        c->partial_opcode = f->opcode;
+        c->partial_rsv1   = f->rsv1;
+    }
+
+    if (c->spill_fd < 0)
     {
-        if (f->fin == 1)
+        // A message complete in memory is left to vws_msg_pop(), and a
+        // compressed one is inflated from memory
+        if ( c->spill == 0 || c->partial <= c->spill || f->fin == 1 ||
+             c->partial_rsv1 == 1 )
+        {
+            return;
+        }
+
+        c->spill_fd   = vws_file_temp();
+        c->spill_drop = false;
+
+        if (c->spill_fd < 0)
+        {
+            // Kept in memory
+            return;
+        }
+
+        // Its frames so far are the ones at the front not ending a message
+        size_t n = 0;
+
+        while (n < sc_queue_size(&c->queue))
+        {
+            vws_frame* g = sc_queue_at(&c->queue, n);
+
+            if (g->fin == 1)
+            {
+                break;
+            }
+
+            n++;
+        }
+
+        // Oldest first
+        for (size_t i = n; i > 0; i--)
+        {
+            vws_frame* g = sc_queue_at(&c->queue, i - 1);
+            cnx_spill_frame(c, g);
+        }
+
+        for (size_t i = 0; i < n; i++)
         {
-            return true;
+            sc_queue_del_first(&c->queue);
         }
     }
+    else
+    {
+        sc_queue_del_first(&c->queue);
 
-    return false;
+        if (c->max_message > 0 && c->partial > c->max_message)
+        {
+            if (c->spill_drop == false)
+            {
+                cnx_fail(c, WS_CLOSE_TOO_BIG);
+                vws.error(VE_WARN, "message larger than max_message");
+            }
+
+            c->spill_drop = true;
+        }
+
+        bool end = (f->fin == 1);
+        cnx_spill_frame(c, f);
+
+        if (end == true)
+        {
+            //> The message is complete. Queue the file in its place.
+
+            size_t size = 0;
+            ucstr data  = NULL;
+
+            if (c->spill_drop == false)
+            {
+                data = vws_file_map(c->spill_fd, 0, &size);
+            }
+
+            // The mapping keeps the file open
+            close(c->spill_fd);
+            c->spill_fd = -1;
+
+            if (data == NULL)
+            {
+                // Its size, recorded by cnx_frame_queued()
+                sc_queue_del_first(&c->messages);
+            }
+            else
+            {
+                vws_frame* m = vws_frame_new(NULL, 0, c->partial_opcode);
+                m->data      = (unsigned char*)data;
+                m->size      = size;
+                m->mapped    = 1;
+
+                sc_queue_add_first(&c->queue, m);
+            }
+        }
+    }
+
+    // Release the receive data the frames borrowed
+    cnx_compact(c);
+}
+
+void cnx_spill_frame(vws_cnx* c, vws_frame* f)
+{
+    if (c->spill_drop == false)
+    {
+        if (vws_file_write(c->spill_fd, frame_payload(c, f), f->size) == false)
+        {
+            // Error already set
+            c->spill_drop = true;
+        }
+    }
+
+    vws_frame_free(f);
+}
+
+void cnx_frame_dequeued(vws_cnx* c, vws_frame* f)
+{
+    if (f->fin == 1)
+    {
+        sc_queue_del_last(&c->messages);
+    }
+    else if (sc_queue_size(&c->messages) == 0)
+    {
+        // Part of the message still being received
+        c->partial -= f->size;
+    }
 }
 
 void dump_websocket_header(const ws_header* header)
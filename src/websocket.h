@@ -36,6 +36,17 @@ typedef enum
 
 } fs_t;
 
+/** Largest frame payload accepted from the network, in bytes. A frame header
+ * claiming more is a FRAME_ERROR, and fails the connection with 1009 (Message
+ * Too Big). Define it at build time to change it. */
+#ifndef VWS_FRAME_MAX
+#define VWS_FRAME_MAX (1ULL << 30)
+#endif
+
+/** Default largest message a connection accepts (vws_cnx.max_message), in
+ * bytes */
+#define VWS_MESSAGE_MAX (1ULL << 30)
+
 /** @brief Defines the types of WebSocket frames */
 typedef enum
 {
@@ -73,6 +84,10 @@ typedef struct vws_frame
     /**< Defines whether the payload is masked. */
     unsigned char mask;
 
+    /**< RSV1 bit. With permessage-deflate, set on the first frame of a
+     * compressed message. */
+    unsigned char rsv1;
+
     /**< Position of the data in the frame. */
     unsigned int offset;
 
@@ -82,6 +97,18 @@ typedef struct vws_frame
     /**< The payload data for the frame. */
     unsigned char* data;
 
+    /**< Payload is borrowed from a connection receive buffer (1) or owned by
+     * the frame (0). Borrowed data is not freed with the frame. */
+    unsigned char borrowed;
+
+    /**< Position of borrowed payload in the connection receive buffer. */
+    size_t pos;
+
+    /**< Payload is a read-only mapping of a temporary file holding a whole
+     * message received past vws_cnx.spill (1), or not (0). It is unmapped
+     * with the frame. */
+    unsigned char mapped;
+
 } vws_frame;
 
 /**
@@ -104,6 +131,24 @@ vws_frame* vws_frame_new(ucstr data, size_t s, unsigned char oc);
  */
 void vws_frame_free(vws_frame* frame);
 
+/**
+ * @brief Writes an unmasked frame header (FIN bit, opcode and payload length)
+ *        for a payload of the given size. This allows the header and payload to
+ *        be sent as separate buffers without copying the payload.
+ *
+ * @param header The destination. Must hold at least 10 bytes.
+ * @param fin The FIN bit.
+ * @param opcode The frame opcode.
+ * @param size The payload size.
+ * @return The number of header bytes written.
+ *
+ * @ingroup FrameFunctions
+ */
+size_t vws_frame_header( unsigned char* header,
+                         unsigned char fin,
+                         unsigned char opcode,
+                         size_t size );
+
 /**
  * @brief Serializes a vws_frame into a buffer that can be sent over the
  *        network.
@@ -125,12 +170,99 @@ vws_buffer* vws_serialize(vws_frame* f);
  * @param consumed Pointer to the number of bytes consumed during
  *        deserialization.
  * @return The status of the deserialization process, 0 if successful, an error
- *         code otherwise.
+ *         code otherwise. FRAME_ERROR if the payload length has its top bit
+ *         set or is larger than VWS_FRAME_MAX.
  *
  * @ingroup FrameFunctions
  */
 fs_t vws_deserialize(ucstr data, size_t size, vws_frame* f, size_t* consumed);
 
+/**
+ * @brief Deserializes raw network data into a vws_frame without copying the
+ *        payload. The payload is unmasked in place and f->data points into
+ *        data, so data must outlive the frame. The frame is marked as
+ *        borrowed and vws_frame_free() will not free the payload.
+ *
+ * @param data The raw network data. Modified in place by unmasking.
+ * @param size The size of the data.
+ * @param f The vws_frame to deserialize into.
+ * @param consumed Pointer to the number of bytes consumed during
+ *        deserialization.
+ * @return The status of the deserialization process. FRAME_ERROR as for
+ *         vws_deserialize().
+ *
+ * @ingroup FrameFunctions
+ */
+fs_t vws_deserialize_borrow( unsigned char* data,
+                             size_t size,
+                             vws_frame* f,
+                             size_t* consumed );
+
+/**
+ * @brief Applies (or removes) a WebSocket masking key to payload data.
+ *
+ * XORs size bytes of src with the 4-byte masking key and writes the result to
+ * dst. The source and destination may be the same buffer (in-place masking)
+ * but must not otherwise overlap. The kernel processes data a machine word or
+ * vector register at a time. The widest implementation supported by the CPU
+ * (AVX2, SSE2, NEON or portable 64-bit scalar) is selected at runtime on first
+ * use.
+ *
+ * @param dst The output buffer.
+ * @param src The input buffer.
+ * @param size The number of bytes to mask.
+ * @param key The 4-byte masking key.
+ * @param pos The payload offset of src[0]. This is used to align the key when
+ *        masking a payload in pieces. Use 0 when masking a whole payload.
+ *
+ * @ingroup FrameFunctions
+ */
+void vws_mask(unsigned char* dst, ucstr src, size_t size, ucstr key, size_t pos);
+
+/**
+ * @brief Generates a masking key for a client frame.
+ *
+ * RFC 6455 needs masking keys that intermediaries cannot predict, not secret
+ * ones. Rather than calling RAND_bytes() for every frame, keys are cut from a
+ * per-thread ChaCha20 keystream seeded from RAND_bytes(), a few hundred bytes
+ * at a time. The stream is reseeded every few million keys.
+ *
+ * @param key Receives the 4-byte key.
+ * @return True on success, false if seeding failed (vws.e has the details).
+ *
+ * @ingroup FrameFunctions
+ */
+bool vws_mask_key(unsigned char* key);
+
+/** UTF-8 validation state between complete characters */
+#define VWS_UTF8_ACCEPT 0
+
+/** UTF-8 validation state once invalid data has been seen */
+#define VWS_UTF8_REJECT 0xFFFFFFFF
+
+/**
+ * @brief Validates UTF-8 incrementally.
+ *
+ * Text can be validated in pieces that split characters anywhere, such as the
+ * fragments of a TEXT message. Start with VWS_UTF8_ACCEPT and pass each call
+ * the state returned by the last. The text is valid if the final state is
+ * VWS_UTF8_ACCEPT. Anything else other than VWS_UTF8_REJECT means it ends in
+ * the middle of a character.
+ *
+ * Overlong forms, surrogates and code points above U+10FFFF are rejected, as
+ * RFC 3629 requires. Complete characters are checked 32 bytes at a time with
+ * AVX2 if the CPU supports it, otherwise 8 bytes at a time for ASCII and one
+ * byte at a time for the rest. Selected at runtime on first use.
+ *
+ * @param state The state returned for the previous piece.
+ * @param data The next piece.
+ * @param size The number of bytes.
+ * @return The new state.
+ *
+ * @ingroup FrameFunctions
+ */
+uint32_t vws_utf8_validate(uint32_t state, ucstr data, size_t size);
+
 /**
  * @brief Generates a close frame for a WebSocket connection.
  *
@@ -175,6 +307,10 @@ typedef struct vws_msg
 
     /**< The payload data for the message. */
     vws_buffer* data;
+
+    /**< The data is a read-only mapping of a temporary file rather than
+     * memory (see vws_cnx.spill). It is unmapped by vws_msg_free(). */
+    bool mapped;
 } vws_msg;
 
 /**
@@ -204,6 +340,23 @@ struct vws_cnx;
  */
 typedef void (*vws_process_frame)(struct vws_cnx* cnx, vws_frame* frame);
 
+/**
+ * @brief Callback for streamed message data. See vws_cnx_set_stream().
+ * @param cnx The connection instance
+ * @param opcode The message opcode (TEXT_FRAME or BINARY_FRAME), taken from
+ *   its first frame
+ * @param data The fragment payload, unmasked. Only valid during the call.
+ * @param size The payload size. This may be 0.
+ * @param begin True for the first fragment of a message
+ * @param end True for the last fragment of a message
+ */
+typedef void (*vws_cnx_stream)( struct vws_cnx* cnx,
+                                unsigned char opcode,
+                                ucstr data,
+                                size_t size,
+                                bool begin,
+                                bool end );
+
 typedef struct vws_url_data
 {
   char* href;
@@ -234,6 +387,29 @@ typedef struct vws_url_data
  */
 typedef void (*vws_cnx_disconnect)(struct vws_cnx* cnx);
 
+/**
+ * @brief Callback for messages the async send queue has finished writing. See
+ * vws_cnx_set_async().
+ * @param cnx The connection instance
+ * @param count The number of messages completed since the last call
+ */
+typedef void (*vws_cnx_sent)(struct vws_cnx* cnx, uint64_t count);
+
+/**
+ * @brief Initializes a queue the first time something is added to it. Queues
+ * are left zeroed until then, which sc_queue treats as empty, so that idle
+ * connections hold no queue storage.
+ * @param q The queue
+ */
+#define vws_queue_lazy(q)                                                     \
+    do                                                                        \
+    {                                                                         \
+        if ((q)->elems == NULL)                                               \
+        {                                                                     \
+            sc_queue_init(q);                                                 \
+        }                                                                     \
+    } while (0)
+
 /**
  * @brief A WebSocket connection.
  */
@@ -248,12 +424,35 @@ typedef struct vws_cnx
     /**< The URL of the websocket server. */
     vws_url_data* url;
 
-    /**< The websocket key. */
+    /**< Unix domain socket to connect to instead of the URL's host and port
+     * (vws_connect_unix()). NULL for TCP. */
+    char* path;
+
+    /**< The websocket key. Generated for each handshake. NULL before the
+     * first connect, and always on the server side. */
     char* key;
 
-    /**< Queue for incoming frames. */
+    /**< Queue for incoming frames. Allocated on first use. */
     struct sc_queue_ptr queue;
 
+    /**< Payload size of each complete message in queue, oldest last. Its
+     * length is the number of messages ready to pop. */
+    struct sc_queue_64 messages;
+
+    /**< Payload bytes queued so far for the message still being received. */
+    size_t partial;
+
+    /**< Opcode of the message still being received, from its first frame. */
+    unsigned char partial_opcode;
+
+    /**< RSV1 bit of the first frame of the message still being received. */
+    unsigned char partial_rsv1;
+
+    /**< Number of bytes at the front of the receive buffer already parsed into
+     * frames. Only used in zero-copy mode, where these bytes are held until
+     * the borrowed frames referencing them have been consumed. */
+    size_t parsed;
+
     /**< Frame processing callback. */
     vws_process_frame process;
 
@@ -263,8 +462,89 @@ typedef struct vws_cnx
     /**< User-defined data associated with the connection */
     char* data;
 
+    /**< permessage-deflate state. NULL unless enabled with
+     * vws_cnx_set_deflate(). */
+    struct vws_deflate* deflate;
+
+    /**< Streaming receive callback. NULL unless set with
+     * vws_cnx_set_stream(). */
+    vws_cnx_stream stream;
+
+    /**< Opcode of the message being streamed, 0 between messages. */
+    unsigned char stream_opcode;
+
+    /**< Compressed payload of the message being streamed. Compressed messages
+     * are collected here and delivered whole. NULL otherwise. */
+    vws_buffer* stream_buffer;
+
+    /**< UTF-8 validation state of the TEXT message being streamed (see
+     * vws_utf8_validate()). */
+    uint32_t stream_utf8;
+
+    /**< Largest frame payload vws_msg_send_data() sends (default 0, no
+     * limit). Larger messages are sent as continuation frames. */
+    size_t max_frame;
+
+    /**< Largest message received, in bytes (default VWS_MESSAGE_MAX, 0 for no
+     * limit). It applies to messages vws_msg_pop() reassembles and to the
+     * inflated size of compressed ones. A larger message is dropped and fails
+     * the connection with 1009 (Message Too Big). */
+    size_t max_message;
+
+    /**< Size above which a message is reassembled in a temporary file
+     * ($TMPDIR, or /tmp) instead of memory, and vws_msg_pop() returns a
+     * mapped view of it (vws_msg.mapped). Once a message being received
+     * passes it, each frame is written out as it arrives, so only a frame at
+     * a time is held in memory. Default 0, never. Compressed messages are
+     * always reassembled in memory. */
+    size_t spill;
+
+    /**< Temporary file the message being received is written to, once it
+     * has passed spill. -1 otherwise. */
+    int spill_fd;
+
+    /**< The message being written to spill_fd is dropped, because it could
+     * not be written or is larger than max_message. The rest of its frames
+     * are discarded as they arrive. */
+    bool spill_drop;
+
+    /**< Frames waiting to be sent while corked (vws_cnx_cork()). NULL when
+     * not corked. */
+    vws_buffer* out;
+
+    /**< Size at which corked frames are sent without waiting for
+     * vws_cnx_flush(). */
+    size_t cork;
+
+    /**< Sends are queued in out and written without blocking. See
+     * vws_cnx_set_async(). */
+    bool async;
+
+    /**< Callback for completed async sends. Optional. */
+    vws_cnx_sent on_sent;
+
+    /**< Number of messages queued with async sends so far. */
+    uint64_t sends;
+
+    /**< Number of async messages fully written so far. sends - sent are
+     * still in out. */
+    uint64_t sent;
+
+    /**< Total bytes written from out since connecting. */
+    uint64_t out_written;
+
+    /**< Where each message still in out ends, counted like out_written.
+     * Allocated on first use. */
+    struct sc_queue_64 out_ends;
+
 } vws_cnx;
 
+/** Size of a WebSocket accept key: base64 of a SHA-1 digest plus NUL. */
+#define VWS_ACCEPT_KEY_SIZE 29
+
+/** Default size at which corked frames are sent (see vws_cnx_cork()). */
+#define VWS_CORK_SIZE 65536
+
 /**
  * @brief Generates a WebSocket accept key from input.
  *
@@ -276,6 +556,20 @@ typedef struct vws_cnx
  */
 cstr vws_accept_key(cstr key);
 
+/**
+ * @brief Generates a WebSocket accept key into a caller-supplied buffer,
+ * without allocating.
+ *
+ * @param key The input key
+ * @param out Receives the NUL-terminated accept key. Must hold at least
+ *   VWS_ACCEPT_KEY_SIZE bytes.
+ * @return Returns true on success, false if the key is missing or longer
+ *   than any valid client key.
+ *
+ * @ingroup ConnectionFunctions
+ */
+bool vws_accept_key_into(cstr key, char* out);
+
 /**
  * @brief Connects to a specified host URL.
  *
@@ -287,6 +581,39 @@ cstr vws_accept_key(cstr key);
  */
 bool vws_connect(vws_cnx* c, cstr uri);
 
+/**
+ * @brief Connects to a server listening on a Unix domain socket. The
+ * WebSocket handshake and framing are unchanged: the URL still supplies the
+ * Host header and the resource to request, but no DNS lookup or TCP connect
+ * is made. vws_reconnect() reconnects to the same socket.
+ *
+ * @param c The websocket connection.
+ * @param path The socket path. A leading '@' names a socket in the Linux
+ *   abstract namespace.
+ * @param uri The URL to request, such as "ws://localhost/chat". Must use the
+ *   ws scheme, as there is no TLS over a local socket.
+ * @return Returns true if the connection is successful, false otherwise.
+ *
+ * @ingroup ConnectionFunctions
+ */
+bool vws_connect_unix(vws_cnx* c, cstr path, cstr uri);
+
+/**
+ * @brief Connects over a TCP socket that is already connected to the URL's
+ * host, such as one from vws_dial_take(). This lets an event loop dial many
+ * connections at once and only do the handshakes here. vws_reconnect()
+ * dials again as vws_connect() does.
+ *
+ * @param c The websocket connection.
+ * @param fd The connected descriptor. The connection takes ownership of it,
+ *   and it is closed on failure.
+ * @param uri The URL of the host it is connected to.
+ * @return Returns true if the connection is successful, false otherwise.
+ *
+ * @ingroup ConnectionFunctions
+ */
+bool vws_connect_fd(vws_cnx* c, int fd, cstr uri);
+
 /**
  * @brief Attempts to reconnects based on previous URL. If no previous
  * connection was made, this function does nothing and returns false.
@@ -346,6 +673,201 @@ bool vws_cnx_is_connected(vws_cnx* c);
  */
 void vws_cnx_set_server_mode(vws_cnx* c);
 
+/**
+ * @brief Puts the connection in zero-copy receive mode. Incoming frames borrow
+ *        their payload from the socket receive buffer instead of copying it,
+ *        and the buffer is only compacted once the frames referencing it have
+ *        been consumed by vws_msg_pop() or vws_frame_recv(). Frames handed to
+ *        a custom process callback are only valid for the duration of the
+ *        call unless queued on c->queue.
+ *
+ * @param c The websocket connection.
+ * @return Returns void.
+ *
+ * @ingroup ConnectionFunctions
+ */
+void vws_cnx_set_zero_copy(vws_cnx* c);
+
+/**
+ * @brief Puts the connection in streaming receive mode. Data frames are no
+ *        longer queued and reassembled into messages for vws_msg_pop().
+ *        Instead each fragment is handed to the callback as it is parsed in
+ *        vws_cnx_ingress(), marked with where it falls in its message. Memory
+ *        use is then bounded by the frame size rather than the message size.
+ *        Control frames are handled as usual. Messages compressed with
+ *        permessage-deflate are the exception: they are collected, inflated
+ *        and delivered in a single call. TEXT fragments are validated as
+ *        UTF-8 before they are handed over. If one is invalid, or the final
+ *        fragment ends mid-character, the rest of the message is dropped
+ *        without an end call and the connection is failed as for
+ *        vws_msg_pop().
+ *
+ * @param c The websocket connection.
+ * @param cb The callback, or NULL to go back to queueing messages.
+ * @return Returns void.
+ *
+ * @ingroup ConnectionFunctions
+ */
+void vws_cnx_set_stream(vws_cnx* c, vws_cnx_stream cb);
+
+/**
+ * @brief Enables the permessage-deflate extension (RFC 7692). A client offers
+ *        it in the handshake, a server accepts it when the client offers it
+ *        (see vws_cnx_accept_deflate()). Once negotiated, data messages sent
+ *        in a single frame are compressed and received messages with RSV1 set
+ *        are decompressed.
+ *
+ * @param c The websocket connection.
+ * @param window_bits The LZ77 window size (9-15) used to compress outgoing
+ *        messages. The peer may ask for a smaller one.
+ * @param no_context_takeover If true, the compressor is reset after every
+ *        message. This saves memory between messages at some cost in ratio.
+ * @return Returns void.
+ *
+ * @ingroup ConnectionFunctions
+ */
+void vws_cnx_set_deflate(vws_cnx* c, int window_bits, bool no_context_takeover);
+
+/**
+ * @brief Corks the connection. Frames sent from then on are serialized into an
+ *        output buffer instead of being written one by one, and go out in a
+ *        single write (one send() or SSL_write()) when vws_cnx_flush() is
+ *        called, when the buffer reaches the threshold, or before the
+ *        connection waits to receive. Sending many small messages then costs
+ *        one system call instead of one each. While corked, the send
+ *        functions return the number of bytes queued. Turns TCP_NODELAY on, as
+ *        the connection now does its own coalescing and Nagle's algorithm
+ *        would only hold back the tail of each flush.
+ *
+ * @param c The websocket connection.
+ * @param threshold The output buffer size at which it is flushed. 0 for
+ *        VWS_CORK_SIZE.
+ * @return Returns void.
+ *
+ * @ingroup ConnectionFunctions
+ */
+void vws_cnx_cork(vws_cnx* c, size_t threshold);
+
+/**
+ * @brief Flushes the frames a corked connection has queued. Does nothing if
+ *        the connection is not corked or nothing is queued.
+ *
+ * @param c The websocket connection.
+ * @return The number of bytes written, or -1 on error (the queued frames are
+ *         dropped). In the case of error, check vws.e for details.
+ *
+ * @ingroup ConnectionFunctions
+ */
+ssize_t vws_cnx_flush(vws_cnx* c);
+
+/**
+ * @brief Flushes a corked connection and goes back to writing each frame as
+ *        it is sent (or to async sends, see vws_cnx_set_async()). TCP_NODELAY
+ *        is left on.
+ *
+ * @param c The websocket connection.
+ * @return As vws_cnx_flush().
+ *
+ * @ingroup ConnectionFunctions
+ */
+ssize_t vws_cnx_uncork(vws_cnx* c);
+
+/**
+ * @brief Puts the connection in async send mode. The send functions no longer
+ *        block until a message is written. They serialize it into the output
+ *        buffer and write whatever the socket takes right away, leaving the
+ *        rest for later. The rest goes out with each later send, when
+ *        vws_cnx_send_ready() is called (for example once an event loop finds
+ *        the socket writable), and in full by vws_cnx_flush() or before the
+ *        connection waits to receive. Completed messages are counted in
+ *        c->sent and reported through the callback. If the connection is also
+ *        corked, writing is deferred until the output reaches the cork
+ *        threshold. A message counts as one completion per frame with FIN
+ *        set, so control frames count too.
+ *
+ * @param c The websocket connection.
+ * @param cb Called with the number of messages completed, or NULL to rely on
+ *        c->sent.
+ * @return Returns void.
+ *
+ * @ingroup ConnectionFunctions
+ */
+void vws_cnx_set_async(vws_cnx* c, vws_cnx_sent cb);
+
+/**
+ * @brief Writes as much of the output queue as the socket takes without
+ *        waiting.
+ *
+ * @param c The websocket connection.
+ * @return The number of bytes written (0 if the socket would block or nothing
+ *         is queued), or -1 on error (the queued frames are dropped).
+ *
+ * @ingroup ConnectionFunctions
+ */
+ssize_t vws_cnx_send_ready(vws_cnx* c);
+
+/**
+ * @brief Returns the number of bytes waiting in the output queue.
+ *
+ * @param c The websocket connection.
+ * @return The number of bytes.
+ *
+ * @ingroup ConnectionFunctions
+ */
+size_t vws_cnx_pending(vws_cnx* c);
+
+/**
+ * @brief Server side negotiation of permessage-deflate. Takes the value of the
+ *        client's Sec-WebSocket-Extensions header and, if it offers
+ *        permessage-deflate and vws_cnx_set_deflate() was called on c,
+ *        enables compression on the connection.
+ *
+ * @param c The websocket connection.
+ * @param offer The Sec-WebSocket-Extensions header from the client.
+ * @return The Sec-WebSocket-Extensions value to respond with, on the heap, or
+ *         NULL if the extension is not used. Caller must free it with
+ *         vws.free().
+ *
+ * @ingroup ConnectionFunctions
+ */
+cstr vws_cnx_accept_deflate(vws_cnx* c, cstr offer);
+
+/**
+ * @brief Checks whether permessage-deflate has been negotiated.
+ *
+ * @param c The websocket connection.
+ * @return Returns true if messages are compressed on this connection.
+ *
+ * @ingroup ConnectionFunctions
+ */
+bool vws_cnx_is_deflate(vws_cnx* c);
+
+/**
+ * @brief Compresses a message payload in place for sending. Does nothing
+ *        unless permessage-deflate has been negotiated.
+ *
+ * @param c The websocket connection.
+ * @param buffer The message payload.
+ * @return Returns true if the payload was compressed, in which case the frame
+ *         must be sent with RSV1 set.
+ *
+ * @ingroup ConnectionFunctions
+ */
+bool vws_cnx_deflate(vws_cnx* c, vws_buffer* buffer);
+
+/**
+ * @brief Decompresses a received message payload in place.
+ *
+ * @param c The websocket connection.
+ * @param buffer The message payload.
+ * @return Returns true on success, false if the data is corrupt or
+ *         permessage-deflate is not in use. Also false if it inflates to more
+ *         than c->max_message, which fails the connection with 1009.
+ *
+ * @ingroup ConnectionFunctions
+ */
+bool vws_cnx_inflate(vws_cnx* c, vws_buffer* buffer);
+
 /**
  * @brief Processes incoming data from a Socket.
  *
@@ -412,6 +934,45 @@ ssize_t vws_frame_send_data(vws_cnx* c, ucstr data, size_t size, int oc);
  */
 ssize_t vws_frame_send(vws_cnx* c, vws_frame* frame);
 
+/**
+ * @brief Sends an already serialized websocket frame, as produced by
+ * vws_serialize(). No compression is applied.
+ *
+ * @param c The connection.
+ * @param binary The frame bytes. This function will take ownership of the
+ *   buffer and deallocate it for the caller.
+ * @return Returns the number of bytes sent or -1 on error. In the case of
+ *         error, check vws.e for details, especially for VE_SOCKET.
+ */
+ssize_t vws_frame_write(vws_cnx* c, vws_buffer* binary);
+
+/**
+ * @brief Sends one fragment of a message being relayed from another
+ * connection, as it arrives. Its arguments are those of a vws_cnx_stream or
+ * vws_svr_stream callback, so a proxy can pass each fragment straight on
+ * without reassembling the message. The payload is masked as it is copied
+ * into the frame, in a single pass, with no vws_frame in between. It is not
+ * compressed.
+ *
+ * Fragments of one message must be relayed in order, and nothing else sent on
+ * the connection until its last fragment has gone.
+ *
+ * @param c The connection.
+ * @param opcode The message opcode. Only used on the first fragment.
+ * @param data The fragment payload.
+ * @param size The payload size. This may be 0.
+ * @param begin True for the first fragment of a message.
+ * @param end True for the last fragment of a message.
+ * @return Returns the number of bytes sent or -1 on error. In the case of
+ *         error, check vws.e for details, especially for VE_SOCKET.
+ */
+ssize_t vws_frame_relay( vws_cnx* c,
+                         unsigned char opcode,
+                         ucstr data,
+                         size_t size,
+                         bool begin,
+                         bool end );
+
 /**
  * @brief Sends a TEXT message
  *
@@ -434,7 +995,9 @@ ssize_t vws_msg_send_text(vws_cnx* c, cstr string);
 ssize_t vws_msg_send_binary(vws_cnx* c, ucstr string, size_t size);
 
 /**
- * @brief Sends custom message containing
+ * @brief Sends custom message containing data. If the connection has a
+ * max_frame and the data is larger, it is sent as a series of fragments, each
+ * no larger than max_frame. Fragmented messages are not compressed.
  *
  * @param c The connection.
  * @param dataThe data to send.
@@ -445,6 +1008,22 @@ ssize_t vws_msg_send_binary(vws_cnx* c, ucstr string, size_t size);
  */
 ssize_t vws_msg_send_data(vws_cnx* c, ucstr data, size_t size, int oc);
 
+/**
+ * @brief Sends part of a file as a binary message. The file is mapped rather
+ * than read, and masked a chunk at a time straight from the mapping as it is
+ * written, so the payload is never held in memory whole. It is fragmented past
+ * max_frame and not compressed. It is written before returning, after
+ * anything corked or queued for async sends.
+ *
+ * @param c The connection.
+ * @param fd The file. The caller keeps it.
+ * @param offset Where the payload starts in the file.
+ * @param size The payload size. If 0, the rest of the file.
+ * @return Returns the number of bytes sent or -1 on error. In the case of
+ *         error, check vws.e for details, especially for VE_SOCKET.
+ */
+ssize_t vws_msg_send_file(vws_cnx* c, int fd, uint64_t offset, size_t size);
+
 /**
  * @brief Receives a websocket message from the connection. If there are no
  *        messages in queue, it will call socket_wait_for_frame().
@@ -460,9 +1039,21 @@ vws_msg* vws_msg_recv(vws_cnx* c);
  * @brief Removes and returns the first complete message from the connection's
  *         message queue.
  *
+ * TEXT messages are validated as UTF-8, fragment by fragment as they are
+ * assembled (after inflating, if compressed). An invalid message is dropped
+ * and the connection is failed: it is marked closing and, unless in server
+ * mode, a CLOSE frame with code 1007 is sent.
+ *
+ * A message larger than vws_cnx.spill is written frame by frame to a
+ * temporary file, and the message data is a read-only mapping of that file.
+ * The file has no name and is gone once the message is freed. If the file
+ * cannot be written, the message is dropped. A message that passes spill
+ * before its final frame is written out as its frames arrive, and its frames
+ * are not seen by vws_frame_recv().
+ *
  * @param c The vws_cnx representing the WebSocket connection.
  * @return A pointer to the popped vws_msg object, or NULL if the queue is
- * empty.
+ * empty or the message was dropped (vws.e has the details).
  *
  * @ingroup MessageFunctions
  */